@@ -98,6 +98,10 @@ int main(int argc, char** argv) {
     // NanoLog::setLogFile("/tmp/logFile");
     NanoLog::setLogFile(BENCHMARK_OUTPUT_FILE);
 
+#ifdef BENCHMARK_BLOCK_COMPRESSION
+    NanoLog::setBlockCompression(NanoLog::BLOCK_COMPRESSION_LZ4);
+#endif
+
     printf("BENCH_OP = %s\r\n", BENCH_OPS_AS_A_STR);
 
 #ifdef PREPROCESSOR_NANOLOG
@@ -139,14 +143,20 @@ int main(int argc, char** argv) {
     printf("Flushing the log statements to disk took an additional %0.2lf secs\r\n",
             time);
 
-    uint64_t totalEvents = NanoLogInternal::RuntimeLogger::nanoLogSingleton.logsProcessed;
+    // Sum the metrics over all of the compression threads
+    uint64_t totalEvents = 0;
+    uint64_t cyclesCompressing = 0;
+    for (auto *shard : NanoLogInternal::RuntimeLogger::nanoLogSingleton.shards) {
+        totalEvents += shard->logsProcessed;
+        cyclesCompressing += shard->cyclesCompressing;
+    }
+
     double totalTime = PerfUtils::Cycles::toSeconds(stop - start);
     double recordTimeEstimated = PerfUtils::Cycles::toSeconds(stop - start
                                     - NanoLogInternal::RuntimeLogger::stagingBuffer->cyclesProducerBlocked);
     double recordNsEstimated = recordTimeEstimated*1.0e9
                                 / NanoLogInternal::RuntimeLogger::stagingBuffer->numAllocations;
-    double compressionTime = PerfUtils::Cycles::toSeconds(
-                    NanoLogInternal::RuntimeLogger::nanoLogSingleton.cyclesCompressing);
+    double compressionTime = PerfUtils::Cycles::toSeconds(cyclesCompressing);
     printf("Took %0.2lf seconds to log %lu operations\r\nThroughput: %0.2lf op/s (%0.2lf Mop/s)\r\n",
                 totalTime, totalEvents,
                 totalEvents/totalTime,
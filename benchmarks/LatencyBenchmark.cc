@@ -0,0 +1,506 @@
+/* Copyright (c) 2016-2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * This file implements a benchmark that measures the latency of individual
+ * NANO_LOG() invocations for the log messages of the NanoLog paper, over a
+ * sweep of producer thread counts and StagingBuffer sizes. Every invocation
+ * is timed with rdtsc and recorded in a log-linear histogram, and each
+ * configuration is reported as one line of JSON so that the percentiles can
+ * be compared across releases (see run_latency.sh and compareLatency.py).
+ *
+ * Like Benchmark.cc, it breaks abstractions to retrieve hidden metrics and
+ * is NOT meant to be used as example code.
+ */
+
+#define EXPOSE_PRIVATES
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <pthread.h>
+
+// For benchmarking
+#include "BenchmarkConfig.h"
+
+#include "Cycles.h"
+
+#ifdef PREPROCESSOR_NANOLOG
+#include "NanoLog.h"
+#else
+#include "NanoLogCpp17.h"
+#endif
+
+using namespace NanoLog::LogLevels;
+
+/**
+ * Log messages used in the benchmark; these are the messages of the "Log
+ * Messages Map" in the top-level README.
+ */
+enum BenchOp {
+    STATIC_STRING,
+    STRING_CONCAT,
+    SINGLE_INTEGER,
+    TWO_INTEGERS,
+    SINGLE_DOUBLE,
+    COMPLEX_FORMAT,
+    NUM_BENCH_OPS
+};
+
+static const char *benchOpNames[NUM_BENCH_OPS] = {
+    "staticString",
+    "stringConcat",
+    "singleInteger",
+    "twoIntegers",
+    "singleDouble",
+    "complexFormat",
+};
+
+/**
+ * Histogram of latencies (in cycles) that keeps every value within ~1.5% of
+ * its true value regardless of its magnitude, in the fashion of an HDR
+ * histogram. Values below 2*SUB_BUCKETS are counted exactly and larger
+ * values are counted in SUB_BUCKETS linear buckets per power of 2.
+ */
+class LatencyHistogram {
+  public:
+    LatencyHistogram()
+        : counts(NUM_BUCKETS, 0)
+        , count(0)
+        , sum(0)
+        , max(0)
+    {}
+
+    inline void
+    record(uint64_t value)
+    {
+        ++counts[bucketOf(value)];
+        ++count;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    void
+    merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < NUM_BUCKETS; ++i)
+            counts[i] += other.counts[i];
+
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    /**
+     * Returns the value below which a percentage of the recorded values
+     * fall, as the midpoint of the bucket that holds it.
+     *
+     * \param percentile
+     *      Percentage of the recorded values in (0, 100]
+     */
+    uint64_t
+    percentile(double percentile) const
+    {
+        uint64_t target = static_cast<uint64_t>(percentile/100.0*count);
+        target = std::max<uint64_t>(1, std::min(target, count));
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target)
+                return std::min(max, midpointOf(i));
+        }
+
+        return max;
+    }
+
+    uint64_t getCount() const { return count; }
+    uint64_t getMax() const { return max; }
+    double getMean() const { return count ? double(sum)/count : 0; }
+
+  private:
+    static const int SUB_BUCKET_BITS = 6;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1)*SUB_BUCKETS;
+
+    static inline size_t
+    bucketOf(uint64_t value)
+    {
+        if (value < 2*SUB_BUCKETS)
+            return value;
+
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return shift*SUB_BUCKETS + (value >> shift);
+    }
+
+    static uint64_t
+    midpointOf(size_t bucket)
+    {
+        if (bucket < 2*SUB_BUCKETS)
+            return bucket;
+
+        int shift = static_cast<int>(bucket/SUB_BUCKETS) - 1;
+        uint64_t low = (bucket - shift*SUB_BUCKETS) << shift;
+        return low + ((uint64_t(1) << shift) >> 1);
+    }
+
+    // Number of values recorded in each bucket
+    std::vector<uint64_t> counts;
+
+    // Number, sum and maximum of the values recorded
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/**
+ * Results of one producer thread in one configuration.
+ */
+struct ThreadResult {
+    ThreadResult()
+        : latencies()
+        , producerBlocks(0)
+        , cyclesProducerBlocked(0)
+    {}
+
+    LatencyHistogram latencies;
+
+    // Times the thread blocked on a full StagingBuffer and for how long
+    uint64_t producerBlocks;
+    uint64_t cyclesProducerBlocked;
+};
+
+/**
+ * Invokes a benchmarked log message. Each message is its own NANO_LOG()
+ * so that the preprocessor generates code specific to it.
+ */
+static inline void __attribute__((always_inline))
+logOp(BenchOp op)
+{
+    switch (op) {
+    case STATIC_STRING:
+        NANO_LOG(NOTICE, "Starting backup replica garbage collector thread");
+        break;
+    case STRING_CONCAT:
+        NANO_LOG(NOTICE, "Opened session with coordinator at %s",
+                 "basic+udp:host=192.168.1.140,port=12246");
+        break;
+    case SINGLE_INTEGER:
+        NANO_LOG(NOTICE, "Backup storage speeds (min): %d MB/s read", 181);
+        break;
+    case TWO_INTEGERS:
+        NANO_LOG(NOTICE, "buffer has consumed %lu bytes of extra storage, "
+                 "current allocation: %lu bytes", 1032024lu, 1016544lu);
+        break;
+    case SINGLE_DOUBLE:
+        NANO_LOG(NOTICE, "Using tombstone ratio balancer with ratio = %0.6lf",
+                 0.400000);
+        break;
+    case COMPLEX_FORMAT:
+        NANO_LOG(NOTICE, "Initialized InfUdDriver buffers: %lu receive "
+                 "buffers (%u MB), %u transmit buffers (%u MB), took "
+                 "%0.1lf ms", 50000lu, 97u, 50u, 0u, 26.2);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Body of each producer thread: logs a message a number of times after a
+ * warmup, recording the latency of every invocation.
+ */
+static void
+runProducer(BenchOp op, uint64_t warmup, uint64_t iterations,
+            pthread_barrier_t *barrier, ThreadResult *result)
+{
+    NanoLog::preallocate();
+    pthread_barrier_wait(barrier);
+
+    for (uint64_t i = 0; i < warmup; ++i)
+        logOp(op);
+
+    // Only count the blocking of the measured invocations
+    auto *stagingBuffer = NanoLogInternal::RuntimeLogger::stagingBuffer;
+    uint64_t blocksBefore = stagingBuffer->numTimesProducerBlocked;
+    uint64_t cyclesBlockedBefore = stagingBuffer->cyclesProducerBlocked;
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        logOp(op);
+        uint64_t stop = PerfUtils::Cycles::rdtsc();
+        result->latencies.record(stop - start);
+    }
+
+    result->producerBlocks = stagingBuffer->numTimesProducerBlocked
+                                - blocksBefore;
+    result->cyclesProducerBlocked = stagingBuffer->cyclesProducerBlocked
+                                - cyclesBlockedBefore;
+}
+
+/**
+ * Returns the latency of a back-to-back pair of rdtsc's, which is included
+ * in every latency recorded by runProducer(), as the median of many pairs.
+ */
+static uint64_t
+measureTimerOverhead()
+{
+    LatencyHistogram overhead;
+    for (int i = 0; i < 100000; ++i) {
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        uint64_t stop = PerfUtils::Cycles::rdtsc();
+        overhead.record(stop - start);
+    }
+
+    return overhead.percentile(50);
+}
+
+static double
+toNs(uint64_t cycles)
+{
+    return 1.0e9*PerfUtils::Cycles::toSeconds(cycles);
+}
+
+/**
+ * Parses a comma separated list of numbers.
+ */
+static std::vector<uint64_t>
+parseList(const char *list)
+{
+    std::vector<uint64_t> values;
+    std::string str(list);
+    size_t pos = 0;
+    while (pos <= str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+
+        if (end > pos)
+            values.push_back(strtoull(str.substr(pos, end - pos).c_str(),
+                                      NULL, 10));
+        pos = end + 1;
+    }
+
+    return values;
+}
+
+/**
+ * Prints the usage information to stdout.
+ *
+ * \param exe
+ *      Name of the executable
+ */
+static void
+printHelp(const char *exe)
+{
+    printf("Measures the latency of each NANO_LOG() invocation for the log\r\n"
+           "messages of the NanoLog paper and prints one JSON object per\r\n"
+           "configuration (per line) with its latency percentiles.\r\n\r\n");
+    printf("Usage:\r\n\t%s [options]\r\n\r\n", exe);
+    printf("Options:\r\n"
+           "\t--ops <op,...>           Messages to log (default all of\r\n"
+           "\t                         staticString,stringConcat,\r\n"
+           "\t                         singleInteger,twoIntegers,\r\n"
+           "\t                         singleDouble,complexFormat)\r\n"
+           "\t--threads <n,...>        Producer thread counts (default 1,2,4)\r\n"
+           "\t--stagingBufferExp <e,...>\r\n"
+           "\t                         StagingBuffer sizes as 2^e bytes\r\n"
+           "\t                         (default: the configured size)\r\n"
+           "\t--iterations <n>         Measured invocations per thread\r\n"
+           "\t                         (default 1000000)\r\n"
+           "\t--warmup <n>             Unmeasured invocations per thread\r\n"
+           "\t                         before them (default 10000)\r\n"
+           "\t--output <file>          Append the JSON to a file instead\r\n"
+           "\t                         of stdout\r\n");
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> ops;
+    std::vector<uint64_t> threadCounts = {1, 2, 4};
+    std::vector<uint64_t> stagingBufferExps;
+    uint64_t iterations = 1000000;
+    uint64_t warmup = 10000;
+    const char *outputFile = NULL;
+
+    static struct option options[] = {
+        {"ops", required_argument, NULL, 'o'},
+        {"threads", required_argument, NULL, 't'},
+        {"stagingBufferExp", required_argument, NULL, 's'},
+        {"iterations", required_argument, NULL, 'i'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"output", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'o': {
+            std::string list(optarg);
+            size_t pos = 0;
+            while (pos <= list.size()) {
+                size_t end = std::min(list.find(',', pos), list.size());
+                std::string name = list.substr(pos, end - pos);
+                int op = 0;
+                while (op < NUM_BENCH_OPS && name != benchOpNames[op])
+                    ++op;
+
+                if (op == NUM_BENCH_OPS) {
+                    printf("Unknown benchmark op: %s\r\n\r\n", name.c_str());
+                    printHelp(argv[0]);
+                    exit(1);
+                }
+
+                ops.push_back(op);
+                pos = end + 1;
+            }
+            break;
+        }
+        case 't':
+            threadCounts = parseList(optarg);
+            break;
+        case 's':
+            stagingBufferExps = parseList(optarg);
+            break;
+        case 'i':
+            iterations = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            outputFile = optarg;
+            break;
+        default:
+            printHelp(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (ops.empty()) {
+        for (int op = 0; op < NUM_BENCH_OPS; ++op)
+            ops.push_back(op);
+    }
+
+    if (stagingBufferExps.empty())
+        stagingBufferExps.push_back(__builtin_ctz(
+                                    NanoLogConfig::STAGING_BUFFER_SIZE));
+
+    if (threadCounts.empty() || iterations == 0 ||
+            std::find(threadCounts.begin(), threadCounts.end(), 0)
+                                                    != threadCounts.end()) {
+        printHelp(argv[0]);
+        exit(1);
+    }
+
+    FILE *out = stdout;
+    if (outputFile) {
+        out = fopen(outputFile, "a");
+        if (out == NULL) {
+            perror("Unable to open the output file");
+            exit(1);
+        }
+    }
+
+    NanoLog::setLogFile(BENCHMARK_OUTPUT_FILE);
+
+#ifdef PREPROCESSOR_NANOLOG
+    const char *system = "PreProc";
+#else
+    const char *system = "C++17";
+#endif
+
+    double timerOverheadNs = toNs(measureTimerOverhead());
+    const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    const char *percentileNames[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+
+    for (uint64_t stagingBufferExp : stagingBufferExps) {
+        uint64_t stagingBufferSize = uint64_t(1) << std::min<uint64_t>(
+                                                    stagingBufferExp, 63);
+        if (stagingBufferSize < NanoLogConfig::MIN_STAGING_BUFFER_SIZE ||
+                stagingBufferSize > NanoLogConfig::MAX_STAGING_BUFFER_SIZE) {
+            fprintf(stderr, "Skipping the unsupported StagingBuffer size of "
+                    "2^%lu bytes\r\n", stagingBufferExp);
+            continue;
+        }
+
+        // Only applies to the new threads started for each configuration
+        NanoLog::setStagingBufferSize(
+                                static_cast<uint32_t>(stagingBufferSize));
+
+        for (uint64_t threads : threadCounts) {
+            for (int op : ops) {
+                pthread_barrier_t barrier;
+                pthread_barrier_init(&barrier, NULL,
+                                     static_cast<unsigned>(threads));
+
+                std::vector<ThreadResult> results(threads);
+                std::vector<std::thread> producers;
+                for (uint64_t i = 0; i < threads; ++i)
+                    producers.emplace_back(runProducer, BenchOp(op), warmup,
+                                           iterations, &barrier,
+                                           &results[i]);
+
+                for (std::thread &producer : producers)
+                    producer.join();
+                pthread_barrier_destroy(&barrier);
+
+                // Have each configuration start with empty StagingBuffers
+                NanoLog::sync();
+
+                LatencyHistogram latencies;
+                uint64_t producerBlocks = 0;
+                uint64_t cyclesProducerBlocked = 0;
+                for (ThreadResult &result : results) {
+                    latencies.merge(result.latencies);
+                    producerBlocks += result.producerBlocks;
+                    cyclesProducerBlocked += result.cyclesProducerBlocked;
+                }
+
+                fprintf(out, "{\"benchOp\": \"%s\", \"system\": \"%s\", "
+                        "\"threads\": %lu, \"stagingBufferSize\": %lu, "
+                        "\"pollIntervalUs\": %u, \"parkTimeoutUs\": %u, "
+                        "\"outputFile\": \"%s\", "
+                        "\"count\": %lu, \"timerOverheadNs\": %0.2lf, "
+                        "\"meanNs\": %0.2lf",
+                        benchOpNames[op], system, threads, stagingBufferSize,
+                        BENCHMARK_POLL_INTERVAL_NO_WORK_US,
+                        BENCHMARK_IDLE_PARK_TIMEOUT_US,
+                        BENCHMARK_OUTPUT_FILE, latencies.getCount(),
+                        timerOverheadNs, toNs(1)*latencies.getMean());
+
+                for (size_t i = 0; i < sizeof(percentiles)/sizeof(double);
+                        ++i)
+                    fprintf(out, ", \"%sNs\": %0.2lf", percentileNames[i],
+                            toNs(latencies.percentile(percentiles[i])));
+
+                fprintf(out, ", \"maxNs\": %0.2lf, \"producerBlocks\": %lu, "
+                        "\"producerBlockedNs\": %0.2lf}\n",
+                        toNs(latencies.getMax()), producerBlocks,
+                        toNs(cyclesProducerBlocked));
+                fflush(out);
+            }
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
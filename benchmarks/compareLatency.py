@@ -0,0 +1,67 @@
+#! /usr/bin/python
+
+"""Compare Latency
+
+Compares the latency percentiles of two latencyBenchmark runs (i.e. of two
+releases) configuration by configuration and flags those that regressed.
+
+Usage:
+    compareLatency.py [-h] [--threshold=PERCENT] BASELINE_JSON NEW_JSON
+
+Options:
+    -h --help               Show this help messages
+    --threshold=PERCENT     Percentage by which a percentile may grow before
+                            it is flagged as a regression [default: 10]
+"""
+
+import json
+import os
+import sys
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                             "..", "preprocessor"))
+from docopt import docopt
+
+# Fields that identify a configuration and the percentiles compared
+CONFIG_KEYS = ["benchOp", "system", "threads", "stagingBufferSize",
+               "pollIntervalUs", "parkTimeoutUs"]
+PERCENTILES = ["p50Ns", "p99Ns", "p99.9Ns"]
+
+def loadResults(filename):
+  results = {}
+  with open(filename) as iFile:
+    for line in iFile:
+      line = line.strip()
+      if line:
+        result = json.loads(line)
+        results[tuple(result.get(key) for key in CONFIG_KEYS)] = result
+
+  return results
+
+def main(arguments):
+  threshold = float(arguments['--threshold'])
+  baseline = loadResults(arguments['BASELINE_JSON'])
+  current = loadResults(arguments['NEW_JSON'])
+
+  print "# %-14s %-8s %8s %12s %8s %10s %10s %8s" % (
+          "BenchOp", "System", "Threads", "StagingBuf", "PollUs",
+          "Percentile", "Baseline", "New")
+
+  regressions = 0
+  for config in sorted(set(baseline.keys()) & set(current.keys())):
+    for percentile in PERCENTILES:
+      old = baseline[config][percentile]
+      new = current[config][percentile]
+      regressed = old > 0 and (new - old)*100.0/old > threshold
+      regressions += regressed
+
+      print "%-16s %-8s %8d %12d %8d %10s %10.2lf %8.2lf%s" % (
+              config + (percentile[:-2], old, new,
+                        "  <== regressed" if regressed else ""))
+
+  print "\r\n%d percentiles regressed by more than %0.1lf%%" % (
+          regressions, threshold)
+  sys.exit(1 if regressions else 0)
+
+if __name__ == "__main__":
+  main(docopt(__doc__))
@@ -95,6 +95,12 @@ do
   printf "\r\n== Python Aggregator output ==\r\n" >> $DEBUG_LOG_FILE
   sync; sudo sh -c 'echo 1 > /proc/sys/vm/drop_caches'
   (/usr/bin/time --format="%e %M %K ${PERCENTAGE} Python Aggregation" python aggregation/aggregateArg1.py /tmp/decomp >> $DEBUG_LOG_FILE) |& tee -a $LOG_FILE
+
+  # The query command aggregates the typed arguments in C++17 NanoLog log files
+  PREPROCESSOR_NANOLOG=no ./run_bench.sh "aggregationWith${UNRELATED_MSGS}UnrelatedMsgsCpp17Setup" > /dev/null
+  printf "\r\n== NanoLog Query output ==\r\n" >> $DEBUG_LOG_FILE
+  sync; sudo sh -c 'echo 1 > /proc/sys/vm/drop_caches'
+  (/usr/bin/time --format="%e %M %K ${PERCENTAGE} NanoLog Query" ./decompressor query /tmp/logFile "group by logId; count, min, max, mean of arg[0]" >> $DEBUG_LOG_FILE) |& tee -a $LOG_FILE
   echo "" |& tee -a $LOG_FILE
 done
 
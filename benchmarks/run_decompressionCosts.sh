@@ -22,6 +22,11 @@ BENCH_OPS["complexFormat"]="NANO_LOG(NOTICE, \"Initialized InfUdDriver buffers:
 
 BENCH_OPS_ORDERING="staticString stringConcat singleInteger twoIntegers singleDouble complexFormat"
 
+# Preprocessor NanoLog decompresses via its generated functions whereas C++17
+# NanoLog formats messages with the Decoder's compiled format fragments, so
+# each is measured separately (rows for the latter are suffixed with Cpp17).
+PREPROCESSOR_MODES="yes no"
+
 LOG_FILE="results/$(date +%Y%m%d%H%M%S)_decompressionCosts.txt"
 mkdir -p results
 
@@ -58,12 +63,20 @@ printf "\r\n\r\n\r\n#Random Statistics\r\n" > $STATS_LOG_FILE
 # Threads OP1 OP2 OP3 ...
 #####
 
-for OP_KEY in $BENCH_OPS_ORDERING
+for PREPROCESSOR_NANOLOG in $PREPROCESSOR_MODES
+do
+  export PREPROCESSOR_NANOLOG
+  for OP_KEY in $BENCH_OPS_ORDERING
     do
 
     BENCH_OP=${BENCH_OPS[$OP_KEY]}
-    echo -n "$OP_KEY" >> $LOG_FILE
-    echo -n "$OP_KEY" >> $SORTED_LOG_FILE
+    ROW_NAME="$OP_KEY"
+    if [[ "$PREPROCESSOR_NANOLOG" == "no" ]]; then
+        ROW_NAME="${OP_KEY}Cpp17"
+    fi
+
+    echo -n "$ROW_NAME" >> $LOG_FILE
+    echo -n "$ROW_NAME" >> $SORTED_LOG_FILE
 
     for (( threads = 1; threads <= $THREADS_MAX; threads*=4 )); do
         ((itterations = $ITTRS/$threads))
@@ -80,7 +93,7 @@ for OP_KEY in $BENCH_OPS_ORDERING
         UNSORTED_THROUGHPUT=$(echo "scale=2; $ITTRS/(1000000*${UNSORTED_TIME})" | bc)
         SORTED_THROUGHPUT=$(echo "scale=2;   $ITTRS/(1000000*${SORTED_TIME})" | bc)
 
-        printf "At $threads threads, $OP_KEY had unsorted/sorted throughputs of "
+        printf "At $threads threads, $ROW_NAME had unsorted/sorted throughputs of "
         printf " & 0%s" $UNSORTED_THROUGHPUT |& tee -a $LOG_FILE
         printf " / "
         printf " & 0%s" $SORTED_THROUGHPUT |& tee -a $SORTED_LOG_FILE
@@ -98,6 +111,7 @@ for OP_KEY in $BENCH_OPS_ORDERING
 
     echo "" |& tee -a $LOG_FILE
     echo "" |& tee -a $SORTED_LOG_FILE
+  done
 done
 
 cat $SORTED_LOG_FILE >> $LOG_FILE
@@ -0,0 +1,37 @@
+#! /bin/bash -e
+
+###
+# Latency of individual NANO_LOG() invocations for the log messages of the
+# NanoLog paper over a sweep of producer threads, StagingBuffer sizes, and
+# park timeouts of the idle background thread (IDLE_PARK_TIMEOUT_US, which
+# bounds how long a log message that races with a park waits). The park
+# timeout is a compile-time configuration, so the benchmark is rebuilt for
+# each one, whereas the others are swept within latencyBenchmark.
+#
+# The results are written as one JSON object per configuration (per line)
+# and can be compared to those of an earlier run with compareLatency.py.
+###
+
+THREADS="1,2,4,8"
+STAGING_BUFFER_EXPS="16,20,24"
+PARK_TIMEOUTS="1000 10000 100000"
+ITTRS=1000000
+
+RESULTS_FILE="results/$(date +%Y%m%d%H%M%S)_latency.json"
+mkdir -p results
+
+for PARK_TIMEOUT in $PARK_TIMEOUTS
+do
+    python genConfig.py --parkTimeout=${PARK_TIMEOUT}
+    make clean-all > /dev/null && make -j4 latencyBenchmark > /dev/null
+    rm -f /tmp/logFile
+
+    ./latencyBenchmark --threads=${THREADS} \
+                       --stagingBufferExp=${STAGING_BUFFER_EXPS} \
+                       --iterations=${ITTRS} \
+                       --output=${RESULTS_FILE}
+done
+
+rm -f /tmp/logFile
+git checkout ../runtime/Config.h
+printf "Results written to ${RESULTS_FILE}\r\n"
@@ -5,6 +5,10 @@
 # In theory, the decompression should take longer with increasing threads
 # (but same nubmer of log messages)
 # In the paper as sortedDecompressionThreads
+#
+# The first log file is also decompressed with an increasing number of
+# decompressor threads (up to the number of cores) to measure the parallel
+# decompression.
 ###
 
 SUDO_POWER="$(sudo -v 2>&1)"
@@ -35,6 +39,21 @@ TMP_SORTED="/tmp/$(date +%Y%m%d%H%M%S)_1.txt"
 TMP_UNSORTED="/tmp/$(date +%Y%m%d%H%M%S)_2.txt"
 TMP_SORTED_NULL="/tmp/$(date +%Y%m%d%H%M%S)_3.txt"
 TMP_UNSORTED_NULL="/tmp/$(date +%Y%m%d%H%M%S)_4.txt"
+TMP_PARALLEL="/tmp/$(date +%Y%m%d%H%M%S)_5.txt"
+
+printf "# Decompressor Threads | Sorted (secs) | Unsorted (secs)\r\n" > $TMP_PARALLEL
+for ((decompThreads=1; decompThreads<=$(nproc); decompThreads*=2))
+do
+    sync; sudo sh -c 'echo 1 > /proc/sys/vm/drop_caches'
+    SORTED=$( { /usr/bin/time -f "%e"  ./decompressor decompress /tmp/logFile ${decompThreads} > /tmp/decomp; } 2>&1 )
+    rm -f /tmp/decomp
+
+    sync; sudo sh -c 'echo 1 > /proc/sys/vm/drop_caches'
+    UNSORTED=$( { /usr/bin/time -f "%e"  ./decompressor decompressUnordered /tmp/logFile ${decompThreads} > /tmp/decomp; } 2>&1 )
+    rm -f /tmp/decomp
+
+    printf "${decompThreads}    ${SORTED}    ${UNSORTED}\r\n" >> $TMP_PARALLEL
+done
 
 for ((threads=1; threads<=4096; threads*=2))
 # for ((threads=1; threads<=1; threads*=2))
@@ -76,4 +95,7 @@ cat $TMP_SORTED_NULL |& tee -a $LOG_FILE
 printf "\r\n# Unsorted to /dev/null\r\n" |& tee -a $LOG_FILE
 cat $TMP_UNSORTED_NULL |& tee -a $LOG_FILE
 
-rm -f $TMP_SORTED $TMP_UNSORTED $TMP_SORTED_NULL $TMP_UNSORTED_NULL
\ No newline at end of file
+printf "\r\n# Parallel decompression of the 1 thread log to file\r\n" |& tee -a $LOG_FILE
+cat $TMP_PARALLEL |& tee -a $LOG_FILE
+
+rm -f $TMP_SORTED $TMP_UNSORTED $TMP_SORTED_NULL $TMP_UNSORTED_NULL $TMP_PARALLEL
\ No newline at end of file
@@ -17,10 +17,14 @@
 # routines for log messages using the NanoLog system.
 
 import errno
+import glob
+import hashlib
 import json
 import os.path
 import re
 
+import StringIO
+
 from collections import namedtuple
 
 # Various globals mapping symbolic names to the object/function names in
@@ -32,15 +36,21 @@ RECORD_PRIMITIVE_FN = "NanoLogInternal::Log::recordPrimitive"
 NIBBLE_OBJ = "BufferUtils::TwoNibbles"
 LOG_LEVEL_ENUM = "NanoLog::LogLevel"
 
-LOG_LEVEL_GET_FN = "NanoLog::getLogLevel"
+LOG_SITE_ENABLED_FN = "NanoLogInternal::RuntimeLogger::isLogSiteEnabled"
+LOG_SITE_UNRESOLVED = "NanoLogInternal::LOG_SITE_UNRESOLVED"
 ALLOC_FN = "NanoLogInternal::RuntimeLogger::reserveAlloc"
 FINISH_ALLOC_FN = "NanoLogInternal::RuntimeLogger::finishAlloc"
+TIMESTAMP_FN = "NanoLogInternal::RuntimeLogger::readTimestamp" \
+               "<NanoLogConfig::TIMESTAMP_SOURCE>"
 
 PACK_FN = "BufferUtils::pack"
 UNPACK_FN = "BufferUtils::unpack"
 
 GENERATED_CODE_NAMESPACE = "GeneratedFunctions"
 
+# Key of the example entry that FunctionGenerator.logId2Code starts with
+INVALID_LOG_ID = "__INVALID__INVALID__INVALID__"
+
 # This class assigns unique identifiers to unique printf-like format strings,
 # generates C++ code to record/compress/decompress the printf-like statements
 # in the NanoLog system, and maintains these mappings between multiple
@@ -123,14 +133,12 @@ class FunctionGenerator(object):
     #
     # \param filename
     #           file to persist the state to
-    def outputMappingFile(self, filename):
-        dirname = os.path.dirname(filename)
-        if dirname and not os.path.exists(dirname):
-            try:
-                os.makedirs(dirname)
-            except OSError as exc:
-                if exc.errno != errno.EEXIST:
-                    raise
+    # \param sourceHash
+    #           Optional hash of the preprocessed source the state was
+    #           generated from, which lets the parser skip sources that
+    #           haven't changed since (see parser.py:processFile)
+    def outputMappingFile(self, filename, sourceHash=None):
+        makeDirsFor(filename)
 
         with open(filename, 'w') as json_file:
             outputJSON = {
@@ -138,6 +146,9 @@ class FunctionGenerator(object):
                 "logId2Code":self.logId2Code
             }
 
+            if sourceHash:
+                outputJSON["sourceHash"] = sourceHash
+
             json_file.write(json.dumps(outputJSON, sort_keys=True,
                                             indent=4, separators=(',', ': ')))
 
@@ -150,10 +161,32 @@ class FunctionGenerator(object):
     #       - The supporting compression/decompression functions
     #       - The record function that should have been injected (for debugging)
     #
+    # For incremental builds, the numerical ids can be kept stable between
+    # invocations with a logIdsFile and the compression/decompression
+    # functions can be split out into one file per source file in sitesDir.
+    # Files whose contents would not change are left untouched, so that only
+    # the generated code for the source files that changed is recompiled.
+    #
     # \param filename
     #               The C++ file to emit
+    # \param inputFiles
+    #               Map files to combine (see outputMappingFile())
+    # \param logIdsFile
+    #               Optional JSON file that persists the numerical ids assigned
+    #               to the log statements from one invocation to the next
+    #               (see assignLogIds())
+    # \param sitesDir
+    #               Optional directory to emit the compression/decompression
+    #               functions into, as one (non-inline) C++ file per source
+    #               file with log statements. The record functions are omitted
+    #               in this case. Files in it for source files without log
+    #               statements are removed, along with their ".o".
+    #
+    # \return
+    #               List of the files that were (re)written or removed
     @staticmethod
-    def outputCompilationFiles(outputFileName="BufferStuffer.h", inputFiles=[]):
+    def outputCompilationFiles(outputFileName="BufferStuffer.h", inputFiles=[],
+                               logIdsFile=None, sitesDir=None):
         # Merge all the intermediate compilations
         mergedCode = {}
         for filename in inputFiles:
@@ -161,11 +194,56 @@ class FunctionGenerator(object):
                 loaded_json = json.load(iFile)
                 mergedCode.update(loaded_json["logId2Code"])
 
+        logIds = [logId for logId in mergedCode.iterkeys()
+                                                if logId != INVALID_LOG_ID]
+        if logIdsFile:
+            logIds = assignLogIds(mergedCode, logIds, logIdsFile)
+
+        # Ids left over by log statements that no longer exist are filled in
+        # with a log message that's never logged.
+        retiredCode = None
+        if None in logIds:
+            fg = FunctionGenerator()
+            fg.generateLogFunctions("NOTICE", "", "<retired>", "<retired>", 0)
+            retiredCode = fg.logId2Code[generateLogIdStr("", "<retired>", 0)]
+
+        changedFiles = []
+        declarations = ""
+        if sitesDir:
+            (declarations, changedFiles) = outputSiteFiles(mergedCode, logIds,
+                                                           sitesDir)
+
+        contents = StringIO.StringIO()
+        FunctionGenerator.writeCompilationFile(contents, mergedCode, logIds,
+                                               retiredCode, declarations,
+                                               not sitesDir)
+        if writeIfChanged(outputFileName, contents.getvalue()):
+            changedFiles.append(outputFileName)
+
+        return changedFiles
+
+    # Writes the C++ file output by outputCompilationFiles()
+    #
+    # \param oFile
+    #               File object to write to
+    # \param mergedCode
+    #               Combined logId2Code of the map files
+    # \param logIds
+    #               Log statement of each numerical id (see assignLogIds())
+    # \param retiredCode
+    #               Generated code that stands in for the ids that are None
+    # \param declarations
+    #               Declarations of the functions in the site files, if any
+    # \param withDefinitions
+    #               True if the functions of every log statement are to be
+    #               written, rather than just the stand-in for retired ids
+    @staticmethod
+    def writeCompilationFile(oFile, mergedCode, logIds, retiredCode,
+                             declarations, withDefinitions):
         # Output the C++ code. It may be a bit hard to read admist the static
         # C++ code, but all the code immediately before/after a triple quote
         # sections are in the same indention.
-        with open(outputFileName, 'w') as oFile:
-            oFile.write("""
+        oFile.write("""
 #ifndef BUFFER_STUFFER
 #define BUFFER_STUFFER
 
@@ -198,53 +276,61 @@ namespace {{
 
 using namespace NanoLog::LogLevels;
 """.format(logLevelEnum=LOG_LEVEL_ENUM))
-            for logId, code in mergedCode.iteritems():
-                if logId == "__INVALID__INVALID__INVALID__":
-                    continue
+        definitions = logIds if withDefinitions else []
+        if retiredCode:
+            definitions = definitions + [None]
+
+        for logId in definitions:
+            code = mergedCode[logId] if logId else retiredCode
 
-                oFile.write(code["recordFnDef"] + "\n")
-                oFile.write(code["compressFnDef"] + "\n")
-                oFile.write(code["decompressFnDef"] + "\n")
+            oFile.write(code["recordFnDef"] + "\n")
+            oFile.write(code["compressFnDef"] + "\n")
+            oFile.write(code["decompressFnDef"] + "\n")
 
-            oFile.write("""
+        oFile.write("""
 } // end empty namespace
 
 // Assignment of numerical ids to format NANO_LOG occurrences
 """)
 
-            # Here, we take the iteration order as the canonical order
-            count = 0
-            logId2Metadata = []
-            compressFnNameArray = []
-            decompressFnNameArray = []
-            dictionaryFragments = []
-            for logId, code in mergedCode.iteritems():
-                if logId == "__INVALID__INVALID__INVALID__":
-                    continue
-
-                dictionaryFragments.append(code['dictionaryFragment'])
-                logId2Metadata.append("{\"%s\", \"%s\", %d, %s}" % (
-                    code["fmtString"],
-                    code["filename"],
-                    code["linenum"],
-                    code["logLevel"]
-                ))
-
-                oFile.write("extern const int %s = %d; // %s:%d \"%s\"\n" % (
-                        generateIdVariableNameFromLogId(logId),
-                        count,
-                        code["filename"],
-                        code["linenum"],
-                        code["fmtString"]
-                ))
+        # The position of a log statement in logIds is its numerical id
+        count = 0
+        logId2Metadata = []
+        compressFnNameArray = []
+        decompressFnNameArray = []
+        dictionaryFragments = []
+        for logId in logIds:
+            code = mergedCode[logId] if logId else retiredCode
+
+            dictionaryFragments.append(code['dictionaryFragment'])
+            logId2Metadata.append("{\"%s\", \"%s\", %d, %s}" % (
+                code["fmtString"],
+                code["filename"],
+                code["linenum"],
+                code["logLevel"]
+            ))
+
+            if not logId:
                 count += 1
-
                 compressFnNameArray.append(code["compressFnName"])
                 decompressFnNameArray.append(code["decompressFnName"])
-            oFile.write("""
+                continue
+
+            oFile.write("extern const int %s = %d; // %s:%d \"%s\"\n" % (
+                    generateIdVariableNameFromLogId(logId),
+                    count,
+                    code["filename"],
+                    code["linenum"],
+                    code["fmtString"]
+            ))
+            count += 1
+
+            compressFnNameArray.append(code["compressFnName"])
+            decompressFnNameArray.append(code["decompressFnName"])
+        oFile.write("""
 // Start new namespace for generated ids and code
 namespace {namespace} {{
-
+{declarations}
 // Map of numerical ids to log message metadata
 struct LogMetadata logId2Metadata[{count}] =
 {{
@@ -286,6 +372,7 @@ size_t numLogIds = {count};
 
 #endif /* BUFFER_STUFFER */
 """.format(count=count,
+           declarations=declarations,
            Entry=RECORD_ENTRY,
            listOfLogId2Metadata=",\n".join(logId2Metadata),
            listOfCompressFnNames=",\n".join(compressFnNameArray),
@@ -461,15 +548,22 @@ size_t numLogIds = {count};
 """
 inline {function_declaration} {{
     extern const uint32_t {idVariableName};
+    static int siteFilter = {siteUnresolved};
 
-    if (level > {getLogLevelFn}())
+    if (!{isLogSiteEnabledFn}(siteFilter,
+            reinterpret_cast<const int*>(&{idVariableName}),
+            "{filename}", {linenum}, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = {timestamp_fn}();
     {strlen_declaration};
     size_t allocSize = {primitive_size_sum} {strlen_sum} sizeof({entry});
     {entry} *re = reinterpret_cast<{entry}*>({alloc_fn}(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = {idVariableName};
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -483,15 +577,19 @@ inline {function_declaration} {{
     {recordStringsArgsCode}
 
     // Make the entry visible
-    {finishAlloc_fn}(allocSize);
+    {finishAlloc_fn}(allocSize, level);
 }}
 """.format(function_declaration = recordDeclaration,
-       getLogLevelFn=LOG_LEVEL_GET_FN,
+       siteUnresolved=LOG_SITE_UNRESOLVED,
+       isLogSiteEnabledFn=LOG_SITE_ENABLED_FN,
+       filename=escapeCString(filename),
+       linenum=linenum,
        strlen_declaration = "\r\n\t".join(strlenDeclarations),
        primitive_size_sum = nonStringSizeOfPartialSum,
        strlen_sum = stringLenPartialSum,
        entry = RECORD_ENTRY,
        alloc_fn = ALLOC_FN,
+       timestamp_fn = TIMESTAMP_FN,
        idVariableName = generateIdVariableNameFromLogId(logId),
        nibble_size = nibbleByteSizes,
        recordNonStringArgsCode = recordNonStringArgsCode,
@@ -642,6 +740,7 @@ inline void
     fm->numNibbles = {numNibbles};
     fm->numPrintFragments = {numPrintFragments};
     fm->logLevel = {logLevel};
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = {linenum};
     fm->filenameLength = {filenameLength};
 
@@ -675,6 +774,7 @@ inline void
             pf->argType = {type};
             pf->hasDynamicWidth = {width};
             pf->hasDynamicPrecision = {precision};
+            pf->internedString = false;
             pf->fragmentLength = sizeof("{substring}")/sizeof(char);
 
             buffer = stpcpy(buffer, "{substring}") + 1;
@@ -887,6 +987,10 @@ def isWideString(typeStr):
     return typeStr and -1 != typeStr.find("wchar_t*")
 
 # Helper functions to generate variable names
+# Escapes a string so that it can be embedded in a C++ string literal
+def escapeCString(string):
+    return string.replace("\\", "\\\\").replace("\"", "\\\"")
+
 def generateIdVariableNameFromLogId(logId):
     return "__fmtId" + logId
 
@@ -895,3 +999,169 @@ def generateLogIdStr(fmtString, filename, linenum):
         return "".join([c if c.isalnum() else str(ord(c)) for c in string])
 
     return "__%s__%s__%d__" % (encode(fmtString), encode(filename), linenum)
+
+# Creates the directories leading up to a file, if they don't exist yet.
+def makeDirsFor(filename):
+    dirname = os.path.dirname(filename)
+    if dirname and not os.path.exists(dirname):
+        try:
+            os.makedirs(dirname)
+        except OSError as exc:
+            if exc.errno != errno.EEXIST:
+                raise
+
+# Writes a file unless it already has the contents given, so that its
+# modification time only changes (and make only rebuilds what depends on it)
+# if it actually changed.
+#
+# \return
+#           True if the file was written
+def writeIfChanged(filename, contents):
+    if os.path.exists(filename):
+        with open(filename, 'r') as iFile:
+            if iFile.read() == contents:
+                return False
+
+    makeDirsFor(filename)
+    with open(filename, 'w') as oFile:
+        oFile.write(contents)
+
+    return True
+
+# Assigns numerical ids to the log statements such that the ones that were
+# assigned an id by a previous invocation keep it, as recorded in logIdsFile.
+# This keeps ids stable across builds (i.e. for log site filters by id) and
+# spares the generated code that depends on them from changing. New log
+# statements first take over the ids of the ones that no longer exist and
+# then extend the range, in order of source file and line number. Ids that
+# remain unused are holes.
+#
+# \param mergedCode
+#           logId2Code of all the log statements
+# \param logIds
+#           Keys of mergedCode to assign ids to
+# \param logIdsFile
+#           JSON file mapping the log statements to their ids, which is read
+#           (if it exists) and then updated
+#
+# \return
+#           List mapping each numerical id to its log statement (a key of
+#           mergedCode) or None for a hole
+def assignLogIds(mergedCode, logIds, logIdsFile):
+    previousIds = {}
+    if os.path.exists(logIdsFile):
+        with open(logIdsFile, 'r') as iFile:
+            previousIds = json.load(iFile)
+
+    assigned = {}
+    newLogIds = []
+    for logId in logIds:
+        if logId in previousIds:
+            assigned[previousIds[logId]] = logId
+        else:
+            newLogIds.append(logId)
+
+    def sourceOrder(logId):
+        code = mergedCode[logId]
+        return (code["filename"], code["linenum"], code["fmtString"])
+
+    numericalId = 0
+    for logId in sorted(newLogIds, key=sourceOrder):
+        while numericalId in assigned:
+            numericalId += 1
+        assigned[numericalId] = logId
+
+    numIds = max(assigned.keys()) + 1 if assigned else 0
+    ordered = [assigned.get(i) for i in range(numIds)]
+
+    writeIfChanged(logIdsFile, json.dumps(
+                        dict((logId, i) for i, logId in enumerate(ordered)
+                                                                if logId),
+                        sort_keys=True, indent=4, separators=(',', ': ')))
+    return ordered
+
+# Makes a compression/decompression function definition generated by
+# FunctionGenerator.generateLogFunctions() usable from another file.
+def externalDefinition(fnDef):
+    return re.sub(r"^(\s*)inline ", r"\1", fnDef, count=1)
+
+# Returns the file in sitesDir that holds the generated functions for the
+# log statements in a source file.
+def siteFileFor(sitesDir, filename):
+    name = re.sub(r"[^a-zA-Z0-9_.-]", "_", os.path.basename(filename))
+    digest = hashlib.md5(filename.encode("utf-8")).hexdigest()[:8]
+    return os.path.join(sitesDir, "%s.%s.cc" % (name, digest))
+
+# Writes the compression/decompression functions of the log statements into
+# one file per source file (see FunctionGenerator.outputCompilationFiles())
+#
+# \param mergedCode
+#           logId2Code of all the log statements
+# \param logIds
+#           Log statement of each numerical id (see assignLogIds())
+# \param sitesDir
+#           Directory to write the files to
+#
+# \return
+#           Tuple of the declarations of the functions for the main C++ file
+#           and a list of the files that were (re)written or removed
+def outputSiteFiles(mergedCode, logIds, sitesDir):
+    siteFiles = {}
+    declarations = []
+    for logId in sorted(logId for logId in logIds if logId):
+        code = mergedCode[logId]
+        siteFile = siteFileFor(sitesDir, code["filename"])
+        siteFiles.setdefault(siteFile, []).append(code)
+
+        declarations.append("ssize_t %s(%s *re, char* out);" % (
+                                            code["compressFnName"],
+                                            RECORD_ENTRY))
+        declarations.append("void %s(const char **in, FILE *outputFd, "
+                            "void (*aggFn)(const char*, ...));" % (
+                                            code["decompressFnName"]))
+
+    changedFiles = []
+    for siteFile, codes in siteFiles.iteritems():
+        contents = """
+// Compression and decompression functions for the NANO_LOG statements in
+// {filename}
+
+#include "NanoLog.h"
+#include "Packer.h"
+
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+
+namespace {namespace} {{
+
+using namespace NanoLog::LogLevels;
+""".format(filename=codes[0]["filename"], namespace=GENERATED_CODE_NAMESPACE)
+
+        for code in codes:
+            contents += externalDefinition(code["compressFnDef"]) + "\n"
+            contents += externalDefinition(code["decompressFnDef"]) + "\n"
+
+        contents += """
+}}; // {namespace}
+
+#pragma GCC diagnostic pop
+""".format(namespace=GENERATED_CODE_NAMESPACE)
+
+        if writeIfChanged(siteFile, contents):
+            changedFiles.append(siteFile)
+
+    for siteFile in glob.glob(os.path.join(sitesDir, "*.cc")):
+        if siteFile not in siteFiles:
+            os.remove(siteFile)
+            changedFiles.append(siteFile)
+            if os.path.exists(siteFile + ".o"):
+                os.remove(siteFile + ".o")
+
+    declarationText = ""
+    if declarations:
+        declarationText = "\n// Defined in %s\n%s\n" % (sitesDir,
+                                                        "\n".join(declarations))
+
+    return (declarationText, changedFiles)
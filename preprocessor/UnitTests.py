@@ -253,12 +253,19 @@ class PreprocesorTestCase(unittest.TestCase):
         with open("test", "w") as testFile:
             testFile.write(src)
 
-        processFile("test", "test.map")
+        self.assertTrue(processFile("test", "test.map"))
+        with open("testi", 'r') as iFile:
+            self.assertEqual(src, iFile.read())
+
+        # The unchanged file is served from the cache of the last output
+        os.remove("testi")
+        self.assertFalse(processFile("test", "test.map"))
         with open("testi", 'r') as iFile:
             self.assertEqual(src, iFile.read())
 
         os.remove("test")
         os.remove("testi")
+        os.remove("test.ii")
         os.remove("test.map")
 
     ###### NOTE #######
@@ -549,15 +556,22 @@ class FunctionGeneratorTestCase(unittest.TestCase):
 """
 inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
     extern const uint32_t __fmtId{logId};
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId{logId}),
+            "{filename}", {linenum}, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId{logId};
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -571,7 +585,7 @@ inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
     %s
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }}
 """ % ("", "")
         fg = FunctionGenerator()
@@ -588,16 +602,24 @@ inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
         funcs = fg.getRecordFunctionDefinitionsFor("mar.cc")
 
         logId = generateLogIdStr("A", "mar.cc", 293)
-        self.assertMultiLineEqual(emptyRec.format(logId=logId), funcs[0])
+        self.assertMultiLineEqual(emptyRec.format(logId=logId,
+                                                  filename="mar.cc",
+                                                  linenum=293), funcs[0])
 
         logId = generateLogIdStr("C", "mar.cc", 200)
-        self.assertMultiLineEqual(emptyRec.format(logId=logId), funcs[1])
+        self.assertMultiLineEqual(emptyRec.format(logId=logId,
+                                                  filename="mar.cc",
+                                                  linenum=200), funcs[1])
 
         logId = generateLogIdStr("B", "mar.cc", 293)
-        self.assertMultiLineEqual(emptyRec.format(logId=logId), funcs[2])
+        self.assertMultiLineEqual(emptyRec.format(logId=logId,
+                                                  filename="mar.cc",
+                                                  linenum=293), funcs[2])
 
         logId = generateLogIdStr("D", "mar.cc", 100)
-        self.assertMultiLineEqual(emptyRec.format(logId=logId),
+        self.assertMultiLineEqual(emptyRec.format(logId=logId,
+                                                  filename="mar.cc",
+                                                  linenum=100),
                                 fg.getRecordFunctionDefinitionsFor("s.cc")[0])
 
     def test_outputMappingFile(self):
@@ -672,6 +694,94 @@ inline void __syang0__fl{logId}(NanoLog::LogLevel level, const char* fmtStr ) {{
         os.remove("map2.map")
         os.remove("test.h")
 
+    def test_outputCompilationFiles_stableLogIds(self):
+        fg = FunctionGenerator()
+        fg.generateLogFunctions("DEBUG", "A", "mar.cc", "mar.cc", 293)
+        fg.generateLogFunctions("DEBUG", "B", "mar.cc", "mar.cc", 294)
+        fg.generateLogFunctions("DEBUG", "D %d", "s.cc", "s.cc", 100)
+        fg.outputMappingFile("map1.map")
+
+        FunctionGenerator.outputCompilationFiles("test.h", ["map1.map"],
+                                                 logIdsFile="logIds.json")
+        with open("logIds.json") as iFile:
+            firstIds = json.load(iFile)
+        self.assertEqual(sorted(firstIds.values()), [0, 1, 2])
+
+        # Removing a log statement leaves a hole instead of renumbering the
+        # rest, and a new one fills the lowest free id
+        fg = FunctionGenerator()
+        fg.generateLogFunctions("DEBUG", "A", "mar.cc", "mar.cc", 293)
+        fg.generateLogFunctions("DEBUG", "D %d", "s.cc", "s.cc", 100)
+        fg.outputMappingFile("map1.map")
+
+        FunctionGenerator.outputCompilationFiles("test.h", ["map1.map"],
+                                                 logIdsFile="logIds.json")
+        with open("logIds.json") as iFile:
+            secondIds = json.load(iFile)
+        removed = [logId for logId in firstIds if logId not in secondIds]
+        self.assertEqual(len(removed), 1)
+        for logId, numericalId in secondIds.items():
+            self.assertEqual(firstIds[logId], numericalId)
+
+        with open("test.h") as iFile:
+            self.assertIn("<retired>", iFile.read())
+
+        fg.generateLogFunctions("DEBUG", "C", "mar.cc", "mar.cc", 200)
+        fg.outputMappingFile("map1.map")
+        FunctionGenerator.outputCompilationFiles("test.h", ["map1.map"],
+                                                 logIdsFile="logIds.json")
+        with open("logIds.json") as iFile:
+            thirdIds = json.load(iFile)
+        self.assertEqual(sorted(thirdIds.values()), [0, 1, 2])
+        for logId, numericalId in secondIds.items():
+            self.assertEqual(thirdIds[logId], numericalId)
+
+        os.remove("map1.map")
+        os.remove("logIds.json")
+        os.remove("test.h")
+
+    def test_outputCompilationFiles_sitesDir(self):
+        fg = FunctionGenerator()
+        fg.generateLogFunctions("DEBUG", "A", "mar.cc", "mar.cc", 293)
+        fg.generateLogFunctions("DEBUG", "D %d", "s.cc", "s.cc", 100)
+        fg.outputMappingFile("map1.map")
+
+        changed = FunctionGenerator.outputCompilationFiles("test.h",
+                                                ["map1.map"],
+                                                logIdsFile="logIds.json",
+                                                sitesDir="testSites")
+        marFile = siteFileFor("testSites", "mar.cc")
+        sFile = siteFileFor("testSites", "s.cc")
+        self.assertEqual(sorted(changed),
+                         sorted(["test.h", marFile, sFile]))
+
+        # Nothing is rewritten when the log statements are the same
+        changed = FunctionGenerator.outputCompilationFiles("test.h",
+                                                ["map1.map"],
+                                                logIdsFile="logIds.json",
+                                                sitesDir="testSites")
+        self.assertEqual(changed, [])
+
+        # Only the file of the source file that changed is rewritten, and
+        # the file of a source file without log statements is removed
+        fg = FunctionGenerator()
+        fg.generateLogFunctions("DEBUG", "A %d", "mar.cc", "mar.cc", 293)
+        fg.outputMappingFile("map1.map")
+        changed = FunctionGenerator.outputCompilationFiles("test.h",
+                                                ["map1.map"],
+                                                logIdsFile="logIds.json",
+                                                sitesDir="testSites")
+        self.assertIn(marFile, changed)
+        self.assertIn(sFile, changed)
+        self.assertTrue(os.path.exists(marFile))
+        self.assertFalse(os.path.exists(sFile))
+
+        os.remove(marFile)
+        os.removedirs("testSites")
+        os.remove("map1.map")
+        os.remove("logIds.json")
+        os.remove("test.h")
+
     def test_isStringType(self):
         self.assertTrue(isStringType("char*"))
         self.assertTrue(isStringType("wchar_t*"))
@@ -37,14 +37,18 @@ a supporting C++ header file used in the Runtime and Decompression components.
 
 Usage:
     parser.py [-h] --mapOutput=MAP PREPROCESSED_SRC
-    parser.py [-h] --combinedOutput=HEADER [MAP_FILES...]
+    parser.py [-h] --combinedOutput=HEADER [--logIds=IDS] [--sitesDir=DIR]
+                    [MAP_FILES...]
 
 Options:
   -h --help             Show this help messages
 
   --mapOutput=MAP       Output destination for the intermediate metadata map
                         file to be used in the combinedOutput mode. There should
-                        be one map file per preprocessed_src
+                        be one map file per preprocessed_src. A copy of the
+                        processed file is kept next to it (ex main.cc.map ->
+                        main.cc.ii) so that the file needn't be processed again
+                        if the preprocessed_src doesn't change.
 
   PREPROCESSED_SRC      GNU-preprocessed C/C++ file to process. The processed
                         files will be outputted with an extra "i" extension
@@ -56,13 +60,27 @@ Options:
                         aggregates all the map files for use with the
                         other NanoLog components [default:BufferStuffer.h]
 
+  --logIds=IDS          JSON file that keeps the numerical ids assigned to the
+                        log statements stable from one build to the next; it is
+                        created if it does not exist yet
+
+  --sitesDir=DIR        Output the compression/decompression functions into
+                        one C++ file per source file in DIR instead of into
+                        the final header. Only the files whose contents change
+                        are rewritten, which keeps rebuilds incremental.
+
   MAP_FILES             List of map files to combine into the final header;
                         There should be one map file per preprocessed source
 """
 
 from docopt import docopt
 from collections import namedtuple
+import hashlib
+import json
+import os
+import shutil
 import sys
+import time
 
 from FunctionGenerator import *
 
@@ -320,7 +338,34 @@ def peekNextMeaningfulChar(lines, filePos):
 # \param inputFiles
 #           list of g++ preprocessed C/C++ files to analyze
 #
+# \return
+#           True if the file was processed, False if the output of an earlier
+#           invocation on the same (unchanged) file was reused instead
+#
 def processFile(inputFile, mapOutputFilename):
+  # The outputs only depend on the preprocessed file and on the preprocessor
+  # itself, so unless either of them changed, the outputs of the last
+  # invocation are still good.
+  sourceHash = hashlib.md5()
+  for filename in [inputFile, __file__.replace(".pyc", ".py"),
+                   os.path.join(os.path.dirname(__file__),
+                                "FunctionGenerator.py")]:
+    with open(filename, 'rb') as f:
+      sourceHash.update(f.read())
+  sourceHash = sourceHash.hexdigest()
+
+  cachedOutput = os.path.splitext(mapOutputFilename)[0] + ".ii"
+  if os.path.exists(mapOutputFilename) and os.path.exists(cachedOutput):
+    with open(mapOutputFilename) as mapFile:
+      try:
+        cachedHash = json.load(mapFile).get("sourceHash")
+      except ValueError:
+        cachedHash = None
+
+    if cachedHash == sourceHash:
+      shutil.copyfile(cachedOutput, inputFile + "i")
+      return False
+
   functionGenerator = FunctionGenerator()
   directiveRegex = re.compile("^# (\d+) \"(.*)\"(.*)")
 
@@ -572,15 +617,30 @@ def processFile(inputFile, mapOutputFilename):
       output.write(line)
 
     output.close()
-    functionGenerator.outputMappingFile(mapOutputFilename)
+
+  # The map file is written last, so that a cache hit above implies that the
+  # cached output was completely written
+  makeDirsFor(cachedOutput)
+  shutil.copyfile(inputFile + "i", cachedOutput)
+  functionGenerator.outputMappingFile(mapOutputFilename, sourceHash)
+  return True
 
 if __name__ == "__main__":
   arguments = docopt(__doc__, version='NanoLog Preprocesor v1.0')
+  startTime = time.time()
 
   if arguments['--mapOutput']:
-    processFile(inputFile=arguments['PREPROCESSED_SRC'],
+    processed = processFile(inputFile=arguments['PREPROCESSED_SRC'],
                 mapOutputFilename=arguments['--mapOutput'])
+    print "NanoLog: %s %s in %0.2lf seconds" % (
+          "processed" if processed else "reused the cached output for",
+          arguments['PREPROCESSED_SRC'], time.time() - startTime)
   else:
-    FunctionGenerator.outputCompilationFiles(
+    changedFiles = FunctionGenerator.outputCompilationFiles(
                                   outputFileName=arguments['--combinedOutput'],
-                                  inputFiles=arguments['MAP_FILES'])
\ No newline at end of file
+                                  inputFiles=arguments['MAP_FILES'],
+                                  logIdsFile=arguments['--logIds'],
+                                  sitesDir=arguments['--sitesDir'])
+    print "NanoLog: combined %d map files in %0.2lf seconds, %d generated " \
+          "files changed" % (len(arguments['MAP_FILES']),
+                             time.time() - startTime, len(changedFiles))
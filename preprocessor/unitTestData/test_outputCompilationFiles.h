@@ -33,15 +33,22 @@ using namespace NanoLog::LogLevels;
 
 inline void __syang0__fl__B__mar46cc__294__(NanoLog::LogLevel level, const char* fmtStr ) {
     extern const uint32_t __fmtId__B__mar46cc__294__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__B__mar46cc__294__),
+            "mar.cc", 294, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__B__mar46cc__294__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -55,7 +62,7 @@ inline void __syang0__fl__B__mar46cc__294__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -118,15 +125,22 @@ decompressPrintArgs__B__mar46cc__294__ (const char **in,
 
 inline void __syang0__fl__A__mar46h__1__(NanoLog::LogLevel level, const char* fmtStr ) {
     extern const uint32_t __fmtId__A__mar46h__1__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__A__mar46h__1__),
+            "mar.h", 1, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__A__mar46h__1__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -140,7 +154,7 @@ inline void __syang0__fl__A__mar46h__1__(NanoLog::LogLevel level, const char* fm
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -203,15 +217,22 @@ decompressPrintArgs__A__mar46h__1__ (const char **in,
 
 inline void __syang0__fl__E__del46cc__199__(NanoLog::LogLevel level, const char* fmtStr ) {
     extern const uint32_t __fmtId__E__del46cc__199__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__E__del46cc__199__),
+            "del.cc", 199, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__E__del46cc__199__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -225,7 +246,7 @@ inline void __syang0__fl__E__del46cc__199__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -288,15 +309,22 @@ decompressPrintArgs__E__del46cc__199__ (const char **in,
 
 inline void __syang0__fl__A__mar46cc__293__(NanoLog::LogLevel level, const char* fmtStr ) {
     extern const uint32_t __fmtId__A__mar46cc__293__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__A__mar46cc__293__),
+            "mar.cc", 293, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__A__mar46cc__293__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -310,7 +338,7 @@ inline void __syang0__fl__A__mar46cc__293__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -373,15 +401,22 @@ decompressPrintArgs__A__mar46cc__293__ (const char **in,
 
 inline void __syang0__fl__C__mar46cc__200__(NanoLog::LogLevel level, const char* fmtStr ) {
     extern const uint32_t __fmtId__C__mar46cc__200__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__C__mar46cc__200__),
+            "mar.cc", 200, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize =   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__C__mar46cc__200__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -395,7 +430,7 @@ inline void __syang0__fl__C__mar46cc__200__(NanoLog::LogLevel level, const char*
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -458,15 +493,22 @@ decompressPrintArgs__C__mar46cc__200__ (const char **in,
 
 inline void __syang0__fl__E32374s3237424642lf__s46cc__100__(NanoLog::LogLevel level, const char* fmtStr , const char* arg0, int arg1, int arg2, double arg3) {
     extern const uint32_t __fmtId__E32374s3237424642lf__s46cc__100__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__E32374s3237424642lf__s46cc__100__),
+            "s.cc", 100, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     size_t str0Len = 1 + strlen(arg0);;
     size_t allocSize = sizeof(arg1) + sizeof(arg2) + sizeof(arg3) +  str0Len +  sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__E32374s3237424642lf__s46cc__100__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -483,7 +525,7 @@ inline void __syang0__fl__E32374s3237424642lf__s46cc__100__(NanoLog::LogLevel le
     memcpy(buffer, arg0, str0Len); buffer += str0Len;*(reinterpret_cast<std::remove_const<typename std::remove_pointer<decltype(arg0)>::type>::type*>(buffer) - 1) = L'\0';
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -558,15 +600,22 @@ decompressPrintArgs__E32374s3237424642lf__s46cc__100__ (const char **in,
 
 inline void __syang0__fl__D3237d__s46cc__100__(NanoLog::LogLevel level, const char* fmtStr , int arg0) {
     extern const uint32_t __fmtId__D3237d__s46cc__100__;
+    static int siteFilter = NanoLogInternal::LOG_SITE_UNRESOLVED;
 
-    if (level > NanoLog::getLogLevel())
+    if (!NanoLogInternal::RuntimeLogger::isLogSiteEnabled(siteFilter,
+            reinterpret_cast<const int*>(&__fmtId__D3237d__s46cc__100__),
+            "s.cc", 100, level, fmtStr))
         return;
 
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp = NanoLogInternal::RuntimeLogger::readTimestamp<NanoLogConfig::TIMESTAMP_SOURCE>();
     ;
     size_t allocSize = sizeof(arg0) +   sizeof(NanoLogInternal::Log::UncompressedEntry);
     NanoLogInternal::Log::UncompressedEntry *re = reinterpret_cast<NanoLogInternal::Log::UncompressedEntry*>(NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize));
 
+    // The buffer is full and the overflow policy is to drop the message
+    if (re == nullptr)
+        return;
+
     re->fmtId = __fmtId__D3237d__s46cc__100__;
     re->timestamp = timestamp;
     re->entrySize = static_cast<uint32_t>(allocSize);
@@ -581,7 +630,7 @@ inline void __syang0__fl__D3237d__s46cc__100__(NanoLog::LogLevel level, const ch
     
 
     // Make the entry visible
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, level);
 }
 
 
@@ -718,6 +767,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 0;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 294;
     fm->filenameLength = 7;
 
@@ -734,6 +784,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = NONE;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("B")/sizeof(char);
 
             buffer = stpcpy(buffer, "B") + 1;
@@ -755,6 +806,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 0;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 1;
     fm->filenameLength = 6;
 
@@ -771,6 +823,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = NONE;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("A")/sizeof(char);
 
             buffer = stpcpy(buffer, "A") + 1;
@@ -792,6 +845,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 0;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 199;
     fm->filenameLength = 7;
 
@@ -808,6 +862,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = NONE;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("E")/sizeof(char);
 
             buffer = stpcpy(buffer, "E") + 1;
@@ -829,6 +884,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 0;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 293;
     fm->filenameLength = 7;
 
@@ -845,6 +901,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = NONE;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("A")/sizeof(char);
 
             buffer = stpcpy(buffer, "A") + 1;
@@ -866,6 +923,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 0;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 200;
     fm->filenameLength = 7;
 
@@ -882,6 +940,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = NONE;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("C")/sizeof(char);
 
             buffer = stpcpy(buffer, "C") + 1;
@@ -903,6 +962,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 3;
     fm->numPrintFragments = 2;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 100;
     fm->filenameLength = 5;
 
@@ -919,6 +979,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = const_char_ptr_t;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("E %4s")/sizeof(char);
 
             buffer = stpcpy(buffer, "E %4s") + 1;
@@ -934,6 +995,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = double_t;
             pf->hasDynamicWidth = true;
             pf->hasDynamicPrecision = true;
+            pf->internedString = false;
             pf->fragmentLength = sizeof(" %*.*lf")/sizeof(char);
 
             buffer = stpcpy(buffer, " %*.*lf") + 1;
@@ -955,6 +1017,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
     fm->numNibbles = 1;
     fm->numPrintFragments = 1;
     fm->logLevel = DEBUG;
+    fm->timestampSource = NanoLogConfig::TIMESTAMP_SOURCE;
     fm->lineNumber = 100;
     fm->filenameLength = 5;
 
@@ -971,6 +1034,7 @@ long int writeDictionary(char *buffer, char *endOfBuffer) {
             pf->argType = int_t;
             pf->hasDynamicWidth = false;
             pf->hasDynamicPrecision = false;
+            pf->internedString = false;
             pf->fragmentLength = sizeof("D %d")/sizeof(char);
 
             buffer = stpcpy(buffer, "D %d") + 1;
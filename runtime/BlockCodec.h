@@ -0,0 +1,375 @@
+/* Copyright (c) 2016-2019 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+
+#ifndef BLOCKCODEC_H
+#define BLOCKCODEC_H
+
+/**
+ * This file contains the general purpose compressor(s) that NanoLog can apply
+ * to whole output buffers on top of the pack()-ing in Packer.h (see
+ * NanoLog::setBlockCompression()). The packing removes the redundancy within
+ * a single log message, whereas these find the redundancy across messages,
+ * such as repeated string arguments.
+ *
+ * ** Implementation **
+ *
+ * The compressor emits the LZ4 block format, so the blocks could be
+ * inflated by any LZ4 implementation, but it is implemented here to keep the
+ * runtime free of external dependencies. The block is a sequence of
+ *      (1 byte)   token: 4-bit literal length and 4-bit match length - 4
+ *      (0-n bytes) literal length - 15 in 255 increments (if nibble is 15)
+ *      (0-n bytes) literals
+ *      (2 bytes)  little-endian offset of the match (1-65535 bytes back)
+ *      (0-n bytes) match length - 19 in 255 increments (if nibble is 15)
+ * The last sequence is only made up of literals and, as in LZ4, the last
+ * LAST_LITERALS bytes of a block are never part of a match.
+ */
+namespace BlockCodec {
+
+/**
+ * Identifies the algorithm a block was compressed with in the compressed
+ * log. The values must match those of NanoLog::BlockCompression.
+ */
+enum Algorithm : uint8_t {
+    // The block is stored as is
+    NONE = 0,
+
+    // The block is in the LZ4 block format
+    LZ4 = 1
+};
+
+// Shortest match the block format can encode
+static const uint32_t MIN_MATCH = 4;
+
+// Number of bytes at the end of a block that are always literals
+static const uint32_t LAST_LITERALS = 5;
+
+// Matches have to start at least this many bytes before the end of a block
+static const uint32_t MATCH_FIND_LIMIT = 12;
+
+// Largest distance between a match and the bytes it repeats
+static const uint32_t MAX_DISTANCE = 65535;
+
+// Log2 of the number of entries in the compressor's hash table
+static const int HASH_LOG = 14;
+
+/**
+ * Loads 4 bytes from a possibly unaligned address.
+ */
+inline uint32_t
+read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Loads 8 bytes from a possibly unaligned address.
+ */
+inline uint64_t
+read64(const char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Hashes the 4 bytes at the current position into the compressor's table.
+ */
+inline uint32_t
+hash(uint32_t sequence) {
+    return (sequence*2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+ * Appends the bytes that extend a length whose nibble in the token is
+ * saturated (i.e. 15).
+ *
+ * \param length
+ *      Number of units in excess of the saturated nibble
+ * \param[in/out] out
+ *      Output position to append to; it's advanced past the bytes appended
+ */
+inline void
+appendLength(size_t length, char **out) {
+    while (length >= 255) {
+        *(*out)++ = static_cast<char>(255);
+        length -= 255;
+    }
+    *(*out)++ = static_cast<char>(length);
+}
+
+/**
+ * Appends one sequence (literals optionally followed by a match) to the
+ * compressed block.
+ *
+ * \param literals
+ *      Literals that precede the match
+ * \param numLiterals
+ *      Number of literals
+ * \param offset
+ *      Distance of the match from its start (ignored if matchLength is 0)
+ * \param matchLength
+ *      Length of the match or 0 for the final, literal-only, sequence
+ * \param[in/out] out
+ *      Output position to append to; it's advanced past the sequence
+ * \param outEnd
+ *      End of the output buffer
+ *
+ * \return
+ *      false if the sequence does not fit in the output buffer
+ */
+inline bool
+appendSequence(const char *literals, size_t numLiterals, uint32_t offset,
+               size_t matchLength, char **out, const char *outEnd) {
+    // Worst case size of the token, the lengths, literals and offset
+    size_t maxBytes = 1 + (numLiterals/255 + 1) + numLiterals + 2
+                        + (matchLength/255 + 1);
+    if (maxBytes > static_cast<size_t>(outEnd - *out))
+        return false;
+
+    char *token = (*out)++;
+    uint8_t nibbles = 0;
+
+    if (numLiterals >= 15) {
+        nibbles = 15 << 4;
+        appendLength(numLiterals - 15, out);
+    } else {
+        nibbles = static_cast<uint8_t>(numLiterals << 4);
+    }
+
+    memcpy(*out, literals, numLiterals);
+    *out += numLiterals;
+
+    if (matchLength != 0) {
+        *(*out)++ = static_cast<char>(offset & 0xFF);
+        *(*out)++ = static_cast<char>(offset >> 8);
+
+        size_t length = matchLength - MIN_MATCH;
+        if (length >= 15) {
+            nibbles |= 15;
+            appendLength(length - 15, out);
+        } else {
+            nibbles |= static_cast<uint8_t>(length);
+        }
+    }
+
+    *token = static_cast<char>(nibbles);
+    return true;
+}
+
+/**
+ * Compresses a block of bytes with the LZ4 block format. The compressor
+ * greedily takes the first match its hash table finds and skips ahead faster
+ * the longer it goes without one, so incompressible data costs little time.
+ *
+ * \param in
+ *      Bytes to compress
+ * \param inBytes
+ *      Number of bytes to compress
+ * \param[out] out
+ *      Buffer to compress into
+ * \param outCapacity
+ *      Byte size of the out buffer
+ *
+ * \return
+ *      Number of bytes compressed into out, or 0 if the compressed block
+ *      would not fit in outCapacity bytes
+ */
+inline size_t
+compress(const char *in, size_t inBytes, char *out, size_t outCapacity) {
+    std::vector<uint32_t> table(1U << HASH_LOG, 0);
+
+    const char *ip = in;
+    const char *anchor = in;
+    const char *inEnd = in + inBytes;
+    char *op = out;
+    const char *outEnd = out + outCapacity;
+
+    if (inBytes > MATCH_FIND_LIMIT) {
+        const char *matchFindLimit = inEnd - MATCH_FIND_LIMIT;
+        const char *matchLimit = inEnd - LAST_LITERALS;
+
+        while (ip < matchFindLimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t &slot = table[hash(sequence)];
+            const char *match = in + slot;
+            slot = static_cast<uint32_t>(ip - in);
+
+            if (match >= ip || static_cast<size_t>(ip - match) > MAX_DISTANCE
+                    || read32(match) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Grow the match backwards over the pending literals
+            while (ip > anchor && match > in && ip[-1] == match[-1]) {
+                --ip;
+                --match;
+            }
+
+            // ... and then forwards, 8 bytes at a time
+            const char *matchEnd = ip + MIN_MATCH;
+            const char *ref = match + MIN_MATCH;
+            while (matchEnd < matchLimit) {
+                if (matchEnd + sizeof(uint64_t) > matchLimit) {
+                    if (*matchEnd != *ref)
+                        break;
+
+                    ++matchEnd;
+                    ++ref;
+                    continue;
+                }
+
+                uint64_t diff = read64(matchEnd) ^ read64(ref);
+                if (diff != 0) {
+                    matchEnd += __builtin_ctzll(diff) >> 3;
+                    break;
+                }
+
+                matchEnd += sizeof(uint64_t);
+                ref += sizeof(uint64_t);
+            }
+
+            if (!appendSequence(anchor, static_cast<size_t>(ip - anchor),
+                                static_cast<uint32_t>(ip - match),
+                                static_cast<size_t>(matchEnd - ip),
+                                &op, outEnd))
+                return 0;
+
+            ip = anchor = matchEnd;
+
+            // Index a position within the match to find its repeats sooner
+            if (ip < matchFindLimit) {
+                table[hash(read32(ip - 2))] =
+                                        static_cast<uint32_t>(ip - 2 - in);
+            }
+        }
+    }
+
+    if (!appendSequence(anchor, static_cast<size_t>(inEnd - anchor), 0, 0,
+                        &op, outEnd))
+        return 0;
+
+    return static_cast<size_t>(op - out);
+}
+
+/**
+ * Reads a length extended past its saturated nibble (see appendLength()).
+ *
+ * \param[in/out] in
+ *      Position of the extension bytes; it's advanced past them
+ * \param inEnd
+ *      End of the compressed block
+ * \param[in/out] length
+ *      Length to add the extension bytes to
+ *
+ * \return
+ *      false if the block ends in the middle of the length
+ */
+inline bool
+readLength(const char **in, const char *inEnd, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in >= inEnd)
+            return false;
+
+        byte = static_cast<uint8_t>(*(*in)++);
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/**
+ * Decompresses a block produced by compress() (or any LZ4 block compressor).
+ *
+ * \param in
+ *      Compressed block
+ * \param inBytes
+ *      Byte size of the compressed block
+ * \param[out] out
+ *      Buffer to decompress into
+ * \param outCapacity
+ *      Byte size of the out buffer
+ *
+ * \return
+ *      Number of bytes decompressed into out, or -1 if the block is
+ *      corrupt or decompresses to more than outCapacity bytes
+ */
+inline int64_t
+decompress(const char *in, size_t inBytes, char *out, size_t outCapacity) {
+    const char *ip = in;
+    const char *inEnd = in + inBytes;
+    char *op = out;
+    char *outEnd = out + outCapacity;
+
+    while (ip < inEnd) {
+        uint8_t token = static_cast<uint8_t>(*ip++);
+
+        size_t numLiterals = token >> 4;
+        if (numLiterals == 15 && !readLength(&ip, inEnd, &numLiterals))
+            return -1;
+
+        if (numLiterals > static_cast<size_t>(inEnd - ip) ||
+                numLiterals > static_cast<size_t>(outEnd - op))
+            return -1;
+
+        memcpy(op, ip, numLiterals);
+        ip += numLiterals;
+        op += numLiterals;
+
+        // The last sequence has no match
+        if (ip == inEnd)
+            break;
+
+        if (inEnd - ip < 2)
+            return -1;
+
+        size_t offset = static_cast<uint8_t>(ip[0]) |
+                        (static_cast<size_t>(static_cast<uint8_t>(ip[1])) << 8);
+        ip += 2;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(&ip, inEnd, &matchLength))
+            return -1;
+        matchLength += MIN_MATCH;
+
+        if (offset == 0 || offset > static_cast<size_t>(op - out) ||
+                matchLength > static_cast<size_t>(outEnd - op))
+            return -1;
+
+        // Matches may overlap the bytes they produce (i.e. repeat a pattern)
+        const char *match = op - offset;
+        if (offset >= matchLength) {
+            memcpy(op, match, matchLength);
+            op += matchLength;
+        } else {
+            for (size_t i = 0; i < matchLength; ++i)
+                *op++ = *match++;
+        }
+    }
+
+    return static_cast<int64_t>(op - out);
+}
+
+}; // namespace BlockCodec
+
+#endif /* BLOCKCODEC_H */
@@ -0,0 +1,139 @@
+/* Copyright (c) 2016-2019 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "BlockCodec.h"
+
+#include "gtest/gtest.h"
+
+using namespace BlockCodec;
+namespace {
+
+// The fixture for testing the block compressor.
+class BlockCodecTest : public ::testing::Test {
+    protected:
+    BlockCodecTest()
+        : compressed(1 << 20)
+        , inflated(1 << 20)
+    {
+    }
+
+    virtual ~BlockCodecTest() {
+    }
+
+    /**
+     * Compresses and then decompresses a string, returning the result.
+     */
+    std::string
+    roundTrip(const std::string &in, size_t *compressedBytes=nullptr) {
+        size_t bytes = compress(in.data(), in.size(), compressed.data(),
+                                compressed.size());
+        if (compressedBytes)
+            *compressedBytes = bytes;
+
+        int64_t inflatedBytes = decompress(compressed.data(), bytes,
+                                           inflated.data(), inflated.size());
+        if (inflatedBytes < 0)
+            return "<corrupt>";
+
+        return std::string(inflated.data(), inflatedBytes);
+    }
+
+    std::vector<char> compressed;
+    std::vector<char> inflated;
+};
+
+TEST_F(BlockCodecTest, roundTrip_short) {
+    EXPECT_EQ("", roundTrip(""));
+    EXPECT_EQ("a", roundTrip("a"));
+    EXPECT_EQ("aaaaaaaaaaaa", roundTrip("aaaaaaaaaaaa"));
+    EXPECT_EQ("aaaaaaaaaaaaa", roundTrip("aaaaaaaaaaaaa"));
+
+    // An empty block is a lone token
+    size_t bytes;
+    roundTrip("", &bytes);
+    EXPECT_EQ(1U, bytes);
+}
+
+TEST_F(BlockCodecTest, roundTrip_repetitive) {
+    std::string in;
+    for (int i = 0; i < 1000; ++i)
+        in += "Log message " + std::to_string(i % 17) + " with a string\n";
+
+    size_t bytes;
+    EXPECT_EQ(in, roundTrip(in, &bytes));
+    EXPECT_LT(bytes, in.size()/10);
+
+    // Long runs overlap the bytes they copy
+    std::string run(100000, 'x');
+    EXPECT_EQ(run, roundTrip(run, &bytes));
+    EXPECT_LT(bytes, 500U);
+}
+
+TEST_F(BlockCodecTest, roundTrip_random) {
+    srand(12345);
+    std::string in;
+    for (int i = 0; i < 200000; ++i) {
+        // Mix incompressible stretches with repeats further than a match
+        // can reach back
+        if (i % 1000 < 900)
+            in += static_cast<char>(rand());
+        else
+            in += in[in.size()/2];
+    }
+
+    size_t bytes;
+    EXPECT_EQ(in, roundTrip(in, &bytes));
+    EXPECT_LT(bytes, in.size() + in.size()/100);
+}
+
+TEST_F(BlockCodecTest, compress_tooSmall) {
+    std::string in;
+    for (int i = 0; i < 1000; ++i)
+        in += static_cast<char>(i*7919);
+
+    EXPECT_EQ(0U, compress(in.data(), in.size(), compressed.data(), 100));
+    EXPECT_LT(0U, compress(in.data(), in.size(), compressed.data(),
+                           compressed.size()));
+}
+
+TEST_F(BlockCodecTest, decompress_corrupt) {
+    std::string in(1000, 'y');
+    in += "tail of the block";
+    size_t bytes = compress(in.data(), in.size(), compressed.data(),
+                            compressed.size());
+    ASSERT_LT(0U, bytes);
+
+    // Output too small
+    EXPECT_EQ(-1, decompress(compressed.data(), bytes, inflated.data(), 10));
+
+    // Truncated block
+    EXPECT_EQ(-1, decompress(compressed.data(), bytes - 1, inflated.data(),
+                             inflated.size()));
+
+    // Match pointing before the start of the output
+    const char badOffset[] = {0x10, 'a', 0x05, 0x00, 0x00};
+    EXPECT_EQ(-1, decompress(badOffset, sizeof(badOffset), inflated.data(),
+                             inflated.size()));
+
+    EXPECT_EQ(static_cast<int64_t>(in.size()),
+              decompress(compressed.data(), bytes, inflated.data(),
+                         in.size()));
+}
+
+}  // namespace
@@ -46,6 +46,32 @@ namespace NanoLogConfig {
         "OUTPUT_BUFFER_SIZE must be greater than or "
             "equal to the STAGING_BUFFER_SIZE");
 
+    // Bounds on the StagingBuffer and output buffer sizes that can be set at
+    // runtime via NanoLog::setStagingBufferSize() and setOutputBufferSize();
+    // the sizes above are only the defaults. A StagingBuffer must still be
+    // larger than the largest log message logged to it.
+    static const uint32_t MIN_STAGING_BUFFER_SIZE = 1<<12;
+    static const uint32_t MAX_STAGING_BUFFER_SIZE = 1<<30;
+    static const uint32_t MIN_OUTPUT_BUFFER_SIZE = 1<<20;
+    static const uint32_t MAX_OUTPUT_BUFFER_SIZE = 1<<30;
+
+    // Determines how the StagingBuffers are placed in memory (these can be
+    // changed at runtime via NanoLog::setStagingBufferPlacement()). Each
+    // buffer is preferably placed on the NUMA node of the thread that
+    // allocates it (i.e. its producer) and can be backed by 2MB huge pages,
+    // which rounds the buffers up to a multiple of 2MB. Buffers that are not
+    // backed by huge pages can instead be mapped twice back to back so that
+    // log messages never wrap around their ends.
+    static const bool NUMA_LOCAL_STAGING_BUFFERS = true;
+    static const bool STAGING_BUFFER_HUGE_PAGES = false;
+    static const bool MIRRORED_STAGING_BUFFERS = false;
+
+    // Maximum number of drained StagingBuffers kept around after their threads
+    // exit so that new threads can adopt them instead of allocating (and
+    // faulting in) fresh ones. A pooled buffer is only adopted by a thread
+    // asking for the same size and placement; 0 disables the pool.
+    static const uint32_t STAGING_BUFFER_POOL_SIZE = 16;
+
     // The threshold at which the consumer should release space back to the
     // producer in the thread-local StagingBuffer. Due to the blocking nature
     // of the producer when it runs out of space, a low value will incur more
@@ -53,8 +79,44 @@ namespace NanoLogConfig {
     // the opposite effect.
     static const uint32_t RELEASE_THRESHOLD = STAGING_BUFFER_SIZE>>1;
 
-    // How often should the background compression thread wake up to check
-    // for more log messages in the StagingBuffers to compress and output.
+    // A producer whose StagingBuffer has less than 1/NEARLY_FULL_FRACTION of
+    // its space free (or that blocks on it) hints its compression thread to
+    // start the next pass through the StagingBuffers at it. To bound the delay
+    // of the other buffers, at most MAX_PRIORITIZED_PASSES passes in a row
+    // start at such a buffer rather than where the previous pass stopped.
+    static const uint32_t NEARLY_FULL_FRACTION = 8;
+    static const uint32_t MAX_PRIORITIZED_PASSES = 4;
+
+    // Number of background compression threads NanoLog starts with. Each
+    // thread drains a disjoint shard of the StagingBuffers with its own
+    // output buffers (2*OUTPUT_BUFFER_SIZE bytes per thread), so this should
+    // be raised when a single thread cannot keep up with the logging threads.
+    // It can also be changed at runtime via NanoLog::setCompressionThreads().
+    static const uint32_t NUM_COMPRESSION_THREADS = 1;
+
+    // Number of output buffers each compression thread may have in flight to
+    // the kernel at once with the NanoLog::IO_URING output engine. Each thread
+    // allocates IO_URING_QUEUE_DEPTH + 1 output buffers in that mode so that it
+    // can keep compressing while the previous buffers are being written out.
+    static const uint32_t IO_URING_QUEUE_DEPTH = 2;
+
+    // Number of output buffers each compression thread may have in flight at
+    // once with the NanoLog::COLLECTOR output engine; buffers sent with
+    // MSG_ZEROCOPY stay in flight until the kernel is done with their pages.
+    // Buffers smaller than COLLECTOR_ZEROCOPY_MIN_BYTES are always copied as
+    // pinning their pages costs more than the copy.
+    static const uint32_t COLLECTOR_QUEUE_DEPTH = 2;
+    static const uint32_t COLLECTOR_ZEROCOPY_MIN_BYTES = 16384;
+
+    // A connection to the log collector that makes no progress for this long
+    // is considered lost, and reconnecting is retried with a backoff that
+    // doubles up to COLLECTOR_RECONNECT_MAX_BACKOFF_US.
+    static const uint32_t COLLECTOR_SEND_TIMEOUT_MS = 1000;
+    static const uint32_t COLLECTOR_RECONNECT_MIN_BACKOFF_US = 10000;
+    static const uint32_t COLLECTOR_RECONNECT_MAX_BACKOFF_US = 5000000;
+
+    // How long the background compression thread initially sleeps between
+    // checks for more log messages once it starts backing off while idle.
     // Due to overheads in the kernel, this number will a lower bound and
     // the actual time spent sleeping may be significantly higher.
     static const uint32_t POLL_INTERVAL_NO_WORK_US = 1;
@@ -64,6 +126,44 @@ namespace NanoLogConfig {
     // to complete. Due to overheads in the kernel, this number will
     // be a lower bound and the actual time spent sleeping may be higher.
     static const uint32_t POLL_INTERVAL_DURING_IO_US = 1;
+
+    // Controls how the compression thread idles once it runs out of work.
+    // It first keeps polling the StagingBuffers without sleeping for
+    // IDLE_SPIN_DURATION_US, then sleeps between polls for exponentially
+    // increasing intervals (from POLL_INTERVAL_NO_WORK_US up to
+    // IDLE_MAX_BACKOFF_US), and finally parks until a logging thread wakes
+    // it up. A parked thread still wakes up every IDLE_PARK_TIMEOUT_US in
+    // case it missed a wakeup, so a log message that races with the park
+    // waits at most that long (10ms by default) to be picked up.
+    static const uint32_t IDLE_SPIN_DURATION_US = 50;
+    static const uint32_t IDLE_MAX_BACKOFF_US = 1000;
+    static const uint32_t IDLE_PARK_TIMEOUT_US = 10000;
+
+    // A compression agent (see NanoLog::setCompressionAgent()) looks for new
+    // processes, new StagingBuffers and processes that exited this often.
+    // sync() gives up on the agent once it hasn't made progress on the
+    // process's StagingBuffers for COMPRESSION_AGENT_SYNC_TIMEOUT_US, e.g.
+    // because no agent is running.
+    static const uint32_t COMPRESSION_AGENT_SCAN_US = 100000;
+    static const uint32_t COMPRESSION_AGENT_SYNC_TIMEOUT_US = 1000000;
+
+    // How often the background compression thread records a reading of the
+    // wall clock (CLOCK_REALTIME) along with the rdtsc() in the log file,
+    // which lets the decompressor correct the drift of the wall times it
+    // derives from the rdtsc() in long running processes. 0 disables them.
+    static const uint32_t CLOCK_CALIBRATION_INTERVAL_MS = 10000;
+}
+
+// NanoLog.h includes the runtime headers, which need the constants above, so
+// the constants that depend on its enums come after it.
+#include "NanoLog.h"
+
+namespace NanoLogConfig {
+    // Determines how the log statements read their timestamps, unless the
+    // C++17 version of NanoLog overrides it for a log statement with
+    // NANO_LOG_TIMESTAMP() (see NanoLog::TimestampSource).
+    static const NanoLog::TimestampSource TIMESTAMP_SOURCE =
+                                                    NanoLog::TIMESTAMP_RDTSC;
 }
 
 #endif /* CONFIG_H */
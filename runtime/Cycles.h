@@ -44,7 +44,24 @@ class Cycles {
 #endif
         uint32_t lo, hi;
         __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
-//        __asm__ __volatile__("rdtscp" : "=a" (lo), "=d" (hi) : : "%rcx");
+        return (((uint64_t)hi << 32) | lo);
+    }
+
+    /**
+     * Return the current value of the fine-grain CPU cycle counter once all
+     * the preceding instructions have executed (accessed via the RDTSCP
+     * instruction).
+     */
+    static __inline __attribute__((always_inline))
+    uint64_t
+    rdtscp()
+    {
+#if TESTING
+        if (mockTscValue)
+            return mockTscValue;
+#endif
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtscp" : "=a" (lo), "=d" (hi) : : "%rcx");
         return (((uint64_t)hi << 32) | lo);
     }
 
@@ -14,11 +14,37 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 #include <bits/algorithmfwd.h>
 #include <regex>
+#include <thread>
 #include <vector>
 
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BlockCodec.h"
 #include "Log.h"
 #include "GeneratedCode.h"
 
@@ -75,1963 +101,7414 @@ Log::insertCheckpoint(char **out, char *outLimit, bool writeDictionary) {
 
     return true;
 }
+
 /**
- * Encoder constructor. The construction of an Encoder should logically
- * correlate with the start of a new log file as it will embed unique metadata
- * information at the beginning of log file/buffer.
+ * Serializes the static information of a log invocation site for the crash
+ * recovery dictionary (see RecoverySite).
  *
- * \param buffer
- *      Buffer to encode log messages and metadata to
- * \param bufferSize
- *      The number of bytes usable within the buffer
- * \param skipCheckpoint
- *      Optional parameter to skip embedding metadata information at the
- *      beginning of the buffer. This parameter should never bet set except
- *      in unit tests.
+ * \param fmtId
+ *      Log identifier the site was assigned
+ * \param info
+ *      Static information of the site
+ *
+ * \return
+ *      The RecoverySite and the data that follows it
  */
-Log::Encoder::Encoder(char *buffer,
-                                size_t bufferSize,
-                                bool skipCheckpoint,
-                                bool forceDictionaryOutput)
-    : backing_buffer(buffer)
-    , writePos(buffer)
-    , endOfBuffer(buffer + bufferSize)
-    , lastBufferIdEncoded(-1)
-    , currentExtentSize(nullptr)
-    , encodeMissDueToMetadata(0)
-    , consecutiveEncodeMissesDueToMetadata(0)
+std::string
+Log::encodeRecoverySite(uint32_t fmtId, const StaticLogInfo &info)
 {
-    assert(buffer);
+    RecoverySite site;
+    site.fmtId = fmtId;
+    site.lineNumber = info.lineNum;
+    site.logLevel = packSeverity(info.severity, info.timestampSource);
+    site.numParams = downCast<uint16_t>(info.numParams);
+    site.filenameLength = downCast<uint16_t>(strlen(info.filename) + 1);
+    site.formatStringLength = downCast<uint32_t>(strlen(info.formatString) + 1);
+
+    std::string out(reinterpret_cast<const char*>(&site), sizeof(site));
+    for (int i = 0; i < info.numParams; ++i) {
+        int32_t paramType = info.paramTypes[i];
+        out.append(reinterpret_cast<const char*>(&paramType),
+                   sizeof(paramType));
+    }
 
-    // Start the buffer off with a checkpoint
-    if (skipCheckpoint && !forceDictionaryOutput)
-        return;
+    for (int i = 0; i < info.numParams; ++i)
+        out.push_back(static_cast<char>(info.argStorage ? info.argStorage[i]
+                                                        : 0));
 
-#ifdef PREPROCESSOR_NANOLOG
-    bool writeDictionary = true;
-#else
-    bool writeDictionary = forceDictionaryOutput;
-#endif
+    out.append(info.filename, site.filenameLength);
+    out.append(info.formatString, site.formatStringLength);
+    return out;
+}
 
-    // In virtually all cases, our output buffer should have enough
-    // space to store the dictionary. If not, we fail in place.
-    if (!insertCheckpoint(&writePos, endOfBuffer, writeDictionary)) {
-        fprintf(stderr, "Internal Error: Not enough space allocated for "
-                        "dictionary file.\r\n");
+/**
+ * Log invocation site rebuilt from a crash recovery dictionary, along with
+ * the storage its StaticLogInfo points into.
+ */
+struct RecoveredSite {
+    RecoveredSite()
+        : filename()
+        , formatString()
+        , lineNumber(0)
+        , logLevel(0)
+        , timestampSource(NanoLog::TIMESTAMP_RDTSC)
+        , layout()
+    {}
+
+    std::string filename;
+    std::string formatString;
+    uint32_t lineNumber;
+    uint8_t logLevel;
+    NanoLog::TimestampSource timestampSource;
+
+    // numParams, followed by the ParamType and then the argStorage of each
+    // argument. StaticLogInfo::paramTypes points one past numParams, which
+    // lets compressRecoveredArgs() find the rest.
+    std::vector<int32_t> layout;
+};
 
-        exit(-1);
+/**
+ * Walks the arguments of an UncompressedEntry stored by the non-preprocessor
+ * version of NanoLog according to the layout of a RecoveredSite.
+ *
+ * \param layout
+ *      RecoveredSite::layout of the entry's site
+ * \param argData
+ *      Arguments of the entry
+ * \param limit
+ *      First byte past the arguments
+ *
+ * \return
+ *      True if the arguments exactly fill [argData, limit)
+ */
+static bool
+checkRecoveredArgs(const std::vector<int32_t> &layout, const char *argData,
+                   const char *limit)
+{
+    int numParams = layout[0];
+    for (int i = 0; i < numParams; ++i) {
+        uint64_t bytes = layout[1 + numParams + i] & ARG_STORAGE_SIZE_MASK;
+        if (layout[1 + i] > ParamType::NON_STRING) {
+            uint32_t stringBytes;
+            if (limit - argData < static_cast<long>(sizeof(stringBytes)))
+                return false;
+            memcpy(&stringBytes, argData, sizeof(stringBytes));
+            bytes = sizeof(stringBytes) + uint64_t(stringBytes);
+        } else if (bytes == 0) {
+            return false;
+        }
+
+        if (static_cast<uint64_t>(limit - argData) < bytes)
+            return false;
+        argData += bytes;
     }
+
+    return argData == limit;
 }
 
 /**
- * Given a vector of StaticLogInfo and a starting index, encode all the static
- * log information into a partial dictionary for the Decompressor to use.
+ * Packs an argument of an UncompressedEntry the way the non-preprocessor
+ * version of NanoLog's compression functions would.
  *
- * \param[in/out] currentPosition
- *      Starting/Ending index
- * \param allMetadata
- *      All the static log information encountered so far
+ * \tparam T
+ *      Type the argument was stored as
+ *
+ * \param[in/out] out
+ *      Output buffer to pack the argument into
+ * \param arg
+ *      Argument within the UncompressedEntry, which need not be aligned
  *
  * \return
- *      Number of bytes encoded in the dictionary
+ *      The nibble describing the packed argument
  */
-uint32_t
-Log::Encoder::encodeNewDictionaryEntries(uint32_t& currentPosition,
-                                        std::vector<StaticLogInfo> allMetadata)
+template<typename T>
+static inline int
+packRecoveredArg(char **out, const char *arg)
 {
-    char *bufferStart = writePos;
+    T value;
+    memcpy(&value, arg, sizeof(T));
+    return BufferUtils::pack(out, value);
+}
 
-    if (sizeof(DictionaryFragment) >=
-                                static_cast<uint32_t>(endOfBuffer - writePos))
-        return 0;
+/**
+ * Compresses the arguments of an UncompressedEntry into the same format as
+ * the non-preprocessor version of NanoLog's compression functions (nibbles
+ * and packed non-string arguments, then the null-terminated strings), going
+ * by the argument layout recorded in the crash recovery dictionary rather
+ * than the argument types. The layout is found in front of the paramTypes
+ * (see RecoveredSite::layout).
+ *
+ * \param numNibbles
+ *      Number of non-string arguments
+ * \param paramTypes
+ *      ParamType of each argument, placed within a RecoveredSite::layout
+ * \param[in/out] in
+ *      Arguments of the UncompressedEntry
+ * \param[in/out] out
+ *      Output buffer to compress the arguments into
+ */
+static void
+compressRecoveredArgs(int numNibbles, const ParamType *paramTypes, char **in,
+                      char **out)
+{
+    const int32_t *layout = reinterpret_cast<const int32_t*>(paramTypes) - 1;
+    int numParams = layout[0];
+    const int32_t *argStorage = layout + 1 + numParams;
+
+    auto *nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(*out);
+    int numNibbleBytes = (numNibbles + 1)/2;
+    memset(nibbles, 0, numNibbleBytes);
+    *out += numNibbleBytes;
+
+    char *args = *in;
+    int nibbleCnt = 0;
+    for (int i = 0; i < numParams; ++i) {
+        uint32_t bytes = argStorage[i] & ARG_STORAGE_SIZE_MASK;
+        if (paramTypes[i] > ParamType::NON_STRING) {
+            uint32_t stringBytes;
+            memcpy(&stringBytes, *in, sizeof(stringBytes));
+            *in += sizeof(stringBytes) + stringBytes;
+            continue;
+        }
 
-    DictionaryFragment *df = reinterpret_cast<DictionaryFragment*>(writePos);
-    writePos += sizeof(DictionaryFragment);
-    df->entryType = EntryType::LOG_MSGS_OR_DIC;
+        int nibble;
+        const char *arg = *in;
+        if (argStorage[i] & ARG_STORAGE_FLOATING_POINT) {
+            if (bytes == sizeof(float))
+                nibble = packRecoveredArg<float>(out, arg);
+            else if (bytes == sizeof(double))
+                nibble = packRecoveredArg<double>(out, arg);
+            else
+                nibble = packRecoveredArg<long double>(out, arg);
+        } else if (argStorage[i] & ARG_STORAGE_SIGNED) {
+            if (bytes == 1)
+                nibble = packRecoveredArg<int8_t>(out, arg);
+            else if (bytes == 2)
+                nibble = packRecoveredArg<int16_t>(out, arg);
+            else if (bytes == 4)
+                nibble = packRecoveredArg<int32_t>(out, arg);
+            else
+                nibble = packRecoveredArg<int64_t>(out, arg);
+        } else {
+            if (bytes == 1)
+                nibble = packRecoveredArg<uint8_t>(out, arg);
+            else if (bytes == 2)
+                nibble = packRecoveredArg<uint16_t>(out, arg);
+            else if (bytes == 4)
+                nibble = packRecoveredArg<uint32_t>(out, arg);
+            else
+                nibble = packRecoveredArg<uint64_t>(out, arg);
+        }
 
-    while (currentPosition < allMetadata.size()) {
-        StaticLogInfo &curr = allMetadata.at(currentPosition);
-        size_t filenameLength = strlen(curr.filename) + 1;
-        size_t formatLength = strlen(curr.formatString) + 1;
-        size_t nextDictSize = sizeof(CompressedLogInfo)
-                                    + filenameLength
-                                    + formatLength;
+        if (nibbleCnt & 0x1)
+            nibbles[nibbleCnt/2].second = 0xf & nibble;
+        else
+            nibbles[nibbleCnt/2].first = 0xf & nibble;
+        ++nibbleCnt;
+        *in += bytes;
+    }
 
-        // Not enough space, break out!
-        if (nextDictSize >= static_cast<uint32_t>(endOfBuffer - writePos))
-            break;
+    *in = args;
+    for (int i = 0; i < numParams; ++i) {
+        if (paramTypes[i] <= ParamType::NON_STRING) {
+            *in += argStorage[i] & ARG_STORAGE_SIZE_MASK;
+            continue;
+        }
 
-        CompressedLogInfo *cli = reinterpret_cast<CompressedLogInfo*>(writePos);
-        writePos += sizeof(CompressedLogInfo);
+        uint32_t stringBytes;
+        memcpy(&stringBytes, *in, sizeof(stringBytes));
+        *in += sizeof(stringBytes);
+        if ((argStorage[i] & ARG_STORAGE_ARRAY) == ARG_STORAGE_ARRAY) {
+            encodeArray(*in, stringBytes, out);
+            *in += stringBytes;
+            continue;
+        }
 
-        cli->severity = curr.severity;
-        cli->linenum = curr.lineNum;
-        cli->filenameLength = static_cast<uint16_t>(filenameLength);
-        cli->formatStringLength = static_cast<uint16_t>(formatLength);
+        if (argStorage[i] & ARG_STORAGE_BINARY) {
+            encodeHexDump(*in, stringBytes, out);
+            *in += stringBytes;
+            continue;
+        }
 
-        memcpy(writePos, curr.filename, filenameLength);
-        memcpy(writePos + filenameLength, curr.formatString, formatLength);
-        writePos += filenameLength + formatLength;
-        ++currentPosition;
-    }
+        if (argStorage[i] & ARG_STORAGE_USER_TYPE) {
+            encodeUserType(*in, stringBytes, out);
+            *in += stringBytes;
+            continue;
+        }
 
-    df->newMetadataBytes = 0x3FFFFFFF & static_cast<uint32_t>(
-                                                        writePos - bufferStart);
-    df->totalMetadataEntries = currentPosition;
-    return df->newMetadataBytes;
+        memcpy(*out, *in, stringBytes);
+        *in += stringBytes;
+        *out += stringBytes;
+
+        uint32_t characterWidth = (argStorage[i] & ARG_STORAGE_WIDE_STRING)
+                                        ? sizeof(wchar_t) : sizeof(char);
+        memset(*out, 0, characterWidth);
+        *out += characterWidth;
+    }
 }
 
 /**
- * Interprets the uncompressed log messages (created by the compile-time
- * generated code) contained in the *from buffer and compresses them to
- * the internal buffer. The encoded data can later be retrieved via swapBuffer()
+ * Reads a whole file into memory.
  *
- * \param from
- *      A buffer containing the uncompressed log message created by the
- *      compile-time generated code
- * \param nbytes
- *      Maximum number of bytes that can be extracted from the *from buffer
- * \param bufferId
- *      The runtime thread/StagingBuffer id to associate the logs with
- * \param newPass
- *      Indicates that this encoding correlates with starting a new pass
- *      through the runtime StagingBuffers. In other words, this should be true
- *      on the first invocation of this function after the runtime has checked
- *      and encoded all the StagingBuffers at least once.
- * \param[out] numEventsCompressed
- *      adds the number of log messages processed in this invocation
+ * \param filename
+ *      File to read
+ * \param[out] contents
+ *      Contents of the file
  *
  * \return
- *      The number of bytes read from *from. A value of 0 indicates there is
- *      insufficient space in the internal buffer to fit the compressed message.
+ *      True if successful
  */
-long
-Log::Encoder::encodeLogMsgs(char *from,
-                                    uint64_t nbytes,
-                                    uint32_t bufferId,
-                                    bool newPass,
-                                    uint64_t *numEventsCompressed)
+static bool
+readRecoveryFile(const std::string &filename, std::vector<char> &contents)
 {
-    if (!encodeBufferExtentStart(bufferId, newPass))
-        return 0;
-
-    uint64_t lastTimestamp = 0;
-    long remaining = nbytes;
-    long numEventsProcessed = 0;
-    char *bufferStart = writePos;
+    FILE *fd = fopen(filename.c_str(), "rb");
+    if (fd == nullptr)
+        return false;
 
-    while (remaining > 0) {
-        auto *entry = reinterpret_cast<UncompressedEntry*>(from);
+    contents.clear();
+    char chunk[64*1024];
+    size_t bytesRead;
+    while ((bytesRead = fread(chunk, 1, sizeof(chunk), fd)) > 0)
+        contents.insert(contents.end(), chunk, chunk + bytesRead);
 
-        if (entry->entrySize > remaining) {
-            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
-                break;
+    bool good = !ferror(fd);
+    fclose(fd);
+    return good;
+}
 
-            GeneratedFunctions::LogMetadata &lm
-                            = GeneratedFunctions::logId2Metadata[entry->fmtId];
-            fprintf(stderr, "ERROR: Attempting to log a message that is %u "
-                            "bytes while the maximum allowable size is %u.\r\n"
-                            "This occurs for the log message %s:%u '%s'\r\n",
-                            entry->entrySize,
-                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
-                            lm.fileName, lm.lineNumber, lm.fmtString);
-        }
+/**
+ * The log invocation sites of a process rebuilt from its crash recovery
+ * dictionary, for the crash recovery tool and the compression agent.
+ */
+struct RecoveredDictionary {
+    RecoveredDictionary()
+        : sites()
+        , siteRecovered()
+        , registry()
+    {}
+
+    // Sites indexed by their log identifiers. The deque keeps the sites in
+    // place as it grows since the registry points into them.
+    std::deque<RecoveredSite> sites;
+    std::vector<bool> siteRecovered;
+
+    // Sites registered in the order of their log identifiers, so that they
+    // get the same identifiers the process assigned them
+    InvocationSiteRegistry registry;
+};
 
-        // Check for free space using the worst case assumption that
-        // none of the arguments compressed and there are as many Nibbles
-        // as there are data bytes.
-        uint32_t maxCompressedSize = downCast<uint32_t>(2*entry->entrySize
-                                + sizeof(Log::UncompressedEntry));
-        if (maxCompressedSize > (endOfBuffer - writePos))
+/**
+ * Adds the RecoverySites in a piece of a crash recovery dictionary to a
+ * RecoveredDictionary, stopping at the first one that is incomplete (or
+ * malformed).
+ *
+ * \param dictionary
+ *      Dictionary to add the sites to
+ * \param data
+ *      RecoverySites to parse
+ * \param bytes
+ *      Number of bytes in data
+ *
+ * \return
+ *      Number of bytes of data parsed
+ */
+static size_t
+parseRecoverySites(RecoveredDictionary &dictionary, const char *data,
+                   size_t bytes)
+{
+    size_t pos = 0;
+    while (pos + sizeof(Log::RecoverySite) <= bytes) {
+        Log::RecoverySite site;
+        memcpy(&site, data + pos, sizeof(site));
+        const char *in = data + pos + sizeof(site);
+        size_t siteBytes = sizeof(site) + site.numParams*(sizeof(int32_t) + 1)
+                           + site.filenameLength + site.formatStringLength;
+        if (pos + siteBytes > bytes || site.filenameLength == 0 ||
+                site.formatStringLength == 0 || site.fmtId >= (1U << 24))
             break;
+        pos += siteBytes;
 
-        compressLogHeader(entry, &writePos, lastTimestamp);
-        lastTimestamp = entry->timestamp;
+        if (site.fmtId >= dictionary.sites.size()) {
+            dictionary.sites.resize(site.fmtId + 1);
+            dictionary.siteRecovered.resize(site.fmtId + 1, false);
+        }
 
-        size_t argBytesWritten =
-            GeneratedFunctions::compressFnArray[entry->fmtId](entry, writePos);
-        writePos += argBytesWritten;
+        // Threads that raced to register a site leave duplicates behind
+        if (dictionary.siteRecovered[site.fmtId])
+            continue;
 
-        remaining -= entry->entrySize;
-        from += entry->entrySize;
+        RecoveredSite &rs = dictionary.sites[site.fmtId];
+        dictionary.siteRecovered[site.fmtId] = true;
+        rs.lineNumber = site.lineNumber;
+        rs.logLevel = Log::SEVERITY_MASK & site.logLevel;
+        rs.timestampSource = Log::unpackTimestampSource(site.logLevel);
+        rs.layout.resize(1 + 2*site.numParams);
+        rs.layout[0] = site.numParams;
+        for (int i = 0; i < site.numParams; ++i) {
+            memcpy(&rs.layout[1 + i], in, sizeof(int32_t));
+            in += sizeof(int32_t);
+        }
+        for (int i = 0; i < site.numParams; ++i)
+            rs.layout[1 + site.numParams + i] = static_cast<uint8_t>(*in++);
 
-        ++numEventsProcessed;
+        rs.filename.assign(in, site.filenameLength - 1);
+        in += site.filenameLength;
+        rs.formatString.assign(in, site.formatStringLength - 1);
     }
 
-    assert(currentExtentSize);
-    *currentExtentSize += downCast<uint32_t>(writePos - bufferStart);
+    return pos;
+}
 
-    if (numEventsCompressed)
-        *numEventsCompressed += numEventsProcessed;
+/**
+ * Registers the sites of a RecoveredDictionary that aren't registered yet, in
+ * the order of their log identifiers. A site missing from the dictionary
+ * holds up the ones after it unless the gaps are to be filled, in which case
+ * it's registered as a placeholder that no entry can match.
+ *
+ * \param dictionary
+ *      Dictionary whose sites to register
+ * \param fillGaps
+ *      Register placeholders for the missing sites; this is for when no more
+ *      sites will be added to the dictionary
+ */
+static void
+registerRecoveredSites(RecoveredDictionary &dictionary, bool fillGaps)
+{
+    for (size_t id = dictionary.registry.size(); id < dictionary.sites.size();
+            ++id) {
+        RecoveredSite &rs = dictionary.sites[id];
+        if (!dictionary.siteRecovered[id]) {
+            if (!fillGaps)
+                return;
+
+            dictionary.registry.add(StaticLogInfo(nullptr, "", 0, 0, "", 0, 0,
+                                                  nullptr));
+            continue;
+        }
 
-    return nbytes - remaining;
-}
+        int numNibbles = 0;
+        for (int i = 0; i < rs.layout[0]; ++i) {
+            if (rs.layout[1 + i] <= ParamType::NON_STRING)
+                ++numNibbles;
+        }
 
+        dictionary.registry.add(StaticLogInfo(&compressRecoveredArgs,
+                        rs.filename.c_str(), rs.lineNumber, rs.logLevel,
+                        rs.formatString.c_str(), rs.layout[0], numNibbles,
+                        reinterpret_cast<const ParamType*>(&rs.layout[1]),
+                        nullptr, false, rs.timestampSource));
+    }
+}
 
 /**
- * Compresses a *from buffer filled with UncompressedEntry's and their
- * arguments to an internal buffer. The encoded data can then later be retrieved
- * via swapBuffer().
- *
- * This function is specialized for the non-preprocessor version of NanoLog and
- * requires a dictionary mapping logId's to static log information to be
- * explicitly passed in.
+ * Finds the run of intact entries at the start of a region of a StagingBuffer
+ * that another process logged to, which are the ones that can be handed to
+ * the Encoder: each has to lie within the region and, in the non-preprocessor
+ * version of NanoLog, match the argument layout of a registered site.
  *
- * \param from
- *      A buffer containing the uncompressed log message created by the
- *      the non-preprocessor version of NanoLog
- * \param nbytes
- *      Maximum number of bytes that can be extracted from the *from buffer
- * \param bufferId
- *      The runtime thread/StagingBuffer id to associate the logs with
- * \param newPass
- *      Indicates that this encoding correlates with starting a new pass
- *      through the runtime StagingBuffers. In other words, this should be true
- *      on the first invocation of this function after the runtime has checked
- *      and encoded all the StagingBuffers at least once.
- * \param[out] numEventsCompressed
- *      adds the number of log messages processed in this invocation
+ * \param dictionary
+ *      Sites of the process that logged
+ * \param preprocessor
+ *      Indicates that the process used the preprocessor version of NanoLog
+ * \param start
+ *      Start of the region
+ * \param end
+ *      End of the region
  *
  * \return
- *      The number of bytes read from *from. A value of 0 indicates there is
- *      insufficient space in the internal buffer to fit the compressed message.
+ *      End of the run of intact entries
  */
-long
-Log::Encoder::encodeLogMsgs(char *from,
-                            uint64_t nbytes,
-                            uint32_t bufferId,
-                            bool newPass,
-                            std::vector<StaticLogInfo> dictionary,
-                            uint64_t *numEventsCompressed)
+static char *
+findIntactEntries(const RecoveredDictionary &dictionary, bool preprocessor,
+                  char *start, char *end)
 {
-    if (!encodeBufferExtentStart(bufferId, newPass))
-        return 0;
+    char *validEnd = start;
+    while (static_cast<size_t>(end - validEnd) >= sizeof(Log::UncompressedEntry)) {
+        auto *entry = reinterpret_cast<Log::UncompressedEntry*>(validEnd);
+        if (entry->entrySize < sizeof(Log::UncompressedEntry) ||
+                entry->entrySize > static_cast<size_t>(end - validEnd))
+            break;
 
-    uint64_t lastTimestamp = 0;
-    long remaining = nbytes;
-    long numEventsProcessed = 0;
-    char *bufferStart = writePos;
+        if (preprocessor) {
+            if (entry->fmtId >= GeneratedFunctions::numLogIds)
+                break;
+        } else if (entry->fmtId >= dictionary.registry.size() ||
+                   !dictionary.siteRecovered[entry->fmtId] ||
+                   !checkRecoveredArgs(dictionary.sites[entry->fmtId].layout,
+                                       entry->argData,
+                                       validEnd + entry->entrySize)) {
+            break;
+        }
 
-    while (remaining > 0) {
-        auto *entry = reinterpret_cast<UncompressedEntry*>(from);
+        validEnd += entry->entrySize;
+    }
 
-        // New log entry that we have not observed yet
-        if (dictionary.size() <= entry->fmtId) {
-            ++encodeMissDueToMetadata;
-            ++consecutiveEncodeMissesDueToMetadata;
+    return validEnd;
+}
 
-            // If we miss a whole bunch, then we start printing out errors
-            if (consecutiveEncodeMissesDueToMetadata % 1000 == 0) {
-                fprintf(stderr, "NanoLog Error: Metadata missing for a dynamic "
-                                "log message (id=%u) during compression. If "
-                                "you are using Preprocessor NanoLog, there is "
-                                "be a problem with your integration (static "
-                                "logs detected=%lu).\r\n",
-                                entry->fmtId,
-                                GeneratedFunctions::numLogIds);
-            }
+/**
+ * Checks the header of a crash recovery dictionary and whether its process's
+ * log messages can be compressed here.
+ *
+ * \param header
+ *      Header to check
+ * \param filename
+ *      Dictionary the header was read from, for error messages
+ *
+ * \return
+ *      True if the entries of the process can be encoded
+ */
+static bool
+checkRecoveryDictionaryHeader(const Log::RecoveryDictionaryHeader &header,
+                              const std::string &filename)
+{
+    if (strncmp(header.magic, "NLRCDC1", sizeof(header.magic)) != 0) {
+        fprintf(stderr, "\"%s\" is not a crash recovery dictionary\r\n",
+                filename.c_str());
+        return false;
+    }
 
-            break;
-        }
+    if (header.preprocessor && GeneratedFunctions::numLogIds == 0) {
+        fprintf(stderr, "The process behind \"%s\" used the preprocessor "
+                        "version of NanoLog; its log messages can only be "
+                        "compressed by the decompressor built with the "
+                        "application.\r\n", filename.c_str());
+        return false;
+    }
 
-        consecutiveEncodeMissesDueToMetadata = 0;
+    return true;
+}
 
-#ifdef ENABLE_DEBUG_PRINTING
-        printf("Trying to encode fmtId=%u, size=%u, remaining=%ld\r\n",
-                entry->fmtId, entry->entrySize, remaining);
-        printf("\t%s\r\n", dictionary.at(entry->fmtId).formatString);
-#endif
+/**
+ * Replaces the Checkpoint an Encoder was constructed with by the one of the
+ * process that logged, so that the Decoder converts the process's timestamps
+ * correctly.
+ *
+ * \param buffer
+ *      Buffer the Encoder was constructed with
+ * \param header
+ *      Crash recovery dictionary header of the process
+ */
+static void
+useProcessCheckpoint(char *buffer, const Log::RecoveryDictionaryHeader &header)
+{
+    Log::Checkpoint *checkpoint = reinterpret_cast<Log::Checkpoint*>(buffer);
+    checkpoint->rdtsc = header.checkpoint.rdtsc;
+    checkpoint->unixTime = header.checkpoint.unixTime;
+    checkpoint->cyclesPerSecond = header.checkpoint.cyclesPerSecond;
+}
 
-        if (entry->entrySize > remaining) {
-            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
-                break;
+/**
+ * Recovers the log messages left in the StagingBuffers of a process that
+ * crashed with crash recovery enabled (see
+ * NanoLog::setCrashRecoveryDirectory()) and encodes them into a new log file
+ * that the Decoder can read like any other.
+ *
+ * Each StagingBuffer holds on to its log messages until the compression
+ * thread has seen them reach the log file, so the ones recovered include
+ * those still waiting for compression, sitting in an output buffer, or in a
+ * write that was in flight. Writes that completed before the StagingBuffer
+ * found out leave their log messages in both the crashed process's log file
+ * and the recovered one. An entry of a site that is missing from the
+ * dictionary, or that is malformed, ends the recovery of its StagingBuffer.
+ *
+ * \param recoveryPrefix
+ *      Path prefix of the crash recovery files, i.e.
+ *      "<directory>/nanolog.<pid>"
+ * \param logFile
+ *      Log file to create with the recovered log messages
+ *
+ * \return
+ *      The number of log messages recovered, or -1 if the crash recovery
+ *      dictionary or the log file could not be opened
+ */
+int64_t
+Log::recoverStagingBuffers(const char *recoveryPrefix, const char *logFile)
+{
+    std::string prefix(recoveryPrefix);
+    std::string dictionaryFile = prefix + ".dictionary";
+
+    std::vector<char> dictionaryData;
+    RecoveryDictionaryHeader header;
+    if (!readRecoveryFile(dictionaryFile, dictionaryData) ||
+            dictionaryData.size() < sizeof(header)) {
+        fprintf(stderr, "Could not read the crash recovery dictionary "
+                        "\"%s\"\r\n", dictionaryFile.c_str());
+        return -1;
+    }
 
-            StaticLogInfo &info = dictionary.at(entry->fmtId);
-            fprintf(stderr, "NanoLog ERROR: Attempting to log a message that "
-                            "is %u bytes while the maximum allowable size is "
-                            "%u.\r\n This occurs for the log message %s:%u '%s'"
-                            "\r\n",
-                            entry->entrySize,
-                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
-                            info.filename, info.lineNum, info.formatString);
+    memcpy(&header, dictionaryData.data(), sizeof(header));
+    if (!checkRecoveryDictionaryHeader(header, dictionaryFile))
+        return -1;
+
+    // Rebuild the dictionary of the non-preprocessor version of NanoLog. A
+    // site cut off by the crash is only missing its own log messages.
+    bool preprocessor = (header.preprocessor != 0);
+    RecoveredDictionary dictionary;
+    parseRecoverySites(dictionary, dictionaryData.data() + sizeof(header),
+                       dictionaryData.size() - sizeof(header));
+    registerRecoveredSites(dictionary, true);
+
+    // Read in the StagingBuffers up front to size the output buffer after
+    // the largest one
+    std::string pattern = prefix + ".buffer*";
+    glob_t bufferFiles;
+    std::vector<std::vector<char>> buffers;
+    if (glob(pattern.c_str(), 0, nullptr, &bufferFiles) == 0) {
+        for (size_t i = 0; i < bufferFiles.gl_pathc; ++i) {
+            buffers.emplace_back();
+            if (!readRecoveryFile(bufferFiles.gl_pathv[i], buffers.back())) {
+                fprintf(stderr, "Could not read the crash recovery file "
+                                "\"%s\"\r\n", bufferFiles.gl_pathv[i]);
+                buffers.pop_back();
+            }
         }
+    }
+    globfree(&bufferFiles);
 
-        // Check for free space using the worst case assumption that
-        // none of the arguments compressed and there are as many Nibbles
-        // as there are data bytes.
-        uint32_t maxCompressedSize = downCast<uint32_t>(2*entry->entrySize
-                                              + sizeof(Log::UncompressedEntry));
-        if (maxCompressedSize > (endOfBuffer - writePos))
-            break;
+    size_t outputBufferSize = 1 << 20;
+    for (std::vector<char> &buffer : buffers)
+        outputBufferSize = std::max(outputBufferSize, 4*buffer.size());
 
-        compressLogHeader(entry, &writePos, lastTimestamp);
-        lastTimestamp = entry->timestamp;
+    FILE *outputFd = fopen(logFile, "wb");
+    if (outputFd == nullptr) {
+        fprintf(stderr, "Could not open \"%s\" for writing: %s\r\n", logFile,
+                strerror(errno));
+        return -1;
+    }
 
-        StaticLogInfo &info = dictionary.at(entry->fmtId);
-#ifdef ENABLE_DEBUG_PRINTING
-        printf("\r\nCompressing \'%s\' with info.id=%d\r\n",
-                info.formatString, entry->fmtId);
-#endif
-        char *argData = entry->argData;
-        info.compressionFunction(info.numNibbles, info.paramTypes,
-                                        &argData, &writePos);
+    // The log starts with the crashed process's Checkpoint so that the
+    // Decoder converts the recovered timestamps correctly
+    std::vector<char> outputBuffer(outputBufferSize);
+    Encoder encoder(outputBuffer.data(), outputBuffer.size(), false,
+                    preprocessor);
+    useProcessCheckpoint(outputBuffer.data(), header);
+
+    uint32_t nextSiteToEncode = 0;
+    if (!preprocessor)
+        encoder.encodeNewDictionaryEntries(nextSiteToEncode,
+                                           dictionary.registry);
+
+    auto flush = [&]() {
+        size_t bytes = encoder.getEncodedBytes();
+        if (bytes > 0)
+            fwrite(outputBuffer.data(), 1, bytes, outputFd);
+        encoder.swapBuffer(outputBuffer.data(), outputBuffer.size());
+        return bytes > 0;
+    };
+
+    uint64_t numRecovered = 0;
+    for (std::vector<char> &file : buffers) {
+        RecoveryBufferHeader bh;
+        if (file.size() < sizeof(bh))
+            continue;
 
-        remaining -= entry->entrySize;
-        from += entry->entrySize;
+        memcpy(&bh, file.data(), sizeof(bh));
+        if (strncmp(bh.magic, "NLRCBF1", sizeof(bh.magic)) != 0 ||
+                bh.storageOffset + bh.capacity > file.size())
+            continue;
 
-        ++numEventsProcessed;
-    }
+        auto field = [&](uint32_t offset) {
+            uint64_t value = 0;
+            if (offset + sizeof(value) <= file.size())
+                memcpy(&value, &file[offset], sizeof(value));
+            return value;
+        };
+        auto position = [&](uint32_t offset) {
+            return field(offset) - bh.storageAddress;
+        };
+
+        uint32_t bufferId = static_cast<uint32_t>(field(bh.idOffset));
+        uint64_t producer = position(bh.producerPosOffset);
+        uint64_t endOfRecorded = position(bh.endOfRecordedSpaceOffset);
+        uint64_t persisted = position(bh.persistedPosOffset);
+        if (producer > bh.capacity || endOfRecorded > bh.capacity ||
+                persisted > bh.capacity)
+            continue;
 
-    assert(currentExtentSize);
-    *currentExtentSize += downCast<uint32_t>(writePos - bufferStart);
+        // The producer never reuses the space of log messages that haven't
+        // been persisted, so they all lie between persistedPos and
+        // producerPos, rolling over at endOfRecordedSpace
+        std::vector<std::pair<uint64_t, uint64_t>> regions;
+        if (producer >= persisted) {
+            regions.emplace_back(persisted, producer);
+        } else {
+            regions.emplace_back(persisted, std::max(persisted, endOfRecorded));
+            regions.emplace_back(0, producer);
+        }
 
-    if (numEventsCompressed)
-        *numEventsCompressed += numEventsProcessed;
+        char *storage = &file[bh.storageOffset];
+        for (auto &region : regions) {
+            char *start = storage + region.first;
+            char *end = storage + region.second;
+            char *validEnd = findIntactEntries(dictionary, preprocessor,
+                                               start, end);
+
+            while (start < validEnd) {
+                long bytesRead;
+                if (preprocessor)
+                    bytesRead = encoder.encodeLogMsgs(start, validEnd - start,
+                                        bufferId, false, &numRecovered);
+                else
+                    bytesRead = encoder.encodeLogMsgs(start, validEnd - start,
+                                        bufferId, false, dictionary.registry,
+                                        &numRecovered);
+
+                if (bytesRead == 0 && !flush())
+                    break;
+                start += bytesRead;
+            }
 
-    return nbytes - remaining;
+            if (validEnd != end)
+                break;
+        }
+    }
+
+    flush();
+    fclose(outputFd);
+    return static_cast<int64_t>(numRecovered);
 }
 
 /**
- * Internal function that encodes a marker indicating that all log messages
- * after this point (but after the next marker) belong to a particular buffer.
- * This is only used in encodeLogMsgs, but is separated out to allow for easy
- * unit testing with its counterpart in Decoder.
- *
- * \param bufferId
- *      Buffer id to encode in the extent
- * \param newPass
- *      Indicates whether this buffer change also correlates with the start of
- *      a new pass through the runtime StagingBuffers by the caller
- * \return
- *      Whether the operation completed successfully (true) or failed due to
- *      lack of space in the internal buffer (false)
+ * A StagingBuffer of a process attached to by a CompressionAgent, mapped from
+ * its crash recovery file.
  */
-bool
-Log::Encoder::encodeBufferExtentStart(uint32_t bufferId, bool newPass)
-{
-    // For size check, assume the worst case of no compression on bufferId
-    char *writePosStart = writePos;
-    if (sizeof(BufferExtent) + sizeof(bufferId) >
-            static_cast<size_t>(endOfBuffer - writePos))
-        return false;
+struct Log::CompressionAgent::AttachedBuffer {
+    AttachedBuffer()
+        : filename()
+        , mapping(nullptr)
+        , mappingBytes(0)
+        , header()
+        , consumed(0)
+        , consumedUnpublished(false)
+    {}
+
+    /**
+     * Returns a pointer-sized field of the StagingBuffer object in the
+     * mapping, given its offset in the RecoveryBufferHeader.
+     */
+    uint64_t *
+    field(uint32_t offset) {
+        return reinterpret_cast<uint64_t*>(mapping + offset);
+    }
 
-    BufferExtent *tc = reinterpret_cast<BufferExtent*>(writePos);
-    writePos += sizeof(BufferExtent);
+    /**
+     * Returns the offset within the storage of a position field (e.g.
+     * producerPos) of the StagingBuffer object in the mapping.
+     */
+    uint64_t
+    position(uint32_t offset) {
+        return __atomic_load_n(field(offset), __ATOMIC_ACQUIRE)
+                                                - header.storageAddress;
+    }
 
-    tc->entryType = EntryType::BUFFER_EXTENT;
-    tc->wrapAround = newPass;
+    std::string filename;
+    char *mapping;
+    size_t mappingBytes;
+    RecoveryBufferHeader header;
 
-    if (bufferId < (1<<4)) {
-        tc->isShort = true;
-        tc->threadIdOrPackNibble = 0x0F & bufferId;
-    } else {
-        tc->isShort = false;
-        tc->threadIdOrPackNibble = 0x0F & BufferUtils::pack<uint32_t>(
-                                                        &writePos, bufferId);
-    }
+    // Offset within the storage up to which the agent has encoded the log
+    // messages, and whether it still has to hand that space back to the
+    // producer, which it does once the log messages are in the log file
+    uint64_t consumed;
+    bool consumedUnpublished;
 
-    tc->length = downCast<uint32_t>(writePos - writePosStart);
-    currentExtentSize = &(tc->length);
-    lastBufferIdEncoded = bufferId;
+    DISALLOW_COPY_AND_ASSIGN(AttachedBuffer);
+};
 
-    return true;
+/**
+ * A process that a CompressionAgent compresses the StagingBuffers of, along
+ * with the log file it writes them to.
+ */
+struct Log::CompressionAgent::AttachedProcess {
+    AttachedProcess()
+        : pid(0)
+        , prefix()
+        , dictionaryFd(-1)
+        , dictionaryBacklog()
+        , header()
+        , dictionary()
+        , nextSiteToEncode(0)
+        , buffers()
+        , logFile()
+        , logFd(-1)
+        , outputBuffer()
+        , encoder()
+        , exited(false)
+        , logsCompressed(0)
+    {}
+
+    uint32_t pid;
+
+    // Path prefix of the process's crash recovery files, i.e.
+    // "<directory>/nanolog.<pid>"
+    std::string prefix;
+
+    // The process's crash recovery dictionary, which it keeps appending to,
+    // and the bytes read from it that don't make up a complete site yet
+    int dictionaryFd;
+    std::vector<char> dictionaryBacklog;
+    RecoveryDictionaryHeader header;
+    RecoveredDictionary dictionary;
+
+    // Index of the next site in dictionary.registry to encode in the log
+    uint32_t nextSiteToEncode;
+
+    std::vector<AttachedBuffer*> buffers;
+
+    // Log file the process's log messages are written to and the Encoder
+    // that compresses them into outputBuffer for it
+    std::string logFile;
+    int logFd;
+    std::vector<char> outputBuffer;
+    std::unique_ptr<Encoder> encoder;
+
+    // Indicates that the process has exited, so its StagingBuffers will not
+    // receive any more log messages
+    bool exited;
+
+    // Metric: Number of log messages compressed for the process
+    uint64_t logsCompressed;
+};
+
+/**
+ * CompressionAgent constructor. The agent doesn't look for processes until
+ * it's polled.
+ *
+ * \param directory
+ *      Directory the processes place their crash recovery files in (see
+ *      NanoLog::setCompressionAgent())
+ * \param logDirectory
+ *      Directory to write the processes' log files to
+ */
+Log::CompressionAgent::CompressionAgent(const char *directory,
+                                        const char *logDirectory)
+    : directory(directory)
+    , logDirectory(logDirectory)
+    , processes()
+    , ignoredDictionaries()
+    , lastScan(0)
+{
 }
 
 /**
- * Retrieve the number of bytes encoded in the internal buffer
+ * CompressionAgent destructor; writes out what has been compressed so far
+ * but leaves the processes' files for another agent to attach to.
+ */
+Log::CompressionAgent::~CompressionAgent()
+{
+    for (auto &process : processes)
+        detachProcess(process.second, false);
+    processes.clear();
+}
+
+/**
+ * Makes one pass over the processes attached to, compressing the log
+ * messages in their StagingBuffers and writing them to their log files, and
+ * periodically looks for processes to attach to or detach from.
  *
  * \return
- *      Number of bytes encoded in the internal buffer
+ *      The number of log messages compressed in the pass
  */
-size_t
-Log::Encoder::getEncodedBytes() {
-    return writePos - backing_buffer;
+uint64_t
+Log::CompressionAgent::poll()
+{
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (lastScan == 0 || PerfUtils::Cycles::toMicroseconds(now - lastScan)
+                                >= NanoLogConfig::COMPRESSION_AGENT_SCAN_US) {
+        lastScan = now;
+        scan();
+    }
+
+    uint64_t numCompressed = 0;
+    for (auto it = processes.begin(); it != processes.end();) {
+        AttachedProcess *process = it->second;
+        uint64_t logsCompressed = compress(process);
+        numCompressed += logsCompressed;
+
+        // A process that exited is done once nothing more can be compressed
+        if (process->exited && logsCompressed == 0) {
+            detachProcess(process, true);
+            it = processes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return numCompressed;
 }
 
 /**
- * Releases the internal buffer and replaces it with a different one.
+ * Polls the processes until told to stop, backing off while there are no log
+ * messages to compress.
  *
- * \param inBuffer
- *      the new buffer to swap in
- * \param inSize
- *      the amount of free space usable in the buffer
- * \param[out] outBuffer
- *      returns a pointer to the original buffer
- * \param[out] outLength
- *      returns the number of bytes of encoded data in the outBuffer
+ * \param stop
+ *      Flag to stop running; what the processes logged up to then is still
+ *      written out
  */
 void
-Log::Encoder::swapBuffer(char *inBuffer, size_t inSize, char **outBuffer,
-                                            size_t *outLength, size_t *outSize)
+Log::CompressionAgent::run(const std::atomic<bool> &stop)
 {
-    char *ret = backing_buffer;
-    size_t size = writePos - backing_buffer;
-    size_t originalSize = endOfBuffer - backing_buffer;
-
-    backing_buffer = inBuffer;
-    writePos = inBuffer;
-    endOfBuffer = inBuffer + inSize;
-    lastBufferIdEncoded = -1;
-    currentExtentSize = nullptr;
-
-    if (outBuffer)
-        *outBuffer = ret;
+    const uint32_t minBackoffUs = std::max(1U,
+                                    NanoLogConfig::POLL_INTERVAL_NO_WORK_US);
+    uint32_t backoffUs = minBackoffUs;
+    while (!stop.load()) {
+        if (poll() > 0) {
+            backoffUs = minBackoffUs;
+            continue;
+        }
 
-    if (outLength)
-        *outLength = size;
+        usleep(backoffUs);
+        backoffUs = std::min(2*backoffUs, NanoLogConfig::IDLE_MAX_BACKOFF_US);
+    }
 
-    if (outSize)
-        *outSize = originalSize;
+    poll();
 }
 
-// Constructor for LogMessage
-Log::LogMessage::LogMessage()
-        : metadata(nullptr)
-        , logId(-1)
-        , rdtsc(0)
-        , numArgs(0)
-        , totalCapacity(sizeof(rawArgs)/sizeof(uint64_t))
-        , rawArgs()
-        , rawArgsExtension(nullptr)
-{}
+/**
+ * Looks for new processes and StagingBuffers in the directory, and for
+ * processes that have exited.
+ */
+void
+Log::CompressionAgent::scan()
+{
+    std::string pattern = directory + "/nanolog.*.dictionary";
+    glob_t dictionaryFiles;
+    if (glob(pattern.c_str(), 0, nullptr, &dictionaryFiles) == 0) {
+        for (size_t i = 0; i < dictionaryFiles.gl_pathc; ++i)
+            attachProcess(dictionaryFiles.gl_pathv[i]);
+    }
+    globfree(&dictionaryFiles);
+
+    for (auto &entry : processes) {
+        AttachedProcess *process = entry.second;
+        if (!process->exited && kill(process->pid, 0) != 0 && errno == ESRCH) {
+            // The dictionary is complete; the sites it's missing were cut off
+            // by a crash and won't show up anymore.
+            readDictionary(process);
+            registerRecoveredSites(process->dictionary, true);
+            process->exited = true;
+        }
 
-// Destructor for LogMessage
-Log::LogMessage::~LogMessage() {
-    if (rawArgsExtension != nullptr) {
-        free(rawArgsExtension);
-        rawArgsExtension = nullptr;
-        totalCapacity = INITIAL_SIZE;
+        attachBuffers(process);
     }
 }
 
 /**
- * Reserve/Allocate enough space for N parameters in the structure
+ * Attaches to the process behind a crash recovery dictionary if it uses a
+ * compression agent and isn't attached to yet.
  *
- * \param nparams
- *    Number of parameters to ensure space for
+ * \param dictionaryFile
+ *      Crash recovery dictionary of the process
  */
 void
-Log::LogMessage::reserve(int nparams)
+Log::CompressionAgent::attachProcess(const std::string &dictionaryFile)
 {
-    if (totalCapacity >= nparams)
+    if (ignoredDictionaries.count(dictionaryFile))
         return;
 
-    while (totalCapacity < nparams)
-        totalCapacity *= 2;
+    const std::string suffix = ".dictionary";
+    std::string prefix = dictionaryFile.substr(0,
+                                    dictionaryFile.size() - suffix.size());
+    for (auto &entry : processes) {
+        if (entry.second->prefix == prefix)
+            return;
+    }
 
-    size_t newSize = sizeof(uint64_t)*(totalCapacity - INITIAL_SIZE);
-    uint64_t *newAllocation = static_cast<uint64_t*>(malloc(newSize));
+    int fd = open(dictionaryFile.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
 
-    if (newAllocation == nullptr) {
-        fprintf(stderr, "Could not allocate memory to store %d log "
-                        "arguments. Exiting...", nparams);
-        exit(1);
+    // A header that's not all there yet is still being written
+    RecoveryDictionaryHeader header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return;
     }
 
-    if (rawArgsExtension == nullptr) {
-        rawArgsExtension = newAllocation;
+    if (!header.compressionAgent ||
+            !checkRecoveryDictionaryHeader(header, dictionaryFile)) {
+        ignoredDictionaries.insert(dictionaryFile);
+        close(fd);
         return;
     }
 
-    memcpy(newAllocation,
-           rawArgsExtension,
-           sizeof(uint64_t)*(numArgs - INITIAL_SIZE));
-    free(rawArgsExtension);
+    // Pick a log file that doesn't exist yet, going "<name>.<n>" with the
+    // lowest n not taken like a rotated log file would
+    std::string name = logDirectory + "/nanolog." +
+                       std::to_string(header.pid) + ".log";
+    std::string logFile = name;
+    int logFd = -1;
+    for (uint32_t n = 1; logFd < 0; ++n) {
+        logFd = open(logFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (logFd < 0 && errno != EEXIST)
+            break;
+        if (logFd < 0)
+            logFile = name + "." + std::to_string(n);
+    }
 
-    rawArgsExtension = newAllocation;
+    if (logFd < 0) {
+        fprintf(stderr, "Could not create the log file \"%s\" for process "
+                        "%u: %s\r\n", logFile.c_str(), header.pid,
+                        strerror(errno));
+        ignoredDictionaries.insert(dictionaryFile);
+        close(fd);
+        return;
+    }
+
+    AttachedProcess *process = new AttachedProcess();
+    process->pid = header.pid;
+    process->prefix = prefix;
+    process->dictionaryFd = fd;
+    process->header = header;
+    process->logFile = logFile;
+    process->logFd = logFd;
+
+    // The log starts with the process's Checkpoint, as if it had been
+    // written by the process's own compression thread
+    process->outputBuffer.resize(NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE);
+    process->encoder.reset(new Encoder(process->outputBuffer.data(),
+                                       process->outputBuffer.size(), false,
+                                       header.preprocessor != 0, true));
+    useProcessCheckpoint(process->outputBuffer.data(), header);
+
+    processes[header.pid] = process;
+    readDictionary(process);
+    attachBuffers(process);
 }
 
 /**
- * Ready's the structure for a new log statement by reassigning the static
- * log information. Dynamic arguments can then be push()-ed into the
- * structure.
+ * Maps the StagingBuffers of a process that the agent isn't attached to yet.
  *
- * \param meta
- *      Static log data to refer to
- * \param logId
- *      Preprocessor assigned log id of the log message
- * \param rdtsc
- *      Invocation time of the log message
+ * \param process
+ *      Process to attach the StagingBuffers of
  */
 void
-Log::LogMessage::reset(FormatMetadata *meta, uint32_t logId, uint64_t rdtsc)
+Log::CompressionAgent::attachBuffers(AttachedProcess *process)
 {
-    this->metadata = meta;
-    this->rdtsc = rdtsc;
-    this->logId = logId;
-    numArgs = 0;
-}
+    std::string pattern = process->prefix + ".buffer*";
+    glob_t bufferFiles;
+    if (glob(pattern.c_str(), 0, nullptr, &bufferFiles) != 0) {
+        globfree(&bufferFiles);
+        return;
+    }
 
-// Indicates whether the structure stores a valid log statement or not
-bool Log::LogMessage::valid() {
-    return metadata != nullptr;
-}
+    for (size_t i = 0; i < bufferFiles.gl_pathc; ++i) {
+        std::string filename = bufferFiles.gl_pathv[i];
+        bool attached = false;
+        for (AttachedBuffer *buffer : process->buffers)
+            attached |= (buffer->filename == filename);
+        if (attached)
+            continue;
 
-// Returns the number of arguments currently stored for the log.
-int Log::LogMessage::getNumArgs() {
-    return numArgs;
-}
+        int fd = open(filename.c_str(), O_RDWR);
+        if (fd < 0)
+            continue;
 
-// Returns the preprocessor-assigned log identifier for this log message
-uint32_t Log::LogMessage::getLogId() {
-    return logId;
-}
+        struct stat st;
+        void *mapping = MAP_FAILED;
+        if (fstat(fd, &st) == 0 &&
+                static_cast<size_t>(st.st_size) >= sizeof(RecoveryBufferHeader))
+            mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            continue;
 
-// Returns the runtime timestamp for the log invocation.
-uint64_t Log::LogMessage::getTimestamp() {
-    return rdtsc;
+        // The process writes the magic last, once the rest of the header and
+        // the StagingBuffer are set up
+        AttachedBuffer *buffer = new AttachedBuffer();
+        buffer->filename = filename;
+        buffer->mapping = static_cast<char*>(mapping);
+        buffer->mappingBytes = st.st_size;
+        memcpy(&buffer->header, mapping, sizeof(buffer->header));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        RecoveryBufferHeader &bh = buffer->header;
+        size_t lastField = std::max({bh.idOffset, bh.producerPosOffset,
+                                     bh.endOfRecordedSpaceOffset,
+                                     bh.persistedPosOffset,
+                                     bh.consumerPosOffset,
+                                     bh.numLogsDroppedOffset,
+                                     bh.lastDropTimestampOffset,
+                                     bh.numLogsDroppedReportedOffset});
+        if (strncmp(bh.magic, "NLRCBF1", sizeof(bh.magic)) != 0 ||
+                bh.storageOffset + bh.capacity > buffer->mappingBytes ||
+                lastField + sizeof(uint64_t) > buffer->mappingBytes) {
+            munmap(mapping, buffer->mappingBytes);
+            delete buffer;
+            continue;
+        }
+
+        buffer->consumed = buffer->position(bh.consumerPosOffset);
+        if (buffer->consumed > bh.capacity) {
+            munmap(mapping, buffer->mappingBytes);
+            delete buffer;
+            continue;
+        }
+
+        process->buffers.push_back(buffer);
+    }
+
+    globfree(&bufferFiles);
 }
 
 /**
- * Decoder constructor.
+ * Reads the sites a process has appended to its crash recovery dictionary
+ * since the last time and registers them.
  *
- * Due to the large amount of memory needed to buffer log statements, the
- * decoder is intended to be constructed once and then re-used via open().
+ * \param process
+ *      Process whose dictionary to read
  */
-Log::Decoder::Decoder()
-    : filename()
-    , inputFd(nullptr)
-    , logMsgsPrinted(0)
-    , bufferFragment(nullptr)
-    , good(false)
-    , checkpoint()
-    , freeBuffers()
-    , fmtId2metadata()
-    , fmtId2fmtString()
-    , rawMetadata(nullptr)
-    , endOfRawMetadata(nullptr)
-    , numBufferFragmentsRead(0)
-    , numCheckpointsRead(0)
+void
+Log::CompressionAgent::readDictionary(AttachedProcess *process)
 {
-    // Take advantage of virtual memory an allocate an insanely large (1GB)
-    // buffer to store log metadata read from the logFile. Such a large buffer
-    // is used so that we don't have to explicitly manage the buffer and instead
-    // leave it up to the virtual memory system.
-    rawMetadata = static_cast<char*>(malloc(1024*1024*1024));
-
-    if (rawMetadata == nullptr) {
-        fprintf(stderr, "Could not allocate an internal 1GB buffer to store log"
-                " metadata");
-        exit(-1);
-    }
-
-    endOfRawMetadata = rawMetadata;
-    fmtId2metadata.reserve(1000);
-    fmtId2fmtString.reserve(1000);
-    bufferFragment = allocateBufferFragment();
+    char chunk[64*1024];
+    ssize_t bytesRead;
+    std::vector<char> &backlog = process->dictionaryBacklog;
+    while ((bytesRead = read(process->dictionaryFd, chunk, sizeof(chunk))) > 0)
+        backlog.insert(backlog.end(), chunk, chunk + bytesRead);
+
+    size_t bytesParsed = parseRecoverySites(process->dictionary,
+                                            backlog.data(), backlog.size());
+    backlog.erase(backlog.begin(), backlog.begin() + bytesParsed);
+    registerRecoveredSites(process->dictionary, process->exited);
 }
 
 /**
- * Reads the metadata necessary to decompress log messsages from a log file.
- * This function can be invoked incrementally to build a larger dictionary from
- * smaller fragments in the file and it should only be invoked once per fragment
+ * Compresses as many log messages from the StagingBuffers of a process as
+ * fit in its output buffer, writes them to its log file, and then hands
+ * their space back to the process.
+ *
+ * \param process
+ *      Process to compress the log messages of
  *
- * \param fd
- *      File descriptor pointing to the dictionary fragment
- * \param flushOldDictionary
- *      Removes the old dictionary entries
  * \return
- *      true if successful, false if the dictionary was corrupt
+ *      The number of log messages compressed
  */
-bool
-Log::Decoder::readDictionary(FILE *fd, bool flushOldDictionary) {
-    if (!readCheckpoint(checkpoint, fd)) {
-        fprintf(stderr, "Error: Could not read initial checkpoint, "
-                "the compressed log may be corrupted.\r\n");
-        return false;
-    }
-
-    size_t bytesRead = fread(endOfRawMetadata, 1, checkpoint.newMetadataBytes,
-                             fd);
-    if (bytesRead != checkpoint.newMetadataBytes) {
-        fprintf(stderr, "Error couldn't read metadata header in log file.\r\n");
-        return false;
-    }
-
-    if (flushOldDictionary) {
-        endOfRawMetadata = rawMetadata;
-        fmtId2metadata.clear();
-        fmtId2fmtString.clear();
-    }
+uint64_t
+Log::CompressionAgent::compress(AttachedProcess *process)
+{
+    Encoder &encoder = *process->encoder;
+    bool preprocessor = (process->header.preprocessor != 0);
+    uint64_t logsCompressedBefore = process->logsCompressed;
+
+    // Sites are recorded before their first log message is staged, so
+    // reading the dictionary first makes sure it has all the sites needed
+    readDictionary(process);
+    if (!preprocessor)
+        encoder.encodeNewDictionaryEntries(process->nextSiteToEncode,
+                                           process->dictionary.registry);
+
+    bool outputBufferFull = false;
+    bool wrapAround = true;
+    for (AttachedBuffer *buffer : process->buffers) {
+        if (outputBufferFull)
+            break;
 
-    // Build an index of format id to metadata
-    const char *start = endOfRawMetadata;
-    const char *newEnd = endOfRawMetadata + bytesRead;
-    while(endOfRawMetadata < newEnd) {
-        std::string fmtString;
-        fmtId2metadata.push_back(endOfRawMetadata);
+        RecoveryBufferHeader &bh = buffer->header;
+        uint32_t bufferId = *reinterpret_cast<uint32_t*>(
+                                            buffer->mapping + bh.idOffset);
+
+        // Record the log statements the producer had to drop
+        uint64_t *dropped = buffer->field(bh.numLogsDroppedOffset);
+        uint64_t *reported = buffer->field(bh.numLogsDroppedReportedOffset);
+        uint64_t numLogsDropped = __atomic_load_n(dropped, __ATOMIC_ACQUIRE);
+        uint64_t numLogsReported = __atomic_load_n(reported, __ATOMIC_RELAXED);
+        if (numLogsDropped != numLogsReported) {
+            uint64_t timestamp = __atomic_load_n(
+                    buffer->field(bh.lastDropTimestampOffset),
+                    __ATOMIC_RELAXED);
+            if (!encoder.encodeDroppedLogs(bufferId,
+                                numLogsDropped - numLogsReported, timestamp))
+                break;
+            __atomic_store_n(reported, numLogsDropped, __ATOMIC_RELAXED);
+        }
 
-        // Skip ahead
-        auto *fm = reinterpret_cast<FormatMetadata*>(endOfRawMetadata);
-        endOfRawMetadata += sizeof(FormatMetadata) + fm->filenameLength;
+        // Consume the StagingBuffer the way StagingBuffer::peek() and
+        // consume() would, rolling over at endOfRecordedSpace
+        while (true) {
+            uint64_t producer = buffer->position(bh.producerPosOffset);
+            uint64_t start = buffer->consumed;
+            uint64_t end = producer;
+            if (producer < start) {
+                end = buffer->position(bh.endOfRecordedSpaceOffset);
+                if (end <= start) {
+                    start = 0;
+                    end = producer;
+                    buffer->consumed = 0;
+                    buffer->consumedUnpublished = true;
+                }
+            }
 
-        for (int i = 0; i < fm->numPrintFragments
-                        && newEnd >= endOfRawMetadata; ++i)
-        {
-            auto *pf = reinterpret_cast<PrintFragment*>(endOfRawMetadata);
-            endOfRawMetadata += sizeof(PrintFragment) + pf->fragmentLength;
-            fmtString.append(pf->formatFragment);
-        }
+            if (start >= end || end > bh.capacity)
+                break;
 
-        fmtId2fmtString.push_back(fmtString);
-    }
+            char *storage = buffer->mapping + bh.storageOffset;
+            char *validEnd = findIntactEntries(process->dictionary,
+                                               preprocessor, storage + start,
+                                               storage + end);
+            if (validEnd == storage + start)
+                break;
 
-    if (newEnd != endOfRawMetadata) {
-        fprintf(stderr, "Error: Log dictionary is inconsistent; "
-                        "expected %lu bytes, but read %lu bytes\r\n",
-                newEnd - start,
-                endOfRawMetadata - start);
-        return false;
-    }
+            long bytesRead;
+            if (preprocessor)
+                bytesRead = encoder.encodeLogMsgs(storage + start,
+                                        validEnd - (storage + start),
+                                        bufferId, wrapAround,
+                                        &process->logsCompressed);
+            else
+                bytesRead = encoder.encodeLogMsgs(storage + start,
+                                        validEnd - (storage + start),
+                                        bufferId, wrapAround,
+                                        process->dictionary.registry,
+                                        &process->logsCompressed);
+
+            if (bytesRead == 0) {
+                outputBufferFull = true;
+                break;
+            }
 
-    if (fmtId2metadata.size() != checkpoint.totalMetadataEntries) {
-        fprintf(stderr, "Error: Missing log metadata detected; "
-                        "expected %u messages, but only found %lu\r\n",
-                       checkpoint.totalMetadataEntries,
-                       fmtId2metadata.size());
-        return false;
+            wrapAround = false;
+            buffer->consumed = start + bytesRead;
+            buffer->consumedUnpublished = true;
+        }
     }
 
-    ++numCheckpointsRead;
-    return true;
+    flush(process);
+    return process->logsCompressed - logsCompressedBefore;
 }
 
 /**
- * Parses the <length> and <specifier> components of a printf format sub-string
- * according to http://www.cplusplus.com/reference/cstdio/printf/ and returns
- * a corresponding FormatType.
+ * Writes the output buffer of a process out to its log file and then hands
+ * the space of the log messages in it back to the process.
  *
- * \param length
- *      Length component of the printf format string
- * \param specifier
- *      Specifier component of the printf format string
- * @return
- *      The FormatType corresponding to the length and specifier. A value of
- *      MAX_FORMAT_TYPE is returned in case of error.
+ * \param process
+ *      Process whose output buffer to write out
  */
-static NanoLogInternal::Log::FormatType
-getFormatType(std::string length, char specifier)
+void
+Log::CompressionAgent::flush(AttachedProcess *process)
 {
-    using namespace NanoLogInternal::Log;
-
-    // Signed Integers
-    if (specifier == 'd' || specifier == 'i') {
-        if (length.empty())
-            return int_t;
+    Encoder &encoder = *process->encoder;
+    size_t bytes = encoder.getEncodedBytes();
+    const char *out = process->outputBuffer.data();
+    while (bytes > 0) {
+        ssize_t bytesWritten = write(process->logFd, out, bytes);
+        if (bytesWritten < 0 && errno == EINTR)
+            continue;
 
-        if (length.size() == 2) {
-            if (length[0] == 'h') return signed_char_t;
-            if (length[0] == 'l') return long_long_int_t;
+        if (bytesWritten <= 0) {
+            fprintf(stderr, "Could not write to the log file \"%s\" of "
+                            "process %u: %s\r\n", process->logFile.c_str(),
+                            process->pid, strerror(errno));
+            break;
         }
 
-        switch(length[0]) {
-            case 'h': return short_int_t;
-            case 'l': return long_int_t;
-            case 'j': return intmax_t_t;
-            case 'z': return size_t_t;
-            case 't': return ptrdiff_t_t;
-            default : break;
-        }
+        out += bytesWritten;
+        bytes -= bytesWritten;
     }
 
-    // Unsigned integers
-    if (specifier == 'u' || specifier == 'o'
-            || specifier == 'x' || specifier == 'X')
-    {
-        if (length.empty())
-            return unsigned_int_t;
-
-        if (length.size() == 2) {
-            if (length[0] == 'h') return unsigned_char_t;
-            if (length[0] == 'l') return unsigned_long_long_int_t;
-        }
-
-        switch(length[0]) {
-            case 'h': return unsigned_short_int_t;
-            case 'l': return unsigned_long_int_t;
-            case 'j': return uintmax_t_t;
-            case 'z': return size_t_t;
-            case 't': return ptrdiff_t_t;
-            default : break;
-        }
-    }
+    // Grow the output buffer now that it's empty if it no longer holds a
+    // StagingBuffer's worth of log messages
+    size_t outputBufferSize = process->outputBuffer.size();
+    for (AttachedBuffer *buffer : process->buffers)
+        outputBufferSize = std::max<size_t>(outputBufferSize,
+                                            2*buffer->header.capacity);
+    if (outputBufferSize != process->outputBuffer.size())
+        process->outputBuffer.resize(outputBufferSize);
+    encoder.swapBuffer(process->outputBuffer.data(),
+                       process->outputBuffer.size());
+
+    // The release orders the agent's reads of the log messages before the
+    // producer's reuse of their space
+    for (AttachedBuffer *buffer : process->buffers) {
+        if (!buffer->consumedUnpublished)
+            continue;
 
-    // Strings
-    if (specifier == 's') {
-        if (length.empty()) return const_char_ptr_t;
-        if (length[0] == 'l') return const_wchar_t_ptr_t;
+        RecoveryBufferHeader &bh = buffer->header;
+        uint64_t position = bh.storageAddress + buffer->consumed;
+        __atomic_store_n(buffer->field(bh.consumerPosOffset), position,
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(buffer->field(bh.persistedPosOffset), position,
+                         __ATOMIC_RELEASE);
+        buffer->consumedUnpublished = false;
     }
+}
 
-    // Pointer
-    if (specifier == 'p') {
-        if (length.empty()) return const_void_ptr_t;
+/**
+ * Writes out what has been compressed for a process and lets go of it.
+ *
+ * \param process
+ *      Process to detach from; it's freed
+ * \param removeFiles
+ *      Remove the process's crash recovery files, which is for when it has
+ *      exited and everything it logged has been compressed
+ */
+void
+Log::CompressionAgent::detachProcess(AttachedProcess *process,
+                                     bool removeFiles)
+{
+    flush(process);
+    for (AttachedBuffer *buffer : process->buffers) {
+        munmap(buffer->mapping, buffer->mappingBytes);
+        if (removeFiles)
+            unlink(buffer->filename.c_str());
+        delete buffer;
     }
+    process->buffers.clear();
 
+    close(process->dictionaryFd);
+    if (removeFiles)
+        unlink((process->prefix + ".dictionary").c_str());
 
-    // Floating points
-    if (specifier == 'f' || specifier == 'F'
-            || specifier == 'e' || specifier == 'E'
-            || specifier == 'g' || specifier == 'G'
-            || specifier == 'a' || specifier == 'A')
-    {
-        if (length.size() == 1 && length[0] == 'L' )
-            return long_double_t;
-        else
-            return double_t;
-    }
+    close(process->logFd);
+    delete process;
+}
 
-    if (specifier == 'c') {
-        if (length.empty()) return int_t;
-        if (length[0] == 'l') return wint_t_t;
-    }
+__thread Log::StringInterner *Log::StringInterner::active = nullptr;
 
-    fprintf(stderr, "Attempt to decode format specifier failed: %s%c\r\n",
-            length.c_str(), specifier);
-    return MAX_FORMAT_TYPE;
+/**
+ * Creates an interner with no strings interned.
+ */
+Log::StringInterner::StringInterner()
+    : slots()
+    , epoch(1)
+    , numStrings(0)
+{
 }
 
 /**
- * Generate a more efficient internal representation describing how to process
- * the compressed arguments of a NANO_LOG statement given its static
- * log information.
- *
- * The output representation would look something like a FormatMetadata with
- * nested PrintFragments. This representation can then be interpreted by the
- * state machine in decompressNextLogStatement to decompress the log statements.
+ * Encoder constructor. The construction of an Encoder should logically
+ * correlate with the start of a new log file as it will embed unique metadata
+ * information at the beginning of log file/buffer.
  *
- * \param[in/out] microCode
- *      Buffer to store the generated internal representation
- * \param formatString
- *      Format string of the NANO_LOG statement
- * \param filename
- *      File associated with the log invocation site
- * \param linenum
- *      Line number within filename associated with the log invocation site
- * \param severity
- *      LogLevel severity associated with the log invocation site
- * \return
- *      true indicates success; false indicates malformed printf format string
+ * \param buffer
+ *      Buffer to encode log messages and metadata to
+ * \param bufferSize
+ *      The number of bytes usable within the buffer
+ * \param skipCheckpoint
+ *      Optional parameter to skip embedding metadata information at the
+ *      beginning of the buffer. This parameter should only be set in unit
+ *      tests and by runtime compression shards whose output is appended to
+ *      a log file that another Encoder has already started with a
+ *      checkpoint.
+ * \param forceDictionaryOutput
+ *      Embed the dictionary after the checkpoint even in the
+ *      non-preprocessor version of NanoLog.
+ * \param encodeTimeIndex
+ *      Lead the entries in each buffer with a TimeIndex so that the Decoder
+ *      can seek through the log by time. This should be set when the buffers
+ *      are written to the log file in one piece each (as the runtime does).
  */
-bool
-Log::Decoder::createMicroCode(char **microCode,
-                                const char *formatString,
-                                const char *filename,
-                                uint32_t linenum,
-                                uint8_t severity)
-{
-    using namespace NanoLogInternal::Log;
-
+Log::Encoder::Encoder(char *buffer,
+                                size_t bufferSize,
+                                bool skipCheckpoint,
+                                bool forceDictionaryOutput,
+                                bool encodeTimeIndex)
+    : backing_buffer(buffer)
+    , writePos(buffer)
+    , endOfBuffer(buffer + bufferSize)
+    , lastBufferIdEncoded(-1)
+    , stringInterner()
+    , currentExtentSize(nullptr)
+    , encodeMissDueToMetadata(0)
+    , consecutiveEncodeMissesDueToMetadata(0)
+    , encodeTimeIndex(encodeTimeIndex)
+    , timeIndex(nullptr)
+    , logIdSummary(nullptr)
+    , encodePlans()
+    , encodePlansDictionary(nullptr)
+{
+    assert(buffer);
+
+    // Start the buffer off with a checkpoint
+    if (skipCheckpoint && !forceDictionaryOutput)
+        return;
+
+#ifdef PREPROCESSOR_NANOLOG
+    bool writeDictionary = true;
+#else
+    bool writeDictionary = forceDictionaryOutput;
+#endif
+
+    // In virtually all cases, our output buffer should have enough
+    // space to store the dictionary. If not, we fail in place.
+    if (!insertCheckpoint(&writePos, endOfBuffer, writeDictionary)) {
+        fprintf(stderr, "Internal Error: Not enough space allocated for "
+                        "dictionary file.\r\n");
+
+        exit(-1);
+    }
+}
+
+/**
+ * Starts a new log file off with a Checkpoint (and, in the preprocessor
+ * version of NanoLog, the dictionary) in the same way the constructor does;
+ * the non-preprocessor version re-encodes its dictionary afterwards with
+ * encodeNewDictionaryEntries(). This is used to rotate to a new log file
+ * without constructing a new Encoder, so the buffer must not contain any
+ * entries yet.
+ *
+ * \return
+ *      True if the operation succeeded; false if the buffer is not empty or
+ *      there's not enough space for the Checkpoint
+ */
+bool
+Log::Encoder::encodeCheckpoint() {
+    if (writePos != backing_buffer)
+        return false;
+
+#ifdef PREPROCESSOR_NANOLOG
+    bool writeDictionary = true;
+#else
+    bool writeDictionary = false;
+#endif
+
+    return insertCheckpoint(&writePos, endOfBuffer, writeDictionary);
+}
+
+/**
+ * Given a vector of StaticLogInfo and a starting index, encode all the static
+ * log information into a partial dictionary for the Decompressor to use.
+ *
+ * \param[in/out] currentPosition
+ *      Starting/Ending index
+ * \param allMetadata
+ *      All the static log information encountered so far
+ *
+ * \return
+ *      Number of bytes encoded in the dictionary
+ */
+uint32_t
+Log::Encoder::encodeNewDictionaryEntries(uint32_t& currentPosition,
+                            const InvocationSiteRegistry &allMetadata)
+{
+    if (!reserveTimeIndex())
+        return 0;
+
+    char *bufferStart = writePos;
+
+    if (sizeof(DictionaryFragment) >=
+                                static_cast<uint32_t>(endOfBuffer - writePos))
+        return 0;
+
+    DictionaryFragment *df = reinterpret_cast<DictionaryFragment*>(writePos);
+    writePos += sizeof(DictionaryFragment);
+    df->entryType = EntryType::LOG_MSGS_OR_DIC;
+
+    uint32_t numSites = allMetadata.size();
+    while (currentPosition < numSites) {
+        const StaticLogInfo &curr = allMetadata[currentPosition];
+        size_t filenameLength = strlen(curr.filename) + 1;
+        size_t formatLength = strlen(curr.formatString) + 1;
+
+        // User-defined types and arrays are stored as strings that plain %s
+        // arguments could mimic, so the sites that log them also record how
+        // their parameters are stored (see CompressedLogInfo).
+        size_t argStorageLength = 0;
+        for (int i = 0; curr.argStorage != nullptr && i < curr.numParams; ++i) {
+            if (curr.paramTypes[i] > ParamType::NON_STRING
+                    && (curr.argStorage[i] & ARG_STORAGE_USER_TYPE))
+                argStorageLength = curr.numParams;
+        }
+
+        size_t nextDictSize = sizeof(CompressedLogInfo)
+                                    + filenameLength
+                                    + formatLength
+                                    + argStorageLength;
+
+        // Not enough space, break out!
+        if (nextDictSize >= static_cast<uint32_t>(endOfBuffer - writePos))
+            break;
+
+        CompressedLogInfo *cli = reinterpret_cast<CompressedLogInfo*>(writePos);
+        writePos += sizeof(CompressedLogInfo);
+
+        cli->severity = packSeverity(curr.severity, curr.timestampSource);
+        if (curr.internStrings)
+            cli->severity |= INTERNED_STRINGS_FLAG;
+        cli->linenum = curr.lineNum;
+        cli->filenameLength = static_cast<uint16_t>(filenameLength);
+        cli->formatStringLength = static_cast<uint16_t>(formatLength
+                                                        + argStorageLength);
+
+        memcpy(writePos, curr.filename, filenameLength);
+        memcpy(writePos + filenameLength, curr.formatString, formatLength);
+        writePos += filenameLength + formatLength;
+
+        // Only the flags of string parameters are meaningful (see
+        // ARG_STORAGE_BINARY), so the others are recorded as 0.
+        for (size_t i = 0; i < argStorageLength; ++i) {
+            *writePos++ = (curr.paramTypes[i] > ParamType::NON_STRING)
+                                ? static_cast<char>(curr.argStorage[i]) : 0;
+        }
+        ++currentPosition;
+    }
+
+    df->newMetadataBytes = 0x3FFFFFFF & static_cast<uint32_t>(
+                                                        writePos - bufferStart);
+    df->totalMetadataEntries = currentPosition;
+
+    if (timeIndex)
+        timeIndex->hasDictionary = true;
+    updateTimeIndexLength();
+
+    return df->newMetadataBytes;
+}
+
+/**
+ * Interprets the uncompressed log messages (created by the compile-time
+ * generated code) contained in the *from buffer and compresses them to
+ * the internal buffer. The encoded data can later be retrieved via swapBuffer()
+ *
+ * \param from
+ *      A buffer containing the uncompressed log message created by the
+ *      compile-time generated code
+ * \param nbytes
+ *      Maximum number of bytes that can be extracted from the *from buffer
+ * \param bufferId
+ *      The runtime thread/StagingBuffer id to associate the logs with
+ * \param newPass
+ *      Indicates that this encoding correlates with starting a new pass
+ *      through the runtime StagingBuffers. In other words, this should be true
+ *      on the first invocation of this function after the runtime has checked
+ *      and encoded all the StagingBuffers at least once.
+ * \param[out] numEventsCompressed
+ *      adds the number of log messages processed in this invocation
+ *
+ * \return
+ *      The number of bytes read from *from. A value of 0 indicates there is
+ *      insufficient space in the internal buffer to fit the compressed message.
+ */
+long
+Log::Encoder::encodeLogMsgs(char *from,
+                                    uint64_t nbytes,
+                                    uint32_t bufferId,
+                                    bool newPass,
+                                    uint64_t *numEventsCompressed)
+{
+    if (!encodeBufferExtentStart(bufferId, newPass))
+        return 0;
+
+    uint64_t lastTimestamp = getTimestampBase(from, nbytes);
+    long remaining = nbytes;
+    long numEventsProcessed = 0;
+    char *bufferStart = writePos;
+
+    while (remaining > 0) {
+        auto *entry = reinterpret_cast<UncompressedEntry*>(from);
+
+        if (entry->entrySize > remaining) {
+            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
+                break;
+
+            GeneratedFunctions::LogMetadata &lm
+                            = GeneratedFunctions::logId2Metadata[entry->fmtId];
+            fprintf(stderr, "ERROR: Attempting to log a message that is %u "
+                            "bytes while the maximum allowable size is %u.\r\n"
+                            "This occurs for the log message %s:%u '%s'\r\n",
+                            entry->entrySize,
+                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
+                            lm.fileName, lm.lineNumber, lm.fmtString);
+        }
+
+        // Check for free space using the worst case assumption that
+        // none of the arguments compressed and there are as many Nibbles
+        // as there are data bytes.
+        uint32_t maxCompressedSize = downCast<uint32_t>(2*entry->entrySize
+                                + sizeof(Log::UncompressedEntry));
+        if (maxCompressedSize > (endOfBuffer - writePos))
+            break;
+
+        fillInTimestamp(entry, lastTimestamp);
+        compressLogHeader(entry, &writePos, lastTimestamp);
+        lastTimestamp = entry->timestamp;
+        indexTimestamp(entry->timestamp);
+        indexLogId(entry->fmtId);
+
+        size_t argBytesWritten =
+            GeneratedFunctions::compressFnArray[entry->fmtId](entry, writePos);
+        writePos += argBytesWritten;
+
+        remaining -= entry->entrySize;
+        from += entry->entrySize;
+
+        ++numEventsProcessed;
+    }
+
+    assert(currentExtentSize);
+    *currentExtentSize += downCast<uint32_t>(writePos - bufferStart);
+    updateTimeIndexLength();
+
+    if (numEventsCompressed)
+        *numEventsCompressed += numEventsProcessed;
+
+    return nbytes - remaining;
+}
+
+
+/**
+ * Compresses a *from buffer filled with UncompressedEntry's and their
+ * arguments to an internal buffer. The encoded data can then later be retrieved
+ * via swapBuffer().
+ *
+ * This function is specialized for the non-preprocessor version of NanoLog and
+ * requires a dictionary mapping logId's to static log information to be
+ * explicitly passed in.
+ *
+ * \param from
+ *      A buffer containing the uncompressed log message created by the
+ *      the non-preprocessor version of NanoLog
+ * \param nbytes
+ *      Maximum number of bytes that can be extracted from the *from buffer
+ * \param bufferId
+ *      The runtime thread/StagingBuffer id to associate the logs with
+ * \param newPass
+ *      Indicates that this encoding correlates with starting a new pass
+ *      through the runtime StagingBuffers. In other words, this should be true
+ *      on the first invocation of this function after the runtime has checked
+ *      and encoded all the StagingBuffers at least once.
+ * \param[out] numEventsCompressed
+ *      adds the number of log messages processed in this invocation
+ *
+ * \return
+ *      The number of bytes read from *from. A value of 0 indicates there is
+ *      insufficient space in the internal buffer to fit the compressed message.
+ */
+long
+Log::Encoder::encodeLogMsgs(char *from,
+                            uint64_t nbytes,
+                            uint32_t bufferId,
+                            bool newPass,
+                            const InvocationSiteRegistry &dictionary,
+                            uint64_t *numEventsCompressed)
+{
+    if (!encodeBufferExtentStart(bufferId, newPass))
+        return 0;
+
+    uint64_t lastTimestamp = getTimestampBase(from, nbytes);
+    long remaining = nbytes;
+    long numEventsProcessed = 0;
+    char *bufferStart = writePos;
+
+    // Sites registered while this runs are picked up on the next invocation
+    uint32_t numSites = updateEncodePlans(dictionary);
+    const EncodePlan *plans = encodePlans.data();
+
+    // Lends the interner to the compression functions of NANO_LOG_INTERNED()
+    StringInterner::active = &stringInterner;
+
+    while (remaining > 0) {
+        auto *entry = reinterpret_cast<UncompressedEntry*>(from);
+
+        // New log entry that we have not observed yet
+        if (numSites <= entry->fmtId) {
+            ++encodeMissDueToMetadata;
+            ++consecutiveEncodeMissesDueToMetadata;
+
+            // If we miss a whole bunch, then we start printing out errors
+            if (consecutiveEncodeMissesDueToMetadata % 1000 == 0) {
+                fprintf(stderr, "NanoLog Error: Metadata missing for a dynamic "
+                                "log message (id=%u) during compression. If "
+                                "you are using Preprocessor NanoLog, there is "
+                                "be a problem with your integration (static "
+                                "logs detected=%lu).\r\n",
+                                entry->fmtId,
+                                GeneratedFunctions::numLogIds);
+            }
+
+            break;
+        }
+
+        consecutiveEncodeMissesDueToMetadata = 0;
+
+#ifdef ENABLE_DEBUG_PRINTING
+        printf("Trying to encode fmtId=%u, size=%u, remaining=%ld\r\n",
+                entry->fmtId, entry->entrySize, remaining);
+        printf("\t%s\r\n", dictionary[entry->fmtId].formatString);
+#endif
+
+        if (entry->entrySize > remaining) {
+            if (entry->entrySize < (NanoLogConfig::STAGING_BUFFER_SIZE/2))
+                break;
+
+            const StaticLogInfo &info = dictionary[entry->fmtId];
+            fprintf(stderr, "NanoLog ERROR: Attempting to log a message that "
+                            "is %u bytes while the maximum allowable size is "
+                            "%u.\r\n This occurs for the log message %s:%u '%s'"
+                            "\r\n",
+                            entry->entrySize,
+                            NanoLogConfig::STAGING_BUFFER_SIZE/2,
+                            info.filename, info.lineNum, info.formatString);
+        }
+
+        // Check for free space using the worst case assumption that
+        // none of the arguments compressed and there are as many Nibbles
+        // as there are data bytes.
+        uint32_t maxCompressedSize = downCast<uint32_t>(2*entry->entrySize
+                                              + sizeof(Log::UncompressedEntry));
+        if (maxCompressedSize > (endOfBuffer - writePos))
+            break;
+
+        fillInTimestamp(entry, lastTimestamp);
+        compressLogHeader(entry, &writePos, lastTimestamp);
+        lastTimestamp = entry->timestamp;
+        indexTimestamp(entry->timestamp);
+        indexLogId(entry->fmtId);
+
+        const EncodePlan &plan = plans[entry->fmtId];
+#ifdef ENABLE_DEBUG_PRINTING
+        printf("\r\nCompressing \'%s\' with info.id=%d\r\n",
+                dictionary[entry->fmtId].formatString, entry->fmtId);
+#endif
+        char *argData = entry->argData;
+        plan.compressionFunction(plan.numNibbles, plan.paramTypes,
+                                 &argData, &writePos);
+
+        remaining -= entry->entrySize;
+        from += entry->entrySize;
+
+        ++numEventsProcessed;
+    }
+
+    StringInterner::active = nullptr;
+
+    assert(currentExtentSize);
+    *currentExtentSize += downCast<uint32_t>(writePos - bufferStart);
+    updateTimeIndexLength();
+
+    if (numEventsCompressed)
+        *numEventsCompressed += numEventsProcessed;
+
+    return nbytes - remaining;
+}
+
+/**
+ * Extends the EncodePlans to cover the invocation sites registered in the
+ * dictionary since the last invocation. Only the new sites are read, so the
+ * cost of registering a site is paid once rather than on every pass.
+ *
+ * \param dictionary
+ *      Static log information of the log invocation sites; if it's not the
+ *      dictionary of the previous invocation, the plans are rebuilt
+ *
+ * \return
+ *      Number of sites that have an EncodePlan
+ */
+uint32_t
+Log::Encoder::updateEncodePlans(const InvocationSiteRegistry &dictionary)
+{
+    if (encodePlansDictionary != &dictionary) {
+        encodePlans.clear();
+        encodePlansDictionary = &dictionary;
+    }
+
+    uint32_t numSites = dictionary.size();
+    for (uint32_t id = downCast<uint32_t>(encodePlans.size());
+            id < numSites; ++id) {
+        const StaticLogInfo &info = dictionary[id];
+        encodePlans.push_back({info.compressionFunction, info.numNibbles,
+                               info.paramTypes});
+    }
+
+    return numSites;
+}
+
+/**
+ * Encodes a marker indicating that a runtime StagingBuffer had to drop log
+ * messages due to a lack of space. The Decoder reports the loss inline with
+ * the log messages.
+ *
+ * \param bufferId
+ *      The runtime thread/StagingBuffer id that dropped the log messages
+ * \param numDropped
+ *      Number of log messages dropped since the last marker for bufferId
+ * \param timestamp
+ *      rdtsc() timestamp of the last log message dropped
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::encodeDroppedLogs(uint32_t bufferId,
+                                uint64_t numDropped,
+                                uint64_t timestamp)
+{
+    if (!reserveTimeIndex())
+        return false;
+
+    if (sizeof(DroppedLogs) > static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    DroppedLogs *dl = reinterpret_cast<DroppedLogs*>(writePos);
+    writePos += sizeof(DroppedLogs);
+
+    dl->entryType = EntryType::INVALID;
+    dl->extendedType = ExtendedEntryType::DROPPED_LOGS;
+    dl->bufferId = bufferId;
+    dl->numDropped = numDropped;
+    dl->timestamp = timestamp;
+
+    // Log messages after the marker belong to a new extent
+    lastBufferIdEncoded = -1;
+    currentExtentSize = nullptr;
+
+    if (timeIndex)
+        timeIndex->bufferIds |= (1UL << (bufferId % 64));
+    indexTimestamp(timestamp);
+    updateTimeIndexLength();
+
+    return true;
+}
+
+/**
+ * Encodes a reading of the wall clock along with the rdtsc() at the time,
+ * which the Decoder interpolates the wall times of the log messages between
+ * (see ClockCalibration).
+ *
+ * \param rdtsc
+ *      rdtsc() value at the time of the reading
+ * \param unixNanos
+ *      CLOCK_REALTIME in nanoseconds since the epoch
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::encodeClockCalibration(uint64_t rdtsc, int64_t unixNanos)
+{
+    if (!reserveTimeIndex())
+        return false;
+
+    if (sizeof(ClockCalibration) >
+            static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    ClockCalibration *cc = reinterpret_cast<ClockCalibration*>(writePos);
+    writePos += sizeof(ClockCalibration);
+
+    cc->entryType = EntryType::INVALID;
+    cc->extendedType = ExtendedEntryType::CLOCK_CALIBRATION;
+    cc->rdtsc = rdtsc;
+    cc->unixNanos = unixNanos;
+
+    // Log messages after the calibration belong to a new extent, and a
+    // Decoder seeking by time must not skip over it
+    lastBufferIdEncoded = -1;
+    currentExtentSize = nullptr;
+
+    if (timeIndex)
+        timeIndex->hasDictionary = true;
+    updateTimeIndexLength();
+
+    return true;
+}
+
+/**
+ * Internal function that encodes a marker indicating that all log messages
+ * after this point (but after the next marker) belong to a particular buffer.
+ * This is only used in encodeLogMsgs, but is separated out to allow for easy
+ * unit testing with its counterpart in Decoder.
+ *
+ * \param bufferId
+ *      Buffer id to encode in the extent
+ * \param newPass
+ *      Indicates whether this buffer change also correlates with the start of
+ *      a new pass through the runtime StagingBuffers by the caller
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::encodeBufferExtentStart(uint32_t bufferId, bool newPass)
+{
+    if (!reserveTimeIndex())
+        return false;
+
+    // For size check, assume the worst case of no compression on bufferId
+    char *writePosStart = writePos;
+    if (sizeof(BufferExtent) + sizeof(bufferId) >
+            static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    BufferExtent *tc = reinterpret_cast<BufferExtent*>(writePos);
+    writePos += sizeof(BufferExtent);
+
+    tc->entryType = EntryType::BUFFER_EXTENT;
+    tc->wrapAround = newPass;
+
+    if (bufferId < (1<<4)) {
+        tc->isShort = true;
+        tc->threadIdOrPackNibble = 0x0F & bufferId;
+    } else {
+        tc->isShort = false;
+        tc->threadIdOrPackNibble = 0x0F & BufferUtils::pack<uint32_t>(
+                                                        &writePos, bufferId);
+    }
+
+    tc->length = downCast<uint32_t>(writePos - writePosStart);
+    currentExtentSize = &(tc->length);
+    lastBufferIdEncoded = bufferId;
+    stringInterner.reset();
+
+    if (timeIndex)
+        timeIndex->bufferIds |= (1UL << (bufferId % 64));
+    updateTimeIndexLength();
+
+    return true;
+}
+
+/**
+ * Internal function that starts the buffer's entries off with a TimeIndex
+ * and its LogIdSummary if the Encoder was configured to do so and the buffer
+ * doesn't have one yet. Both are filled in as entries are encoded after them.
+ *
+ * \return
+ *      Whether the operation completed successfully (true) or failed due to
+ *      lack of space in the internal buffer (false)
+ */
+bool
+Log::Encoder::reserveTimeIndex()
+{
+    if (!encodeTimeIndex || timeIndex != nullptr)
+        return true;
+
+    if (sizeof(TimeIndex) + sizeof(LogIdSummary) >
+                            static_cast<size_t>(endOfBuffer - writePos))
+        return false;
+
+    timeIndex = reinterpret_cast<TimeIndex*>(writePos);
+    writePos += sizeof(TimeIndex);
+
+    timeIndex->entryType = EntryType::INVALID;
+    timeIndex->extendedType = ExtendedEntryType::TIME_INDEX;
+    timeIndex->hasDictionary = false;
+    timeIndex->minTimestamp = UINT64_MAX;
+    timeIndex->maxTimestamp = 0;
+    timeIndex->bufferIds = 0;
+    timeIndex->baseTimestamp = 0;
+    timeIndex->flushedUpTo = 0;
+
+    logIdSummary = reinterpret_cast<LogIdSummary*>(writePos);
+    writePos += sizeof(LogIdSummary);
+
+    logIdSummary->entryType = EntryType::INVALID;
+    logIdSummary->extendedType = ExtendedEntryType::LOG_ID_SUMMARY;
+    memset(logIdSummary->logIds, 0, sizeof(logIdSummary->logIds));
+    timeIndex->length = sizeof(TimeIndex) + sizeof(LogIdSummary);
+
+    return true;
+}
+
+/**
+ * Records in the TimeIndex of the current buffer that every log message
+ * timestamped before a point in time is in the log file ahead of the buffer
+ * (see TimeIndex::flushedUpTo).
+ *
+ * \param timestamp
+ *      rdtsc() timestamp to record
+ */
+void
+Log::Encoder::setFlushedUpTo(uint64_t timestamp)
+{
+    // 0 is left to the encoders that don't keep track
+    if (timeIndex)
+        timeIndex->flushedUpTo = std::max<uint64_t>(timestamp, 1);
+}
+
+/**
+ * Retrieve the number of bytes encoded in the internal buffer
+ *
+ * \return
+ *      Number of bytes encoded in the internal buffer
+ */
+size_t
+Log::Encoder::getEncodedBytes() {
+    return writePos - backing_buffer;
+}
+
+/**
+ * Releases the internal buffer and replaces it with a different one.
+ *
+ * \param inBuffer
+ *      the new buffer to swap in
+ * \param inSize
+ *      the amount of free space usable in the buffer
+ * \param[out] outBuffer
+ *      returns a pointer to the original buffer
+ * \param[out] outLength
+ *      returns the number of bytes of encoded data in the outBuffer
+ */
+void
+Log::Encoder::swapBuffer(char *inBuffer, size_t inSize, char **outBuffer,
+                                            size_t *outLength, size_t *outSize)
+{
+    char *ret = backing_buffer;
+    size_t size = writePos - backing_buffer;
+    size_t originalSize = endOfBuffer - backing_buffer;
+
+    backing_buffer = inBuffer;
+    writePos = inBuffer;
+    endOfBuffer = inBuffer + inSize;
+    lastBufferIdEncoded = -1;
+    currentExtentSize = nullptr;
+    timeIndex = nullptr;
+    logIdSummary = nullptr;
+
+    if (outBuffer)
+        *outBuffer = ret;
+
+    if (outLength)
+        *outLength = size;
+
+    if (outSize)
+        *outSize = originalSize;
+}
+
+// Constructor for LogMessage
+Log::LogMessage::LogMessage()
+        : metadata(nullptr)
+        , logId(-1)
+        , rdtsc(0)
+        , numArgs(0)
+        , totalCapacity(sizeof(rawArgs)/sizeof(uint64_t))
+        , rawArgs()
+        , rawArgsExtension(nullptr)
+{}
+
+// Destructor for LogMessage
+Log::LogMessage::~LogMessage() {
+    if (rawArgsExtension != nullptr) {
+        free(rawArgsExtension);
+        rawArgsExtension = nullptr;
+        totalCapacity = INITIAL_SIZE;
+    }
+}
+
+/**
+ * Reserve/Allocate enough space for N parameters in the structure
+ *
+ * \param nparams
+ *    Number of parameters to ensure space for
+ */
+void
+Log::LogMessage::reserve(int nparams)
+{
+    if (totalCapacity >= nparams)
+        return;
+
+    while (totalCapacity < nparams)
+        totalCapacity *= 2;
+
+    size_t newSize = sizeof(uint64_t)*(totalCapacity - INITIAL_SIZE);
+    uint64_t *newAllocation = static_cast<uint64_t*>(malloc(newSize));
+
+    if (newAllocation == nullptr) {
+        fprintf(stderr, "Could not allocate memory to store %d log "
+                        "arguments. Exiting...", nparams);
+        exit(1);
+    }
+
+    if (rawArgsExtension == nullptr) {
+        rawArgsExtension = newAllocation;
+        return;
+    }
+
+    memcpy(newAllocation,
+           rawArgsExtension,
+           sizeof(uint64_t)*(numArgs - INITIAL_SIZE));
+    free(rawArgsExtension);
+
+    rawArgsExtension = newAllocation;
+}
+
+/**
+ * Ready's the structure for a new log statement by reassigning the static
+ * log information. Dynamic arguments can then be push()-ed into the
+ * structure.
+ *
+ * \param meta
+ *      Static log data to refer to
+ * \param logId
+ *      Preprocessor assigned log id of the log message
+ * \param rdtsc
+ *      Invocation time of the log message
+ */
+void
+Log::LogMessage::reset(FormatMetadata *meta, uint32_t logId, uint64_t rdtsc)
+{
+    this->metadata = meta;
+    this->rdtsc = rdtsc;
+    this->logId = logId;
+    numArgs = 0;
+}
+
+// Indicates whether the structure stores a valid log statement or not
+bool Log::LogMessage::valid() {
+    return metadata != nullptr;
+}
+
+// Returns the number of arguments currently stored for the log.
+int Log::LogMessage::getNumArgs() {
+    return numArgs;
+}
+
+// Returns the preprocessor-assigned log identifier for this log message
+uint32_t Log::LogMessage::getLogId() {
+    return logId;
+}
+
+// Returns the runtime timestamp for the log invocation.
+uint64_t Log::LogMessage::getTimestamp() {
+    return rdtsc;
+}
+
+/**
+ * Decoder constructor.
+ *
+ * Due to the large amount of memory needed to buffer log statements, the
+ * decoder is intended to be constructed once and then re-used via open().
+ */
+Log::Decoder::Decoder()
+    : filename()
+    , inputFd(nullptr)
+    , fileMapping(nullptr)
+    , fileMappingBytes(0)
+    , blockStream(nullptr)
+    , logMsgsPrinted(0)
+    , bufferFragment(nullptr)
+    , good(false)
+    , checkpoint()
+    , wallClock()
+    , freeBuffers()
+    , fmtId2metadata()
+    , fmtId2fmtString()
+    , fmtId2compiledFormat()
+    , rawMetadata(nullptr)
+    , endOfRawMetadata(nullptr)
+    , numBufferFragmentsRead(0)
+    , numLogMsgsDropped(0)
+    , numCheckpointsRead(0)
+    , timeRangeSet(false)
+    , timeRangeStart(0)
+    , timeRangeEnd(0)
+    , logFilter()
+    , logFilterSet(false)
+    , logFilterMatches()
+    , logFilterSummary()
+    , numTimeIndexesSkipped(0)
+    , timestampBase(0)
+    , timestampBaseEnd(-1)
+    , flushedUpTo(0)
+    , numCompressedBlocksRead(0)
+    , numLogMsgsOutOfRange(0)
+    , numLogMsgsFiltered(0)
+    , mergeStream(nullptr)
+    , traceFd(nullptr)
+    , numTraceEvents(0)
+    , following(false)
+    , inotifyFd(-1)
+    , inotifyWatch(-1)
+{
+    // Take advantage of virtual memory an allocate an insanely large (1GB)
+    // buffer to store log metadata read from the logFile. Such a large buffer
+    // is used so that we don't have to explicitly manage the buffer and instead
+    // leave it up to the virtual memory system.
+    rawMetadata = static_cast<char*>(malloc(1024*1024*1024));
+
+    if (rawMetadata == nullptr) {
+        fprintf(stderr, "Could not allocate an internal 1GB buffer to store log"
+                " metadata");
+        exit(-1);
+    }
+
+    endOfRawMetadata = rawMetadata;
+    fmtId2metadata.reserve(1000);
+    fmtId2fmtString.reserve(1000);
+    fmtId2compiledFormat.reserve(1000);
+    bufferFragment = allocateBufferFragment();
+}
+
+/**
+ * Reads the metadata necessary to decompress log messsages from a log file.
+ * This function can be invoked incrementally to build a larger dictionary from
+ * smaller fragments in the file and it should only be invoked once per fragment
+ *
+ * \param fd
+ *      File descriptor pointing to the dictionary fragment
+ * \param flushOldDictionary
+ *      Removes the old dictionary entries
+ * \return
+ *      true if successful, false if the dictionary was corrupt
+ */
+bool
+Log::Decoder::readDictionary(FILE *fd, bool flushOldDictionary) {
+    if (!readCheckpoint(checkpoint, fd)) {
+        fprintf(stderr, "Error: Could not read initial checkpoint, "
+                "the compressed log may be corrupted.\r\n");
+        return false;
+    }
+    wallClock.reset(checkpoint);
+
+    // The timestamps of a new execution start over
+    flushedUpTo = 0;
+
+    size_t bytesRead = fread(endOfRawMetadata, 1, checkpoint.newMetadataBytes,
+                             fd);
+    if (bytesRead != checkpoint.newMetadataBytes) {
+        fprintf(stderr, "Error couldn't read metadata header in log file.\r\n");
+        return false;
+    }
+
+    if (flushOldDictionary) {
+        endOfRawMetadata = rawMetadata;
+        fmtId2metadata.clear();
+        fmtId2fmtString.clear();
+        fmtId2compiledFormat.clear();
+        logFilterMatches.clear();
+        memset(logFilterSummary, 0, sizeof(logFilterSummary));
+    }
+
+    // Build an index of format id to metadata
+    const char *start = endOfRawMetadata;
+    const char *newEnd = endOfRawMetadata + bytesRead;
+    while(endOfRawMetadata < newEnd) {
+        std::string fmtString;
+        fmtId2metadata.push_back(endOfRawMetadata);
+
+        // Skip ahead
+        auto *fm = reinterpret_cast<FormatMetadata*>(endOfRawMetadata);
+        endOfRawMetadata += sizeof(FormatMetadata) + fm->filenameLength;
+
+        for (int i = 0; i < fm->numPrintFragments
+                        && newEnd >= endOfRawMetadata; ++i)
+        {
+            auto *pf = reinterpret_cast<PrintFragment*>(endOfRawMetadata);
+            endOfRawMetadata += sizeof(PrintFragment) + pf->fragmentLength;
+            fmtString.append(pf->formatFragment);
+
+            // The preprocessor version of NanoLog doesn't intern strings
+            pf->internedString = false;
+        }
+
+        fmtId2fmtString.push_back(fmtString);
+    }
+
+    if (newEnd != endOfRawMetadata) {
+        fprintf(stderr, "Error: Log dictionary is inconsistent; "
+                        "expected %lu bytes, but read %lu bytes\r\n",
+                newEnd - start,
+                endOfRawMetadata - start);
+        return false;
+    }
+
+    if (fmtId2metadata.size() != checkpoint.totalMetadataEntries) {
+        fprintf(stderr, "Error: Missing log metadata detected; "
+                        "expected %u messages, but only found %lu\r\n",
+                       checkpoint.totalMetadataEntries,
+                       fmtId2metadata.size());
+        return false;
+    }
+
+    compileFormats();
+    ++numCheckpointsRead;
+    return true;
+}
+
+/**
+ * Parses the <length> and <specifier> components of a printf format sub-string
+ * according to http://www.cplusplus.com/reference/cstdio/printf/ and returns
+ * a corresponding FormatType.
+ *
+ * \param length
+ *      Length component of the printf format string
+ * \param specifier
+ *      Specifier component of the printf format string
+ * @return
+ *      The FormatType corresponding to the length and specifier. A value of
+ *      MAX_FORMAT_TYPE is returned in case of error.
+ */
+static NanoLogInternal::Log::FormatType
+getFormatType(std::string length, char specifier)
+{
+    using namespace NanoLogInternal::Log;
+
+    // Signed Integers
+    if (specifier == 'd' || specifier == 'i') {
+        if (length.empty())
+            return int_t;
+
+        if (length.size() == 2) {
+            if (length[0] == 'h') return signed_char_t;
+            if (length[0] == 'l') return long_long_int_t;
+        }
+
+        switch(length[0]) {
+            case 'h': return short_int_t;
+            case 'l': return long_int_t;
+            case 'j': return intmax_t_t;
+            case 'z': return size_t_t;
+            case 't': return ptrdiff_t_t;
+            default : break;
+        }
+    }
+
+    // Unsigned integers
+    if (specifier == 'u' || specifier == 'o'
+            || specifier == 'x' || specifier == 'X')
+    {
+        if (length.empty())
+            return unsigned_int_t;
+
+        if (length.size() == 2) {
+            if (length[0] == 'h') return unsigned_char_t;
+            if (length[0] == 'l') return unsigned_long_long_int_t;
+        }
+
+        switch(length[0]) {
+            case 'h': return unsigned_short_int_t;
+            case 'l': return unsigned_long_int_t;
+            case 'j': return uintmax_t_t;
+            case 'z': return size_t_t;
+            case 't': return ptrdiff_t_t;
+            default : break;
+        }
+    }
+
+    // Strings
+    if (specifier == 's') {
+        if (length.empty()) return const_char_ptr_t;
+        if (length[0] == 'l') return const_wchar_t_ptr_t;
+    }
+
+    // Pointer
+    if (specifier == 'p') {
+        if (length.empty()) return const_void_ptr_t;
+    }
+
+
+    // Floating points
+    if (specifier == 'f' || specifier == 'F'
+            || specifier == 'e' || specifier == 'E'
+            || specifier == 'g' || specifier == 'G'
+            || specifier == 'a' || specifier == 'A')
+    {
+        if (length.size() == 1 && length[0] == 'L' )
+            return long_double_t;
+        else
+            return double_t;
+    }
+
+    if (specifier == 'c') {
+        if (length.empty()) return int_t;
+        if (length[0] == 'l') return wint_t_t;
+    }
+
+    fprintf(stderr, "Attempt to decode format specifier failed: %s%c\r\n",
+            length.c_str(), specifier);
+    return MAX_FORMAT_TYPE;
+}
+
+/**
+ * Generate a more efficient internal representation describing how to process
+ * the compressed arguments of a NANO_LOG statement given its static
+ * log information.
+ *
+ * The output representation would look something like a FormatMetadata with
+ * nested PrintFragments. This representation can then be interpreted by the
+ * state machine in decompressNextLogStatement to decompress the log statements.
+ *
+ * \param[in/out] microCode
+ *      Buffer to store the generated internal representation
+ * \param formatString
+ *      Format string of the NANO_LOG statement
+ * \param filename
+ *      File associated with the log invocation site
+ * \param linenum
+ *      Line number within filename associated with the log invocation site
+ * \param severity
+ *      LogLevel severity associated with the log invocation site
+ * \param internedStrings
+ *      Indicates that the %s arguments of the log invocation site are
+ *      interned (see StringInterner)
+ * \param timestampSource
+ *      How the log invocation site read its timestamps
+ * \param argStorage
+ *      StaticLogInfo::argStorage of the parameters of the log invocation site
+ *      if the dictionary carries it, which identifies the %s arguments that
+ *      are user-defined types or arrays; nullptr otherwise
+ * \param numArgStorage
+ *      Number of bytes in argStorage
+ * \return
+ *      true indicates success; false indicates malformed printf format string
+ */
+bool
+Log::Decoder::createMicroCode(char **microCode,
+                                const char *formatString,
+                                const char *filename,
+                                uint32_t linenum,
+                                uint8_t severity,
+                                bool internedStrings,
+                                NanoLog::TimestampSource timestampSource,
+                                const uint8_t *argStorage,
+                                size_t numArgStorage)
+{
+    using namespace NanoLogInternal::Log;
+
     size_t formatStringLength = strlen(formatString) + 1; // +1 for NULL
     char *microCodeStartingPos = *microCode;
     FormatMetadata *fm = reinterpret_cast<FormatMetadata*>(*microCode);
     *microCode += sizeof(FormatMetadata);
 
-    fm->logLevel = severity;
-    fm->lineNumber = linenum;
-    fm->filenameLength = static_cast<uint16_t>(strlen(filename) + 1);
-    *microCode = stpcpy(*microCode, filename) + 1;
+    fm->logLevel = SEVERITY_MASK & severity;
+    fm->timestampSource = 0x7 & static_cast<uint8_t>(timestampSource);
+    fm->lineNumber = linenum;
+    fm->filenameLength = static_cast<uint16_t>(strlen(filename) + 1);
+    *microCode = stpcpy(*microCode, filename) + 1;
+
+    fm->numNibbles = 0;
+    fm->numPrintFragments = 0;
+
+    std::regex regex("^%"
+                     "([-+ #0]+)?" // Flags (Position 1)
+                     "([\\d]+|\\*)?" // Width (Position 2)
+                     "(\\.(\\d+|\\*))?"// Precision (Position 4; 3 includes '.')
+                     "(hh|h|l|ll|j|z|Z|t|L)?" // Length (Position 5)
+                     "([diuoxXfFeEgGaAcspn])"// Specifier (Position 6)
+                     );
+
+    size_t i = 0;
+    std::cmatch match;
+    int consecutivePercents = 0;
+    size_t startOfNextFragment = 0;
+    size_t paramIndex = 0;
+    PrintFragment *pf = nullptr;
+
+    // The key idea here is to split up the format string in to fragments (i.e.
+    // PrintFragments) such that there is at most one specifier per fragment.
+    // This then allows the decompressor later to consume one argument at a
+    // time and print the fragment (vs. buffering all the arguments first).
+
+    while (i < formatStringLength) {
+        char c = formatString[i];
+
+        // Skip the next character if there's an escape
+        if (c == '\\') {
+            i += 2;
+            continue;
+        }
+
+        if (c != '%') {
+            ++i;
+            consecutivePercents = 0;
+            continue;
+        }
+
+        // If there's an even number of '%'s, then it's a comment
+        if (++consecutivePercents % 2 == 0
+                || !std::regex_search(formatString + i, match, regex))
+        {
+            ++i;
+            continue;
+        }
+
+        // Advance the pointer to the end of the specifier
+        i += match.length();
+
+        // At this point we found a match, let's start analyzing it
+        pf = reinterpret_cast<PrintFragment*>(*microCode);
+        *microCode += sizeof(PrintFragment);
+
+        std::string width = match[2].str();
+        std::string precision = match[4].str();
+        std::string length = match[5].str();
+        char specifier = match[6].str()[0];
+
+        FormatType type = getFormatType(length, specifier);
+        if (type == MAX_FORMAT_TYPE) {
+            fprintf(stderr, "Error: Couldn't process this: %s\r\n",
+                    match.str().c_str());
+            *microCode = microCodeStartingPos;
+            return false;
+        }
+
+        pf->hasDynamicWidth = (width.empty()) ? false : width[0] == '*';
+        pf->hasDynamicPrecision = (precision.empty()) ? false
+                                                        : precision[0] == '*';
+        paramIndex += pf->hasDynamicWidth + pf->hasDynamicPrecision;
+
+        if (type == const_char_ptr_t && paramIndex < numArgStorage) {
+            uint8_t storage = argStorage[paramIndex];
+            if ((storage & ARG_STORAGE_ARRAY) == ARG_STORAGE_ARRAY)
+                type = array_t;
+            else if (storage & ARG_STORAGE_USER_TYPE)
+                type = user_type_t;
+        }
+        ++paramIndex;
+
+        pf->argType = 0x1F & type;
+        pf->internedString = internedStrings && (type == const_char_ptr_t
+                                                    || type == user_type_t
+                                                    || type == array_t);
+
+        // Tricky tricky: We null-terminate the fragment by copying 1
+        // extra byte and then setting it to NULL
+        pf->fragmentLength = static_cast<uint16_t>(i - startOfNextFragment + 1);
+        memcpy(*microCode,
+                formatString + startOfNextFragment,
+                pf->fragmentLength);
+        *microCode += pf->fragmentLength;
+        *(*microCode - 1) = '\0';
+
+        // Non-strings and dynamic widths need nibbles!
+        if (specifier != 's')
+            ++fm->numNibbles;
+
+        if (pf->hasDynamicWidth)
+            ++fm->numNibbles;
+
+        if (pf->hasDynamicPrecision)
+            ++fm->numNibbles;
+
+#ifdef ENABLE_DEBUG_PRINTING
+        printf("Fragment %d: %s\r\n", fm->numPrintFragments,pf->formatFragment);
+        printf("\t\ttype: %u, dWidth: %u, dPrecision: %u, length: %u\r\n",
+                                           pf->argType,
+                                           pf->hasDynamicWidth,
+                                           pf->hasDynamicPrecision,
+                                           pf->fragmentLength);
+#endif
+
+        startOfNextFragment = i;
+        ++fm->numPrintFragments;
+    }
+
+    // If we didn't encounter any specifiers, make one for a basic string
+    if (pf == nullptr) {
+        pf = reinterpret_cast<PrintFragment*>(*microCode);
+        *microCode += sizeof(PrintFragment);
+        fm->numPrintFragments = 1;
+
+        pf->argType = FormatType::NONE;
+        pf->hasDynamicWidth = pf->hasDynamicPrecision = false;
+        pf->internedString = false;
+        pf->fragmentLength = downCast<uint16_t>(formatStringLength);
+        memcpy(*microCode, formatString, formatStringLength);
+        *microCode += formatStringLength;
+    } else {
+        // Extend the last fragment to include the rest of the string
+        size_t endingLength = formatStringLength - startOfNextFragment;
+        memcpy(pf->formatFragment + pf->fragmentLength - 1,  // -1 to erase \0
+              formatString + startOfNextFragment,
+              endingLength);
+        pf->fragmentLength = downCast<uint16_t>(pf->fragmentLength - 1
+                                                                + endingLength);
+        *microCode += endingLength;
+    }
+
+#ifdef ENABLE_DEBUG_PRINTING
+    printf("Fragment %d: %s\r\n", fm->numPrintFragments, pf->formatFragment);
+    printf("\t\ttype: %u, dWidth: %u, dPrecision: %u, length: %u\r\n",
+           pf->argType,
+           pf->hasDynamicWidth,
+           pf->hasDynamicPrecision,
+           pf->fragmentLength);
+#endif
+
+    return true;
+}
+
+/**
+ * Reads a partial dictionary from the log file and adds it to the global
+ * mapping of log identifiers to static log information.
+ *
+ * \param fd
+ *      File descriptor to read the mapping from
+ * \return
+ *      true indicates success; false indicates error
+ */
+bool
+Log::Decoder::readDictionaryFragment(FILE *fd) {
+    // These buffers start us off with some statically allocated space.
+    // Should we need more, we will malloc it.
+    size_t bufferSize = 10*1024;
+    char filenameBuffer[bufferSize];
+    char formatBuffer[bufferSize];
+
+    bool newBuffersAllocated = false;
+    char *filename = filenameBuffer;
+    char *format = formatBuffer;
+
+    DictionaryFragment df;
+    size_t bytesRead = fread(&df, 1, sizeof(DictionaryFragment), fd);
+    if (bytesRead != sizeof(DictionaryFragment)) {
+        fprintf(stderr, "Could not read entire dictionary fragment header\r\n");
+        return false;
+    }
+
+    assert(df.entryType == EntryType::LOG_MSGS_OR_DIC);
+
+    // Each runtime compression shard encodes its own dictionary fragments, so
+    // a fragment may repeat entries already read from another shard's
+    // output. These are detected via totalMetadataEntries after the read.
+    size_t entriesBefore = fmtId2metadata.size();
+
+    while (bytesRead < df.newMetadataBytes && !feof(fd)) {
+        CompressedLogInfo cli;
+        size_t newBytesRead = 0;
+        newBytesRead += fread(&cli, 1, sizeof(CompressedLogInfo), fd);
+
+        if (newBytesRead != sizeof(CompressedLogInfo)) {
+            fprintf(stderr, "Could not read in log metadata\r\n");
+            return false;
+        }
+
+        if (bufferSize < cli.filenameLength ||
+            bufferSize < cli.formatStringLength)
+        {
+            if (newBuffersAllocated) {
+                free(filename);
+                free(format);
+                filename = format = nullptr;
+            }
+
+            newBuffersAllocated = true;
+            bufferSize = 2*std::max(cli.filenameLength, cli.formatStringLength);
+            filename = static_cast<char*>(malloc(bufferSize));
+            format = static_cast<char*>(malloc(bufferSize));
+
+            if (filename == nullptr || format == nullptr) {
+                fprintf(stderr, "Internal Error: Could not allocate enough "
+                               "memory to store the filename/format strings "
+                               "in the dictionary. Tried to allocate %lu bytes "
+                               "to store the %u and %u byte filename and "
+                               "format string lengths respectively",
+                               bufferSize,
+                               cli.formatStringLength,
+                               cli.filenameLength);
+                return false;
+            }
+        }
+
+        newBytesRead += fread(filename, 1, cli.filenameLength, fd);
+        newBytesRead += fread(format, 1, cli.formatStringLength, fd);
+        bytesRead += newBytesRead;
+
+        if (newBytesRead != sizeof(CompressedLogInfo)
+                                + cli.filenameLength + cli.formatStringLength)
+        {
+            fprintf(stderr, "Could not read in a log's filename/"
+                            "format string\r\n");
+            return false;
+        }
+
+        // Any bytes after the format string's null terminator hold the
+        // argStorage of the site's parameters
+        size_t formatLength = strnlen(format, cli.formatStringLength) + 1;
+        const uint8_t *argStorage = nullptr;
+        size_t numArgStorage = 0;
+        if (formatLength < cli.formatStringLength) {
+            argStorage = reinterpret_cast<const uint8_t*>(format)
+                                                                + formatLength;
+            numArgStorage = cli.formatStringLength - formatLength;
+        }
+
+        char *microCode = endOfRawMetadata;
+        if (!createMicroCode(&endOfRawMetadata,
+                            format,
+                            filename,
+                            cli.linenum,
+                            cli.severity & SEVERITY_MASK,
+                            cli.severity & INTERNED_STRINGS_FLAG,
+                            unpackTimestampSource(cli.severity),
+                            argStorage,
+                            numArgStorage))
+        {
+            fprintf(stderr, "Could not process the format string of the log "
+                            "statement at %s:%u\r\n", filename, cli.linenum);
+            if (newBuffersAllocated) {
+                free(filename);
+                free(format);
+            }
+            return false;
+        }
+
+        fmtId2metadata.push_back(microCode);
+        fmtId2fmtString.push_back(format);
+    }
+
+    if (newBuffersAllocated) {
+        free(filename);
+        free(format);
+    }
+
+    // The fragment ends at totalMetadataEntries, so anything it contains
+    // below entriesBefore is a duplicate and dropped. Duplicates lead the
+    // fragment, so the microcode of the entries kept is moved down over
+    // theirs to reclaim the space in rawMetadata.
+    size_t entriesRead = fmtId2metadata.size() - entriesBefore;
+    if (df.totalMetadataEntries >= entriesRead &&
+            df.totalMetadataEntries - entriesRead < entriesBefore)
+    {
+        size_t duplicates = std::min(entriesRead,
+                        entriesBefore - (df.totalMetadataEntries - entriesRead));
+        char *firstDuplicate =
+                        static_cast<char*>(fmtId2metadata[entriesBefore]);
+        char *firstKept = (duplicates < entriesRead)
+                ? static_cast<char*>(fmtId2metadata[entriesBefore + duplicates])
+                : endOfRawMetadata;
+        size_t reclaimed = static_cast<size_t>(firstKept - firstDuplicate);
+
+        memmove(firstDuplicate, firstKept,
+                static_cast<size_t>(endOfRawMetadata - firstKept));
+        endOfRawMetadata -= reclaimed;
+        for (size_t i = entriesBefore + duplicates; i < fmtId2metadata.size();
+                ++i)
+            fmtId2metadata[i] = static_cast<char*>(fmtId2metadata[i])
+                                                                - reclaimed;
+
+        fmtId2metadata.erase(fmtId2metadata.begin() + entriesBefore,
+                    fmtId2metadata.begin() + entriesBefore + duplicates);
+        fmtId2fmtString.erase(fmtId2fmtString.begin() + entriesBefore,
+                    fmtId2fmtString.begin() + entriesBefore + duplicates);
+    }
+
+    compileFormats();
+    return true;
+}
+
+/**
+ * Compiles the FormatMetadata added to fmtId2metadata since the last
+ * invocation into fmtId2compiledFormat. Entries are compiled only once the
+ * dictionary they came from has been fully read and validated.
+ */
+void
+Log::Decoder::compileFormats()
+{
+    for (size_t i = fmtId2compiledFormat.size(); i < fmtId2metadata.size(); ++i)
+        fmtId2compiledFormat.emplace_back(fmtId2metadata[i]);
+}
+
+/**
+ * Opens a compressed log with contents created by Encoder.
+ *
+ * \param filename
+ *      Compressed log file to open
+ * \param memoryMap
+ *      Memory map the file so that the log messages are decompressed in
+ *      place instead of being copied out of the file. If the file cannot be
+ *      mapped, it is read normally. The file must not be truncated while it
+ *      is open()-ed in this mode.
+ * \return
+ *      True if success, false if the log file is not valid or cannot be opened
+ */
+bool
+Log::Decoder::open(const char *filename, bool memoryMap) {
+    unmapFile();
+    bufferFragment->reset();
+
+    if (inputFd)
+        fclose(inputFd);
+
+    inputFd = fopen(filename, "rb");
+    blockStream = nullptr;
+    good = false;
+    timestampBaseEnd = -1;
+
+    if (!inputFd)
+        return false;
+
+    struct stat st;
+    if (memoryMap && fstat(fileno(inputFd), &st) == 0 && st.st_size > 0) {
+        size_t bytes = static_cast<size_t>(st.st_size);
+        void *mapping = mmap(NULL, bytes, PROT_READ, MAP_SHARED,
+                             fileno(inputFd), 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, bytes, MADV_SEQUENTIAL);
+            fileMapping = static_cast<const char*>(mapping);
+            fileMappingBytes = bytes;
+        }
+    }
+
+    // The Checkpoint leads the first output buffer, which may be compressed
+    bool blockRead = peekEntryType(inputFd) != EntryType::INVALID ||
+                     peekExtendedType(inputFd)
+                                    != ExtendedEntryType::COMPRESSED_BLOCK ||
+                     readCompressedBlock();
+
+    if(!blockRead || !readDictionary(inputFd, true)) {
+        unmapFile();
+        fclose(inputFd);
+        inputFd = nullptr;
+        blockStream = nullptr;
+        return false;
+    }
+
+    this->filename = std::string(filename);
+    numBufferFragmentsRead = 0;
+    numLogMsgsDropped = 0;
+    numCheckpointsRead = 1;
+    logMsgsPrinted = 0;
+    good = true;
+    return true;
+}
+/**
+ * Decoder destructor
+ */
+Log::Decoder::~Decoder() {
+    unmapFile();
+
+    if (inputFd)
+        fclose(inputFd);
+
+    if (inotifyFd >= 0)
+        close(inotifyFd);
+
+    filename.clear();
+    inputFd = nullptr;
+    good = false;
+
+    for (BufferFragment *bf : freeBuffers)
+        delete bf;
+
+    freeBuffers.clear();
+}
+
+/**
+ * Releases the memory mapping of the log file, if there is one. The
+ * BufferFragments must not be used until they read new BufferExtents.
+ */
+void
+Log::Decoder::unmapFile() {
+    if (fileMapping != nullptr)
+        munmap(const_cast<char*>(fileMapping), fileMappingBytes);
+
+    fileMapping = nullptr;
+    fileMappingBytes = 0;
+}
+
+/**
+ * Allocates a BufferFragment to read BufferExtents into
+ *
+ * \return
+ *      Allocated BufferFragment
+ */
+Log::Decoder::BufferFragment*
+Log::Decoder::allocateBufferFragment()
+{
+    if (!freeBuffers.empty()) {
+        BufferFragment *ret = freeBuffers.back();
+        freeBuffers.pop_back();
+        return ret;
+    }
+
+    return new BufferFragment();
+}
+
+/**
+ * Internal function to store a BufferFragment on the free list
+ *
+ * \param bf
+ *      BufferFragment to store
+ */
+void
+Log::Decoder::freeBufferFragment(BufferFragment *bf)
+{
+    bf->reset();
+    freeBuffers.push_back(bf);
+}
+
+// BufferFragment constructor
+Log::Decoder::BufferFragment::BufferFragment()
+    : storage(nullptr)
+    , capacity(0)
+    , validBytes(0)
+    , runtimeId(-1)
+    , readPos(nullptr)
+    , endOfBuffer(nullptr)
+    , hasMoreLogs(false)
+    , nextLogId(-1)
+    , nextLogTimestamp(0)
+    , formattedText(nullptr)
+    , formattedTextBytes(0)
+    , formattedLogs()
+    , nextFormattedLog(0)
+    , internedStrings()
+{
+}
+
+// BufferFragment destructor
+Log::Decoder::BufferFragment::~BufferFragment()
+{
+    free(storage);
+    storage = nullptr;
+    capacity = 0;
+
+    free(formattedText);
+    formattedText = nullptr;
+}
+
+/**
+ * Resets the state of the BufferFragment so that the data cannot be reused
+ */
+void
+Log::Decoder::BufferFragment::reset()
+{
+    validBytes = 0;
+    runtimeId = -1;
+    readPos = nullptr;
+    endOfBuffer = nullptr;
+    hasMoreLogs = false;
+
+    free(formattedText);
+    formattedText = nullptr;
+    formattedTextBytes = 0;
+    formattedLogs.clear();
+    nextFormattedLog = 0;
+    internedStrings.clear();
+}
+/**
+ * Read in the next buffer fragment from the compressed log. If an error occurs
+ * the file descriptor will be in an undefined state.
+ *
+ * \param fd
+ *      File stream to read it from
+ * \param[out] wrapAround
+ *      Indicates whether a wrap around was indicated in the log or not.
+ * \param fileMapping
+ *      Optional memory mapping of the file behind fd. If the BufferExtent
+ *      lies within the mapping, the BufferFragment refers to it in place and
+ *      fd is only seeked past the extent.
+ * \param fileMappingBytes
+ *      Number of bytes in fileMapping
+ * \param timestampBase
+ *      Timestamp the first log message in the extent is encoded relative to
+ *      (see TimeIndex::baseTimestamp)
+ *
+ * \return
+ *      indicates whether the operation succeeded (true) or failed due to
+ *      a malformed log data.
+ */
+bool
+Log::Decoder::BufferFragment::readBufferExtent(FILE *fd, bool *wrapAround,
+                                               const char *fileMapping,
+                                               uint64_t fileMappingBytes,
+                                               uint64_t timestampBase) {
+    BufferExtent header = BufferExtent();
+    const char *extent = nullptr;
+    long offset = (fileMapping) ? ftell(fd) : -1;
+
+    if (offset >= 0 && static_cast<uint64_t>(offset) + sizeof(BufferExtent)
+                                                        <= fileMappingBytes) {
+        extent = fileMapping + offset;
+        memcpy(&header, extent, sizeof(BufferExtent));
+        validBytes = sizeof(BufferExtent);
+    } else {
+        validBytes = fread(&header, 1, sizeof(BufferExtent), fd);
+    }
+
+    // An extent can be no larger than the runtime output buffer it was in
+    if (header.entryType != EntryType::BUFFER_EXTENT ||
+            validBytes < sizeof(BufferExtent) ||
+            header.length < sizeof(BufferExtent) ||
+            header.length > NanoLogConfig::MAX_OUTPUT_BUFFER_SIZE) {
+        reset();
+        return false;
+    }
+
+    if (extent != nullptr && static_cast<uint64_t>(offset) + header.length
+                                                        <= fileMappingBytes) {
+        // Refer to the extent in place and skip over it in the file
+        if (fseek(fd, header.length, SEEK_CUR) != 0) {
+            reset();
+            return false;
+        }
+
+        validBytes = header.length;
+    } else {
+        // The extent is not (entirely) mapped; copy it out of the file
+        if (extent != nullptr && fseek(fd, sizeof(BufferExtent), SEEK_CUR)) {
+            reset();
+            return false;
+        }
+
+        if (header.length > capacity) {
+            char *newStorage = static_cast<char*>(realloc(storage,
+                                                          header.length));
+            if (newStorage == nullptr) {
+                reset();
+                return false;
+            }
+
+            storage = newStorage;
+            capacity = header.length;
+        }
+
+        memcpy(storage, &header, sizeof(BufferExtent));
+        uint64_t remaining = header.length - validBytes;
+        validBytes += fread(storage + validBytes, 1, remaining, fd);
+
+        if (validBytes != header.length) {
+            reset();
+            return false;
+        }
+
+        extent = storage;
+    }
+
+    const BufferExtent *be = reinterpret_cast<const BufferExtent*>(extent);
+    readPos = extent + sizeof(BufferExtent);
+    endOfBuffer = extent + validBytes;
+    internedStrings.clear();
+
+    if (be->isShort)
+        runtimeId = be->threadIdOrPackNibble;
+    else
+        runtimeId = BufferUtils::unpack<uint32_t>(
+                                            &readPos, be->threadIdOrPackNibble);
+
+    if (wrapAround)
+        *wrapAround = be->wrapAround;
+
+    // The buffer has no log messages, skip it (this may be possible in cases
+    // where we want to mark wrapArounds or the output buffer ran out of space).
+    if (readPos == endOfBuffer) {
+        hasMoreLogs = false;
+        return true;
+    }
+
+    hasMoreLogs = decompressLogHeader(&readPos, timestampBase, nextLogId,
+                                      nextLogTimestamp);
+    if (!hasMoreLogs)
+        reset();
+
+    return hasMoreLogs;
+}
+
+/**
+ * Compiles a PrintFragment into a Step (see CompiledFormat).
+ *
+ * \param fragment
+ *      PrintFragment to compile; it must outlive the Step
+ */
+Log::CompiledFormat::Step::Step(const PrintFragment *fragment)
+    : fragment(fragment)
+    , conversion(PRINTF)
+    , precision(6)
+    , prefix()
+    , suffix()
+{
+    const char *c = fragment->formatFragment;
+    std::string *text = &prefix;
+    Conversion specifierConversion = TEXT_ONLY;
+
+    while (*c != '\0') {
+        if (*c != '%') {
+            text->push_back(*c++);
+            continue;
+        }
+
+        if (c[1] == '%') {
+            text->push_back('%');
+            c += 2;
+            continue;
+        }
+
+        // Only one format specifier is expected per fragment; anything
+        // unusual is left for printf to interpret.
+        if (text == &suffix)
+            return;
+        ++c;
+
+        // Flags and width are never handled here
+        if (*c != '\0' && (strchr("-+ #0*", *c) || isdigit(*c)))
+            return;
+
+        bool hasPrecision = false;
+        if (*c == '.') {
+            ++c;
+            if (*c == '*')
+                return;
+
+            hasPrecision = true;
+            precision = 0;
+            while (isdigit(*c) && precision < 1000)
+                precision = 10*precision + (*c++ - '0');
+        }
+
+        while (*c != '\0' && strchr("hljztL", *c))
+            ++c;
+
+        switch (*c) {
+            case 'd':
+            case 'i':
+            case 'u':
+                if (hasPrecision)
+                    return;
+
+                switch (fragment->argType) {
+                    case unsigned_char_t:
+                    case unsigned_short_int_t:
+                    case unsigned_int_t:
+                    case unsigned_long_int_t:
+                    case unsigned_long_long_int_t:
+                    case uintmax_t_t:
+                    case size_t_t:
+                    case signed_char_t:
+                    case short_int_t:
+                    case int_t:
+                    case long_int_t:
+                    case long_long_int_t:
+                    case intmax_t_t:
+                    case ptrdiff_t_t:
+                        specifierConversion = DECIMAL;
+                        break;
+                    default:
+                        return;
+                }
+                break;
+
+            case 's':
+                // User-defined types and arrays are printed as the text
+                // they're rendered into (see printRenderedArg())
+                if (hasPrecision || (fragment->argType != const_char_ptr_t
+                                        && fragment->argType != user_type_t
+                                        && fragment->argType != array_t))
+                    return;
+
+                specifierConversion = STRING;
+                break;
+
+#ifdef __cpp_lib_to_chars
+            case 'f':
+                if (fragment->argType != double_t || precision > 64)
+                    return;
+
+                specifierConversion = FIXED_POINT;
+                break;
+#endif
+
+            default:
+                return;
+        }
+
+        ++c;
+        text = &suffix;
+    }
+
+    if (specifierConversion == TEXT_ONLY && fragment->argType != NONE)
+        return;
+
+    conversion = specifierConversion;
+}
+
+/**
+ * Compiles all the PrintFragments of a FormatMetadata.
+ *
+ * \param formatMetadata
+ *      FormatMetadata to compile; it must outlive the CompiledFormat
+ */
+Log::CompiledFormat::CompiledFormat(const void *formatMetadata)
+    : steps()
+{
+    auto *metadata = static_cast<const FormatMetadata*>(formatMetadata);
+    const char *pos = reinterpret_cast<const char*>(metadata)
+                            + sizeof(FormatMetadata)
+                            + metadata->filenameLength;
+
+    steps.reserve(metadata->numPrintFragments);
+    for (int i = 0; i < metadata->numPrintFragments; ++i) {
+        auto *pf = reinterpret_cast<const PrintFragment*>(pos);
+        steps.emplace_back(pf);
+        pos += sizeof(PrintFragment) + pf->fragmentLength;
+    }
+}
+
+/**
+ * Appends the output of snprintf(format, args...) to a string.
+ *
+ * \param out
+ *      String to append to
+ * \param format
+ *      printf format string
+ * \param args
+ *      Arguments for the format string
+ */
+template<typename... Args>
+static void
+appendPrintf(std::string &out, const char *format, Args... args)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-security"
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    char buffer[256];
+    int bytes = snprintf(buffer, sizeof(buffer), format, args...);
+    if (bytes < 0)
+        return;
+
+    size_t length = static_cast<size_t>(bytes);
+    if (length < sizeof(buffer)) {
+        out.append(buffer, length);
+        return;
+    }
+
+    size_t start = out.size();
+    out.resize(start + length + 1);
+    snprintf(&out[start], length + 1, format, args...);
+    out.resize(start + length);
+#pragma GCC diagnostic pop
+}
+
+/**
+ * Appends the decimal representation of an integer to a string,
+ * zero-padded to at least minDigits digits.
+ *
+ * \param out
+ *      String to append to
+ * \param magnitude
+ *      Absolute value of the integer
+ * \param negative
+ *      Whether the integer is negative
+ * \param minDigits
+ *      Minimum number of digits to output
+ */
+static inline void
+appendDecimal(std::string &out, unsigned long long magnitude,
+              bool negative = false, int minDigits = 1)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *pos = end;
+
+    do {
+        *--pos = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    while (end - pos < minDigits)
+        *--pos = '0';
+
+    if (negative)
+        *--pos = '-';
+
+    out.append(pos, end);
+}
+
+/**
+ * Formats an argument according to its Step if the Step's conversion can be
+ * done without printf.
+ *
+ * \param out
+ *      String to append the formatted text to
+ * \param step
+ *      Compiled PrintFragment of the argument
+ * \param arg
+ *      Argument to format
+ *
+ * \return
+ *      true if the argument was formatted; false means the caller should
+ *      fall back to printf
+ */
+template<typename T>
+static inline typename std::enable_if<std::is_integral<T>::value, bool>::type
+formatFast(std::string &out,
+           const NanoLogInternal::Log::CompiledFormat::Step &step,
+           T arg)
+{
+    if (step.conversion != NanoLogInternal::Log::CompiledFormat::DECIMAL)
+        return false;
+
+    out.append(step.prefix);
+    if (std::is_signed<T>::value && static_cast<long long>(arg) < 0) {
+        appendDecimal(out, 0ULL - static_cast<unsigned long long>(arg), true);
+    } else {
+        appendDecimal(out, static_cast<unsigned long long>(arg));
+    }
+    out.append(step.suffix);
+    return true;
+}
+
+static inline bool
+formatFast(std::string &out,
+           const NanoLogInternal::Log::CompiledFormat::Step &step,
+           const char *arg)
+{
+    if (step.conversion != NanoLogInternal::Log::CompiledFormat::STRING)
+        return false;
+
+    out.append(step.prefix);
+    out.append(arg);
+    out.append(step.suffix);
+    return true;
+}
+
+static inline bool
+formatFast(std::string &out,
+           const NanoLogInternal::Log::CompiledFormat::Step &step,
+           double arg)
+{
+#ifdef __cpp_lib_to_chars
+    // printf spells out non-finite values slightly differently
+    if (step.conversion != NanoLogInternal::Log::CompiledFormat::FIXED_POINT
+            || !std::isfinite(arg))
+        return false;
+
+    char buffer[512];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), arg,
+                                std::chars_format::fixed, step.precision);
+    if (result.ec != std::errc())
+        return false;
+
+    out.append(step.prefix);
+    out.append(buffer, result.ptr);
+    out.append(step.suffix);
+    return true;
+#else
+    (void) out;
+    (void) step;
+    (void) arg;
+    return false;
+#endif
+}
+
+template<typename T>
+static inline typename std::enable_if<!std::is_integral<T>::value, bool>::type
+formatFast(std::string &,
+           const NanoLogInternal::Log::CompiledFormat::Step &,
+           T)
+{
+    return false;
+}
+
+/**
+ * Helper to printSingleArg() that appends a single PrintFragment formatted
+ * with an argument and the optional width/precision specifiers to out.
+ *
+ * \tparam T
+ *      Type of the argument (automatically inferred)
+ * \param out
+ *      Where to append the formatted text; nullptr means nowhere
+ * \param step
+ *      Compiled PrintFragment containing exactly 1 format specifier
+ * \param arg
+ *      Argument to pass in with the format string
+ * \param width
+ *      Width parameter of a printf-specifier, a value of -1 specifies none
+ * \param precision
+ *      precision parameter of a printf-specifier, a value of -1 specifies none
+ */
+template<typename T>
+static inline void
+formatSingleArg(std::string *out,
+                const NanoLogInternal::Log::CompiledFormat::Step &step,
+                T arg,
+                int width,
+                int precision)
+{
+    if (out == nullptr || formatFast(*out, step, arg))
+        return;
+
+    const char *formatString = step.fragment->formatFragment;
+    if (width < 0 && precision < 0) {
+        appendPrintf(*out, formatString, arg);
+    } else if (width >= 0 && precision < 0)
+        appendPrintf(*out, formatString, width, arg);
+    else if (width >= 0 && precision >= 0)
+        appendPrintf(*out, formatString, width, precision, arg);
+    else
+        appendPrintf(*out, formatString, precision, arg);
+}
+
+/**
+ * Helper to decompressNextLogStatement to print a single PrintFragment
+ * given an argument and optional width/precision specifiers.
+ *
+ * \tparam T
+ *      Type of the argument (automatically inferred)
+ * \param out
+ *      Where to append the formatted text; nullptr means only logArguments
+ *      is updated
+ * \param logArguments
+ *      LogMessage to save the argument in
+ * \param step
+ *      Compiled PrintFragment containing exactly 1 format specifier
+ * \param arg
+ *      Argument to pass in with the format string
+ * \param width
+ *      Width parameter of a printf-specifier, a value of -1 specifies none
+ * \param precision
+ *      precision parameter of a printf-specifier, a value of -1 specifies none
+ */
+template<typename T>
+static inline void
+printSingleArg(std::string *out,
+               NanoLogInternal::Log::LogMessage &logArguments,
+               const NanoLogInternal::Log::CompiledFormat::Step &step,
+               T arg,
+               int width = -1,
+               int precision = -1)
+{
+    logArguments.push(arg);
+    formatSingleArg(out, step, arg, width, precision);
+}
+
+/**
+ * Variant of printSingleArg() for an argument of a user-defined type (see
+ * NanoLog::Serializer) or an array (see NanoLog::array()), which is saved in
+ * logArguments as it's stored in the compressed log and printed as the text
+ * the render function turns it into.
+ *
+ * \param out
+ *      Where to append the formatted text; nullptr means only logArguments
+ *      is updated
+ * \param logArguments
+ *      LogMessage to save the argument in
+ * \param step
+ *      Compiled PrintFragment containing exactly 1 format specifier
+ * \param arg
+ *      The argument as it's stored in the compressed log (see
+ *      USER_TYPE_MARKER and ARRAY_MARKER)
+ * \param render
+ *      Function that appends the text for the argument to a string
+ * \param width
+ *      Width parameter of a printf-specifier, a value of -1 specifies none
+ * \param precision
+ *      precision parameter of a printf-specifier, a value of -1 specifies none
+ */
+static void
+printRenderedArg(std::string *out,
+                 NanoLogInternal::Log::LogMessage &logArguments,
+                 const NanoLogInternal::Log::CompiledFormat::Step &step,
+                 const char *arg,
+                 void (*render)(const char *arg, std::string &out),
+                 int width,
+                 int precision)
+{
+    static thread_local std::string rendered;
+
+    logArguments.push(arg);
+    if (out == nullptr)
+        return;
+
+    rendered.clear();
+    render(arg, rendered);
+    formatSingleArg(out, step, rendered.c_str(), width, precision);
+}
+
+/**
+ * Appends the context printed before each log message, i.e.
+ * "<date> <time>.<nanoseconds> <file>:<line> <level>[<runtimeId>]: ".
+ *
+ * \param out
+ *      String to append to
+ * \param absTime
+ *      Unix time of the log message, in whole seconds
+ * \param nanos
+ *      Nanoseconds past absTime
+ * \param filename
+ *      Source file of the log message
+ * \param lineNumber
+ *      Source line of the log message
+ * \param logLevel
+ *      Name of the log level of the message
+ * \param runtimeId
+ *      Id of the runtime thread that logged the message
+ * \param timestampSource
+ *      How the log statement read its timestamp; imprecise timestamps are
+ *      marked with a '~' (coarse) or '+' (borrowed from the previous message)
+ */
+static void
+appendLogHeader(std::string &out, std::time_t absTime, double nanos,
+                const char *filename, uint32_t lineNumber,
+                const char *logLevel, uint32_t runtimeId,
+                NanoLog::TimestampSource timestampSource)
+{
+    // Consecutive log messages tend to fall within the same second, so the
+    // date/time string is cached per formatting thread.
+    static thread_local std::time_t cachedTime = 0;
+    static thread_local char cachedTimeString[32] = {};
+
+    if (cachedTimeString[0] == '\0' || cachedTime != absTime) {
+        std::tm tm;
+        localtime_r(&absTime, &tm);
+        strftime(cachedTimeString, sizeof(cachedTimeString),
+                 "%Y-%m-%d %H:%M:%S", &tm);
+        cachedTime = absTime;
+    }
+
+    out.append(cachedTimeString);
+
+    double roundedNanos = nearbyint(nanos);
+    if (roundedNanos >= 0 && roundedNanos < 1.0e18) {
+        out.push_back('.');
+        appendDecimal(out, static_cast<unsigned long long>(roundedNanos),
+                      false, 9);
+    } else {
+        appendPrintf(out, ".%09.0lf", nanos);
+    }
+
+    if (timestampSource == NanoLog::TIMESTAMP_COARSE)
+        out.push_back('~');
+    else if (timestampSource == NanoLog::TIMESTAMP_NONE)
+        out.push_back('+');
+
+    out.push_back(' ');
+    out.append(filename);
+    out.push_back(':');
+    appendDecimal(out, lineNumber);
+    out.push_back(' ');
+    out.append(logLevel);
+    out.push_back('[');
+    appendDecimal(out, runtimeId);
+    out.append("]: ");
+}
+
+/**
+ * Attempt to read back the next log statement contained in the BufferFragment,
+ * output the original log message to outputFd, and if applicable, run an
+ * aggregation function on the log message.
+ *
+ * The aggregation function should take in the same arguments as the original
+ * invocation of NANO_LOG. For example, NANO_LOG("The number is %d." num) should
+ * have the function signature of (const char *fmtString, int num).
+ *
+ * \param outputFd
+ *      File descriptor to output the log messages to
+ * \param[in/out] logMsgsProccessed
+ *      The number of log messages processed
+ * \param lastTimestamp
+ *      The timestamp of the last log message to be outputted (this is used
+ *      to print time differences).
+ * \param wallClock
+ *      The rdtsc-to-time mapping this function should use
+ * \param aggregationFilterId
+ *      The logId to target running aggregationFn on
+ * \param aggregationFn
+ *      This is an aggregation function that can be passed to any log messages
+ *      matching aggregationFilterId. This function accepts the same parameters
+ *      as the original log statement.
+ * \param compiledFormats
+ *      Mapping of format ids to the CompiledFormats of fmtId2metadata; if
+ *      nullptr, each log message's format is compiled as it is output.
+ *
+ * \return
+ *      true indicates the operation sucessfully; false indicates that either
+ *      we reached the end of the file or the file is corrupt.
+ */
+bool
+Log::Decoder::BufferFragment::decompressNextLogStatement(FILE *outputFd,
+                                        uint64_t &logMsgsProcessed,
+                                        LogMessage &logArgs,
+                                        const WallClock &wallClock,
+                                        std::vector<void*>& fmtId2metadata,
+                                        long aggregationFilterId,
+                                        void (*aggregationFn)(const char*, ...),
+                        const std::vector<CompiledFormat> *compiledFormats)
+{
+    double nanos = 0.0;
+    std::time_t absTime = 0;
+
+    // Each log message is built up in this buffer and written out with a
+    // single fwrite() instead of a printf per fragment.
+    static thread_local std::string formatBuffer;
+    std::string *out = (outputFd) ? &formatBuffer : nullptr;
+    formatBuffer.clear();
+
+    if (readPos > endOfBuffer || !hasMoreLogs) {
+        hasMoreLogs = false;
+        return false;
+    }
+
+    // The messages were already formatted by formatAll(), so just copy out
+    // the text. Note that logArgs is not filled in this case.
+    if (formattedText) {
+        size_t start = (nextFormattedLog == 0) ? 0 :
+                            formattedLogs[nextFormattedLog - 1].end;
+        size_t end = formattedLogs[nextFormattedLog].end;
+        if (outputFd)
+            fwrite(formattedText + start, 1, end - start, outputFd);
+
+        logMsgsProcessed++;
+        ++nextFormattedLog;
+        hasMoreLogs = (nextFormattedLog < formattedLogs.size());
+        if (hasMoreLogs) {
+            nextLogTimestamp = formattedLogs[nextFormattedLog].timestamp;
+            nextLogId = formattedLogs[nextFormattedLog].logId;
+        }
+
+        return true;
+    }
+
+    // no need to format the time if we're not going to output
+    if (outputFd) {
+    // Convert to relative time
+//        double timeDiff;
+//        if (nextLogTimestamp >= lastTimestamp)
+//            timeDiff = 1.0e9*PerfUtils::Cycles::toSeconds(
+//                                    nextLogTimestamp - lastTimestamp,
+//                                    checkpoint.cyclesPerSecond));
+//        else
+//            timeDiff = -1.0e9*PerfUtils::Cycles::toSeconds(
+//                                    lastTimestamp - nextLogTimestamp,
+//                                    checkpoint.cyclesPerSecond));
+//        if (logMsgsProcessed == 0)
+//            timeDiff = 0;
+//
+//        fprintf(outputFd, "%4ld) +%12.2lf ns ", logMsgsProcessed, timeDiff);
+
+        // Convert to absolute time
+        struct timespec wallTime = wallClock.toTimespec(nextLogTimestamp);
+        absTime = wallTime.tv_sec;
+        nanos = static_cast<double>(wallTime.tv_nsec);
+    }
+
+    if (fmtId2metadata.empty() || aggregationFn != nullptr) {
+        // Output the context
+        struct GeneratedFunctions::LogMetadata meta =
+                                GeneratedFunctions::logId2Metadata[nextLogId];
+        if (out) {
+            appendLogHeader(*out, absTime, nanos, meta.fileName,
+                            meta.lineNumber, logLevelNames[meta.logLevel],
+                            runtimeId, NanoLogConfig::TIMESTAMP_SOURCE);
+            fwrite(out->data(), 1, out->size(), outputFd);
+        }
+
+        void (*aggFn)(const char*, ...) = nullptr;
+        if (aggregationFilterId == nextLogId)
+            aggFn = aggregationFn;
+
+        if (nextLogId >= GeneratedFunctions::numLogIds) {
+            fprintf(stderr, "Log message id=%u not found in the generated "
+                            "functions list for Preprocessor NanoLog.\r\n"
+                            "This indicates either a corrupt log file or "
+                            "a mismatched decompressor as we only have %lu "
+                            "generated functions\r\n"
+                            , nextLogId
+                            , GeneratedFunctions::numLogIds);
+            return false;
+        }
+
+        GeneratedFunctions::decompressAndPrintFnArray[nextLogId](&readPos,
+                                                                 outputFd,
+                                                                 aggFn);
+    } else {
+        using namespace BufferUtils;
+        auto *metadata = reinterpret_cast<FormatMetadata*>(
+                                            fmtId2metadata.at(nextLogId));
+
+        const char *filename = metadata->filename;
+        const char *logLevel = logLevelNames[metadata->logLevel];
+
+        logArgs.reset(metadata, nextLogId, nextLogTimestamp);
+
+        // Output the context
+        if (out) {
+            appendLogHeader(*out, absTime, nanos, filename,
+                            metadata->lineNumber, logLevel, runtimeId,
+                            static_cast<NanoLog::TimestampSource>(
+                                            metadata->timestampSource));
+        }
+
+        // The dictionary is normally compiled ahead of time by the Decoder
+        std::unique_ptr<CompiledFormat> uncompiledFormat;
+        const CompiledFormat *compiledFormat;
+        if (compiledFormats && nextLogId < compiledFormats->size()) {
+            compiledFormat = &(*compiledFormats)[nextLogId];
+        } else {
+            uncompiledFormat.reset(new CompiledFormat(metadata));
+            compiledFormat = uncompiledFormat.get();
+        }
+
+        // Print out the actual log message, piece by piece
+        PrintFragment *pf = reinterpret_cast<PrintFragment*>(
+                reinterpret_cast<char*>(metadata)
+                + sizeof(FormatMetadata)
+                + metadata->filenameLength);
+
+        Nibbler nb(readPos, metadata->numNibbles);
+        const char *nextStringArg = nb.getEndOfPackedArguments();
+
+        // TODO(syang0) We can probably skip processing the log message at
+        // if we (a) aren't printing and (b) aren't aggregating
+        for (int i = 0; i < metadata->numPrintFragments; ++i) {
+            const CompiledFormat::Step &step = compiledFormat->steps[i];
+            const wchar_t *wstrArg;
+
+            int width = -1;
+            if (pf->hasDynamicWidth)
+                width = nb.getNext<int>();
+
+            int precision = -1;
+            if (pf->hasDynamicPrecision)
+                precision = nb.getNext<int>();
+
+            switch(pf->argType) {
+                case NONE:
+
+                    if (out == nullptr)
+                        break;
+
+                    if (step.conversion == CompiledFormat::TEXT_ONLY)
+                        out->append(step.prefix);
+                    else
+                        appendPrintf(*out, pf->formatFragment);
+                    break;
+
+                case unsigned_char_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<unsigned char>(),
+                                   width, precision);
+                    break;
+
+                case unsigned_short_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<unsigned short int>(),
+                                   width, precision);
+                    break;
+
+                case unsigned_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<unsigned int>(),
+                                   width, precision);
+                    break;
+
+                case unsigned_long_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<unsigned long int>(),
+                                   width, precision);
+                    break;
+
+                case unsigned_long_long_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<unsigned long long int>(),
+                                   width, precision);
+                    break;
+
+                case uintmax_t_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<uintmax_t>(),
+                                   width, precision);
+                    break;
+
+                case size_t_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<size_t>(),
+                                   width, precision);
+                    break;
+
+                case wint_t_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<wint_t>(),
+                                   width, precision);
+                    break;
+
+                case signed_char_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<signed char>(),
+                                   width, precision);
+                    break;
+
+                case short_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<short int>(),
+                                   width, precision);
+                    break;
+
+                case int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<int>(),
+                                   width, precision);
+                    break;
+
+                case long_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<long int>(),
+                                   width, precision);
+                    break;
+
+                case long_long_int_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<long long int>(),
+                                   width, precision);
+                    break;
+
+                case intmax_t_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<intmax_t>(),
+                                   width, precision);
+                    break;
+
+                case ptrdiff_t_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<ptrdiff_t>(),
+                                   width, precision);
+                    break;
+
+                case double_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<double>(),
+                                   width, precision);
+                    break;
+
+                case long_double_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<long double>(),
+                                   width, precision);
+                    break;
+
+                case const_void_ptr_t:
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   nb.getNext<const void *>(),
+                                   width, precision);
+                    break;
+
+                // The next four are strings, so handle it accordingly.
+                case const_char_ptr_t:
+                case user_type_t:
+                case array_t:
+                {
+                    // Interned strings refer back to their first copy in
+                    // the extent
+                    const char *stringArg = nextStringArg;
+                    uint8_t internedId = 0;
+                    if (pf->internedString) {
+                        internedId = static_cast<uint8_t>(*nextStringArg++);
+                        stringArg = nextStringArg;
+
+                        // Arrays are never interned
+                        if (internedId == 0) {
+                            if (pf->argType != array_t
+                                    && internedStrings.size()
+                                            < StringInterner::MAX_STRINGS)
+                                internedStrings.push_back(stringArg);
+                        } else if (internedId <= internedStrings.size()) {
+                            stringArg = internedStrings[internedId - 1];
+                        } else {
+                            stringArg = "";
+                        }
+                    }
+
+                    if (internedId == 0 && pf->argType == array_t) {
+                        printRenderedArg(out, logArgs, step, stringArg,
+                                         &Decoder::formatArray,
+                                         width, precision);
+                        nextStringArg += Decoder::getArrayLength(stringArg);
+                        break;
+                    }
+
+                    if (pf->argType == user_type_t)
+                        printRenderedArg(out, logArgs, step, stringArg,
+                                         &Decoder::formatUserType,
+                                         width, precision);
+                    else
+                        printSingleArg(out,
+                                       logArgs,
+                                       step,
+                                       stringArg,
+                                       width, precision);
+
+                    // References are only the id; +1 for NULL
+                    if (internedId == 0)
+                        nextStringArg += strlen(nextStringArg) + 1;
+                    break;
+                }
+
+                case const_wchar_t_ptr_t:
+
+                    /**
+                     * I've occasionally encountered the following assertion:
+                     * __wcsrtombs: Assertion `data.__outbuf[-1] == '\0'' failed
+                     *
+                     * I don't know why this occurs, but it appears to be caused
+                     * by a wcslen() call deep inside printf returning the wrong
+                     * value when called on the dynamic buffer. I've found
+                     * that copying the data into a stack buffer first fixes
+                     * the problem (not implemented here).
+                     *
+                     * I don't know why this is the case and I'm inclined to
+                     * believe it's a problem with the library because I've...
+                     *  (1) verified byte by byte that the copied wchar_t
+                     *      strings and the surrounding bytes are exactly the
+                     *      same in the dynamic and stack allocated buffers.
+                     *  (2) copied the wcslen code from the glib sources into
+                     *      to this file and calling it on the dynamic buffer
+                     *      works, but the public wcslen() API still returns an
+                     *      incorrect value.
+                     *  (3) verified that no corruption occurs in the buffers
+                     *      before and after the wcslen() returns the wrong val
+                     *
+                     * If wide character support becomes important and this
+                     * assertion keeps erroring out, I would work around it
+                     * by copying the wide string into a stack buffer before
+                     * passing it to printf.
+                     */
+                    wstrArg = reinterpret_cast<const wchar_t *>(nextStringArg);
+                    printSingleArg(out,
+                                   logArgs,
+                                   step,
+                                   wstrArg,
+                                   width, precision);
+                    // +1 for NULL
+                    nextStringArg += (wcslen(wstrArg) + 1) * sizeof(wchar_t);
+                    break;
+
+                case MAX_FORMAT_TYPE:
+                default:
+                    fprintf(outputFd,
+                            "Error: Corrupt log header in header file\r\n");
+                    exit(-1);
+            }
+
+            pf = reinterpret_cast<PrintFragment*>(
+                    reinterpret_cast<char*>(pf)
+                    + pf->fragmentLength
+                    + sizeof(PrintFragment));
+        }
+
+        if (out) {
+            out->append("\r\n");
+            fwrite(out->data(), 1, out->size(), outputFd);
+        }
+
+        // We're done, advance the pointer to the end of the last string
+        readPos = nextStringArg;
+    }
+
+    logMsgsProcessed++;
+
+    if (readPos >= endOfBuffer)
+        hasMoreLogs = false;
+    else
+        hasMoreLogs = decompressLogHeader(&readPos, nextLogTimestamp,
+                                          nextLogId, nextLogTimestamp);
+
+    return true;
+}
+
+/**
+ * Decompresses and formats all the log messages remaining in the
+ * BufferFragment into an in-memory text buffer so that later invocations of
+ * decompressNextLogStatement() only need to copy the text out. This allows
+ * multiple BufferFragments to be formatted in parallel, since this function
+ * only reads from the Decoder's shared state.
+ *
+ * \param wallClock
+ *      The rdtsc-to-time mapping this function should use
+ * \param fmtId2metadata
+ *      Mapping of format ids to the FormatMetadata of the log file
+ * \param compiledFormats
+ *      Mapping of format ids to the CompiledFormats of fmtId2metadata
+ *
+ * \return
+ *      true if the log messages were formatted; false if the text buffer could
+ *      not be allocated, in which case the BufferFragment is left untouched.
+ */
+bool
+Log::Decoder::BufferFragment::formatAll(const WallClock &wallClock,
+                        std::vector<void*>& fmtId2metadata,
+                        const std::vector<CompiledFormat> *compiledFormats)
+{
+    if (formattedText || !hasMoreLogs)
+        return true;
+
+    char *text = nullptr;
+    size_t textBytes = 0;
+    FILE *textFd = open_memstream(&text, &textBytes);
+    if (textFd == nullptr)
+        return false;
+
+    LogMessage logArgs;
+    uint64_t logMsgsFormatted = 0;
+    formattedLogs.clear();
+    while (hasMoreLogs) {
+        uint64_t timestamp = nextLogTimestamp;
+        uint32_t logId = nextLogId;
+        if (!decompressNextLogStatement(textFd, logMsgsFormatted, logArgs,
+                                        wallClock, fmtId2metadata, -1,
+                                        nullptr, compiledFormats))
+            break;
+
+        formattedLogs.push_back({timestamp, logId,
+                                 static_cast<size_t>(ftell(textFd))});
+    }
+    fclose(textFd);
+
+    formattedText = text;
+    formattedTextBytes = textBytes;
+    nextFormattedLog = 0;
+    hasMoreLogs = !formattedLogs.empty();
+    if (hasMoreLogs) {
+        nextLogTimestamp = formattedLogs.front().timestamp;
+        nextLogId = formattedLogs.front().logId;
+    }
+
+    return true;
+}
+
+/**
+ * Whether one can invoke decompressNextLogStatement or not
+ */
+bool
+Log::Decoder::BufferFragment::hasNext() {
+    return hasMoreLogs;
+}
+
+/**
+ * Return the timestamp of the next log message that can be outputted. It is
+ * the responsibility of the caller to ensure that the BufferFragment contains
+ * a next log message (i.e. if decompressNextLogStatement returns true).
+ */
+uint64_t
+Log::Decoder::BufferFragment::getNextLogTimestamp() const
+{
+    assert(readPos <= endOfBuffer && validBytes > 0);
+    return nextLogTimestamp;
+}
+
+/**
+ * Formats the log messages of a batch of BufferFragments ahead of time (see
+ * BufferFragment::formatAll()) using multiple threads. The caller must not
+ * modify the Decoder's dictionary or wallClock while this runs.
+ *
+ * \param fragments
+ *      BufferFragments to format
+ * \param numThreads
+ *      Number of threads to format with, including the calling thread
+ */
+void
+Log::Decoder::formatBufferFragments(std::vector<BufferFragment*> &fragments,
+                                    uint32_t numThreads)
+{
+    std::atomic<size_t> nextFragment(0);
+    auto formatFragments = [&]() {
+        size_t i;
+        while ((i = nextFragment.fetch_add(1)) < fragments.size())
+            fragments[i]->formatAll(wallClock, fmtId2metadata,
+                                    &fmtId2compiledFormat);
+    };
+
+    std::vector<std::thread> workers;
+    size_t numWorkers = std::min<size_t>(numThreads, fragments.size());
+    for (size_t i = 1; i < numWorkers; ++i)
+        workers.emplace_back(formatFragments);
+
+    formatFragments();
+
+    for (auto &worker : workers)
+        worker.join();
+}
+
+/**
+ * Decompress the log file that was open()-ed and print the message out in
+ * an arbitrary order (i.e. dependent on runtime implementation and not
+ * necessarily in chronological order).
+ *
+ * \param outputFd
+ *      The file descriptor to print the log messages to
+ * \param aggregationTargetId
+ *      Target logId to run the aggregation function on
+ * \param aggregationFn
+ *      Aggregation function to run on targetId. The signature of the function
+ *      should be the same as the original NANO_LOG invocation that created
+ *      the log message. For example,
+ *          NANO_LOG("number %d, string %s, float %f", num, str, flo)
+ *      should have the signature
+ *          aggregation(const char*, int, const char*, float)
+ * \param numThreads
+ *      Number of threads to format the log messages with. Batches of
+ *      BufferExtents are formatted in parallel and then printed in the order
+ *      they appear in the log. Aggregations always run on one thread.
+ *
+ * \return
+ *      true indicates the operation succeeded without problems.
+ *      false indicates that there was an error and an incomplete log was
+ *      outputted to outputFd;
+ */
+bool
+Log::Decoder::internalDecompressUnordered(FILE* outputFd,
+                                        uint32_t aggregationTargetId,
+                                        void(*aggregationFn)(const char*,...),
+                                        uint32_t numThreads)
+{
+    if (filename.empty() || !inputFd)
+       return false;
+
+    LogMessage logArguments;
+
+    // BufferFragments read in but not yet printed when formatting in parallel
+    std::vector<BufferFragment*> batch;
+    bool parallel = (numThreads > 1 && outputFd && aggregationFn == nullptr);
+    BufferFragment *bf = (parallel) ? nullptr : allocateBufferFragment();
+
+    // Formats the batch in parallel and prints it in log order
+    auto printBatch = [&]() {
+        formatBufferFragments(batch, numThreads);
+        for (BufferFragment *fragment : batch) {
+            while (fragment->hasNext())
+                outputNextLogStatement(fragment, outputFd, logArguments);
+            freeBufferFragment(fragment);
+        }
+        batch.clear();
+    };
+
+    while(!feof(inputFd) && good) {
+        bool wrapAround = false;
+
+        EntryType entry = peekEntryType(inputFd);
+        switch (entry) {
+            case EntryType::BUFFER_EXTENT:
+            {
+                if (parallel)
+                    bf = allocateBufferFragment();
+
+                if (!bf->readBufferExtent(inputFd, &wrapAround,
+                                          getFileMapping(), fileMappingBytes,
+                                          getTimestampBase())) {
+                    fprintf(stderr,
+                            "Internal Error: Corrupted BufferExtent\r\n");
+                    if (parallel)
+                        freeBufferFragment(bf);
+                    break;
+                }
+
+                ++numBufferFragmentsRead;
+                if (parallel) {
+                    batch.push_back(bf);
+                    if (batch.size() >= FRAGMENTS_PER_THREAD*numThreads)
+                        printBatch();
+                    break;
+                }
+
+                while (bf->hasNext()) {
+                    outputNextLogStatement(bf, outputFd, logArguments,
+                                           aggregationTargetId, aggregationFn);
+                }
+                break;
+            }
+            case EntryType::CHECKPOINT:
+                printBatch();
+                if (!readDictionary(inputFd, true))
+                    good = false;
+                else if (outputFd)
+                    fprintf(outputFd, "\r\n# New execution started\r\n");
+
+                break;
+            case EntryType::LOG_MSGS_OR_DIC:
+                good = readDictionaryFragment(inputFd);
+                break;
+            case EntryType::INVALID:
+                if (peekExtendedType(inputFd) == ExtendedEntryType::TIME_INDEX) {
+                    good = readTimeIndex(inputFd);
+                    break;
+                }
+
+                if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::COMPRESSED_BLOCK) {
+                    good = readCompressedBlock();
+                    break;
+                }
+
+                if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::CLOCK_CALIBRATION) {
+                    good = readClockCalibration(inputFd);
+                    break;
+                }
+
+                if (peekExtendedType(inputFd) != ExtendedEntryType::PADDING) {
+                    printBatch();
+                    DroppedLogs droppedLogs;
+                    good = readDroppedLogs(inputFd, droppedLogs);
+                    if (good)
+                        printDroppedLogs(outputFd, droppedLogs);
+                    break;
+                }
+
+                // Consume whitespace
+                while (!feof(inputFd) && peekEntryType(inputFd) == INVALID &&
+                        peekExtendedType(inputFd) == ExtendedEntryType::PADDING)
+                    fgetc(inputFd);
+                break;
+        }
+    }
+
+    printBatch();
+
+    if (outputFd)
+        fprintf(outputFd, "\r\n\r\n# Decompression Complete after printing "
+                            "%lu log messages\r\n", logMsgsPrinted);
+
+    if (!parallel)
+        freeBufferFragment(bf);
+    return good;
+}
+
+
+/**
+ * Constructs a WallClock that maps every timestamp to the epoch until it's
+ * reset() to a Checkpoint.
+ */
+Log::WallClock::WallClock()
+    : checkpointRdtsc(0)
+    , checkpointNanos(0)
+    , nanosPerCycle(0)
+    , calibrations()
+{
+}
+
+/**
+ * Constructs a WallClock for the execution that a Checkpoint starts.
+ */
+Log::WallClock::WallClock(const Checkpoint &checkpoint)
+    : WallClock()
+{
+    reset(checkpoint);
+}
+
+/**
+ * Starts the WallClock over for the execution that a Checkpoint starts,
+ * dropping the ClockCalibrations of the previous one.
+ *
+ * \param checkpoint
+ *      Checkpoint at the start of the execution
+ */
+void
+Log::WallClock::reset(const Checkpoint &checkpoint)
+{
+    checkpointRdtsc = checkpoint.rdtsc;
+    checkpointNanos = 1000000000*static_cast<int64_t>(checkpoint.unixTime);
+    nanosPerCycle = 1.0e9/checkpoint.cyclesPerSecond;
+    calibrations.clear();
+}
+
+/**
+ * Adds a ClockCalibration of the execution to interpolate the wall times
+ * with. They may be added in any order.
+ *
+ * \param rdtsc
+ *      rdtsc() value at the time of the reading
+ * \param unixNanos
+ *      CLOCK_REALTIME in nanoseconds since the epoch
+ */
+void
+Log::WallClock::addCalibration(uint64_t rdtsc, int64_t unixNanos)
+{
+    auto it = std::lower_bound(calibrations.begin(), calibrations.end(),
+                               std::make_pair(rdtsc, INT64_MIN));
+    if (it != calibrations.end() && it->first == rdtsc)
+        return;
+    calibrations.emplace(it, rdtsc, unixNanos);
+
+    // Outside of the calibrations, timestamps are extrapolated at the rate
+    // measured over all of them, which is more precise than the estimate of
+    // the Checkpoint once they span more than a second
+    uint64_t cycles = calibrations.back().first - calibrations.front().first;
+    int64_t nanos = calibrations.back().second - calibrations.front().second;
+    if (nanos > 1000000000)
+        nanosPerCycle = static_cast<double>(nanos)
+                                    / static_cast<double>(cycles);
+}
+
+/**
+ * Converts an rdtsc() timestamp of the execution to a wall time.
+ *
+ * \param rdtsc
+ *      rdtsc() value to convert
+ * \return
+ *      Nanoseconds since the epoch
+ */
+int64_t
+Log::WallClock::toNanos(uint64_t rdtsc) const
+{
+    // Timestamps are extrapolated from the reading nearest to them
+    uint64_t fromRdtsc = checkpointRdtsc;
+    int64_t fromNanos = checkpointNanos;
+    double rate = nanosPerCycle;
+
+    if (!calibrations.empty()) {
+        auto next = std::upper_bound(calibrations.begin(), calibrations.end(),
+                                     std::make_pair(rdtsc, INT64_MAX));
+        auto from = (next == calibrations.begin()) ? next : next - 1;
+        fromRdtsc = from->first;
+        fromNanos = from->second;
+
+        // ... unless they're between two readings
+        if (next != calibrations.begin() && next != calibrations.end())
+            rate = static_cast<double>(next->second - from->second)
+                        / static_cast<double>(next->first - from->first);
+    }
+
+    double cycles = (rdtsc >= fromRdtsc)
+                        ? static_cast<double>(rdtsc - fromRdtsc)
+                        : -static_cast<double>(fromRdtsc - rdtsc);
+    return fromNanos + llround(rate*cycles);
+}
+
+/**
+ * Converts an rdtsc() timestamp of the execution to a wall time.
+ *
+ * \param rdtsc
+ *      rdtsc() value to convert
+ * \return
+ *      Seconds and nanoseconds since the epoch
+ */
+struct timespec
+Log::WallClock::toTimespec(uint64_t rdtsc) const
+{
+    int64_t nanos = toNanos(rdtsc);
+    int64_t seconds = nanos/1000000000;
+    nanos %= 1000000000;
+    if (nanos < 0) {
+        nanos += 1000000000;
+        --seconds;
+    }
+
+    struct timespec wallTime;
+    wallTime.tv_sec = static_cast<time_t>(seconds);
+    wallTime.tv_nsec = static_cast<long>(nanos);
+    return wallTime;
+}
+
+/**
+ * Converts an rdtsc() timestamp from the current execution in the log file
+ * to a wall time using its Checkpoint and ClockCalibrations (see WallClock).
+ *
+ * \param timestamp
+ *      rdtsc() value to convert
+ * \return
+ *      Seconds since the epoch
+ */
+double
+Log::Decoder::getWallTime(uint64_t timestamp) const
+{
+    return 1.0e-9*static_cast<double>(wallClock.toNanos(timestamp));
+}
+
+/**
+ * Stream that a Decoder of decompressMerged() outputs its log file through.
+ * It cuts the text written into one chunk per log message, each with the
+ * text output ahead of it (i.e. DroppedLogs reports), and queues them up for
+ * the merge along with the wall time of the log message. Since the queue is
+ * bounded, the Decoder waits for the merge to catch up rather than
+ * decompressing its whole file ahead of the others.
+ */
+struct Log::Decoder::MergeStream {
+    /**
+     * MergeStream constructor.
+     *
+     * \param origin
+     *      Name that tags the lines of the log file in the merged output
+     */
+    explicit MergeStream(const std::string &origin)
+        : origin(origin)
+        , pending()
+        , chunks()
+        , finished(false)
+        , mutex()
+        , changed()
+    {
+    }
+
+    // Implements cookie_write_function_t
+    static ssize_t
+    write(void *cookie, const char *buf, size_t size) {
+        static_cast<MergeStream*>(cookie)->pending.append(buf, size);
+        return static_cast<ssize_t>(size);
+    }
+
+    /**
+     * Queues up the text written since the last log message, which ends
+     * with a log message that has a particular wall time. Blocks while the
+     * queue is full.
+     *
+     * \param wallTime
+     *      Nanoseconds since the epoch of the log message
+     */
+    void
+    endLogMessage(int64_t wallTime) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return chunks.size() < MAX_CHUNKS; });
+        chunks.emplace_back(wallTime, std::move(pending));
+        pending.clear();
+        changed.notify_all();
+    }
+
+    /**
+     * Queues up whatever was written after the last log message and marks
+     * the end of the stream.
+     */
+    void
+    finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!pending.empty())
+            chunks.emplace_back(INT64_MAX, std::move(pending));
+
+        finished = true;
+        changed.notify_all();
+    }
+
+    /**
+     * Waits for the next chunk of text of the stream and dequeues it.
+     *
+     * \param[out] chunk
+     *      The wall time and text of the chunk
+     * \return
+     *      true if a chunk was dequeued, false if the stream ended
+     */
+    bool
+    next(std::pair<int64_t, std::string> &chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !chunks.empty() || finished; });
+        if (chunks.empty())
+            return false;
+
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    // Maximum number of chunks queued up per log file
+    static const size_t MAX_CHUNKS = 4096;
+
+    // Name that tags the lines of the log file in the merged output
+    const std::string origin;
+
+    // Text written since the last log message; only touched by the Decoder
+    std::string pending;
+
+    // Chunks of text waiting to be merged, in the order they were written
+    std::deque<std::pair<int64_t, std::string>> chunks;
+
+    // Indicates that the Decoder is done writing
+    bool finished;
+
+    // Protects chunks and finished, and signals when they change
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    DISALLOW_COPY_AND_ASSIGN(MergeStream);
+};
+
+/**
+ * Indicates whether an rdtsc() timestamp from the current execution in the
+ * log file falls within the time range set by decompressRange() (or true if
+ * there is none).
+ *
+ * \param timestamp
+ *      rdtsc() value to check
+ */
+bool
+Log::Decoder::inTimeRange(uint64_t timestamp) const
+{
+    if (!timeRangeSet)
+        return true;
+
+    double wallTime = getWallTime(timestamp);
+    return wallTime >= timeRangeStart && wallTime <= timeRangeEnd;
+}
+
+/**
+ * Decompresses the next log statement in a BufferFragment and outputs it if
+ * it falls within the time range (if any) and matches the log filter. Log
+ * messages that don't are still decompressed to advance the BufferFragment,
+ * but not output nor counted in logMsgsPrinted.
+ *
+ * \param bf
+ *      BufferFragment with a next log statement (i.e. hasNext() is true)
+ * \param outputFd
+ *      File descriptor to output the log message to (nullptr for none)
+ * \param logArgs
+ *      Stores the arguments of the log message decompressed
+ * \param aggregationFilterId
+ *      The logId to target running aggregationFn on
+ * \param aggregationFn
+ *      Aggregation function to run on log messages matching
+ *      aggregationFilterId (see internalDecompressUnordered())
+ */
+void
+Log::Decoder::outputNextLogStatement(BufferFragment *bf,
+                                     FILE *outputFd,
+                                     LogMessage &logArgs,
+                                     long aggregationFilterId,
+                                     void (*aggregationFn)(const char*, ...))
+{
+    if (!matchesLogFilter(bf->nextLogId)) {
+        bf->decompressNextLogStatement(nullptr, numLogMsgsFiltered, logArgs,
+                                       wallClock, fmtId2metadata, -1, nullptr,
+                                       &fmtId2compiledFormat);
+        return;
+    }
+
+    uint64_t timestamp = bf->getNextLogTimestamp();
+    if (inTimeRange(timestamp)) {
+        bf->decompressNextLogStatement(outputFd, logMsgsPrinted, logArgs,
+                                       wallClock, fmtId2metadata,
+                                       aggregationFilterId, aggregationFn,
+                                       &fmtId2compiledFormat);
+        if (mergeStream)
+            mergeStream->endLogMessage(wallClock.toNanos(timestamp));
+        return;
+    }
+
+    bf->decompressNextLogStatement(nullptr, numLogMsgsOutOfRange, logArgs,
+                                   wallClock, fmtId2metadata, -1, nullptr,
+                                   &fmtId2compiledFormat);
+}
+
+/**
+ * Reads a TimeIndex and the LogIdSummary after it (if any) from the
+ * compressed log. If a time range was set by decompressRange() and none of
+ * the entries covered by the TimeIndex fall within it, or none of their log
+ * ids can match the log filter, the file is positioned past all of them.
+ *
+ * \param fd
+ *      File descriptor pointing to the TimeIndex
+ * \return
+ *      true if successful, false if the TimeIndex was corrupt
+ */
+bool
+Log::Decoder::readTimeIndex(FILE *fd) {
+    long start = ftell(fd);
+
+    TimeIndex timeIndex;
+    size_t bytesRead = fread(&timeIndex, 1, sizeof(TimeIndex), fd);
+    if (bytesRead != sizeof(TimeIndex) ||
+            timeIndex.entryType != EntryType::INVALID ||
+            timeIndex.extendedType != ExtendedEntryType::TIME_INDEX ||
+            timeIndex.length < sizeof(TimeIndex)) {
+        fprintf(stderr, "Internal Error: Corrupted TimeIndex in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    if (start >= 0) {
+        timestampBase = timeIndex.baseTimestamp;
+        timestampBaseEnd = start + timeIndex.length;
+    }
+
+    if (timeIndex.flushedUpTo > flushedUpTo)
+        flushedUpTo = timeIndex.flushedUpTo;
+
+    LogIdSummary summary;
+    bool hasSummary = false;
+    if (peekEntryType(fd) == EntryType::INVALID &&
+            peekExtendedType(fd) == ExtendedEntryType::LOG_ID_SUMMARY) {
+        if (fread(&summary, 1, sizeof(LogIdSummary), fd)
+                                                    != sizeof(LogIdSummary)) {
+            fprintf(stderr, "Internal Error: Corrupted LogIdSummary in the "
+                            "compressed log\r\n");
+            return false;
+        }
+
+        hasSummary = true;
+    }
+
+    // Dictionary fragments are needed by later entries, so never skip them
+    if (timeIndex.hasDictionary)
+        return true;
+
+    bool inRange = !timeRangeSet ||
+            (timeIndex.minTimestamp <= timeIndex.maxTimestamp &&
+             getWallTime(timeIndex.maxTimestamp) >= timeRangeStart &&
+             getWallTime(timeIndex.minTimestamp) <= timeRangeEnd);
+
+    bool mayMatch = !logFilterSet || !hasSummary;
+    if (!mayMatch) {
+        updateLogFilterMatches();
+        for (size_t i = 0; i < LogIdSummary::NUM_BITS/64; ++i)
+            mayMatch |= (summary.logIds[i] & logFilterSummary[i]) != 0;
+    }
+
+    if (inRange && mayMatch)
+        return true;
+
+    if (start < 0 || fseek(fd, start + timeIndex.length, SEEK_SET) != 0) {
+        fprintf(stderr, "Internal Error: Could not seek past a TimeIndex in "
+                        "the compressed log\r\n");
+        return false;
+    }
+
+    ++numTimeIndexesSkipped;
+    return true;
+}
+
+/**
+ * Extends logFilterMatches (and logFilterSummary) to the log ids in the
+ * dictionary read so far.
+ */
+void
+Log::Decoder::updateLogFilterMatches()
+{
+    // The log messages of the preprocessor version have no dictionary in the
+    // log and are described by the generated code instead
+    bool generated = fmtId2metadata.empty();
+    size_t numLogIds = (generated) ? GeneratedFunctions::numLogIds
+                                   : fmtId2metadata.size();
+
+    for (size_t logId = logFilterMatches.size(); logId < numLogIds; ++logId) {
+        const char *file;
+        int logLevel;
+        if (generated) {
+            file = GeneratedFunctions::logId2Metadata[logId].fileName;
+            logLevel = GeneratedFunctions::logId2Metadata[logId].logLevel;
+        } else {
+            auto *fm = static_cast<FormatMetadata*>(fmtId2metadata[logId]);
+            file = fm->filename;
+            logLevel = fm->logLevel;
+        }
+
+        bool matches = (logFilter.logIds.empty() ||
+                            logFilter.logIds.count(
+                                    static_cast<uint32_t>(logId)) > 0) &&
+                       logLevel <= logFilter.maxLogLevel &&
+                       (logFilter.fileGlob.empty() ||
+                            fnmatch(logFilter.fileGlob.c_str(), file, 0) == 0);
+
+        logFilterMatches.push_back(matches);
+        if (matches) {
+            size_t bit = logId % LogIdSummary::NUM_BITS;
+            logFilterSummary[bit/64] |= (1UL << (bit % 64));
+        }
+    }
+}
+
+/**
+ * Indicates whether the log messages of a log id match the log filter set by
+ * setLogFilter() (or true if there is none).
+ *
+ * \param logId
+ *      Log id to check
+ */
+bool
+Log::Decoder::matchesLogFilter(uint32_t logId)
+{
+    if (!logFilterSet)
+        return true;
+
+    if (logId >= logFilterMatches.size())
+        updateLogFilterMatches();
+
+    // Ids missing from the dictionary are left for the decompression to
+    // report
+    return logId >= logFilterMatches.size() || logFilterMatches[logId];
+}
+
+/**
+ * Decompresses the log statements at the front of a BufferFragment that
+ * don't match the log filter without outputting them.
+ *
+ * \param bf
+ *      BufferFragment to advance
+ * \param logArgs
+ *      Stores the arguments of the log messages decompressed
+ * \return
+ *      Whether the BufferFragment has a next log statement (which then
+ *      matches the log filter)
+ */
+bool
+Log::Decoder::skipFilteredLogStatements(BufferFragment *bf,
+                                        LogMessage &logArgs)
+{
+    while (bf->hasNext() && !matchesLogFilter(bf->nextLogId))
+        bf->decompressNextLogStatement(nullptr, numLogMsgsFiltered, logArgs,
+                                       wallClock, fmtId2metadata, -1, nullptr,
+                                       &fmtId2compiledFormat);
+
+    return bf->hasNext();
+}
+
+/**
+ * Only output the log messages that match a LogFilter from here on. The
+ * Decoder seeks past the entries
+ * whose LogIdSummary shows that none of their log messages match, the same
+ * way decompressRange() does for a time range. This applies to all the
+ * functions that output log messages, including getNextLogStatement().
+ *
+ * \param filter
+ *      The log messages to output; a default LogFilter outputs all of them
+ */
+void
+Log::Decoder::setLogFilter(const LogFilter &filter)
+{
+    logFilter = filter;
+    logFilterSet = !filter.logIds.empty() ||
+                   filter.maxLogLevel < NanoLog::DEBUG ||
+                   !filter.fileGlob.empty();
+
+    logFilterMatches.clear();
+    memset(logFilterSummary, 0, sizeof(logFilterSummary));
+}
+
+/**
+ * Returns the timestamp that the first log message of the BufferExtent at
+ * the current position of inputFd is encoded relative to. This is the
+ * baseTimestamp of the TimeIndex covering the extent, or 0 if there is none.
+ */
+uint64_t
+Log::Decoder::getTimestampBase() {
+    if (timestampBaseEnd < 0 || ftell(inputFd) >= timestampBaseEnd)
+        return 0;
+
+    return timestampBase;
+}
+
+/**
+ * Stream the Decoder reads the log file through once it finds a
+ * CompressedBlock in it (see readCompressedBlock()). The bytes inflated from
+ * the blocks are spliced in ahead of the rest of the file, so the entries
+ * they hold are parsed as if they were stored in the file uncompressed. The
+ * stream is unbuffered so that the splice points are exact, and it can only
+ * seek forward.
+ */
+struct Log::Decoder::BlockStream {
+    /**
+     * BlockStream constructor.
+     *
+     * \param file
+     *      Log file to read after the inflated bytes; it's closed along with
+     *      the stream.
+     */
+    explicit BlockStream(FILE *file)
+        : file(file)
+        , inflated()
+        , readPos(0)
+        , position(ftell(file))
+        , inflatedEnd(position)
+    {
+    }
+
+    /**
+     * Splices the bytes inflated from a CompressedBlock in at the current
+     * position of the stream.
+     *
+     * \param bytes
+     *      Inflated bytes; the vector is swapped with a spent one
+     */
+    void
+    splice(std::vector<char> &bytes) {
+        bytes.insert(bytes.end(), inflated.begin() + readPos, inflated.end());
+        inflated.swap(bytes);
+        readPos = 0;
+        bytes.clear();
+        inflatedEnd = position + static_cast<int64_t>(inflated.size());
+    }
+
+    // Implements cookie_read_function_t
+    static ssize_t
+    read(void *cookie, char *buf, size_t size) {
+        BlockStream *stream = static_cast<BlockStream*>(cookie);
+
+        size_t bytesRead = std::min(size, stream->inflated.size()
+                                                    - stream->readPos);
+        memcpy(buf, stream->inflated.data() + stream->readPos, bytesRead);
+        stream->readPos += bytesRead;
+
+        if (bytesRead < size)
+            bytesRead += fread(buf + bytesRead, 1, size - bytesRead,
+                               stream->file);
+
+        stream->position += bytesRead;
+        return static_cast<ssize_t>(bytesRead);
+    }
+
+    // Implements cookie_seek_function_t
+    static int
+    seek(void *cookie, off64_t *offset, int whence) {
+        BlockStream *stream = static_cast<BlockStream*>(cookie);
+
+        int64_t target = *offset;
+        if (whence == SEEK_CUR)
+            target += stream->position;
+        else if (whence != SEEK_SET)
+            return -1;
+
+        if (target < stream->position)
+            return -1;
+
+        uint64_t skip = static_cast<uint64_t>(target - stream->position);
+        size_t skipInflated = static_cast<size_t>(std::min<uint64_t>(skip,
+                                stream->inflated.size() - stream->readPos));
+        stream->readPos += skipInflated;
+        skip -= skipInflated;
+
+        if (skip > 0 && fseek(stream->file, static_cast<long>(skip),
+                              SEEK_CUR) != 0)
+            return -1;
+
+        stream->position = target;
+        *offset = target;
+        return 0;
+    }
+
+    // Implements cookie_close_function_t
+    static int
+    close(void *cookie) {
+        BlockStream *stream = static_cast<BlockStream*>(cookie);
+        int err = fclose(stream->file);
+        delete stream;
+        return err;
+    }
+
+    // Log file that is read once the inflated bytes run out
+    FILE *file;
+
+    // Bytes inflated from CompressedBlocks that are read ahead of the file
+    std::vector<char> inflated;
+
+    // Offset of the next byte to read in inflated
+    size_t readPos;
+
+    // Logical position of the stream, which counts the inflated bytes in
+    // place of the CompressedBlocks they came from
+    int64_t position;
+
+    // Logical position at which the inflated bytes end and the stream
+    // continues with the bytes of the file
+    int64_t inflatedEnd;
+
+    DISALLOW_COPY_AND_ASSIGN(BlockStream);
+};
+
+/**
+ * Reads a CompressedBlock from the compressed log and inflates it in place
+ * of the block, so that the entries it holds are read next from inputFd.
+ * The first block read makes inputFd a BlockStream wrapping the log file.
+ *
+ * \return
+ *      true if successful, false if the block was corrupt or compressed
+ *      with an unknown algorithm
+ */
+bool
+Log::Decoder::readCompressedBlock() {
+    CompressedBlock block;
+    size_t bytesRead = fread(&block, 1, sizeof(CompressedBlock), inputFd);
+    if (bytesRead != sizeof(CompressedBlock) ||
+            block.entryType != EntryType::INVALID ||
+            block.extendedType != ExtendedEntryType::COMPRESSED_BLOCK) {
+        fprintf(stderr, "Internal Error: Corrupted CompressedBlock in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    if (block.algorithm != BlockCodec::LZ4) {
+        fprintf(stderr, "The compressed log contains a block compressed with "
+                        "an unknown algorithm (%u)\r\n", block.algorithm);
+        return false;
+    }
+
+    std::vector<char> compressed(block.compressedLength);
+    bytesRead = fread(compressed.data(), 1, compressed.size(), inputFd);
+    if (bytesRead != compressed.size()) {
+        fprintf(stderr, "Internal Error: Truncated CompressedBlock in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    std::vector<char> inflated(block.uncompressedLength);
+    int64_t inflatedBytes = BlockCodec::decompress(compressed.data(),
+                                                   compressed.size(),
+                                                   inflated.data(),
+                                                   inflated.size());
+    if (inflatedBytes != static_cast<int64_t>(inflated.size())) {
+        fprintf(stderr, "Internal Error: Corrupted CompressedBlock in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    if (blockStream == nullptr) {
+        BlockStream *stream = new BlockStream(inputFd);
+        cookie_io_functions_t functions = {&BlockStream::read, nullptr,
+                                           &BlockStream::seek,
+                                           &BlockStream::close};
+        FILE *wrapped = fopencookie(stream, "rb", functions);
+        if (wrapped == nullptr) {
+            perror("Could not set up the decompression of a CompressedBlock");
+            delete stream;
+            return false;
+        }
+
+        setvbuf(wrapped, nullptr, _IONBF, 0);
+        inputFd = wrapped;
+        blockStream = stream;
+    }
+
+    blockStream->splice(inflated);
+    ++numCompressedBlocksRead;
+    return true;
+}
+
+/**
+ * Reads a DroppedLogs marker from the compressed log.
+ *
+ * \param fd
+ *      File descriptor pointing to the DroppedLogs marker
+ * \param[out] droppedLogs
+ *      The marker read
+ * \return
+ *      true if successful, false if the marker was corrupt
+ */
+bool
+Log::Decoder::readDroppedLogs(FILE *fd, DroppedLogs &droppedLogs) {
+    size_t bytesRead = fread(&droppedLogs, 1, sizeof(DroppedLogs), fd);
+    if (bytesRead != sizeof(DroppedLogs) ||
+            droppedLogs.entryType != EntryType::INVALID ||
+            droppedLogs.extendedType != ExtendedEntryType::DROPPED_LOGS) {
+        fprintf(stderr, "Internal Error: Corrupted extended entry in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Reads a ClockCalibration from the compressed log and adds it to the
+ * wallClock of the current execution.
+ *
+ * \param fd
+ *      File descriptor pointing to the ClockCalibration
+ * \return
+ *      true if successful, false if the entry was corrupt
+ */
+bool
+Log::Decoder::readClockCalibration(FILE *fd) {
+    ClockCalibration calibration;
+    size_t bytesRead = fread(&calibration, 1, sizeof(ClockCalibration), fd);
+    if (bytesRead != sizeof(ClockCalibration) ||
+            calibration.entryType != EntryType::INVALID ||
+            calibration.extendedType != ExtendedEntryType::CLOCK_CALIBRATION) {
+        fprintf(stderr, "Internal Error: Corrupted extended entry in the "
+                        "compressed log\r\n");
+        return false;
+    }
+
+    wallClock.addCalibration(calibration.rdtsc, calibration.unixNanos);
+    return true;
+}
+
+/**
+ * Write function of the stream that exportTrace() has the log messages
+ * printed to (see fopencookie()); it appends the text to a std::string.
+ *
+ * \param cookie
+ *      The std::string to append to
+ * \param buf
+ *      Text written to the stream
+ * \param size
+ *      Number of bytes in buf
+ *
+ * \return
+ *      The number of bytes written
+ */
+static ssize_t
+appendToString(void *cookie, const char *buf, size_t size)
+{
+    static_cast<std::string*>(cookie)->append(buf, size);
+    return static_cast<ssize_t>(size);
+}
+
+/**
+ * Appends a string to a JSON document as a quoted string literal.
+ *
+ * \param out
+ *      String to append to
+ * \param str
+ *      String to quote
+ * \param length
+ *      Number of bytes in str
+ */
+static void
+appendJsonString(std::string &out, const char *str, size_t length)
+{
+    out.push_back('"');
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        switch (c) {
+            case '"':  out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (c < 0x20)
+                    appendPrintf(out, "\\u%04x", c);
+                else
+                    out.push_back(static_cast<char>(c));
+        }
+    }
+    out.push_back('"');
+}
+
+/**
+ * Appends the fields that all the events of a Chrome trace start with. The
+ * trace's timestamps are in microseconds, so the nanoseconds of the wall
+ * time are kept as 3 decimals.
+ *
+ * \param out
+ *      String to append the start of the event to
+ * \param phase
+ *      Chrome trace event phase, i.e. "i" for an instant event
+ * \param pid
+ *      Process track of the event (the execution in the log file)
+ * \param tid
+ *      Thread track of the event (the runtime thread id)
+ * \param nanos
+ *      Wall time of the event, in nanoseconds since the epoch
+ */
+static void
+appendTraceEventStart(std::string &out, const char *phase, uint32_t pid,
+                      uint32_t tid, int64_t nanos)
+{
+    appendPrintf(out, "{\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":",
+                 phase, pid, tid);
+    if (nanos < 0) {
+        out.push_back('-');
+        nanos = -nanos;
+    }
+    appendPrintf(out, "%ld.%03ld", nanos/1000, nanos%1000);
+}
+
+/**
+ * Writes an event to the trace of exportTrace(), separating it from the
+ * event before it.
+ *
+ * \param event
+ *      JSON object of the event
+ */
+void
+Log::Decoder::writeTraceEvent(const std::string &event)
+{
+    fputs((numTraceEvents == 0) ? "\n" : ",\n", traceFd);
+    fwrite(event.data(), 1, event.size(), traceFd);
+    ++numTraceEvents;
+}
+
+/**
+ * Reports a DroppedLogs marker read from the compressed log in the same
+ * format as the log messages around it, or as an event in the trace of
+ * exportTrace() while exporting one.
+ *
+ * \param outputFd
+ *      File descriptor to print the report to (nullptr for none)
+ * \param droppedLogs
+ *      The marker to report
+ */
+void
+Log::Decoder::printDroppedLogs(FILE *outputFd, const DroppedLogs &droppedLogs)
+{
+    numLogMsgsDropped += droppedLogs.numDropped;
+
+    if (traceFd) {
+        std::string event;
+        appendTraceEventStart(event, "i", numCheckpointsRead,
+                              droppedLogs.bufferId,
+                              wallClock.toNanos(droppedLogs.timestamp));
+        appendPrintf(event, ",\"s\":\"t\",\"cat\":\"DroppedLogs\","
+                     "\"name\":\"%lu log messages dropped\","
+                     "\"args\":{\"numDropped\":%lu}}",
+                     droppedLogs.numDropped, droppedLogs.numDropped);
+        writeTraceEvent(event);
+        return;
+    }
+
+    if (!outputFd || !inTimeRange(droppedLogs.timestamp))
+        return;
+
+    char timeString[32];
+    struct timespec wallTime = wallClock.toTimespec(droppedLogs.timestamp);
+    double nanos = static_cast<double>(wallTime.tv_nsec);
+    std::time_t absTime = wallTime.tv_sec;
+    std::tm *tm = localtime(&absTime);
+    strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", tm);
+
+    fprintf(outputFd, "%s.%09.0lf # %lu log messages dropped on thread %u"
+                      "\r\n"
+                    , timeString
+                    , nanos
+                    , droppedLogs.numDropped
+                    , droppedLogs.bufferId);
+}
+
+/**
+ * Compares two DroppedLogs markers (a, b) based on their timestamps. Returns
+ * true if a chronologically occurs after b.
+ *
+ * \param a
+ *      First DroppedLogs to compare
+ * \param b
+ *      Second DroppedLogs to compare
+ *
+ * \return
+ *      True if a > b; False otherwise
+ */
+bool
+Log::Decoder::compareDroppedLogs(const DroppedLogs &a, const DroppedLogs &b)
+{
+    return a.timestamp > b.timestamp;
+}
+
+/**
+ * Compares two BufferFragments (a, b) based on the timestamps of
+ * their next decompress-able log statements. Returns true if
+ * a's timestamp chronologically occurs after b's timestamp.
+ *
+ * \param a
+ *      First BufferFragment to compare
+ * \param b
+ *      Second BufferFragment to compare
+ *
+ * \return
+ *      True if a > b; False otherwise
+ */
+bool
+Log::Decoder::compareBufferFragments(const BufferFragment *a,
+                                     const BufferFragment *b)
+{
+    return a->getNextLogTimestamp() > b->getNextLogTimestamp();
+};
+
+/**
+ * Decompress the log file that was open()-ed and print the log messages out
+ * in chronological order.
+ *
+ * \param outputFd
+ *      The file descriptor to print the log messages to
+ * \param numThreads
+ *      Number of threads to format the log messages with. With more than one,
+ *      the BufferExtents are read ahead and formatted in parallel, and the
+ *      formatted messages are then merged by timestamp in the same way as
+ *      they would have been decompressed on a single thread.
+ *
+ * \return
+ *      The number of log messages encountered. A negative value indicates error
+ */
+int64_t
+Log::Decoder::decompressTo(FILE* outputFd, uint32_t numThreads)
+{
+    if (filename.empty() || !inputFd)
+        return -1;
+
+    // In ordered decompression, we must sort the entries by time which means
+    // we need to buffer in 3 rounds of NanoLog output. We need more than one
+    // round of output because the compression is non-quiescent, which means
+    // that as we're outputting the nth buffer, new entries may be added to
+    // n-1 and n, and the entries in n could logically come /before/ the new
+    // entries added to n-1. The reason why we need at least 3 is due to an
+    // implementation detail in StagingBuffer whereby one peek() does not
+    // return all the data and at least 2 peek()'s are needed to deplete a
+    // buffer.
+    //
+    // The passes only order the output of a single compression thread though.
+    // When the runtime records TimeIndex::flushedUpTo, which it does for any
+    // number of compression threads, everything read in is kept in a single
+    // stage instead and only the log messages timestamped before
+    // flushedUpTo are output until all stages must be depleted.
+    static const uint32_t stagesToBuffer = 3;
+
+    // Only the first stagesToBuffer stages are merged at a time; any stages
+    // after them are read ahead to give the formatting threads enough work.
+    std::deque<std::vector<BufferFragment*>> stages(stagesToBuffer);
+
+    // BufferFragments read ahead that still need to be formatted in parallel
+    std::vector<BufferFragment*> unformatted;
+    size_t fragmentsToReadAhead = (numThreads > 1) ?
+                                        FRAGMENTS_PER_THREAD*numThreads : 0;
+
+    // DroppedLogs markers waiting to be reported in between the log messages
+    // in the stages, kept as a min-heap ordered by timestamp
+    std::vector<DroppedLogs> droppedLogs;
+
+    // Reports the DroppedLogs markers up to and including a timestamp
+    auto reportDroppedLogs = [&](uint64_t upToTimestamp) {
+        while (!droppedLogs.empty() &&
+                droppedLogs.front().timestamp <= upToTimestamp) {
+            printDroppedLogs(outputFd, droppedLogs.front());
+            std::pop_heap(droppedLogs.begin(), droppedLogs.end(),
+                          compareDroppedLogs);
+            droppedLogs.pop_back();
+        }
+    };
+
+    // Running number of stages being kept in stages
+    uint32_t stagesBuffered = 0;
+
+    // Value of flushedUpTo when the stages were last merged
+    uint64_t mergedUpTo = 0;
+
+    // Indicates that all stages must be depleted before continuing
+    // processing the log file. This should only be true when we detect
+    // the start of a new execution(s) log appended to inputFd or we
+    // reached the end of the current file
+    bool mustDepleteAllStages = false;
+
+    LogMessage logArguments;
+    while (!feof(inputFd) && good) {
+
+        // Step 1: Read in up to a certain number of "stages" of BufferFragments
+        mustDepleteAllStages = false;
+        while (!feof(inputFd) && good && !mustDepleteAllStages) {
+            EntryType entry = peekEntryType(inputFd);
+            bool newStage = false;
+
+            switch (entry) {
+                case EntryType::BUFFER_EXTENT:
+                {
+                    BufferFragment *bf = allocateBufferFragment();
+                    good = bf->readBufferExtent(inputFd, &newStage,
+                                        getFileMapping(), fileMappingBytes,
+                                        getTimestampBase());
+                    ++numBufferFragmentsRead;
+
+                    if (good) {
+                        stages[stagesBuffered].push_back(bf);
+                        if (numThreads > 1)
+                            unformatted.push_back(bf);
+                    }
+
+                    break;
+                }
+                case EntryType::CHECKPOINT:
+                {
+                    // New logical start to the logs detected, at this point
+                    // we should make sure we've printed all the buffered logs
+                    // before continuing to parse the next logical start.
+                    bool stagesEmpty = true;
+                    for (auto &stage : stages)
+                        stagesEmpty &= stage.empty();
+
+                    if (!stagesEmpty) {
+                        mustDepleteAllStages = true;
+                        break;
+                    }
+
+                    // We're safe, all the stages are empty
+                    reportDroppedLogs(UINT64_MAX);
+                    good = readDictionary(inputFd, true);
+
+                    if (good)
+                        fprintf(outputFd,"\r\n# New execution started\r\n");
+
+                    break;
+                }
+
+                case EntryType::LOG_MSGS_OR_DIC:
+                    good = readDictionaryFragment(inputFd);
+                    break;
+
+                case EntryType::INVALID:
+                {
+                    if (peekExtendedType(inputFd)
+                                        == ExtendedEntryType::TIME_INDEX) {
+                        good = readTimeIndex(inputFd);
+                        break;
+                    }
+
+                    if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::COMPRESSED_BLOCK) {
+                        good = readCompressedBlock();
+                        break;
+                    }
+
+                    if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::CLOCK_CALIBRATION) {
+                        good = readClockCalibration(inputFd);
+                        break;
+                    }
+
+                    if (peekExtendedType(inputFd)
+                                            != ExtendedEntryType::PADDING) {
+                        DroppedLogs dl;
+                        good = readDroppedLogs(inputFd, dl);
+                        if (good) {
+                            droppedLogs.push_back(dl);
+                            std::push_heap(droppedLogs.begin(),
+                                           droppedLogs.end(),
+                                           compareDroppedLogs);
+                        }
+                        break;
+                    }
+
+                    // Consume padding
+                    while (!feof(inputFd) && peekEntryType(inputFd) == INVALID
+                            && peekExtendedType(inputFd)
+                                                == ExtendedEntryType::PADDING)
+                        fgetc(inputFd);
+                    break;
+                }
+            }
+
+            if (feof(inputFd))
+                mustDepleteAllStages = true;
+
+            // If we reach a logical end to the current stage,
+            // make the current stage available for consumption
+            if (((mustDepleteAllStages || !good) &&
+                    !stages[stagesBuffered].empty()) ||
+                    (newStage && flushedUpTo == 0))
+            {
+                ++stagesBuffered;
+                if (stagesBuffered == stages.size())
+                    stages.emplace_back();
+            }
+
+            bool canMerge = (flushedUpTo != 0) ? flushedUpTo > mergedUpTo
+                                        : stagesBuffered >= stagesToBuffer;
+            if (canMerge && unformatted.size() >= fragmentsToReadAhead)
+                break;
+        }
+        mergedUpTo = flushedUpTo;
+
+        // Step 1b: Format the BufferFragments read ahead in parallel
+        if (!unformatted.empty()) {
+            formatBufferFragments(unformatted, numThreads);
+            unformatted.clear();
+        }
+
+        // Step 2: Heapify all BufferFragments within the stages from
+        // front=max to back=min
+        for (auto &stage : stages) {
+            std::make_heap(stage.begin(), stage.end(), compareBufferFragments);
+        }
+
+        // Step 3: Deplete the first stage
+        while (true) {
+            // Step 3a: Find the minimum amongst the stages
+            std::vector<BufferFragment*> *minStage = nullptr;
+            uint32_t minStageIndex = 0;
+            uint32_t stagesToMerge = (flushedUpTo != 0) ? 1
+                                : std::min(stagesBuffered, stagesToBuffer);
+            for (uint32_t i = 0; i < stagesToMerge; ++i) {
+                if (stages[i].empty())
+                    continue;
+
+                uint64_t next = stages[i].front()->getNextLogTimestamp();
+                if (minStage == nullptr ||
+                        next < minStage->front()->getNextLogTimestamp()) {
+                    minStage = &(stages[i]);
+                    minStageIndex = i;
+                }
+            }
+
+            // If nothing was found, we're done
+            if (minStage == nullptr)
+                break;
+
+            // Log messages still to be read may come ahead of the ones
+            // timestamped flushedUpTo or later
+            uint64_t outputUpTo = (flushedUpTo != 0 && !mustDepleteAllStages)
+                                    ? flushedUpTo : UINT64_MAX;
+            if (minStage->front()->getNextLogTimestamp() >= outputUpTo)
+                break;
+
+            // Step 3b: Find the timestamp up to which the minimum's log
+            // messages come ahead of all the others. Ties go to the earlier
+            // stage, as with the search above.
+            BufferFragment *bf = minStage->front();
+            uint64_t runEnd = UINT64_MAX;
+            bool runEndInclusive = true;
+            for (uint32_t i = 0; i < stagesToMerge; ++i) {
+                std::vector<BufferFragment*> &stage = stages[i];
+                if (stage.empty())
+                    continue;
+
+                // The runner-up within the minimum's stage is a heap child
+                uint64_t next = UINT64_MAX;
+                bool inclusive = (i >= minStageIndex);
+                if (i != minStageIndex) {
+                    next = stage.front()->getNextLogTimestamp();
+                } else {
+                    for (size_t child = 1; child <= 2; ++child) {
+                        if (child < stage.size())
+                            next = std::min(next,
+                                    stage[child]->getNextLogTimestamp());
+                    }
+                }
+
+                if (next < runEnd || (next == runEnd && !inclusive)) {
+                    runEnd = next;
+                    runEndInclusive = inclusive;
+                }
+            }
+
+            if (outputUpTo <= runEnd) {
+                runEnd = outputUpTo;
+                runEndInclusive = false;
+            }
+
+            // Step 3c: Output the log messages in the run without going
+            // back through the heaps for each
+            do {
+                reportDroppedLogs(bf->getNextLogTimestamp());
+                outputNextLogStatement(bf, outputFd, logArguments);
+            } while (bf->hasNext() &&
+                        (bf->getNextLogTimestamp() < runEnd ||
+                            (runEndInclusive &&
+                                bf->getNextLogTimestamp() == runEnd)));
+
+            // Moves the minimum element to the end of the array
+            std::pop_heap(minStage->begin(), minStage->end(),
+                    compareBufferFragments);
+
+            if (bf->hasNext()) {
+                // If there's more, re-heapify the last element
+                std::push_heap(minStage->begin(), minStage->end(),
+                              compareBufferFragments);
+            } else {
+                // Otherwise, buffer is depleted -> remove it
+                minStage->pop_back();
+                freeBufferFragment(bf);
+            }
+
+            // Step 3d: Check for exit condition. Later stages may have been
+            // depleted alongside the first, so shift out all the empty ones.
+            // Stages read ahead can be merged without reading the log again.
+            if (stages[0].empty()) {
+                while (stagesBuffered > 0 && stages[0].empty()) {
+                    stages.pop_front();
+                    --stagesBuffered;
+                }
+
+                while (stages.size() < stagesToBuffer ||
+                        stages.size() <= stagesBuffered)
+                    stages.emplace_back();
+
+                if (!mustDepleteAllStages && stagesBuffered < stagesToBuffer)
+                    break;
+            }
+        }
+
+        if (mustDepleteAllStages)
+            reportDroppedLogs(UINT64_MAX);
+    }
+
+    return logMsgsPrinted;
+}
+
+/**
+ * Decompress the log file that was open()-ed and print only the log messages
+ * within a wall time range out in chronological order. The TimeIndex'es in the
+ * log are used to seek past the entries that fall outside of the range
+ * instead of decompressing them.
+ *
+ * \param outputFd
+ *      The file descriptor to print the log messages to
+ * \param startTime
+ *      Wall time of the first log message to print (seconds since epoch)
+ * \param endTime
+ *      Wall time of the last log message to print (seconds since epoch)
+ * \param numThreads
+ *      Number of threads to format the log messages with (see decompressTo())
+ *
+ * \return
+ *      The number of log messages printed. A negative value indicates error
+ */
+int64_t
+Log::Decoder::decompressRange(FILE* outputFd, double startTime,
+                              double endTime, uint32_t numThreads)
+{
+    timeRangeSet = true;
+    timeRangeStart = startTime;
+    timeRangeEnd = endTime;
+
+    int64_t logMsgs = decompressTo(outputFd, numThreads);
+
+    timeRangeSet = false;
+    return logMsgs;
+}
+
+/**
+ * Decompress multiple log files (i.e. of the processes on a host, or the
+ * rotations of a log file) into one stream of log messages in chronological
+ * order. Each file is decompressed in order like decompressTo() does by a
+ * thread of its own, and the log messages are merged by their wall times as
+ * they come, so only a bounded number of them are buffered per file. The
+ * lines of each file are tagged with its name (without the directory).
+ *
+ * \param outputFd
+ *      The file descriptor to print the log messages to
+ * \param logFiles
+ *      Paths of the log files to merge
+ * \param filter
+ *      The log messages to print (see setLogFilter())
+ *
+ * \return
+ *      The number of log messages printed. A negative value indicates error
+ */
+int64_t
+Log::Decoder::decompressMerged(FILE *outputFd,
+                               const std::vector<std::string> &logFiles,
+                               const LogFilter &filter)
+{
+    std::vector<std::unique_ptr<Decoder>> decoders;
+    std::vector<std::unique_ptr<MergeStream>> streams;
+    std::vector<FILE*> streamFds;
+    bool good = true;
+
+    for (const std::string &logFile : logFiles) {
+        decoders.emplace_back(new Decoder());
+        Decoder *decoder = decoders.back().get();
+        decoder->setLogFilter(filter);
+        if (!decoder->open(logFile.c_str())) {
+            fprintf(stderr, "Unable to open file %s\r\n", logFile.c_str());
+            good = false;
+            break;
+        }
+
+        size_t slash = logFile.find_last_of('/');
+        streams.emplace_back(new MergeStream((slash == std::string::npos)
+                                             ? logFile
+                                             : logFile.substr(slash + 1)));
+        cookie_io_functions_t functions = {nullptr, &MergeStream::write,
+                                           nullptr, nullptr};
+        FILE *streamFd = fopencookie(streams.back().get(), "w", functions);
+        if (streamFd == nullptr) {
+            perror("Could not set up the merge of a log file");
+            good = false;
+            break;
+        }
+
+        setvbuf(streamFd, nullptr, _IONBF, 0);
+        streamFds.push_back(streamFd);
+        decoder->mergeStream = streams.back().get();
+    }
+
+    if (!good) {
+        for (FILE *streamFd : streamFds)
+            fclose(streamFd);
+        return -1;
+    }
+
+    std::vector<int64_t> logMsgs(decoders.size(), 0);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < decoders.size(); ++i) {
+        workers.emplace_back([&, i]() {
+            logMsgs[i] = decoders[i]->decompressTo(streamFds[i]);
+            streams[i]->finish();
+        });
+    }
 
-    fm->numNibbles = 0;
-    fm->numPrintFragments = 0;
+    // Min-heap of the wall time of the next chunk of each stream, with ties
+    // going to the earlier log file
+    typedef std::pair<int64_t, size_t> HeapEntry;
+    std::vector<HeapEntry> heap;
+    std::vector<std::pair<int64_t, std::string>> nextChunks(streams.size());
+    for (size_t i = 0; i < streams.size(); ++i) {
+        if (streams[i]->next(nextChunks[i]))
+            heap.emplace_back(nextChunks[i].first, i);
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+        size_t i = heap.back().second;
+        heap.pop_back();
+
+        // Tag every line that isn't blank with the origin of the stream
+        const std::string &text = nextChunks[i].second;
+        const std::string &origin = streams[i]->origin;
+        size_t lineStart = 0;
+        while (lineStart < text.size()) {
+            size_t lineEnd = text.find('\n', lineStart);
+            lineEnd = (lineEnd == std::string::npos) ? text.size()
+                                                     : lineEnd + 1;
+            if (text.compare(lineStart, lineEnd - lineStart, "\r\n") != 0 &&
+                    text.compare(lineStart, lineEnd - lineStart, "\n") != 0)
+                fprintf(outputFd, "[%s] ", origin.c_str());
+
+            fwrite(text.data() + lineStart, 1, lineEnd - lineStart, outputFd);
+            lineStart = lineEnd;
+        }
 
-    std::regex regex("^%"
-                     "([-+ #0]+)?" // Flags (Position 1)
-                     "([\\d]+|\\*)?" // Width (Position 2)
-                     "(\\.(\\d+|\\*))?"// Precision (Position 4; 3 includes '.')
-                     "(hh|h|l|ll|j|z|Z|t|L)?" // Length (Position 5)
-                     "([diuoxXfFeEgGaAcspn])"// Specifier (Position 6)
-                     );
+        if (streams[i]->next(nextChunks[i])) {
+            heap.emplace_back(nextChunks[i].first, i);
+            std::push_heap(heap.begin(), heap.end(),
+                           std::greater<HeapEntry>());
+        }
+    }
 
-    size_t i = 0;
-    std::cmatch match;
-    int consecutivePercents = 0;
-    size_t startOfNextFragment = 0;
-    PrintFragment *pf = nullptr;
+    int64_t logMsgsPrinted = 0;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+        fclose(streamFds[i]);
 
-    // The key idea here is to split up the format string in to fragments (i.e.
-    // PrintFragments) such that there is at most one specifier per fragment.
-    // This then allows the decompressor later to consume one argument at a
-    // time and print the fragment (vs. buffering all the arguments first).
+        if (logMsgs[i] < 0)
+            good = false;
+        logMsgsPrinted += logMsgs[i];
+    }
 
-    while (i < formatStringLength) {
-        char c = formatString[i];
+    return (good) ? logMsgsPrinted : -1;
+}
 
-        // Skip the next character if there's an escape
-        if (c == '\\') {
-            i += 2;
-            continue;
-        }
+/**
+ * Returns the formatters registered with registerTypeFormatter(), by the
+ * name of their user-defined type.
+ */
+static std::unordered_map<std::string,
+                          NanoLogInternal::Log::Decoder::TypeFormatter> &
+getTypeFormatters()
+{
+    static std::unordered_map<std::string,
+                              NanoLogInternal::Log::Decoder::TypeFormatter>
+                                                                formatters;
+    return formatters;
+}
 
-        if (c != '%') {
-            ++i;
-            consecutivePercents = 0;
-            continue;
-        }
+/**
+ * Registers the function that turns the objects of a user-defined type back
+ * into text (see NanoLog::Serializer) for all Decoders. This shall be invoked
+ * before decoding log files that contain the type, and not concurrently with
+ * decoding.
+ *
+ * \param typeName
+ *      NanoLog::Serializer::typeName of the type
+ * \param formatter
+ *      Function to format its objects with; nullptr unregisters the type
+ */
+void
+Log::Decoder::registerTypeFormatter(const char *typeName,
+                                    TypeFormatter formatter)
+{
+    if (formatter == nullptr)
+        getTypeFormatters().erase(typeName);
+    else
+        getTypeFormatters()[typeName] = formatter;
+}
 
-        // If there's an even number of '%'s, then it's a comment
-        if (++consecutivePercents % 2 == 0
-                || !std::regex_search(formatString + i, match, regex))
-        {
-            ++i;
-            continue;
-        }
+/**
+ * Appends the text for a user-defined type argument, as its registered
+ * formatter renders it (see registerTypeFormatter()). Types without one are
+ * printed as the type name followed by the hex digits of the object in
+ * braces.
+ *
+ * \param str
+ *      String the argument is stored as in the compressed log, starting with
+ *      USER_TYPE_MARKER (see encodeUserType())
+ * \param out
+ *      String to append the text to
+ */
+void
+Log::Decoder::formatUserType(const char *str, std::string &out)
+{
+    static thread_local std::string bytes;
 
-        // Advance the pointer to the end of the specifier
-        i += match.length();
+    const char *name = str + 1;
+    const char *separator = strchr(name, USER_TYPE_SEPARATOR);
+    if (separator == nullptr) {
+        out.append(name);
+        return;
+    }
 
-        // At this point we found a match, let's start analyzing it
-        pf = reinterpret_cast<PrintFragment*>(*microCode);
-        *microCode += sizeof(PrintFragment);
+    const char *digits = separator + 1;
+    std::string typeName(name, separator);
+    auto it = getTypeFormatters().find(typeName);
+    if (it == getTypeFormatters().end()) {
+        out.append(typeName);
+        out.push_back('{');
+        out.append(digits);
+        out.push_back('}');
+        return;
+    }
 
-        std::string width = match[2].str();
-        std::string precision = match[4].str();
-        std::string length = match[5].str();
-        char specifier = match[6].str()[0];
+    bytes.clear();
+    for (const char *c = digits; isxdigit(c[0]) && isxdigit(c[1]); c += 2) {
+        int high = isdigit(c[0]) ? c[0] - '0' : tolower(c[0]) - 'a' + 10;
+        int low = isdigit(c[1]) ? c[1] - '0' : tolower(c[1]) - 'a' + 10;
+        bytes.push_back(static_cast<char>(high << 4 | low));
+    }
 
-        FormatType type = getFormatType(length, specifier);
-        if (type == MAX_FORMAT_TYPE) {
-            fprintf(stderr, "Error: Couldn't process this: %s\r\n",
-                    match.str().c_str());
-            *microCode = microCodeStartingPos;
-            return false;
+    it->second(out, bytes.data(), bytes.size());
+}
+
+// Formats that formatArray() renders the elements of arrays with (see
+// Log::Decoder::setArrayFormat()); a null integer format picks "%lld" or
+// "%llu" by the signedness of the elements.
+static const char *arrayIntegerFormat = nullptr;
+static const char *arrayFloatingPointFormat = "%g";
+static const char *arraySeparator = ", ";
+
+/**
+ * Sets how all Decoders render the elements of arrays (see NanoLog::array()),
+ * which are printed in brackets and divided by the separator. This shall not
+ * be invoked concurrently with decoding and the strings must outlive the
+ * decoding.
+ *
+ * \param integerFormat
+ *      printf() format for a single integer element, which is passed as a
+ *      long long (i.e. "%lld" or "%llx"); nullptr restores the default
+ * \param floatingPointFormat
+ *      printf() format for a single floating point element, which is passed
+ *      as a double; nullptr restores the default "%g"
+ * \param separator
+ *      String to print between elements; nullptr restores the default ", "
+ */
+void
+Log::Decoder::setArrayFormat(const char *integerFormat,
+                             const char *floatingPointFormat,
+                             const char *separator)
+{
+    arrayIntegerFormat = integerFormat;
+    arrayFloatingPointFormat = (floatingPointFormat == nullptr)
+                                    ? "%g" : floatingPointFormat;
+    arraySeparator = (separator == nullptr) ? ", " : separator;
+}
+
+/**
+ * Returns the number of bytes an array argument takes up in the compressed
+ * log, which unlike strings aren't null-terminated.
+ *
+ * \param str
+ *      Array as it's stored in the compressed log, starting with
+ *      ARRAY_MARKER (see encodeArray())
+ */
+uint32_t
+Log::Decoder::getArrayLength(const char *str)
+{
+    uint8_t elements = static_cast<uint8_t>(str[1]);
+    uint32_t count;
+    memcpy(&count, str + 2, sizeof(count));
+
+    uint32_t length = 2 + sizeof(count);
+    if (elements & ARG_STORAGE_FLOATING_POINT)
+        return length + count*(elements & ARG_STORAGE_SIZE_MASK);
+
+    const BufferUtils::TwoNibbles *nibbles =
+            reinterpret_cast<const BufferUtils::TwoNibbles*>(str + length);
+    return length + (count + 1)/2
+                  + BufferUtils::getSizeOfPackedValues(nibbles, count);
+}
+
+/**
+ * Appends the text for an array argument, i.e. "[1, 2, 3]" with the default
+ * formats (see setArrayFormat()).
+ *
+ * \param str
+ *      Array as it's stored in the compressed log, starting with
+ *      ARRAY_MARKER (see encodeArray())
+ * \param out
+ *      String to append the text to
+ */
+void
+Log::Decoder::formatArray(const char *str, std::string &out)
+{
+    static thread_local std::vector<int64_t> values;
+
+    uint8_t elements = static_cast<uint8_t>(str[1]);
+    uint32_t elementBytes = elements & ARG_STORAGE_SIZE_MASK;
+    uint32_t count;
+    memcpy(&count, str + 2, sizeof(count));
+    const char *pos = str + 2 + sizeof(count);
+
+    out.push_back('[');
+    if (elements & ARG_STORAGE_FLOATING_POINT) {
+        for (uint32_t i = 0; i < count; ++i, pos += elementBytes) {
+            double value;
+            if (elementBytes == sizeof(float)) {
+                float single;
+                memcpy(&single, pos, sizeof(single));
+                value = single;
+            } else {
+                memcpy(&value, pos, sizeof(value));
+            }
+
+            if (i > 0)
+                out.append(arraySeparator);
+            appendPrintf(out, arrayFloatingPointFormat, value);
         }
 
-        pf->argType = 0x1F & type;
-        pf->hasDynamicWidth = (width.empty()) ? false : width[0] == '*';
-        pf->hasDynamicPrecision = (precision.empty()) ? false
-                                                        : precision[0] == '*';
+        out.push_back(']');
+        return;
+    }
 
-        // Tricky tricky: We null-terminate the fragment by copying 1
-        // extra byte and then setting it to NULL
-        pf->fragmentLength = static_cast<uint16_t>(i - startOfNextFragment + 1);
-        memcpy(*microCode,
-                formatString + startOfNextFragment,
-                pf->fragmentLength);
-        *microCode += pf->fragmentLength;
-        *(*microCode - 1) = '\0';
+    // The elements were widened to 64 bits before they were packed
+    const BufferUtils::TwoNibbles *nibbles =
+                    reinterpret_cast<const BufferUtils::TwoNibbles*>(pos);
+    pos += (count + 1)/2;
+    values.resize(count);
+    BufferUtils::unpackValues(&pos, nibbles, count, values.data());
 
-        // Non-strings and dynamic widths need nibbles!
-        if (specifier != 's')
-            ++fm->numNibbles;
+    bool isSigned = (elements & ARG_STORAGE_SIGNED);
+    const char *format = arrayIntegerFormat;
+    if (format == nullptr)
+        format = isSigned ? "%lld" : "%llu";
 
-        if (pf->hasDynamicWidth)
-            ++fm->numNibbles;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i > 0)
+            out.append(arraySeparator);
 
-        if (pf->hasDynamicPrecision)
-            ++fm->numNibbles;
+        if (isSigned)
+            appendPrintf(out, format, static_cast<long long int>(values[i]));
+        else
+            appendPrintf(out, format,
+                         static_cast<unsigned long long>(values[i]));
+    }
 
-#ifdef ENABLE_DEBUG_PRINTING
-        printf("Fragment %d: %s\r\n", fm->numPrintFragments,pf->formatFragment);
-        printf("\t\ttype: %u, dWidth: %u, dPrecision: %u, length: %u\r\n",
-                                           pf->argType,
-                                           pf->hasDynamicWidth,
-                                           pf->hasDynamicPrecision,
-                                           pf->fragmentLength);
-#endif
+    out.push_back(']');
+}
 
-        startOfNextFragment = i;
-        ++fm->numPrintFragments;
+/**
+ * Returns the wall time (seconds since epoch) of the most recent Checkpoint
+ * read from the log file, which is the start of the log file right after
+ * open().
+ */
+std::time_t
+Log::Decoder::getStartTime()
+{
+    return checkpoint.unixTime;
+}
+
+/**
+ * Iterative interface to decompress the next log statement (if there are any)
+ * in the log file and optionally prints it via outputFd. The log statements
+ * are output in the order in which they appear in the log which may not be
+ * in chronological order.
+ *
+ * \param[out] logMsg
+ *          Log message that's decompressed; the contents are valid until
+ *          the next invocation to this function.
+ *
+ * \param outputFd
+ *          File descriptor to output the log message to. A value of nullptr
+ *          indicates that no printing is desired.
+ *
+ * \return
+ *      True if the decompression was successfully
+ *      False indicates there are no more logs or there's an error
+ */
+bool
+Log::Decoder::getNextLogStatement(LogMessage &logMsg,
+                                  FILE *outputFd) {
+    if (skipFilteredLogStatements(bufferFragment, logMsg)) {
+        bufferFragment->decompressNextLogStatement(outputFd,
+                                                        logMsgsPrinted,
+                                                        logMsg,
+                                                        wallClock,
+                                                        fmtId2metadata,
+                                                        -1,
+                                                        nullptr,
+                                                        &fmtId2compiledFormat);
+        return true;
     }
 
-    // If we didn't encounter any specifiers, make one for a basic string
-    if (pf == nullptr) {
-        pf = reinterpret_cast<PrintFragment*>(*microCode);
-        *microCode += sizeof(PrintFragment);
-        fm->numPrintFragments = 1;
+    logMsg.reset();
 
-        pf->argType = FormatType::NONE;
-        pf->hasDynamicWidth = pf->hasDynamicPrecision = false;
-        pf->fragmentLength = downCast<uint16_t>(formatStringLength);
-        memcpy(*microCode, formatString, formatStringLength);
-        *microCode += formatStringLength;
-    } else {
-        // Extend the last fragment to include the rest of the string
-        size_t endingLength = formatStringLength - startOfNextFragment;
-        memcpy(pf->formatFragment + pf->fragmentLength - 1,  // -1 to erase \0
-              formatString + startOfNextFragment,
-              endingLength);
-        pf->fragmentLength = downCast<uint16_t>(pf->fragmentLength - 1
-                                                                + endingLength);
-        *microCode += endingLength;
+    // Decoder was never 'opened' properly
+    if (filename.empty() || !inputFd)
+        return false;
+
+    // The end of a file that's followed only marks the end of the entries
+    // written so far
+    if (following) {
+        clearerr(inputFd);
+        if (blockStream)
+            clearerr(blockStream->file);
     }
 
-#ifdef ENABLE_DEBUG_PRINTING
-    printf("Fragment %d: %s\r\n", fm->numPrintFragments, pf->formatFragment);
-    printf("\t\ttype: %u, dWidth: %u, dPrecision: %u, length: %u\r\n",
-           pf->argType,
-           pf->hasDynamicWidth,
-           pf->hasDynamicPrecision,
-           pf->fragmentLength);
-#endif
+    // We've read the end of the file or an error
+    if (feof(inputFd) || !good)
+        return false;
+
+    while(!skipFilteredLogStatements(bufferFragment, logMsg) &&
+            !feof(inputFd) && good) {
+        // Leave entries that are still being written for the next call
+        if (following && !nextEntryIsComplete())
+            return false;
+
+        EntryType entry = peekEntryType(inputFd);
+        bool wrapAround;
+
+        switch (entry) {
+            case EntryType::BUFFER_EXTENT:
+                if (bufferFragment->readBufferExtent(inputFd, &wrapAround,
+                                        getFileMapping(), fileMappingBytes,
+                                        getTimestampBase())) {
+                    ++numBufferFragmentsRead;
+                    break;
+                }
+
+                fprintf(stderr, "Internal Error: Corrupted BufferExtent\r\n");
+                good = false;
+                return false;
+
+            case EntryType::CHECKPOINT:
+                if (readDictionary(inputFd, true)) {
+
+                    if (outputFd)
+                        fprintf(outputFd, "\r\n# New execution started\r\n");
+
+                    break;
+                }
+
+                good = false;
+                return false;
+
+            case EntryType::LOG_MSGS_OR_DIC:
+                good = readDictionaryFragment(inputFd);
+                break;
+
+            case EntryType::INVALID:
+                if (peekExtendedType(inputFd) == ExtendedEntryType::TIME_INDEX) {
+                    good = readTimeIndex(inputFd);
+                    break;
+                }
+
+                if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::COMPRESSED_BLOCK) {
+                    good = readCompressedBlock();
+                    break;
+                }
+
+                if (peekExtendedType(inputFd)
+                                    == ExtendedEntryType::CLOCK_CALIBRATION) {
+                    good = readClockCalibration(inputFd);
+                    break;
+                }
+
+                if (peekExtendedType(inputFd) != ExtendedEntryType::PADDING) {
+                    DroppedLogs droppedLogs;
+                    good = readDroppedLogs(inputFd, droppedLogs);
+                    if (good)
+                        printDroppedLogs(outputFd, droppedLogs);
+                    break;
+                }
+
+                // Consume padding
+                while (!feof(inputFd) && peekEntryType(inputFd) == INVALID &&
+                        peekExtendedType(inputFd) == ExtendedEntryType::PADDING)
+                    fgetc(inputFd);
+                break;
+        }
+    }
 
-    return true;
+    return bufferFragment->decompressNextLogStatement(outputFd,
+                                                            logMsgsPrinted,
+                                                            logMsg,
+                                                            wallClock,
+                                                            fmtId2metadata,
+                                                            -1,
+                                                            nullptr,
+                                                        &fmtId2compiledFormat);
 }
 
 /**
- * Reads a partial dictionary from the log file and adds it to the global
- * mapping of log identifiers to static log information.
+ * Determines the byte size of the entry that starts with a given header in
+ * the compressed log.
+ *
+ * \param header
+ *      Leading bytes of the entry
+ * \param headerBytes
+ *      Number of valid bytes in header
  *
- * \param fd
- *      File descriptor to read the mapping from
  * \return
- *      true indicates success; false indicates error
+ *      Byte size of the entry, or 0 if headerBytes does not cover the part
+ *      of the header that records it
  */
-bool
-Log::Decoder::readDictionaryFragment(FILE *fd) {
-    // These buffers start us off with some statically allocated space.
-    // Should we need more, we will malloc it.
-    size_t bufferSize = 10*1024;
-    char filenameBuffer[bufferSize];
-    char formatBuffer[bufferSize];
+static uint64_t
+getEntryBytes(const char *header, size_t headerBytes)
+{
+    using namespace NanoLogInternal::Log;
 
-    bool newBuffersAllocated = false;
-    char *filename = filenameBuffer;
-    char *format = formatBuffer;
+    if (headerBytes == 0)
+        return 0;
 
-    DictionaryFragment df;
-    size_t bytesRead = fread(&df, 1, sizeof(DictionaryFragment), fd);
-    if (bytesRead != sizeof(DictionaryFragment)) {
-        fprintf(stderr, "Could not read entire dictionary fragment header\r\n");
-        return false;
-    }
+    switch (peekEntryType(header)) {
+        case EntryType::BUFFER_EXTENT:
+        {
+            if (headerBytes < sizeof(BufferExtent))
+                return 0;
 
-    assert(df.entryType == EntryType::LOG_MSGS_OR_DIC);
+            BufferExtent be;
+            memcpy(&be, header, sizeof(BufferExtent));
+            return std::max<uint64_t>(be.length, sizeof(BufferExtent));
+        }
 
-    while (bytesRead < df.newMetadataBytes && !feof(fd)) {
-        CompressedLogInfo cli;
-        size_t newBytesRead = 0;
-        newBytesRead += fread(&cli, 1, sizeof(CompressedLogInfo), fd);
+        case EntryType::CHECKPOINT:
+        {
+            if (headerBytes < sizeof(Checkpoint))
+                return 0;
 
-        if (newBytesRead != sizeof(CompressedLogInfo)) {
-            fprintf(stderr, "Could not read in log metadata\r\n");
-            return false;
+            Checkpoint cp;
+            memcpy(&cp, header, sizeof(Checkpoint));
+            return sizeof(Checkpoint) + cp.newMetadataBytes;
         }
 
-        if (bufferSize < cli.filenameLength ||
-            bufferSize < cli.formatStringLength)
+        case EntryType::LOG_MSGS_OR_DIC:
         {
-            if (newBuffersAllocated) {
-                free(filename);
-                free(format);
-                filename = format = nullptr;
-            }
-
-            newBuffersAllocated = true;
-            bufferSize = 2*std::max(cli.filenameLength, cli.formatStringLength);
-            filename = static_cast<char*>(malloc(bufferSize));
-            format = static_cast<char*>(malloc(bufferSize));
+            if (headerBytes < sizeof(DictionaryFragment))
+                return 0;
 
-            if (filename == nullptr || format == nullptr) {
-                fprintf(stderr, "Internal Error: Could not allocate enough "
-                               "memory to store the filename/format strings "
-                               "in the dictionary. Tried to allocate %lu bytes "
-                               "to store the %u and %u byte filename and "
-                               "format string lengths respectively",
-                               bufferSize,
-                               cli.formatStringLength,
-                               cli.filenameLength);
-                return false;
-            }
+            DictionaryFragment df;
+            memcpy(&df, header, sizeof(DictionaryFragment));
+            return std::max<uint64_t>(df.newMetadataBytes,
+                                      sizeof(DictionaryFragment));
         }
 
-        newBytesRead += fread(filename, 1, cli.filenameLength, fd);
-        newBytesRead += fread(format, 1, cli.formatStringLength, fd);
-        bytesRead += newBytesRead;
+        case EntryType::INVALID:
+            break;
+    }
 
-        if (newBytesRead != sizeof(CompressedLogInfo)
-                                + cli.filenameLength + cli.formatStringLength)
+    const UnknownHeader *uh = reinterpret_cast<const UnknownHeader*>(header);
+    switch (uh->other) {
+        case ExtendedEntryType::DROPPED_LOGS:
+            return sizeof(DroppedLogs);
+
+        case ExtendedEntryType::TIME_INDEX:
+            return sizeof(TimeIndex);
+
+        case ExtendedEntryType::CLOCK_CALIBRATION:
+            return sizeof(ClockCalibration);
+
+        case ExtendedEntryType::LOG_ID_SUMMARY:
+            return sizeof(LogIdSummary);
+
+        case ExtendedEntryType::COMPRESSED_BLOCK:
         {
-            fprintf(stderr, "Could not read in a log's filename/"
-                            "format string\r\n");
-            return false;
-        }
+            if (headerBytes < sizeof(CompressedBlock))
+                return 0;
 
-        fmtId2metadata.push_back(endOfRawMetadata);
-        fmtId2fmtString.push_back(format);
-        createMicroCode(&endOfRawMetadata,
-                            format,
-                            filename,
-                            cli.linenum,
-                            cli.severity);
-    }
+            CompressedBlock block;
+            memcpy(&block, header, sizeof(CompressedBlock));
+            return sizeof(CompressedBlock) + block.compressedLength;
+        }
 
-    if (newBuffersAllocated) {
-        free(filename);
-        free(format);
+        default:
+            return 1;
     }
-
-    return true;
 }
 
 /**
- * Opens a compressed log with contents created by Encoder.
+ * Puts the Decoder in follow mode for a log file that is still being written
+ * to (i.e. "tail -f"). From here on, getNextLogStatement() returns false
+ * once it runs out of entries that were completely written rather than at
+ * the end of the log, and picks up where it left off once waitForData()
+ * reports that more were written. New dictionary fragments and
+ * CompressedBlocks are read as they arrive. If the log file is rotated (see
+ * NanoLog::setLogRotation()), the Decoder moves on to the new file at the
+ * same path once the old one has gone quiet.
  *
- * \param filename
- *      Compressed log file to open
  * \return
- *      True if success, false if the log file is not valid or cannot be opened
+ *      true if the Decoder now follows the log file; false if no log file
+ *      was open()-ed
  */
 bool
-Log::Decoder::open(const char *filename) {
-    inputFd = fopen(filename, "rb");
-    good = false;
-
-    if (!inputFd)
+Log::Decoder::follow()
+{
+    if (filename.empty() || !inputFd)
         return false;
 
-    if(!readDictionary(inputFd, true)) {
-        fclose(inputFd);
-        inputFd = nullptr;
-        return false;
-    }
+    following = true;
 
-    this->filename = std::string(filename);
-    numBufferFragmentsRead = 0;
-    numCheckpointsRead = 1;
-    logMsgsPrinted = 0;
-    good = true;
+    if (inotifyFd < 0)
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    watchFile();
     return true;
 }
+
 /**
- * Decoder destructor
+ * Waits for more complete entries to be written to the log file followed
+ * (see follow()). The file's inotify events wake the Decoder up as soon as
+ * the runtime writes to it, or, if inotify is not available, the file is
+ * checked every millisecond.
+ *
+ * \param timeoutMs
+ *      Maximum number of milliseconds to wait
+ *
+ * \return
+ *      true if getNextLogStatement() has new entries to read; false if the
+ *      timeout expired first or the Decoder is not following a file
  */
-Log::Decoder::~Decoder() {
-    if (inputFd)
-        fclose(inputFd);
+bool
+Log::Decoder::waitForData(uint32_t timeoutMs)
+{
+    if (!following)
+        return false;
 
-    filename.clear();
-    inputFd = nullptr;
-    good = false;
+    if (inputFd && good && nextEntryIsComplete())
+        return true;
 
-    for (BufferFragment *bf : freeBuffers)
-        delete bf;
+    bool notified = false;
+    if (inotifyWatch >= 0) {
+        struct pollfd pfd;
+        pfd.fd = inotifyFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        notified = (poll(&pfd, 1, static_cast<int>(timeoutMs)) > 0);
+
+        // Only the fact that the file changed matters, not the events
+        char events[4096];
+        while (notified && read(inotifyFd, events, sizeof(events)) > 0);
+    } else {
+        usleep(1000*std::min(timeoutMs, 1U));
+    }
 
-    freeBuffers.clear();
+    if (inputFd && good && nextEntryIsComplete())
+        return true;
+
+    // The shards of the runtime may write to the old file for a short while
+    // after a rotation, so only a file that went quiet is let go of.
+    return !notified && reopenRotatedFile() && nextEntryIsComplete();
 }
 
 /**
- * Allocates a BufferFragment to read BufferExtents into
+ * Indicates whether the next entry to be read from inputFd was completely
+ * written to the log file, so that it can be read in one go. The entries
+ * inflated from a CompressedBlock are always complete, as is the block
+ * itself once it can be read.
  *
  * \return
- *      Allocated BufferFragment
+ *      true if the next entry is complete
  */
-Log::Decoder::BufferFragment*
-Log::Decoder::allocateBufferFragment()
+bool
+Log::Decoder::nextEntryIsComplete()
 {
-    if (!freeBuffers.empty()) {
-        BufferFragment *ret = freeBuffers.back();
-        freeBuffers.pop_back();
-        return ret;
+    long position = ftell(inputFd);
+    if (position < 0)
+        return false;
+
+    // Translate the position in the inflated stream to one in the file
+    FILE *file = inputFd;
+    if (blockStream) {
+        if (position < blockStream->inflatedEnd)
+            return true;
+
+        file = blockStream->file;
+        position = ftell(file) - (blockStream->position - position);
     }
 
-    return new BufferFragment();
-}
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size <= position)
+        return false;
 
-/**
- * Internal function to store a BufferFragment on the free list
- *
- * \param bf
- *      BufferFragment to store
- */
-void
-Log::Decoder::freeBufferFragment(BufferFragment *bf)
-{
-    bf->reset();
-    freeBuffers.push_back(bf);
-}
+    char header[std::max(sizeof(Checkpoint), sizeof(CompressedBlock))];
+    ssize_t headerBytes = pread(fileno(file), header, sizeof(header), position);
+    if (headerBytes <= 0)
+        return false;
 
-// BufferFragment constructor
-Log::Decoder::BufferFragment::BufferFragment()
-    : storage()
-    , validBytes(0)
-    , runtimeId(-1)
-    , readPos(nullptr)
-    , endOfBuffer(nullptr)
-    , hasMoreLogs(false)
-    , nextLogId(-1)
-    , nextLogTimestamp(0)
-{
+    uint64_t entryBytes = getEntryBytes(header,
+                                        static_cast<size_t>(headerBytes));
+    return entryBytes > 0 &&
+           static_cast<uint64_t>(st.st_size - position) >= entryBytes;
 }
 
 /**
- * Resets the state of the BufferFragment so that the data cannot be reused
- */
-void
-Log::Decoder::BufferFragment::reset()
-{
-    validBytes = 0;
-    runtimeId = -1;
-    readPos = nullptr;
-    endOfBuffer = nullptr;
-    hasMoreLogs = false;
-}
-/**
- * Read in the next buffer fragment from the compressed log. If an error occurs
- * the file descriptor will be in an undefined state.
- *
- * \param fd
- *      File stream to read it from
- * \param[out] wrapAround
- *      Indicates whether a wrap around was indicated in the log or not.
+ * Moves the Decoder on to a new file at the same path as the log file
+ * followed, if the latter was rotated (i.e. renamed or deleted) and the new
+ * one has been started off with a Checkpoint.
  *
  * \return
- *      indicates whether the operation succeeded (true) or failed due to
- *      a malformed log data.
+ *      true if the Decoder moved on to a new file; false otherwise
  */
 bool
-Log::Decoder::BufferFragment::readBufferExtent(FILE *fd, bool *wrapAround) {
-    validBytes = fread(storage, 1, sizeof(BufferExtent), fd);
-    BufferExtent *be = reinterpret_cast<BufferExtent*>(storage);
-
-    if (be->entryType != EntryType::BUFFER_EXTENT ||
-            validBytes < sizeof(BufferExtent) ||
-            be->length > sizeof(storage)) {
-        reset();
+Log::Decoder::reopenRotatedFile()
+{
+    if (filename.empty())
         return false;
-    }
 
-    assert(be->length >= validBytes);
-    uint64_t remaining = be->length - validBytes;
-    validBytes += fread(storage + validBytes, 1, remaining, fd);
-
-    if (validBytes != be->length) {
-        reset();
+    struct stat named, current;
+    if (stat(filename.c_str(), &named) != 0 || named.st_size == 0)
         return false;
-    }
 
-    readPos = storage + sizeof(BufferExtent);
-    endOfBuffer = storage + validBytes;
+    FILE *file = blockStream ? blockStream->file : inputFd;
+    if (file && fstat(fileno(file), &current) == 0 &&
+            current.st_dev == named.st_dev && current.st_ino == named.st_ino)
+        return false;
 
-    if (be->isShort)
-        runtimeId = be->threadIdOrPackNibble;
-    else
-        runtimeId = BufferUtils::unpack<uint32_t>(
-                                            &readPos, be->threadIdOrPackNibble);
+    // The path is copied since open() only keeps it on success
+    std::string path = filename;
+    if (!open(path.c_str()))
+        return false;
 
-    if (wrapAround)
-        *wrapAround = be->wrapAround;
+    watchFile();
+    return true;
+}
 
-    // The buffer has no log messages, skip it (this may be possible in cases
-    // where we want to mark wrapArounds or the output buffer ran out of space).
-    if (readPos == endOfBuffer) {
-        hasMoreLogs = false;
-        return true;
-    }
+/**
+ * (Re)points the inotify watch at the log file currently open.
+ */
+void
+Log::Decoder::watchFile()
+{
+    if (inotifyFd < 0)
+        return;
 
-    hasMoreLogs = decompressLogHeader(&readPos, 0, nextLogId, nextLogTimestamp);
-    if (!hasMoreLogs)
-        reset();
+    if (inotifyWatch >= 0)
+        inotify_rm_watch(inotifyFd, inotifyWatch);
 
-    return hasMoreLogs;
+    inotifyWatch = inotify_add_watch(inotifyFd, filename.c_str(),
+                                     IN_MODIFY | IN_MOVE_SELF |
+                                     IN_DELETE_SELF | IN_ATTRIB);
 }
 
 /**
- * Helper to decompressNextLogStatement to print a single PrintFragment
- * given an argument and optional width/precision specifiers.
+ * Appends the bytes of a value to a column of a ColumnTable.
  *
- * \tparam T
- *      Type of the argument (automatically inferred)
- * \param outputFd
- *      Where to output the statement
- * \param formatString
- *      Partial format string containing exactly 1 format specifier
- * \param arg
- *      Argument to pass in with the format string
- * \param width
- *      Width parameter of a printf-specifier, a value of -1 specifies none
- * \param precision
- *      precision parameter of a printf-specifier, a value of -1 specifies none
+ * \param column
+ *      Column to append to
+ * \param value
+ *      Value to append
  */
 template<typename T>
 static inline void
-printSingleArg(FILE *outputFd,
-               NanoLogInternal::Log::LogMessage &logArguments,
-               const char* formatString,
-               T arg,
-               int width = -1,
-               int precision = -1)
+appendColumnValue(std::string &column, T value)
+{
+    column.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Indicates whether arguments of a FormatType are stored as strings with
+ * offsets in a ColumnTable rather than as fixed-width values.
+ */
+static inline bool
+isStringColumn(uint8_t argType)
+{
+    return argType == NanoLogInternal::Log::const_char_ptr_t ||
+           argType == NanoLogInternal::Log::const_wchar_t_ptr_t ||
+           argType == NanoLogInternal::Log::user_type_t ||
+           argType == NanoLogInternal::Log::array_t;
+}
+
+/**
+ * Lists the FormatType of each argument pushed into the LogMessages of a
+ * format, i.e. of every PrintFragment that has an argument.
+ *
+ * \param formatMetadata
+ *      FormatMetadata of the format
+ * \param[out] argTypes
+ *      FormatType of each argument, in order
+ */
+static void
+getArgTypes(const void *formatMetadata, std::vector<uint8_t> &argTypes)
 {
-    logArguments.push(arg);
+    using namespace NanoLogInternal::Log;
+    auto *metadata = static_cast<const FormatMetadata*>(formatMetadata);
+    const char *pos = reinterpret_cast<const char*>(metadata)
+                            + sizeof(FormatMetadata)
+                            + metadata->filenameLength;
+
+    argTypes.clear();
+    for (int i = 0; i < metadata->numPrintFragments; ++i) {
+        auto *pf = reinterpret_cast<const PrintFragment*>(pos);
+        if (pf->argType != NONE)
+            argTypes.push_back(pf->argType);
+        pos += sizeof(PrintFragment) + pf->fragmentLength;
+    }
+}
 
-    if (outputFd == nullptr)
+/**
+ * ColumnTable constructor; creates the table file and writes out its header.
+ * The failed member is set if the file could not be written.
+ *
+ * \param path
+ *      Table file to create (any existing file is overwritten)
+ * \param fmtId
+ *      Format id of the log messages to be appended to the table
+ * \param formatMetadata
+ *      FormatMetadata of the format id
+ * \param formatString
+ *      Original format string of the format id
+ */
+Log::Decoder::ColumnTable::ColumnTable(const char *path, uint32_t fmtId,
+                                       const void *formatMetadata,
+                                       const std::string &formatString)
+    : failed(false)
+    , path(path)
+    , argTypes()
+    , numRows(0)
+    , columns()
+    , stringOffsets()
+{
+    auto *metadata = static_cast<const FormatMetadata*>(formatMetadata);
+    getArgTypes(metadata, argTypes);
+
+    columns.resize(2 + argTypes.size());
+    stringOffsets.resize(columns.size());
+
+    ColumnTableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "NLCOLS1", sizeof(header.magic));
+    header.fmtId = fmtId;
+    header.lineNumber = metadata->lineNumber;
+    header.logLevel = metadata->logLevel;
+    header.filenameLength = metadata->filenameLength;
+    header.formatStringLength = static_cast<uint32_t>(formatString.size() + 1);
+    header.numArgColumns = static_cast<uint16_t>(argTypes.size());
+
+    FILE *fd = fopen(path, "wb");
+    if (fd == nullptr) {
+        fprintf(stderr, "Could not create the table %s: %s\r\n",
+                path, strerror(errno));
+        failed = true;
         return;
+    }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-security"
-#pragma GCC diagnostic ignored "-Wformat-nonliteral"
-
-    if (width < 0 && precision < 0) {
-        fprintf(outputFd, formatString, arg);
-    } else if (width >= 0 && precision < 0)
-        fprintf(outputFd, formatString, width, arg);
-    else if (width >= 0 && precision >= 0)
-        fprintf(outputFd, formatString, width, precision, arg);
-    else
-        fprintf(outputFd, formatString, precision, arg);
+    fwrite(&header, 1, sizeof(header), fd);
+    fwrite(metadata->filename, 1, metadata->filenameLength, fd);
+    fwrite(formatString.c_str(), 1, formatString.size() + 1, fd);
+
+    // User-defined types and arrays are stored as the text they're rendered
+    // into, so readers see them as %s arguments
+    for (uint8_t argType : argTypes) {
+        uint8_t columnType = (argType == user_type_t || argType == array_t)
+                                ? static_cast<uint8_t>(const_char_ptr_t)
+                                : argType;
+        fputc(columnType, fd);
+    }
 
-#pragma GCC diagnostic pop
+    if (ferror(fd) | fclose(fd)) {
+        fprintf(stderr, "Could not write the table %s: %s\r\n",
+                path, strerror(errno));
+        failed = true;
+    }
 }
 
 /**
- * Attempt to read back the next log statement contained in the BufferFragment,
- * output the original log message to outputFd, and if applicable, run an
- * aggregation function on the log message.
- *
- * The aggregation function should take in the same arguments as the original
- * invocation of NANO_LOG. For example, NANO_LOG("The number is %d." num) should
- * have the function signature of (const char *fmtString, int num).
+ * Appends a row for a log message to the ColumnTable, writing the rows
+ * buffered out to the table file once there are ROWS_PER_ROW_GROUP of them.
  *
- * \param outputFd
- *      File descriptor to output the log messages to
- * \param[in/out] logMsgsProccessed
- *      The number of log messages processed
- * \param lastTimestamp
- *      The timestamp of the last log message to be outputted (this is used
- *      to print time differences).
- * \param checkpoint
- *      The checkpoint containing rdtsc-to-time mapping this function should use
- * \param aggregationFilterId
- *      The logId to target running aggregationFn on
- * \param aggregationFn
- *      This is an aggregation function that can be passed to any log messages
- *      matching aggregationFilterId. This function accepts the same parameters
- *      as the original log statement.
+ * \param logMsg
+ *      Log message of the table's format id to append
+ * \param timestamp
+ *      Wall time of the log message in nanoseconds since the epoch
+ * \param runtimeId
+ *      Runtime thread/StagingBuffer id that logged the message
  *
  * \return
- *      true indicates the operation sucessfully; false indicates that either
- *      we reached the end of the file or the file is corrupt.
+ *      true if successful; false if the table could not be written
  */
 bool
-Log::Decoder::BufferFragment::decompressNextLogStatement(FILE *outputFd,
-                                        uint64_t &logMsgsProcessed,
-                                        LogMessage &logArgs,
-                                        const Checkpoint &checkpoint,
-                                        std::vector<void*>& fmtId2metadata,
-                                        long aggregationFilterId,
-                                        void (*aggregationFn)(const char*, ...))
+Log::Decoder::ColumnTable::append(LogMessage &logMsg, int64_t timestamp,
+                                  uint32_t runtimeId)
 {
-    double secondsSinceCheckpoint, nanos = 0.0;
-    char timeString[32];
+    if (failed)
+        return false;
 
-    if (readPos > endOfBuffer || !hasMoreLogs) {
-        hasMoreLogs = false;
+    if (logMsg.getNumArgs() != static_cast<int>(argTypes.size())) {
+        fprintf(stderr, "Internal Error: Log message has %d arguments, but "
+                        "the table %s has %lu argument columns\r\n",
+                logMsg.getNumArgs(), path.c_str(), argTypes.size());
+        failed = true;
         return false;
     }
 
-    // no need to format the time if we're not going to output
-    if (outputFd) {
-    // Convert to relative time
-//        double timeDiff;
-//        if (nextLogTimestamp >= lastTimestamp)
-//            timeDiff = 1.0e9*PerfUtils::Cycles::toSeconds(
-//                                    nextLogTimestamp - lastTimestamp,
-//                                    checkpoint.cyclesPerSecond));
-//        else
-//            timeDiff = -1.0e9*PerfUtils::Cycles::toSeconds(
-//                                    lastTimestamp - nextLogTimestamp,
-//                                    checkpoint.cyclesPerSecond));
-//        if (logMsgsProcessed == 0)
-//            timeDiff = 0;
-//
-//        fprintf(outputFd, "%4ld) +%12.2lf ns ", logMsgsProcessed, timeDiff);
+    appendColumnValue(columns[0], timestamp);
+    appendColumnValue(columns[1], runtimeId);
 
-        // Convert to absolute time
-        secondsSinceCheckpoint = PerfUtils::Cycles::toSeconds(
-                                            nextLogTimestamp - checkpoint.rdtsc,
-                                            checkpoint.cyclesPerSecond);
-        int64_t wholeSeconds = static_cast<int64_t>(secondsSinceCheckpoint);
-        nanos = 1.0e9 * (secondsSinceCheckpoint
-                                - static_cast<double>(wholeSeconds));
-        std::time_t absTime = wholeSeconds + checkpoint.unixTime;
-        std::tm *tm = localtime(&absTime);
-        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", tm);
-    }
+    for (size_t i = 0; i < argTypes.size(); ++i) {
+        std::string &column = columns[i + 2];
+        int arg = static_cast<int>(i);
 
-    if (fmtId2metadata.empty() || aggregationFn != nullptr) {
-        // Output the context
-        struct GeneratedFunctions::LogMetadata meta =
-                                GeneratedFunctions::logId2Metadata[nextLogId];
-        if (outputFd) {
-            fprintf(outputFd,"%s.%09.0lf %s:%u %s[%u]: "
-                    , timeString
-                    , nanos
-                    , meta.fileName
-                    , meta.lineNumber
-                    , logLevelNames[meta.logLevel]
-                    , runtimeId);
-        }
+        switch (argTypes[i]) {
+            case unsigned_char_t:
+                appendColumnValue(column, logMsg.get<unsigned char>(arg));
+                break;
 
-        void (*aggFn)(const char*, ...) = nullptr;
-        if (aggregationFilterId == nextLogId)
-            aggFn = aggregationFn;
+            case unsigned_short_int_t:
+                appendColumnValue(column, logMsg.get<unsigned short int>(arg));
+                break;
 
-        if (nextLogId >= GeneratedFunctions::numLogIds) {
-            fprintf(stderr, "Log message id=%u not found in the generated "
-                            "functions list for Preprocessor NanoLog.\r\n"
-                            "This indicates either a corrupt log file or "
-                            "a mismatched decompressor as we only have %lu "
-                            "generated functions\r\n"
-                            , nextLogId
-                            , GeneratedFunctions::numLogIds);
-            return false;
-        }
+            case unsigned_int_t:
+                appendColumnValue(column, logMsg.get<unsigned int>(arg));
+                break;
 
-        GeneratedFunctions::decompressAndPrintFnArray[nextLogId](&readPos,
-                                                                 outputFd,
-                                                                 aggFn);
-    } else {
-        using namespace BufferUtils;
-        auto *metadata = reinterpret_cast<FormatMetadata*>(
-                                            fmtId2metadata.at(nextLogId));
+            case unsigned_long_int_t:
+                appendColumnValue(column, logMsg.get<unsigned long int>(arg));
+                break;
 
-        const char *filename = metadata->filename;
-        const char *logLevel = logLevelNames[metadata->logLevel];
+            case unsigned_long_long_int_t:
+                appendColumnValue(column,
+                                  logMsg.get<unsigned long long int>(arg));
+                break;
 
-        logArgs.reset(metadata, nextLogId, nextLogTimestamp);
+            case uintmax_t_t:
+                appendColumnValue(column, logMsg.get<uintmax_t>(arg));
+                break;
 
-        // Output the context
-        if (outputFd) {
-            fprintf(outputFd,"%s.%09.0lf %s:%u %s[%u]: "
-                    , timeString
-                    , nanos
-                    , filename
-                    , metadata->lineNumber
-                    , logLevel
-                    , runtimeId);
-        }
+            case size_t_t:
+                appendColumnValue(column, logMsg.get<size_t>(arg));
+                break;
 
-        // Print out the actual log message, piece by piece
-        PrintFragment *pf = reinterpret_cast<PrintFragment*>(
-                reinterpret_cast<char*>(metadata)
-                + sizeof(FormatMetadata)
-                + metadata->filenameLength);
+            case wint_t_t:
+                appendColumnValue(column, logMsg.get<wint_t>(arg));
+                break;
 
-        Nibbler nb(readPos, metadata->numNibbles);
-        const char *nextStringArg = nb.getEndOfPackedArguments();
+            case signed_char_t:
+                appendColumnValue(column, logMsg.get<signed char>(arg));
+                break;
 
-        // TODO(syang0) We can probably skip processing the log message at
-        // if we (a) aren't printing and (b) aren't aggregating
-        for (int i = 0; i < metadata->numPrintFragments; ++i) {
-            const wchar_t *wstrArg;
+            case short_int_t:
+                appendColumnValue(column, logMsg.get<short int>(arg));
+                break;
 
-            int width = -1;
-            if (pf->hasDynamicWidth)
-                width = nb.getNext<int>();
+            case int_t:
+                appendColumnValue(column, logMsg.get<int>(arg));
+                break;
 
-            int precision = -1;
-            if (pf->hasDynamicPrecision)
-                precision = nb.getNext<int>();
+            case long_int_t:
+                appendColumnValue(column, logMsg.get<long int>(arg));
+                break;
 
-            switch(pf->argType) {
-                case NONE:
+            case long_long_int_t:
+                appendColumnValue(column, logMsg.get<long long int>(arg));
+                break;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-security"
-#pragma GCC diagnostic ignored "-Wformat-nonliteral"
-                    if (outputFd)
-                        fprintf(outputFd, pf->formatFragment);
-#pragma GCC diagnostic pop
-                    break;
+            case intmax_t_t:
+                appendColumnValue(column, logMsg.get<intmax_t>(arg));
+                break;
 
-                case unsigned_char_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<unsigned char>(),
-                                   width, precision);
-                    break;
+            case ptrdiff_t_t:
+                appendColumnValue(column, logMsg.get<ptrdiff_t>(arg));
+                break;
 
-                case unsigned_short_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<unsigned short int>(),
-                                   width, precision);
-                    break;
+            case double_t:
+                appendColumnValue(column, logMsg.get<double>(arg));
+                break;
 
-                case unsigned_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<unsigned int>(),
-                                   width, precision);
-                    break;
+            case const_void_ptr_t:
+                appendColumnValue(column, logMsg.get<const void*>(arg));
+                break;
 
-                case unsigned_long_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<unsigned long int>(),
-                                   width, precision);
-                    break;
+            case const_char_ptr_t:
+                column.append(logMsg.get<const char*>(arg));
+                stringOffsets[i + 2].push_back(column.size());
+                break;
 
-                case unsigned_long_long_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<unsigned long long int>(),
-                                   width, precision);
-                    break;
+            case user_type_t:
+                formatUserType(logMsg.get<const char*>(arg), column);
+                stringOffsets[i + 2].push_back(column.size());
+                break;
 
-                case uintmax_t_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<uintmax_t>(),
-                                   width, precision);
-                    break;
+            case array_t:
+                formatArray(logMsg.get<const char*>(arg), column);
+                stringOffsets[i + 2].push_back(column.size());
+                break;
 
-                case size_t_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<size_t>(),
-                                   width, precision);
-                    break;
+            case const_wchar_t_ptr_t:
+            {
+                const wchar_t *wstr = logMsg.get<const wchar_t*>(arg);
+                column.append(reinterpret_cast<const char*>(wstr),
+                              wcslen(wstr)*sizeof(wchar_t));
+                stringOffsets[i + 2].push_back(column.size());
+                break;
+            }
 
-                case wint_t_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<wint_t>(),
-                                   width, precision);
-                    break;
+            // LogMessage does not retain long doubles
+            case long_double_t:
+            default:
+                break;
+        }
+    }
 
-                case signed_char_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<signed char>(),
-                                   width, precision);
-                    break;
+    if (++numRows >= ROWS_PER_ROW_GROUP)
+        return flush();
 
-                case short_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<short int>(),
-                                   width, precision);
-                    break;
+    return true;
+}
 
-                case int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<int>(),
-                                   width, precision);
-                    break;
+/**
+ * Appends the rows buffered in the ColumnTable to the table file as a
+ * ColumnRowGroup.
+ *
+ * \return
+ *      true if successful; false if the table could not be written
+ */
+bool
+Log::Decoder::ColumnTable::flush()
+{
+    if (failed)
+        return false;
 
-                case long_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<long int>(),
-                                   width, precision);
-                    break;
+    if (numRows == 0)
+        return true;
+
+    std::vector<uint64_t> columnBytes;
+    ColumnRowGroup group;
+    group.numRows = numRows;
+    group.bytes = sizeof(uint64_t)*columns.size();
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        uint64_t bytes = columns[i].size();
+        if (i >= 2 && isStringColumn(argTypes[i - 2]))
+            bytes += sizeof(uint64_t)*(numRows + 1);
+
+        columnBytes.push_back(bytes);
+        group.bytes += bytes;
+    }
+
+    FILE *fd = fopen(path.c_str(), "ab");
+    if (fd == nullptr) {
+        fprintf(stderr, "Could not open the table %s: %s\r\n",
+                path.c_str(), strerror(errno));
+        failed = true;
+        return false;
+    }
+
+    fwrite(&group, 1, sizeof(group), fd);
+    fwrite(columnBytes.data(), sizeof(uint64_t), columnBytes.size(), fd);
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (i >= 2 && isStringColumn(argTypes[i - 2])) {
+            uint64_t firstOffset = 0;
+            fwrite(&firstOffset, sizeof(uint64_t), 1, fd);
+            fwrite(stringOffsets[i].data(), sizeof(uint64_t),
+                   stringOffsets[i].size(), fd);
+            stringOffsets[i].clear();
+        }
+
+        fwrite(columns[i].data(), 1, columns[i].size(), fd);
+        columns[i].clear();
+    }
+
+    numRows = 0;
+    if (ferror(fd) | fclose(fd)) {
+        fprintf(stderr, "Could not write the table %s: %s\r\n",
+                path.c_str(), strerror(errno));
+        failed = true;
+    }
+
+    return !failed;
+}
+
+/**
+ * Exports the log messages in the file open()-ed as tables of typed columns
+ * rather than text, so that analyses don't have to parse the arguments back
+ * out of the human-readable format. One table (see ColumnTableHeader) is
+ * written per format id and execution in the log file, named
+ * "<outputDir>/<execution>_<fmtId>.nlcol" where execution counts the times
+ * the log file was appended to from 0. The rows of a table are in the order
+ * the log messages appear in the log file, which may not be chronological.
+ *
+ * Only log files from C++17 NanoLog can be exported since those of
+ * Preprocessor NanoLog do not contain the dictionary needed to identify
+ * the argument types.
+ *
+ * \param outputDir
+ *      Directory to write the tables to; it is created if it does not exist
+ *
+ * \return
+ *      The number of log messages exported; a negative value indicates error
+ */
+int64_t
+Log::Decoder::exportColumns(const char *outputDir)
+{
+    if (mkdir(outputDir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create the output directory %s: %s\r\n",
+                outputDir, strerror(errno));
+        return -1;
+    }
+
+    std::vector<std::unique_ptr<ColumnTable>> tables;
+    uint32_t execution = numCheckpointsRead;
+    int64_t logMsgsExported = 0;
+    bool success = true;
+    LogMessage logMsg;
+
+    while (success && getNextLogStatement(logMsg)) {
+        if (!logMsg.valid()) {
+            fprintf(stderr, "Only log files produced by C++17 NanoLog can be "
+                            "exported\r\n");
+            success = false;
+            break;
+        }
 
-                case long_long_int_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<long long int>(),
-                                   width, precision);
-                    break;
+        // Format ids restart with each execution appended to the log file
+        if (numCheckpointsRead != execution) {
+            for (auto &table : tables) {
+                if (table && !table->flush())
+                    success = false;
+            }
 
-                case intmax_t_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<intmax_t>(),
-                                   width, precision);
-                    break;
+            tables.clear();
+            execution = numCheckpointsRead;
+        }
 
-                case ptrdiff_t_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<ptrdiff_t>(),
-                                   width, precision);
-                    break;
+        uint32_t fmtId = logMsg.getLogId();
+        if (fmtId >= tables.size())
+            tables.resize(fmtId + 1);
+
+        if (!tables[fmtId]) {
+            std::string path = std::string(outputDir) + "/"
+                                + std::to_string(execution - 1) + "_"
+                                + std::to_string(fmtId) + ".nlcol";
+            tables[fmtId].reset(new ColumnTable(path.c_str(), fmtId,
+                                                fmtId2metadata.at(fmtId),
+                                                fmtId2fmtString.at(fmtId)));
+        }
 
-                case double_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<double>(),
-                                   width, precision);
-                    break;
+        int64_t timestamp = wallClock.toNanos(logMsg.getTimestamp());
 
-                case long_double_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<long double>(),
-                                   width, precision);
-                    break;
+        if (success && tables[fmtId]->append(logMsg, timestamp,
+                                             bufferFragment->runtimeId))
+            ++logMsgsExported;
+        else
+            success = false;
+    }
 
-                case const_void_ptr_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nb.getNext<const void *>(),
-                                   width, precision);
-                    break;
+    for (auto &table : tables) {
+        if (table && !table->flush())
+            success = false;
+    }
 
-                // The next two are strings, so handle it accordingly.
-                case const_char_ptr_t:
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   nextStringArg,
-                                   width, precision);
+    return (success) ? logMsgsExported : -1;
+}
 
-                    nextStringArg += strlen(nextStringArg) + 1; // +1 for NULL
-                    break;
+/**
+ * Exports the log messages in the file open()-ed as a trace in the JSON
+ * format of the Chrome trace viewer, which Perfetto (ui.perfetto.dev) and
+ * chrome://tracing can open. Each execution in the log file is a process
+ * and each runtime thread a thread track in it, on which the log messages
+ * are instant events named by their format string, with the formatted
+ * message in the event's arguments.
+ *
+ * The records of PerfUtils::TimeTrace that NanoLog::routeTimeTrace() logged
+ * become slices instead, spanning the time since the thread's previous
+ * record (as TimeTrace::print() reports them), and the DroppedLogs markers
+ * become instant events marking where log messages were lost.
+ *
+ * Only log files from C++17 NanoLog can be exported since those of
+ * Preprocessor NanoLog do not contain the dictionary needed to read the
+ * TimeTrace records' arguments back.
+ *
+ * \param outputFd
+ *      File to write the trace to
+ *
+ * \return
+ *      The number of log messages exported; a negative value indicates error
+ */
+int64_t
+Log::Decoder::exportTrace(FILE *outputFd)
+{
+    std::string text;
+    cookie_io_functions_t functions = {nullptr, &appendToString,
+                                       nullptr, nullptr};
+    FILE *textFd = fopencookie(&text, "w", functions);
+    if (textFd == nullptr) {
+        perror("Could not set up the export of the trace");
+        return -1;
+    }
+    setvbuf(textFd, nullptr, _IONBF, 0);
+
+    // Tracks are named by metadata events the first time they're used
+    uint32_t execution = 0;
+    std::set<uint32_t> namedThreads;
+
+    // Wall time of the previous TimeTrace record on each thread
+    std::unordered_map<uint32_t, int64_t> lastRecords;
+
+    const char executionMarker[] = "\r\n# New execution started\r\n";
+    int64_t logMsgsExported = 0;
+    bool success = true;
+    LogMessage logMsg;
+    std::string event;
+
+    traceFd = outputFd;
+    numTraceEvents = 0;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", outputFd);
+
+    while (getNextLogStatement(logMsg, textFd)) {
+        if (!logMsg.valid()) {
+            fprintf(stderr, "Only log files produced by C++17 NanoLog can be "
+                            "exported\r\n");
+            success = false;
+            break;
+        }
 
-                case const_wchar_t_ptr_t:
+        uint32_t tid = bufferFragment->runtimeId;
+        if (numCheckpointsRead != execution) {
+            execution = numCheckpointsRead;
+            namedThreads.clear();
+            lastRecords.clear();
+
+            event.clear();
+            appendPrintf(event, "{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+                         "\"name\":\"process_name\",\"args\":{\"name\":"
+                         "\"Execution %u\"}}", execution, tid, execution);
+            writeTraceEvent(event);
+        }
 
-                    /**
-                     * I've occasionally encountered the following assertion:
-                     * __wcsrtombs: Assertion `data.__outbuf[-1] == '\0'' failed
-                     *
-                     * I don't know why this occurs, but it appears to be caused
-                     * by a wcslen() call deep inside printf returning the wrong
-                     * value when called on the dynamic buffer. I've found
-                     * that copying the data into a stack buffer first fixes
-                     * the problem (not implemented here).
-                     *
-                     * I don't know why this is the case and I'm inclined to
-                     * believe it's a problem with the library because I've...
-                     *  (1) verified byte by byte that the copied wchar_t
-                     *      strings and the surrounding bytes are exactly the
-                     *      same in the dynamic and stack allocated buffers.
-                     *  (2) copied the wcslen code from the glib sources into
-                     *      to this file and calling it on the dynamic buffer
-                     *      works, but the public wcslen() API still returns an
-                     *      incorrect value.
-                     *  (3) verified that no corruption occurs in the buffers
-                     *      before and after the wcslen() returns the wrong val
-                     *
-                     * If wide character support becomes important and this
-                     * assertion keeps erroring out, I would work around it
-                     * by copying the wide string into a stack buffer before
-                     * passing it to printf.
-                     */
-                    wstrArg = reinterpret_cast<const wchar_t *>(nextStringArg);
-                    printSingleArg(outputFd,
-                                   logArgs,
-                                   pf->formatFragment,
-                                   wstrArg,
-                                   width, precision);
-                    // +1 for NULL
-                    nextStringArg += (wcslen(wstrArg) + 1) * sizeof(wchar_t);
-                    break;
+        if (namedThreads.insert(tid).second) {
+            event.clear();
+            appendPrintf(event, "{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+                         "\"name\":\"thread_name\",\"args\":{\"name\":"
+                         "\"Thread %u\"}}", execution, tid, tid);
+            writeTraceEvent(event);
+        }
 
-                case MAX_FORMAT_TYPE:
-                default:
-                    fprintf(outputFd,
-                            "Error: Corrupt log header in header file\r\n");
-                    exit(-1);
+        uint32_t fmtId = logMsg.getLogId();
+        const std::string &format = fmtId2fmtString.at(fmtId);
+        event.clear();
+
+        if (format == NANO_LOG_TIME_TRACE_FORMAT) {
+            std::string message;
+            appendPrintf(message, logMsg.get<const char*>(0),
+                         logMsg.get<unsigned int>(2),
+                         logMsg.get<unsigned int>(3),
+                         logMsg.get<unsigned int>(4),
+                         logMsg.get<unsigned int>(5));
+            int64_t nanos = wallClock.toNanos(logMsg.get<unsigned long>(1));
+
+            auto last = lastRecords.find(tid);
+            if (last == lastRecords.end()) {
+                appendTraceEventStart(event, "i", execution, tid, nanos);
+                event.append(",\"s\":\"t\"");
+            } else {
+                int64_t duration = std::max<int64_t>(nanos - last->second, 0);
+                appendTraceEventStart(event, "X", execution, tid,
+                                      nanos - duration);
+                appendPrintf(event, ",\"dur\":%ld.%03ld", duration/1000,
+                             duration%1000);
             }
 
-            pf = reinterpret_cast<PrintFragment*>(
-                    reinterpret_cast<char*>(pf)
-                    + pf->fragmentLength
-                    + sizeof(PrintFragment));
+            event.append(",\"cat\":\"TimeTrace\",\"name\":");
+            appendJsonString(event, message.data(), message.size());
+            event.push_back('}');
+            lastRecords[tid] = nanos;
+        } else {
+            // The text printed is "[<executionMarker>]<header>]: <message>"
+            size_t start = 0;
+            if (text.compare(0, sizeof(executionMarker) - 1,
+                             executionMarker) == 0)
+                start = sizeof(executionMarker) - 1;
+
+            start = text.find("]: ", start);
+            start = (start == std::string::npos) ? text.size() : start + 3;
+
+            size_t end = text.size();
+            if (end >= start + 2 && text.compare(end - 2, 2, "\r\n") == 0)
+                end -= 2;
+
+            int64_t nanos = wallClock.toNanos(logMsg.getTimestamp());
+            appendTraceEventStart(event, "i", execution, tid, nanos);
+            event.append(",\"s\":\"t\",\"cat\":\"NanoLog\",\"name\":");
+            appendJsonString(event, format.data(), format.size());
+            event.append(",\"args\":{\"message\":");
+            appendJsonString(event, text.data() + start, end - start);
+            appendPrintf(event, ",\"logId\":%u}}", fmtId);
         }
 
-        if (outputFd)
-            fprintf(outputFd, "\r\n");
-        // We're done, advance the pointer to the end of the last string
-        readPos = nextStringArg;
+        writeTraceEvent(event);
+        ++logMsgsExported;
+        text.clear();
     }
 
-    logMsgsProcessed++;
+    fputs("\n]}\n", outputFd);
+    traceFd = nullptr;
+    fclose(textFd);
 
-    if (readPos >= endOfBuffer)
-        hasMoreLogs = false;
-    else
-        hasMoreLogs = decompressLogHeader(&readPos, nextLogTimestamp,
-                                          nextLogId, nextLogTimestamp);
+    if (ferror(outputFd))
+        success = false;
 
-    return true;
+    return (success) ? logMsgsExported : -1;
 }
 
 /**
- * Whether one can invoke decompressNextLogStatement or not
+ * Arguments of user-defined types (see NanoLog::Serializer) and arrays (see
+ * NanoLog::array()) as visitArgument() passes them to visitors, i.e. as
+ * they're stored in the compressed log.
  */
-bool
-Log::Decoder::BufferFragment::hasNext() {
-    return hasMoreLogs;
-}
+struct UserTypeArgument {
+    const char *encoded;
+};
 
-/**
- * Return the timestamp of the next log message that can be outputted. It is
- * the responsibility of the caller to ensure that the BufferFragment contains
- * a next log message (i.e. if decompressNextLogStatement returns true).
- */
-uint64_t
-Log::Decoder::BufferFragment::getNextLogTimestamp() const
-{
-    assert(readPos <= endOfBuffer && validBytes > 0);
-    return nextLogTimestamp;
-}
+struct ArrayArgument {
+    const char *encoded;
+};
 
 /**
- * Decompress the log file that was open()-ed and print the message out in
- * an arbitrary order (i.e. dependent on runtime implementation and not
- * necessarily in chronological order).
+ * Invokes a visitor with the n-th argument of a LogMessage read as the C++
+ * type of its FormatType.
  *
- * \param outputFd
- *      The file descriptor to print the log messages to
- * \param aggregationTargetId
- *      Target logId to run the aggregation function on
- * \param aggregationFn
- *      Aggregation function to run on targetId. The signature of the function
- *      should be the same as the original NANO_LOG invocation that created
- *      the log message. For example,
- *          NANO_LOG("number %d, string %s, float %f", num, str, flo)
- *      should have the signature
- *          aggregation(const char*, int, const char*, float)
+ * \param logMsg
+ *      Log message to read the argument of
+ * \param arg
+ *      Index of the argument (0-based)
+ * \param argType
+ *      FormatType of the argument
+ * \param visitor
+ *      Callable taking any integer, double, pointer or string argument as
+ *      well as UserTypeArgument and ArrayArgument
  *
  * \return
- *      true indicates the operation succeeded without problems.
- *      false indicates that there was an error and an incomplete log was
- *      outputted to outputFd;
+ *      The result of the visitor; false if the argument was not retained by
+ *      the LogMessage (i.e. a long double)
  */
-bool
-Log::Decoder::internalDecompressUnordered(FILE* outputFd,
-                                        uint32_t aggregationTargetId,
-                                        void(*aggregationFn)(const char*,...))
+template<typename Visitor>
+static bool
+visitArgument(NanoLogInternal::Log::LogMessage &logMsg, int arg,
+              uint8_t argType, Visitor &visitor)
 {
-    if (filename.empty() || !inputFd)
-       return false;
+    using namespace NanoLogInternal::Log;
+    switch (argType) {
+        case unsigned_char_t:
+            return visitor(logMsg.get<unsigned char>(arg));
+        case unsigned_short_int_t:
+            return visitor(logMsg.get<unsigned short int>(arg));
+        case unsigned_int_t:
+            return visitor(logMsg.get<unsigned int>(arg));
+        case unsigned_long_int_t:
+            return visitor(logMsg.get<unsigned long int>(arg));
+        case unsigned_long_long_int_t:
+            return visitor(logMsg.get<unsigned long long int>(arg));
+        case uintmax_t_t:
+            return visitor(logMsg.get<uintmax_t>(arg));
+        case size_t_t:
+            return visitor(logMsg.get<size_t>(arg));
+        case wint_t_t:
+            return visitor(logMsg.get<wint_t>(arg));
+        case signed_char_t:
+            return visitor(logMsg.get<signed char>(arg));
+        case short_int_t:
+            return visitor(logMsg.get<short int>(arg));
+        case int_t:
+            return visitor(logMsg.get<int>(arg));
+        case long_int_t:
+            return visitor(logMsg.get<long int>(arg));
+        case long_long_int_t:
+            return visitor(logMsg.get<long long int>(arg));
+        case intmax_t_t:
+            return visitor(logMsg.get<intmax_t>(arg));
+        case ptrdiff_t_t:
+            return visitor(logMsg.get<ptrdiff_t>(arg));
+        case double_t:
+            return visitor(logMsg.get<double>(arg));
+        case const_void_ptr_t:
+            return visitor(logMsg.get<const void*>(arg));
+        case const_char_ptr_t:
+            return visitor(logMsg.get<const char*>(arg));
+        case const_wchar_t_ptr_t:
+            return visitor(logMsg.get<const wchar_t*>(arg));
+        case user_type_t:
+            return visitor(UserTypeArgument{logMsg.get<const char*>(arg)});
+        case array_t:
+            return visitor(ArrayArgument{logMsg.get<const char*>(arg)});
+
+        // LogMessage does not retain long doubles
+        case long_double_t:
+        default:
+            return false;
+    }
+}
 
-    LogMessage logArguments;
-    BufferFragment *bf = allocateBufferFragment();
-    while(!feof(inputFd) && good) {
-        bool wrapAround = false;
+/**
+ * Argument visitor that reads numeric arguments as doubles to be aggregated;
+ * pointers and strings are rejected.
+ */
+struct ArgumentValue {
+    double value = 0;
 
-        EntryType entry = peekEntryType(inputFd);
-        switch (entry) {
-            case EntryType::BUFFER_EXTENT:
-            {
-                if (!bf->readBufferExtent(inputFd, &wrapAround)){
-                    fprintf(stderr,
-                            "Internal Error: Corrupted BufferExtent\r\n");
-                    break;
-                }
+    template<typename T>
+    bool operator()(T arg) {
+        value = static_cast<double>(arg);
+        return true;
+    }
 
-                ++numBufferFragmentsRead;
-                while (bf->hasNext()) {
-                    bf->decompressNextLogStatement(outputFd,
-                                                    logMsgsPrinted,
-                                                    logArguments,
-                                                    checkpoint,
-                                                    fmtId2metadata,
-                                                    aggregationTargetId,
-                                                    aggregationFn);
-                }
-                break;
-            }
-            case EntryType::CHECKPOINT:
-                if (!readDictionary(inputFd, true))
-                    good = false;
-                else if (outputFd)
-                    fprintf(outputFd, "\r\n# New execution started\r\n");
+    bool operator()(const void*) { return false; }
+    bool operator()(const char*) { return false; }
+    bool operator()(const wchar_t*) { return false; }
+    bool operator()(UserTypeArgument) { return false; }
+    bool operator()(ArrayArgument) { return false; }
+};
 
-                break;
-            case EntryType::LOG_MSGS_OR_DIC:
-                good = readDictionaryFragment(inputFd);
-                break;
-            case EntryType::INVALID:
-                // Consume whitespace
-                while (!feof(inputFd) && peekEntryType(inputFd) == INVALID)
-                    fgetc(inputFd);
-                break;
+/**
+ * Argument visitor that appends a binary encoding of arguments to the key
+ * of an Aggregation group. Integers are widened so that the same value
+ * logged with different integer types falls into the same group.
+ */
+struct ArgumentKey {
+    std::string &key;
+
+    explicit ArgumentKey(std::string &key) : key(key) {}
+
+    template<typename T>
+    bool operator()(T arg) {
+        if (std::is_signed<T>::value) {
+            key.push_back('i');
+            appendColumnValue(key, static_cast<int64_t>(arg));
+        } else {
+            key.push_back('u');
+            appendColumnValue(key, static_cast<uint64_t>(arg));
         }
+        return true;
     }
 
-    if (outputFd)
-        fprintf(outputFd, "\r\n\r\n# Decompression Complete after printing "
-                            "%lu log messages\r\n", logMsgsPrinted);
+    bool operator()(double arg) {
+        key.push_back('d');
+        appendColumnValue(key, arg);
+        return true;
+    }
 
-    freeBufferFragment(bf);
-    return good;
+    bool operator()(const void *arg) {
+        key.push_back('p');
+        appendColumnValue(key, arg);
+        return true;
+    }
+
+    bool operator()(const char *arg) {
+        key.push_back('s');
+        key.append(arg, strlen(arg) + 1);
+        return true;
+    }
+
+    bool operator()(UserTypeArgument arg) {
+        key.push_back('t');
+        key.append(arg.encoded, strlen(arg.encoded) + 1);
+        return true;
+    }
+
+    bool operator()(ArrayArgument arg) {
+        key.push_back('a');
+        key.append(arg.encoded, Log::Decoder::getArrayLength(arg.encoded));
+        return true;
+    }
+
+    bool operator()(const wchar_t *arg) {
+        key.push_back('w');
+        key.append(reinterpret_cast<const char*>(arg),
+                   (wcslen(arg) + 1)*sizeof(wchar_t));
+        return true;
+    }
+};
+
+/**
+ * Argument visitor that formats arguments as the human-readable key values
+ * of an Aggregation group.
+ */
+struct ArgumentText {
+    ArgumentText()
+        : text()
+    {}
+
+    std::string text;
+
+    template<typename T>
+    bool operator()(T arg) {
+        if (std::is_signed<T>::value)
+            appendPrintf(text, "%lld", static_cast<long long int>(arg));
+        else
+            appendPrintf(text, "%llu", static_cast<unsigned long long>(arg));
+        return true;
+    }
+
+    bool operator()(double arg) {
+        appendPrintf(text, "%.15g", arg);
+        return true;
+    }
+
+    bool operator()(const void *arg) {
+        appendPrintf(text, "%p", arg);
+        return true;
+    }
+
+    bool operator()(const char *arg) {
+        text.append(arg);
+        return true;
+    }
+
+    bool operator()(UserTypeArgument arg) {
+        Log::Decoder::formatUserType(arg.encoded, text);
+        return true;
+    }
+
+    bool operator()(ArrayArgument arg) {
+        Log::Decoder::formatArray(arg.encoded, text);
+        return true;
+    }
+
+    bool operator()(const wchar_t *arg) {
+        appendPrintf(text, "%ls", arg);
+        return true;
+    }
+};
+
+/**
+ * Skips over whitespace and then a word in a query if the word is next.
+ * Words ending in a letter or digit must not be followed by another one.
+ *
+ * \param pos
+ *      Position in the query; moved past the word if it was next
+ * \param word
+ *      Word to consume (case sensitive)
+ *
+ * \return
+ *      true if the word was consumed; false otherwise
+ */
+static bool
+consumeWord(const char *&pos, const char *word)
+{
+    const char *next = pos;
+    while (isspace(*next))
+        ++next;
+
+    size_t length = strlen(word);
+    if (strncmp(next, word, length) != 0)
+        return false;
+
+    if (isalnum(word[length - 1]) && isalnum(next[length]))
+        return false;
+
+    pos = next + length;
+    return true;
 }
 
-
 /**
- * Compares two BufferFragments (a, b) based on the timestamps of
- * their next decompress-able log statements. Returns true if
- * a's timestamp chronologically occurs after b's timestamp.
+ * Consumes an argument reference of the form "arg[<n>]" in a query.
  *
- * \param a
- *      First BufferFragment to compare
- * \param b
- *      Second BufferFragment to compare
+ * \param pos
+ *      Position in the query; moved past the reference if it was next
+ * \param[out] arg
+ *      Index of the argument referenced
  *
  * \return
- *      True if a > b; False otherwise
+ *      true if an argument reference was consumed; false otherwise
  */
-bool
-Log::Decoder::compareBufferFragments(const BufferFragment *a,
-                                     const BufferFragment *b)
+static bool
+consumeArgument(const char *&pos, int *arg)
 {
-    return a->getNextLogTimestamp() > b->getNextLogTimestamp();
-};
+    const char *next = pos;
+    if (!consumeWord(next, "arg[") || !isdigit(*next))
+        return false;
+
+    char *end;
+    long index = strtol(next, &end, 10);
+    if (*end != ']' || index > INT_MAX)
+        return false;
+
+    *arg = static_cast<int>(index);
+    pos = end + 1;
+    return true;
+}
 
 /**
- * Decompress the log file that was open()-ed and print the log messages out
- * in chronological order.
+ * Aggregation constructor; the query must then be parse()-ed before log
+ * messages are add()-ed.
+ */
+Log::Decoder::Aggregation::Aggregation()
+    : keys()
+    , aggregates()
+    , valueArg(-1)
+    , keepValues(false)
+    , groups()
+    , groupIndex()
+    , logIdNames()
+    , logIdIndex()
+    , keyBuffer()
+{
+}
+
+/**
+ * Parses a query (see the Aggregation class) into the keys and aggregates
+ * to compute.
  *
- * \param outputFd
- *      The file descriptor to print the log messages to
+ * \param query
+ *      Query to parse
  *
  * \return
- *      The number of log messages encountered. A negative value indicates error
+ *      true if the query is valid; false otherwise
  */
-int64_t
-Log::Decoder::decompressTo(FILE* outputFd)
+bool
+Log::Decoder::Aggregation::parse(const char *query)
 {
-    if (filename.empty() || !inputFd)
-        return -1;
-
-    // In ordered decompression, we must sort the entries by time which means
-    // we need to buffer in 3 rounds of NanoLog output. We need more than one
-    // round of output because the compression is non-quiescent, which means
-    // that as we're outputting the nth buffer, new entries may be added to
-    // n-1 and n, and the entries in n could logically come /before/ the new
-    // entries added to n-1. The reason why we need at least 3 is due to an
-    // implementation detail in StagingBuffer whereby one peek() does not
-    // return all the data and at least 2 peek()'s are needed to deplete a
-    // buffer.
-    static const uint32_t stagesToBuffer = 3;
-    std::vector<BufferFragment*> stages[stagesToBuffer];
+    keys.clear();
+    aggregates.clear();
+    valueArg = -1;
+    keepValues = false;
+
+    const char *pos = query;
+    if (consumeWord(pos, "group")) {
+        if (!consumeWord(pos, "by"))
+            return false;
 
-    // Running number of stages being kept in stages
-    uint32_t stagesBuffered = 0;
+        do {
+            Key key;
+            key.arg = -1;
+
+            if (consumeWord(pos, "logId"))
+                key.type = LOG_ID;
+            else if (consumeWord(pos, "runtimeId"))
+                key.type = RUNTIME_ID;
+            else if (consumeArgument(pos, &key.arg))
+                key.type = ARGUMENT;
+            else
+                return false;
 
-    // Indicates that all stages must be depleted before continuing
-    // processing the log file. This should only be true when we detect
-    // the start of a new execution(s) log appended to inputFd or we
-    // reached the end of the current file
-    bool mustDepleteAllStages = false;
+            keys.push_back(key);
+        } while (consumeWord(pos, ","));
 
-    LogMessage logArguments;
-    while (!feof(inputFd) && good) {
+        if (!consumeWord(pos, ";"))
+            return false;
+    }
 
-        // Step 1: Read in up to a certain number of "stages" of BufferFragments
-        mustDepleteAllStages = false;
-        while (!feof(inputFd) && good && !mustDepleteAllStages) {
-            EntryType entry = peekEntryType(inputFd);
-            bool newStage = false;
+    do {
+        Aggregate aggregate;
+        aggregate.percentile = 0;
+
+        while (isspace(*pos))
+            ++pos;
+
+        if (consumeWord(pos, "count")) {
+            aggregate.function = COUNT;
+        } else if (consumeWord(pos, "sum")) {
+            aggregate.function = SUM;
+        } else if (consumeWord(pos, "min")) {
+            aggregate.function = MIN;
+        } else if (consumeWord(pos, "max")) {
+            aggregate.function = MAX;
+        } else if (consumeWord(pos, "mean")) {
+            aggregate.function = MEAN;
+        } else if (pos[0] == 'p' && isdigit(pos[1])) {
+            char *end;
+            aggregate.function = PERCENTILE;
+            aggregate.percentile = strtod(pos + 1, &end);
+            if (aggregate.percentile <= 0 || aggregate.percentile > 100 ||
+                    isalnum(*end))
+                return false;
 
-            switch (entry) {
-                case EntryType::BUFFER_EXTENT:
-                {
-                    BufferFragment *bf = allocateBufferFragment();
-                    good = bf->readBufferExtent(inputFd, &newStage);
-                    ++numBufferFragmentsRead;
+            pos = end;
+            keepValues = true;
+        } else {
+            return false;
+        }
 
-                    if (good)
-                        stages[stagesBuffered].push_back(bf);
+        aggregates.push_back(aggregate);
+    } while (consumeWord(pos, ","));
 
-                    break;
-                }
-                case EntryType::CHECKPOINT:
-                    // New logical start to the logs detected, at this point
-                    // we should make sure we've printed all the buffered logs
-                    // before continuing to parse the next logical start.
-                    if (!stages[0].empty()) {
-                        mustDepleteAllStages = true;
-                        break;
-                    }
+    if (consumeWord(pos, "of") && !consumeArgument(pos, &valueArg))
+        return false;
 
-                    // We're safe, all the stages are empty
-                    good = readDictionary(inputFd, true);
+    consumeWord(pos, ";");
+    while (isspace(*pos))
+        ++pos;
 
-                    if (good)
-                        fprintf(outputFd,"\r\n# New execution started\r\n");
+    if (*pos != '\0')
+        return false;
 
-                    break;
+    for (const Aggregate &aggregate : aggregates) {
+        if (aggregate.function != COUNT && valueArg < 0)
+            return false;
+    }
 
-                case EntryType::LOG_MSGS_OR_DIC:
-                    good = readDictionaryFragment(inputFd);
-                    break;
+    return true;
+}
 
-                case EntryType::INVALID:
-                    // Consume padding
-                    while (!feof(inputFd) && peekEntryType(inputFd) == INVALID)
-                        fgetc(inputFd);
-                    break;
-            }
+/**
+ * Adds a log message to the group of its keys, creating the group if it
+ * is the first log message with those keys.
+ *
+ * \param logMsg
+ *      Log message to add
+ * \param argTypes
+ *      FormatType of each argument of the log message
+ * \param execution
+ *      Number of times the log file was appended to up to the log message
+ *      (starting at 1), since log ids restart with each execution
+ * \param runtimeId
+ *      Runtime thread/StagingBuffer id that logged the message
+ * \param formatMetadata
+ *      FormatMetadata of the log message
+ * \param formatString
+ *      Original format string of the log message
+ *
+ * \return
+ *      true if the log message was added; false if it lacks an argument
+ *      referenced by the query or its aggregated argument is not numeric
+ */
+bool
+Log::Decoder::Aggregation::add(LogMessage &logMsg,
+                               const std::vector<uint8_t> &argTypes,
+                               uint32_t execution, uint32_t runtimeId,
+                               const void *formatMetadata,
+                               const std::string &formatString)
+{
+    int numArgs = static_cast<int>(argTypes.size());
 
-            if (feof(inputFd))
-                mustDepleteAllStages = true;
+    ArgumentValue value;
+    if (valueArg >= 0 && (valueArg >= numArgs ||
+            !visitArgument(logMsg, valueArg, argTypes[valueArg], value)))
+        return false;
 
-            // If we reach a logical end to the current stage,
-            // make the current stage available for consumption
-            if (((mustDepleteAllStages || !good) && !stages[0].empty()) ||
-                    newStage)
-            {
-                ++stagesBuffered;
-            }
+    keyBuffer.clear();
+    ArgumentKey argumentKey(keyBuffer);
+    for (const Key &key : keys) {
+        switch (key.type) {
+            case LOG_ID:
+                appendColumnValue(keyBuffer, execution);
+                appendColumnValue(keyBuffer, logMsg.getLogId());
+                break;
 
-            if (stagesBuffered == stagesToBuffer)
+            case RUNTIME_ID:
+                appendColumnValue(keyBuffer, runtimeId);
                 break;
-        }
 
-        // Step 2: Heapify all BufferFragments within the stages from
-        // front=max to back=min
-        for (auto &stage : stages) {
-            std::make_heap(stage.begin(), stage.end(), compareBufferFragments);
+            case ARGUMENT:
+                if (key.arg >= numArgs || !visitArgument(logMsg, key.arg,
+                                                argTypes[key.arg], argumentKey))
+                    return false;
+                break;
         }
+    }
 
-        // Step 3: Deplete the first stage
-        while (true) {
-            // Step 3a: Find the minimum amongst the stages
-            std::vector<BufferFragment*> *minStage = nullptr;
-            for (uint32_t i = 0; i < stagesBuffered; ++i) {
-                if (stages[i].empty())
-                    continue;
-
-                uint64_t next = stages[i].front()->getNextLogTimestamp();
-                if (minStage == nullptr ||
-                        next < minStage->front()->getNextLogTimestamp()) {
-                    minStage = &(stages[i]);
+    auto it = groupIndex.find(keyBuffer);
+    if (it == groupIndex.end()) {
+        it = groupIndex.emplace(keyBuffer, groups.size()).first;
+        groups.emplace_back();
+
+        Group &group = groups.back();
+        group.count = 0;
+        group.sum = 0;
+        group.min = group.max = value.value;
+
+        for (const Key &key : keys) {
+            ArgumentText text;
+            if (key.type == LOG_ID) {
+                std::pair<uint32_t, uint32_t> logId(execution,
+                                                    logMsg.getLogId());
+                auto index = logIdIndex.find(logId);
+                if (index == logIdIndex.end()) {
+                    auto *metadata = static_cast<const FormatMetadata*>(
+                                                            formatMetadata);
+
+                    // Follow the "<execution>_<fmtId>" naming of
+                    // exportColumns() for the executions appended later
+                    if (execution > 1)
+                        appendPrintf(text.text, "%u_", execution - 1);
+                    appendPrintf(text.text, "%u", logId.second);
+
+                    std::string description;
+                    appendPrintf(description, "%s:%u \"%s\"",
+                                 metadata->filename, metadata->lineNumber,
+                                 formatString.c_str());
+                    index = logIdIndex.emplace(logId,
+                                               logIdNames.size()).first;
+                    logIdNames.emplace_back(text.text, description);
                 }
+
+                text.text = logIdNames[index->second].first;
+            } else if (key.type == RUNTIME_ID) {
+                text(runtimeId);
+            } else {
+                visitArgument(logMsg, key.arg, argTypes[key.arg], text);
             }
 
-            // If nothing was found, we're done
-            if (minStage == nullptr)
-                break;
+            group.keyText.push_back(text.text);
+        }
+    }
 
-            // Step 3b: Output the log message
-            BufferFragment *bf = minStage->front();
-            bf->decompressNextLogStatement(outputFd, logMsgsPrinted,
-                                           logArguments, checkpoint,
-                                           fmtId2metadata);
+    Group &group = groups[it->second];
+    ++group.count;
+    group.sum += value.value;
+    group.min = std::min(group.min, value.value);
+    group.max = std::max(group.max, value.value);
+    if (keepValues)
+        group.values.push_back(value.value);
 
-            // Moves the minimum element to the end of the array
-            std::pop_heap(minStage->begin(), minStage->end(),
-                    compareBufferFragments);
+    return true;
+}
 
-            if (bf->hasNext()) {
-                // If there's more, re-heapify the last element
-                std::push_heap(minStage->begin(), minStage->end(),
-                              compareBufferFragments);
-            } else {
-                // Otherwise, buffer is depleted -> remove it
-                minStage->pop_back();
-                freeBufferFragment(bf);
-            }
+/**
+ * Prints a table with a row of keys and aggregates for each group, in the
+ * order the groups were created, followed by the source location and format
+ * string of each logId key value.
+ *
+ * \param outputFd
+ *      File to print the table to
+ */
+void
+Log::Decoder::Aggregation::print(FILE *outputFd)
+{
+    std::vector<std::vector<std::string>> rows(1);
+    std::vector<std::string> &header = rows.front();
+
+    for (const Key &key : keys) {
+        if (key.type == LOG_ID)
+            header.push_back("logId");
+        else if (key.type == RUNTIME_ID)
+            header.push_back("runtimeId");
+        else
+            header.push_back("arg[" + std::to_string(key.arg) + "]");
+    }
 
-            // Step 3c: Check for exit condition
-            if (stages[0].empty()) {
-                for (uint32_t i = 0; i < stagesBuffered - 1; ++i) {
-                    stages[i] = stages[i+1];
-                }
-                stages[stagesBuffered - 1].clear();
+    static const char *functionNames[] = {"count", "sum", "min", "max",
+                                          "mean", "p"};
+    for (const Aggregate &aggregate : aggregates) {
+        std::string name = functionNames[aggregate.function];
+        if (aggregate.function == PERCENTILE)
+            appendPrintf(name, "%g", aggregate.percentile);
+        if (aggregate.function != COUNT)
+            appendPrintf(name, "(arg[%d])", valueArg);
+        header.push_back(name);
+    }
+
+    for (Group &group : groups) {
+        rows.emplace_back(group.keyText);
+        std::vector<std::string> &row = rows.back();
 
-                --stagesBuffered;
-                if (!mustDepleteAllStages)
+        for (const Aggregate &aggregate : aggregates) {
+            std::string text;
+            double result = 0;
+            switch (aggregate.function) {
+                case COUNT:
+                    appendPrintf(text, "%lu", group.count);
+                    break;
+                case SUM:
+                    result = group.sum;
+                    break;
+                case MIN:
+                    result = group.min;
+                    break;
+                case MAX:
+                    result = group.max;
+                    break;
+                case MEAN:
+                    result = group.sum/static_cast<double>(group.count);
+                    break;
+                case PERCENTILE:
+                {
+                    // Nearest-rank percentile
+                    double rank = ceil(aggregate.percentile/100.0
+                                    * static_cast<double>(group.count));
+                    size_t index = (rank < 1) ? 0
+                                        : static_cast<size_t>(rank) - 1;
+                    auto nth = group.values.begin()
+                                    + std::min(index, group.values.size() - 1);
+                    std::nth_element(group.values.begin(), nth,
+                                     group.values.end());
+                    result = *nth;
                     break;
+                }
             }
+
+            if (aggregate.function != COUNT)
+                appendPrintf(text, "%.15g", result);
+            row.push_back(text);
         }
     }
 
-    return logMsgsPrinted;
+    // Note that header is invalidated by the rows added above
+    std::vector<size_t> widths(rows.front().size(), 0);
+    for (const std::vector<std::string> &row : rows) {
+        for (size_t i = 0; i < row.size(); ++i)
+            widths[i] = std::max(widths[i], row[i].size());
+    }
+
+    for (const std::vector<std::string> &row : rows) {
+        for (size_t i = 0; i + 1 < row.size(); ++i) {
+            fprintf(outputFd, "%-*s | ", static_cast<int>(widths[i]),
+                    row[i].c_str());
+        }
+        fprintf(outputFd, "%s", row.back().c_str());
+        fprintf(outputFd, "\r\n");
+    }
+
+    if (!logIdNames.empty())
+        fprintf(outputFd, "\r\n");
+
+    for (const auto &logIdName : logIdNames) {
+        fprintf(outputFd, "# logId %s: %s\r\n", logIdName.first.c_str(),
+                logIdName.second.c_str());
+    }
 }
 
 /**
- * Iterative interface to decompress the next log statement (if there are any)
- * in the log file and optionally prints it via outputFd. The log statements
- * are output in the order in which they appear in the log which may not be
- * in chronological order.
+ * Runs a query (see the Aggregation class) over the typed arguments of the
+ * log messages in the file open()-ed and prints the resulting table. Unlike
+ * aggregating the decompressed text, the arguments are never formatted or
+ * parsed back, e.g. "group by logId, arg[2]; count, sum, p50, p99 of arg[1]"
+ * counts each distinct third argument of each log statement and summarizes
+ * the second argument for each.
  *
- * \param[out] logMsg
- *          Log message that's decompressed; the contents are valid until
- *          the next invocation to this function.
+ * Only log files from C++17 NanoLog can be queried since those of
+ * Preprocessor NanoLog do not contain the dictionary needed to identify
+ * the argument types.
  *
  * \param outputFd
- *          File descriptor to output the log message to. A value of nullptr
- *          indicates that no printing is desired.
+ *      File to print the table to
+ * \param query
+ *      Query to run
  *
  * \return
- *      True if the decompression was successfully
- *      False indicates there are no more logs or there's an error
+ *      The number of log messages aggregated; a negative value indicates
+ *      an invalid query or log file
  */
-bool
-Log::Decoder::getNextLogStatement(LogMessage &logMsg,
-                                  FILE *outputFd) {
-    if (bufferFragment->hasNext()) {
-        bufferFragment->decompressNextLogStatement(outputFd,
-                                                        logMsgsPrinted,
-                                                        logMsg,
-                                                        checkpoint,
-                                                        fmtId2metadata,
-                                                        -1,
-                                                        nullptr);
-        return true;
+int64_t
+Log::Decoder::aggregate(FILE *outputFd, const char *query)
+{
+    Aggregation aggregation;
+    if (!aggregation.parse(query)) {
+        fprintf(stderr, "Invalid query: %s\r\n", query);
+        return -1;
     }
 
-    logMsg.reset();
-
-    // Decoder was never 'opened' properly
-    if (filename.empty() || !inputFd)
-        return false;
-
-    // We've read the end of the file or an error
-    if (feof(inputFd) || !good)
-        return false;
-
-    while(!bufferFragment->hasNext() && !feof(inputFd) && good) {
-        EntryType entry = peekEntryType(inputFd);
-        bool wrapAround;
-
-        switch (entry) {
-            case EntryType::BUFFER_EXTENT:
-                if (bufferFragment->readBufferExtent(inputFd, &wrapAround)) {
-                    ++numBufferFragmentsRead;
-                    break;
-                }
-
-                fprintf(stderr, "Internal Error: Corrupted BufferExtent\r\n");
-                good = false;
-                return false;
-
-            case EntryType::CHECKPOINT:
-                if (readDictionary(inputFd, true)) {
-
-                    if (outputFd)
-                        fprintf(outputFd, "\r\n# New execution started\r\n");
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> fmtId2argTypes;
+    uint32_t execution = numCheckpointsRead;
+    int64_t logMsgsAggregated = 0;
+    LogMessage logMsg;
 
-                    break;
-                }
+    while (getNextLogStatement(logMsg)) {
+        if (!logMsg.valid()) {
+            fprintf(stderr, "Only log files produced by C++17 NanoLog can be "
+                            "queried\r\n");
+            return -1;
+        }
 
-                good = false;
-                return false;
+        // Format ids restart with each execution appended to the log file
+        if (numCheckpointsRead != execution) {
+            fmtId2argTypes.clear();
+            execution = numCheckpointsRead;
+        }
 
-            case EntryType::LOG_MSGS_OR_DIC:
-                good = readDictionaryFragment(inputFd);
-                break;
+        uint32_t fmtId = logMsg.getLogId();
+        if (fmtId >= fmtId2argTypes.size())
+            fmtId2argTypes.resize(fmtId + 1);
 
-            case EntryType::INVALID:
-                // Consume padding
-                while (!feof(inputFd) && peekEntryType(inputFd) == INVALID)
-                    fgetc(inputFd);
-                break;
+        if (!fmtId2argTypes[fmtId]) {
+            fmtId2argTypes[fmtId].reset(new std::vector<uint8_t>());
+            getArgTypes(fmtId2metadata.at(fmtId), *fmtId2argTypes[fmtId]);
         }
+
+        if (aggregation.add(logMsg, *fmtId2argTypes[fmtId], execution,
+                            bufferFragment->runtimeId,
+                            fmtId2metadata.at(fmtId),
+                            fmtId2fmtString.at(fmtId)))
+            ++logMsgsAggregated;
     }
 
-    return bufferFragment->decompressNextLogStatement(outputFd,
-                                                            logMsgsPrinted,
-                                                            logMsg,
-                                                            checkpoint,
-                                                            fmtId2metadata,
-                                                            -1,
-                                                            nullptr);
+    aggregation.print(outputFd);
+    return logMsgsAggregated;
 }
 
 /**
@@ -2041,14 +7518,15 @@ Log::Decoder::getNextLogStatement(LogMessage &logMsg,
  *
  * \param outputFd
  *      File descriptor to output the log messages to
- * \param logMsgsToPrint
- *      Number of log messages to print before returning
+ * \param numThreads
+ *      Number of threads to format the log messages with
  * \return
  *      The number of log messages processed; a negative value indicates error
  */
 int64_t
-Log::Decoder::decompressUnordered(FILE* outputFd) {
-    bool success = internalDecompressUnordered(outputFd);
+Log::Decoder::decompressUnordered(FILE* outputFd, uint32_t numThreads) {
+    bool success = internalDecompressUnordered(outputFd, -1, nullptr,
+                                               numThreads);
     return (success) ? logMsgsPrinted : -1;
 }
 
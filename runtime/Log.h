@@ -13,7 +13,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <ctime>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <assert.h>
@@ -113,6 +121,15 @@ enum ParamType : int32_t {
 // invocation sites.
 static constexpr int UNASSIGNED_LOGID = -1;
 
+// Values of the filter word kept next to the log identifier of each log
+// invocation site. A site starts out unresolved and is resolved against the
+// log level and log site filters the first time it's reached; from then on,
+// the RuntimeLogger rewrites the word whenever either changes (see
+// NanoLog::setLogSitesEnabled()).
+static constexpr int LOG_SITE_UNRESOLVED = 0;
+static constexpr int LOG_SITE_ENABLED = 1;
+static constexpr int LOG_SITE_DISABLED = 2;
+
 /**
  * Stores the static log information associated with a log invocation site
  * (i.e. filename/line/fmtString combination).
@@ -131,7 +148,11 @@ struct StaticLogInfo {
                       const char* fmtString,
                       const int numParams,
                       const int numNibbles,
-                      const ParamType* paramTypes)
+                      const ParamType* paramTypes,
+                      const uint8_t* argStorage=nullptr,
+                      const bool internStrings=false,
+                      const NanoLog::TimestampSource timestampSource=
+                                            NanoLog::TIMESTAMP_RDTSC)
             : compressionFunction(compress)
             , filename(filename)
             , lineNum(lineNum)
@@ -140,6 +161,9 @@ struct StaticLogInfo {
             , numParams(numParams)
             , numNibbles(numNibbles)
             , paramTypes(paramTypes)
+            , argStorage(argStorage)
+            , internStrings(internStrings)
+            , timestampSource(timestampSource)
     { }
 
     // Stores the compression function to be used on the log's dynamic arguments
@@ -167,6 +191,365 @@ struct StaticLogInfo {
     // argument list starting at 0) to parameter type as inferred from the
     // printf log message invocation
     const ParamType* paramTypes;
+
+    // How each argument is stored in an UncompressedEntry (see
+    // ARG_STORAGE_SIZE_MASK), which lets the crash recovery tool compress
+    // the entries without the compressionFunction. Only the non-preprocessor
+    // version of NanoLog fills this in; it may be nullptr otherwise.
+    const uint8_t* argStorage;
+
+    // Indicates that the compressionFunction interns the log's %s arguments
+    // (see NANO_LOG_INTERNED() and Log::StringInterner)
+    const bool internStrings;
+
+    // Indicates how the log invocation reads its timestamps (see
+    // NANO_LOG_TIMESTAMP())
+    const NanoLog::TimestampSource timestampSource;
+};
+
+// Describe an argument the non-preprocessor version of NanoLog stored in an
+// UncompressedEntry (see StaticLogInfo::argStorage). The low bits hold the
+// sizeof() of the argument's type and the rest are flags; the wide string
+// flag is set for wchar_t pointers, whose strings are stored in characters
+// of sizeof(wchar_t) bytes. Strings carry no sign, so for them the signed
+// flag is reused to mark binary data that is logged as hex digits (see
+// NanoLog::hexdump()), the floating point flag to mark user-defined
+// types (see NanoLog::Serializer) and both of them to mark arrays (see
+// NanoLog::array()).
+static constexpr uint8_t ARG_STORAGE_SIZE_MASK = 0x1f;
+static constexpr uint8_t ARG_STORAGE_SIGNED = 0x20;
+static constexpr uint8_t ARG_STORAGE_FLOATING_POINT = 0x40;
+static constexpr uint8_t ARG_STORAGE_WIDE_STRING = 0x80;
+static constexpr uint8_t ARG_STORAGE_BINARY = ARG_STORAGE_SIGNED;
+static constexpr uint8_t ARG_STORAGE_USER_TYPE = ARG_STORAGE_FLOATING_POINT;
+static constexpr uint8_t ARG_STORAGE_ARRAY = ARG_STORAGE_BINARY
+                                                | ARG_STORAGE_USER_TYPE;
+
+// A user-defined type (see NanoLog::Serializer) is stored as a string that
+// starts with the marker, followed by the name of the type, the separator
+// and then the bytes of the object (see encodeUserType()). Plain strings may
+// start with the marker too, so the Decoder tells them apart by the
+// argStorage of the invocation site in the dictionary (see
+// Log::FormatType::user_type_t).
+static constexpr char USER_TYPE_MARKER = '\x1e';
+static constexpr char USER_TYPE_SEPARATOR = '\x1f';
+
+// An array (see NanoLog::array()) is stored in an UncompressedEntry as the
+// ARG_STORAGE_SIZE_MASK byte that describes its elements followed by the
+// elements. In the compressed log, it starts with the marker instead of
+// being a null-terminated string (see encodeArray()). As for user-defined
+// types, the Decoder identifies arrays by the dictionary rather than by the
+// marker (see Log::FormatType::array_t).
+static constexpr char ARRAY_MARKER = '\x1d';
+
+/**
+ * Encodes binary data as the null-terminated string of lower case hex digits
+ * that a NanoLog::hexdump() argument is stored as in the compressed log.
+ *
+ * \param data
+ *      Binary data to encode
+ * \param bytes
+ *      Number of bytes in data
+ * \param[in/out] out
+ *      Output buffer to encode the data into; it must have room for
+ *      2*bytes + 1 bytes
+ */
+inline void
+encodeHexDump(const char *data, uint32_t bytes, char **out)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    char *pos = *out;
+    for (uint32_t i = 0; i < bytes; ++i) {
+        uint8_t byte = static_cast<uint8_t>(data[i]);
+        *pos++ = digits[byte >> 4];
+        *pos++ = digits[byte & 0xf];
+    }
+
+    *pos++ = '\0';
+    *out = pos;
+}
+
+/**
+ * Encodes a user-defined type as the null-terminated string it's stored as
+ * in the compressed log: the marker, type name and separator it was logged
+ * with are kept and the bytes of the object after them are stored as hex
+ * digits (see encodeHexDump()).
+ *
+ * \param data
+ *      Marker, type name, separator and object bytes (see USER_TYPE_MARKER)
+ * \param bytes
+ *      Number of bytes in data
+ * \param[in/out] out
+ *      Output buffer to encode the data into; it must have room for
+ *      2*bytes + 1 bytes
+ */
+inline void
+encodeUserType(const char *data, uint32_t bytes, char **out)
+{
+    const char *separator = static_cast<const char*>(
+                                    memchr(data, USER_TYPE_SEPARATOR, bytes));
+    uint32_t nameBytes = (separator == nullptr) ? bytes
+                : static_cast<uint32_t>(separator - data) + 1;
+
+    memcpy(*out, data, nameBytes);
+    *out += nameBytes;
+    encodeHexDump(data + nameBytes, bytes - nameBytes, out);
+}
+
+/**
+ * Encodes an array as it's stored in the compressed log: the marker, the
+ * byte that describes the elements, the number of elements and then the
+ * elements. Integers are widened to 64 bits and pack()-ed en bloc, with
+ * their nibbles ahead of the packed values; floating point elements are
+ * copied as is.
+ *
+ * \param data
+ *      Element description byte followed by the elements (see ARRAY_MARKER)
+ * \param bytes
+ *      Number of bytes in data
+ * \param[in/out] out
+ *      Output buffer to encode the array into; it must have room for
+ *      2*bytes + 6 bytes
+ */
+inline void
+encodeArray(const char *data, uint32_t bytes, char **out)
+{
+    // Integers are packed from blocks of the widened elements on the stack
+    static constexpr uint32_t VALUES_PER_BLOCK = 64;
+
+    uint8_t elements = static_cast<uint8_t>(data[0]);
+    uint32_t elementBytes = elements & ARG_STORAGE_SIZE_MASK;
+    uint32_t count = (bytes - 1)/elementBytes;
+    const char *values = data + 1;
+
+    *(*out)++ = ARRAY_MARKER;
+    *(*out)++ = static_cast<char>(elements);
+    memcpy(*out, &count, sizeof(count));
+    *out += sizeof(count);
+
+    if (elements & ARG_STORAGE_FLOATING_POINT) {
+        memcpy(*out, values, count*elementBytes);
+        *out += count*elementBytes;
+        return;
+    }
+
+    BufferUtils::TwoNibbles *nibbles =
+                            reinterpret_cast<BufferUtils::TwoNibbles*>(*out);
+    *out += (count + 1)/2;
+
+    bool isSigned = (elements & ARG_STORAGE_SIGNED);
+    for (uint32_t i = 0; i < count; i += VALUES_PER_BLOCK) {
+        uint32_t blockSize = std::min(VALUES_PER_BLOCK, count - i);
+        union {
+            int64_t signedValues[VALUES_PER_BLOCK];
+            uint64_t unsignedValues[VALUES_PER_BLOCK];
+        } block;
+
+        for (uint32_t j = 0; j < blockSize; ++j) {
+            uint64_t value = 0;
+            memcpy(&value, values + (i + j)*elementBytes, elementBytes);
+
+            // Signed elements are sign extended from their own width
+            int shift = 64 - 8*static_cast<int>(elementBytes);
+            if (isSigned)
+                block.signedValues[j] = static_cast<int64_t>(value << shift)
+                                                                    >> shift;
+            else
+                block.unsignedValues[j] = value;
+        }
+
+        if (isSigned)
+            BufferUtils::packValues(out, block.signedValues, blockSize,
+                                    nibbles + i/2);
+        else
+            BufferUtils::packValues(out, block.unsignedValues, blockSize,
+                                    nibbles + i/2);
+    }
+}
+
+/**
+ * Append-only registry that maps log identifiers to the StaticLogInfo of
+ * the log invocation sites encountered at runtime by the non-preprocessor
+ * version of NanoLog. Any number of threads may register sites concurrently
+ * without locking and the compression threads read the registry in place
+ * (i.e. without locking or copying it) while they do.
+ *
+ * Identifiers are allocated with an atomic increment and the entries are
+ * stored in fixed size chunks that never move once allocated, so an entry
+ * remains valid for the lifetime of the registry. An entry is published to
+ * the readers with a release store after it's been written, and the readers
+ * only ever see the prefix of identifiers whose entries are all published.
+ */
+class InvocationSiteRegistry {
+PUBLIC:
+    InvocationSiteRegistry()
+        : chunks()
+        , nextId(0)
+        , numPublished(0)
+    {
+        for (auto &chunk : chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~InvocationSiteRegistry()
+    {
+        for (auto &chunk : chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    InvocationSiteRegistry(const InvocationSiteRegistry&) = delete;
+    InvocationSiteRegistry& operator=(const InvocationSiteRegistry&) = delete;
+
+    /**
+     * Adds a log invocation site to the registry. Safe to invoke from
+     * multiple threads concurrently with each other and with the readers.
+     *
+     * \param info
+     *      Static log information to associate with a new identifier
+     *
+     * \return
+     *      The identifier assigned to the entry
+     */
+    uint32_t
+    add(const StaticLogInfo &info)
+    {
+        uint32_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+        if (id >= MAX_SITES) {
+            fprintf(stderr, "NanoLog Error: More than %u log invocation "
+                            "sites were registered\r\n", MAX_SITES);
+            exit(1);
+        }
+
+        Slot &slot = getChunk(id/CHUNK_SIZE)[id%CHUNK_SIZE];
+        new (slot.storage) StaticLogInfo(info);
+        slot.published.store(true, std::memory_order_release);
+
+        return id;
+    }
+
+    /**
+     * Returns the number of entries readable through operator[], i.e. the
+     * length of the longest prefix of identifiers that are all published.
+     * Entries being added concurrently become readable once they and every
+     * entry assigned an identifier ahead of them are published.
+     */
+    uint32_t
+    size() const
+    {
+        uint32_t published = numPublished.load(std::memory_order_acquire);
+        uint32_t allocated = getNumAllocated();
+
+        uint32_t end = published;
+        while (end < allocated && isPublished(end))
+            ++end;
+
+        // Advance the shared watermark so the next reader scans less
+        while (published < end && !numPublished.compare_exchange_weak(
+                                    published, end, std::memory_order_release,
+                                    std::memory_order_acquire)) { }
+
+        return end;
+    }
+
+    /**
+     * Returns the number of identifiers allocated so far. Unlike size(), this
+     * counts the entries that add() has yet to publish (see isPublished()).
+     */
+    uint32_t
+    getNumAllocated() const
+    {
+        return std::min(MAX_SITES, nextId.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * Indicates whether the entry associated with an identifier has been
+     * published, i.e. whether operator[] may read it.
+     *
+     * \param id
+     *      Identifier to check; it must have been allocated already
+     */
+    bool
+    isPublished(uint32_t id) const
+    {
+        const Slot *chunk = chunks[id/CHUNK_SIZE].load(
+                                                std::memory_order_acquire);
+        return chunk != nullptr &&
+                chunk[id%CHUNK_SIZE].published.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Returns the static log information associated with an identifier
+     *
+     * \param id
+     *      Identifier of the entry; it must be less than size()
+     */
+    const StaticLogInfo &
+    operator[](uint32_t id) const
+    {
+        const Slot *chunk = chunks[id/CHUNK_SIZE].load(
+                                                std::memory_order_acquire);
+        return *reinterpret_cast<const StaticLogInfo*>(
+                                                chunk[id%CHUNK_SIZE].storage);
+    }
+
+PRIVATE:
+    // Number of entries in each chunk of the registry
+    static const uint32_t CHUNK_SIZE = 1024;
+
+    // Maximum number of chunks the registry can allocate
+    static const uint32_t MAX_CHUNKS = 1024;
+
+    // Maximum number of log invocation sites that can be registered
+    static const uint32_t MAX_SITES = CHUNK_SIZE*MAX_CHUNKS;
+
+    /**
+     * Storage for a single entry, along with whether it has been published.
+     */
+    struct Slot {
+        Slot()
+            : storage()
+            , published(false)
+        { }
+
+        // Holds the entry's StaticLogInfo once it has been added
+        alignas(StaticLogInfo) char storage[sizeof(StaticLogInfo)];
+
+        // Set with a release store once the storage has been written
+        std::atomic<bool> published;
+    };
+
+    /**
+     * Returns a chunk of the registry, allocating it if no thread has yet.
+     *
+     * \param index
+     *      Index of the chunk to return
+     */
+    Slot *
+    getChunk(uint32_t index)
+    {
+        Slot *chunk = chunks[index].load(std::memory_order_acquire);
+        if (chunk != nullptr)
+            return chunk;
+
+        // Race the other threads to install a chunk; the losers free theirs
+        Slot *newChunk = new Slot[CHUNK_SIZE];
+        if (chunks[index].compare_exchange_strong(chunk, newChunk,
+                                                  std::memory_order_acq_rel))
+            return newChunk;
+
+        delete[] newChunk;
+        return chunk;
+    }
+
+    // Chunks of CHUNK_SIZE entries, allocated on demand and never moved
+    std::atomic<Slot*> chunks[MAX_CHUNKS];
+
+    // Next identifier to allocate
+    std::atomic<uint32_t> nextId;
+
+    // Lower bound on size(), maintained by the readers to shorten their scans
+    mutable std::atomic<uint32_t> numPublished;
 };
 
 namespace Log {
@@ -187,6 +570,7 @@ namespace Log {
         uint32_t entrySize;
 
         // Stores the rdtsc() value at the time of the log function invocation
+        // (NO_TIMESTAMP if the invocation doesn't read it)
         uint64_t timestamp;
 
         // After this header are the uncompressed arguments required by
@@ -202,7 +586,8 @@ namespace Log {
     enum EntryType : uint8_t {
         // Marks an invalid entry in the compressed log. This value is
         // deliberately 0 since \0's are used to pad the output to 512B
-        // in the final output.
+        // in the final output. A byte with this type but with non-zero upper
+        // bits marks an extended entry instead (see ExtendedEntryType).
         INVALID = 0,
 
         // Indicates the beginning of a CompressedRecordEntry when within a
@@ -226,6 +611,31 @@ namespace Log {
         uint8_t other:6;
     } __attribute((packed));
 
+    /**
+     * 6-bit enum that differentiates the less common entries in the compressed
+     * log that share the EntryType::INVALID bits. It occupies the upper bits
+     * of the UnknownHeader and is only valid when the EntryType is INVALID.
+     */
+    enum ExtendedEntryType : uint8_t {
+        // Padding byte (i.e. the whole byte is 0)
+        PADDING = 0,
+
+        // Indicates a DroppedLogs struct
+        DROPPED_LOGS = 1,
+
+        // Indicates a TimeIndex struct
+        TIME_INDEX = 2,
+
+        // Indicates a CompressedBlock struct
+        COMPRESSED_BLOCK = 3,
+
+        // Indicates a ClockCalibration struct
+        CLOCK_CALIBRATION = 4,
+
+        // Indicates a LogIdSummary struct
+        LOG_ID_SUMMARY = 5
+    };
+
     static_assert(sizeof(UnknownHeader) == 1, "Unknown Header should have a"
             " byte size of 1 to ensure that we can always determine the entry"
             " that follows with 1 byte peeks.");
@@ -291,6 +701,127 @@ namespace Log {
         }
     } __attribute__((packed));
 
+    /**
+     * Marker in the compressed log recording that a runtime thread dropped log
+     * messages because its StagingBuffer was full (see OverflowPolicy). The
+     * compression thread encodes the marker when it next visits the buffer,
+     * before it compresses the log messages still in the buffer, so the
+     * marker can precede log messages in the file that were logged ahead of
+     * the drops. The sorted decompression places it by its timestamp.
+     */
+    struct DroppedLogs {
+        // Byte representation of EntryType::INVALID
+        uint8_t entryType:2;
+
+        // Byte representation of ExtendedEntryType::DROPPED_LOGS
+        uint8_t extendedType:6;
+
+        // The runtime thread/StagingBuffer id that dropped the log messages
+        uint32_t bufferId;
+
+        // Number of log messages dropped since the previous DroppedLogs
+        // marker for the same bufferId
+        uint64_t numDropped;
+
+        // rdtsc() value of the last log message dropped
+        uint64_t timestamp;
+    } __attribute__((packed));
+
+    /**
+     * Index entry in the compressed log that summarizes the entries after it,
+     * up to the end of the output buffer the runtime wrote them out with
+     * (excluding any padding). Since the output buffers are written to the
+     * file in one contiguous write each, the Decoder can use the length to
+     * seek past all the log messages outside a time range without reading
+     * them. Old log files and unit tests may not contain any; newer ones
+     * follow each TimeIndex with a LogIdSummary of the same entries.
+     */
+    struct TimeIndex {
+        // Byte representation of EntryType::INVALID
+        uint8_t entryType:2;
+
+        // Byte representation of ExtendedEntryType::TIME_INDEX
+        uint8_t extendedType:6;
+
+        // Indicates that the entries covered contain dictionary fragments
+        // or ClockCalibrations, which means they cannot be skipped.
+        uint8_t hasDictionary;
+
+        // Number of bytes from the start of this TimeIndex to the end of the
+        // last entry it covers
+        uint32_t length;
+
+        // Smallest and largest rdtsc() timestamps of the log messages and
+        // DroppedLogs markers covered (UINT64_MAX and 0 if there are none)
+        uint64_t minTimestamp;
+        uint64_t maxTimestamp;
+
+        // Bitmask of the runtime thread/StagingBuffer ids with entries covered
+        // (bit bufferId % 64 is set for each)
+        uint64_t bufferIds;
+
+        // rdtsc() timestamp that the first log message of every BufferExtent
+        // covered is encoded relative to (instead of 0), so that it only
+        // needs a small delta. This is the timestamp of the first log
+        // message encoded in the buffer, or 0 if there is none.
+        uint64_t baseTimestamp;
+
+        // rdtsc() timestamp before which every log message of the runtime,
+        // from all of its compression threads, is in the log file ahead of
+        // this TimeIndex. The Decoder sorts the log messages by it since the
+        // compression threads write their output buffers independently of
+        // each other. 0 means that the encoder doesn't keep track, in which
+        // case the Decoder goes by the wrapAround passes of the
+        // BufferExtents instead.
+        uint64_t flushedUpTo;
+    } __attribute__((packed));
+
+    /**
+     * Follows a TimeIndex in the compressed log and summarizes which log ids
+     * the log messages it covers have, so that the Decoder can also seek past
+     * the entries when none of them can match a log filter (see
+     * Decoder::setLogFilter()). Ids beyond the bitmap share bits with the
+     * ones below, which only costs an unnecessary read.
+     */
+    struct LogIdSummary {
+        // Byte representation of EntryType::INVALID
+        uint8_t entryType:2;
+
+        // Byte representation of ExtendedEntryType::LOG_ID_SUMMARY
+        uint8_t extendedType:6;
+
+        // Number of bits in logIds
+        static const uint32_t NUM_BITS = 512;
+
+        // Bitmap of the log ids of the log messages covered (bit
+        // logId % NUM_BITS is set for each)
+        uint64_t logIds[NUM_BITS/64];
+    } __attribute__((packed));
+
+    /**
+     * Frames an output buffer that the runtime ran through a general purpose
+     * compressor (see NanoLog::setBlockCompression()) before writing it out.
+     * The compressed bytes follow this header and inflate to the entries the
+     * output buffer held (including its TimeIndex), which the Decoder then
+     * reads as if they came straight from the file.
+     */
+    struct CompressedBlock {
+        // Byte representation of EntryType::INVALID
+        uint8_t entryType:2;
+
+        // Byte representation of ExtendedEntryType::COMPRESSED_BLOCK
+        uint8_t extendedType:6;
+
+        // BlockCodec::Algorithm the block was compressed with
+        uint8_t algorithm;
+
+        // Number of compressed bytes that follow this header
+        uint32_t compressedLength;
+
+        // Number of bytes the compressed bytes inflate to
+        uint32_t uncompressedLength;
+    } __attribute__((packed));
+
     /**
      * Synchronization data structure in the compressed log that correlates the
      * runtime machine's rdtsc() with a wall time and the translation between
@@ -324,6 +855,28 @@ namespace Log {
 
     } __attribute__((packed));
 
+    /**
+     * Reading of the wall clock that the runtime takes periodically (see
+     * NanoLogConfig::CLOCK_CALIBRATION_INTERVAL_MS), along with the rdtsc()
+     * at the time. The Checkpoint only has whole seconds and the
+     * cyclesPerSecond estimated at startup, which would otherwise be used
+     * to extrapolate the wall times of the whole execution; the Decoder
+     * interpolates between these instead (see WallClock).
+     */
+    struct ClockCalibration {
+        // Byte representation of EntryType::INVALID
+        uint8_t entryType:2;
+
+        // Byte representation of ExtendedEntryType::CLOCK_CALIBRATION
+        uint8_t extendedType:6;
+
+        // rdtsc() time that corresponds with the unixNanos below
+        uint64_t rdtsc;
+
+        // CLOCK_REALTIME in nanoseconds since the epoch
+        int64_t unixNanos;
+    } __attribute__((packed));
+
     /**
      * A DictionaryFragment contains a partial mapping of unique identifiers to
      * static log information on disk. Following this structure is one or more
@@ -348,7 +901,9 @@ namespace Log {
      * Following this structure are the filename and format string.
      */
     struct CompressedLogInfo {
-        // LogLevel severity of the original log invocation
+        // LogLevel severity of the original log invocation, combined with
+        // INTERNED_STRINGS_FLAG if its %s arguments are interned and with
+        // its TimestampSource (see TIMESTAMP_SOURCE_SHIFT)
         uint8_t severity;
 
         // File line number in which the original log invocation appeared
@@ -359,10 +914,86 @@ namespace Log {
         uint16_t filenameLength;
 
         // Length of the format string that is associated with this log
-        // invocation and comes after filename.
+        // invocation and comes after filename. For invocations that log
+        // user-defined types or arrays, this also counts the argStorage
+        // bytes of its parameters (see StaticLogInfo::argStorage) that
+        // follow the null terminator of the format string.
         uint16_t formatStringLength;
     } __attribute((packed));
 
+    // Marks the CompressedLogInfo of a log invocation site whose compression
+    // function interns its %s arguments (see StringInterner)
+    static constexpr uint8_t INTERNED_STRINGS_FLAG = 0x80;
+
+    // Position and bits of the NanoLog::TimestampSource of a log invocation
+    // site within CompressedLogInfo::severity and RecoverySite::logLevel; the
+    // LogLevel takes up the SEVERITY_MASK bits below them.
+    static constexpr int TIMESTAMP_SOURCE_SHIFT = 5;
+    static constexpr uint8_t TIMESTAMP_SOURCE_MASK = 0x60;
+    static constexpr uint8_t SEVERITY_MASK = 0x1F;
+
+    // Timestamp the log statements of TIMESTAMP_NONE sites store in their
+    // UncompressedEntry; the Encoder replaces it before compressing them.
+    static constexpr uint64_t NO_TIMESTAMP = ~0UL;
+
+    /**
+     * Combines a LogLevel with a TimestampSource (and any flags) into the
+     * severity byte of CompressedLogInfo and RecoverySite.
+     *
+     * \param severity
+     *      LogLevel of the log invocation site, possibly with flags
+     * \param timestampSource
+     *      How the site reads its timestamps
+     */
+    inline uint8_t
+    packSeverity(uint8_t severity, NanoLog::TimestampSource timestampSource)
+    {
+        return static_cast<uint8_t>(severity | (TIMESTAMP_SOURCE_MASK &
+                    (static_cast<int>(timestampSource)
+                                                << TIMESTAMP_SOURCE_SHIFT)));
+    }
+
+    /**
+     * Extracts the TimestampSource from a byte made by packSeverity().
+     */
+    inline NanoLog::TimestampSource
+    unpackTimestampSource(uint8_t severity)
+    {
+        return static_cast<NanoLog::TimestampSource>(
+                (severity & TIMESTAMP_SOURCE_MASK) >> TIMESTAMP_SOURCE_SHIFT);
+    }
+
+    /**
+     * Converts the rdtsc() timestamps of an execution in the compressed log
+     * to wall times. Without ClockCalibrations, the timestamps are
+     * extrapolated from the execution's Checkpoint. Otherwise, they are
+     * interpolated between the two calibrations around them and those
+     * outside of the calibrations are extrapolated from the nearest one, at
+     * the rate measured between the first and the last calibration.
+     */
+    class WallClock {
+    PUBLIC:
+        WallClock();
+        explicit WallClock(const Checkpoint &checkpoint);
+
+        void reset(const Checkpoint &checkpoint);
+        void addCalibration(uint64_t rdtsc, int64_t unixNanos);
+        int64_t toNanos(uint64_t rdtsc) const;
+        struct timespec toTimespec(uint64_t rdtsc) const;
+
+    PRIVATE:
+        // rdtsc() and nanoseconds since the epoch of the Checkpoint
+        uint64_t checkpointRdtsc;
+        int64_t checkpointNanos;
+
+        // Nanoseconds per rdtsc() cycle to extrapolate with
+        double nanosPerCycle;
+
+        // rdtsc() and CLOCK_REALTIME nanoseconds of the ClockCalibrations
+        // read, sorted by rdtsc()
+        std::vector<std::pair<uint64_t, int64_t>> calibrations;
+    };
+
     /**
      * Describes a unique log message within the user sources. The order in
      * which this structure appears in the log file determines the associated
@@ -376,8 +1007,10 @@ namespace Log {
         // Number of PrintFragments following this data structure
         uint8_t numPrintFragments;
 
-        // Log level of the LOG statement in the original source file
-        uint8_t logLevel;
+        // Log level of the LOG statement in the original source file and how
+        // it read its timestamps (a NanoLog::TimestampSource)
+        uint8_t logLevel:5;
+        uint8_t timestampSource:3;
 
         // Line number of the LOG statement in the original source file
         uint32_t lineNumber;
@@ -403,6 +1036,11 @@ namespace Log {
         bool hasDynamicWidth:1;
         bool hasDynamicPrecision:1;
 
+        // Indicates that the (const_char_ptr_t) argument is encoded by a
+        // StringInterner rather than as a plain string. Only the Decoder
+        // sets this; it's always cleared in FormatMetadata read from a log.
+        bool internedString:1;
+
         //TODO(syang0) is this necessary? The format framgnet is null-terminated
         // Length of the format fragment
         uint16_t fragmentLength;
@@ -445,9 +1083,253 @@ namespace Log {
         const_char_ptr_t,
         const_wchar_t_ptr_t,
 
+        // Assigned only by the Decoder, to the %s arguments that the
+        // dictionary describes as user-defined types (see
+        // NanoLog::Serializer) or arrays (see NanoLog::array()).
+        user_type_t,
+        array_t,
+
         MAX_FORMAT_TYPE
     };
 
+    /**
+     * The PrintFragments of a FormatMetadata compiled once by the Decoder
+     * into the steps needed to reconstruct its log messages. Steps whose
+     * format specifiers are common enough (plain integers, strings and
+     * fixed-point doubles) are formatted directly into the output text; the
+     * rest fall back to the C library's printf family.
+     */
+    struct CompiledFormat {
+        // How a Step converts its argument to text
+        enum Conversion : uint8_t {
+            // The fragment has no format specifier; only prefix is output
+            TEXT_ONLY,
+
+            // %d/%i/%u with no flags, width or precision
+            DECIMAL,
+
+            // %s with no flags, width or precision
+            STRING,
+
+            // %f with a static precision and no flags or width
+            FIXED_POINT,
+
+            // Anything else; the formatFragment is handed to snprintf
+            PRINTF,
+        };
+
+        /**
+         * One PrintFragment compiled, i.e. static text followed by at most one
+         * converted argument followed by (for the last fragment) more text.
+         */
+        struct Step {
+            // PrintFragment this Step was compiled from
+            const PrintFragment *fragment;
+
+            // How to convert the argument of the fragment
+            Conversion conversion;
+
+            // Digits after the decimal point for FIXED_POINT conversions
+            int precision;
+
+            // Static text before and after the format specifier with the
+            // "%%" escapes already replaced (unused for PRINTF)
+            std::string prefix;
+            std::string suffix;
+
+            explicit Step(const PrintFragment *fragment);
+            Step(const Step&) = default;
+            Step(Step&&) = default;
+            Step &operator=(const Step&) = default;
+            Step &operator=(Step&&) = default;
+        };
+
+        // Steps in the same order as the PrintFragments
+        std::vector<Step> steps;
+
+        explicit CompiledFormat(const void *formatMetadata);
+    };
+
+    /**
+     * Header of a table file produced by Decoder::exportColumns(). Each table
+     * holds the log messages of one format id (of one execution in the log
+     * file) stored column by column so that readers can load only the
+     * columns they need. The table is laid out as follows:
+     *
+     *  ColumnTableHeader
+     *  char filename[filenameLength]            (null-terminated)
+     *  char formatString[formatStringLength]    (null-terminated)
+     *  uint8_t argTypes[numArgColumns]           (FormatType of each argument)
+     *  ColumnRowGroup ...
+     *
+     * All values are in the byte order of the machine that exported them.
+     */
+    struct ColumnTableHeader {
+        // Identifies the file as a table; always "NLCOLS1" (null-terminated)
+        char magic[8];
+
+        // Format id of the log messages in the table
+        uint32_t fmtId;
+
+        // Line number of the LOG statement in the original source file
+        uint32_t lineNumber;
+
+        // Log level of the LOG statement in the original source file
+        uint8_t logLevel;
+
+        // Number of bytes in the filename and format string that follow
+        // (including the null characters)
+        uint16_t filenameLength;
+        uint32_t formatStringLength;
+
+        // Number of argument columns, i.e. the number of format specifiers
+        // in the format string excluding dynamic widths and precisions
+        uint16_t numArgColumns;
+    } __attribute__((packed));
+
+    /**
+     * A batch of rows in a table produced by Decoder::exportColumns(). After
+     * this header are the byte sizes of the (2 + numArgColumns) columns as
+     * uint64_t's followed by the columns themselves in order:
+     *
+     *  int64_t timestamps[numRows]     (nanoseconds since the epoch)
+     *  uint32_t runtimeIds[numRows]    (runtime thread/StagingBuffer id)
+     *  <argument column> ...
+     *
+     * Integers, doubles and pointers are stored as numRows values of the
+     * argument's type. Strings are stored as numRows + 1 uint64_t byte offsets
+     * into the characters (char or wchar_t, not null-terminated) that follow
+     * them. Long doubles are not retained by LogMessage, so their columns are
+     * empty.
+     */
+    struct ColumnRowGroup {
+        // Number of rows in every column of the group
+        uint32_t numRows;
+
+        // Number of bytes after this header that belong to the group
+        uint64_t bytes;
+    } __attribute__((packed));
+
+    /**
+     * Leads each crash recovery file that backs a runtime StagingBuffer (see
+     * NanoLog::setCrashRecoveryDirectory()). The file is mapped shared and
+     * holds the StagingBuffer object itself after this header with its
+     * storage after that, so the producer and consumer positions are in the
+     * file without any extra work on the logging path. Since those positions
+     * are pointers in the process that logged, the header records where the
+     * storage was mapped and where within the file each field lives. A
+     * compression agent (see NanoLog::setCompressionAgent()) consumes the
+     * buffer through the same fields.
+     */
+    struct RecoveryBufferHeader {
+        // Identifies the file as a StagingBuffer; always "NLRCBF1"
+        // (null-terminated)
+        char magic[8];
+
+        // Address of the StagingBuffer's storage in the process that logged,
+        // and its offset and byte size within the file
+        uint64_t storageAddress;
+        uint64_t storageOffset;
+        uint32_t capacity;
+
+        // File offsets of the StagingBuffer's id, producerPos,
+        // endOfRecordedSpace and persistedPos
+        uint32_t idOffset;
+        uint32_t producerPosOffset;
+        uint32_t endOfRecordedSpaceOffset;
+        uint32_t persistedPosOffset;
+
+        // File offsets of the fields only a compression agent needs: the
+        // consumerPos and the counts of dropped log statements
+        uint32_t consumerPosOffset;
+        uint32_t numLogsDroppedOffset;
+        uint32_t lastDropTimestampOffset;
+        uint32_t numLogsDroppedReportedOffset;
+    } __attribute__((packed));
+
+    /**
+     * Header of the dictionary file that accompanies the StagingBuffer crash
+     * recovery files of a process. In the non-preprocessor version of
+     * NanoLog, the header is followed by a RecoverySite for every log
+     * invocation site in the order they were registered (possibly with
+     * duplicates); the preprocessor version's dictionary is compiled into
+     * the recovery tool instead.
+     */
+    struct RecoveryDictionaryHeader {
+        // Identifies the file as a dictionary; always "NLRCDC1"
+        // (null-terminated)
+        char magic[8];
+
+        // Process that logged
+        uint32_t pid;
+
+        // Indicates that the process used the preprocessor version of NanoLog
+        uint8_t preprocessor;
+
+        // Indicates that the process leaves the compression of its
+        // StagingBuffers to a compression agent rather than its own
+        // compression threads (see NanoLog::setCompressionAgent())
+        uint8_t compressionAgent;
+
+        // Relates the rdtsc() timestamps in the StagingBuffers to wall time
+        Checkpoint checkpoint;
+    } __attribute__((packed));
+
+    /**
+     * Static information of a log invocation site in the dictionary file for
+     * crash recovery. It is laid out as follows:
+     *
+     *  RecoverySite
+     *  int32_t paramTypes[numParams]            (ParamType of each argument)
+     *  uint8_t argStorage[numParams]            (see StaticLogInfo::argStorage)
+     *  char filename[filenameLength]            (null-terminated)
+     *  char formatString[formatStringLength]    (null-terminated)
+     */
+    struct RecoverySite {
+        // Log identifier the site was assigned
+        uint32_t fmtId;
+
+        // Line number of the LOG statement in the original source file
+        uint32_t lineNumber;
+
+        // Log level of the LOG statement in the original source file,
+        // combined with its TimestampSource (see packSeverity())
+        uint8_t logLevel;
+
+        // Number of arguments of the LOG statement
+        uint16_t numParams;
+
+        // Number of bytes in the filename and format string that follow
+        // (including the null characters)
+        uint16_t filenameLength;
+        uint32_t formatStringLength;
+    } __attribute__((packed));
+
+    std::string encodeRecoverySite(uint32_t fmtId, const StaticLogInfo &info);
+
+    int64_t recoverStagingBuffers(const char *recoveryPrefix,
+                                  const char *logFile);
+
+    /**
+     * Leads every connection a process makes to a log collector (see
+     * NanoLog::setLogCollector()). What follows is the compressed log exactly
+     * as it would have been written to a log file, which the collector
+     * writes out to "nanolog.<hostname>.<pid>.<connection>.log".
+     */
+    struct CollectorHello {
+        // Identifies the connection as a NanoLog stream; always "NLCOLL1"
+        // (null-terminated)
+        char magic[8];
+
+        // Process that logs and the number of connections it made to log
+        // collectors before this one
+        uint32_t pid;
+        uint32_t connection;
+
+        // Host the process runs on (null-terminated)
+        char hostname[64];
+    } __attribute__((packed));
+
     /**
      * Peek into a data array and identify the next entry embedded in the
      * compressed log (if there is one) and read it back.
@@ -488,6 +1370,27 @@ namespace Log {
         return EntryType(header->entryType);
     }
 
+    /**
+     * Peek into the next byte in the file and identify the extended entry
+     * that follows, assuming peekEntryType() returned EntryType::INVALID.
+     *
+     * \param fd
+     *      File descriptor to peek into
+     * \return
+     *      An ExtendedEntryType specifying what comes next
+     */
+    inline ExtendedEntryType
+    peekExtendedType(FILE *fd) {
+        int type = fgetc(fd);
+        ungetc(type, fd);
+
+        if (type == EOF || type < 0 || type > 255)
+            return ExtendedEntryType::PADDING;
+
+        UnknownHeader *header = reinterpret_cast<UnknownHeader*>(&type);
+        return ExtendedEntryType(header->other);
+    }
+
     /**
      * Extract the information from an UncompressedLogEntry and re-encode it
      * as a CompressedRecordEntry. Here, the provided lastTimestamp is provided
@@ -612,6 +1515,163 @@ namespace Log {
         buffer += sizeof(T);
     }
 
+    /**
+     * Interns the %s arguments of the log messages in the BufferExtent being
+     * encoded whose sites opted in (see NANO_LOG_INTERNED()). The first time
+     * a string appears in an extent, it is encoded as a 0 byte followed by
+     * the null-terminated string, and (while there is room) assigned the next
+     * id; from then on it is encoded as that id, a single byte from 1 to
+     * MAX_STRINGS. The table starts over with every BufferExtent so that, like
+     * the rest of the extent, the strings can be decoded without looking at
+     * any other part of the log.
+     */
+    class StringInterner {
+    PUBLIC:
+        // Most strings that can be interned per BufferExtent
+        static const uint32_t MAX_STRINGS = 255;
+
+        StringInterner();
+
+        /**
+         * Forgets the strings interned so far, i.e. for a new BufferExtent.
+         */
+        inline void
+        reset() {
+            numStrings = 0;
+            if (++epoch == 0) {
+                memset(slots, 0, sizeof(slots));
+                epoch = 1;
+            }
+        }
+
+        /**
+         * Encodes a string argument.
+         *
+         * \param str
+         *      String to encode (need not be null-terminated)
+         * \param length
+         *      Number of bytes in str
+         * \param[in/out] out
+         *      Output buffer to encode the string into; it must have room
+         *      for length + 2 bytes. The bytes of new strings are referred
+         *      to by later invocations, so they must stay in place until
+         *      the next reset().
+         */
+        inline void
+        encode(const char *str, uint32_t length, char **out) {
+            Slot &slot = find(str, length);
+            if (slot.epoch == epoch) {
+                **out = static_cast<char>(slot.id);
+                ++*out;
+                return;
+            }
+
+            **out = 0;
+            ++*out;
+            claim(slot, *out, length);
+
+            memcpy(*out, str, length);
+            *out += length;
+            **out = '\0';
+            ++*out;
+        }
+
+        /**
+         * Variant of encode() for a string that the caller already wrote,
+         * null-terminated, one byte past *out (i.e. where encode() would
+         * copy it to). This saves on staging strings that are produced
+         * while compressing, such as the hex digits of NanoLog::hexdump().
+         *
+         * \param length
+         *      Number of bytes in the string, excluding the terminator
+         * \param[in/out] out
+         *      Output buffer the string was written into
+         */
+        inline void
+        encodeInPlace(uint32_t length, char **out) {
+            const char *str = *out + 1;
+            Slot &slot = find(str, length);
+            if (slot.epoch == epoch) {
+                **out = static_cast<char>(slot.id);
+                ++*out;
+                return;
+            }
+
+            **out = 0;
+            ++*out;
+            claim(slot, *out, length);
+            *out += length + 1;
+        }
+
+        // Interner of the Encoder that is invoking the compression functions
+        // on this thread; nullptr (e.g. when they're invoked directly) means
+        // every string is encoded as a new one without being interned.
+        static __thread StringInterner *active;
+
+    PRIVATE:
+        // A string interned in the current BufferExtent
+        struct Slot {
+            // The encoded copy of the string
+            const char *str;
+            uint32_t length;
+
+            // The slot is only in use if this matches StringInterner::epoch
+            uint32_t epoch;
+
+            // Id the string is encoded as
+            uint8_t id;
+        };
+
+        /**
+         * Finds the slot that interns a string, or the empty slot that it
+         * would be interned in.
+         */
+        inline Slot &
+        find(const char *str, uint32_t length) {
+            // FNV-1a
+            uint32_t hash = 2166136261U;
+            for (uint32_t i = 0; i < length; ++i)
+                hash = (hash ^ static_cast<uint8_t>(str[i])) * 16777619U;
+
+            for (uint32_t i = hash; ; ++i) {
+                Slot &slot = slots[i % NUM_SLOTS];
+                if (slot.epoch != epoch)
+                    return slot;
+
+                if (slot.length == length && !memcmp(slot.str, str, length))
+                    return slot;
+            }
+        }
+
+        /**
+         * Interns the new string that was just encoded at str, if there's
+         * still room for it in this BufferExtent.
+         */
+        inline void
+        claim(Slot &slot, const char *str, uint32_t length) {
+            if (numStrings >= MAX_STRINGS)
+                return;
+
+            slot.str = str;
+            slot.length = length;
+            slot.epoch = epoch;
+            slot.id = static_cast<uint8_t>(++numStrings);
+        }
+
+        // Open-addressed hash table of the interned strings. It's kept at
+        // most half full so that lookups don't probe for long.
+        static const uint32_t NUM_SLOTS = 512;
+        static_assert(2*MAX_STRINGS < NUM_SLOTS,
+                      "The interned strings need a sparse hash table");
+        Slot slots[NUM_SLOTS];
+
+        // Incremented by reset() to empty all the slots at once
+        uint32_t epoch;
+
+        // Number of strings interned in the current BufferExtent
+        uint32_t numStrings;
+    };
+
     /**
      * Encapsulates the knowledge on how to transform UncompresedLogMessage's
      * created by the generated code into a compressed log for a Decoder
@@ -636,7 +1696,8 @@ namespace Log {
     PUBLIC:
         Encoder(char *buffer, size_t bufferSize,
                 bool skipCheckpoint=false,
-                bool forceDictionaryOutput=false);
+                bool forceDictionaryOutput=false,
+                bool encodeTimeIndex=false);
 
         long encodeLogMsgs(char *from, uint64_t nbytes,
                            uint32_t bufferId,
@@ -646,10 +1707,18 @@ namespace Log {
         long encodeLogMsgs(char *from, uint64_t nbytes,
                                     uint32_t bufferId,
                                     bool wrapAround,
-                                    std::vector<StaticLogInfo> dictionary,
+                            const InvocationSiteRegistry &dictionary,
                                     uint64_t *numEventsCompressed);
+
+        bool encodeDroppedLogs(uint32_t bufferId, uint64_t numDropped,
+                               uint64_t timestamp);
+        bool encodeClockCalibration(uint64_t rdtsc, int64_t unixNanos);
+
         uint32_t encodeNewDictionaryEntries(uint32_t& currentPosition,
-                                            std::vector<StaticLogInfo> allMetadata);
+                            const InvocationSiteRegistry &allMetadata);
+
+        bool encodeCheckpoint();
+        void setFlushedUpTo(uint64_t timestamp);
 
         size_t getEncodedBytes();
         void swapBuffer(char *inBuffer, size_t inSize,
@@ -657,7 +1726,106 @@ namespace Log {
                         size_t *outSize=nullptr);
 
     PRIVATE:
+        /**
+         * What encodeLogMsgs() needs to encode the log messages of a log
+         * invocation site, copied out of its StaticLogInfo once so that
+         * encoding a log message takes a single lookup into a flat array.
+         */
+        struct EncodePlan {
+            // Compression function specialized to the site's arguments
+            StaticLogInfo::CompressionFn compressionFunction;
+
+            // Number of nibbles the site's non-string arguments need
+            int numNibbles;
+
+            // Types of the site's arguments (see StaticLogInfo::paramTypes)
+            const ParamType *paramTypes;
+        };
+
         bool encodeBufferExtentStart(uint32_t bufferId, bool wrapAround);
+        bool reserveTimeIndex();
+        uint32_t updateEncodePlans(const InvocationSiteRegistry &dictionary);
+
+        /**
+         * Returns the timestamp the first log message of a new BufferExtent
+         * is encoded relative to (see TimeIndex::baseTimestamp).
+         *
+         * \param from
+         *      Buffer of UncompressedEntry's the extent will be encoded from
+         * \param nbytes
+         *      Number of bytes in the *from buffer
+         */
+        inline uint64_t
+        getTimestampBase(const char *from, uint64_t nbytes) {
+            if (timeIndex == nullptr)
+                return 0;
+
+            // Log messages without a timestamp (TIMESTAMP_NONE) are based on
+            // the time they're compressed at instead
+            if (timeIndex->baseTimestamp == 0 &&
+                    nbytes >= sizeof(UncompressedEntry)) {
+                uint64_t timestamp =
+                    reinterpret_cast<const UncompressedEntry*>(from)->timestamp;
+                timeIndex->baseTimestamp = (timestamp != NO_TIMESTAMP)
+                                        ? timestamp
+                                        : PerfUtils::Cycles::rdtsc();
+            }
+
+            return timeIndex->baseTimestamp;
+        }
+
+        /**
+         * Gives the log messages without a timestamp (TIMESTAMP_NONE) the
+         * timestamp of the log message before them, which keeps the messages
+         * of a thread in order and packs into no bytes.
+         *
+         * \param entry
+         *      Log message about to be encoded
+         * \param lastTimestamp
+         *      Timestamp the log message is encoded relative to
+         */
+        inline void
+        fillInTimestamp(UncompressedEntry *entry, uint64_t lastTimestamp) {
+            if (entry->timestamp == NO_TIMESTAMP)
+                entry->timestamp = (lastTimestamp != 0) ? lastTimestamp
+                                                : PerfUtils::Cycles::rdtsc();
+        }
+
+        /**
+         * Records the timestamp of an entry in the TimeIndex of the buffer
+         */
+        inline void
+        indexTimestamp(uint64_t timestamp) {
+            if (timeIndex == nullptr)
+                return;
+
+            timeIndex->minTimestamp = std::min(timeIndex->minTimestamp,
+                                               timestamp);
+            timeIndex->maxTimestamp = std::max(timeIndex->maxTimestamp,
+                                               timestamp);
+        }
+
+        /**
+         * Records the log id of a log message in the LogIdSummary of the buffer
+         */
+        inline void
+        indexLogId(uint32_t logId) {
+            if (logIdSummary == nullptr)
+                return;
+
+            uint32_t bit = logId % LogIdSummary::NUM_BITS;
+            logIdSummary->logIds[bit/64] |= (1UL << (bit % 64));
+        }
+
+        /**
+         * Extends the TimeIndex of the buffer to cover everything encoded
+         */
+        inline void
+        updateTimeIndexLength() {
+            if (timeIndex)
+                timeIndex->length = static_cast<uint32_t>(
+                                writePos - reinterpret_cast<char*>(timeIndex));
+        }
 
         // Used to store the compressed log messages and related metadata
         char *backing_buffer;
@@ -673,6 +1841,9 @@ namespace Log {
         // needs to be encoded. A value of (-1) indicates no extent was encoded.
         uint32_t lastBufferIdEncoded;
 
+        // Strings interned in the current BufferExtent
+        StringInterner stringInterner;
+
         // A pointer to the last encoded BufferExtent's length to allow updating
         // the value as the user performs more encodeLogMsgs with the same id.
         uint32_t *currentExtentSize;
@@ -685,6 +1856,80 @@ namespace Log {
         // Metric: Number of consecutive encode failures due to missing metadata
         // Used to detect cases where the dictionary isn't persisted due to bugs
         uint32_t consecutiveEncodeMissesDueToMetadata;
+
+        // Indicates that each buffer's entries should be led by a TimeIndex
+        bool encodeTimeIndex;
+
+        // The TimeIndex leading the entries in the current buffer; nullptr
+        // means none were encoded yet (or encodeTimeIndex is false).
+        TimeIndex *timeIndex;
+
+        // The LogIdSummary following timeIndex (nullptr if there is none)
+        LogIdSummary *logIdSummary;
+
+        // EncodePlans of the invocation sites of encodePlansDictionary,
+        // indexed by fmtId and extended as more sites are registered.
+        std::vector<EncodePlan> encodePlans;
+
+        // Dictionary whose sites encodePlans describes
+        const InvocationSiteRegistry *encodePlansDictionary;
+
+        DISALLOW_COPY_AND_ASSIGN(Encoder);
+    };
+
+    /**
+     * Compresses the StagingBuffers of the processes that hand their
+     * compression off to an agent (see NanoLog::setCompressionAgent()), so
+     * that a host running many of them pays for one set of compression
+     * threads and output buffers rather than one per process. The agent finds
+     * the processes by the crash recovery dictionaries they leave in a shared
+     * directory, maps their StagingBuffers from their crash recovery files,
+     * and encodes them like a compression thread would, writing the log
+     * messages of each process to "<logDirectory>/nanolog.<pid>.log".
+     * StagingBuffer space is handed back to a process once its log messages
+     * are in the log file. When a process exits, the agent drains what it
+     * left behind and removes its files.
+     *
+     * The log messages of the preprocessor version of NanoLog can only be
+     * compressed by an agent built with the application's generated code.
+     */
+    class CompressionAgent {
+    PUBLIC:
+        CompressionAgent(const char *directory, const char *logDirectory);
+        ~CompressionAgent();
+
+        uint64_t poll();
+        void run(const std::atomic<bool> &stop);
+
+    PRIVATE:
+        struct AttachedBuffer;
+        struct AttachedProcess;
+
+        void scan();
+        void attachProcess(const std::string &dictionaryFile);
+        void attachBuffers(AttachedProcess *process);
+        void readDictionary(AttachedProcess *process);
+        uint64_t compress(AttachedProcess *process);
+        void flush(AttachedProcess *process);
+        void detachProcess(AttachedProcess *process, bool removeFiles);
+
+        // Directory the processes place their crash recovery files in
+        std::string directory;
+
+        // Directory the processes' log files are written to
+        std::string logDirectory;
+
+        // Processes attached to, by pid
+        std::map<uint32_t, AttachedProcess*> processes;
+
+        // Dictionaries of processes that compress their own log messages (or
+        // that can't be compressed by this agent)
+        std::set<std::string> ignoredDictionaries;
+
+        // rdtsc() of the last time the directory was scanned for processes
+        uint64_t lastScan;
+
+        DISALLOW_COPY_AND_ASSIGN(CompressionAgent);
     };
 
     /**
@@ -846,29 +2091,97 @@ namespace Log {
         Decoder();
         ~Decoder();
 
-        bool open(const char *filename);
+        bool open(const char *filename, bool memoryMap=true);
 
-        int64_t decompressUnordered(FILE *outputFd);
-        int64_t decompressTo(FILE *outputFd);
+        int64_t decompressUnordered(FILE *outputFd, uint32_t numThreads=1);
+        int64_t decompressTo(FILE *outputFd, uint32_t numThreads=1);
+        int64_t decompressRange(FILE *outputFd, double startTime,
+                                double endTime, uint32_t numThreads=1);
+
+        std::time_t getStartTime();
 
         bool getNextLogStatement(LogMessage &logMsg,
                                  FILE *outputFd= nullptr);
 
+        bool follow();
+        bool waitForData(uint32_t timeoutMs);
+
+        int64_t exportColumns(const char *outputDir);
+        int64_t exportTrace(FILE *outputFd);
+        int64_t aggregate(FILE *outputFd, const char *query);
+
+        /**
+         * Appends the text for an object of a user-defined type (see
+         * NanoLog::Serializer) to out.
+         *
+         * \param out
+         *      String to append the text to
+         * \param data
+         *      Bytes the object was serialized as
+         * \param length
+         *      Number of bytes in data
+         */
+        typedef void (*TypeFormatter)(std::string &out, const char *data,
+                                      size_t length);
+
+        static void registerTypeFormatter(const char *typeName,
+                                          TypeFormatter formatter);
+        static void formatUserType(const char *str, std::string &out);
+
+        /**
+         * Selects the log messages that the Decoder outputs by their log
+         * statement. A log message is output if it matches all the criteria
+         * that are set; the default LogFilter matches every log message.
+         */
+        struct LogFilter {
+            LogFilter()
+                : logIds()
+                , maxLogLevel(NanoLog::DEBUG)
+                , fileGlob()
+            {}
+
+            // Log ids of the log statements to output (empty for any)
+            std::set<uint32_t> logIds;
+
+            // Least severe log level to output, i.e. WARNING outputs the
+            // WARNING and ERROR log messages
+            NanoLog::LogLevel maxLogLevel;
+
+            // fnmatch() pattern the source file of the log statements must
+            // match (empty for any)
+            std::string fileGlob;
+        };
+
+        void setLogFilter(const LogFilter &filter);
+
+        static int64_t decompressMerged(FILE *outputFd,
+                                const std::vector<std::string> &logFiles,
+                                const LogFilter &filter=LogFilter());
+
+        static void setArrayFormat(const char *integerFormat,
+                                   const char *floatingPointFormat,
+                                   const char *separator);
+        static uint32_t getArrayLength(const char *str);
+        static void formatArray(const char *str, std::string &out);
+
     PRIVATE:
         /**
          * Reads and stores a BufferExtent from the compressed log and
          * facilitates the interpretation of the log messages contained in the
-         * extent.
+         * extent. If the log file is memory mapped, the BufferFragment is
+         * only a view into the mapping and no bytes are copied.
          */
         struct BufferFragment {
-            // Stores the bytes in a compressed log BufferExtent. The size is
-            // chosen to be a little bigger than the size of a runtime
-            // StagingBuffer to account for any other entries that may be
-            // inserted at runtime.
-            char storage[NanoLogConfig::STAGING_BUFFER_SIZE
-                                             + BufferExtent::maxSizeOfHeader()];
-
-            // Number of valid bytes in storage.
+            // Stores a copy of the bytes in a compressed log BufferExtent if
+            // the extent is not memory mapped. The buffer is grown to fit the
+            // length recorded in each extent's header since the runtime's
+            // buffer sizes are configurable.
+            char *storage;
+
+            // Number of bytes allocated for storage
+            uint64_t capacity;
+
+            // Number of valid bytes in the extent
             uint64_t validBytes;
 
             // The runtime StagingBuffer id associated with this extent.
@@ -878,8 +2191,8 @@ namespace Log {
             // keep track of a read position within the buffer
             const char *readPos;
 
-            // Marks the first invalid byte in storage
-            char *endOfBuffer;
+            // Marks the first invalid byte in the extent
+            const char *endOfBuffer;
 
             // Indicates if there are more log messages that can be decompressed
             bool hasMoreLogs;
@@ -889,37 +2202,291 @@ namespace Log {
             uint32_t nextLogId;
             uint64_t nextLogTimestamp;
 
+            // Human-readable text of all the log messages in the extent if
+            // they were formatted ahead of time by formatAll(). A nullptr
+            // means the messages are decompressed one at a time instead.
+            char *formattedText;
+
+            // Number of bytes in formattedText
+            size_t formattedTextBytes;
+
+            // Describes a log message in formattedText
+            struct FormattedLog {
+                // Timestamp and log id of the log message
+                uint64_t timestamp;
+                uint32_t logId;
+
+                // Offset of the first byte past its text
+                size_t end;
+            };
+
+            // Each log message in formattedText, in order
+            std::vector<FormattedLog> formattedLogs;
+
+            // Index of the next formattedLogs entry to be output
+            size_t nextFormattedLog;
+
+            // Strings interned in the extent by its StringInterner, in the
+            // order of their ids
+            std::vector<const char*> internedStrings;
+
             BufferFragment();
+            ~BufferFragment();
             void reset();
             bool hasNext();
-            bool readBufferExtent(FILE *fd, bool *wrapAround=nullptr);
+            bool formatAll(const WallClock &wallClock,
+                           std::vector<void*>& fmtId2metadata,
+                           const std::vector<CompiledFormat> *compiledFormats
+                                                                =nullptr);
+            bool readBufferExtent(FILE *fd, bool *wrapAround=nullptr,
+                                  const char *fileMapping=nullptr,
+                                  uint64_t fileMappingBytes=0,
+                                  uint64_t timestampBase=0);
             bool decompressNextLogStatement(FILE *outputFd,
                                  uint64_t &logMsgsProcessed,
                                  LogMessage &logArguments,
-                                 const Checkpoint &checkpoint,
+                                 const WallClock &wallClock,
                                  std::vector<void*>& fmtId2metadata,
                                  long aggregationFilterId=-1,
-                                 void (*aggregationFn)(const char*, ...)=NULL);
+                                 void (*aggregationFn)(const char*, ...)=NULL,
+                                 const std::vector<CompiledFormat>
+                                                    *compiledFormats=nullptr);
             uint64_t getNextLogTimestamp() const;
+
+            DISALLOW_COPY_AND_ASSIGN(BufferFragment);
+        };
+
+        /**
+         * Buffers the log messages of one format id in columns and appends
+         * them to a table file (see ColumnTableHeader) in ColumnRowGroups.
+         */
+        class ColumnTable {
+        PUBLIC:
+            ColumnTable(const char *path, uint32_t fmtId,
+                        const void *formatMetadata,
+                        const std::string &formatString);
+
+            bool append(LogMessage &logMsg, int64_t timestamp,
+                        uint32_t runtimeId);
+            bool flush();
+
+            // Indicates that the table file could not be created or written
+            bool failed;
+
+        PRIVATE:
+            // Table file to append to
+            std::string path;
+
+            // FormatType of each argument column
+            std::vector<uint8_t> argTypes;
+
+            // Number of rows buffered in the columns
+            uint32_t numRows;
+
+            // Contents of the timestamp, runtimeId and argument columns
+            // buffered, in that order. String columns only hold characters.
+            std::vector<std::string> columns;
+
+            // Byte offsets of each string buffered in a string column
+            // (empty for the other columns)
+            std::vector<std::vector<uint64_t>> stringOffsets;
+
+            DISALLOW_COPY_AND_ASSIGN(ColumnTable);
         };
 
+        /**
+         * Groups log messages by their log ids, runtime ids and/or typed
+         * arguments and computes aggregates over one numeric argument of the
+         * messages in each group, for aggregate(). Queries take the form
+         *
+         *  [group by <key>[, <key>]...;] <aggregate>[, <aggregate>]...
+         *                                                    [of arg[<n>]]
+         *
+         * where a key is "logId", "runtimeId" or "arg[<n>]" (0-based) and an
+         * aggregate is "count", "sum", "min", "max", "mean" or "p<percentile>"
+         * (i.e. "p50" or "p99.9"). Log messages that lack any of the
+         * arguments referenced or whose aggregated argument is not numeric
+         * are left out.
+         */
+        class Aggregation {
+        PUBLIC:
+            Aggregation();
+
+            bool parse(const char *query);
+            bool add(LogMessage &logMsg, const std::vector<uint8_t> &argTypes,
+                     uint32_t execution, uint32_t runtimeId,
+                     const void *formatMetadata,
+                     const std::string &formatString);
+            void print(FILE *outputFd);
+
+        PRIVATE:
+            // What a group by key of the query is taken from
+            enum KeyType {
+                LOG_ID,
+                RUNTIME_ID,
+                ARGUMENT,
+            };
+
+            struct Key {
+                KeyType type;
+
+                // Argument index for ARGUMENT keys
+                int arg;
+            };
+
+            // Aggregates the query can compute for each group
+            enum Function {
+                COUNT,
+                SUM,
+                MIN,
+                MAX,
+                MEAN,
+                PERCENTILE,
+            };
+
+            struct Aggregate {
+                Function function;
+
+                // Percentile (0, 100] for PERCENTILE aggregates
+                double percentile;
+            };
+
+            // Running aggregates of the log messages in one group
+            struct Group {
+                Group()
+                    : keyText()
+                    , count(0)
+                    , sum(0)
+                    , min(0)
+                    , max(0)
+                    , values()
+                {}
+
+                // Human-readable value of each key of the group
+                std::vector<std::string> keyText;
+
+                // Number of log messages in the group
+                uint64_t count;
+
+                // Sum, minimum and maximum of the aggregated argument
+                double sum;
+                double min;
+                double max;
+
+                // Every value of the aggregated argument; only kept when
+                // the query has percentiles
+                std::vector<double> values;
+            };
+
+            // Keys to group the log messages by, in the order of the query
+            std::vector<Key> keys;
+
+            // Aggregates to compute, in the order of the query
+            std::vector<Aggregate> aggregates;
+
+            // Argument the aggregates other than count are computed over;
+            // -1 means the query only counts
+            int valueArg;
+
+            // Indicates the query has percentiles and the values of the
+            // aggregated argument must be kept
+            bool keepValues;
+
+            // Groups in the order their first log message was added
+            std::vector<Group> groups;
+
+            // Maps the binary encoding of the keys of a group to its index
+            // in groups
+            std::unordered_map<std::string, size_t> groupIndex;
+
+            // Human-readable value and description (source location and
+            // format string) of each logId key value in the order they were
+            // added, printed after the groups
+            std::vector<std::pair<std::string, std::string>> logIdNames;
+
+            // Maps each (execution, logId) key value to its index in
+            // logIdNames
+            std::map<std::pair<uint32_t, uint32_t>, size_t> logIdIndex;
+
+            // Scratch buffer the keys of the log message being added are
+            // encoded into
+            std::string keyBuffer;
+
+            DISALLOW_COPY_AND_ASSIGN(Aggregation);
+        };
+
+        struct BlockStream;
+        struct MergeStream;
+
         static bool compareBufferFragments(const BufferFragment *a,
                                            const BufferFragment *b);
 
+        static bool compareDroppedLogs(const DroppedLogs &a,
+                                       const DroppedLogs &b);
+
+        void formatBufferFragments(std::vector<BufferFragment*> &fragments,
+                                   uint32_t numThreads);
+        void unmapFile();
+
+        /**
+         * Returns the memory mapping BufferExtents can be read from in
+         * place, or nullptr if they have to be read through inputFd. Offsets
+         * in inputFd no longer correspond to the file once CompressedBlocks
+         * were inflated into it.
+         */
+        inline const char *
+        getFileMapping() const {
+            return (blockStream == nullptr) ? fileMapping : nullptr;
+        }
+
+        double getWallTime(uint64_t timestamp) const;
+        bool inTimeRange(uint64_t timestamp) const;
+        void outputNextLogStatement(BufferFragment *bf, FILE *outputFd,
+                                LogMessage &logArgs,
+                                long aggregationFilterId=-1,
+                                void (*aggregationFn)(const char*, ...)=NULL);
+        bool readTimeIndex(FILE *fd);
+        void updateLogFilterMatches();
+        bool matchesLogFilter(uint32_t logId);
+        bool skipFilteredLogStatements(BufferFragment *bf, LogMessage &logArgs);
+        uint64_t getTimestampBase();
+        bool readCompressedBlock();
+        bool nextEntryIsComplete();
+        bool reopenRotatedFile();
+        void watchFile();
         bool readDictionary(FILE *fd, bool flushOldDictionary);
         bool readDictionaryFragment(FILE *fd);
+        void compileFormats();
+        bool readDroppedLogs(FILE *fd, DroppedLogs &droppedLogs);
+        void printDroppedLogs(FILE *outputFd, const DroppedLogs &droppedLogs);
+        void writeTraceEvent(const std::string &event);
+        bool readClockCalibration(FILE *fd);
 
         BufferFragment *allocateBufferFragment();
         void freeBufferFragment(BufferFragment *bf);
         bool internalDecompressUnordered(FILE *outputFd,
                                 uint32_t aggregationTargetId=-1,
-                                void (*aggregationFn)(const char*,...)=nullptr);
+                                void (*aggregationFn)(const char*,...)=nullptr,
+                                uint32_t numThreads=1);
 
         static bool createMicroCode(char **microCode,
                                      const char *formatString,
                                      const char *filename,
                                      uint32_t linenum,
-                                     uint8_t severity);
+                                     uint8_t severity,
+                                     bool internedStrings=false,
+                                     NanoLog::TimestampSource timestampSource=
+                                                    NanoLog::TIMESTAMP_RDTSC,
+                                     const uint8_t *argStorage=nullptr,
+                                     size_t numArgStorage=0);
+
+        // Number of BufferFragments to read ahead per thread before they are
+        // formatted in parallel when decompressing with more than one thread.
+        static const uint32_t FRAGMENTS_PER_THREAD = 8;
+
+        // Maximum number of rows exportColumns() buffers per table before
+        // writing them out as a ColumnRowGroup.
+        static const uint32_t ROWS_PER_ROW_GROUP = 64*1024;
 
         // The symbolic file being operated on by the decoder. A string of
         // length 0 indicates that no valid file is currently opened.
@@ -928,6 +2495,21 @@ namespace Log {
         // The handle for the log file currently being operated on
         FILE *inputFd;
 
+        // Read-only memory mapping of the log file that BufferFragments
+        // point into rather than copying the BufferExtents out of inputFd.
+        // A nullptr indicates the file is read only through inputFd.
+        const char *fileMapping;
+
+        // Number of bytes mapped in fileMapping; BufferExtents appended to
+        // the file after it was open()-ed are read through inputFd instead.
+        uint64_t fileMappingBytes;
+
+        // Inflates the CompressedBlocks found in the log file back into
+        // inputFd, which wraps the file once the first one is read (see
+        // readCompressedBlock()); nullptr means none were found so far. It
+        // is owned and freed by inputFd.
+        BlockStream *blockStream;
+
         // The number of log messages that has been outputted from the
         // current file
         uint64_t logMsgsPrinted;
@@ -943,6 +2525,10 @@ namespace Log {
         // if inputFd is nullptr.
         Checkpoint checkpoint;
 
+        // Converts the timestamps of the current execution to wall times,
+        // starting from the checkpoint above
+        WallClock wallClock;
+
         // Maintains a list of BufferFragments that are unused. These buffers
         // will be freed upon destruction of the Decoder object.
         std::vector<BufferFragment*> freeBuffers;
@@ -954,6 +2540,10 @@ namespace Log {
         // built from FormatMetadata's.
         std::vector<std::string> fmtId2fmtString;
 
+        // Mapping of fmtId to the compiled form of its FormatMetadata; this
+        // is kept in step with fmtId2metadata by compileFormats().
+        std::vector<CompiledFormat> fmtId2compiledFormat;
+
         // Contains the raw metadata to interpret log messages,
         // directly read from the log file
         char *rawMetadata;
@@ -964,9 +2554,76 @@ namespace Log {
         // Metric: Number of BufferFragment's read in the decompression
         uint32_t numBufferFragmentsRead;
 
+        // Metric: Number of log messages the runtime reported as dropped
+        uint64_t numLogMsgsDropped;
+
         // Metric: Number of Checkpoint's read in the decompression
         uint32_t numCheckpointsRead;
 
+        // Indicates that only the log messages between timeRangeStart and
+        // timeRangeEnd (inclusive, in seconds since the epoch) are output
+        // by decompressRange().
+        bool timeRangeSet;
+        double timeRangeStart;
+        double timeRangeEnd;
+
+        // Log messages to output (see setLogFilter()) and whether it leaves
+        // any of them out
+        LogFilter logFilter;
+        bool logFilterSet;
+
+        // Whether each log id of the current execution matches logFilter;
+        // extended by updateLogFilterMatches() as the dictionary grows.
+        std::vector<bool> logFilterMatches;
+
+        // Bitmap of the log ids in logFilterMatches that match, laid out
+        // like LogIdSummary::logIds
+        uint64_t logFilterSummary[LogIdSummary::NUM_BITS/64];
+
+        // Metric: Number of TimeIndex'es whose entries were seeked past
+        // because they fell outside the time range or log filter
+        uint32_t numTimeIndexesSkipped;
+
+        // TimeIndex::baseTimestamp of the last TimeIndex read and the
+        // position in inputFd past the last entry it covers
+        uint64_t timestampBase;
+        long timestampBaseEnd;
+
+        // Largest TimeIndex::flushedUpTo read in the log of the current
+        // execution (0 if its TimeIndex'es don't keep track)
+        uint64_t flushedUpTo;
+
+        // Metric: Number of CompressedBlocks inflated
+        uint32_t numCompressedBlocksRead;
+
+        // Metric: Number of log messages decompressed but not output because
+        // they fell outside the time range
+        uint64_t numLogMsgsOutOfRange;
+
+        // Metric: Number of log messages decompressed but not output because
+        // they did not match the log filter
+        uint64_t numLogMsgsFiltered;
+
+        // Collects the text of the log messages output for decompressMerged()
+        // along with their wall times; nullptr when outputting directly.
+        MergeStream *mergeStream;
+
+        // Trace that exportTrace() writes the events to, i.e. for the
+        // DroppedLogs markers, and the number of events in it so far;
+        // nullptr when not exporting.
+        FILE *traceFd;
+        uint64_t numTraceEvents;
+
+        // Indicates that the log file is still being written to, so the end
+        // of the file is not the end of the log (see follow()).
+        bool following;
+
+        // inotify instance that reports changes to the log file while
+        // following it and the watch on the file (-1 if there are none, in
+        // which case waitForData() polls the file instead).
+        int inotifyFd;
+        int inotifyWatch;
+
         DISALLOW_COPY_AND_ASSIGN(Decoder);
     };
 }; /* namespace Log */
@@ -0,0 +1,325 @@
+/* Copyright (c) 2016-2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Log.h"
+
+using namespace NanoLogInternal::Log;
+
+// Set by SIGINT/SIGTERM to stop the collector
+static std::atomic<bool> stopRequested(false);
+
+/**
+ * Signal handler that asks the collector to close its log files and exit.
+ */
+static void
+stopCollector(int)
+{
+    stopRequested = true;
+}
+
+/**
+ * A connection from a process streaming its log (see
+ * NanoLog::setLogCollector()).
+ */
+struct Connection {
+    // Socket the log is streamed over
+    int fd;
+
+    // The CollectorHello leading the stream and how much of it was received
+    CollectorHello hello;
+    size_t helloBytes;
+
+    // Log file the stream is written to once the hello is received
+    int logFd;
+
+    explicit Connection(int fd)
+        : fd(fd)
+        , hello()
+        , helloBytes(0)
+        , logFd(-1)
+    {}
+};
+
+/**
+ * Creates the log file for a connection whose CollectorHello was received.
+ * A file of the same name (i.e. left over from an earlier run) is never
+ * overwritten; a ".<n>" suffix is added instead.
+ *
+ * \param outputDir
+ *      Directory to create the log file in
+ * \param hello
+ *      Hello the connection started with
+ *
+ * \return
+ *      File descriptor of the log file, or -1 if it could not be created
+ */
+static int
+openLogFile(const char *outputDir, const CollectorHello &hello)
+{
+    std::string hostname(hello.hostname,
+                         strnlen(hello.hostname, sizeof(hello.hostname)));
+    for (char &c : hostname) {
+        if (c == '/')
+            c = '_';
+    }
+    if (hostname.empty())
+        hostname = "unknown";
+
+    std::string path = std::string(outputDir) + "/nanolog." + hostname + "."
+                        + std::to_string(hello.pid) + "."
+                        + std::to_string(hello.connection) + ".log";
+
+    std::string candidate = path;
+    for (int n = 1; n < 1000; ++n) {
+        int fd = open(candidate.c_str(),
+                      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd >= 0) {
+            printf("Collecting %s\r\n", candidate.c_str());
+            return fd;
+        }
+
+        if (errno != EEXIST)
+            break;
+        candidate = path + "." + std::to_string(n);
+    }
+
+    fprintf(stderr, "Unable to create %s: %s\r\n", candidate.c_str(),
+            strerror(errno));
+    return -1;
+}
+
+/**
+ * Reads what has arrived on a connection and writes it to its log file.
+ *
+ * \param outputDir
+ *      Directory to create the connection's log file in
+ * \param conn
+ *      Connection that is readable
+ *
+ * \return
+ *      False if the connection should be closed
+ */
+static bool
+collect(const char *outputDir, Connection &conn)
+{
+    static char buffer[1 << 16];
+
+    ssize_t bytesRead = read(conn.fd, buffer, sizeof(buffer));
+    if (bytesRead <= 0)
+        return bytesRead < 0 && (errno == EINTR || errno == EAGAIN);
+
+    const char *data = buffer;
+    size_t bytesLeft = static_cast<size_t>(bytesRead);
+
+    if (conn.helloBytes < sizeof(CollectorHello)) {
+        size_t bytes = std::min(bytesLeft,
+                                sizeof(CollectorHello) - conn.helloBytes);
+        memcpy(reinterpret_cast<char*>(&conn.hello) + conn.helloBytes,
+               data, bytes);
+        conn.helloBytes += bytes;
+        data += bytes;
+        bytesLeft -= bytes;
+
+        if (conn.helloBytes < sizeof(CollectorHello))
+            return true;
+
+        if (strncmp(conn.hello.magic, "NLCOLL1", sizeof(conn.hello.magic))) {
+            fprintf(stderr, "Dropping a connection that is not a NanoLog "
+                            "stream\r\n");
+            return false;
+        }
+
+        conn.logFd = openLogFile(outputDir, conn.hello);
+        if (conn.logFd < 0)
+            return false;
+    }
+
+    while (bytesLeft > 0) {
+        ssize_t bytesWritten = write(conn.logFd, data, bytesLeft);
+        if (bytesWritten < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Unable to write to the log file");
+            return false;
+        }
+
+        data += bytesWritten;
+        bytesLeft -= bytesWritten;
+    }
+
+    return true;
+}
+
+/**
+ * Creates the socket the collector accepts connections on, preferring one
+ * that accepts both IPv6 and IPv4.
+ *
+ * \param port
+ *      TCP port to listen on
+ *
+ * \return
+ *      The listening socket, or -1 on failure
+ */
+static int
+listenOn(uint16_t port)
+{
+    int one = 1;
+    int zero = 0;
+
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                 sizeof(addr)) == 0 && listen(fd, SOMAXCONN) == 0)
+            return fd;
+
+        close(fd);
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) == 0 && listen(fd, SOMAXCONN) == 0)
+        return fd;
+
+    close(fd);
+    return -1;
+}
+
+/**
+ * Prints the usage information to stdout.
+ *
+ * \param exe
+ *      Name of the executable
+ */
+void printHelp(const char *exe) {
+    printf("Collect the logs streamed by processes that called\r\n"
+           "NanoLog::setLogCollector(), writing each connection to\r\n"
+           "\"<outputDir>/nanolog.<hostname>.<pid>.<connection>.log\"\r\n"
+           "until interrupted. The files are decompressed like any other\r\n"
+           "NanoLog log file:\r\n");
+    printf("\t%s <port> <outputDir>\r\n\r\n", exe);
+}
+
+/**
+ * Simple program that receives the compressed logs that NanoLog streams over
+ * TCP and stores them as log files.
+ */
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        printHelp(argv[0]);
+        exit(1);
+    }
+
+    char *end;
+    unsigned long port = strtoul(argv[1], &end, 10);
+    if (*end != '\0' || port == 0 || port > 65535) {
+        printf("Invalid port: %s\r\n\r\n", argv[1]);
+        printHelp(argv[0]);
+        exit(1);
+    }
+
+    const char *outputDir = argv[2];
+
+    int listenFd = listenOn(static_cast<uint16_t>(port));
+    if (listenFd < 0) {
+        perror("Unable to listen for log collector connections");
+        exit(1);
+    }
+
+    // Not SA_RESTART, so that poll() returns to check stopRequested
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopCollector;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    std::vector<Connection> connections;
+    std::vector<struct pollfd> pollFds;
+    while (!stopRequested) {
+        pollFds.clear();
+        pollFds.push_back({listenFd, POLLIN, 0});
+        for (Connection &conn : connections)
+            pollFds.push_back({conn.fd, POLLIN, 0});
+
+        if (poll(pollFds.data(), pollFds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Log collector poll failed");
+            break;
+        }
+
+        // Connections are visited back to front so that closing one doesn't
+        // shift the ones not visited yet.
+        for (size_t i = connections.size(); i > 0; --i) {
+            Connection &conn = connections[i - 1];
+            if (pollFds[i].revents == 0 || collect(outputDir, conn))
+                continue;
+
+            close(conn.fd);
+            if (conn.logFd >= 0)
+                close(conn.logFd);
+            connections.erase(connections.begin() + (i - 1));
+        }
+
+        if (pollFds[0].revents & POLLIN) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0)
+                connections.emplace_back(fd);
+        }
+    }
+
+    for (Connection &conn : connections) {
+        close(conn.fd);
+        if (conn.logFd >= 0)
+            close(conn.logFd);
+    }
+    close(listenFd);
+
+    return 0;
+}
@@ -14,12 +14,18 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <vector>
 
+#include <csignal>
 #include <cstdarg>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "Log.h"
 #include "Cycles.h"
@@ -109,6 +115,174 @@ void runRCDF(std::vector<uint64_t> timeDeltas, double cyclesPerSecond) {
            1e9*PerfUtils::Cycles::toSeconds(sum/timeDeltas.size(), cyclesPerSecond));
 }
 
+/**
+ * Parses a local wall time in the format of the decompressed log messages,
+ * i.e. "YYYY-MM-DD HH:MM:SS[.fraction]". The date may be omitted, in which
+ * case the time is taken to be on the day the log file started.
+ *
+ * \param str
+ *      String to parse
+ * \param logStartTime
+ *      Wall time the log file started at (seconds since epoch)
+ * \param[out] wallTime
+ *      Seconds since epoch of the time parsed
+ *
+ * \return
+ *      true if the string was parsed; false if it is malformed
+ */
+bool
+parseWallTime(const char *str, std::time_t logStartTime, double *wallTime)
+{
+    std::tm tm;
+    memset(&tm, 0, sizeof(tm));
+
+    const char *rest = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+    if (rest == nullptr) {
+        localtime_r(&logStartTime, &tm);
+        rest = strptime(str, "%H:%M:%S", &tm);
+        if (rest == nullptr)
+            return false;
+    }
+
+    double fraction = 0;
+    if (*rest == '.') {
+        char *end;
+        fraction = strtod(rest, &end);
+        rest = end;
+    }
+
+    if (*rest != '\0')
+        return false;
+
+    tm.tm_isdst = -1;
+    *wallTime = static_cast<double>(mktime(&tm)) + fraction;
+    return true;
+}
+
+/**
+ * Removes the log filter options (see printHelp()) from the command line
+ * arguments after the log file and adds them to a LogFilter.
+ *
+ * \param[in,out] argc
+ *      Number of arguments; reduced by the number of arguments removed
+ * \param argv
+ *      Arguments; the ones that remain are moved to the front
+ * \param[out] filter
+ *      LogFilter to add the options to
+ *
+ * \return
+ *      true if the options were parsed; false if one is malformed
+ */
+bool
+parseLogFilter(int *argc, char **argv, Decoder::LogFilter *filter)
+{
+    static const char *levels[] = {"ERROR", "WARNING", "NOTICE", "DEBUG"};
+    int remaining = 3;
+
+    for (int i = 3; i < *argc; ++i) {
+        const char *option = argv[i];
+        if (strcmp(option, "--logId") != 0 && strcmp(option, "--level") != 0
+                && strcmp(option, "--file") != 0) {
+            argv[remaining++] = argv[i];
+            continue;
+        }
+
+        if (++i >= *argc) {
+            printf("Missing the value of %s\r\n", option);
+            return false;
+        }
+
+        const char *value = argv[i];
+        if (strcmp(option, "--logId") == 0) {
+            long long logId;
+            try {
+                logId = std::stoll(value);
+            } catch (const std::exception& e) {
+                printf("Invalid logId, please enter a number: %s\r\n", value);
+                return false;
+            }
+
+            if (logId < 0 || logId > UINT32_MAX) {
+                printf("The logId is out of range: %s\r\n", value);
+                return false;
+            }
+
+            filter->logIds.insert(static_cast<uint32_t>(logId));
+        } else if (strcmp(option, "--level") == 0) {
+            size_t level = 0;
+            while (level < sizeof(levels)/sizeof(*levels) &&
+                   strcmp(value, levels[level]) != 0)
+                ++level;
+
+            if (level == sizeof(levels)/sizeof(*levels)) {
+                printf("Invalid log level: %s\r\n", value);
+                return false;
+            }
+
+            filter->maxLogLevel = static_cast<NanoLog::LogLevel>(
+                                                    NanoLog::ERROR + level);
+        } else {
+            filter->fileGlob = value;
+        }
+    }
+
+    *argc = remaining;
+    return true;
+}
+
+/**
+ * Adds a log file to merge, or all the files in it if it's a directory (in
+ * the order of their names).
+ *
+ * \param path
+ *      Path of the log file or directory
+ * \param[out] logFiles
+ *      Paths of the log files to merge
+ *
+ * \return
+ *      true if successful; false if the directory could not be read
+ */
+bool
+addLogFiles(const char *path, std::vector<std::string> *logFiles)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        logFiles->push_back(path);
+        return true;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == nullptr) {
+        printf("Unable to read the directory %s\r\n", path);
+        return false;
+    }
+
+    std::vector<std::string> files;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string file = std::string(path) + "/" + entry->d_name;
+        if (entry->d_name[0] != '.' && stat(file.c_str(), &st) == 0 &&
+                S_ISREG(st.st_mode))
+            files.push_back(file);
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    logFiles->insert(logFiles->end(), files.begin(), files.end());
+    return true;
+}
+
+// Set by SIGINT/SIGTERM to stop the compression agent
+static std::atomic<bool> agentStopRequested(false);
+
+/**
+ * Signal handler that asks the compression agent to finish up and exit.
+ */
+static void
+stopAgent(int)
+{
+    agentStopRequested = true;
+}
+
 /**
  * Prints the usage information to stdout.
  *
@@ -120,11 +294,74 @@ void printHelp(const char *exe) {
                 "the NanoLog System\r\n\r\n");
 
     printf("Decompress the log file into a human-readable format:\r\n");
-    printf("\t%s decompress <logFile>\r\n\r\n", exe);
+    printf("\t%s decompress <logFile> [numThreads]\r\n\r\n", exe);
 
     printf("Decompress the log file into a sorted human-readable format \r\n"
            "without sorting the messages by time:\r\n");
-    printf("\t%s decompressUnordered <logFile>\r\n\r\n", exe);
+    printf("\t%s decompressUnordered <logFile> [numThreads]\r\n\r\n", exe);
+
+    printf("Decompress only the log messages between two local times in\r\n"
+           "the format \"[YYYY-MM-DD ]HH:MM:SS[.fraction]\" (the date\r\n"
+           "defaults to the day the log started) into a sorted\r\n"
+           "human-readable format:\r\n");
+    printf("\t%s range <logFile> <startTime> <endTime> [numThreads]\r\n\r\n",
+           exe);
+
+    printf("The optional numThreads (default 1) formats the log messages\r\n"
+           "in parallel with that many threads.\r\n\r\n");
+
+    printf("The 3 commands above also take options that only print the log\r\n"
+           "messages of some log statements and skip the parts of the log\r\n"
+           "without any. --logId may be repeated and --level prints the\r\n"
+           "messages at that level or above:\r\n");
+    printf("\t[--logId <logId>] [--level <ERROR|WARNING|NOTICE|DEBUG>] "
+           "[--file <fileGlob>]\r\n\r\n");
+
+    printf("Decompress multiple log files (i.e. one per process, or the\r\n"
+           "rotations of a log file) into one sorted human-readable format\r\n"
+           "with each line tagged by the name of its log file. A directory\r\n"
+           "stands for all the files in it. Takes the options above too:\r\n");
+    printf("\t%s merge <logFile|directory> [...]\r\n\r\n", exe);
+
+    printf("Follow a log file that is still being written to and print its\r\n"
+           "log messages as they are logged, starting from the end of the\r\n"
+           "file and moving on to the new file if it is rotated:\r\n");
+    printf("\t%s tail -f <logFile>\r\n\r\n", exe);
+
+    printf("Export the log messages as binary tables with one typed column\r\n"
+           "per argument, one table per log format, to a directory. Only\r\n"
+           "works with logs produced by the C++17 version of NanoLog:\r\n");
+    printf("\t%s export <logFile> <outputDir>\r\n\r\n", exe);
+
+    printf("Export the log messages, and the PerfUtils::TimeTrace records\r\n"
+           "logged after NanoLog::routeTimeTrace(), as a trace with one\r\n"
+           "track per thread that ui.perfetto.dev and chrome://tracing can\r\n"
+           "open. Only works with logs produced by the C++17 version of\r\n"
+           "NanoLog:\r\n");
+    printf("\t%s trace <logFile> <outputFile>\r\n\r\n", exe);
+
+    printf("Aggregate the typed arguments of the log messages without\r\n"
+           "formatting them, grouping by any of logId, runtimeId and\r\n"
+           "arg[<n>] (0-based) and computing any of count, sum, min, max,\r\n"
+           "mean and p<percentile> of one numeric argument, e.g.\r\n"
+           "\"group by logId, arg[2]; count, sum, p50, p99 of arg[1]\". Only\r\n"
+           "works with logs produced by the C++17 version of NanoLog:\r\n");
+    printf("\t%s query <logFile> \"[group by <key>, ...;] "
+           "<aggregate>, ... [of arg[<n>]]\"\r\n\r\n", exe);
+
+    printf("Recover the log messages left in the StagingBuffers of a\r\n"
+           "process that crashed after\r\n"
+           "NanoLog::setCrashRecoveryDirectory() into a new log file;\r\n"
+           "the prefix is \"<directory>/nanolog.<pid>\".\r\n"
+           "The last messages logged before the crash may also be in the\r\n"
+           "process's own log file:\r\n");
+    printf("\t%s recover <recoveryPrefix> <outputLogFile>\r\n\r\n", exe);
+
+    printf("Run the compression agent of the processes that called\r\n"
+           "NanoLog::setCompressionAgent() with the recoveryDirectory,\r\n"
+           "writing their log messages to\r\n"
+           "\"<logDirectory>/nanolog.<pid>.log\" until interrupted:\r\n");
+    printf("\t%s agent <recoveryDirectory> <logDirectory>\r\n\r\n", exe);
 
     printf("Create an RCDF of the inter-log invocation times. Only works\r\n");
     printf("when there is one runtime logging thread:\r\n");
@@ -162,12 +399,122 @@ int main(int argc, char** argv) {
     bool doRCDF = false;
     FILE *outputFd = NULL;
     int filterId = -1;
-
-    if (strcmp(command, "decompress") == 0) {
-        outputFd = stdout;
-        sorted = true;
-    } else if (strcmp(command, "decompressUnordered") == 0) {
+    int numThreads = 1;
+    bool range = false;
+    bool tail = false;
+    const char *exportDir = nullptr;
+    const char *traceFile = nullptr;
+    const char *query = nullptr;
+    Decoder::LogFilter logFilter;
+
+    if (strcmp(command, "decompress") == 0 ||
+            strcmp(command, "decompressUnordered") == 0 ||
+            strcmp(command, "range") == 0) {
         outputFd = stdout;
+        sorted = (strcmp(command, "decompressUnordered") != 0);
+        range = (strcmp(command, "range") == 0);
+
+        if (!parseLogFilter(&argc, argv, &logFilter))
+            exit(-1);
+
+        int threadsArg = 3;
+        if (range) {
+            if (argc < 5) {
+                printHelp(argv[0]);
+                exit(1);
+            }
+
+            threadsArg = 5;
+        }
+
+        if (argc > threadsArg) {
+            try {
+                numThreads = std::stoi(argv[threadsArg]);
+            } catch (const std::exception& e) {
+                printf("Invalid numThreads, please enter a number: %s\r\n",
+                       argv[threadsArg]);
+                exit(-1);
+            }
+
+            if (numThreads < 1) {
+                printf("The numThreads must be positive: %s\r\n",
+                       argv[threadsArg]);
+                exit(-1);
+            }
+        }
+    } else if (strcmp(command, "merge") == 0) {
+        if (!parseLogFilter(&argc, argv, &logFilter))
+            exit(-1);
+
+        std::vector<std::string> logFiles;
+        for (int i = 2; i < argc; ++i) {
+            if (!addLogFiles(argv[i], &logFiles))
+                exit(1);
+        }
+
+        int64_t numLogMsgs = Decoder::decompressMerged(stdout, logFiles,
+                                                       logFilter);
+        if (numLogMsgs < 0)
+            exit(1);
+
+        printf("\r\n\r\n# Decompression Complete after printing "
+               "%ld log messages\r\n", numLogMsgs);
+        return 0;
+    } else if (strcmp(command, "tail") == 0) {
+        if (argc < 4 || strcmp(argv[2], "-f") != 0) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        logFileName = argv[3];
+        tail = true;
+    } else if (strcmp(command, "export") == 0) {
+        if (argc < 4) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        exportDir = argv[3];
+    } else if (strcmp(command, "trace") == 0) {
+        if (argc < 4) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        traceFile = argv[3];
+    } else if (strcmp(command, "query") == 0) {
+        if (argc < 4) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        query = argv[3];
+    } else if (strcmp(command, "recover") == 0) {
+        if (argc < 4) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        // There's no log file to open; the log is rebuilt from the buffers
+        int64_t numLogMsgs = recoverStagingBuffers(argv[2], argv[3]);
+        if (numLogMsgs < 0)
+            exit(1);
+
+        printf("# Recovery Complete after writing %ld log messages to %s\r\n",
+               numLogMsgs, argv[3]);
+        return 0;
+    } else if (strcmp(command, "agent") == 0) {
+        if (argc < 4) {
+            printHelp(argv[0]);
+            exit(1);
+        }
+
+        signal(SIGINT, stopAgent);
+        signal(SIGTERM, stopAgent);
+
+        CompressionAgent agent(argv[2], argv[3]);
+        agent.run(agentStopRequested);
+        return 0;
     }  else if (strcmp(command, "rcdfTime") == 0) {
         doRCDF = true;
     } else if (strcmp(command, "minMaxMean") == 0) {
@@ -203,6 +550,7 @@ int main(int argc, char** argv) {
     }
 
     Decoder decoder;
+    decoder.setLogFilter(logFilter);
     if(!decoder.open(logFileName)) {
         printf("Unable to open file %s\r\n", logFileName);
         exit(1);
@@ -213,7 +561,64 @@ int main(int argc, char** argv) {
         return 0;
     }
 
+    if (exportDir) {
+        int64_t numLogMsgs = decoder.exportColumns(exportDir);
+        if (numLogMsgs < 0) {
+            printf("Unable to export %s to %s\r\n", logFileName, exportDir);
+            exit(1);
+        }
+
+        printf("# Export Complete after writing %ld log messages to %s\r\n",
+               numLogMsgs, exportDir);
+        return 0;
+    }
+
+    if (traceFile) {
+        FILE *traceFd = fopen(traceFile, "w");
+        if (traceFd == NULL) {
+            printf("Unable to open file %s\r\n", traceFile);
+            exit(1);
+        }
+
+        int64_t numLogMsgs = decoder.exportTrace(traceFd);
+        fclose(traceFd);
+        if (numLogMsgs < 0) {
+            printf("Unable to export %s to %s\r\n", logFileName, traceFile);
+            exit(1);
+        }
+
+        printf("# Export Complete after writing %ld log messages to %s\r\n",
+               numLogMsgs, traceFile);
+        return 0;
+    }
+
+    if (query) {
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        int64_t numLogMsgs = decoder.aggregate(stdout, query);
+        uint64_t stop = PerfUtils::Cycles::rdtsc();
+        if (numLogMsgs < 0)
+            exit(1);
+
+        printf("\r\n# Query Complete after aggregating %ld log messages "
+               "in %0.2lf seconds\r\n", numLogMsgs,
+               PerfUtils::Cycles::toSeconds(stop - start));
+        return 0;
+    }
+
     LogMessage args;
+    if (tail) {
+        decoder.follow();
+
+        // Skip over the log messages that were already in the file
+        while (decoder.getNextLogStatement(args));
+
+        while (true) {
+            while (decoder.getNextLogStatement(args, stdout));
+            fflush(stdout);
+            decoder.waitForData(100);
+        }
+    }
+
     if (doRCDF) {
         uint64_t start = PerfUtils::Cycles::rdtsc();
         std::vector<uint64_t> interLogTimes;
@@ -254,8 +659,30 @@ int main(int argc, char** argv) {
         return 0;
     }
 
+    if (range) {
+        double startTime, endTime;
+        for (int i = 3; i <= 4; ++i) {
+            if (!parseWallTime(argv[i], decoder.getStartTime(),
+                               (i == 3) ? &startTime : &endTime)) {
+                printf("Invalid time, please use the format "
+                       "\"[YYYY-MM-DD ]HH:MM:SS[.fraction]\": %s\r\n",
+                       argv[i]);
+                exit(-1);
+            }
+        }
+
+        int64_t numLogMsgs = decoder.decompressRange(outputFd,
+                                        startTime, endTime,
+                                        static_cast<uint32_t>(numThreads));
+
+        fprintf(outputFd, "\r\n\r\n# Decompression Complete after printing "
+                          "%ld log messages\r\n", numLogMsgs);
+        return 0;
+    }
+
     if (sorted) {
-        int64_t numLogMsgs = decoder.decompressTo(outputFd);
+        int64_t numLogMsgs = decoder.decompressTo(outputFd,
+                                        static_cast<uint32_t>(numThreads));
 
         if (outputFd)
             fprintf(outputFd, "\r\n\r\n# Decompression Complete after printing "
@@ -264,6 +691,12 @@ int main(int argc, char** argv) {
     }
 
     // Perform no aggregation but decompress unsorted.
+    if (filterId < 0 && numThreads > 1) {
+        decoder.decompressUnordered(outputFd,
+                                    static_cast<uint32_t>(numThreads));
+        return 0;
+    }
+
     if (filterId < 0) {
         int64_t numLogMsgs = 0;
         while(decoder.getNextLogStatement(args, outputFd))
@@ -19,11 +19,19 @@
 #include <cstdio>
 #include <vector>
 #include <sstream>
+#include <thread>
+
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+
+#include <sys/mman.h>
 
 #include "gtest/gtest.h"
 
 #include "TestUtil.h"
 
+#include "BlockCodec.h"
 #include "RuntimeLogger.h"
 #include "Packer.h"
 #include "Log.h"
@@ -37,6 +45,7 @@ extern int __fmtId__I32have32an32integer3237d__testHelper47client46cc__28__; //
 extern int __fmtId__I32have32a32uint6495t3237lu__testHelper47client46cc__29__; // testHelper/client.cc:29 "I have a uint64_t %lu"
 extern int __fmtId__I32have32a32double3237lf__testHelper47client46cc__30__; // testHelper/client.cc:30 "I have a double %lf"
 extern int __fmtId__I32have32a32couple32of32things3237d443237f443237u443237s__testHelper47client46cc__31__; // testHelper/client.cc:31 "I have a couple of things %d, %f, %u, %s"
+extern int __fmtId__Warning32Level__testHelper47client46cc__25__; // testHelper/client.cc:25 "Warning Level"
 
 
 namespace {
@@ -46,25 +55,12 @@ using namespace NanoLogInternal;
 using namespace Log;
 
 void stopCompressionThread() {
-    {
-        std::lock_guard<std::mutex> lock(
-                RuntimeLogger::nanoLogSingleton.condMutex);
-        RuntimeLogger::nanoLogSingleton.compressionThreadShouldExit = true;
-        RuntimeLogger::nanoLogSingleton.workAdded.notify_all();
-    }
-
-    if (RuntimeLogger::nanoLogSingleton.compressionThread.joinable()) {
-        RuntimeLogger::nanoLogSingleton.compressionThread.join();
-    }
+    RuntimeLogger::nanoLogSingleton.stopCompressionThreads();
 }
 
 void restartCompressionThread() {
     stopCompressionThread();
-
-    RuntimeLogger::nanoLogSingleton.compressionThreadShouldExit = false;
-    RuntimeLogger::nanoLogSingleton.compressionThread =
-            std::thread(&RuntimeLogger::compressionThreadMain,
-                        &RuntimeLogger::nanoLogSingleton);
+    RuntimeLogger::nanoLogSingleton.startCompressionThreads(false);
 }
 
 // The fixture for testing class Foo.
@@ -81,6 +77,7 @@ int integerParamId = __fmtId__I32have32an32integer3237d__testHelper47client46cc_
 int uint64_tParamId = __fmtId__I32have32a32uint6495t3237lu__testHelper47client46cc__29__;
 int doubleParamId = __fmtId__I32have32a32double3237lf__testHelper47client46cc__30__;
 int mixParamId = __fmtId__I32have32a32couple32of32things3237d443237f443237u443237s__testHelper47client46cc__31__;
+int warningId = __fmtId__Warning32Level__testHelper47client46cc__25__;
 LogTest()
 {
     char dictionary[4096];
@@ -359,16 +356,67 @@ TEST_F(LogTest, encoder_constructor) {
     EXPECT_EQ(sizeof(buffer), e.endOfBuffer - e.backing_buffer);
 }
 
+TEST_F(LogTest, InvocationSiteRegistry) {
+    InvocationSiteRegistry registry;
+    NanoLogInternal::ParamType paramTypes[10];
+    EXPECT_EQ(0U, registry.size());
+
+    EXPECT_EQ(0U, registry.add(StaticLogInfo(nullptr, "File", 1, 0, "Hi",
+                                             0, 0, paramTypes)));
+    EXPECT_EQ(1U, registry.size());
+    EXPECT_EQ(1U, registry[0].lineNum);
+    EXPECT_STREQ("Hi", registry[0].formatString);
+
+    // An identifier that's allocated, but not yet published, holds back
+    // the entries after it
+    ++registry.nextId;
+    EXPECT_EQ(2U, registry.add(StaticLogInfo(nullptr, "File", 3, 0, "Hi",
+                                             0, 0, paramTypes)));
+    EXPECT_EQ(1U, registry.size());
+
+    new (registry.getChunk(0)[1].storage) StaticLogInfo(nullptr, "File", 2, 0,
+                                                        "Hi", 0, 0,
+                                                        paramTypes);
+    registry.getChunk(0)[1].published = true;
+    EXPECT_EQ(3U, registry.size());
+    EXPECT_EQ(3U, registry.numPublished);
+
+    // Register from many threads at once, spilling into more chunks
+    const uint32_t numThreads = 8;
+    const uint32_t sitesPerThread = 1000;
+    std::vector<std::thread> threads;
+    std::vector<std::vector<uint32_t>> ids(numThreads);
+    for (uint32_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (uint32_t i = 0; i < sitesPerThread; ++i) {
+                ids[t].push_back(registry.add(StaticLogInfo(nullptr, "File",
+                                        1000*t + i, 0, "Hi", 0, 0,
+                                        paramTypes)));
+                registry.size();
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    ASSERT_EQ(3 + numThreads*sitesPerThread, registry.size());
+    for (uint32_t t = 0; t < numThreads; ++t) {
+        for (uint32_t i = 0; i < sitesPerThread; ++i)
+            EXPECT_EQ(1000*t + i, registry[ids[t][i]].lineNum);
+    }
+}
+
 TEST_F(LogTest, encodeNewDictionaryEntries) {
     char buffer[10*1024];
     uint32_t currentPos = 0;
 
-    std::vector<StaticLogInfo> meta;
+    InvocationSiteRegistry meta;
 
     NanoLogInternal::ParamType paramTypes[10];
-    meta.emplace_back(nullptr, "File", 123, 0, "Hello World", 0, 0, paramTypes);
-    meta.emplace_back(nullptr, "FileA", 99, 2, "Hello World %s", 0, 0, paramTypes);
-    meta.emplace_back(nullptr, "FileC", 125, 3, "Hello World %%d", 0, 0, paramTypes);
+    meta.add(StaticLogInfo(nullptr, "File", 123, 0, "Hello World", 0, 0, paramTypes));
+    meta.add(StaticLogInfo(nullptr, "FileA", 99, 2, "Hello World %s", 0, 0, paramTypes));
+    meta.add(StaticLogInfo(nullptr, "FileC", 125, 3, "Hello World %%d", 0, 0, paramTypes));
 
     // Not enough space, even for a dictionary fragment
     Encoder noSpaceEncoder(buffer, 1, true);
@@ -420,7 +468,7 @@ TEST_F(LogTest, encodeNewDictionaryEntries) {
     EXPECT_EQ(buffer + expectedSize, readPos);
 
     // Now let's add another entry to make sure it makes it in okay
-    meta.emplace_back(nullptr, "BLALKSD", 125, 3, "H %%d", 0, 0, paramTypes);
+    meta.add(StaticLogInfo(nullptr, "BLALKSD", 125, 3, "H %%d", 0, 0, paramTypes));
     expectedSize = sizeof(DictionaryFragment)
                     + sizeof(CompressedLogInfo)
                     + strlen(meta[3].filename) + 1
@@ -454,7 +502,7 @@ TEST_F(LogTest, encodeNewDictionaryEntries) {
     // One last entry, but this time we'll run out of space after encoding
     // the dictionary fragment header
     encoder.endOfBuffer = encoder.writePos + sizeof(DictionaryFragment) + 1;
-    meta.emplace_back(nullptr, "BLALKSD", 125, 3, "H %%d", 0, 0, paramTypes);
+    meta.add(StaticLogInfo(nullptr, "BLALKSD", 125, 3, "H %%d", 0, 0, paramTypes));
     EXPECT_EQ(sizeof(DictionaryFragment),
                 encoder.encodeNewDictionaryEntries(currentPos, meta));
 
@@ -468,6 +516,35 @@ TEST_F(LogTest, encodeNewDictionaryEntries) {
 
 }
 
+TEST_F(LogTest, encodeNewDictionaryEntries_timestampSources) {
+    char buffer[1024];
+    uint32_t currentPos = 0;
+
+    InvocationSiteRegistry meta;
+    NanoLogInternal::ParamType paramTypes[1];
+    for (int source = 0; source < NanoLog::NUM_TIMESTAMP_SOURCES; ++source) {
+        meta.add(StaticLogInfo(nullptr, "File", 1, 3, "Hi", 0, 0, paramTypes,
+                        nullptr, false,
+                        static_cast<NanoLog::TimestampSource>(source)));
+    }
+
+    Encoder encoder(buffer, sizeof(buffer), true);
+    encoder.encodeNewDictionaryEntries(currentPos, meta);
+    EXPECT_EQ(NanoLog::NUM_TIMESTAMP_SOURCES, currentPos);
+
+    // The source shares the severity byte without changing the severity
+    char *readPos = buffer + sizeof(DictionaryFragment);
+    for (size_t i = 0; i < meta.size(); ++i) {
+        CompressedLogInfo *cli = reinterpret_cast<CompressedLogInfo*>(readPos);
+        readPos += sizeof(CompressedLogInfo) + cli->filenameLength
+                                             + cli->formatStringLength;
+
+        EXPECT_EQ(3, cli->severity & SEVERITY_MASK);
+        EXPECT_EQ(meta[i].timestampSource,
+                  unpackTimestampSource(cli->severity));
+    }
+}
+
 TEST_F(LogTest, encodeLogMsgs) {
     char inputBuffer[100], outputBuffer1[1000];
 
@@ -785,6 +862,97 @@ TEST_F(LogTest, encodeBufferExtentStart_outtaSpace) {
     EXPECT_EQ(nullptr, encoder.currentExtentSize);
 }
 
+TEST_F(LogTest, StringInterner) {
+    StringInterner interner;
+    char buffer[4*StringInterner::MAX_STRINGS*8];
+    char *out = buffer;
+
+    // New strings are led by a 0, later occurrences are their id
+    interner.encode("hostA", 5, &out);
+    EXPECT_EQ(7, out - buffer);
+    EXPECT_EQ(0, buffer[0]);
+    EXPECT_STREQ("hostA", buffer + 1);
+
+    interner.encode("hostB-and-more", 5, &out);
+    EXPECT_EQ(14, out - buffer);
+    EXPECT_EQ(0, buffer[7]);
+    EXPECT_STREQ("hostB", buffer + 8);
+
+    interner.encode("hostA", 5, &out);
+    interner.encode("hostB", 5, &out);
+    interner.encode("", 0, &out);
+    interner.encode("", 0, &out);
+    ASSERT_EQ(19, out - buffer);
+    EXPECT_EQ(1, buffer[14]);
+    EXPECT_EQ(2, buffer[15]);
+    EXPECT_EQ(0, buffer[16]);
+    EXPECT_EQ(0, buffer[17]);
+    EXPECT_EQ(3, buffer[18]);
+
+    // A reset forgets the strings
+    interner.reset();
+    out = buffer;
+    interner.encode("hostA", 5, &out);
+    EXPECT_EQ(7, out - buffer);
+    EXPECT_EQ(0, buffer[0]);
+
+    // Strings past the limit are never interned
+    interner.reset();
+    out = buffer;
+    char str[8];
+    for (uint32_t i = 0; i <= StringInterner::MAX_STRINGS; ++i) {
+        snprintf(str, sizeof(str), "%u", i);
+        interner.encode(str, static_cast<uint32_t>(strlen(str)), &out);
+    }
+
+    char *end = out;
+    interner.encode("0", 1, &out);
+    EXPECT_EQ(1, out - end);
+    EXPECT_EQ(1, end[0]);
+
+    snprintf(str, sizeof(str), "%u", StringInterner::MAX_STRINGS);
+    end = out;
+    interner.encode(str, static_cast<uint32_t>(strlen(str)), &out);
+    EXPECT_EQ(strlen(str) + 2, static_cast<size_t>(out - end));
+    EXPECT_EQ(0, end[0]);
+}
+
+TEST_F(LogTest, StringInterner_encodeInPlace) {
+    StringInterner interner;
+    char buffer[100];
+    char *out = buffer;
+
+    // The string is left where it was written and interned as usual
+    strcpy(buffer + 1, "0a1b");
+    interner.encodeInPlace(4, &out);
+    EXPECT_EQ(6, out - buffer);
+    EXPECT_EQ(0, buffer[0]);
+    EXPECT_STREQ("0a1b", buffer + 1);
+
+    interner.encode("0a1b", 4, &out);
+    EXPECT_EQ(7, out - buffer);
+    EXPECT_EQ(1, buffer[6]);
+
+    strcpy(out + 1, "0a1b");
+    interner.encodeInPlace(4, &out);
+    EXPECT_EQ(8, out - buffer);
+    EXPECT_EQ(1, buffer[7]);
+}
+
+TEST_F(LogTest, encodeHexDump) {
+    char buffer[100];
+    char *out = buffer;
+
+    encodeHexDump("\x00\x7f\xab\xff", 4, &out);
+    EXPECT_EQ(9, out - buffer);
+    EXPECT_STREQ("007fabff", buffer);
+
+    out = buffer;
+    encodeHexDump("", 0, &out);
+    EXPECT_EQ(1, out - buffer);
+    EXPECT_STREQ("", buffer);
+}
+
 TEST_F(LogTest, swapBuffer) {
     char buffer1[1000], buffer2[100];
     Encoder encoder(buffer1, 1000, false, true);
@@ -805,6 +973,42 @@ TEST_F(LogTest, swapBuffer) {
     EXPECT_EQ(nullptr, encoder.currentExtentSize);
 }
 
+TEST_F(LogTest, encodeCheckpoint) {
+    char buffer1[1000], buffer2[1000];
+    uint64_t compressedLogs = 0;
+    Encoder encoder(buffer1, sizeof(buffer1), true, false, true);
+
+    // Checkpoints can only lead a buffer
+    UncompressedEntry ue;
+    ue.fmtId = noParamsId;
+    ue.timestamp = 100;
+    ue.entrySize = sizeof(UncompressedEntry);
+    EXPECT_LT(0, encoder.encodeLogMsgs(reinterpret_cast<char*>(&ue),
+                                       sizeof(ue), 1, false, &compressedLogs));
+    size_t encodedBytes = encoder.getEncodedBytes();
+    EXPECT_FALSE(encoder.encodeCheckpoint());
+    EXPECT_EQ(encodedBytes, encoder.getEncodedBytes());
+
+    // ... and precede the TimeIndex of the buffer
+    encoder.swapBuffer(buffer2, sizeof(buffer2));
+    EXPECT_TRUE(encoder.encodeCheckpoint());
+    EXPECT_EQ(EntryType::CHECKPOINT, peekEntryType(buffer2));
+    Checkpoint *checkpoint = reinterpret_cast<Checkpoint*>(buffer2);
+    size_t checkpointBytes = sizeof(Checkpoint) + checkpoint->newMetadataBytes;
+    EXPECT_EQ(checkpointBytes, encoder.getEncodedBytes());
+
+    EXPECT_LT(0, encoder.encodeLogMsgs(reinterpret_cast<char*>(&ue),
+                                       sizeof(ue), 1, false, &compressedLogs));
+    EXPECT_EQ(reinterpret_cast<TimeIndex*>(buffer2 + checkpointBytes),
+              encoder.timeIndex);
+
+    // Not enough space
+    char buffer3[sizeof(Checkpoint) - 1];
+    encoder.swapBuffer(buffer3, sizeof(buffer3));
+    EXPECT_FALSE(encoder.encodeCheckpoint());
+    EXPECT_EQ(0U, encoder.getEncodedBytes());
+}
+
 TEST_F(LogTest, Decoder_open) {
     char buffer[1000];
     const char *testFile = "/tmp/testFile";
@@ -848,6 +1052,14 @@ TEST_F(LogTest, Decoder_open) {
     EXPECT_TRUE(dc.open(testFile));
     EXPECT_NE(nullptr, dc.inputFd);
     EXPECT_STREQ(testFile, dc.filename.c_str());
+    EXPECT_NE(nullptr, dc.fileMapping);
+    EXPECT_EQ(encoder.getEncodedBytes(), dc.fileMappingBytes);
+
+    // Reopening without memory mapping should release the old mapping
+    EXPECT_TRUE(dc.open(testFile, false));
+    EXPECT_NE(nullptr, dc.inputFd);
+    EXPECT_EQ(nullptr, dc.fileMapping);
+    EXPECT_EQ(0U, dc.fileMappingBytes);
 
     std::remove(testFile);
 }
@@ -921,6 +1133,7 @@ TEST_F(LogTest, decoder_readDictionary) {
     fm->numNibbles = 1;
     fm->numPrintFragments = 2;
     fm->logLevel = 2;
+    fm->timestampSource = NanoLog::TIMESTAMP_RDTSC;
     fm->lineNumber = 1234;
     fm->filenameLength = sizeof("asdfasdfasdf");
     writePos = stpcpy(fm->filename, "asdfasdfasdf") + 1;
@@ -930,6 +1143,7 @@ TEST_F(LogTest, decoder_readDictionary) {
     pf->argType = NanoLogInternal::Log::FormatType::double_t;
     pf->hasDynamicPrecision = true;
     pf->hasDynamicWidth = true;
+    pf->internedString = false;
     pf->fragmentLength = sizeof("abab %*.*lf");
     writePos = stpcpy(writePos, "abab %*.*lf") + 1;
 
@@ -938,6 +1152,7 @@ TEST_F(LogTest, decoder_readDictionary) {
     pf->argType = NONE;
     pf->hasDynamicPrecision = false;
     pf->hasDynamicWidth = false;
+    pf->internedString = false;
     pf->fragmentLength = sizeof("abab");
     writePos = stpcpy(writePos, "abab") + 1;
 
@@ -948,6 +1163,7 @@ TEST_F(LogTest, decoder_readDictionary) {
     fm2->numNibbles = 1;
     fm2->numPrintFragments = 1;
     fm2->logLevel = 2;
+    fm2->timestampSource = NanoLog::TIMESTAMP_RDTSC;
     fm2->lineNumber = 1234;
     fm2->filenameLength = sizeof("asdfasdfasdf");
     writePos = stpcpy(fm2->filename, "asdfasdfasdf") + 1;
@@ -957,6 +1173,7 @@ TEST_F(LogTest, decoder_readDictionary) {
     pf->argType = NONE;
     pf->hasDynamicPrecision = false;
     pf->hasDynamicWidth = false;
+    pf->internedString = false;
     pf->fragmentLength = sizeof("asdflkaldfjasfdlasdfjal;sdfjaslkdfas");
     writePos = stpcpy(writePos, "asdflkaldfjasfdlasdfjal;sdfjaslkdfas") + 1;
 
@@ -1294,6 +1511,62 @@ TEST_F(LogTest, Decoder_readBufferExtent_end2end) {
     std::remove(testFile);
 }
 
+TEST_F(LogTest, Decoder_readBufferExtent_memoryMapped) {
+    const char *testFile = "/tmp/testFile";
+    char inputBuffer[100], outputBuffer1[1000];
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->timestamp = 100;
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+
+    uint64_t compressedLogs = 0;
+    Encoder e(outputBuffer1, 1000, true);
+    e.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry), 5, false,
+                    &compressedLogs);
+    EXPECT_EQ(1U, compressedLogs);
+    long extentBytes = e.getEncodedBytes();
+
+    // Write the extent twice
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer1, extentBytes);
+    oFile.write(outputBuffer1, extentBytes);
+    oFile.close();
+
+    FILE *in = fopen(testFile, "rb");
+    ASSERT_TRUE(in);
+    void *mapping = mmap(NULL, 2*extentBytes, PROT_READ, MAP_SHARED,
+                         fileno(in), 0);
+    ASSERT_NE(MAP_FAILED, mapping);
+    const char *fileMapping = static_cast<const char*>(mapping);
+
+    // Pretend the second extent was only partially there when mapped
+    uint64_t mappedBytes = extentBytes + sizeof(BufferExtent) - 1;
+
+    // The first extent is used in place
+    Decoder::BufferFragment *bf = new Decoder::BufferFragment();
+    ASSERT_TRUE(bf->readBufferExtent(in, nullptr, fileMapping, mappedBytes));
+    EXPECT_EQ(nullptr, bf->storage);
+    EXPECT_EQ(fileMapping + extentBytes, bf->endOfBuffer);
+    EXPECT_EQ(extentBytes, ftell(in));
+    EXPECT_EQ(5U, bf->runtimeId);
+    EXPECT_EQ(100UL, bf->nextLogTimestamp);
+
+    // The second one falls back to a copy
+    ASSERT_TRUE(bf->readBufferExtent(in, nullptr, fileMapping, mappedBytes));
+    EXPECT_NE(nullptr, bf->storage);
+    EXPECT_EQ(bf->storage + extentBytes, bf->endOfBuffer);
+    EXPECT_EQ(2*extentBytes, ftell(in));
+    EXPECT_EQ(5U, bf->runtimeId);
+    EXPECT_EQ(100UL, bf->nextLogTimestamp);
+
+    delete bf;
+    munmap(mapping, 2*extentBytes);
+    fclose(in);
+    std::remove(testFile);
+}
+
 TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     const char *testFile = "/tmp/testFile";
     char inputBuffer[100], goodBuffer[1000], badBuffer[100];
@@ -1349,7 +1622,7 @@ TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     BufferExtent *be = reinterpret_cast<BufferExtent*>(badBuffer);
     be->entryType = EntryType::BUFFER_EXTENT;
     be->isShort = true;
-    be->length = sizeof(bf->storage) + 1;
+    be->length = NanoLogConfig::MAX_OUTPUT_BUFFER_SIZE + 1;
     be->threadIdOrPackNibble = 1;
     be->wrapAround = false;
 
@@ -1374,7 +1647,7 @@ TEST_F(LogTest, Decoder_readBufferExtent_notEnoughSpace) {
     be = reinterpret_cast<BufferExtent*>(badBuffer);
     be->entryType = EntryType::BUFFER_EXTENT;
     be->isShort = true;
-    be->length = sizeof(bf->storage) + 1;
+    be->length = NanoLogConfig::MAX_OUTPUT_BUFFER_SIZE + 1;
     be->threadIdOrPackNibble = 1;
     be->wrapAround = false;
     ++be;
@@ -1440,6 +1713,7 @@ TEST_F(LogTest, decompressNextLogStatement) {
     uint64_t logMsgsPrinted = 0;
     Checkpoint checkpoint;
     checkpoint.cyclesPerSecond = 1;
+    WallClock wallClock(checkpoint);
     long aggregationFilterId = stringParamId;
     numAggregationsRun = 0;
     std::vector<void*> fmtId2metadata;
@@ -1447,7 +1721,7 @@ TEST_F(LogTest, decompressNextLogStatement) {
     EXPECT_TRUE(bf->decompressNextLogStatement(NULL,
                                                 logMsgsPrinted,
                                                 logArguments,
-                                                checkpoint,
+                                                wallClock,
                                                 fmtId2metadata,
                                                 aggregationFilterId,
                                                 &aggregation));
@@ -1457,7 +1731,7 @@ TEST_F(LogTest, decompressNextLogStatement) {
     EXPECT_TRUE(bf->decompressNextLogStatement(NULL,
                                                 logMsgsPrinted,
                                                 logArguments,
-                                                checkpoint,
+                                                wallClock,
                                                 fmtId2metadata,
                                                 aggregationFilterId,
                                                 &aggregation));
@@ -1468,7 +1742,7 @@ TEST_F(LogTest, decompressNextLogStatement) {
     EXPECT_FALSE(bf->decompressNextLogStatement(NULL,
                                                 logMsgsPrinted,
                                                 logArguments,
-                                                checkpoint,
+                                                wallClock,
                                                 fmtId2metadata,
                                                 aggregationFilterId,
                                                 &aggregation));
@@ -1910,17 +2184,17 @@ TEST_F(LogTest, Decoder_internalDecompress_fileBreaks) {
     std::remove(decomp);
 }
 
-TEST_F(LogTest, Decoder_decompressNextLogStatement_timeTravel) {
-    // Tests what happen when the checkpoint is newer than the log message.
+TEST_F(LogTest, Decoder_decompressTo_laterStagesDepletedFirst) {
+    // Each of the first three extents starts a new pass and thus closes a
+    // stage. The 2nd and 3rd stages are depleted before the 1st, and the
+    // last extent must still be output after the decoder shifts the stages.
     char inputBuffer[1000], outputBuffer[1000];
     const char *testFile = "/tmp/testFile";
     const char *decomp = "/tmp/testFile2";
-    LogMessage logMsg;
 
-    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
-    ue->timestamp = 10e9;
-    ue->fmtId = noParamsId;
-    ue->entrySize = sizeof(UncompressedEntry);
+    uint64_t timestamps[] = {500, 10, 20, 600};
+    uint32_t bufferIds[] = {1, 2, 3, 1};
+    bool newPass[] = {true, true, true, false};
 
     uint64_t compressedLogs = 0;
     Encoder encoder(outputBuffer, 1000);
@@ -1928,198 +2202,1081 @@ TEST_F(LogTest, Decoder_decompressNextLogStatement_timeTravel) {
     // Hack to load fake Checkpoint values to get a consistent time output
     Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
     checkpoint->cyclesPerSecond = 1e9;
-    checkpoint->rdtsc = 20e9;
-    checkpoint->unixTime = 30;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
 
-    long bytesRead = encoder.encodeLogMsgs(inputBuffer,
-                                                    sizeof(UncompressedEntry),
-                                                    1,
-                                                    false,
-                                                    &compressedLogs);
-    EXPECT_EQ(1, compressedLogs);
-    EXPECT_EQ(sizeof(UncompressedEntry), bytesRead);
+    for (int i = 0; i < 4; ++i) {
+        UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(
+                                                                inputBuffer);
+        ue->timestamp = timestamps[i];
+        ue->fmtId = noParamsId;
+        ue->entrySize = sizeof(UncompressedEntry);
+
+        EXPECT_EQ(sizeof(UncompressedEntry),
+                  encoder.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                        bufferIds[i], newPass[i],
+                                        &compressedLogs));
+    }
+    EXPECT_EQ(4, compressedLogs);
 
     std::ofstream oFile;
     oFile.open(testFile);
     oFile.write(outputBuffer, encoder.getEncodedBytes());
     oFile.close();
 
-    // Now let's attempt to parse it back and decompress it to decomp
     Decoder dc;
     ASSERT_TRUE(dc.open(testFile));
     FILE *outputFd = fopen(decomp, "w");
     ASSERT_NE(nullptr, outputFd);
-    EXPECT_TRUE(dc.internalDecompressUnordered(outputFd));
-    EXPECT_EQ(1, dc.logMsgsPrinted);
+    EXPECT_EQ(4, dc.decompressTo(outputFd));
+    EXPECT_EQ(4, dc.numBufferFragmentsRead);
     fclose(outputFd);
 
-    // Read it back and compare
-    std::ifstream iFile;
-    iFile.open(decomp);
-    ASSERT_TRUE(iFile.good());
-
     const char* expectedLines[] = {
-        "1969-12-31 16:00:20.000000000 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
+        "1969-12-31 16:00:01.000000010 testHelper/client.cc:20 NOTICE[2]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000020 testHelper/client.cc:20 NOTICE[3]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000500 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000600 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
     };
 
+    std::ifstream iFile;
     std::string iLine;
-    for (const char *line : expectedLines) {
-        ASSERT_TRUE(iFile.good());
-        std::getline(iFile, iLine);
-        EXPECT_STREQ(line, iLine.c_str());
-    }
-    EXPECT_FALSE(iFile.eof());
-    iFile.close();
-
-    // Try iterative interface
-    dc.open(testFile);
-
-    outputFd = fopen(decomp, "w");
-    ASSERT_NE(nullptr, outputFd);
-    while (dc.getNextLogStatement(logMsg, outputFd));
-    EXPECT_EQ(1, dc.logMsgsPrinted);
-    EXPECT_EQ(1, dc.numBufferFragmentsRead);
-    EXPECT_EQ(1, dc.numCheckpointsRead);
-    fclose(outputFd);
-
-    iFile.open(decomp);
-    for (const char *line : expectedLines) {
-        ASSERT_TRUE(iFile.good());
-        std::getline(iFile, iLine);
-        EXPECT_STREQ(line, iLine.c_str());
-    }
-    EXPECT_FALSE(iFile.eof());
-    iFile.close();
-
-    // Try the ordered case
-    dc.open(testFile);
-
-    outputFd = fopen(decomp, "w");
-    ASSERT_NE(nullptr, outputFd);
-    dc.decompressTo(outputFd);
-    EXPECT_EQ(1, dc.logMsgsPrinted);
-    EXPECT_EQ(1, dc.numBufferFragmentsRead);
-    EXPECT_EQ(1, dc.numCheckpointsRead);
-    fclose(outputFd);
-
     iFile.open(decomp);
     for (const char *line : expectedLines) {
         ASSERT_TRUE(iFile.good());
         std::getline(iFile, iLine);
         EXPECT_STREQ(line, iLine.c_str());
     }
-    EXPECT_FALSE(iFile.eof());
     iFile.close();
 
     std::remove(testFile);
     std::remove(decomp);
 }
 
-TEST_F(LogTest, Decoder_getNextLogStatement) {
-    // First we have to create a log file with encoder.
+TEST_F(LogTest, Decoder_decompress_parallel) {
+    // Enough extents for several rounds of read ahead, with the timestamps
+    // of each pass interleaved across the buffers.
+    char inputBuffer[1000], outputBuffer[8192];
     const char *testFile = "/tmp/testFile";
     const char *decomp = "/tmp/testFile2";
-    char inputBuffer[1000], buffer[1000];
-    Encoder encoder(buffer, 1000, false, true);
+    const int numExtents = 100;
+    const int logsPerExtent = 3;
+
+    uint64_t compressedLogs = 0;
+    Encoder encoder(outputBuffer, sizeof(outputBuffer));
 
     // Hack to load fake Checkpoint values to get a consistent time output
-    Checkpoint *checkpoint = (Checkpoint *) encoder.backing_buffer;
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
     checkpoint->cyclesPerSecond = 1e9;
     checkpoint->rdtsc = 0;
     checkpoint->unixTime = 1;
 
-    char *writePos = inputBuffer;
-    UncompressedEntry *ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 10;
-    ue->fmtId = integerParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
-    writePos += ue->entrySize;
-    *((int*)(ue->argData)) = 1;
+    for (int i = 0; i < numExtents; ++i) {
+        uint32_t bufferId = i%4;
+        for (int j = 0; j < logsPerExtent; ++j) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(
+                                    inputBuffer + j*sizeof(UncompressedEntry));
+            ue->timestamp = 1000*(i/4) + 10*j + (3 - bufferId);
+            ue->fmtId = noParamsId;
+            ue->entrySize = sizeof(UncompressedEntry);
+        }
+
+        ASSERT_EQ(logsPerExtent*sizeof(UncompressedEntry),
+                  encoder.encodeLogMsgs(inputBuffer,
+                                        logsPerExtent*sizeof(UncompressedEntry),
+                                        bufferId, bufferId == 3,
+                                        &compressedLogs));
+    }
+    EXPECT_EQ(numExtents*logsPerExtent, compressedLogs);
 
-    ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 20;
-    ue->fmtId = integerParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
-    writePos += ue->entrySize;
-    *((int*)(ue->argData)) = -2;
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer, encoder.getEncodedBytes());
+    oFile.close();
 
-    ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 30;
-    ue->fmtId = uint64_tParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(uint64_t);
-    writePos += ue->entrySize;
-    *((uint64_t*)(ue->argData)) = 3;
+    auto decompress = [&](bool sorted, uint32_t numThreads) {
+        Decoder dc;
+        EXPECT_TRUE(dc.open(testFile));
+        FILE *outputFd = fopen(decomp, "w");
+        EXPECT_NE(nullptr, outputFd);
+        if (sorted)
+            EXPECT_EQ(numExtents*logsPerExtent,
+                      dc.decompressTo(outputFd, numThreads));
+        else
+            EXPECT_EQ(numExtents*logsPerExtent,
+                      dc.decompressUnordered(outputFd, numThreads));
+        EXPECT_EQ(numExtents, dc.numBufferFragmentsRead);
+        fclose(outputFd);
 
-    ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 40;
-    ue->fmtId = doubleParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(double);
-    writePos += ue->entrySize;
-    *((double*)(ue->argData)) = 4.0;
+        std::ifstream iFile(decomp);
+        std::stringstream contents;
+        contents << iFile.rdbuf();
+        return contents.str();
+    };
 
-    // Note; this one is special since it has multiple args
-    const char *strParam = "eight point oh";
-    ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 50;
-    ue->fmtId = mixParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int) + sizeof(double) + sizeof(uint32_t) + strlen(strParam) + 1;
-    writePos += sizeof(UncompressedEntry);
+    std::string sorted = decompress(true, 1);
+    std::string unordered = decompress(false, 1);
+    EXPECT_NE(sorted, unordered);
 
-    *(reinterpret_cast<int*>(writePos)) = 5;
-    writePos += sizeof(int);
+    for (uint32_t numThreads : {2, 3, 16}) {
+        EXPECT_EQ(sorted, decompress(true, numThreads));
+        EXPECT_EQ(unordered, decompress(false, numThreads));
+    }
 
-    *(reinterpret_cast<double*>(writePos)) = 6.0;
-    writePos += sizeof(double);
+    std::remove(testFile);
+    std::remove(decomp);
+}
 
-    *(reinterpret_cast<uint32_t*>(writePos)) = 7;
-    writePos += sizeof(uint32_t);
+TEST_F(LogTest, Encoder_timeIndex) {
+    char inputBuffer[1000], outputBuffer[1000], outputBuffer2[1000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    uint64_t compressedLogs = 0;
 
-    strcpy(writePos, strParam);
-    writePos += strlen(strParam) + 1;
+    auto encode = [&](Encoder &encoder, uint32_t bufferId,
+                      std::vector<uint64_t> timestamps) {
+        char *pos = inputBuffer;
+        for (uint64_t timestamp : timestamps) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(pos);
+            ue->timestamp = timestamp;
+            ue->fmtId = noParamsId;
+            ue->entrySize = sizeof(UncompressedEntry);
+            pos += sizeof(UncompressedEntry);
+        }
+
+        return encoder.encodeLogMsgs(inputBuffer, pos - inputBuffer, bufferId,
+                                     false, &compressedLogs);
+    };
 
-    // Finally, finish it off with a final double to make sure strings work
-    ue = reinterpret_cast<UncompressedEntry *>(writePos);
-    ue->timestamp = 60;
-    ue->fmtId = doubleParamId;
-    ue->entrySize = sizeof(UncompressedEntry) + sizeof(double);
-    writePos += ue->entrySize;
-    *((double*)(ue->argData)) = 9.0;
+    // First buffer: Checkpoint, then the TimeIndex covering two extents
+    Encoder encoder(outputBuffer, sizeof(outputBuffer), false, false, true);
+    size_t checkpointBytes = encoder.getEncodedBytes();
+    EXPECT_EQ(sizeof(Checkpoint), checkpointBytes);
 
-    uint64_t compressedLogs = 0;
-    long bytesRead = encoder.encodeLogMsgs(inputBuffer,
-                                           writePos - inputBuffer,
-                                           1,
-                                           false,
-                                           &compressedLogs);
-    EXPECT_EQ(6, compressedLogs);
-    EXPECT_EQ(159, bytesRead);
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    EXPECT_LT(0, encode(encoder, 1, {200, 300}));
+    EXPECT_LT(0, encode(encoder, 65, {100}));
+    EXPECT_TRUE(encoder.encodeDroppedLogs(2, 10, 400));
+
+    TimeIndex *ti = reinterpret_cast<TimeIndex*>(outputBuffer
+                                                        + checkpointBytes);
+    EXPECT_EQ(EntryType::INVALID, ti->entryType);
+    EXPECT_EQ(ExtendedEntryType::TIME_INDEX, ti->extendedType);
+    EXPECT_FALSE(ti->hasDictionary);
+    EXPECT_EQ(encoder.getEncodedBytes() - checkpointBytes, ti->length);
+    EXPECT_EQ(100U, ti->minTimestamp);
+    EXPECT_EQ(400U, ti->maxTimestamp);
+    EXPECT_EQ(0x6UL, ti->bufferIds);
+    EXPECT_EQ(200U, ti->baseTimestamp);
+
+    LogIdSummary *lis = reinterpret_cast<LogIdSummary*>(ti + 1);
+    EXPECT_EQ(EntryType::INVALID, lis->entryType);
+    EXPECT_EQ(ExtendedEntryType::LOG_ID_SUMMARY, lis->extendedType);
+    uint32_t noParamsBit = static_cast<uint32_t>(noParamsId);
+    for (uint32_t i = 0; i < LogIdSummary::NUM_BITS/64; ++i)
+        EXPECT_EQ((i == noParamsBit/64) ? uint64_t(1) << (noParamsBit % 64)
+                                        : uint64_t(0),
+                  lis->logIds[i]);
+
+    // Second buffer: an empty buffer has no TimeIndex until entries arrive
+    size_t firstBufferBytes;
+    encoder.swapBuffer(outputBuffer2, sizeof(outputBuffer2), nullptr,
+                       &firstBufferBytes);
+    EXPECT_EQ(0U, encoder.getEncodedBytes());
+    EXPECT_LT(0, encode(encoder, 3, {5000, 6000}));
 
+    ti = reinterpret_cast<TimeIndex*>(outputBuffer2);
+    EXPECT_EQ(ExtendedEntryType::TIME_INDEX, ti->extendedType);
+    EXPECT_EQ(encoder.getEncodedBytes(), ti->length);
+    EXPECT_EQ(5000U, ti->minTimestamp);
+    EXPECT_EQ(6000U, ti->maxTimestamp);
+    EXPECT_EQ(0x8UL, ti->bufferIds);
+    EXPECT_EQ(5000U, ti->baseTimestamp);
+    EXPECT_EQ(5U, compressedLogs);
 
-    // Write it out and read it back in.
     std::ofstream oFile;
     oFile.open(testFile);
-    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.write(outputBuffer, firstBufferBytes);
+    oFile.write(outputBuffer2, encoder.getEncodedBytes());
     oFile.close();
 
-    std::string iLine;
-    std::ifstream iFile;
-    FILE *outputFd;
-
-    const char* expectedLines[] = {
-            "1969-12-31 16:00:01.000000010 testHelper/client.cc:28 NOTICE[1]: I have an integer 1\r",
-            "1969-12-31 16:00:01.000000020 testHelper/client.cc:28 NOTICE[1]: I have an integer -2\r",
-            "1969-12-31 16:00:01.000000030 testHelper/client.cc:29 NOTICE[1]: I have a uint64_t 3\r",
-            "1969-12-31 16:00:01.000000040 testHelper/client.cc:30 NOTICE[1]: I have a double 4.000000\r",
-            "1969-12-31 16:00:01.000000050 testHelper/client.cc:31 NOTICE[1]: I have a couple of things 5, 6.000000, 7, eight point oh\r",
-            "1969-12-31 16:00:01.000000060 testHelper/client.cc:30 NOTICE[1]: I have a double 9.000000\r"
-    };
-
-    LogMessage logMsg;
+    // Everything decompresses as usual...
     Decoder dc;
+    ASSERT_TRUE(dc.open(testFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(5, dc.decompressTo(outputFd));
+    EXPECT_EQ(0U, dc.numTimeIndexesSkipped);
+    EXPECT_EQ(10U, dc.numLogMsgsDropped);
+    fclose(outputFd);
 
+    // ...but a range seeks past the first buffer
+    Decoder dcRange;
+    ASSERT_TRUE(dcRange.open(testFile));
     outputFd = fopen(decomp, "w");
     ASSERT_NE(nullptr, outputFd);
-    ASSERT_TRUE(dc.open(testFile));
+    EXPECT_EQ(1, dcRange.decompressRange(outputFd, 1 + 4000e-9, 1 + 5500e-9));
+    EXPECT_EQ(1U, dcRange.numTimeIndexesSkipped);
+    EXPECT_EQ(1U, dcRange.numLogMsgsOutOfRange);
+    EXPECT_EQ(1U, dcRange.numBufferFragmentsRead);
+    EXPECT_EQ(0U, dcRange.numLogMsgsDropped);
+    fclose(outputFd);
+
+    std::ifstream iFile;
+    std::string iLine;
+    iFile.open(decomp);
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("1969-12-31 16:00:01.000005000 testHelper/client.cc:20 "
+                 "NOTICE[3]: Simple log message with 0 parameters\r",
+                 iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_FALSE(iFile.good());
+    iFile.close();
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, Decoder_logFilter) {
+    char inputBuffer[1000], outputBuffer[1000], outputBuffer2[1000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    uint64_t compressedLogs = 0;
+
+    auto encode = [&](Encoder &encoder, std::vector<int> fmtIds) {
+        char *pos = inputBuffer;
+        for (int fmtId : fmtIds) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(pos);
+            ue->timestamp = 100;
+            ue->fmtId = fmtId;
+            ue->entrySize = sizeof(UncompressedEntry);
+            pos += sizeof(UncompressedEntry);
+        }
+
+        return encoder.encodeLogMsgs(inputBuffer, pos - inputBuffer, 1,
+                                     false, &compressedLogs);
+    };
+
+    // First buffer only has NOTICE messages, the second a WARNING as well
+    Encoder encoder(outputBuffer, sizeof(outputBuffer), false, false, true);
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+    EXPECT_LT(0, encode(encoder, {noParamsId, noParamsId}));
+
+    size_t firstBufferBytes;
+    encoder.swapBuffer(outputBuffer2, sizeof(outputBuffer2), nullptr,
+                       &firstBufferBytes);
+    EXPECT_LT(0, encode(encoder, {noParamsId, warningId}));
+
+    LogIdSummary *lis = reinterpret_cast<LogIdSummary*>(outputBuffer2
+                                                          + sizeof(TimeIndex));
+    EXPECT_EQ(ExtendedEntryType::LOG_ID_SUMMARY, lis->extendedType);
+    EXPECT_NE(0U, lis->logIds[warningId/64] & (1UL << (warningId % 64)));
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer, firstBufferBytes);
+    oFile.write(outputBuffer2, encoder.getEncodedBytes());
+    oFile.close();
+
+    // The first buffer can't have a WARNING, so it's seeked past
+    Decoder::LogFilter filter;
+    filter.maxLogLevel = NanoLog::WARNING;
+    Decoder dc;
+    dc.setLogFilter(filter);
+    ASSERT_TRUE(dc.open(testFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(1, dc.decompressTo(outputFd));
+    EXPECT_EQ(1U, dc.numTimeIndexesSkipped);
+    EXPECT_EQ(1U, dc.numLogMsgsFiltered);
+    EXPECT_EQ(1U, dc.numBufferFragmentsRead);
+    fclose(outputFd);
+
+    std::ifstream iFile;
+    std::string iLine;
+    iFile.open(decomp);
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("1969-12-31 16:00:01.000000100 testHelper/client.cc:25 "
+                 "WARNING[1]: Warning Level\r", iLine.c_str());
+    iFile.close();
+
+    // Log ids match in both buffers, also through getNextLogStatement()
+    filter = Decoder::LogFilter();
+    filter.logIds.insert(noParamsId);
+    Decoder dcIds;
+    dcIds.setLogFilter(filter);
+    ASSERT_TRUE(dcIds.open(testFile));
+    LogMessage logMsg;
+    int logMsgs = 0;
+    while (dcIds.getNextLogStatement(logMsg))
+        ++logMsgs;
+    EXPECT_EQ(3, logMsgs);
+    EXPECT_EQ(0U, dcIds.numTimeIndexesSkipped);
+    EXPECT_EQ(1U, dcIds.numLogMsgsFiltered);
+
+    // No file matches, so there's nothing to read
+    filter = Decoder::LogFilter();
+    filter.fileGlob = "*.h";
+    Decoder dcFile;
+    dcFile.setLogFilter(filter);
+    ASSERT_TRUE(dcFile.open(testFile));
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(0, dcFile.decompressTo(outputFd));
+    EXPECT_EQ(2U, dcFile.numTimeIndexesSkipped);
+    EXPECT_EQ(0U, dcFile.numBufferFragmentsRead);
+    fclose(outputFd);
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, Decoder_decompressMerged) {
+    char inputBuffer[1000], outputBuffer[1000];
+    const char *testFiles[] = {"/tmp/testFileA", "/tmp/testFileB"};
+    const char *decomp = "/tmp/testFile2";
+    uint64_t compressedLogs = 0;
+
+    // The log messages of the two files interleave in time
+    std::vector<uint64_t> timestamps[] = {{100, 300, 301}, {200, 400}};
+    for (int file = 0; file < 2; ++file) {
+        Encoder encoder(outputBuffer, sizeof(outputBuffer));
+        Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+        checkpoint->cyclesPerSecond = 1e9;
+        checkpoint->rdtsc = 0;
+        checkpoint->unixTime = 1;
+
+        char *pos = inputBuffer;
+        for (uint64_t timestamp : timestamps[file]) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(pos);
+            ue->timestamp = timestamp;
+            ue->fmtId = (timestamp == 400) ? warningId : noParamsId;
+            ue->entrySize = sizeof(UncompressedEntry);
+            pos += sizeof(UncompressedEntry);
+        }
+        EXPECT_LT(0, encoder.encodeLogMsgs(inputBuffer, pos - inputBuffer, 1,
+                                           false, &compressedLogs));
+
+        std::ofstream oFile(testFiles[file]);
+        oFile.write(outputBuffer, encoder.getEncodedBytes());
+        oFile.close();
+    }
+
+    std::vector<std::string> logFiles(testFiles, testFiles + 2);
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(5, Decoder::decompressMerged(outputFd, logFiles));
+    fclose(outputFd);
+
+    std::ifstream iFile;
+    std::string iLine;
+    iFile.open(decomp);
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("[testFileA] 1969-12-31 16:00:01.000000100 "
+                 "testHelper/client.cc:20 NOTICE[1]: "
+                 "Simple log message with 0 parameters\r", iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("[testFileB] 1969-12-31 16:00:01.000000200 "
+                 "testHelper/client.cc:20 NOTICE[1]: "
+                 "Simple log message with 0 parameters\r", iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("[testFileA] 1969-12-31 16:00:01.000000300 "
+                 "testHelper/client.cc:20 NOTICE[1]: "
+                 "Simple log message with 0 parameters\r", iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("[testFileA] 1969-12-31 16:00:01.000000301 "
+                 "testHelper/client.cc:20 NOTICE[1]: "
+                 "Simple log message with 0 parameters\r", iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_STREQ("[testFileB] 1969-12-31 16:00:01.000000400 "
+                 "testHelper/client.cc:25 WARNING[1]: Warning Level\r",
+                 iLine.c_str());
+    std::getline(iFile, iLine);
+    EXPECT_FALSE(iFile.good());
+    iFile.close();
+
+    // The filter applies to all the files
+    Decoder::LogFilter filter;
+    filter.maxLogLevel = NanoLog::WARNING;
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(1, Decoder::decompressMerged(outputFd, logFiles, filter));
+
+    logFiles.push_back("/tmp/testFileDoesNotExist");
+    EXPECT_EQ(-1, Decoder::decompressMerged(outputFd, logFiles));
+    fclose(outputFd);
+
+    std::remove(testFiles[0]);
+    std::remove(testFiles[1]);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, Encoder_timestampBase) {
+    char inputBuffer[1000], buffer[1000];
+    const char *testFile = "/tmp/testFile";
+    uint64_t compressedLogs = 0;
+    const uint64_t start = 1000000000000000UL;
+
+    auto encode = [&](Encoder &encoder, uint32_t bufferId,
+                      uint64_t timestamp) {
+        UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(
+                                                                inputBuffer);
+        ue->timestamp = timestamp;
+        ue->fmtId = noParamsId;
+        ue->entrySize = sizeof(UncompressedEntry);
+        return encoder.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                     bufferId, false, &compressedLogs);
+    };
+
+    // Without a TimeIndex, the first message of each extent stores the
+    // complete timestamp...
+    Encoder plain(buffer, sizeof(buffer), true);
+    EXPECT_LT(0, encode(plain, 1, start));
+    size_t firstExtentBytes = plain.getEncodedBytes();
+    EXPECT_LT(0, encode(plain, 2, start + 50));
+    EXPECT_EQ(firstExtentBytes, plain.getEncodedBytes() - firstExtentBytes);
+
+    // ... whereas with one, they're deltas from the first message's in the
+    // buffer (i.e. 1 byte here instead of 7)
+    Encoder encoder(buffer, sizeof(buffer), false, true, true);
+    Checkpoint *checkpoint = (Checkpoint*)buffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = start;
+    checkpoint->unixTime = 1;
+    size_t checkpointBytes = encoder.getEncodedBytes();
+    size_t headerBytes = checkpointBytes + sizeof(TimeIndex)
+                                         + sizeof(LogIdSummary);
+
+    EXPECT_LT(0, encode(encoder, 1, start));
+    EXPECT_EQ(headerBytes + firstExtentBytes - 6, encoder.getEncodedBytes());
+
+    TimeIndex *ti = reinterpret_cast<TimeIndex*>(buffer + checkpointBytes);
+    EXPECT_EQ(start, ti->baseTimestamp);
+
+    size_t bytes = encoder.getEncodedBytes();
+    EXPECT_LT(0, encode(encoder, 2, start + 50));
+    EXPECT_LT(0, encode(encoder, 3, start - 50));
+    EXPECT_EQ(firstExtentBytes*2 - 12, encoder.getEncodedBytes() - bytes);
+    EXPECT_EQ(start, ti->baseTimestamp);
+
+    std::ofstream oFile(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    Decoder dc;
+    LogMessage logMsg;
+    ASSERT_TRUE(dc.open(testFile));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(start, logMsg.getTimestamp());
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(start + 50, logMsg.getTimestamp());
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(start - 50, logMsg.getTimestamp());
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+
+    std::remove(testFile);
+}
+
+TEST_F(LogTest, Encoder_fillInTimestamp) {
+    char inputBuffer[1000], buffer[1000];
+    const char *testFile = "/tmp/testFile";
+    uint64_t compressedLogs = 0;
+    const uint64_t start = 1000000000000000UL;
+
+    auto encode = [&](Encoder &encoder, std::vector<uint64_t> timestamps) {
+        char *pos = inputBuffer;
+        for (uint64_t timestamp : timestamps) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(pos);
+            ue->timestamp = timestamp;
+            ue->fmtId = noParamsId;
+            ue->entrySize = sizeof(UncompressedEntry);
+            pos += sizeof(UncompressedEntry);
+        }
+        return encoder.encodeLogMsgs(inputBuffer, pos - inputBuffer, 1,
+                                     false, &compressedLogs);
+    };
+
+    // Log messages without a timestamp (TIMESTAMP_NONE) take on the one of
+    // the message before them, or the current time if there is none.
+    uint64_t before = PerfUtils::Cycles::rdtsc();
+    Encoder encoder(buffer, sizeof(buffer), false, true);
+    EXPECT_LT(0, encode(encoder, {NO_TIMESTAMP, NO_TIMESTAMP}));
+    EXPECT_LT(0, encode(encoder, {start, NO_TIMESTAMP, start + 50,
+                                  NO_TIMESTAMP}));
+
+    std::ofstream oFile(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    Decoder dc;
+    LogMessage logMsg;
+    ASSERT_TRUE(dc.open(testFile));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    uint64_t now = logMsg.getTimestamp();
+    EXPECT_LE(before, now);
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(now, logMsg.getTimestamp());
+
+    for (uint64_t expected : {start, start, start + 50, start + 50}) {
+        ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+        EXPECT_EQ(expected, logMsg.getTimestamp());
+    }
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+
+    std::remove(testFile);
+}
+
+TEST_F(LogTest, Decoder_readCompressedBlock) {
+    char inputBuffer[1000], outputBuffer[1000], outputBuffer2[1000];
+    char blockBuffer[2000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    uint64_t compressedLogs = 0;
+
+    auto encode = [&](Encoder &encoder, std::vector<uint64_t> timestamps) {
+        char *pos = inputBuffer;
+        for (uint64_t timestamp : timestamps) {
+            UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(pos);
+            ue->timestamp = timestamp;
+            ue->fmtId = noParamsId;
+            ue->entrySize = sizeof(UncompressedEntry);
+            pos += sizeof(UncompressedEntry);
+        }
+
+        return encoder.encodeLogMsgs(inputBuffer, pos - inputBuffer, 1,
+                                     false, &compressedLogs);
+    };
+
+    // Frames a buffer the way the runtime's block compressor does
+    auto writeBlock = [&](std::ofstream &oFile, const char *buffer,
+                          size_t bytes, uint8_t algorithm) {
+        CompressedBlock *block = reinterpret_cast<CompressedBlock*>(
+                                                                blockBuffer);
+        block->entryType = EntryType::INVALID;
+        block->extendedType = ExtendedEntryType::COMPRESSED_BLOCK;
+        block->algorithm = algorithm;
+        block->uncompressedLength = downCast<uint32_t>(bytes);
+        block->compressedLength = downCast<uint32_t>(BlockCodec::compress(
+                    buffer, bytes, blockBuffer + sizeof(CompressedBlock),
+                    sizeof(blockBuffer) - sizeof(CompressedBlock)));
+        ASSERT_LT(0U, block->compressedLength);
+        oFile.write(blockBuffer, sizeof(CompressedBlock)
+                                        + block->compressedLength);
+    };
+
+    auto decompress = [&](double start, double end) {
+        Decoder dc;
+        EXPECT_TRUE(dc.open(testFile));
+        FILE *outputFd = fopen(decomp, "w");
+        if (start < 0)
+            EXPECT_LT(0, dc.decompressTo(outputFd));
+        else
+            EXPECT_LT(0, dc.decompressRange(outputFd, start, end));
+        fclose(outputFd);
+
+        std::ifstream iFile(decomp);
+        std::stringstream contents;
+        contents << iFile.rdbuf();
+        return std::make_pair(contents.str(), dc.numCompressedBlocksRead);
+    };
+
+    Encoder encoder(outputBuffer, sizeof(outputBuffer), false, false, true);
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+    for (int i = 0; i < 10; ++i)
+        EXPECT_LT(0, encode(encoder, {100U + i, 200U + i}));
+
+    size_t firstBufferBytes;
+    encoder.swapBuffer(outputBuffer2, sizeof(outputBuffer2), nullptr,
+                       &firstBufferBytes);
+    EXPECT_LT(0, encode(encoder, {5000, 6000}));
+    size_t secondBufferBytes = encoder.getEncodedBytes();
+
+    // Reference output of the uncompressed buffers
+    std::ofstream oFile(testFile);
+    oFile.write(outputBuffer, firstBufferBytes);
+    oFile.write(outputBuffer2, secondBufferBytes);
+    oFile.close();
+    auto expected = decompress(-1, 0);
+    auto expectedRange = decompress(1 + 4000e-9, 1 + 5500e-9);
+    EXPECT_EQ(0U, expected.second);
+    EXPECT_NE(expected.first, expectedRange.first);
+
+    // The Checkpoint itself is compressed; the next buffer is not, but is
+    // separated from the block by padding
+    oFile.open(testFile);
+    writeBlock(oFile, outputBuffer, firstBufferBytes, BlockCodec::LZ4);
+    oFile.write("\0\0\0", 3);
+    oFile.write(outputBuffer2, secondBufferBytes);
+    oFile.close();
+    auto actual = decompress(-1, 0);
+    EXPECT_EQ(expected.first, actual.first);
+    EXPECT_EQ(1U, actual.second);
+    EXPECT_EQ(expectedRange.first, decompress(1 + 4000e-9, 1 + 5500e-9).first);
+
+    // Both buffers compressed
+    oFile.open(testFile);
+    writeBlock(oFile, outputBuffer, firstBufferBytes, BlockCodec::LZ4);
+    writeBlock(oFile, outputBuffer2, secondBufferBytes, BlockCodec::LZ4);
+    oFile.close();
+    actual = decompress(-1, 0);
+    EXPECT_EQ(expected.first, actual.first);
+    EXPECT_EQ(2U, actual.second);
+
+    // Unknown algorithms are rejected
+    oFile.open(testFile);
+    writeBlock(oFile, outputBuffer, firstBufferBytes, 42);
+    oFile.close();
+
+    testing::internal::CaptureStderr();
+    Decoder dc;
+    EXPECT_FALSE(dc.open(testFile));
+    EXPECT_STREQ("The compressed log contains a block compressed with an "
+                 "unknown algorithm (42)\r\n",
+                 testing::internal::GetCapturedStderr().c_str());
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, encodeDroppedLogs) {
+    char buffer[100];
+    Encoder tooSmall(buffer, sizeof(DroppedLogs) - 1, true);
+    EXPECT_FALSE(tooSmall.encodeDroppedLogs(1, 2, 3));
+    EXPECT_EQ(0U, tooSmall.getEncodedBytes());
+
+    Encoder encoder(buffer, sizeof(DroppedLogs), true);
+    EXPECT_TRUE(encoder.encodeDroppedLogs(1, 2, 3));
+    EXPECT_EQ(sizeof(DroppedLogs), encoder.getEncodedBytes());
+    EXPECT_FALSE(encoder.encodeDroppedLogs(1, 2, 3));
+
+    DroppedLogs *dl = reinterpret_cast<DroppedLogs*>(buffer);
+    EXPECT_EQ(EntryType::INVALID, peekEntryType(buffer));
+    EXPECT_EQ(ExtendedEntryType::DROPPED_LOGS, dl->extendedType);
+    EXPECT_EQ(1U, dl->bufferId);
+    EXPECT_EQ(2U, dl->numDropped);
+    EXPECT_EQ(3U, dl->timestamp);
+}
+
+TEST_F(LogTest, Decoder_droppedLogs) {
+    // The second output buffer starts with a DroppedLogs marker right after
+    // the padding that ends the first one.
+    char inputBuffer[1000], outputBuffer[1000], outputBuffer2[1000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+
+    uint64_t compressedLogs = 0;
+    Encoder encoder(outputBuffer, 1000);
+    Encoder encoder2(outputBuffer2, 1000, true);
+
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+
+    ue->timestamp = 500;
+    EXPECT_EQ(sizeof(UncompressedEntry),
+              encoder.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                    1, true, &compressedLogs));
+    EXPECT_TRUE(encoder2.encodeDroppedLogs(1, 7, 550));
+
+    ue->timestamp = 520;
+    EXPECT_EQ(sizeof(UncompressedEntry),
+              encoder2.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                     2, false, &compressedLogs));
+    ue->timestamp = 600;
+    EXPECT_EQ(sizeof(UncompressedEntry),
+              encoder2.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                     1, false, &compressedLogs));
+
+    char padding[512] = {};
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer, encoder.getEncodedBytes());
+    oFile.write(padding, sizeof(padding));
+    oFile.write(outputBuffer2, encoder2.getEncodedBytes());
+    oFile.close();
+
+    const char* sortedLines[] = {
+        "1969-12-31 16:00:01.000000500 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000520 testHelper/client.cc:20 NOTICE[2]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000550 # 7 log messages dropped on thread 1\r",
+        "1969-12-31 16:00:01.000000600 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
+    };
+
+    const char* unsortedLines[] = {
+        "1969-12-31 16:00:01.000000500 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000550 # 7 log messages dropped on thread 1\r",
+        "1969-12-31 16:00:01.000000520 testHelper/client.cc:20 NOTICE[2]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.000000600 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
+    };
+
+    for (bool sorted : {true, false}) {
+        Decoder dc;
+        ASSERT_TRUE(dc.open(testFile));
+        FILE *outputFd = fopen(decomp, "w");
+        ASSERT_NE(nullptr, outputFd);
+        if (sorted)
+            EXPECT_EQ(3, dc.decompressTo(outputFd));
+        else
+            EXPECT_EQ(3, dc.decompressUnordered(outputFd));
+        EXPECT_EQ(7U, dc.numLogMsgsDropped);
+        fclose(outputFd);
+
+        std::ifstream iFile;
+        std::string iLine;
+        iFile.open(decomp);
+        const char **expectedLines = (sorted) ? sortedLines : unsortedLines;
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_TRUE(iFile.good());
+            std::getline(iFile, iLine);
+            EXPECT_STREQ(expectedLines[i], iLine.c_str());
+        }
+        iFile.close();
+    }
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, encodeClockCalibration) {
+    char buffer[100];
+    Encoder tooSmall(buffer, sizeof(ClockCalibration) - 1, true);
+    EXPECT_FALSE(tooSmall.encodeClockCalibration(1, 2));
+    EXPECT_EQ(0U, tooSmall.getEncodedBytes());
+
+    Encoder encoder(buffer, sizeof(ClockCalibration), true);
+    EXPECT_TRUE(encoder.encodeClockCalibration(1, 2));
+    EXPECT_EQ(sizeof(ClockCalibration), encoder.getEncodedBytes());
+    EXPECT_FALSE(encoder.encodeClockCalibration(1, 2));
+
+    ClockCalibration *cc = reinterpret_cast<ClockCalibration*>(buffer);
+    EXPECT_EQ(EntryType::INVALID, peekEntryType(buffer));
+    EXPECT_EQ(ExtendedEntryType::CLOCK_CALIBRATION, cc->extendedType);
+    EXPECT_EQ(1U, cc->rdtsc);
+    EXPECT_EQ(2, cc->unixNanos);
+}
+
+TEST_F(LogTest, WallClock) {
+    Checkpoint checkpoint = {};
+    checkpoint.rdtsc = 1000;
+    checkpoint.unixTime = 100;
+    checkpoint.cyclesPerSecond = 1e9;
+
+    // Without calibrations, the Checkpoint is extrapolated from
+    WallClock wallClock(checkpoint);
+    EXPECT_EQ(100000000500, wallClock.toNanos(1500));
+    EXPECT_EQ(99999999500, wallClock.toNanos(500));
+
+    // Between calibrations, the wall time is interpolated ...
+    wallClock.addCalibration(3000000000, 103000000000);
+    wallClock.addCalibration(1000000000, 100900000000);
+    wallClock.addCalibration(1000000000, 0);
+    EXPECT_EQ(100900000000, wallClock.toNanos(1000000000));
+    EXPECT_EQ(101950000000, wallClock.toNanos(2000000000));
+
+    // ... and outside of them extrapolated at the rate measured over them
+    EXPECT_EQ(104050000000, wallClock.toNanos(4000000000));
+    EXPECT_EQ(100795000000, wallClock.toNanos(900000000));
+
+    struct timespec wallTime = wallClock.toTimespec(2000000001);
+    EXPECT_EQ(101, wallTime.tv_sec);
+    EXPECT_EQ(950000001, wallTime.tv_nsec);
+
+    // A new Checkpoint drops the calibrations
+    wallClock.reset(checkpoint);
+    EXPECT_EQ(102999999000, wallClock.toNanos(3000000000));
+}
+
+TEST_F(LogTest, Decoder_clockCalibrations) {
+    char inputBuffer[1000], outputBuffer[1000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+
+    uint64_t compressedLogs = 0;
+    Encoder encoder(outputBuffer, 1000);
+
+    // The Checkpoint has whole seconds only, so it's off by almost a second
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    EXPECT_TRUE(encoder.encodeClockCalibration(1000, 1900001000));
+    EXPECT_TRUE(encoder.encodeClockCalibration(3000, 1900005000));
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+    for (uint64_t timestamp : {500, 2000, 4000}) {
+        ue->timestamp = timestamp;
+        EXPECT_EQ(sizeof(UncompressedEntry),
+                  encoder.encodeLogMsgs(inputBuffer, sizeof(UncompressedEntry),
+                                        1, false, &compressedLogs));
+    }
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    const char* expectedLines[] = {
+        "1969-12-31 16:00:01.900000500 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.900003000 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r",
+        "1969-12-31 16:00:01.900006000 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
+    };
+
+    for (bool sorted : {true, false}) {
+        Decoder dc;
+        ASSERT_TRUE(dc.open(testFile));
+        FILE *outputFd = fopen(decomp, "w");
+        ASSERT_NE(nullptr, outputFd);
+        if (sorted)
+            EXPECT_EQ(3, dc.decompressTo(outputFd));
+        else
+            EXPECT_EQ(3, dc.decompressUnordered(outputFd));
+        fclose(outputFd);
+
+        std::ifstream iFile;
+        std::string iLine;
+        iFile.open(decomp);
+        for (const char *expected : expectedLines) {
+            ASSERT_TRUE(iFile.good());
+            std::getline(iFile, iLine);
+            EXPECT_STREQ(expected, iLine.c_str());
+        }
+        iFile.close();
+    }
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, Decoder_decompressNextLogStatement_timeTravel) {
+    // Tests what happen when the checkpoint is newer than the log message.
+    char inputBuffer[1000], outputBuffer[1000];
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    LogMessage logMsg;
+
+    UncompressedEntry* ue = reinterpret_cast<UncompressedEntry*>(inputBuffer);
+    ue->timestamp = 10e9;
+    ue->fmtId = noParamsId;
+    ue->entrySize = sizeof(UncompressedEntry);
+
+    uint64_t compressedLogs = 0;
+    Encoder encoder(outputBuffer, 1000);
+
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint*)outputBuffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 20e9;
+    checkpoint->unixTime = 30;
+
+    long bytesRead = encoder.encodeLogMsgs(inputBuffer,
+                                                    sizeof(UncompressedEntry),
+                                                    1,
+                                                    false,
+                                                    &compressedLogs);
+    EXPECT_EQ(1, compressedLogs);
+    EXPECT_EQ(sizeof(UncompressedEntry), bytesRead);
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(outputBuffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    // Now let's attempt to parse it back and decompress it to decomp
+    Decoder dc;
+    ASSERT_TRUE(dc.open(testFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_TRUE(dc.internalDecompressUnordered(outputFd));
+    EXPECT_EQ(1, dc.logMsgsPrinted);
+    fclose(outputFd);
+
+    // Read it back and compare
+    std::ifstream iFile;
+    iFile.open(decomp);
+    ASSERT_TRUE(iFile.good());
+
+    const char* expectedLines[] = {
+        "1969-12-31 16:00:20.000000000 testHelper/client.cc:20 NOTICE[1]: Simple log message with 0 parameters\r"
+    };
+
+    std::string iLine;
+    for (const char *line : expectedLines) {
+        ASSERT_TRUE(iFile.good());
+        std::getline(iFile, iLine);
+        EXPECT_STREQ(line, iLine.c_str());
+    }
+    EXPECT_FALSE(iFile.eof());
+    iFile.close();
+
+    // Try iterative interface
+    dc.open(testFile);
+
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(logMsg, outputFd));
+    EXPECT_EQ(1, dc.logMsgsPrinted);
+    EXPECT_EQ(1, dc.numBufferFragmentsRead);
+    EXPECT_EQ(1, dc.numCheckpointsRead);
+    fclose(outputFd);
+
+    iFile.open(decomp);
+    for (const char *line : expectedLines) {
+        ASSERT_TRUE(iFile.good());
+        std::getline(iFile, iLine);
+        EXPECT_STREQ(line, iLine.c_str());
+    }
+    EXPECT_FALSE(iFile.eof());
+    iFile.close();
+
+    // Try the ordered case
+    dc.open(testFile);
+
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    dc.decompressTo(outputFd);
+    EXPECT_EQ(1, dc.logMsgsPrinted);
+    EXPECT_EQ(1, dc.numBufferFragmentsRead);
+    EXPECT_EQ(1, dc.numCheckpointsRead);
+    fclose(outputFd);
+
+    iFile.open(decomp);
+    for (const char *line : expectedLines) {
+        ASSERT_TRUE(iFile.good());
+        std::getline(iFile, iLine);
+        EXPECT_STREQ(line, iLine.c_str());
+    }
+    EXPECT_FALSE(iFile.eof());
+    iFile.close();
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
+TEST_F(LogTest, Decoder_getNextLogStatement) {
+    // First we have to create a log file with encoder.
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    char inputBuffer[1000], buffer[1000];
+    Encoder encoder(buffer, 1000, false, true);
+
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint *) encoder.backing_buffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    char *writePos = inputBuffer;
+    UncompressedEntry *ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 10;
+    ue->fmtId = integerParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+    writePos += ue->entrySize;
+    *((int*)(ue->argData)) = 1;
+
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 20;
+    ue->fmtId = integerParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+    writePos += ue->entrySize;
+    *((int*)(ue->argData)) = -2;
+
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 30;
+    ue->fmtId = uint64_tParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(uint64_t);
+    writePos += ue->entrySize;
+    *((uint64_t*)(ue->argData)) = 3;
+
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 40;
+    ue->fmtId = doubleParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(double);
+    writePos += ue->entrySize;
+    *((double*)(ue->argData)) = 4.0;
+
+    // Note; this one is special since it has multiple args
+    const char *strParam = "eight point oh";
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 50;
+    ue->fmtId = mixParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int) + sizeof(double) + sizeof(uint32_t) + strlen(strParam) + 1;
+    writePos += sizeof(UncompressedEntry);
+
+    *(reinterpret_cast<int*>(writePos)) = 5;
+    writePos += sizeof(int);
+
+    *(reinterpret_cast<double*>(writePos)) = 6.0;
+    writePos += sizeof(double);
+
+    *(reinterpret_cast<uint32_t*>(writePos)) = 7;
+    writePos += sizeof(uint32_t);
+
+    strcpy(writePos, strParam);
+    writePos += strlen(strParam) + 1;
+
+    // Finally, finish it off with a final double to make sure strings work
+    ue = reinterpret_cast<UncompressedEntry *>(writePos);
+    ue->timestamp = 60;
+    ue->fmtId = doubleParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(double);
+    writePos += ue->entrySize;
+    *((double*)(ue->argData)) = 9.0;
+
+    uint64_t compressedLogs = 0;
+    long bytesRead = encoder.encodeLogMsgs(inputBuffer,
+                                           writePos - inputBuffer,
+                                           1,
+                                           false,
+                                           &compressedLogs);
+    EXPECT_EQ(6, compressedLogs);
+    EXPECT_EQ(159, bytesRead);
+
+
+    // Write it out and read it back in.
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    std::string iLine;
+    std::ifstream iFile;
+    FILE *outputFd;
+
+    const char* expectedLines[] = {
+            "1969-12-31 16:00:01.000000010 testHelper/client.cc:28 NOTICE[1]: I have an integer 1\r",
+            "1969-12-31 16:00:01.000000020 testHelper/client.cc:28 NOTICE[1]: I have an integer -2\r",
+            "1969-12-31 16:00:01.000000030 testHelper/client.cc:29 NOTICE[1]: I have a uint64_t 3\r",
+            "1969-12-31 16:00:01.000000040 testHelper/client.cc:30 NOTICE[1]: I have a double 4.000000\r",
+            "1969-12-31 16:00:01.000000050 testHelper/client.cc:31 NOTICE[1]: I have a couple of things 5, 6.000000, 7, eight point oh\r",
+            "1969-12-31 16:00:01.000000060 testHelper/client.cc:30 NOTICE[1]: I have a double 9.000000\r"
+    };
+
+    LogMessage logMsg;
+    Decoder dc;
+
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    ASSERT_TRUE(dc.open(testFile));
     while (dc.getNextLogStatement(logMsg, outputFd));
     EXPECT_EQ(6, dc.logMsgsPrinted);
     EXPECT_EQ(1, dc.numBufferFragmentsRead);
@@ -2193,6 +3350,80 @@ TEST_F(LogTest, Decoder_getNextLogStatement) {
 
 }
 
+TEST_F(LogTest, Decoder_follow) {
+    const char *testFile = "/tmp/testFile";
+    char inputBuffer[1000], buffer[1000];
+    Encoder encoder(buffer, 1000, false, true);
+
+    Checkpoint *checkpoint = (Checkpoint *) encoder.backing_buffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+    size_t checkpointBytes = encoder.getEncodedBytes();
+
+    char *writePos = inputBuffer;
+    for (int i = 1; i <= 2; ++i) {
+        UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
+        ue->timestamp = 10*i;
+        ue->fmtId = integerParamId;
+        ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+        *((int*)(ue->argData)) = i;
+        writePos += ue->entrySize;
+    }
+
+    uint64_t compressedLogs = 0;
+    encoder.encodeLogMsgs(inputBuffer, writePos - inputBuffer, 1, false,
+                          &compressedLogs);
+    EXPECT_EQ(2U, compressedLogs);
+    size_t totalBytes = encoder.getEncodedBytes();
+    size_t partialBytes = checkpointBytes + (totalBytes - checkpointBytes)/2;
+
+    // Only the Checkpoint and half of the extent made it to disk
+    std::ofstream oFile(testFile);
+    oFile.write(buffer, partialBytes);
+    oFile.close();
+
+    Decoder dc;
+    LogMessage logMsg;
+    EXPECT_FALSE(dc.follow());
+    ASSERT_TRUE(dc.open(testFile));
+    ASSERT_TRUE(dc.follow());
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+    EXPECT_FALSE(dc.waitForData(0));
+
+    // The half written extent is left for when the rest arrives
+    oFile.open(testFile, std::ios::app);
+    oFile.write(buffer + partialBytes, totalBytes - partialBytes);
+    oFile.close();
+
+    EXPECT_TRUE(dc.waitForData(1000));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(10, logMsg.getTimestamp());
+    EXPECT_EQ(1, logMsg.get<int>(0));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(20, logMsg.getTimestamp());
+    EXPECT_EQ(2, logMsg.get<int>(0));
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+
+    // Messages appended later, as a new extent, are picked up too
+    encoder.swapBuffer(buffer, sizeof(buffer));
+    encoder.encodeLogMsgs(inputBuffer, writePos - inputBuffer, 1, false,
+                          &compressedLogs);
+    oFile.open(testFile, std::ios::app);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    EXPECT_TRUE(dc.waitForData(1000));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(1, logMsg.get<int>(0));
+    ASSERT_TRUE(dc.getNextLogStatement(logMsg));
+    EXPECT_EQ(2, logMsg.get<int>(0));
+    EXPECT_FALSE(dc.getNextLogStatement(logMsg));
+    EXPECT_FALSE(dc.waitForData(0));
+
+    std::remove(testFile);
+}
+
 // Static helper functions to test when aggregation is run.
 static int numInvocations = 0;
 
@@ -2211,6 +3442,278 @@ getCount() {
     return numInvocations;
 }
 
+TEST_F(LogTest, Decoder_exportColumns) {
+    const char *testFile = "/tmp/testFile";
+    const char *exportDir = "/tmp/testExportDir";
+    char inputBuffer[1000], buffer[1000];
+    Encoder encoder(buffer, 1000, false, true);
+
+    // Hack to load fake Checkpoint values to get a consistent time output
+    Checkpoint *checkpoint = (Checkpoint *) encoder.backing_buffer;
+    checkpoint->cyclesPerSecond = 1e9;
+    checkpoint->rdtsc = 0;
+    checkpoint->unixTime = 1;
+
+    char *writePos = inputBuffer;
+    for (int i = 0; i < 2; ++i) {
+        UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
+        ue->timestamp = 10 + i;
+        ue->fmtId = integerParamId;
+        ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+        writePos += ue->entrySize;
+        *((int*)(ue->argData)) = -1 - i;
+    }
+
+    const char *strParam = "eight point oh";
+    UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
+    ue->timestamp = 50;
+    ue->fmtId = mixParamId;
+    ue->entrySize = sizeof(UncompressedEntry) + sizeof(int) + sizeof(double)
+                        + sizeof(uint32_t) + strlen(strParam) + 1;
+    writePos += sizeof(UncompressedEntry);
+
+    *(reinterpret_cast<int*>(writePos)) = 5;
+    writePos += sizeof(int);
+
+    *(reinterpret_cast<double*>(writePos)) = 6.0;
+    writePos += sizeof(double);
+
+    *(reinterpret_cast<uint32_t*>(writePos)) = 7;
+    writePos += sizeof(uint32_t);
+
+    strcpy(writePos, strParam);
+    writePos += strlen(strParam) + 1;
+
+    uint64_t compressedLogs = 0;
+    encoder.encodeLogMsgs(inputBuffer, writePos - inputBuffer, 1, false,
+                          &compressedLogs);
+    EXPECT_EQ(3, compressedLogs);
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    std::string integerTable = std::string(exportDir) + "/0_"
+                                + std::to_string(integerParamId) + ".nlcol";
+    std::string mixTable = std::string(exportDir) + "/0_"
+                                + std::to_string(mixParamId) + ".nlcol";
+
+    Decoder dc;
+    ASSERT_TRUE(dc.open(testFile));
+    EXPECT_EQ(3, dc.exportColumns(exportDir));
+
+    // Table with a single int column
+    std::ifstream iFile(integerTable, std::ios::binary);
+    ASSERT_TRUE(iFile.good());
+    std::string table((std::istreambuf_iterator<char>(iFile)),
+                       std::istreambuf_iterator<char>());
+    iFile.close();
+
+    const char *readPos = table.data();
+    auto *header = reinterpret_cast<const ColumnTableHeader*>(readPos);
+    EXPECT_STREQ("NLCOLS1", header->magic);
+    EXPECT_EQ(integerParamId, header->fmtId);
+    EXPECT_EQ(28U, header->lineNumber);
+    EXPECT_EQ(1U, header->numArgColumns);
+    readPos += sizeof(ColumnTableHeader);
+    EXPECT_STREQ("testHelper/client.cc", readPos);
+    readPos += header->filenameLength;
+    EXPECT_STREQ("I have an integer %d", readPos);
+    readPos += header->formatStringLength;
+    EXPECT_EQ(int_t, *readPos);
+    readPos += header->numArgColumns;
+
+    auto *group = reinterpret_cast<const ColumnRowGroup*>(readPos);
+    EXPECT_EQ(2U, group->numRows);
+    readPos += sizeof(ColumnRowGroup);
+    EXPECT_EQ(table.data() + table.size(), readPos + group->bytes);
+
+    const uint64_t *columnBytes = reinterpret_cast<const uint64_t*>(readPos);
+    EXPECT_EQ(2*sizeof(int64_t), columnBytes[0]);
+    EXPECT_EQ(2*sizeof(uint32_t), columnBytes[1]);
+    EXPECT_EQ(2*sizeof(int), columnBytes[2]);
+    readPos += 3*sizeof(uint64_t);
+
+    const int64_t *timestamps = reinterpret_cast<const int64_t*>(readPos);
+    EXPECT_EQ(1000000010, timestamps[0]);
+    EXPECT_EQ(1000000011, timestamps[1]);
+    readPos += columnBytes[0];
+
+    const uint32_t *runtimeIds = reinterpret_cast<const uint32_t*>(readPos);
+    EXPECT_EQ(1U, runtimeIds[0]);
+    EXPECT_EQ(1U, runtimeIds[1]);
+    readPos += columnBytes[1];
+
+    const int *ints = reinterpret_cast<const int*>(readPos);
+    EXPECT_EQ(-1, ints[0]);
+    EXPECT_EQ(-2, ints[1]);
+
+    // Table with a string column
+    iFile.open(mixTable, std::ios::binary);
+    ASSERT_TRUE(iFile.good());
+    table.assign((std::istreambuf_iterator<char>(iFile)),
+                  std::istreambuf_iterator<char>());
+    iFile.close();
+
+    readPos = table.data();
+    header = reinterpret_cast<const ColumnTableHeader*>(readPos);
+    EXPECT_EQ(4U, header->numArgColumns);
+    readPos += sizeof(ColumnTableHeader) + header->filenameLength
+                    + header->formatStringLength;
+    EXPECT_EQ(int_t, readPos[0]);
+    EXPECT_EQ(double_t, readPos[1]);
+    EXPECT_EQ(unsigned_int_t, readPos[2]);
+    EXPECT_EQ(const_char_ptr_t, readPos[3]);
+    readPos += header->numArgColumns;
+
+    group = reinterpret_cast<const ColumnRowGroup*>(readPos);
+    EXPECT_EQ(1U, group->numRows);
+    readPos += sizeof(ColumnRowGroup);
+    columnBytes = reinterpret_cast<const uint64_t*>(readPos);
+    readPos += 6*sizeof(uint64_t);
+    for (int i = 0; i < 5; ++i)
+        readPos += columnBytes[i];
+
+    EXPECT_EQ(2*sizeof(uint64_t) + strlen(strParam), columnBytes[5]);
+    const uint64_t *offsets = reinterpret_cast<const uint64_t*>(readPos);
+    EXPECT_EQ(0U, offsets[0]);
+    EXPECT_EQ(strlen(strParam), offsets[1]);
+    EXPECT_EQ(strParam, std::string(readPos + 2*sizeof(uint64_t), offsets[1]));
+
+    // Unwritable output directory
+    ASSERT_TRUE(dc.open(testFile));
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(-1, dc.exportColumns("/tmp/testFile/notADirectory"));
+    EXPECT_STREQ("Could not create the output directory "
+                 "/tmp/testFile/notADirectory: Not a directory\r\n",
+                 testing::internal::GetCapturedStderr().c_str());
+
+    std::remove(integerTable.c_str());
+    std::remove(mixTable.c_str());
+    rmdir(exportDir);
+    std::remove(testFile);
+}
+
+TEST_F(LogTest, Decoder_aggregate) {
+    const char *testFile = "/tmp/testFile";
+    const char *decomp = "/tmp/testFile2";
+    char inputBuffer[1000], buffer[1000];
+    Encoder encoder(buffer, 1000, false, true);
+
+    char *writePos = inputBuffer;
+    int integers[] = {3, 1, 4, 1};
+    for (int i = 0; i < 4; ++i) {
+        UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
+        ue->timestamp = 10 + i;
+        ue->fmtId = integerParamId;
+        ue->entrySize = sizeof(UncompressedEntry) + sizeof(int);
+        writePos += ue->entrySize;
+        *((int*)(ue->argData)) = integers[i];
+    }
+
+    const char *strParams[] = {"a", "bc"};
+    for (int i = 0; i < 2; ++i) {
+        UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
+        ue->timestamp = 50 + i;
+        ue->fmtId = mixParamId;
+        ue->entrySize = sizeof(UncompressedEntry) + sizeof(int)
+                            + sizeof(double) + sizeof(uint32_t)
+                            + strlen(strParams[i]) + 1;
+        writePos += sizeof(UncompressedEntry);
+
+        *(reinterpret_cast<int*>(writePos)) = 5;
+        writePos += sizeof(int);
+
+        *(reinterpret_cast<double*>(writePos)) = 6.0 + 0.5*i;
+        writePos += sizeof(double);
+
+        *(reinterpret_cast<uint32_t*>(writePos)) = 7;
+        writePos += sizeof(uint32_t);
+
+        strcpy(writePos, strParams[i]);
+        writePos += strlen(strParams[i]) + 1;
+    }
+
+    uint64_t compressedLogs = 0;
+    encoder.encodeLogMsgs(inputBuffer, writePos - inputBuffer, 1, false,
+                          &compressedLogs);
+    EXPECT_EQ(6, compressedLogs);
+
+    std::ofstream oFile;
+    oFile.open(testFile);
+    oFile.write(buffer, encoder.getEncodedBytes());
+    oFile.close();
+
+    Decoder dc;
+    ASSERT_TRUE(dc.open(testFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(6, dc.aggregate(outputFd,
+            "group by logId; count, sum, min, max, mean, p50 of arg[0]"));
+
+    // Log messages lacking the arguments are left out
+    ASSERT_TRUE(dc.open(testFile));
+    EXPECT_EQ(2, dc.aggregate(outputFd,
+            " group by arg[3],runtimeId ; count,p99.9 of arg[1];"));
+    fclose(outputFd);
+
+    std::string integerId = std::to_string(integerParamId);
+    std::string mixId = std::to_string(mixParamId);
+    std::string expectedLines[] = {
+        "logId | count | sum(arg[0]) | min(arg[0]) | max(arg[0]) "
+                "| mean(arg[0]) | p50(arg[0])\r",
+        integerId + "     | 4     | 9           | 1           "
+                "| 4           | 2.25         | 1\r",
+        mixId + "     | 2     | 10          | 5           "
+                "| 5           | 5            | 5\r",
+        "\r",
+        "# logId " + integerId + ": testHelper/client.cc:28 "
+                "\"I have an integer %d\"\r",
+        "# logId " + mixId + ": testHelper/client.cc:31 "
+                "\"I have a couple of things %d, %f, %u, %s\"\r",
+        "arg[3] | runtimeId | count | p99.9(arg[1])\r",
+        "a      | 1         | 1     | 6\r",
+        "bc     | 1         | 1     | 6.5\r",
+    };
+
+    std::ifstream iFile;
+    std::string iLine;
+    iFile.open(decomp);
+    for (const std::string &line : expectedLines) {
+        ASSERT_TRUE(iFile.good());
+        std::getline(iFile, iLine);
+        EXPECT_EQ(line, iLine);
+    }
+    std::getline(iFile, iLine);
+    EXPECT_FALSE(iFile.good());
+    iFile.close();
+
+    // Invalid queries
+    const char *invalidQueries[] = {
+        "sum",
+        "count of args[0]",
+        "group logId; count",
+        "group by logId count",
+        "group by arg[-1]; count",
+        "p0 of arg[0]",
+        "p101 of arg[0]",
+        "count, medium of arg[0]",
+        "count of arg[0] please",
+    };
+
+    for (const char *query : invalidQueries) {
+        ASSERT_TRUE(dc.open(testFile));
+        testing::internal::CaptureStderr();
+        EXPECT_EQ(-1, dc.aggregate(stdout, query));
+        EXPECT_EQ("Invalid query: " + std::string(query) + "\r\n",
+                  testing::internal::GetCapturedStderr());
+    }
+
+    std::remove(testFile);
+    std::remove(decomp);
+}
+
 TEST_F(LogTest, Decoder_internalDecompress_aggregationFn) {
     // First we have to create a log file with encoder.
     const char *testFile = "/tmp/testFile";
@@ -2459,10 +3962,10 @@ TEST_F(LogTest, encodeLogMsgs_cpp17) {
     char *out = outBuffer;
 
     uint64_t numEventsCompressed = 0;
-    std::vector<StaticLogInfo> dictionary;
+    InvocationSiteRegistry dictionary;
     NanoLogInternal::ParamType paramTypes[10];
-    dictionary.emplace_back(&compressHelper0, "File", 123, 0, "Hello World", 0, 0, paramTypes);
-    dictionary.emplace_back(&compressHelper1, "FileA", 99, 2, "Hello World %s", 0, 0, paramTypes);
+    dictionary.add(StaticLogInfo(&compressHelper0, "File", 123, 0, "Hello World", 0, 0, paramTypes));
+    dictionary.add(StaticLogInfo(&compressHelper1, "FileA", 99, 2, "Hello World %s", 0, 0, paramTypes));
 
     // Case 1: early break because we haven't persisted the dictionary entries
     UncompressedEntry *ue = push<UncompressedEntry>(in);
@@ -2530,6 +4033,38 @@ TEST_F(LogTest, encodeLogMsgs_cpp17) {
     EXPECT_EQ(0, encoder.consecutiveEncodeMissesDueToMetadata);
 }
 
+TEST_F(LogTest, Encoder_updateEncodePlans) {
+    NanoLogInternal::ParamType paramTypes[1];
+    InvocationSiteRegistry dictionary;
+    dictionary.add(StaticLogInfo(&compressHelper0, "File", 1, 0, "A", 0, 3,
+                                 paramTypes));
+
+    char outBuffer[1024];
+    Encoder encoder(outBuffer, sizeof(outBuffer), true);
+    EXPECT_EQ(1U, encoder.updateEncodePlans(dictionary));
+    ASSERT_EQ(1U, encoder.encodePlans.size());
+    EXPECT_EQ(&compressHelper0, encoder.encodePlans[0].compressionFunction);
+    EXPECT_EQ(3, encoder.encodePlans[0].numNibbles);
+    EXPECT_EQ(paramTypes, encoder.encodePlans[0].paramTypes);
+
+    // Only the sites registered since are added
+    encoder.encodePlans[0].numNibbles = 7;
+    dictionary.add(StaticLogInfo(&compressHelper1, "File", 2, 0, "B", 0, 0,
+                                 paramTypes));
+    EXPECT_EQ(2U, encoder.updateEncodePlans(dictionary));
+    ASSERT_EQ(2U, encoder.encodePlans.size());
+    EXPECT_EQ(7, encoder.encodePlans[0].numNibbles);
+    EXPECT_EQ(&compressHelper1, encoder.encodePlans[1].compressionFunction);
+
+    // Another dictionary starts over
+    InvocationSiteRegistry other;
+    other.add(StaticLogInfo(&compressHelper1, "File", 3, 0, "C", 0, 0,
+                            paramTypes));
+    EXPECT_EQ(1U, encoder.updateEncodePlans(other));
+    ASSERT_EQ(1U, encoder.encodePlans.size());
+    EXPECT_EQ(&compressHelper1, encoder.encodePlans[0].compressionFunction);
+}
+
 TEST_F(LogTest, createMicroCode) {
     using namespace NanoLogInternal::Log;
     char backing_buffer[1024];
@@ -2563,6 +4098,7 @@ TEST_F(LogTest, createMicroCode) {
     EXPECT_EQ(5, fm->filenameLength);
     EXPECT_EQ(4, fm->lineNumber);
     EXPECT_EQ(0, fm->logLevel);
+    EXPECT_EQ(NanoLog::TIMESTAMP_RDTSC, fm->timestampSource);
     EXPECT_EQ(0, fm->numNibbles);
     EXPECT_EQ(1, fm->numPrintFragments);
 
@@ -2639,6 +4175,59 @@ TEST_F(LogTest, createMicroCode) {
     EXPECT_TRUE(pf->hasDynamicPrecision);
 }
 
+TEST_F(LogTest, CompiledFormat) {
+    using namespace NanoLogInternal::Log;
+    char backing_buffer[1024];
+    char *microCode = backing_buffer;
+
+    // Static text only
+    EXPECT_TRUE(Decoder::createMicroCode(&microCode, "100%% static",
+                                         "file", 4, 0));
+    CompiledFormat textOnly(backing_buffer);
+    ASSERT_EQ(1U, textOnly.steps.size());
+    EXPECT_EQ(CompiledFormat::TEXT_ONLY, textOnly.steps[0].conversion);
+    EXPECT_STREQ("100% static", textOnly.steps[0].prefix.c_str());
+    EXPECT_STREQ("", textOnly.steps[0].suffix.c_str());
+
+    // Plain integers and strings are converted directly
+    microCode = backing_buffer;
+    EXPECT_TRUE(Decoder::createMicroCode(&microCode,
+                                         "%d items, %s and %5d %lu done",
+                                         "file", 4, 0));
+    CompiledFormat mixed(backing_buffer);
+    ASSERT_EQ(4U, mixed.steps.size());
+
+    EXPECT_EQ(CompiledFormat::DECIMAL, mixed.steps[0].conversion);
+    EXPECT_STREQ("", mixed.steps[0].prefix.c_str());
+    EXPECT_STREQ("", mixed.steps[0].suffix.c_str());
+
+    EXPECT_EQ(CompiledFormat::STRING, mixed.steps[1].conversion);
+    EXPECT_STREQ(" items, ", mixed.steps[1].prefix.c_str());
+
+    EXPECT_EQ(CompiledFormat::PRINTF, mixed.steps[2].conversion);
+    EXPECT_STREQ(" and %5d", mixed.steps[2].fragment->formatFragment);
+
+    EXPECT_EQ(CompiledFormat::DECIMAL, mixed.steps[3].conversion);
+    EXPECT_STREQ(" ", mixed.steps[3].prefix.c_str());
+    EXPECT_STREQ(" done", mixed.steps[3].suffix.c_str());
+
+    // Everything else is left to printf
+    microCode = backing_buffer;
+    EXPECT_TRUE(Decoder::createMicroCode(&microCode,
+                                         "%.3f %.2s %x %*d %p %.2d %+d %c",
+                                         "file", 4, 0));
+    CompiledFormat others(backing_buffer);
+    ASSERT_EQ(8U, others.steps.size());
+#ifdef __cpp_lib_to_chars
+    EXPECT_EQ(CompiledFormat::FIXED_POINT, others.steps[0].conversion);
+    EXPECT_EQ(3, others.steps[0].precision);
+#else
+    EXPECT_EQ(CompiledFormat::PRINTF, others.steps[0].conversion);
+#endif
+    for (size_t i = 1; i < others.steps.size(); ++i)
+        EXPECT_EQ(CompiledFormat::PRINTF, others.steps[i].conversion);
+}
+
 TEST_F(LogTest, readDictionaryFragment) {
     char testFile[] = "test.dic";
     char *buffer = static_cast<char*>(malloc(1024*1024));
@@ -2752,18 +4341,75 @@ TEST_F(LogTest, readDictionaryFragment) {
     EXPECT_STREQ(formatString2, dc.fmtId2fmtString.at(1).c_str());
 
     EXPECT_EQ(2, dc.fmtId2metadata.size());
+    char *endOfRawMetadata = dc.endOfRawMetadata;
+
+    // And then we duplicate the dictionary (as another compression shard
+    // would) and the duplicates should be dropped along with their microcode
+    fclose(fd);
+    fd = fopen(testFile, "rb");
+    ASSERT_TRUE(fd);
+    EXPECT_TRUE(dc.readDictionaryFragment(fd));
+    ASSERT_EQ(2, dc.fmtId2fmtString.size());
+    EXPECT_STREQ(formatString, dc.fmtId2fmtString.at(0).c_str());
+    EXPECT_STREQ(formatString2, dc.fmtId2fmtString.at(1).c_str());
+
+    ASSERT_EQ(2, dc.fmtId2metadata.size());
+    EXPECT_EQ(endOfRawMetadata, dc.endOfRawMetadata);
+    fclose(fd);
+
+    // A fragment that claims to end at 3 overlaps only on its first entry
+    df->totalMetadataEntries = 3;
+    oFile.open(testFile);
+    oFile.write(buffer, writePos - buffer);
+    oFile.close();
 
-    // And then we duplicate the dictoinary and should end up with 4
     fd = fopen(testFile, "rb");
     ASSERT_TRUE(fd);
     EXPECT_TRUE(dc.readDictionaryFragment(fd));
-    ASSERT_EQ(4, dc.fmtId2fmtString.size());
+    ASSERT_EQ(3, dc.fmtId2fmtString.size());
     EXPECT_STREQ(formatString, dc.fmtId2fmtString.at(0).c_str());
     EXPECT_STREQ(formatString2, dc.fmtId2fmtString.at(1).c_str());
-    EXPECT_STREQ(formatString, dc.fmtId2fmtString.at(2).c_str());
-    EXPECT_STREQ(formatString2, dc.fmtId2fmtString.at(3).c_str());
+    EXPECT_STREQ(formatString2, dc.fmtId2fmtString.at(2).c_str());
+
+    ASSERT_EQ(3, dc.fmtId2metadata.size());
+    auto *fm = static_cast<FormatMetadata*>(dc.fmtId2metadata.at(2));
+    EXPECT_EQ(endOfRawMetadata, reinterpret_cast<char*>(fm));
+    EXPECT_STREQ(filename2, fm->filename);
+    EXPECT_LT(endOfRawMetadata, dc.endOfRawMetadata);
+    fclose(fd);
+
+    // Format strings the microcode can't be made for fail the fragment
+    char badFormatString[] = "bad %Ls\r\n";
+    writePos = buffer + sizeof(DictionaryFragment);
+    cli = push<CompressedLogInfo>(writePos);
+    cli->severity = 2;
+    cli->linenum = 125;
+    cli->filenameLength = strlen(filename) + 1;
+    cli->formatStringLength = strlen(badFormatString) + 1;
+
+    memcpy(writePos, filename, cli->filenameLength);
+    writePos += cli->filenameLength;
+    memcpy(writePos, badFormatString, cli->formatStringLength);
+    writePos += cli->formatStringLength;
+
+    df->newMetadataBytes = writePos - buffer;
+    df->totalMetadataEntries = 4;
+    oFile.open(testFile);
+    oFile.write(buffer, writePos - buffer);
+    oFile.close();
 
-    ASSERT_EQ(4, dc.fmtId2metadata.size());
+    endOfRawMetadata = dc.endOfRawMetadata;
+    fd = fopen(testFile, "rb");
+    ASSERT_TRUE(fd);
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(dc.readDictionaryFragment(fd));
+    EXPECT_STREQ("Attempt to decode format specifier failed: Ls\r\n"
+                 "Error: Couldn't process this: %Ls\r\n"
+                 "Could not process the format string of the log statement "
+                 "at file.txt:125\r\n",
+                 testing::internal::GetCapturedStderr().c_str());
+    EXPECT_EQ(3, dc.fmtId2metadata.size());
+    EXPECT_EQ(endOfRawMetadata, dc.endOfRawMetadata);
 
     fclose(fd);
     std::remove(testFile);
@@ -11,29 +11,83 @@ namespace NanoLog {
         return RuntimeLogger::getStats();
     }
 
+    void getMetrics(Metrics &metrics) {
+        RuntimeLogger::getMetrics(metrics);
+    }
+
+    void setMetricsExporter(std::function<void(const Metrics&)> exporter,
+                            uint32_t intervalMs) {
+        RuntimeLogger::setMetricsExporter(std::move(exporter), intervalMs);
+    }
+
     void printConfig() {
         printf("==== NanoLog Configuration ====\r\n");
 
         printf("StagingBuffer size: %u MB\r\n",
-               NanoLogConfig::STAGING_BUFFER_SIZE / 1000000);
+               RuntimeLogger::getStagingBufferSize() / 1000000);
         printf("Output Buffer size: %u MB\r\n",
-               NanoLogConfig::OUTPUT_BUFFER_SIZE / 1000000);
+               RuntimeLogger::getOutputBufferSize() / 1000000);
         printf("Release Threshold : %u MB\r\n",
                NanoLogConfig::RELEASE_THRESHOLD / 1000000);
         printf("Idle Poll Interval: %u µs\r\n",
                NanoLogConfig::POLL_INTERVAL_NO_WORK_US);
         printf("IO Poll Interval  : %u µs\r\n",
                NanoLogConfig::POLL_INTERVAL_DURING_IO_US);
+        printf("Compress Threads  : %u\r\n",
+               RuntimeLogger::getCompressionThreads());
+        printf("Output Engine     : %s\r\n",
+               OutputBackend::getEngineName(RuntimeLogger::getOutputEngine()));
+        printf("Block Compression : %s\r\n",
+               OutputBackend::getBlockCompressionName(
+                                    RuntimeLogger::getBlockCompression()));
     }
 
     void preallocate() {
         RuntimeLogger::preallocate();
     }
 
+    void preallocate(uint32_t stagingBufferSize) {
+        RuntimeLogger::preallocate(stagingBufferSize);
+    }
+
+    void setStagingBufferSize(uint32_t bytes) {
+        RuntimeLogger::setStagingBufferSize(bytes);
+    }
+
+    void setStagingBufferPlacement(bool numaLocal, bool hugePages,
+                                   bool mirrored) {
+        RuntimeLogger::setStagingBufferPlacement(numaLocal, hugePages,
+                                                 mirrored);
+    }
+
+    void setCrashRecoveryDirectory(const char *directory) {
+        RuntimeLogger::setCrashRecoveryDirectory(directory);
+    }
+
+    void setCompressionAgent(const char *directory) {
+        RuntimeLogger::setCompressionAgent(directory);
+    }
+
+    void setOutputBufferSize(uint32_t bytes) {
+        RuntimeLogger::setOutputBufferSize(bytes);
+    }
+
     void setLogFile(const char *filename) {
         RuntimeLogger::setLogFile(filename);
     }
 
+    void setLogCollector(const char *host, uint16_t port) {
+        RuntimeLogger::setLogCollector(host, port);
+    }
+
+    void setLogRotation(uint64_t maxBytes, uint32_t maxAgeSeconds) {
+        RuntimeLogger::setLogRotation(maxBytes, maxAgeSeconds);
+    }
+
+    void rotateLogFile() {
+        RuntimeLogger::rotateLogFile();
+    }
+
     LogLevel getLogLevel() {
         return RuntimeLogger::getLogLevel();
     }
@@ -42,11 +96,73 @@ namespace NanoLog {
         RuntimeLogger::setLogLevel(logLevel);
     }
 
+    void setLogSitesEnabled(LogSiteMatch match, const char *pattern,
+                            bool enabled) {
+        RuntimeLogger::setLogSitesEnabled(match, pattern, enabled);
+    }
+
+    void clearLogSiteFilters() {
+        RuntimeLogger::clearLogSiteFilters();
+    }
+
+    OverflowPolicy getOverflowPolicy() {
+        return RuntimeLogger::getOverflowPolicy();
+    }
+
+    void setOverflowPolicy(OverflowPolicy policy) {
+        RuntimeLogger::setOverflowPolicy(policy);
+    }
+
+    void setPriorityLogLevel(LogLevel logLevel, bool sync) {
+        RuntimeLogger::setPriorityLogLevel(logLevel, sync);
+    }
+
+    void setCompressionThreads(uint32_t numThreads) {
+        RuntimeLogger::setCompressionThreads(numThreads);
+    }
+
+    void setCompressionThreadCpus(const std::vector<int> &cpus) {
+        RuntimeLogger::setCompressionThreadCpus(cpus);
+    }
+
+    void setOutputEngine(OutputEngine engine) {
+        RuntimeLogger::setOutputEngine(engine);
+    }
+
+    OutputEngine getOutputEngine() {
+        return RuntimeLogger::getOutputEngine();
+    }
+
+    void setBlockCompression(BlockCompression compression) {
+        RuntimeLogger::setBlockCompression(compression);
+    }
+
+    BlockCompression getBlockCompression() {
+        return RuntimeLogger::getBlockCompression();
+    }
+
     void sync() {
         RuntimeLogger::sync();
     }
 
+    LogPosition getLogPosition() {
+        return RuntimeLogger::getLogPosition();
+    }
+
+    bool isPersisted(const LogPosition &position) {
+        return RuntimeLogger::isPersisted(position);
+    }
+
+    void notifyWhenPersisted(const LogPosition &position,
+                             std::function<void()> callback) {
+        RuntimeLogger::notifyWhenPersisted(position, std::move(callback));
+    }
+
     int getCoreIdOfBackgroundThread() {
         return RuntimeLogger::getCoreIdOfBackgroundThread();
     }
+
+    std::vector<int> getCoreIdsOfBackgroundThreads() {
+        return RuntimeLogger::getCoreIdsOfBackgroundThreads();
+    }
 };
\ No newline at end of file
@@ -16,7 +16,10 @@
 #ifndef NANOLOG_H
 #define NANOLOG_H
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 /**
  * This header serves as the application and generated code interface into
@@ -60,6 +63,276 @@ namespace LogLevels {
 };
 using namespace LogLevels;
 
+/**
+ * Determines what a logging thread does when it invokes #NANO_LOG while its
+ * thread-local staging buffer is full (i.e. the background thread is unable
+ * to keep up with the log rate).
+ */
+enum OverflowPolicy {
+    /**
+     * Wait for the background thread to free up space in the buffer. No log
+     * statements are lost, but the logging thread may stall (default).
+     */
+    BLOCK = 0,
+    /**
+     * Drop the log statement and return immediately. The number of dropped
+     * log statements is counted per thread and recorded in the log file, so
+     * the decompressor reports where the gaps are.
+     */
+    DROP_NEWEST,
+    NUM_OVERFLOW_POLICIES // must be the last element in the enum
+};
+
+/**
+ * Selects how a log statement reads the time it's logged at. All log
+ * statements use NanoLogConfig::TIMESTAMP_SOURCE unless the C++17 version of
+ * NanoLog picks another source for them with NANO_LOG_TIMESTAMP(). The source
+ * of each log statement is recorded in the log file, so the decompressor
+ * marks the timestamps that are less precise than the cycle counter. The
+ * values are recorded in the log file, so keep them below 4.
+ */
+enum TimestampSource {
+    /**
+     * Reads the CPU cycle counter with RDTSC (default). Since RDTSC is not
+     * serializing, the CPU may read the counter before the instructions
+     * preceding the log statement are done.
+     */
+    TIMESTAMP_RDTSC = 0,
+    /**
+     * Reads the CPU cycle counter with RDTSCP, which waits for the preceding
+     * instructions to finish first at the cost of a few more cycles.
+     */
+    TIMESTAMP_RDTSCP,
+    /**
+     * Reads a copy of the cycle counter that the first compression thread
+     * refreshes as it works, which saves the counter read. The timestamps lag
+     * by up to the time the thread takes to compress a batch of log messages
+     * (see NanoLogConfig::RELEASE_THRESHOLD); while the thread idles, the
+     * cycle counter is read instead. The decompressor marks these timestamps
+     * with a trailing '~'.
+     */
+    TIMESTAMP_COARSE,
+    /**
+     * Doesn't read the time at all, i.e. for log statements in hot loops that
+     * don't need it. They take on the timestamp of the log message logged
+     * before them by the same thread (or the time they're compressed at if
+     * there's none), which the decompressor marks with a trailing '+'.
+     */
+    TIMESTAMP_NONE,
+    NUM_TIMESTAMP_SOURCES // must be the last element in the enum
+};
+
+/**
+ * Format string of the log statement that the records of PerfUtils::TimeTrace
+ * are logged with once the C++17 version of NanoLog routes them into the log
+ * (see NanoLog::routeTimeTrace()). Its arguments are the record's format
+ * string, timestamp and 4 arguments, which the decompressor's trace export
+ * recognizes by this format string.
+ */
+#define NANO_LOG_TIME_TRACE_FORMAT "TimeTrace %s @%lu (%u, %u, %u, %u)"
+
+/**
+ * Selects the kernel interface the background threads use to write the
+ * compressed log to disk.
+ */
+enum OutputEngine {
+    /**
+     * POSIX AIO with a single write in flight per compression thread
+     * (default; available everywhere).
+     */
+    POSIX_AIO = 0,
+    /**
+     * Linux io_uring with up to NanoLogConfig::IO_URING_QUEUE_DEPTH writes in
+     * flight per compression thread, issued from pre-registered buffers. It
+     * requires Linux 5.1+ and falls back to POSIX_AIO when unavailable.
+     */
+    IO_URING,
+    /**
+     * Streams the compressed log over TCP to a log collector instead of
+     * writing it to a file. It is selected by setLogCollector() rather than
+     * setOutputEngine().
+     */
+    COLLECTOR,
+    NUM_OUTPUT_ENGINES // must be the last element in the enum
+};
+
+/**
+ * Selects the general purpose compressor the background threads run each
+ * output buffer through before writing it to disk. It finds the redundancy
+ * across log messages (e.g. repeated string arguments) that NanoLog's own
+ * encoding leaves behind. The compression runs on a helper thread for each
+ * compression thread, so it costs disk bandwidth rather than log throughput.
+ * The values are recorded in the log file; keep them in sync with
+ * BlockCodec::Algorithm.
+ */
+enum BlockCompression {
+    /**
+     * Output buffers are written out as is (default).
+     */
+    BLOCK_COMPRESSION_NONE = 0,
+    /**
+     * Output buffers are compressed with the LZ4 block format.
+     */
+    BLOCK_COMPRESSION_LZ4,
+    NUM_BLOCK_COMPRESSIONS // must be the last element in the enum
+};
+
+/**
+ * Selects what a log site filter is matched against (see
+ * setLogSitesEnabled()).
+ */
+enum LogSiteMatch {
+    /**
+     * The pattern is the decimal log identifier of a log statement, as
+     * shown by the decompressor. Since the non-preprocessor version of
+     * NanoLog assigns the identifiers as the log statements are first
+     * logged, it only matches log statements that have logged before.
+     */
+    MATCH_LOG_ID = 0,
+    /**
+     * The pattern is a shell glob (see fnmatch(3)) matched against the file
+     * name of a log statement as passed to the compiler (i.e. __FILE__).
+     */
+    MATCH_FILE,
+    /**
+     * The pattern is a substring of the format string of a log statement.
+     */
+    MATCH_FORMAT,
+    NUM_LOG_SITE_MATCHES // must be the last element in the enum
+};
+
+/**
+ * Identifies a point in the log messages of one logging thread (see
+ * getLogPosition()). Positions of the same thread can be compared by their
+ * offsets.
+ */
+struct LogPosition {
+    // Identifier of the thread's staging buffer (the runtime id of its log
+    // messages in the decompressor)
+    uint32_t bufferId;
+
+    // Number of bytes the thread logged to the staging buffer before the
+    // point
+    uint64_t offset;
+};
+
+/**
+ * Counters of the StagingBuffer of one logging thread (see getMetrics()).
+ */
+struct ThreadMetrics {
+    // Identifier of the StagingBuffer, which the decompressor shows as the
+    // runtime id of the thread's log messages
+    uint32_t id;
+
+    // Byte size of the StagingBuffer and the number of bytes in it waiting
+    // to be compressed. A buffer that stays close to full means the thread
+    // is about to block (or drop log statements under DROP_NEWEST).
+    uint32_t capacity;
+    uint32_t bytesPending;
+
+    // Number of log statements the thread logged and the number of those
+    // it dropped because its StagingBuffer was full
+    uint64_t numAllocations;
+    uint64_t numLogsDropped;
+
+    // Number of times the thread blocked on its full StagingBuffer, and the
+    // time it spent blocked (only counted if the runtime is compiled with
+    // -DRECORD_PRODUCER_STATS)
+    uint64_t numTimesBlocked;
+    uint64_t nsBlocked;
+};
+
+/**
+ * Snapshot of the counters kept by the NanoLog system (see getMetrics()). The
+ * counters are cumulative since the start of the process, except for the
+ * threads, which only include the StagingBuffers that are currently in use.
+ */
+struct Metrics {
+    // Number of buckets in stagingBufferPeekDist and writeLatencyDist
+    static const uint32_t NUM_PEEK_BUCKETS = 20;
+    static const uint32_t NUM_WRITE_LATENCY_BUCKETS = 20;
+
+    Metrics()
+        : compressionThreads(0)
+        , logsProcessed(0)
+        , bytesRead(0)
+        , bytesWritten(0)
+        , padBytesWritten(0)
+        , blockBytesIn(0)
+        , blockBytesOut(0)
+        , numWritesSubmitted(0)
+        , numWritesCompleted(0)
+        , numWritesFailed(0)
+        , numPriorityWrites(0)
+        , numPrioritySyncs(0)
+        , numLogFilesRotated(0)
+        , numStagingBuffersReused(0)
+        , numLogsDropped(0)
+        , nsActive(0)
+        , nsCompressing(0)
+        , nsOutput(0)
+        , stagingBufferPeekDist()
+        , writeLatencyDist()
+        , threads()
+    {}
+
+    // Number of background compression threads
+    uint32_t compressionThreads;
+
+    // Number of log statements compressed, the bytes they took up in the
+    // StagingBuffers, and the bytes written to the log file for them
+    // (including padBytesWritten bytes of padding)
+    uint64_t logsProcessed;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t padBytesWritten;
+
+    // Bytes fed to and produced by the block compressor (see
+    // setBlockCompression())
+    uint64_t blockBytesIn;
+    uint64_t blockBytesOut;
+
+    // Number of output buffer writes submitted, completed and failed
+    uint64_t numWritesSubmitted;
+    uint64_t numWritesCompleted;
+    uint64_t numWritesFailed;
+
+    // Number of output buffer writes that went out early because they held
+    // priority log messages, and the number of those that were synced (see
+    // setPriorityLogLevel())
+    uint64_t numPriorityWrites;
+    uint64_t numPrioritySyncs;
+
+    // Number of times the log file was rotated and the number of
+    // StagingBuffers reused from exited threads
+    uint64_t numLogFilesRotated;
+    uint64_t numStagingBuffersReused;
+
+    // Number of log statements dropped because their StagingBuffer was full
+    // (see OverflowPolicy::DROP_NEWEST), including those of the threads that
+    // have exited since
+    uint64_t numLogsDropped;
+
+    // Time the compression threads spent doing work, the part of it spent
+    // compressing, and an upper bound on the part spent on output
+    uint64_t nsActive;
+    uint64_t nsCompressing;
+    uint64_t nsOutput;
+
+    // Distribution of how full the StagingBuffers were when the compression
+    // threads found log messages in them, in 5% increments of their size
+    uint64_t stagingBufferPeekDist[NUM_PEEK_BUCKETS];
+
+    // Distribution of the time output buffer writes took from submission
+    // until the compression thread found them completed. Bucket 0 counts the
+    // writes that took less than 1us and bucket i > 0 the ones that took
+    // [2^(i-1), 2^i) us; the last bucket also counts all the slower writes.
+    uint64_t writeLatencyDist[NUM_WRITE_LATENCY_BUCKETS];
+
+    // Counters of each StagingBuffer in use
+    std::vector<ThreadMetrics> threads;
+};
+
 // User API
 
 /**
@@ -70,6 +343,123 @@ using namespace LogLevels;
  */
 void preallocate();
 
+/**
+ * Preallocates the NanoLog data structures for the current thread with a
+ * StagingBuffer of a specific size, overriding setStagingBufferSize() for
+ * this thread only. Hot threads can use this to get a larger buffer while
+ * the rest keep a small one. This has no effect if the thread has already
+ * logged or preallocated.
+ *
+ * \param stagingBufferSize
+ *      Byte size of the thread's StagingBuffer
+ */
+void preallocate(uint32_t stagingBufferSize);
+
+/**
+ * Sets the byte size of the StagingBuffers that hold each thread's log
+ * statements until they are compressed. The size only applies to threads
+ * that have not logged or preallocated yet, so it is best set at the start
+ * of the application. Larger buffers absorb bigger bursts of log statements
+ * at the cost of memory per thread (1MB by default). The buffers must be
+ * larger than the largest log statement.
+ *
+ * \param bytes
+ *      Size of StagingBuffers allocated after this call
+ */
+void setStagingBufferSize(uint32_t bytes);
+
+/**
+ * Sets how the StagingBuffers of threads that have not logged or preallocated
+ * yet are placed in memory. Each buffer is allocated by its thread, so it can
+ * be placed on the NUMA node the thread runs on instead of wherever the
+ * kernel's default policy puts it (the default is to place it locally).
+ * Huge pages cut the TLB misses of cycling through the buffers, but round
+ * each buffer up to a multiple of 2MB; if the system has no huge pages
+ * reserved, transparent huge pages are requested instead.
+ *
+ * Threads that move to other NUMA nodes keep their buffers where they are,
+ * so NUMA local placement works best with pinned logging threads.
+ *
+ * A mirrored StagingBuffer has its pages mapped a second time right after
+ * its end, so log messages that reach the end of the buffer continue in the
+ * mirror instead of leaving its tail unused and wrapping around. This keeps
+ * all of the buffer usable and lets the compression thread drain it in one
+ * piece. It uses twice the address space (not memory) and requires a buffer
+ * size that is a multiple of the page size; buffers backed by huge pages or
+ * crash recovery files are never mirrored.
+ *
+ * \param numaLocal
+ *      Place each StagingBuffer on the NUMA node of its thread
+ * \param hugePages
+ *      Back the StagingBuffers with 2MB huge pages
+ * \param mirrored
+ *      Map each StagingBuffer twice, back to back
+ */
+void setStagingBufferPlacement(bool numaLocal, bool hugePages,
+                               bool mirrored=false);
+
+/**
+ * Backs the StagingBuffers of threads that have not logged or preallocated
+ * yet with files in a directory, so that the log messages they hold survive
+ * the process crashing. Each buffer becomes a shared mapping of the file
+ * "<directory>/nanolog.<pid>.buffer<n>" next to a dictionary file
+ * "<directory>/nanolog.<pid>.dictionary", and logging to it costs the same
+ * as logging to memory. After a crash, "decompressor recover
+ * <directory>/nanolog.<pid> <logFile>" writes the messages the files still
+ * hold to a new log file; the last messages written before the crash may
+ * show up in both logs. The files are removed as the buffers are freed and
+ * at exit.
+ *
+ * The directory should be on a memory backed file system (e.g. /dev/shm):
+ * on a disk backed one, the kernel writes the buffers back to disk as they
+ * are logged to and takes page faults to track them.
+ *
+ * \param directory
+ *      Directory to create the files in; nullptr or "" turns the recovery
+ *      files off for the StagingBuffers allocated from here on
+ */
+void setCrashRecoveryDirectory(const char *directory);
+
+/**
+ * Hands the compression of the StagingBuffers of threads that have not logged
+ * or preallocated yet to a compression agent ("decompressor agent <directory>
+ * <logDirectory>") shared by all the processes on the host, so that the
+ * process only pays for logging to its StagingBuffers. The buffers are placed
+ * in files in the directory like with setCrashRecoveryDirectory(), which the
+ * agent maps to compress them into "<logDirectory>/nanolog.<pid>.log"; the
+ * process's own compression threads keep draining the buffers allocated
+ * before, but shrink their output buffers and stop waking up for new log
+ * messages. If no agent is running, the buffers fill up and the logging
+ * threads block (or drop log messages, see setOverflowPolicy()) until one
+ * is started, and sync() gives up on the agent after a second without
+ * progress. At exit, the files of the buffers the agent has not drained yet
+ * are left for it to finish.
+ *
+ * This lasts for the rest of the process; later calls, and calls to
+ * setCrashRecoveryDirectory(), have no effect. The log file settings only
+ * apply to the log messages the process still compresses itself.
+ *
+ * \param directory
+ *      Directory the compression agent watches; it should be on a memory
+ *      backed file system (e.g. /dev/shm)
+ */
+void setCompressionAgent(const char *directory);
+
+/**
+ * Sets the byte size of the output buffers in which the background threads
+ * batch compressed log statements before writing them to disk. Each
+ * compression thread uses two of these (64MB each by default), or one more
+ * than the queue depth with the IO_URING output engine. Smaller
+ * buffers save memory, but result in smaller and more frequent disk writes.
+ *
+ * Like setLogFile(), this function is *not* thread safe and will sync() the
+ * pending log statements before swapping out the buffers.
+ *
+ * \param bytes
+ *      Size of each output buffer; it is rounded up to a multiple of 512
+ */
+void setOutputBufferSize(uint32_t bytes);
+
 /**
  * Sets the file location for the NanoLog output. All NANO_LOG statements
  * invoked after this function returns are guaranteed to be in the new file
@@ -82,6 +472,77 @@ void preallocate();
  */
 void setLogFile(const char* filename);
 
+/**
+ * Streams the NanoLog output to a log collector (see the collector program)
+ * instead of a log file, as if the collector's end of the connection were
+ * the file; the collector writes each connection to a log file of its own
+ * that decompresses like any other. setLogFile() switches back to a file.
+ *
+ * The logging threads never wait on the network. Should the connection be
+ * lost, or the collector fail to take output for
+ * NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS, the output is dropped until the
+ * background threads reconnect, which they retry with a backoff of up to
+ * NanoLogConfig::COLLECTOR_RECONNECT_MAX_BACKOFF_US. A new connection starts
+ * off like a rotated log file (see setLogRotation()), so the collector's
+ * files can each be decompressed on their own. Rotating the log starts a new
+ * connection as well.
+ *
+ * Like setLogFile(), this function is *not* thread safe and will sync() the
+ * pending log statements before switching over.
+ *
+ * \param host
+ *      Host name or address of the collector
+ * \param port
+ *      TCP port the collector listens on
+ *
+ * \throw std::ios_base::failure
+ *      if the host cannot be resolved; a collector that can't be reached
+ *      yet is retried in the background instead
+ */
+void setLogCollector(const char *host, uint16_t port);
+
+/**
+ * Sets the limits at which NanoLog rotates the log file. Rotating renames the
+ * current log file to "<filename>.<n>", with the lowest n past the previous
+ * rotations that is not taken yet, and continues the log in a fresh file at
+ * the original location. Every file starts off with its own Checkpoint and
+ * dictionary, so each can be decompressed on its own.
+ *
+ * The background threads switch files between output buffers, so the
+ * logging threads never wait on a rotation. Since they'll switch at slightly
+ * different points, log messages logged by different threads around the time
+ * of the rotation may end up on either side of it. The limits are only
+ * checked as output is written, so an idle log file is not rotated for age
+ * until more log messages arrive.
+ *
+ * For the same reason, maxBytes is not a hard cap: each compression thread
+ * (see setCompressionThreads()) finishes the output buffer it's filling
+ * before it moves to the new file, and writes still in flight don't count
+ * yet when the limit is checked. A rotated file can thus exceed the limit by
+ * up to one output buffer (see setOutputBufferSize()) per compression thread
+ * plus the writes each has in flight, i.e. by several times the limit if it
+ * is small compared to the output buffers.
+ *
+ * This function is thread safe.
+ *
+ * \param maxBytes
+ *      Rotate the log file once it holds at least this many bytes (see
+ *      above for how far past it the file may grow); 0 (the default)
+ *      disables rotation by size
+ * \param maxAgeSeconds
+ *      Rotate the log file once it has been written to for this many
+ *      seconds; 0 (the default) disables rotation by age
+ */
+void setLogRotation(uint64_t maxBytes, uint32_t maxAgeSeconds);
+
+/**
+ * Requests the log file to be rotated (see setLogRotation()) once the
+ * background threads finish their current output buffer. This function only
+ * sets a flag, so it may be invoked from a signal handler (i.e. for SIGHUP
+ * from logrotate).
+ */
+void rotateLogFile();
+
 /**
  * Sets the minimum logging severity level in the system. All log statements
  * of a lower log severity will be dropped completely.
@@ -96,6 +557,143 @@ void setLogLevel(LogLevel logLevel);
  */
 LogLevel getLogLevel();
 
+/**
+ * Enables or disables the log statements matching a pattern regardless of
+ * their log level, i.e. to switch on the DEBUG statements of a single module
+ * in production. Filters accumulate and the one set last takes precedence
+ * over the others that match the same log statement; the log statements no
+ * filter matches are subject to the log level.
+ *
+ * Each log statement caches whether it is enabled in a flag next to its log
+ * identifier, which NanoLog rewrites when the filters or log level change,
+ * so filtering costs the same whether or not any filters are set. This
+ * function is thread safe, but takes time proportional to the number of
+ * log statements reached so far.
+ *
+ * \param match
+ *      What the pattern is matched against
+ * \param pattern
+ *      Log identifier, file glob, or format substring to match
+ * \param enabled
+ *      Whether the matching log statements should be logged
+ */
+void setLogSitesEnabled(LogSiteMatch match, const char *pattern, bool enabled);
+
+/**
+ * Removes all the filters set by setLogSitesEnabled(), leaving the log level
+ * in charge of every log statement again.
+ */
+void clearLogSiteFilters();
+
+/**
+ * Sets what logging threads do when their staging buffer is full. The policy
+ * applies to all threads and takes effect on the next log statement that
+ * encounters a full buffer.
+ *
+ * \param policy
+ *      New overflow policy to set
+ */
+void setOverflowPolicy(OverflowPolicy policy);
+
+/**
+ * Returns the current overflow policy enforced by NanoLog
+ */
+OverflowPolicy getOverflowPolicy();
+
+/**
+ * Sets the log level from which on log messages take the priority lane (the
+ * default is WARNING, so WARNING and ERROR messages do). Normally, the log
+ * messages wait in the staging buffers until a background thread gets to
+ * them and their output buffer is written out along with the other log
+ * messages. A priority log message instead wakes the background thread up
+ * right away, which then drains the message's staging buffer ahead of the
+ * others and writes the output out as soon as a buffer write can be
+ * submitted, so it doesn't wait behind large volumes of less severe log
+ * messages and is less likely to be lost in a crash.
+ *
+ * The logging thread pays for the wakeup (a lock and a notification), but
+ * only on the first priority log message since the background thread last
+ * drained its staging buffer.
+ *
+ * \param logLevel
+ *      Least severe log level to take the priority lane; SILENT_LOG_LEVEL
+ *      turns the priority lane off
+ * \param sync
+ *      Also wait for the writes holding priority log messages to complete
+ *      and fdatasync() the log file after them. This stalls the background
+ *      thread for the duration of the sync.
+ */
+void setPriorityLogLevel(LogLevel logLevel, bool sync=false);
+
+/**
+ * Sets the number of background threads used to compress and output log
+ * statements. Each thread handles a disjoint subset of the logging threads,
+ * so additional threads help when a single one cannot keep up with the
+ * aggregate log rate. Log statements from the same logging thread remain in
+ * order, but the relative order between subsets is only restored by the
+ * decompressor's time-sorted output.
+ *
+ * Like setLogFile(), this function is *not* thread safe and is best invoked
+ * before the first log message.
+ *
+ * \param numThreads
+ *      Number of compression threads to use; 0 is treated as 1.
+ */
+void setCompressionThreads(uint32_t numThreads);
+
+/**
+ * Restricts the background compression threads to a set of CPUs, such as
+ * the ones on the NUMA node of the logging threads or cores kept free of
+ * application threads. The threads are free to move between the CPUs in the
+ * set, and threads started later on (see setCompressionThreads()) are
+ * restricted to it too. This function is thread safe.
+ *
+ * \param cpus
+ *      Ids of the CPUs the compression threads may run on; an empty set
+ *      returns the threads to the CPUs the process started out with
+ */
+void setCompressionThreadCpus(const std::vector<int> &cpus);
+
+/**
+ * Sets the engine the background threads use to output the compressed log.
+ * If the engine is not supported by the system, NanoLog prints a warning
+ * and keeps using POSIX_AIO; getOutputEngine() returns the engine in use.
+ * While the output goes to a log collector, the engine is remembered for
+ * the next log file.
+ *
+ * Like setLogFile(), this function is *not* thread safe and will sync() the
+ * pending log statements before switching engines.
+ *
+ * \param engine
+ *      Output engine to use
+ */
+void setOutputEngine(OutputEngine engine);
+
+/**
+ * Returns the engine currently used to output the compressed log
+ */
+OutputEngine getOutputEngine();
+
+/**
+ * Sets the block compressor the background threads apply to the compressed
+ * log before writing it out (see BlockCompression). The decompressor detects
+ * compressed blocks on its own, so a log file may mix compressed and
+ * uncompressed blocks. Invalid values are treated as
+ * BLOCK_COMPRESSION_NONE.
+ *
+ * Like setLogFile(), this function is *not* thread safe and will sync() the
+ * pending log statements before switching compressors.
+ *
+ * \param compression
+ *      Block compressor to use
+ */
+void setBlockCompression(BlockCompression compression);
+
+/**
+ * Returns the block compressor currently applied to the compressed log
+ */
+BlockCompression getBlockCompression();
+
 /**
  * Waits until all pending log statements are persisted to disk. Note that if
  * there is another logging thread continually adding new pending log
@@ -104,6 +702,47 @@ LogLevel getLogLevel();
  */
 void sync();
 
+/**
+ * Returns the position of the calling thread's next log message. Once
+ * isPersisted() is true for it, all of the log messages the thread logged
+ * before this invocation have been written to the log file (i.e. their
+ * writes completed; they're only on disk if the file is opened with O_DSYNC
+ * or synced, see setPriorityLogLevel()). Unlike sync(), this only concerns
+ * the calling thread and never blocks.
+ *
+ * A thread that hasn't logged yet gets a position that is persisted from
+ * the start. The log messages of threads whose staging buffers are handed to
+ * a compression agent count as persisted right away, since they outlive the
+ * process in their crash recovery files (see setCompressionAgent()).
+ */
+LogPosition getLogPosition();
+
+/**
+ * Returns true if all of the log messages logged before a position returned
+ * by getLogPosition() have been written to the log file (see
+ * getLogPosition()). This may be invoked by any thread, but is cheapest for
+ * the thread the position belongs to.
+ *
+ * \param position
+ *      Position returned by getLogPosition()
+ */
+bool isPersisted(const LogPosition &position);
+
+/**
+ * Invokes a callback once all of the log messages logged before a position
+ * returned by getLogPosition() have been written to the log file, without
+ * blocking the calling thread. If they already have, the callback is
+ * invoked right away by the calling thread; otherwise it's invoked by a
+ * background thread, so it should be short and must not block or log.
+ *
+ * \param position
+ *      Position returned by getLogPosition()
+ * \param callback
+ *      Function to invoke once the position is persisted
+ */
+void notifyWhenPersisted(const LogPosition &position,
+                         std::function<void()> callback);
+
 // Debugging API
 
 /**
@@ -114,6 +753,34 @@ void sync();
  */
 std::string getStats();
 
+/**
+ * Takes a snapshot of the counters kept by the NanoLog system. Unlike
+ * getStats(), this is cheap enough to invoke periodically (i.e. to export
+ * the counters to a monitoring system) as it neither formats text nor
+ * flushes the log file, and it never blocks the logging threads. The
+ * counters are read without stopping the background threads, so they may
+ * be slightly inconsistent with one another.
+ *
+ * \param[out] metrics
+ *      Snapshot to fill in; its threads vector is reused, so invoking this
+ *      repeatedly with the same object avoids memory allocations
+ */
+void getMetrics(Metrics &metrics);
+
+/**
+ * Starts invoking a function with a snapshot of getMetrics() at a fixed
+ * interval on a dedicated thread, replacing the function set before. The
+ * function should return quickly and must not invoke setMetricsExporter().
+ *
+ * \param exporter
+ *      Function to invoke with each snapshot; an empty function stops the
+ *      exporting
+ * \param intervalMs
+ *      Milliseconds between consecutive snapshots
+ */
+void setMetricsExporter(std::function<void(const Metrics&)> exporter,
+                        uint32_t intervalMs);
+
 /**
  * Prints the configuration parameters being used by NanoLog to stdout. This is
  * primarily used to keep track of configurations for benchmarking.
@@ -121,10 +788,17 @@ std::string getStats();
 void printConfig();
 
 /**
- * Returns the id of the last CPU that the NanoLog Background thread ran on
+ * Returns the id of the last CPU that the (first) NanoLog Background thread
+ * ran on
  */
 int getCoreIdOfBackgroundThread();
 
+/**
+ * Returns the id of the last CPU that each of the NanoLog background threads
+ * ran on (-1 if it hasn't run yet), in the order of their shards
+ */
+std::vector<int> getCoreIdsOfBackgroundThreads();
+
 }; // namespace NanoLog
 
 
@@ -19,13 +19,18 @@
 #include <cstring>
 
 #include <algorithm>
+#include <array>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include "Common.h"
 #include "Cycles.h"
 #include "Packer.h"
 #include "NanoLog.h"
+#include "TimeTrace.h"
 
 /***
  * This file contains all the C++17 constexpr/templated magic that makes
@@ -40,6 +45,116 @@
  *          and produce a more compact encoding that's compatible with the
  *          NanoLog decompressor.
  */
+namespace NanoLog {
+
+/**
+ * Binary log argument, which the decompressor prints as lower case hex
+ * digits (see hexdump()).
+ */
+struct HexDump {
+    // Data to log
+    const char *data;
+
+    // Number of bytes in data
+    size_t length;
+};
+
+/**
+ * Wraps a binary buffer of known length, such as a network packet, to be
+ * logged with a "%s" specifier in a C++17 NANO_LOG() invocation. The bytes
+ * are copied into the log as is (i.e. there's no strlen() and NULLs are
+ * fine) and only converted to hex digits by the background compression.
+ * A precision (i.e. "%.8s") limits the number of hex digits printed.
+ *
+ * \param data
+ *      Data to log
+ * \param length
+ *      Number of bytes in data
+ */
+inline HexDump
+hexdump(const void *data, size_t length)
+{
+    return {static_cast<const char*>(data), length};
+}
+
+/**
+ * Array log argument, which the decompressor prints as a list of its
+ * elements (see array()).
+ */
+template<typename T>
+struct Array {
+    // Elements to log
+    const T *values;
+
+    // Number of elements in values
+    size_t count;
+};
+
+/**
+ * Wraps an array of integers or floating point numbers, such as the levels
+ * of an order book, to be logged with a "%s" specifier in a C++17 NANO_LOG()
+ * invocation. The elements are copied into the log as is, packed en bloc by
+ * the background compression and printed as "[1, 2, 3]" by the decompressor
+ * (see Log::Decoder::setArrayFormat()). Characters are logged as numbers.
+ *
+ * \param values
+ *      Elements to log
+ * \param count
+ *      Number of elements in values
+ */
+template<typename T>
+inline Array<T>
+array(const T *values, size_t count)
+{
+    static_assert(std::is_arithmetic<T>::value && sizeof(T) <= 8,
+                  "NanoLog::array() only logs integers, floats and doubles");
+    return {values, count};
+}
+
+template<typename T, typename Allocator>
+inline Array<T>
+array(const std::vector<T, Allocator> &values)
+{
+    return array(values.data(), values.size());
+}
+
+template<typename T, size_t N>
+inline Array<T>
+array(const std::array<T, N> &values)
+{
+    return array(values.data(), N);
+}
+
+/**
+ * Trait that lets objects of a user-defined type be logged with a "%s"
+ * specifier in a C++17 NANO_LOG() invocation, without formatting them on
+ * the logging thread. Specializations name the type, which is what the
+ * decompressor looks up the formatter that turns the object back into text
+ * by (see Log::Decoder::registerTypeFormatter()):
+ *
+ *      template<>
+ *      struct NanoLog::Serializer<Order> {
+ *          static constexpr char typeName[] = "Order";
+ *      };
+ *
+ * By default, the bytes of the object are copied into the log as is, so the
+ * type must be trivially copyable. Otherwise, or to log only some of its
+ * fields, the specialization also defines
+ *
+ *      // Number of bytes serialize() writes for the object
+ *      static size_t size(const Order &order);
+ *
+ *      // Writes the bytes of the object to out
+ *      static void serialize(const Order &order, char *out);
+ *
+ * The decompressor prints objects without a registered formatter as the
+ * type name and the hex digits of their bytes.
+ */
+template<typename T, typename Enable = void>
+struct Serializer {};
+
+}; // namespace NanoLog
+
 namespace NanoLogInternal {
 
 /**
@@ -340,6 +455,150 @@ getNumNibblesNeeded(const char (&fmt)[N])
     return numNibbles;
 }
 
+/**
+ * Character type of the strings that arguments of type T are logged with
+ * (only meaningful for the arguments of string specifiers).
+ */
+template<typename T>
+struct CharacterOf {
+    typedef typename std::remove_cv<
+                typename std::remove_pointer<T>::type>::type type;
+};
+
+template<typename C>
+struct CharacterOf<std::basic_string_view<C>> {
+    typedef C type;
+};
+
+/**
+ * Returns the number of bytes in a character of the strings that arguments
+ * of type T are logged with, i.e. the size of the null terminator they
+ * get in the compressed log.
+ */
+template<typename T>
+constexpr uint32_t
+getCharacterWidth()
+{
+    return std::is_same<typename CharacterOf<T>::type, wchar_t>::value
+                ? sizeof(wchar_t) : sizeof(char);
+}
+
+/**
+ * Indicates whether objects of type T are logged through a NanoLog::Serializer
+ * specialization.
+ */
+template<typename T, typename Enable = void>
+struct IsSerialized : std::false_type {};
+
+template<typename T>
+struct IsSerialized<T,
+            std::void_t<decltype(NanoLog::Serializer<T>::typeName)>>
+    : std::true_type {};
+
+/**
+ * Indicates whether the NanoLog::Serializer of type T serializes its objects
+ * itself, rather than having their bytes copied.
+ */
+template<typename T, typename Enable = void>
+struct HasSerializeFunction : std::false_type {};
+
+template<typename T>
+struct HasSerializeFunction<T,
+            std::void_t<decltype(NanoLog::Serializer<T>::serialize)>>
+    : std::true_type {};
+
+/**
+ * Log argument that refers to an object of a user-defined type (see
+ * NanoLog::Serializer).
+ */
+template<typename T>
+struct SerializedArg {
+    const T *object;
+};
+
+template<typename T>
+struct IsSerializedArg : std::false_type {};
+
+template<typename T>
+struct IsSerializedArg<SerializedArg<T>> : std::true_type {};
+
+/**
+ * Indicates whether a log argument is a NanoLog::array().
+ */
+template<typename T>
+struct IsArrayArg : std::false_type {};
+
+template<typename T>
+struct IsArrayArg<NanoLog::Array<T>> : std::true_type {};
+
+/**
+ * Type that a log argument of type T is passed on to the size, store and
+ * compress functions as. Arguments otherwise decay as if they were passed
+ * by value; std::strings are viewed rather than copied, since their length
+ * is known, and user-defined types are referred to.
+ */
+template<typename T, typename Enable = void>
+struct LogArg {
+    typedef typename std::decay<const T>::type type;
+};
+
+template<typename C>
+struct LogArg<std::basic_string<C>> {
+    typedef std::basic_string_view<C> type;
+};
+
+template<typename T>
+struct LogArg<T, typename std::enable_if<IsSerialized<T>::value>::type> {
+    typedef SerializedArg<T> type;
+};
+
+template<typename T>
+using LogArgType = typename LogArg<T>::type;
+
+/**
+ * Converts a log argument to its LogArgType.
+ */
+template<typename T>
+inline typename std::enable_if<!IsSerialized<T>::value, LogArgType<T>>::type
+toLogArg(const T &arg)
+{
+    return arg;
+}
+
+template<typename T>
+inline typename std::enable_if<IsSerialized<T>::value, SerializedArg<T>>::type
+toLogArg(const T &arg)
+{
+    return {&arg};
+}
+
+/**
+ * Describes how store_argument() stores an argument of a given type in an
+ * UncompressedEntry (see StaticLogInfo::argStorage).
+ *
+ * \tparam T
+ *      Type of the argument
+ *
+ * \return
+ *      sizeof(T) combined with the ARG_STORAGE_* flags that apply to T
+ */
+template<typename T>
+constexpr uint8_t
+getArgStorage()
+{
+    typedef typename CharacterOf<T>::type Character;
+
+    return static_cast<uint8_t>(sizeof(T)
+            | (std::is_signed<T>::value ? ARG_STORAGE_SIGNED : 0)
+            | (std::is_floating_point<T>::value ? ARG_STORAGE_FLOATING_POINT : 0)
+            | (std::is_same<Character, wchar_t>::value ? ARG_STORAGE_WIDE_STRING
+                                                       : 0)
+            | (std::is_same<T, NanoLog::HexDump>::value ? ARG_STORAGE_BINARY
+                                                        : 0)
+            | (IsSerializedArg<T>::value ? ARG_STORAGE_USER_TYPE : 0)
+            | (IsArrayArg<T>::value ? ARG_STORAGE_ARRAY : 0));
+}
+
 /**
  * Stores a single printf argument into a buffer and bumps the buffer pointer.
  *
@@ -431,6 +690,79 @@ store_argument(char **storage,
     return;
 }
 
+// std::string_view specialization of the above, which is stored the same as
+// a string pointer
+template<typename C>
+inline void
+store_argument(char **storage,
+               std::basic_string_view<C> arg,
+               const ParamType paramType,
+               const size_t stringSize)
+{
+    store_argument(storage, arg.data(), paramType, stringSize);
+}
+
+// NanoLog::hexdump() specialization of the above
+inline void
+store_argument(char **storage,
+               NanoLog::HexDump arg,
+               const ParamType paramType,
+               const size_t stringSize)
+{
+    store_argument(storage, arg.data, paramType, stringSize);
+}
+
+// User-defined type specialization of the above, which is stored as the
+// string that encodeUserType() expects
+template<typename T>
+inline void
+store_argument(char **storage,
+               SerializedArg<T> arg,
+               const ParamType paramType,
+               const size_t stringSize)
+{
+    typedef NanoLog::Serializer<T> Serializer;
+    constexpr size_t nameBytes = sizeof(Serializer::typeName) - 1;
+
+    uint32_t *size = reinterpret_cast<uint32_t*>(*storage);
+    *storage += sizeof(uint32_t);
+    *size = static_cast<uint32_t>(stringSize);
+
+    char *pos = *storage;
+    *pos++ = USER_TYPE_MARKER;
+    memcpy(pos, Serializer::typeName, nameBytes);
+    pos += nameBytes;
+    *pos++ = USER_TYPE_SEPARATOR;
+
+    if constexpr (HasSerializeFunction<T>::value)
+        Serializer::serialize(*arg.object, pos);
+    else
+        memcpy(pos, arg.object, sizeof(T));
+
+    *storage += stringSize;
+}
+
+// NanoLog::array() specialization of the above, which is stored as the byte
+// that describes the elements (see ARRAY_MARKER) and then the elements
+template<typename T>
+inline void
+store_argument(char **storage,
+               NanoLog::Array<T> arg,
+               const ParamType paramType,
+               const size_t stringSize)
+{
+    uint32_t *size = reinterpret_cast<uint32_t*>(*storage);
+    *storage += sizeof(uint32_t);
+    *size = static_cast<uint32_t>(stringSize);
+
+    **storage = static_cast<char>(sizeof(T)
+            | (std::is_signed<T>::value ? ARG_STORAGE_SIGNED : 0)
+            | (std::is_floating_point<T>::value ? ARG_STORAGE_FLOATING_POINT
+                                                : 0));
+    memcpy(*storage + 1, arg.values, stringSize - 1);
+    *storage += stringSize;
+}
+
 /**
  * Given a variable number of arguments to a NANO_LOG (i.e. printf-like)
  * statement, recursively unpack the arguments, store them to a buffer, and
@@ -576,6 +908,33 @@ getArgSize(const ParamType,
     return sizeof(void*);
 }
 
+/**
+ * Returns the most characters that a string argument is printed with
+ * according to the precision in the original format string.
+ *
+ * \param fmtType
+ *      Type of the argument according to the original printf-like format
+ *      string
+ * \param previousPrecision
+ *      The last 'precision' format specifier type encountered, which
+ *      applies to a string with a dynamic precision
+ */
+inline uint64_t
+getStringPrecision(const ParamType fmtType, uint64_t previousPrecision)
+{
+    // Strings with static length specifiers (ex %.10s), have non-negative
+    // ParamTypes equal to the static length.
+    if (fmtType >= ParamType::STRING)
+        return static_cast<uint32_t>(fmtType);
+
+    // If the string had a dynamic precision specified (i.e. %.*s), the
+    // previous parameter is the precision.
+    if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION)
+        return previousPrecision;
+
+    return UINT64_MAX;
+}
+
 /**
  * String specialization for getArgSize. Returns the number of bytes needed
  * to represent a string (with consideration for any 'precision' specifiers
@@ -605,20 +964,13 @@ getArgSize(const ParamType fmtType,
     if (fmtType <= ParamType::NON_STRING)
         return sizeof(void*);
 
-    stringBytes = strlen(str);
-    uint32_t fmtLength = static_cast<uint32_t>(fmtType);
-
-    // Strings with static length specifiers (ex %.10s), have non-negative
-    // ParamTypes equal to the static length. Thus, we use that value to
-    // truncate the string as necessary.
-    if (fmtType >= ParamType::STRING && stringBytes > fmtLength)
-        stringBytes = fmtLength;
-
-    // If the string had a dynamic precision specified (i.e. %.*s), use
-    // the previous parameter as the precision and truncate as necessary.
-    else if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION &&
-                stringBytes > previousPrecision)
-        stringBytes = previousPrecision;
+    // Strings with a precision are only scanned up to it, so they need not
+    // be null-terminated (i.e. %.*s with a length and a buffer)
+    if (fmtType == ParamType::STRING_WITH_NO_PRECISION)
+        stringBytes = strlen(str);
+    else
+        stringBytes = strnlen(str, getStringPrecision(fmtType,
+                                                      previousPrecision));
 
     return stringBytes + sizeof(uint32_t);
 }
@@ -635,22 +987,88 @@ getArgSize(const ParamType fmtType,
     if (fmtType <= ParamType::NON_STRING)
         return sizeof(void*);
 
-    stringBytes = wcslen(wstr);
-    uint32_t fmtLength = static_cast<uint32_t>(fmtType);
+    if (fmtType == ParamType::STRING_WITH_NO_PRECISION)
+        stringBytes = wcslen(wstr);
+    else
+        stringBytes = wcsnlen(wstr, getStringPrecision(fmtType,
+                                                       previousPrecision));
 
-    // Strings with static length specifiers (ex %.10s), have non-negative
-    // ParamTypes equal to the static length. Thus, we use that value to
-    // truncate the string as necessary.
-    if (fmtType >= ParamType::STRING && stringBytes > fmtLength)
-        stringBytes = fmtLength;
+    stringBytes *= sizeof(wchar_t);
+    return stringBytes + sizeof(uint32_t);
+}
 
-    // If the string had a dynamic precision specified (i.e. %.*s), use
-    // the previous parameter as the precision and truncate as necessary.
-    else if (fmtType == ParamType::STRING_WITH_DYNAMIC_PRECISION &&
-             stringBytes > previousPrecision)
-        stringBytes = previousPrecision;
+/**
+ * std::string_view specialization of the above. The length of the string is
+ * already known, so it isn't scanned for a NULL terminator.
+ */
+template<typename C>
+inline size_t
+getArgSize(const ParamType fmtType,
+           uint64_t &previousPrecision,
+           size_t &stringBytes,
+           std::basic_string_view<C> str)
+{
+    stringBytes = std::min<uint64_t>(str.size(),
+                            getStringPrecision(fmtType, previousPrecision));
+    stringBytes *= sizeof(C);
+    return stringBytes + sizeof(uint32_t);
+}
 
-    stringBytes *= sizeof(wchar_t);
+/**
+ * NanoLog::hexdump() specialization of the above. Each byte is printed as
+ * two hex digits, so only the bytes within half the precision are stored.
+ */
+inline size_t
+getArgSize(const ParamType fmtType,
+           uint64_t &previousPrecision,
+           size_t &stringBytes,
+           NanoLog::HexDump dump)
+{
+    uint64_t precision = getStringPrecision(fmtType, previousPrecision);
+    stringBytes = std::min<uint64_t>(dump.length,
+                                     precision/2 + precision%2);
+    return stringBytes + sizeof(uint32_t);
+}
+
+/**
+ * User-defined type specialization of the above. The object is stored in
+ * full, regardless of the precision.
+ */
+template<typename T>
+inline size_t
+getArgSize(const ParamType,
+           uint64_t &,
+           size_t &stringBytes,
+           SerializedArg<T> arg)
+{
+    typedef NanoLog::Serializer<T> Serializer;
+    static_assert(HasSerializeFunction<T>::value
+                        || std::is_trivially_copyable<T>::value,
+                  "NanoLog::Serializer specializations of types that aren't "
+                  "trivially copyable must define size() and serialize()");
+
+    // The type name is enclosed by USER_TYPE_MARKER and USER_TYPE_SEPARATOR
+    stringBytes = sizeof(Serializer::typeName) + 1;
+    if constexpr (HasSerializeFunction<T>::value)
+        stringBytes += Serializer::size(*arg.object);
+    else
+        stringBytes += sizeof(T);
+
+    return stringBytes + sizeof(uint32_t);
+}
+
+/**
+ * NanoLog::array() specialization of the above. The elements are stored in
+ * full, regardless of the precision, after the byte that describes them.
+ */
+template<typename T>
+inline size_t
+getArgSize(const ParamType,
+           uint64_t &,
+           size_t &stringBytes,
+           NanoLog::Array<T> arg)
+{
+    stringBytes = 1 + arg.count*sizeof(T);
     return stringBytes + sizeof(uint32_t);
 }
 
@@ -746,6 +1164,13 @@ compressSingle(BufferUtils::TwoNibbles* nibbles,
                 char **in,
                 char **out)
 {
+    // NANO_LOG() only ever compresses with compressSpecialized(), so the
+    // arguments that need more than a copy are left to that one alone
+    static_assert(!std::is_same<T, NanoLog::HexDump>::value &&
+                  !IsSerializedArg<T>::value && !IsArrayArg<T>::value,
+                  "NanoLog::hexdump(), NanoLog::array() and user-defined type "
+                  "arguments are only encoded by compressSpecialized()");
+
     if (paramType > ParamType::NON_STRING) {
         uint32_t stringBytes = *reinterpret_cast<uint32_t*>(*in);
         *in += sizeof(uint32_t);
@@ -768,12 +1193,7 @@ compressSingle(BufferUtils::TwoNibbles* nibbles,
         // save space. The length was explicitly encoded previously in the
         // uncompressed format to allow the two-pass compression function
         // to quickly skip strings in the stringsOnly=false pass.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpointer-arith"
-        constexpr uint32_t characterWidth =
-                                sizeof(typename std::remove_pointer<T>::type);
-#pragma GCC diagnostic pop
-
+        constexpr uint32_t characterWidth = getCharacterWidth<T>();
         bzero(*out, characterWidth);
         *out += characterWidth;
         return;
@@ -944,6 +1364,233 @@ compress(int numNibbles, const ParamType *paramTypes, char **input, char **outpu
     *output = out;
 }
 
+/**
+ * Returns the index of the nibble that stores a log argument in the
+ * compressed log. Only the non-strings have nibbles.
+ *
+ * \tparam Format
+ *      Describes the log invocation's format string (see NANO_LOG())
+ * \param argNum
+ *      Index of the argument
+ */
+template<typename Format>
+constexpr inline int
+getNibbleIndex(int argNum)
+{
+    int nibble = 0;
+    for (int i = 0; i < argNum; ++i) {
+        if (Format::paramTypes()[i] <= ParamType::NON_STRING)
+            ++nibble;
+    }
+
+    return nibble;
+}
+
+/**
+ * Variant of compressSingle() for which the argument's ParamType, position
+ * in the nibbles, and the pass it's processed in are all known at compile
+ * time, so the compiler only emits the instructions needed for it.
+ *
+ * \tparam Format
+ *      Describes the log invocation's format string (see NANO_LOG())
+ * \tparam stringsOnly
+ *      Indicates that the strings are being processed rather than the
+ *      non-string types
+ * \tparam argNum
+ *      Index of the argument
+ * \tparam T
+ *      Type of the argument to compress
+ *
+ * \param nibbles
+ *      Preallocated location for nibbles (used for non-string type compression)
+ * \param[in/out] in
+ *      Input buffer to read the arguments back from
+ * \param[in/out] out
+ *      Output buffer to write the compressed results to
+ */
+template<typename Format, bool stringsOnly, int argNum, typename T>
+inline void
+__attribute__((always_inline))
+compressSpecialized(BufferUtils::TwoNibbles *nibbles, char **in, char **out)
+{
+    constexpr ParamType paramType = Format::paramTypes()[argNum];
+    constexpr bool hexDump = std::is_same<T, NanoLog::HexDump>::value;
+    constexpr bool userType = IsSerializedArg<T>::value;
+    constexpr bool array = IsArrayArg<T>::value;
+    constexpr bool mustBeString = hexDump || userType || array
+                                || std::is_same<T, std::string_view>::value
+                                || std::is_same<T, std::wstring_view>::value;
+
+    static_assert(paramType > ParamType::NON_STRING || !mustBeString,
+                  "std::string(_view), NanoLog::hexdump(), NanoLog::array() "
+                  "and user-defined type arguments must be logged with a "
+                  "string specifier (i.e. %s)");
+
+    if constexpr (paramType > ParamType::NON_STRING) {
+        uint32_t stringBytes = *reinterpret_cast<uint32_t*>(*in);
+        *in += sizeof(uint32_t);
+
+        if constexpr (stringsOnly) {
+            constexpr uint32_t characterWidth = getCharacterWidth<T>();
+
+            // Arrays are never interned, but still take up an id byte in
+            // interned log invocations (as a new string)
+            if constexpr (array) {
+                if constexpr (Format::internStrings()) {
+                    **out = 0;
+                    ++*out;
+                }
+
+                encodeArray(*in, stringBytes, out);
+                *in += stringBytes;
+                return;
+            }
+
+            // Only narrow strings are interned (see NANO_LOG_INTERNED())
+            if constexpr (Format::internStrings() && characterWidth == 1) {
+                Log::StringInterner *interner = Log::StringInterner::active;
+
+                // The hex digits are interned where they're written
+                if constexpr (hexDump || userType) {
+                    char *digits = *out + 1;
+                    if constexpr (hexDump)
+                        encodeHexDump(*in, stringBytes, &digits);
+                    else
+                        encodeUserType(*in, stringBytes, &digits);
+                    *in += stringBytes;
+
+                    if (interner) {
+                        uint32_t length =
+                                static_cast<uint32_t>(digits - *out - 2);
+                        interner->encodeInPlace(length, out);
+                    } else {
+                        **out = 0;
+                        *out = digits;
+                    }
+                    return;
+                }
+
+                if (interner) {
+                    interner->encode(*in, stringBytes, out);
+                    *in += stringBytes;
+                    return;
+                }
+
+                // Without an interner, every string is encoded as a new one
+                **out = 0;
+                ++*out;
+            }
+
+            if constexpr (hexDump) {
+                encodeHexDump(*in, stringBytes, out);
+            } else if constexpr (userType) {
+                encodeUserType(*in, stringBytes, out);
+            } else {
+                memcpy(*out, *in, stringBytes);
+                *out += stringBytes;
+
+                bzero(*out, characterWidth);
+                *out += characterWidth;
+            }
+        }
+
+        *in += stringBytes;
+    } else if constexpr (stringsOnly) {
+        *in += sizeof(T);
+    } else if constexpr (!mustBeString) {
+        constexpr int nibble = getNibbleIndex<Format>(argNum);
+        T argument = *reinterpret_cast<T*>(*in);
+        *in += sizeof(T);
+
+        if constexpr (nibble & 0x1)
+            nibbles[nibble/2].second = 0xf & BufferUtils::pack(out, argument);
+        else
+            nibbles[nibble/2].first = 0xf & BufferUtils::pack(out, argument);
+    }
+}
+
+/**
+ * Makes one pass through the raw arguments of a log invocation with
+ * compressSpecialized().
+ *
+ * \tparam Format
+ *      Describes the log invocation's format string (see NANO_LOG())
+ * \tparam stringsOnly
+ *      Indicates that the strings are being processed rather than the
+ *      non-string types
+ * \tparam Ts
+ *      Types of the arguments
+ *
+ * \param nibbles
+ *      Preallocated location for nibbles (used for non-string type compression)
+ * \param[in/out] in
+ *      Input buffer to read the arguments back from
+ * \param[in/out] out
+ *      Output buffer to write the compressed results to
+ */
+template<typename Format, bool stringsOnly, typename... Ts, int... Indices>
+inline void
+__attribute__((always_inline))
+compressSpecializedPass(std::integer_sequence<int, Indices...>,
+                        BufferUtils::TwoNibbles *nibbles,
+                        char **in, char **out)
+{
+    (compressSpecialized<Format, stringsOnly, Indices, Ts>(nibbles, in, out),
+                                                                        ...);
+}
+
+/**
+ * Variant of compress() that is instantiated for a single log invocation
+ * site, so that the ParamTypes of its arguments are compile time constants
+ * rather than looked up (and branched on) for each log message. This gives
+ * the non-preprocessor version of NanoLog the same straight-line code per
+ * log message that the preprocessor generates. The encoding produced is the
+ * same as compress()'s, which doesn't support hexdump(), array() and
+ * user-defined type arguments; NANO_LOG() only ever uses this one.
+ *
+ * \tparam Format
+ *      Class describing the log invocation's format string with static
+ *      constexpr functions paramTypes(), numNibbles(), internStrings() and
+ *      timestampSource() (see NANO_LOG())
+ * \tparam Ts
+ *      Types of the arguments encoded in the input buffer
+ *
+ * \param numNibbles
+ *      Unused; the number of nibbles is taken from Format
+ * \param paramTypes
+ *      Unused; the ParamTypes are taken from Format
+ * \param[in/out] in
+ *      Input buffer to read the arguments back from
+ * \param[in/out out
+ *      Output buffer to write the compressed results to
+ */
+template<typename Format, typename... Ts>
+inline void
+compressSpecialized(int, const ParamType*, char **input, char **output)
+{
+    static_assert(Format::paramTypes().size() == sizeof...(Ts),
+                  "The number of arguments does not match the format string");
+
+    char *in = *input;
+    char *out = *output;
+
+    if constexpr (sizeof...(Ts) > 0) {
+        auto *nibbles = reinterpret_cast<BufferUtils::TwoNibbles*>(out);
+        out += (Format::numNibbles() + 1)/2;
+
+        // As in compress(), the non-strings are processed ahead of the strings
+        using Indices = std::make_integer_sequence<int, sizeof...(Ts)>;
+        compressSpecializedPass<Format, false, Ts...>(Indices(), nibbles,
+                                                      &in, &out);
+        in = *input;
+        compressSpecializedPass<Format, true, Ts...>(Indices(), nibbles,
+                                                     &in, &out);
+    }
+
+    *input = in;
+    *output = out;
+}
+
 /**
  * Logs a log message in the NanoLog system given all the static and dynamic
  * information associated with the log message. This function is meant to work
@@ -951,12 +1598,17 @@ compress(int numNibbles, const ParamType *paramTypes, char **input, char **outpu
  * maintain a permanent mapping of logId to static information once it's
  * assigned by this function.
  *
+ * \tparam Format
+ *      Class describing the format string at compile time, whose
+ *      compressSpecialized() instantiation is used as the compression
+ *      function of the log invocation (see NANO_LOG())
  * \tparam N
  *      length of the format string (automatically deduced)
  * \tparam M
  *      length of the paramTypes array (automatically deduced)
  * \tparam Ts
- *      Types of the arguments passed in for the log (automatically deduced)
+ *      Types of the arguments passed in for the log (automatically deduced);
+ *      they're compressed as their LogArgType
  *
  * \param logId[in/out]
  *      LogId that should be permanently associated with the static information.
@@ -980,7 +1632,7 @@ compress(int numNibbles, const ParamType *paramTypes, char **input, char **outpu
  * \param args
  *      Argument pack for all the arguments for the log invocation
  */
-template<long unsigned int N, int M, typename... Ts>
+template<typename Format, long unsigned int N, int M, typename... Ts>
 inline void
 log(int &logId,
     const char *filename,
@@ -989,36 +1641,50 @@ log(int &logId,
     const char (&format)[M],
     const int numNibbles,
     const std::array<ParamType, N>& paramTypes,
-    Ts... args)
+    const Ts&... args)
 {
     using namespace NanoLogInternal::Log;
     assert(N == static_cast<uint32_t>(sizeof...(Ts)));
 
     if (logId == UNASSIGNED_LOGID) {
+        //HACK: Zero length arrays are not allowed
+        static constexpr uint8_t argStorage[N + 1] =
+                                        {getArgStorage<LogArgType<Ts>>()...};
+
         const ParamType *array = paramTypes.data();
-        StaticLogInfo info(&compress<Ts...>,
+        StaticLogInfo info(&compressSpecialized<Format, LogArgType<Ts>...>,
                         filename,
                         linenum,
                         severity,
                         format,
                         sizeof...(Ts),
                         numNibbles,
-                        array);
+                        array,
+                        argStorage,
+                        Format::internStrings(),
+                        Format::timestampSource());
 
         RuntimeLogger::registerInvocationSite(info, logId);
     }
 
     uint64_t previousPrecision = -1;
-    uint64_t timestamp = PerfUtils::Cycles::rdtsc();
+    uint64_t timestamp =
+                    RuntimeLogger::readTimestamp<Format::timestampSource()>();
     size_t stringSizes[N + 1] = {}; //HACK: Zero length arrays are not allowed
     size_t allocSize = getArgSizes(paramTypes, previousPrecision,
-                            stringSizes, args...) + sizeof(UncompressedEntry);
+                            stringSizes, toLogArg(args)...)
+                                                + sizeof(UncompressedEntry);
 
     char *writePos = NanoLogInternal::RuntimeLogger::reserveAlloc(allocSize);
+
+    // The buffer is full and the overflow policy is to drop the message
+    if (writePos == nullptr)
+        return;
+
     UncompressedEntry *ue = reinterpret_cast<UncompressedEntry*>(writePos);
 
     writePos = ue->argData;
-    store_arguments(paramTypes, stringSizes, &writePos, args...);
+    store_arguments(paramTypes, stringSizes, &writePos, toLogArg(args)...);
 
     ue->fmtId = logId;
     ue->timestamp = timestamp;
@@ -1029,7 +1695,7 @@ log(int &logId,
 #endif
 
     assert(allocSize == downCast<uint32_t>((writePos - (char*)(ue))));
-    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize);
+    NanoLogInternal::RuntimeLogger::finishAlloc(allocSize, severity);
 }
 
 /**
@@ -1045,10 +1711,234 @@ static void
 __attribute__ ((format (printf, 1, 2)))
 checkFormat(const char *, ...) {}
 
+/**
+ * Converts a log argument to what the printf format checker should see it
+ * as (see checkFormat()), i.e. the strings logged zero-copy as the string
+ * pointers they stand in for.
+ */
+template<typename T>
+inline typename std::enable_if<!IsSerialized<T>::value, T>::type
+printfArg(T arg)
+{
+    return arg;
+}
+
+template<typename T>
+inline typename std::enable_if<IsSerialized<T>::value, const char *>::type
+printfArg(const T &)
+{
+    return NanoLog::Serializer<T>::typeName;
+}
+
+inline const char *
+printfArg(const std::string &arg)
+{
+    return arg.c_str();
+}
+
+inline const wchar_t *
+printfArg(const std::wstring &arg)
+{
+    return arg.c_str();
+}
+
+inline const char *
+printfArg(std::string_view arg)
+{
+    return arg.data();
+}
+
+inline const wchar_t *
+printfArg(std::wstring_view arg)
+{
+    return arg.data();
+}
+
+inline const char *
+printfArg(NanoLog::HexDump arg)
+{
+    return arg.data;
+}
+
+template<typename T>
+inline const char *
+printfArg(NanoLog::Array<T>)
+{
+    return "";
+}
 
 /**
- * NANO_LOG macro used for logging.
+ * Per-thread state of a NANO_LOG_EVERY_N() or NANO_LOG_RATE_LIMITED() log
+ * invocation. It's zero-initialized, so the thread_local variables holding it
+ * need no initialization guards.
+ */
+struct SampledLogSite {
+    // rdtsc() of when the current one second window began (rate limited)
+    uint64_t windowStart;
+
+    // Log messages to skip before the next one is logged (every N), or the
+    // number of them logged in the current window (rate limited)
+    uint32_t count;
+
+    // Log messages skipped since the last one that got logged
+    uint32_t numSuppressed;
+};
+
+/**
+ * Carries the format string of the log messages that report the messages a
+ * sampled log invocation suppressed (see logSuppressed()).
+ */
+struct SuppressedLogFormat {
+    static constexpr const char format[] = "suppressed %u similar messages";
+
+    static constexpr std::array<ParamType, 1> paramTypes() {
+        return analyzeFormatString<1>(format);
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded(format);
+    }
+    static constexpr bool internStrings() {
+        return false;
+    }
+    static constexpr NanoLog::TimestampSource timestampSource() {
+        return NanoLogConfig::TIMESTAMP_SOURCE;
+    }
+};
+
+/**
+ * Logs the number of log messages a sampled log invocation suppressed since
+ * the last one it let through, which the decompressor prints with the file
+ * and line number of the invocation. This is kept out of line since it's
+ * only invoked once per log message that makes it through.
  *
+ * \param logId[in/out]
+ *      LogId of the report, which is assigned on its first use
+ * \param filename
+ *      Name of the file containing the sampled log invocation
+ * \param linenum
+ *      Line number within filename of the sampled log invocation
+ * \param severity
+ *      LogLevel of the sampled log invocation
+ * \param numSuppressed
+ *      Number of log messages that it suppressed
+ */
+__attribute__((noinline))
+inline void
+logSuppressed(int &logId, const char *filename, int linenum,
+              LogLevel severity, uint32_t numSuppressed)
+{
+    static constexpr std::array<ParamType, 1> paramTypes =
+                                        SuppressedLogFormat::paramTypes();
+    log<SuppressedLogFormat>(logId, filename, linenum, severity,
+                             SuppressedLogFormat::format,
+                             SuppressedLogFormat::numNibbles(), paramTypes,
+                             numSuppressed);
+}
+
+/**
+ * Decides whether a NANO_LOG_EVERY_N() invocation logs its message, which
+ * the first and then every n-th invocation on a thread does. The ones in
+ * between are counted as suppressed and reported ahead of the next message
+ * that's logged (see logSuppressed()).
+ *
+ * \param site
+ *      The calling thread's state of the log invocation
+ * \param n
+ *      Log one out of every n messages
+ * \param suppressedLogId[in/out]
+ *      LogId of the log invocation's suppressed message reports
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation
+ * \param severity
+ *      LogLevel of the log invocation
+ *
+ * \return
+ *      true if the message should be logged
+ */
+inline bool
+admitEveryN(SampledLogSite &site, uint32_t n, int &suppressedLogId,
+            const char *filename, int linenum, LogLevel severity)
+{
+    if (site.count > 0) {
+        --site.count;
+        ++site.numSuppressed;
+        return false;
+    }
+
+    site.count = (n > 0) ? n - 1 : 0;
+    if (site.numSuppressed > 0) {
+        logSuppressed(suppressedLogId, filename, linenum, severity,
+                      site.numSuppressed);
+        site.numSuppressed = 0;
+    }
+
+    return true;
+}
+
+/**
+ * Decides whether a NANO_LOG_RATE_LIMITED() invocation logs its message,
+ * which the first maxPerSecond invocations on a thread in every one second
+ * window do. The others are counted as suppressed and reported ahead of the
+ * next message that's logged (see logSuppressed()).
+ *
+ * \param site
+ *      The calling thread's state of the log invocation
+ * \param maxPerSecond
+ *      Maximum number of messages to log per second
+ * \param suppressedLogId[in/out]
+ *      LogId of the log invocation's suppressed message reports
+ * \param filename
+ *      Name of the file containing the log invocation
+ * \param linenum
+ *      Line number within filename of the log invocation
+ * \param severity
+ *      LogLevel of the log invocation
+ *
+ * \return
+ *      true if the message should be logged
+ */
+inline bool
+admitRateLimited(SampledLogSite &site, uint32_t maxPerSecond,
+                 int &suppressedLogId, const char *filename, int linenum,
+                 LogLevel severity)
+{
+    static const uint64_t cyclesPerWindow =
+                                    PerfUtils::Cycles::fromSeconds(1.0);
+
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (now - site.windowStart >= cyclesPerWindow) {
+        site.windowStart = now;
+        site.count = 0;
+    }
+
+    if (site.count >= maxPerSecond) {
+        ++site.numSuppressed;
+        return false;
+    }
+
+    ++site.count;
+    if (site.numSuppressed > 0) {
+        logSuppressed(suppressedLogId, filename, linenum, severity,
+                      site.numSuppressed);
+        site.numSuppressed = 0;
+    }
+
+    return true;
+}
+
+
+/**
+ * Expands to a log invocation for NANO_LOG() and its variants.
+ *
+ * \param internedStrings
+ *      Whether the %s arguments are interned (must be constant)
+ * \param clockSource
+ *      The NanoLog::TimestampSource of the log invocation (must be constant)
+ * \param admit
+ *      Expression deciding whether a log message that passed the log level
+ *      and log site filters is logged (i.e. sampling); true for most
  * \param severity
  *      The LogLevel of the log invocation (must be constant)
  * \param format
@@ -1056,7 +1946,8 @@ checkFormat(const char *, ...) {}
  * \param ...UNASSIGNED_LOGID
  *      Log arguments associated with the printf-like string.
  */
-#define NANO_LOG(severity, format, ...) do { \
+#define NANO_LOG_SITE(internedStrings, clockSource, admit, severity, format, \
+                      ...) do { \
     using namespace NanoLogInternal; \
     constexpr int numNibbles = getNumNibblesNeeded(format); \
     constexpr int nParams = countFmtParams(format); \
@@ -1066,22 +1957,204 @@ checkFormat(const char *, ...) {}
      * The static logId is used to forever associate this local scope (tied
      * to an expansion of #NANO_LOG) with an id and the paramTypes array is
      * used by the compression function, which is invoked in another thread
-     * at a much later time. */ \
+     * at a much later time. The siteFilter caches whether the log level and
+     * log site filters let this invocation log. */ \
     static constexpr std::array<ParamType, nParams> paramTypes = \
                                 analyzeFormatString<nParams>(format); \
     static int logId = UNASSIGNED_LOGID; \
+    static int siteFilter = LOG_SITE_UNRESOLVED; \
     \
-    if (severity > NanoLog::getLogLevel()) \
+    /* Carries the format string's information at compile time so that a
+     * compression function can be specialized to this log invocation */ \
+    struct NanoLogFormat { \
+        static constexpr std::array<ParamType, nParams> paramTypes() { \
+            return analyzeFormatString<nParams>(format); \
+        } \
+        static constexpr int numNibbles() { \
+            return getNumNibblesNeeded(format); \
+        } \
+        static constexpr bool internStrings() { \
+            return internedStrings; \
+        } \
+        static constexpr NanoLog::TimestampSource timestampSource() { \
+            return clockSource; \
+        } \
+    }; \
+    \
+    if (!RuntimeLogger::isLogSiteEnabled(siteFilter, &logId, __FILE__, \
+                                         __LINE__, severity, format)) \
+        break; \
+    \
+    if (!(admit)) \
         break; \
     \
     /* Triggers the GNU printf checker by passing it into a no-op function.
      * Trick: This call is surrounded by an if false so that the VA_ARGS don't
-     * evaluate for cases like '++i'.*/ \
-    if (false) { checkFormat(format, ##__VA_ARGS__); } \
+     * evaluate for cases like '++i'. The arguments pass through printfArg()
+     * so that std::strings and the like are checked as strings. */ \
+    if (false) { \
+        [](auto... args) { checkFormat(format, printfArg(args)...); } \
+                                                        (__VA_ARGS__); \
+    } \
     \
-    NanoLogInternal::log(logId, __FILE__, __LINE__, severity, format, \
+    NanoLogInternal::log<NanoLogFormat>(logId, __FILE__, __LINE__, severity, format, \
                             numNibbles, paramTypes, ##__VA_ARGS__); \
 } while(0)
+
+/**
+ * NANO_LOG macro used for logging.
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...UNASSIGNED_LOGID
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG(severity, format, ...) \
+    NANO_LOG_SITE(false, NanoLogConfig::TIMESTAMP_SOURCE, true, severity, \
+                  format, ##__VA_ARGS__)
+
+/**
+ * Variant of NANO_LOG() for log invocations whose %s arguments take on few
+ * distinct values (i.e. hostnames, symbols or states). Rather than storing
+ * each of them in full, the compression threads encode a string that was
+ * already logged in the same BufferExtent as a one byte reference to it,
+ * which saves on both the log file and the time it takes to decode it. The
+ * first occurrence costs one byte more than with NANO_LOG(), so this is a
+ * poor fit for strings that are mostly unique. Wide (%ls) strings are never
+ * interned. Only the C++17 version of NanoLog supports this.
+ *
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_INTERNED(severity, format, ...) \
+    NANO_LOG_SITE(true, NanoLogConfig::TIMESTAMP_SOURCE, true, severity, \
+                  format, ##__VA_ARGS__)
+
+/**
+ * Variant of NANO_LOG() for log invocations that should read their timestamp
+ * differently than the NanoLogConfig::TIMESTAMP_SOURCE default; i.e. hot log
+ * statements that can make do with the cached TIMESTAMP_COARSE cycle count,
+ * or TIMESTAMP_NONE for ones that don't need a timestamp of their own. The
+ * decompressor marks such timestamps with a '~' (coarse) or a '+' (none)
+ * after the nanoseconds. Only the C++17 version of NanoLog supports this.
+ *
+ * \param source
+ *      The NanoLog::TimestampSource of the log invocation (must be constant)
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_TIMESTAMP(source, severity, format, ...) \
+    NANO_LOG_SITE(false, source, true, severity, format, ##__VA_ARGS__)
+
+/**
+ * Variant of NANO_LOG() that logs only the first and then every n-th message
+ * of a thread, i.e. for log invocations in hot loops. The messages skipped in
+ * between are reported ahead of the next one logged as "suppressed N similar
+ * messages" with the same file and line number. Only the C++17 version of
+ * NanoLog supports this.
+ *
+ * \param n
+ *      Log one out of every n messages
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_EVERY_N(n, severity, format, ...) do { \
+    static thread_local NanoLogInternal::SampledLogSite sampledSite; \
+    static int suppressedLogId = NanoLogInternal::UNASSIGNED_LOGID; \
+    NANO_LOG_SITE(false, NanoLogConfig::TIMESTAMP_SOURCE, \
+                  NanoLogInternal::admitEveryN(sampledSite, n, \
+                                suppressedLogId, __FILE__, __LINE__, \
+                                severity), \
+                  severity, format, ##__VA_ARGS__); \
+} while (0)
+
+/**
+ * Variant of NANO_LOG() that logs at most maxPerSecond messages per second
+ * and thread, i.e. for log invocations in retry loops. The messages over the
+ * limit are reported ahead of the next one logged as "suppressed N similar
+ * messages" with the same file and line number. Only the C++17 version of
+ * NanoLog supports this.
+ *
+ * \param maxPerSecond
+ *      Maximum number of messages to log per second
+ * \param severity
+ *      The LogLevel of the log invocation (must be constant)
+ * \param format
+ *      printf-like format string (must be literal)
+ * \param ...
+ *      Log arguments associated with the printf-like string.
+ */
+#define NANO_LOG_RATE_LIMITED(maxPerSecond, severity, format, ...) do { \
+    static thread_local NanoLogInternal::SampledLogSite sampledSite; \
+    static int suppressedLogId = NanoLogInternal::UNASSIGNED_LOGID; \
+    NANO_LOG_SITE(false, NanoLogConfig::TIMESTAMP_SOURCE, \
+                  NanoLogInternal::admitRateLimited(sampledSite, \
+                                maxPerSecond, suppressedLogId, __FILE__, \
+                                __LINE__, severity), \
+                  severity, format, ##__VA_ARGS__); \
+} while (0)
+
 } /* Namespace NanoLogInternal */
 
+namespace NanoLog {
+
+/**
+ * Logs a record of PerfUtils::TimeTrace with NanoLog (see routeTimeTrace()).
+ * The record's format string is interned, so it's stored in full only once
+ * per BufferExtent.
+ *
+ * \param timestamp
+ *      Time at which the event occurred
+ * \param format
+ *      Format string describing the event (see PerfUtils::TimeTrace::record())
+ * \param arg0
+ *      Argument to use when printing a message about this event.
+ * \param arg1
+ *      Argument to use when printing a message about this event.
+ * \param arg2
+ *      Argument to use when printing a message about this event.
+ * \param arg3
+ *      Argument to use when printing a message about this event.
+ */
+inline void
+logTimeTraceRecord(uint64_t timestamp, const char *format, uint32_t arg0,
+                   uint32_t arg1, uint32_t arg2, uint32_t arg3)
+{
+    NANO_LOG_INTERNED(NOTICE, NANO_LOG_TIME_TRACE_FORMAT, format,
+                      static_cast<unsigned long>(timestamp),
+                      arg0, arg1, arg2, arg3);
+}
+
+/**
+ * Routes the records of PerfUtils::TimeTrace into the StagingBuffer of the
+ * thread recording them instead of the TimeTrace's own buffers, so that they
+ * end up in the log file alongside the log messages. The decompressor's
+ * trace command renders them on the same per-thread tracks. This should be
+ * invoked before any thread records (see PerfUtils::TimeTrace::setSink()).
+ *
+ * \param enable
+ *      true to log the records; false to keep them in the TimeTrace buffers
+ */
+inline void
+routeTimeTrace(bool enable)
+{
+    PerfUtils::TimeTrace::setSink(enable ? &logTimeTraceRecord : nullptr);
+}
+
+}; /* namespace NanoLog */
+
 #endif //NANOLOG_CPP17_H
@@ -13,6 +13,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <fstream>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "TestUtil.h"
@@ -20,6 +28,37 @@
 #include "RuntimeLogger.h"
 #include "NanoLogCpp17.h"
 
+// User-defined types for the NANO_LOG_userTypes test
+struct TestQuote {
+    uint32_t id;
+    double price;
+};
+
+struct TestOrder {
+    std::string symbol;
+    int32_t quantity;
+};
+
+template<>
+struct NanoLog::Serializer<TestQuote> {
+    static constexpr char typeName[] = "TestQuote";
+};
+
+template<>
+struct NanoLog::Serializer<TestOrder> {
+    static constexpr char typeName[] = "TestOrder";
+
+    static size_t size(const TestOrder &order) {
+        return order.symbol.size() + sizeof(order.quantity);
+    }
+
+    static void serialize(const TestOrder &order, char *out) {
+        memcpy(out, &order.quantity, sizeof(order.quantity));
+        memcpy(out + sizeof(order.quantity), order.symbol.data(),
+               order.symbol.size());
+    }
+};
+
 namespace {
 using namespace NanoLogInternal;
 using namespace PerfUtils;
@@ -70,6 +109,49 @@ class NanoLogCpp17Test : public ::testing::Test {
   // Objects declared here can be used by all tests in the test case for Foo.
 };
 
+/**
+ * Decompresses a log file in chronological order and checks that the
+ * timestamps of its log messages never go backwards.
+ *
+ * \param logFile
+ *      Log file to decompress
+ * \param expectedLogMsgs
+ *      Number of log messages the log file holds
+ */
+void
+expectChronological(const char *logFile, int64_t expectedLogMsgs)
+{
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    Log::Decoder dc;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(expectedLogMsgs, dc.decompressTo(outputFd));
+    fclose(outputFd);
+
+    // The lines start with "YYYY-MM-DD HH:MM:SS.nnnnnnnnn", which sorts the
+    // same way as the timestamps do
+    const size_t timestampLength = sizeof("YYYY-MM-DD HH:MM:SS.nnnnnnnnn") - 1;
+    std::ifstream iFile(decomp);
+    std::string iLine, latest;
+    int64_t numOutOfOrder = 0;
+    while (std::getline(iFile, iLine)) {
+        if (iLine.size() < timestampLength || !isdigit(iLine[0]))
+            continue;
+
+        std::string timestamp = iLine.substr(0, timestampLength);
+        if (timestamp < latest)
+            ++numOutOfOrder;
+        else
+            latest = timestamp;
+    }
+    iFile.close();
+
+    EXPECT_EQ(0, numOutOfOrder);
+    std::remove(decomp);
+}
+
 TEST_F(NanoLogCpp17Test, getParamInfo_constexpr) {
     constexpr ParamType ret1 = getParamInfo("Hello World %*.*s asdf", 1);
     EXPECT_EQ(ParamType::DYNAMIC_PRECISION, ret1);
@@ -500,6 +582,93 @@ TEST_F(NanoLogCpp17Test, getArgSize) {
     EXPECT_EQ(len, stringSize);
 }
 
+TEST_F(NanoLogCpp17Test, getArgSize_precisionBoundsScan) {
+    size_t stringSize = 0;
+    uint64_t previousPrecision = 4;
+
+    // With a precision, the string need not be null-terminated
+    const char unterminated[] = {'a', 'b', 'c', 'd', 'e', 'f'};
+    EXPECT_EQ(4 + sizeof(uint32_t), getArgSize(STRING_WITH_DYNAMIC_PRECISION,
+                                               previousPrecision,
+                                               stringSize,
+                                               unterminated));
+    EXPECT_EQ(4U, stringSize);
+
+    EXPECT_EQ(6 + sizeof(uint32_t), getArgSize(ParamType(6),
+                                               previousPrecision,
+                                               stringSize,
+                                               unterminated));
+    EXPECT_EQ(6U, stringSize);
+
+    EXPECT_EQ(2 + sizeof(uint32_t), getArgSize(ParamType(8),
+                                               previousPrecision,
+                                               stringSize,
+                                               "ab"));
+    EXPECT_EQ(2U, stringSize);
+}
+
+TEST_F(NanoLogCpp17Test, getArgSize_lengthKnown) {
+    size_t stringSize = 0;
+    uint64_t previousPrecision = 3;
+
+    std::string_view view("abc\0def", 7);
+    EXPECT_EQ(7 + sizeof(uint32_t), getArgSize(STRING_WITH_NO_PRECISION,
+                                               previousPrecision,
+                                               stringSize,
+                                               view));
+    EXPECT_EQ(7U, stringSize);
+
+    EXPECT_EQ(3 + sizeof(uint32_t), getArgSize(STRING_WITH_DYNAMIC_PRECISION,
+                                               previousPrecision,
+                                               stringSize,
+                                               view));
+    EXPECT_EQ(3U, stringSize);
+
+    EXPECT_EQ(5 + sizeof(uint32_t), getArgSize(ParamType(5),
+                                               previousPrecision,
+                                               stringSize,
+                                               view));
+    EXPECT_EQ(5U, stringSize);
+
+    std::wstring_view wview(L"wide");
+    EXPECT_EQ(2*sizeof(wchar_t) + sizeof(uint32_t),
+              getArgSize(ParamType(2), previousPrecision, stringSize, wview));
+    EXPECT_EQ(2*sizeof(wchar_t), stringSize);
+
+    // Only the bytes whose hex digits fit in the precision are kept
+    const char bytes[] = {0, 1, 2, 3, 4, 5};
+    NanoLog::HexDump dump = NanoLog::hexdump(bytes, sizeof(bytes));
+    EXPECT_EQ(6 + sizeof(uint32_t), getArgSize(STRING_WITH_NO_PRECISION,
+                                               previousPrecision,
+                                               stringSize,
+                                               dump));
+    EXPECT_EQ(6U, stringSize);
+
+    EXPECT_EQ(2 + sizeof(uint32_t), getArgSize(STRING_WITH_DYNAMIC_PRECISION,
+                                               previousPrecision,
+                                               stringSize,
+                                               dump));
+    EXPECT_EQ(2U, stringSize);
+
+    EXPECT_EQ(2 + sizeof(uint32_t), getArgSize(ParamType(4),
+                                               previousPrecision,
+                                               stringSize,
+                                               dump));
+    EXPECT_EQ(2U, stringSize);
+
+    // The LogArgTypes view std::strings rather than copy them
+    EXPECT_TRUE((std::is_same<std::string_view,
+                              LogArgType<std::string>>::value));
+    EXPECT_TRUE((std::is_same<std::wstring_view,
+                              LogArgType<std::wstring>>::value));
+    EXPECT_TRUE((std::is_same<const char*, LogArgType<char[4]>>::value));
+    EXPECT_TRUE((std::is_same<int, LogArgType<int>>::value));
+    EXPECT_EQ(ARG_STORAGE_BINARY, getArgStorage<NanoLog::HexDump>()
+                                        & ~ARG_STORAGE_SIZE_MASK);
+    EXPECT_EQ(ARG_STORAGE_WIDE_STRING, getArgStorage<std::wstring_view>()
+                                        & ~ARG_STORAGE_SIZE_MASK);
+}
+
 TEST_F(NanoLogCpp17Test, getArgSize_wchar_t) {
     size_t stringSize = 0;
     uint64_t previousPrecision = 0;
@@ -930,4 +1099,1052 @@ TEST_F(NanoLogCpp17Test, compress) {
     EXPECT_EQ(0, *out); ++out;
 }
 
-}; //namespace
\ No newline at end of file
+// Format descriptions for the compressSpecialized test (see NANO_LOG())
+struct EmptyFormat {
+    static constexpr std::array<ParamType, 0> paramTypes() {
+        return analyzeFormatString<0>("Nothing here");
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded("Nothing here");
+    }
+    static constexpr bool internStrings() {
+        return false;
+    }
+};
+
+struct MixedFormat {
+    static constexpr std::array<ParamType, 4> paramTypes() {
+        return analyzeFormatString<4>("%d %s %ls %hu");
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded("%d %s %ls %hu");
+    }
+    static constexpr bool internStrings() {
+        return false;
+    }
+};
+
+struct BinaryFormat {
+    static constexpr std::array<ParamType, 4> paramTypes() {
+        return analyzeFormatString<4>("%d %s %s %s");
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded("%d %s %s %s");
+    }
+    static constexpr bool internStrings() {
+        return false;
+    }
+};
+
+struct IntFormat {
+    static constexpr std::array<ParamType, 1> paramTypes() {
+        return analyzeFormatString<1>("%d");
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded("%d");
+    }
+    static constexpr bool internStrings() {
+        return false;
+    }
+};
+
+struct InternedFormat {
+    static constexpr std::array<ParamType, 3> paramTypes() {
+        return analyzeFormatString<3>("%s %d %ls");
+    }
+    static constexpr int numNibbles() {
+        return getNumNibblesNeeded("%s %d %ls");
+    }
+    static constexpr bool internStrings() {
+        return true;
+    }
+};
+
+TEST_F(NanoLogCpp17Test, compressSpecialized) {
+    constexpr std::array<ParamType, 4> paramTypes =
+                                        MixedFormat::paramTypes();
+    char inBuffer[1024];
+    char outBuffer[1024];
+    char expectedBuffer[1024];
+
+    char *in = inBuffer;
+    char *out = outBuffer;
+
+    // Empty, do nothing
+    compressSpecialized<EmptyFormat>(0, nullptr, &in, &out);
+    EXPECT_EQ(inBuffer, in);
+    EXPECT_EQ(outBuffer, out);
+
+    // Setup
+    char aString[] = "Blah blah";
+    wchar_t wString[] = L"bleh";
+
+    uint32_t aStringBytes = strlen(aString);
+    uint32_t wStringBytes = wcslen(wString)*sizeof(wchar_t);
+
+    *reinterpret_cast<int*>(in) = -2;
+    in += sizeof(int);
+
+    *reinterpret_cast<uint32_t*>(in) = aStringBytes;
+    in += sizeof(uint32_t);
+    memcpy(in, aString, aStringBytes);
+    in += aStringBytes;
+
+    *reinterpret_cast<uint32_t*>(in) = wStringBytes;
+    in += sizeof(uint32_t);
+    memcpy(in, wString, wStringBytes);
+    in += wStringBytes;
+
+    *reinterpret_cast<uint16_t*>(in) = 99;
+    in += sizeof(uint16_t);
+
+    char *endOfIn = in;
+
+    // The generic version is the reference
+    char *expected = expectedBuffer;
+    in = inBuffer;
+    compress<int, char*, wchar_t*, uint16_t>(MixedFormat::numNibbles(),
+                                             paramTypes.data(),
+                                             &in, &expected);
+    EXPECT_EQ(endOfIn, in);
+
+    in = inBuffer;
+    compressSpecialized<MixedFormat, int, char*, wchar_t*, uint16_t>(
+                        MixedFormat::numNibbles(), paramTypes.data(),
+                        &in, &out);
+    EXPECT_EQ(endOfIn, in);
+    ASSERT_EQ(expected - expectedBuffer, out - outBuffer);
+    EXPECT_EQ(0, memcmp(expectedBuffer, outBuffer, out - outBuffer));
+}
+
+TEST_F(NanoLogCpp17Test, compressSpecialized_binaryArgs) {
+    constexpr std::array<ParamType, 4> paramTypes =
+                                        BinaryFormat::paramTypes();
+    char inBuffer[1024];
+    char outBuffer[1024];
+    char expectedBuffer[1024];
+
+    // Store the arguments the way NANO_LOG() does
+    const char bytes[] = {0x0f, static_cast<char>(0xf0), 0x00, 0x7f};
+    int32_t values[] = {1, -2, 3};
+    TestQuote quote = {42, 0.5};
+    NanoLog::HexDump hex = NanoLog::hexdump(bytes, sizeof(bytes));
+    NanoLog::Array<int32_t> array = NanoLog::array(values, 3);
+    SerializedArg<TestQuote> user = toLogArg(quote);
+
+    uint64_t previousPrecision = -1;
+    size_t stringSizes[5] = {};
+    size_t inBytes = getArgSizes(paramTypes, previousPrecision, stringSizes,
+                                 7, hex, array, user);
+    char *in = inBuffer;
+    store_arguments(paramTypes, stringSizes, &in, 7, hex, array, user);
+    ASSERT_EQ(inBytes, static_cast<size_t>(in - inBuffer));
+    char *endOfIn = in;
+
+    // The int is encoded as on its own, followed by each of the others in
+    // its own string encoding
+    char *expected = expectedBuffer;
+    in = inBuffer;
+    compressSpecialized<IntFormat, int>(IntFormat::numNibbles(), nullptr,
+                                        &in, &expected);
+    uint32_t length;
+    memcpy(&length, in, sizeof(length));
+    encodeHexDump(in + sizeof(length), length, &expected);
+    in += sizeof(length) + length;
+    memcpy(&length, in, sizeof(length));
+    encodeArray(in + sizeof(length), length, &expected);
+    in += sizeof(length) + length;
+    memcpy(&length, in, sizeof(length));
+    encodeUserType(in + sizeof(length), length, &expected);
+    in += sizeof(length) + length;
+    EXPECT_EQ(endOfIn, in);
+
+    in = inBuffer;
+    char *out = outBuffer;
+    compressSpecialized<BinaryFormat, int, NanoLog::HexDump,
+                        NanoLog::Array<int32_t>, SerializedArg<TestQuote>>(
+                        BinaryFormat::numNibbles(), paramTypes.data(),
+                        &in, &out);
+    EXPECT_EQ(endOfIn, in);
+    ASSERT_EQ(expected - expectedBuffer, out - outBuffer);
+    EXPECT_EQ(0, memcmp(expectedBuffer, outBuffer, out - outBuffer));
+    EXPECT_STREQ("0ff0007f", outBuffer + 2);
+}
+
+TEST_F(NanoLogCpp17Test, compressSpecialized_internStrings) {
+    char inBuffer[1024];
+    char outBuffer[1024];
+
+    const char aString[] = "symbol";
+    const wchar_t wString[] = L"wide";
+    uint32_t aStringBytes = strlen(aString);
+    uint32_t wStringBytes = wcslen(wString)*sizeof(wchar_t);
+
+    char *in = inBuffer;
+    *reinterpret_cast<uint32_t*>(in) = aStringBytes;
+    in += sizeof(uint32_t);
+    memcpy(in, aString, aStringBytes);
+    in += aStringBytes;
+
+    *reinterpret_cast<int*>(in) = 7;
+    in += sizeof(int);
+
+    *reinterpret_cast<uint32_t*>(in) = wStringBytes;
+    in += sizeof(uint32_t);
+    memcpy(in, wString, wStringBytes);
+    in += wStringBytes;
+    char *endOfIn = in;
+
+    // Without an interner, the strings are all encoded as new ones
+    char *out = outBuffer;
+    in = inBuffer;
+    compressSpecialized<InternedFormat, const char*, int, const wchar_t*>(
+                                                0, nullptr, &in, &out);
+    EXPECT_EQ(endOfIn, in);
+    const long encodedBytes = 1 + 1 + 1 + (aStringBytes + 1)
+                                        + wStringBytes + sizeof(wchar_t);
+    ASSERT_EQ(encodedBytes, out - outBuffer);
+    EXPECT_EQ(0, outBuffer[2]);
+    EXPECT_STREQ(aString, outBuffer + 3);
+    EXPECT_EQ(0, wcscmp(wString, reinterpret_cast<wchar_t*>(
+                                outBuffer + 3 + aStringBytes + 1)));
+
+    // With one, the narrow string is a reference the second time around, but
+    // the wide string is not. The first copy has to stay in place for that.
+    Log::StringInterner interner;
+    Log::StringInterner::active = &interner;
+    out = outBuffer;
+    in = inBuffer;
+    compressSpecialized<InternedFormat, const char*, int, const wchar_t*>(
+                                                0, nullptr, &in, &out);
+    char *second = out;
+    in = inBuffer;
+    compressSpecialized<InternedFormat, const char*, int, const wchar_t*>(
+                                                0, nullptr, &in, &out);
+    EXPECT_EQ(endOfIn, in);
+    Log::StringInterner::active = nullptr;
+
+    ASSERT_EQ(encodedBytes - aStringBytes - 1, out - second);
+    EXPECT_EQ(1, second[2]);
+    EXPECT_EQ(0, wcscmp(wString, reinterpret_cast<wchar_t*>(second + 3)));
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_INTERNED) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.interned";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+    const char *states[] = {"NEW", "FILLED", "CANCELLED"};
+
+    RuntimeLogger::setLogFile(logFile);
+    for (int i = 0; i < 100; ++i) {
+        NANO_LOG_INTERNED(NOTICE, "Order %d on %s is %s (%ls)", i,
+                          "host.example.com", states[i % 3], L"wide");
+    }
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        std::string expected = "Order " + std::to_string(i)
+                                + " on host.example.com is " + states[i % 3]
+                                + " (wide)";
+        EXPECT_NE(std::string::npos, iLine.find(expected)) << iLine;
+    }
+    iFile.close();
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_lengthKnownStrings) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.lengthKnown";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+    const char packet[] = {'\x00', '\x01', '\xfe', '\xff', 'G', 'E', 'T'};
+    std::string owner("gateway");
+    std::string_view request("GET /orders HTTP/1.1", 11);
+
+    RuntimeLogger::setLogFile(logFile);
+    for (int i = 0; i < 3; ++i) {
+        NANO_LOG(NOTICE, "%d %s %s [%.*s] %s %.4s", i, owner, request, 3,
+                 packet + 4, NanoLog::hexdump(packet, sizeof(packet)),
+                 NanoLog::hexdump(packet, sizeof(packet)));
+        NANO_LOG_INTERNED(NOTICE, "%d %s %s", i,
+                          NanoLog::hexdump(packet, 2 + i), request);
+    }
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    const char *dumps[] = {"0001", "0001fe", "0001feff"};
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        std::string expected = std::to_string(i) + " gateway GET /orders "
+                                + "[GET] 0001feff474554 0001";
+        EXPECT_NE(std::string::npos, iLine.find(expected)) << iLine;
+
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        expected = std::to_string(i) + " " + dumps[i] + " GET /orders";
+        EXPECT_NE(std::string::npos, iLine.find(expected)) << iLine;
+    }
+    iFile.close();
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_TIMESTAMP) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.timestamp";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    RuntimeLogger::setLogFile(logFile);
+    NANO_LOG_TIMESTAMP(NanoLog::TIMESTAMP_RDTSC, NOTICE, "rdtsc %d", 1);
+    NANO_LOG_TIMESTAMP(NanoLog::TIMESTAMP_RDTSCP, NOTICE, "rdtscp %d", 2);
+    NANO_LOG_TIMESTAMP(NanoLog::TIMESTAMP_COARSE, NOTICE, "coarse %d", 3);
+    NANO_LOG_TIMESTAMP(NanoLog::TIMESTAMP_NONE, NOTICE, "none %d", 4);
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    // The marker follows "YYYY-MM-DD HH:MM:SS.nnnnnnnnn"
+    const size_t markerPos = sizeof("YYYY-MM-DD HH:MM:SS.nnnnnnnnn") - 1;
+    const char *expected[] = {" rdtsc 1", " rdtscp 2", "~coarse 3",
+                              "+none 4"};
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (const char *message : expected) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        ASSERT_LT(markerPos, iLine.size());
+        EXPECT_EQ(message[0], iLine[markerPos]) << iLine;
+        EXPECT_NE(std::string::npos, iLine.find(message + 1)) << iLine;
+    }
+    iFile.close();
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_orderedWhileNearlyFull) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    const char *logFile = "/tmp/NanoLogCpp17Test.nearlyFull";
+    const std::string padding(200, 'x');
+    const int numThreads = 4;
+    const int backlogLogs = 20000;
+    const int hintedLogs = 50000;
+
+    // The threads take turns logging, so that the log messages are only out
+    // of order in the log file because of the order in which they're
+    // compressed (and not because a thread is descheduled in between taking
+    // a timestamp and completing its log message). The first threads leave
+    // a backlog of several output buffers in their StagingBuffers while the
+    // compression thread is held up. The last one hints that its buffer is
+    // nearly full after every log message, so the passes start at it and
+    // then run out of output space in the backlog of the others.
+    RuntimeLogger::setLogFile(logFile);
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE);
+    RuntimeLogger::setStagingBufferSize(1 << 23);
+    std::atomic<int> numRegistered(0), turn(-1);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            RuntimeLogger::preallocate();
+            ++numRegistered;
+            while (turn.load() != t)
+                std::this_thread::yield();
+
+            bool hint = (t == numThreads - 1);
+            for (int i = 0; i < (hint ? hintedLogs : backlogLogs); ++i) {
+                NANO_LOG(NOTICE, "Thread %d message %d %s", t, i,
+                         padding.c_str());
+                if (hint)
+                    RuntimeLogger::stagingBuffer->nearlyFull = true;
+            }
+
+            // Keep the StagingBuffer from being handed to the next thread
+            ++turn;
+            while (turn.load() < numThreads)
+                std::this_thread::yield();
+        });
+
+        // Register the buffers in order, so the last one comes last
+        while (numRegistered.load() <= t)
+            std::this_thread::yield();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(rl.shards.at(0)->bufferMutex);
+        turn = 0;
+        while (turn.load() < numThreads - 1)
+            std::this_thread::yield();
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+    RuntimeLogger::sync();
+    RuntimeLogger::setStagingBufferSize(NanoLogConfig::STAGING_BUFFER_SIZE);
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    expectChronological(logFile, (numThreads - 1)*backlogLogs + hintedLogs);
+    std::remove(logFile);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_orderedAcrossCompressionThreads) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.shards";
+    const std::string padding(100, 'x');
+    const int numThreads = 8;
+    const int logsPerTurn = 1000;
+    const int turnsPerThread = 25;
+
+    // The threads take turns logging (see NANO_LOG_orderedWhileNearlyFull)
+    // while the compression threads append their output buffers to the log
+    // file in whatever order they fill them up.
+    RuntimeLogger::setLogFile(logFile);
+    RuntimeLogger::setCompressionThreads(4);
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE);
+    std::atomic<int> turn(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < turnsPerThread; ++i) {
+                while (turn.load() % numThreads != t)
+                    std::this_thread::yield();
+
+                for (int j = 0; j < logsPerTurn; ++j)
+                    NANO_LOG(NOTICE, "Thread %d message %d %s", t,
+                             i*logsPerTurn + j, padding.c_str());
+                ++turn;
+            }
+        });
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+    RuntimeLogger::sync();
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    RuntimeLogger::setCompressionThreads(
+                                NanoLogConfig::NUM_COMPRESSION_THREADS);
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    expectChronological(logFile, numThreads*turnsPerThread*logsPerTurn);
+    std::remove(logFile);
+}
+
+}; //namespace
+TEST_F(NanoLogCpp17Test, NANO_LOG_priority) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.priority";
+    Metrics metrics;
+
+    RuntimeLogger::setLogFile(logFile);
+    RuntimeLogger::setPriorityLogLevel(WARNING, true);
+    NANO_LOG(NOTICE, "notice %d", 1);
+    RuntimeLogger::sync();
+    RuntimeLogger::getMetrics(metrics);
+    uint64_t numPriorityWrites = metrics.numPriorityWrites;
+    uint64_t numPrioritySyncs = metrics.numPrioritySyncs;
+
+    // The ERROR is written out (and synced) without waiting for a sync()
+    NANO_LOG(ERROR, "error %d", 2);
+    for (int i = 0; i < 1000 && metrics.numPrioritySyncs == numPrioritySyncs;
+            ++i) {
+        usleep(1000);
+        RuntimeLogger::getMetrics(metrics);
+    }
+    EXPECT_EQ(numPriorityWrites + 1, metrics.numPriorityWrites);
+    EXPECT_EQ(numPrioritySyncs + 1, metrics.numPrioritySyncs);
+
+    // Below the priority log level, log messages take the regular path
+    RuntimeLogger::setPriorityLogLevel(SILENT_LOG_LEVEL, false);
+    NANO_LOG(ERROR, "error %d", 3);
+    RuntimeLogger::sync();
+    RuntimeLogger::getMetrics(metrics);
+    EXPECT_EQ(numPriorityWrites + 1, metrics.numPriorityWrites);
+
+    RuntimeLogger::setPriorityLogLevel(WARNING, false);
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+    std::remove(logFile);
+}
+
+TEST_F(NanoLogCpp17Test, notifyWhenPersisted) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.persisted";
+    std::atomic<int> numCallbacks(0);
+
+    RuntimeLogger::setLogFile(logFile);
+    NANO_LOG(NOTICE, "notice %d", 1);
+    LogPosition position = RuntimeLogger::getLogPosition();
+    RuntimeLogger::notifyWhenPersisted(position, [&]() { ++numCallbacks; });
+
+    // The log message reaches the log file without a sync()
+    for (int i = 0; i < 1000 && numCallbacks == 0; ++i)
+        usleep(1000);
+    EXPECT_EQ(1, numCallbacks);
+    EXPECT_TRUE(RuntimeLogger::isPersisted(position));
+
+    // Persisted positions invoke the callback right away
+    RuntimeLogger::notifyWhenPersisted(position, [&]() { ++numCallbacks; });
+    EXPECT_EQ(2, numCallbacks);
+
+    // Threads that haven't logged anything have nothing to persist
+    LogPosition otherPosition = {0, 1};
+    std::thread([&]() {
+        otherPosition = RuntimeLogger::getLogPosition();
+    }).join();
+    EXPECT_TRUE(RuntimeLogger::isPersisted(otherPosition));
+
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+    std::remove(logFile);
+}
+
+static void
+formatTestQuote(std::string &out, const char *data, size_t length)
+{
+    TestQuote quote;
+    ASSERT_EQ(sizeof(quote), length);
+    memcpy(&quote, data, sizeof(quote));
+
+    char text[64];
+    snprintf(text, sizeof(text), "quote %u @ %.2lf", quote.id, quote.price);
+    out.append(text);
+}
+
+static void
+formatTestOrder(std::string &out, const char *data, size_t length)
+{
+    int32_t quantity;
+    ASSERT_LE(sizeof(quantity), length);
+    memcpy(&quantity, data, sizeof(quantity));
+
+    out.append(std::to_string(quantity));
+    out.append(" x ");
+    out.append(data + sizeof(quantity), length - sizeof(quantity));
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_userTypes) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.userTypes";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    TestQuote quote = {7, 12.5};
+    TestOrder order = {"NANO", 250};
+    RuntimeLogger::setLogFile(logFile);
+    NANO_LOG(NOTICE, "got %s", quote);
+    NANO_LOG(NOTICE, "placed %s for %s", order, quote);
+    NANO_LOG_INTERNED(NOTICE, "interned %s", quote);
+    NANO_LOG_INTERNED(NOTICE, "interned %s", quote);
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder::registerTypeFormatter("TestQuote", formatTestQuote);
+    Log::Decoder::registerTypeFormatter("TestOrder", formatTestOrder);
+    const char *expected[][2] = {
+        {"got quote 7 @ 12.50", "got TestQuote{"},
+        {"placed 250 x NANO for quote 7 @ 12.50", "placed TestOrder{"},
+        {"interned quote 7 @ 12.50", "interned TestQuote{"},
+        {"interned quote 7 @ 12.50", "interned TestQuote{"},
+    };
+
+    // Without formatters, the objects are printed as hex digits
+    for (int formatted = 1; formatted >= 0; --formatted) {
+        Log::Decoder dc;
+        Log::LogMessage msg;
+        ASSERT_TRUE(dc.open(logFile));
+        FILE *outputFd = fopen(decomp, "w");
+        ASSERT_NE(nullptr, outputFd);
+        while (dc.getNextLogStatement(msg, outputFd));
+        fclose(outputFd);
+
+        std::ifstream iFile(decomp);
+        std::string iLine;
+        for (auto &message : expected) {
+            ASSERT_TRUE(std::getline(iFile, iLine));
+            const char *text = message[formatted ? 0 : 1];
+            EXPECT_NE(std::string::npos, iLine.find(text)) << iLine;
+        }
+        iFile.close();
+
+        Log::Decoder::registerTypeFormatter("TestQuote", nullptr);
+        Log::Decoder::registerTypeFormatter("TestOrder", nullptr);
+    }
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_array) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.array";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    int32_t levels[] = {100, -2, 0, 300000, -70000};
+    std::vector<uint8_t> bytes = {0, 255, 7};
+    std::array<double, 2> prices = {1.5, -0.75};
+    std::vector<int64_t> none;
+
+    // Enough elements for more than one block and the vectorized decoding
+    std::vector<int16_t> samples;
+    std::string samplesText;
+    for (int i = 0; i < 100; ++i) {
+        samples.push_back(static_cast<int16_t>(500*(i - 50)));
+        samplesText += (i == 0 ? "" : ", ") + std::to_string(500*(i - 50));
+    }
+
+    RuntimeLogger::setLogFile(logFile);
+    NANO_LOG(NOTICE, "levels %s bytes %s prices %s",
+             NanoLog::array(levels, 5), NanoLog::array(bytes),
+             NanoLog::array(prices));
+    NANO_LOG_INTERNED(NOTICE, "%s %s %s", "venue", NanoLog::array(none),
+                      "venue");
+    NANO_LOG(NOTICE, "samples %s %d", NanoLog::array(samples), 7);
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    std::string expected[][3] = {
+        {"levels [100, -2, 0, 300000, -70000] bytes [0, 255, 7] "
+            "prices [1.5, -0.75]",
+         "venue [] venue",
+         "samples [" + samplesText + "] 7"},
+        {"levels [100 -02 000 300000 -70000] bytes [000 255 007] "
+            "prices [1.50 -0.75]",
+         "venue [] venue",
+         "samples [-25000 -24500 -24000 "},
+    };
+
+    for (auto &messages : expected) {
+        Log::Decoder dc;
+        Log::LogMessage msg;
+        ASSERT_TRUE(dc.open(logFile));
+        FILE *outputFd = fopen(decomp, "w");
+        ASSERT_NE(nullptr, outputFd);
+        while (dc.getNextLogStatement(msg, outputFd));
+        fclose(outputFd);
+
+        std::ifstream iFile(decomp);
+        std::string iLine;
+        for (auto &message : messages) {
+            ASSERT_TRUE(std::getline(iFile, iLine));
+            EXPECT_NE(std::string::npos, iLine.find(message)) << iLine;
+        }
+        iFile.close();
+
+        Log::Decoder::setArrayFormat("%03lld", "%.2f", " ");
+    }
+
+    Log::Decoder::setArrayFormat(nullptr, nullptr, nullptr);
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_markerPrefixedStrings) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.markers";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    // Plain strings that start like arrays and user-defined types are
+    // stored in the compressed log
+    const char *arrayLike = "\x1d\x08\xff\xff\xff\x0f";
+    const char *userTypeLike = "\x1eNotAType\x1f" "abc";
+    TestQuote quote = {7, 12.5};
+    int32_t levels[] = {1, 2};
+
+    RuntimeLogger::setLogFile(logFile);
+    for (const char *str : {arrayLike, userTypeLike})
+        NANO_LOG(NOTICE, "plain %s", str);
+    NANO_LOG_INTERNED(NOTICE, "interned %s %s %s", arrayLike, userTypeLike,
+                      arrayLike);
+    NANO_LOG(NOTICE, "quote %s", quote);
+    NANO_LOG(NOTICE, "array %s", NanoLog::array(levels, 2));
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    std::string expected[] = {
+        std::string("plain ") + arrayLike,
+        std::string("plain ") + userTypeLike,
+        std::string("interned ") + arrayLike + " " + userTypeLike + " "
+                + arrayLike,
+        "quote TestQuote{",
+        "array [1, 2]",
+    };
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (auto &message : expected) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        EXPECT_NE(std::string::npos, iLine.find(message)) << iLine;
+    }
+    iFile.close();
+
+    // Queries group by the strings as they were logged too
+    ASSERT_TRUE(dc.open(logFile));
+    outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    EXPECT_EQ(5, dc.aggregate(outputFd, "group by arg[0]; count"));
+    fclose(outputFd);
+
+    iFile.open(decomp);
+    std::string contents((std::istreambuf_iterator<char>(iFile)),
+                         std::istreambuf_iterator<char>());
+    iFile.close();
+    EXPECT_NE(std::string::npos, contents.find(arrayLike));
+    EXPECT_NE(std::string::npos, contents.find(userTypeLike));
+    EXPECT_NE(std::string::npos, contents.find("TestQuote{"));
+    EXPECT_NE(std::string::npos, contents.find("[1, 2]"));
+    EXPECT_EQ(std::string::npos, contents.find("NotAType{"));
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, NANO_LOG_EVERY_N) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.sampled";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    RuntimeLogger::setLogFile(logFile);
+    for (int i = 0; i < 10; ++i)
+        NANO_LOG_EVERY_N(4, NOTICE, "sampled %d", i);
+
+    for (int i = 0; i < 10; ++i)
+        NANO_LOG_RATE_LIMITED(3, NOTICE, "limited %d", i);
+
+    // Once the one second window is over, the next message gets through
+    SampledLogSite site = {};
+    int suppressedLogId = UNASSIGNED_LOGID;
+    int numAdmitted = 0;
+    for (int i = 0; i < 10; ++i)
+        numAdmitted += admitRateLimited(site, 3, suppressedLogId, __FILE__,
+                                        __LINE__, NOTICE);
+    EXPECT_EQ(3, numAdmitted);
+    EXPECT_EQ(7U, site.numSuppressed);
+
+    site.windowStart -= Cycles::fromSeconds(1.0);
+    EXPECT_TRUE(admitRateLimited(site, 3, suppressedLogId, __FILE__,
+                                 __LINE__, NOTICE));
+    EXPECT_EQ(0U, site.numSuppressed);
+    EXPECT_EQ(1U, site.count);
+
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    const char *expected[] = {"sampled 0", "suppressed 3 similar messages",
+                              "sampled 4", "suppressed 3 similar messages",
+                              "sampled 8", "limited 0", "limited 1",
+                              "limited 2", "suppressed 7 similar messages"};
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (const char *message : expected) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        EXPECT_NE(std::string::npos, iLine.find(message)) << iLine;
+        EXPECT_NE(std::string::npos, iLine.find("NanoLogCpp17Test.cc"))
+                                                                    << iLine;
+    }
+    EXPECT_FALSE(std::getline(iFile, iLine));
+    iFile.close();
+
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, recoverStagingBuffers) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    char dir[] = "/tmp/NanoLogCpp17Test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    const char *logFile = "/tmp/NanoLogCpp17Test.recovered";
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    RuntimeLogger::setCrashRecoveryDirectory(dir);
+    ASSERT_LE(0, rl.crashRecoveryFd.load());
+
+    // A recoverable buffer that no compression thread knows about is what
+    // a crashed process leaves behind
+    RuntimeLogger::StagingBuffer *recoverable =
+            rl.allocateRecoverableStagingBuffer(4242,
+                                    NanoLogConfig::MIN_STAGING_BUFFER_SIZE);
+    ASSERT_NE(nullptr, recoverable);
+    EXPECT_EQ(&recoverable->persistedPos, recoverable->releasedPos);
+
+    RuntimeLogger::StagingBuffer *threadBuffer = RuntimeLogger::stagingBuffer;
+    RuntimeLogger::stagingBuffer = recoverable;
+    for (int i = 0; i < 3; ++i)
+        NANO_LOG(NOTICE, "Recovered %d %s %0.1lf %s", i, "message", -0.5,
+                 NanoLog::hexdump("\x0f\xf0", 2));
+    RuntimeLogger::stagingBuffer = threadBuffer;
+
+    std::string prefix = std::string(dir) + "/nanolog."
+                                          + std::to_string(getpid());
+    EXPECT_EQ(3, Log::recoverStagingBuffers(prefix.c_str(), logFile));
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        std::string expected = "Recovered " + std::to_string(i)
+                                            + " message -0.5 0ff0";
+        EXPECT_NE(std::string::npos, iLine.find(expected)) << iLine;
+    }
+    iFile.close();
+
+    // Consumed messages stay recoverable until the write carrying them
+    // completes
+    uint64_t bytesAvailable;
+    char *consumed = recoverable->peek(&bytesAvailable);
+    recoverable->consume(bytesAvailable);
+    recoverable->shouldDeallocate = true;
+    recoverable->releasePersisted(7, 7, false);
+    EXPECT_EQ(consumed, recoverable->persistedPos);
+    EXPECT_FALSE(recoverable->checkCanDelete());
+    recoverable->releasePersisted(8, 8, false);
+    EXPECT_EQ(recoverable->consumerPos, recoverable->persistedPos);
+    EXPECT_TRUE(recoverable->checkCanDelete());
+
+    rl.freeStagingBuffer(recoverable);
+    RuntimeLogger::setCrashRecoveryDirectory(nullptr);
+    EXPECT_EQ(-1, rl.crashRecoveryFd.load());
+    EXPECT_EQ(0, rmdir(dir));
+    std::remove(logFile);
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, setCrashRecoveryDirectory_concurrentSites) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    char dir[] = "/tmp/NanoLogCpp17Test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    std::string dictionary = std::string(dir) + "/nanolog."
+                                              + std::to_string(getpid())
+                                              + ".dictionary";
+
+    // Returns which log identifiers the dictionary has a site for
+    auto readDictionary = [&]() {
+        std::ifstream file(dictionary, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+        std::vector<bool> recorded(rl.invocationSites.getNumAllocated(),
+                                   false);
+        size_t pos = sizeof(Log::RecoveryDictionaryHeader);
+        while (pos + sizeof(Log::RecoverySite) <= contents.size()) {
+            Log::RecoverySite site;
+            memcpy(&site, contents.data() + pos, sizeof(site));
+            pos += sizeof(site) + site.numParams*(sizeof(int32_t) + 1)
+                   + site.filenameLength + site.formatStringLength;
+            EXPECT_LT(site.fmtId, recorded.size());
+            if (site.fmtId < recorded.size())
+                recorded[site.fmtId] = true;
+        }
+        EXPECT_EQ(contents.size(), pos);
+        return recorded;
+    };
+
+    // A site that has its identifier, but has yet to be published, holds up
+    // the setter instead of being cut off along with the sites after it
+    static const ParamType paramTypes[1] = {};
+    StaticLogInfo info(nullptr, "concurrentSites.cc", 1, NOTICE, "Site", 0, 0,
+                       paramTypes);
+    uint32_t pending = rl.invocationSites.nextId++;
+    std::thread setter([&]() {
+        RuntimeLogger::setCrashRecoveryDirectory(dir);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    InvocationSiteRegistry::Slot &slot = rl.invocationSites.getChunk(
+            pending/InvocationSiteRegistry::CHUNK_SIZE)[
+            pending%InvocationSiteRegistry::CHUNK_SIZE];
+    new (slot.storage) StaticLogInfo(info);
+    slot.published = true;
+    setter.join();
+    std::vector<bool> recorded = readDictionary();
+    ASSERT_LT(pending, recorded.size());
+    for (size_t id = 0; id < recorded.size(); ++id)
+        EXPECT_TRUE(recorded[id]) << "id " << id;
+    RuntimeLogger::setCrashRecoveryDirectory(nullptr);
+
+    // Each site registered while the setter runs has to make it into the
+    // dictionary, whether its thread or the setter records it
+    const int numThreads = 4;
+    const int sitesPerThread = 250;
+    for (int round = 0; round < 10; ++round) {
+        std::vector<int> logIds(numThreads*sitesPerThread, UNASSIGNED_LOGID);
+        std::atomic<bool> start(false);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, t]() {
+                while (!start) { }
+                for (int i = 0; i < sitesPerThread; ++i)
+                    rl.registerInvocationSite_internal(
+                                    logIds[t*sitesPerThread + i], info);
+            });
+        }
+
+        start = true;
+        RuntimeLogger::setCrashRecoveryDirectory(dir);
+        for (auto &thread : threads)
+            thread.join();
+
+        recorded = readDictionary();
+        for (size_t id = 0; id < recorded.size(); ++id)
+            ASSERT_TRUE(recorded[id]) << "round " << round << " id " << id;
+
+        RuntimeLogger::setCrashRecoveryDirectory(nullptr);
+    }
+
+    EXPECT_EQ(0, rmdir(dir));
+}
+
+TEST_F(NanoLogCpp17Test, compressionAgent) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    char dir[] = "/tmp/NanoLogCpp17Test.XXXXXX";
+    char logDir[] = "/tmp/NanoLogCpp17Test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    ASSERT_NE(nullptr, mkdtemp(logDir));
+    const char *decomp = "/tmp/NanoLogCpp17Test.decomp";
+
+    // Marks the dictionary for the agent without handing the test's own
+    // threads over to it
+    rl.setCrashRecoveryDirectory_internal(dir, true);
+    ASSERT_LE(0, rl.crashRecoveryFd.load());
+
+    RuntimeLogger::StagingBuffer *sb =
+            rl.allocateRecoverableStagingBuffer(4343,
+                                    NanoLogConfig::MIN_STAGING_BUFFER_SIZE);
+    ASSERT_NE(nullptr, sb);
+
+    RuntimeLogger::StagingBuffer *threadBuffer = RuntimeLogger::stagingBuffer;
+    RuntimeLogger::stagingBuffer = sb;
+    for (int i = 0; i < 3; ++i)
+        NANO_LOG(NOTICE, "Agent %d %s %0.1lf", i, "message", 0.5);
+    RuntimeLogger::stagingBuffer = threadBuffer;
+
+    std::string logFile = std::string(logDir) + "/nanolog."
+                                              + std::to_string(getpid())
+                                              + ".log";
+    {
+        Log::CompressionAgent agent(dir, logDir);
+        EXPECT_EQ(3U, agent.poll());
+        EXPECT_EQ(sb->producerPos, sb->consumerPos);
+        EXPECT_EQ(sb->producerPos, sb->persistedPos);
+        EXPECT_EQ(0U, agent.poll());
+    }
+
+    Log::Decoder dc;
+    Log::LogMessage msg;
+    ASSERT_TRUE(dc.open(logFile.c_str()));
+    FILE *outputFd = fopen(decomp, "w");
+    ASSERT_NE(nullptr, outputFd);
+    while (dc.getNextLogStatement(msg, outputFd));
+    fclose(outputFd);
+
+    std::ifstream iFile(decomp);
+    std::string iLine;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(std::getline(iFile, iLine));
+        std::string expected = "Agent " + std::to_string(i) + " message 0.5";
+        EXPECT_NE(std::string::npos, iLine.find(expected)) << iLine;
+    }
+    iFile.close();
+
+    rl.freeStagingBuffer(sb);
+    RuntimeLogger::setCrashRecoveryDirectory(nullptr);
+    EXPECT_EQ(0, rmdir(dir));
+    std::remove(logFile.c_str());
+    EXPECT_EQ(0, rmdir(logDir));
+    std::remove(decomp);
+}
+
+TEST_F(NanoLogCpp17Test, routeTimeTrace) {
+    const char *logFile = "/tmp/NanoLogCpp17Test.timeTrace";
+    const char *trace = "/tmp/NanoLogCpp17Test.trace";
+
+    RuntimeLogger::setLogFile(logFile);
+    NanoLog::routeTimeTrace(true);
+    uint64_t start = Cycles::rdtsc();
+    TimeTrace::record(start, "started %u", 1);
+    TimeTrace::record(start + Cycles::fromNanoseconds(2000),
+                      "phase %u took %u items", 2, 30);
+    NanoLog::routeTimeTrace(false);
+    NANO_LOG(NOTICE, "Quoted \"%s\"\t%d", "name", 4);
+    RuntimeLogger::sync();
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+
+    Log::Decoder dc;
+    ASSERT_TRUE(dc.open(logFile));
+    FILE *traceFd = fopen(trace, "w");
+    ASSERT_NE(nullptr, traceFd);
+    EXPECT_EQ(3, dc.exportTrace(traceFd));
+    fclose(traceFd);
+
+    std::ifstream iFile(trace);
+    std::string contents((std::istreambuf_iterator<char>(iFile)),
+                          std::istreambuf_iterator<char>());
+    iFile.close();
+
+    EXPECT_EQ(0U, contents.find("{\"displayTimeUnit\":\"ns\","
+                                "\"traceEvents\":[\n"));
+    EXPECT_EQ(contents.size() - 4, contents.find("\n]}\n"));
+    EXPECT_NE(std::string::npos, contents.find("\"name\":\"process_name\""));
+    EXPECT_NE(std::string::npos, contents.find("\"name\":\"thread_name\""));
+
+    // The first record is an instant and the next a slice since it
+    EXPECT_NE(std::string::npos, contents.find(
+            "\"s\":\"t\",\"cat\":\"TimeTrace\",\"name\":\"started 1\"}"));
+    size_t slice = contents.find(",\"cat\":\"TimeTrace\","
+                                 "\"name\":\"phase 2 took 30 items\"}");
+    ASSERT_NE(std::string::npos, slice);
+    size_t dur = contents.rfind(",\"dur\":", slice);
+    ASSERT_NE(std::string::npos, dur);
+    size_t lineStart = contents.rfind('\n', slice);
+    ASSERT_LT(lineStart, dur);
+    EXPECT_EQ("{\"ph\":\"X\"", contents.substr(lineStart + 1, 9));
+
+    // The 2us go through the cycle conversions, which may round them off
+    EXPECT_NEAR(2.0, strtod(contents.c_str() + dur + sizeof(",\"dur\":") - 1,
+                            nullptr), 0.01);
+
+    EXPECT_NE(std::string::npos, contents.find(
+            "\"cat\":\"NanoLog\",\"name\":\"Quoted \\\"%s\\\"\\t%d\","
+            "\"args\":{\"message\":\"Quoted \\\"name\\\"\\t4\""));
+
+    std::remove(logFile);
+    std::remove(trace);
+}
@@ -13,10 +13,24 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+
 #include "gtest/gtest.h"
 
 #include "TestUtil.h"
 
+#include "BlockCodec.h"
+#include "NanoLogCpp17.h"
 #include "RuntimeLogger.h"
 
 namespace {
@@ -83,6 +97,37 @@ TEST_F(NanoLogTest, StagingBuffer_reserveProducerSpace)
     // Roll over tests are done in reserveSpaceInternal
 }
 
+TEST_F(NanoLogTest, StagingBuffer_reserveProducerSpace_dropNewest)
+{
+    // Leave exactly 100 bytes free, which is not enough for 100 bytes
+    sb->minFreeSpace = 0;
+    sb->consumerPos = sb->storage + halfSize;
+    sb->producerPos = sb->consumerPos - 100;
+
+    RuntimeLogger::setOverflowPolicy(OverflowPolicy::DROP_NEWEST);
+    EXPECT_EQ(OverflowPolicy::DROP_NEWEST, RuntimeLogger::getOverflowPolicy());
+    EXPECT_EQ(nullptr, sb->reserveProducerSpace(100));
+    EXPECT_EQ(nullptr, sb->reserveProducerSpace(200));
+    EXPECT_EQ(2U, sb->numLogsDropped);
+    EXPECT_NE(0U, sb->lastDropTimestamp);
+
+    // Allocations that fit are unaffected
+    EXPECT_EQ(sb->producerPos, sb->reserveProducerSpace(50));
+    EXPECT_EQ(2U, sb->numLogsDropped);
+
+    // The buffer cannot be deleted until the drops are reported
+    sb->shouldDeallocate = true;
+    sb->producerPos = sb->consumerPos;
+    sb->releasePersisted(0, 0, true);
+    EXPECT_FALSE(sb->checkCanDelete());
+    sb->numLogsDroppedReported = 2;
+    EXPECT_TRUE(sb->checkCanDelete());
+
+    // Invalid policies fall back to blocking
+    RuntimeLogger::setOverflowPolicy(OverflowPolicy::NUM_OVERFLOW_POLICIES);
+    EXPECT_EQ(OverflowPolicy::BLOCK, RuntimeLogger::getOverflowPolicy());
+}
+
 
 TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal)
 {
@@ -136,6 +181,30 @@ TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal)
     EXPECT_EQ(101U, sb->minFreeSpace);
 }
 
+TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal_nearlyFull)
+{
+    // Plenty of space left
+    sb->minFreeSpace = 0;
+    sb->consumerPos = sb->storage + halfSize;
+    sb->producerPos = sb->storage + 100;
+    EXPECT_EQ(sb->producerPos, sb->reserveSpaceInternal(100, false));
+    EXPECT_FALSE(sb->nearlyFull);
+
+    // Less than 1/NEARLY_FULL_FRACTION of the buffer left
+    uint32_t hintBytes = bufferSize/NanoLogConfig::NEARLY_FULL_FRACTION;
+    sb->minFreeSpace = 0;
+    sb->producerPos = sb->consumerPos - hintBytes + 1;
+    EXPECT_EQ(sb->producerPos, sb->reserveSpaceInternal(100, false));
+    EXPECT_TRUE(sb->nearlyFull);
+
+    // The consumer clears the hint, but a blocked producer sets it again
+    sb->nearlyFull = false;
+    sb->minFreeSpace = 0;
+    sb->producerPos = sb->consumerPos - 100;
+    EXPECT_EQ(nullptr, sb->reserveSpaceInternal(100, false));
+    EXPECT_TRUE(sb->nearlyFull);
+}
+
 TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal_rollover_prevention)
 {
     // Setup the situation where the consumer is at position 0 and the producer
@@ -153,6 +222,83 @@ TEST_F(NanoLogTest, StagingBuffer_reserveSpaceInternal_rollover_prevention)
     EXPECT_EQ(nullptr, sb->reserveSpaceInternal(1, false));
 }
 
+TEST_F(NanoLogTest, StagingBuffer_flagPriorityLog) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    uint32_t generation = rl.priorityLogGeneration;
+    EXPECT_FALSE(sb->priorityPending);
+
+    // Only the first priority log message wakes the compression threads
+    sb->flagPriorityLog();
+    EXPECT_TRUE(sb->priorityPending);
+    EXPECT_EQ(generation + 1, rl.priorityLogGeneration);
+    sb->flagPriorityLog();
+    EXPECT_EQ(generation + 1, rl.priorityLogGeneration);
+
+    // ... until the consumer drained the buffer
+    sb->priorityPending = false;
+    sb->flagPriorityLog();
+    EXPECT_EQ(generation + 2, rl.priorityLogGeneration);
+
+    sb->reset(1);
+    EXPECT_FALSE(sb->priorityPending);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_logPositions) {
+    uint64_t bytesAvailable;
+    EXPECT_EQ(0U, sb->getProducerPosition());
+    EXPECT_EQ(0U, sb->getConsumerPosition());
+    EXPECT_EQ(0U, sb->persistedPosition);
+
+    sb->reserveProducerSpace(bufferSize - 100);
+    sb->finishReservation(bufferSize - 100);
+    sb->peek(&bytesAvailable);
+    sb->consume(bytesAvailable);
+    EXPECT_EQ(bufferSize - 100, sb->getConsumerPosition());
+
+    // The space skipped on a roll-over counts as logged
+    sb->reserveProducerSpace(halfSize);
+    sb->finishReservation(halfSize);
+    EXPECT_EQ(bufferSize + halfSize, sb->getProducerPosition());
+
+    // Nothing buffered or in flight: everything consumed is persisted
+    sb->releasePersisted(0, 0, true);
+    EXPECT_EQ(bufferSize - 100, sb->persistedPosition);
+
+    sb->peek(&bytesAvailable);
+    EXPECT_EQ(bufferSize, sb->getConsumerPosition());
+    sb->consume(bytesAvailable);
+    EXPECT_EQ(bufferSize + halfSize, sb->getConsumerPosition());
+
+    // Otherwise, the position moves up once the next write completes
+    sb->releasePersisted(0, 0, false);
+    EXPECT_EQ(bufferSize - 100, sb->persistedPosition);
+    sb->releasePersisted(1, 0, false);
+    EXPECT_EQ(bufferSize - 100, sb->persistedPosition);
+    sb->releasePersisted(1, 1, false);
+    EXPECT_EQ(bufferSize + halfSize, sb->persistedPosition);
+
+    sb->reset(1);
+    EXPECT_EQ(0U, sb->getProducerPosition());
+    EXPECT_EQ(0U, sb->persistedPosition);
+}
+
+TEST_F(NanoLogTest, setPriorityLogLevel) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    EXPECT_EQ(WARNING, rl.priorityLogLevel.load());
+    EXPECT_FALSE(rl.syncPriorityLogs.load());
+
+    RuntimeLogger::setPriorityLogLevel(ERROR, true);
+    EXPECT_EQ(ERROR, rl.priorityLogLevel.load());
+    EXPECT_TRUE(rl.syncPriorityLogs.load());
+
+    RuntimeLogger::setPriorityLogLevel(static_cast<LogLevel>(-1), false);
+    EXPECT_EQ(SILENT_LOG_LEVEL, rl.priorityLogLevel.load());
+    RuntimeLogger::setPriorityLogLevel(NUM_LOG_LEVELS, false);
+    EXPECT_EQ(DEBUG, rl.priorityLogLevel.load());
+
+    RuntimeLogger::setPriorityLogLevel(WARNING, false);
+}
+
 TEST_F(NanoLogTest, StagingBuffer_finishReservation) {
     EXPECT_EQ(sb->storage, sb->producerPos);
     EXPECT_EQ(bufferSize, sb->minFreeSpace);
@@ -197,7 +343,7 @@ TEST_F(NanoLogTest, StagingBuffer_finishReservation_asserts) {
 
     // Case 2: Don't fall of the end (indicates bug in library code)
     sb->minFreeSpace = 2*bufferSize;
-    EXPECT_DEATH(sb->finishReservation(bufferSize), "BUFFER_SIZE");
+    EXPECT_DEATH(sb->finishReservation(bufferSize), "capacity");
 
     // Case 3: The producer somehow passes the consumer location (library bug)
     sb->producerPos = sb->storage + halfSize - 50;
@@ -267,4 +413,939 @@ TEST_F(NanoLogTest, StagingBuffer_peek) {
     sb->peek(&bytesAvailable);
     EXPECT_EQ(10U, bytesAvailable);
 }
-}; //namespace
\ No newline at end of file
+
+TEST_F(NanoLogTest, StagingBuffer_getMetrics) {
+    ThreadMetrics metrics;
+    sb->getMetrics(metrics);
+    EXPECT_EQ(0U, metrics.id);
+    EXPECT_EQ(bufferSize, metrics.capacity);
+    EXPECT_EQ(0U, metrics.bytesPending);
+    EXPECT_EQ(0U, metrics.numAllocations);
+
+    sb->reserveProducerSpace(bufferSize - 100);
+    sb->finishReservation(bufferSize - 100);
+    sb->getMetrics(metrics);
+    EXPECT_EQ(bufferSize - 100, metrics.bytesPending);
+    EXPECT_EQ(1U, metrics.numAllocations);
+
+    // Roll over with the consumer still behind the end of recorded space
+    uint64_t bytesAvailable;
+    sb->peek(&bytesAvailable);
+    sb->consume(halfSize + 10);
+    sb->reserveProducerSpace(halfSize);
+    sb->finishReservation(halfSize);
+    sb->getMetrics(metrics);
+    EXPECT_EQ(bufferSize - 110, metrics.bytesPending);
+    EXPECT_EQ(2U, metrics.numAllocations);
+    EXPECT_EQ(0U, metrics.numLogsDropped);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_placement) {
+    RuntimeLogger::StagingBuffer local(10, 4096, true, false);
+    EXPECT_EQ(4096U, local.mappedBytes);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(local.storage) % 4096);
+
+    // Huge pages round the buffer up, but not its capacity
+    RuntimeLogger::StagingBuffer huge(11, 4096, false, true);
+    EXPECT_EQ(Util::BYTES_PER_HUGE_PAGE, huge.mappedBytes);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(huge.storage)
+                                            % Util::BYTES_PER_HUGE_PAGE);
+    EXPECT_EQ(4096U, huge.getCapacity());
+
+    uint64_t bytesAvailable;
+    ASSERT_EQ(huge.storage, huge.reserveProducerSpace(4000));
+    memset(huge.storage, 'a', 4000);
+    huge.finishReservation(4000);
+    EXPECT_EQ(huge.storage, huge.peek(&bytesAvailable));
+    EXPECT_EQ(4000U, bytesAvailable);
+    huge.consume(4000);
+
+    // The setting applies to the buffers allocated from then on
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::setStagingBufferPlacement(false, true);
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        EXPECT_EQ(0U, RuntimeLogger::stagingBuffer->mappedBytes
+                                            % Util::BYTES_PER_HUGE_PAGE);
+    }).join();
+
+    RuntimeLogger::setStagingBufferPlacement(
+                                    NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS,
+                                    NanoLogConfig::STAGING_BUFFER_HUGE_PAGES);
+    EXPECT_EQ(NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS,
+              rl.numaLocalStagingBuffers);
+    EXPECT_EQ(NanoLogConfig::STAGING_BUFFER_HUGE_PAGES,
+              rl.hugePageStagingBuffers);
+}
+
+TEST_F(NanoLogTest, StagingBuffer_mirrored) {
+    RuntimeLogger::StagingBuffer ring(10, 4096, false, false, true);
+    ASSERT_TRUE(ring.mirrored);
+    EXPECT_EQ(2*4096U, ring.mappedBytes);
+
+    // Writes through either mapping are visible through the other
+    ring.storage[10] = 'a';
+    EXPECT_EQ('a', ring.storage[4096 + 10]);
+    ring.storage[4096 + 20] = 'b';
+    EXPECT_EQ('b', ring.storage[20]);
+
+    // A reservation that doesn't fit before the end runs into the mirror
+    uint64_t bytesAvailable;
+    ring.reserveProducerSpace(4000);
+    ring.finishReservation(4000);
+    ring.peek(&bytesAvailable);
+    ring.consume(3000);
+
+    EXPECT_EQ(ring.storage + 4000, ring.reserveProducerSpace(2000));
+    memset(ring.storage + 4000, 'c', 2000);
+    ring.finishReservation(2000);
+    EXPECT_EQ(ring.storage + 4000 + 2000 - 4096, ring.producerPos);
+    EXPECT_EQ(ring.storage + 4096, ring.endOfRecordedSpace);
+    EXPECT_EQ('c', ring.storage[0]);
+
+    // ... and the consumer sees all of the data in one piece
+    EXPECT_EQ(ring.storage + 3000, ring.peek(&bytesAvailable));
+    EXPECT_EQ(3000U, bytesAvailable);
+    ThreadMetrics metrics;
+    ring.getMetrics(metrics);
+    EXPECT_EQ(3000U, metrics.bytesPending);
+
+    ring.consume(3000);
+    EXPECT_EQ(ring.producerPos, ring.consumerPos);
+    EXPECT_EQ(ring.storage + 4000 + 2000 - 4096, ring.peek(&bytesAvailable));
+    EXPECT_EQ(0U, bytesAvailable);
+
+    // The free space is blocked by the consumer only
+    ring.minFreeSpace = 0;
+    ring.consumerPos = ring.producerPos + 1;
+    EXPECT_EQ(nullptr, ring.reserveSpaceInternal(1, false));
+    EXPECT_EQ(1U, ring.minFreeSpace);
+
+    // Rings that can't be mirrored fall back to plain ones
+    RuntimeLogger::StagingBuffer odd(11, 5000, false, false, true);
+    EXPECT_FALSE(odd.mirrored);
+    RuntimeLogger::StagingBuffer huge(12, 4096, false, true, true);
+    EXPECT_FALSE(huge.mirrored);
+
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    RuntimeLogger::setStagingBufferPlacement(false, false, true);
+    EXPECT_TRUE(rl.mirroredStagingBuffers);
+    RuntimeLogger::setStagingBufferPlacement(
+                                    NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS,
+                                    NanoLogConfig::STAGING_BUFFER_HUGE_PAGES,
+                                    NanoLogConfig::MIRRORED_STAGING_BUFFERS);
+    EXPECT_EQ(NanoLogConfig::MIRRORED_STAGING_BUFFERS,
+              rl.mirroredStagingBuffers);
+}
+
+TEST_F(NanoLogTest, setCompressionThreadCpus) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    cpu_set_t allowed = Util::getCpuAffinity();
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &allowed))
+        ++cpu;
+
+    // Running threads move right away and new ones start out pinned
+    RuntimeLogger::setCompressionThreadCpus({cpu, -1, CPU_SETSIZE});
+    RuntimeLogger::setCompressionThreads(2);
+    ASSERT_EQ(2U, RuntimeLogger::getCompressionThreads());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        cpu_set_t cpus;
+        ASSERT_EQ(0, pthread_getaffinity_np(
+                                shard->compressionThread.native_handle(),
+                                sizeof(cpus), &cpus));
+        EXPECT_EQ(1, CPU_COUNT(&cpus));
+        EXPECT_TRUE(CPU_ISSET(cpu, &cpus));
+    }
+
+    // All of the threads report where they run once they've gone around
+    // their loops again
+    RuntimeLogger::sync();
+    std::vector<int> coreIds = RuntimeLogger::getCoreIdsOfBackgroundThreads();
+    for (int i = 0; i < 1000 && coreIds != std::vector<int>(2, cpu); ++i) {
+        usleep(1000);
+        coreIds = RuntimeLogger::getCoreIdsOfBackgroundThreads();
+    }
+    EXPECT_EQ(std::vector<int>(2, cpu), coreIds);
+    EXPECT_EQ(cpu, RuntimeLogger::getCoreIdOfBackgroundThread());
+
+    // Unpinning restores the affinity the process started with
+    RuntimeLogger::setCompressionThreadCpus({});
+    EXPECT_FALSE(rl.compressionThreadsPinned);
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        cpu_set_t cpus;
+        ASSERT_EQ(0, pthread_getaffinity_np(
+                                shard->compressionThread.native_handle(),
+                                sizeof(cpus), &cpus));
+        EXPECT_TRUE(CPU_EQUAL(&rl.defaultCpuAffinity, &cpus));
+    }
+
+    RuntimeLogger::setCompressionThreads(1);
+}
+
+TEST_F(NanoLogTest, setCompressionThreads) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    RuntimeLogger::setCompressionThreads(3);
+    ASSERT_EQ(3U, RuntimeLogger::getCompressionThreads());
+    for (uint32_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(i, rl.shards.at(i)->id);
+        EXPECT_TRUE(rl.shards.at(i)->compressionThread.joinable());
+    }
+
+    // New StagingBuffers are assigned to the shard matching their id
+    bool foundInShard = false;
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        uint32_t id = RuntimeLogger::stagingBuffer->getId();
+
+        RuntimeLogger::CompressionShard *shard = rl.shards.at(id % 3);
+        std::lock_guard<std::mutex> lock(shard->bufferMutex);
+        for (RuntimeLogger::StagingBuffer *sb : shard->threadBuffers)
+            foundInShard |= (sb == RuntimeLogger::stagingBuffer);
+    }).join();
+    EXPECT_TRUE(foundInShard);
+
+    // sync() must wait on and be released by all of the shards
+    RuntimeLogger::sync();
+
+    // Shrinking keeps the cumulative metrics and 0 is treated as 1
+    uint64_t logsProcessed = 0;
+    for (RuntimeLogger::CompressionShard *shard : rl.shards)
+        logsProcessed += shard->logsProcessed;
+
+    RuntimeLogger::setCompressionThreads(0);
+    ASSERT_EQ(1U, RuntimeLogger::getCompressionThreads());
+    EXPECT_TRUE(rl.shards.at(0)->compressionThread.joinable());
+    EXPECT_EQ(logsProcessed, rl.shards.at(0)->logsProcessed);
+    RuntimeLogger::sync();
+}
+
+TEST_F(NanoLogTest, setStagingBufferSize) {
+    uint32_t defaultCapacity = 0, setCapacity = 0, overrideCapacity = 0;
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        defaultCapacity = RuntimeLogger::stagingBuffer->getCapacity();
+    }).join();
+    EXPECT_EQ(NanoLogConfig::STAGING_BUFFER_SIZE, defaultCapacity);
+
+    RuntimeLogger::setStagingBufferSize(8192);
+    EXPECT_EQ(8192U, RuntimeLogger::getStagingBufferSize());
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        setCapacity = RuntimeLogger::stagingBuffer->getCapacity();
+    }).join();
+    EXPECT_EQ(8192U, setCapacity);
+
+    // Per-thread overrides are clamped to the minimum size
+    std::thread([&]() {
+        RuntimeLogger::preallocate(1);
+        overrideCapacity = RuntimeLogger::stagingBuffer->getCapacity();
+
+        // Already allocated, so this has no effect
+        RuntimeLogger::preallocate(1 << 16);
+        EXPECT_EQ(overrideCapacity,
+                  RuntimeLogger::stagingBuffer->getCapacity());
+    }).join();
+    EXPECT_EQ(NanoLogConfig::MIN_STAGING_BUFFER_SIZE, overrideCapacity);
+
+    RuntimeLogger::setStagingBufferSize(NanoLogConfig::STAGING_BUFFER_SIZE);
+    EXPECT_EQ(NanoLogConfig::STAGING_BUFFER_SIZE,
+              RuntimeLogger::getStagingBufferSize());
+}
+
+TEST_F(NanoLogTest, getMetrics) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    Metrics metrics;
+
+    bool found = false;
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        RuntimeLogger::StagingBuffer *sb = RuntimeLogger::stagingBuffer;
+        sb->reserveProducerSpace(100);
+
+        RuntimeLogger::getMetrics(metrics);
+        for (const ThreadMetrics &thread : metrics.threads) {
+            if (thread.id != sb->getId())
+                continue;
+
+            found = true;
+            EXPECT_EQ(sb->getCapacity(), thread.capacity);
+            EXPECT_EQ(0U, thread.bytesPending);
+            EXPECT_EQ(1U, thread.numAllocations);
+        }
+    }).join();
+    EXPECT_TRUE(found);
+    EXPECT_EQ(RuntimeLogger::getCompressionThreads(),
+              metrics.compressionThreads);
+
+    // A snapshot starts over from scratch but reuses the threads' memory
+    RuntimeLogger::sync();
+    size_t numThreads = metrics.threads.size();
+    metrics.logsProcessed = ~0lu;
+    metrics.threads.resize(numThreads + 100);
+    const ThreadMetrics *threads = metrics.threads.data();
+    RuntimeLogger::getMetrics(metrics);
+    EXPECT_EQ(threads, metrics.threads.data());
+    EXPECT_GE(numThreads, metrics.threads.size());
+
+    uint64_t logsProcessed = 0, bytesWritten = 0;
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        logsProcessed += shard->logsProcessed;
+        bytesWritten += shard->totalBytesWritten;
+    }
+    EXPECT_EQ(logsProcessed, metrics.logsProcessed);
+    EXPECT_EQ(bytesWritten, metrics.bytesWritten);
+}
+
+TEST_F(NanoLogTest, setMetricsExporter) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    std::atomic<int> numExports(0);
+    RuntimeLogger::setMetricsExporter([&](const Metrics &metrics) {
+        EXPECT_EQ(RuntimeLogger::getCompressionThreads(),
+                  metrics.compressionThreads);
+        ++numExports;
+    }, 1);
+    EXPECT_TRUE(rl.metricsExporterThread.joinable());
+
+    for (int i = 0; i < 1000 && numExports < 3; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_LE(3, numExports);
+
+    // An empty exporter stops the thread
+    RuntimeLogger::setMetricsExporter(nullptr, 1);
+    EXPECT_FALSE(rl.metricsExporterThread.joinable());
+    int exported = numExports;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_EQ(exported, numExports);
+}
+
+TEST_F(NanoLogTest, readTimestamp) {
+    uint64_t start = PerfUtils::Cycles::rdtsc();
+    uint64_t rdtsc = RuntimeLogger::readTimestamp<TIMESTAMP_RDTSC>();
+    uint64_t rdtscp = RuntimeLogger::readTimestamp<TIMESTAMP_RDTSCP>();
+    EXPECT_LE(start, rdtsc);
+    EXPECT_LE(rdtsc, rdtscp);
+    EXPECT_EQ(Log::NO_TIMESTAMP,
+              RuntimeLogger::readTimestamp<TIMESTAMP_NONE>());
+
+    // The coarse timestamp lags the cycle counter, but is never unset
+    uint64_t coarse = RuntimeLogger::readTimestamp<TIMESTAMP_COARSE>();
+    EXPECT_NE(0U, coarse);
+    EXPECT_LE(coarse, PerfUtils::Cycles::rdtsc());
+}
+
+TEST_F(NanoLogTest, StagingBuffer_pooledAcrossThreads) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    // A size no other test uses keeps their leftover buffers out of the way
+    const uint32_t poolTestSize = 3*NanoLogConfig::MIN_STAGING_BUFFER_SIZE;
+    RuntimeLogger::setStagingBufferSize(poolTestSize);
+
+    RuntimeLogger::StagingBuffer *first = nullptr;
+    uint32_t firstId = 0;
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        first = RuntimeLogger::stagingBuffer;
+        firstId = first->getId();
+    }).join();
+
+    // The compression thread pools the buffer once it has been drained
+    bool pooled = false;
+    for (int i = 0; i < 1000 && !pooled; ++i) {
+        RuntimeLogger::sync();
+        std::lock_guard<std::mutex> lock(rl.stagingBufferPoolMutex);
+        for (RuntimeLogger::StagingBuffer *sb : rl.stagingBufferPool)
+            pooled |= (sb == first);
+    }
+    ASSERT_TRUE(pooled);
+
+    // The next thread adopts it under a new id with a clean slate
+    uint64_t reused = rl.numStagingBuffersReused;
+    std::thread([&]() {
+        RuntimeLogger::preallocate();
+        RuntimeLogger::StagingBuffer *sb = RuntimeLogger::stagingBuffer;
+        EXPECT_EQ(first, sb);
+        EXPECT_NE(firstId, sb->getId());
+        EXPECT_EQ(poolTestSize, sb->minFreeSpace);
+        EXPECT_EQ(sb->storage, sb->producerPos);
+        EXPECT_EQ(sb->storage, sb->consumerPos);
+        EXPECT_EQ(0U, sb->numAllocations);
+        EXPECT_FALSE(sb->shouldDeallocate);
+    }).join();
+    EXPECT_EQ(reused + 1, rl.numStagingBuffersReused);
+
+    // Buffers of a different size are never adopted
+    std::thread([&]() {
+        RuntimeLogger::preallocate(2*poolTestSize);
+        EXPECT_EQ(2*poolTestSize, RuntimeLogger::stagingBuffer->getCapacity());
+    }).join();
+    EXPECT_EQ(reused + 1, rl.numStagingBuffersReused);
+
+    RuntimeLogger::setStagingBufferSize(NanoLogConfig::STAGING_BUFFER_SIZE);
+}
+
+TEST_F(NanoLogTest, isLogSiteEnabled) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    static int debugFilter = LOG_SITE_UNRESOLVED;
+    static int debugId = 424242;
+    static int noticeFilter = LOG_SITE_UNRESOLVED;
+    static int noticeId = UNASSIGNED_LOGID;
+
+    auto debugSite = [&]() {
+        return RuntimeLogger::isLogSiteEnabled(debugFilter, &debugId,
+                            "src/net/Socket.cc", 10, DEBUG, "sent %d bytes");
+    };
+    auto noticeSite = [&]() {
+        return RuntimeLogger::isLogSiteEnabled(noticeFilter, &noticeId,
+                            "src/db/Table.cc", 20, NOTICE, "opened %s");
+    };
+
+    // The first invocation resolves the site against the log level
+    RuntimeLogger::setLogLevel(NOTICE);
+    EXPECT_FALSE(debugSite());
+    EXPECT_EQ(LOG_SITE_DISABLED, debugFilter);
+    EXPECT_TRUE(noticeSite());
+    EXPECT_EQ(LOG_SITE_ENABLED, noticeFilter);
+
+    size_t numSites = rl.logSites.size();
+    EXPECT_FALSE(debugSite());
+    EXPECT_EQ(numSites, rl.logSites.size());
+
+    // Filters reach sites that were already resolved
+    RuntimeLogger::setLogSitesEnabled(MATCH_FILE, "src/net/*", true);
+    EXPECT_TRUE(debugSite());
+    RuntimeLogger::setLogSitesEnabled(MATCH_FORMAT, "bytes", false);
+    EXPECT_FALSE(debugSite());
+    RuntimeLogger::setLogSitesEnabled(MATCH_LOG_ID, "424242", true);
+    EXPECT_TRUE(debugSite());
+    EXPECT_TRUE(noticeSite());
+
+    // Invalid patterns are ignored
+    size_t numRules = rl.logSiteRules.size();
+    RuntimeLogger::setLogSitesEnabled(MATCH_LOG_ID, "42x", false);
+    RuntimeLogger::setLogSitesEnabled(MATCH_FILE, nullptr, false);
+    RuntimeLogger::setLogSitesEnabled(NUM_LOG_SITE_MATCHES, "*", false);
+    EXPECT_EQ(numRules, rl.logSiteRules.size());
+
+    // Filters take precedence over the log level
+    RuntimeLogger::setLogSitesEnabled(MATCH_FILE, "*/db/*", false);
+    RuntimeLogger::setLogLevel(DEBUG);
+    EXPECT_FALSE(noticeSite());
+    EXPECT_TRUE(debugSite());
+
+    // A log identifier match applies once the site is assigned one, which
+    // only re-evaluates that site
+    RuntimeLogger::clearLogSiteFilters();
+    EXPECT_TRUE(noticeSite());
+    std::string nextId = std::to_string(rl.invocationSites.getNumAllocated());
+    RuntimeLogger::setLogSitesEnabled(MATCH_LOG_ID, nextId.c_str(), false);
+    EXPECT_TRUE(noticeSite());
+    __atomic_store_n(&debugFilter, LOG_SITE_DISABLED, __ATOMIC_RELAXED);
+    static const ParamType paramTypes[1] = {};
+    rl.registerInvocationSite_internal(noticeId,
+            StaticLogInfo(nullptr, "src/db/Table.cc", 20, NOTICE, "opened",
+                          0, 0, paramTypes));
+    EXPECT_EQ(nextId, std::to_string(noticeId));
+    EXPECT_FALSE(noticeSite());
+    EXPECT_EQ(LOG_SITE_DISABLED, debugFilter);
+
+    RuntimeLogger::clearLogSiteFilters();
+    RuntimeLogger::setLogLevel(NOTICE);
+    EXPECT_FALSE(debugSite());
+    EXPECT_TRUE(noticeSite());
+}
+
+TEST_F(NanoLogTest, setOutputBufferSize) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    // Sizes are rounded up to multiples of 512B
+    uint32_t expectedSize = NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE + 512;
+    RuntimeLogger::setOutputBufferSize(expectedSize - 1);
+    EXPECT_EQ(expectedSize, RuntimeLogger::getOutputBufferSize());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        EXPECT_EQ(expectedSize, shard->output->getBufferSize());
+        EXPECT_TRUE(shard->compressionThread.joinable());
+    }
+    RuntimeLogger::sync();
+
+    // Too small is clamped to the minimum
+    RuntimeLogger::setOutputBufferSize(1);
+    EXPECT_EQ(NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE,
+              RuntimeLogger::getOutputBufferSize());
+
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    EXPECT_EQ(NanoLogConfig::OUTPUT_BUFFER_SIZE,
+              rl.shards.at(0)->output->getBufferSize());
+}
+
+TEST_F(NanoLogTest, compressionThread_parksWhenIdle) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    // Give the threads work so they go through every phase of idling again
+    NANO_LOG(NOTICE, "Logged before idling");
+    RuntimeLogger::sync();
+
+    uint64_t numTimesParked = rl.shards.at(0)->numTimesParked;
+    uint64_t cyclesIdleBackingOff = rl.shards.at(0)->cyclesIdleBackingOff;
+
+    // Spinning plus backing off takes ~2ms with the default configuration
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_TRUE(rl.compressionThreadsParked);
+    EXPECT_LT(numTimesParked, rl.shards.at(0)->numTimesParked);
+    EXPECT_LT(cyclesIdleBackingOff, rl.shards.at(0)->cyclesIdleBackingOff);
+
+    // The first logging thread to notice wakes the threads up
+    RuntimeLogger::wakeupCompressionThreads();
+    EXPECT_FALSE(rl.compressionThreadsParked);
+    RuntimeLogger::wakeupCompressionThreads();
+    EXPECT_FALSE(rl.compressionThreadsParked);
+    RuntimeLogger::sync();
+
+    // A log message logged while the threads are parked wakes them up; only
+    // one that races with the park has to wait out IDLE_PARK_TIMEOUT_US
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_TRUE(rl.compressionThreadsParked);
+    uint64_t start = Cycles::rdtsc();
+    NANO_LOG(NOTICE, "Logged while parked");
+    LogPosition position = RuntimeLogger::getLogPosition();
+    while (!RuntimeLogger::isPersisted(position) &&
+            Cycles::toSeconds(Cycles::rdtsc() - start) < 1.0)
+        std::this_thread::yield();
+    EXPECT_TRUE(RuntimeLogger::isPersisted(position));
+    EXPECT_GT(NanoLogConfig::IDLE_PARK_TIMEOUT_US/2,
+              Cycles::toMicroseconds(Cycles::rdtsc() - start));
+}
+
+TEST_F(NanoLogTest, setOutputEngine) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    // io_uring may not be supported here, in which case POSIX AIO is kept
+    RuntimeLogger::setOutputEngine(OutputEngine::IO_URING);
+    OutputEngine engine = RuntimeLogger::getOutputEngine();
+    EXPECT_TRUE(engine == OutputEngine::IO_URING ||
+                engine == OutputEngine::POSIX_AIO);
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        EXPECT_EQ(engine, shard->output->getEngine());
+        EXPECT_EQ(RuntimeLogger::getOutputBufferSize(),
+                  shard->output->getBufferSize());
+        EXPECT_TRUE(shard->compressionThread.joinable());
+    }
+    RuntimeLogger::sync();
+
+    // Invalid engines are treated as POSIX AIO
+    RuntimeLogger::setOutputEngine(OutputEngine::NUM_OUTPUT_ENGINES);
+    EXPECT_EQ(OutputEngine::POSIX_AIO, RuntimeLogger::getOutputEngine());
+    EXPECT_EQ(OutputEngine::POSIX_AIO, rl.shards.at(0)->output->getEngine());
+    EXPECT_EQ(1U, rl.shards.at(0)->output->getQueueDepth());
+}
+
+/**
+ * Issues more writes to an OutputBackend than can be in flight at once and
+ * waits for all of them to retire. Write i is filled with the character
+ * ('a' + i).
+ *
+ * \param output
+ *      OutputBackend to write through
+ * \param fd
+ *      File descriptor to write to
+ * \param bytesPerWrite
+ *      Number of bytes in each write
+ * \param randomLastWrite
+ *      Fill the last write with pseudo-random bytes (from srand(42)) instead,
+ *      which block compression can't shrink
+ *
+ * \return
+ *      The number of writes issued
+ */
+static int
+issueWrites(OutputBackend *output, int fd, uint32_t bytesPerWrite,
+            bool randomLastWrite=false)
+{
+    int numWrites = 3*output->getQueueDepth() + 1;
+    for (int i = 0; i < numWrites; ++i) {
+        if (output->isFull()) {
+            EXPECT_LT(0U, output->reapWrites(true));
+        }
+
+        char *buffer = output->getFreeBuffer();
+        memset(buffer, 'a' + i, bytesPerWrite);
+        if (randomLastWrite && i == numWrites - 1) {
+            srand(42);
+            for (uint32_t j = 0; j < bytesPerWrite; ++j)
+                buffer[j] = static_cast<char>(rand());
+        }
+        output->submitWrite(fd, bytesPerWrite);
+        EXPECT_LE(output->getNumInFlight(), output->getQueueDepth());
+    }
+    output->waitForAllWrites();
+    EXPECT_EQ(0U, output->getNumInFlight());
+    return numWrites;
+}
+
+TEST_F(NanoLogTest, OutputBackend_writesInOrder) {
+    const char *testFile = "/tmp/testLog_outputBackend";
+    const uint32_t bytesPerWrite = 4096;
+
+    for (int e = 0; e < OutputEngine::NUM_OUTPUT_ENGINES; ++e) {
+        OutputEngine engine = static_cast<OutputEngine>(e);
+        OutputBackend *output = OutputBackend::create(engine, 1 << 20);
+        if (output == nullptr) {
+            EXPECT_EQ(OutputEngine::IO_URING, engine);
+            continue;
+        }
+
+        int fd = open(testFile, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0666);
+        ASSERT_LE(0, fd);
+
+        int numWrites = issueWrites(output, fd, bytesPerWrite);
+        EXPECT_EQ(0U, output->reapWrites(true));
+
+        // Every write retired lands in the latency distribution
+        uint64_t numLatencies = 0;
+        for (uint32_t i = 0; i < Metrics::NUM_WRITE_LATENCY_BUCKETS; ++i)
+            numLatencies += output->getWriteLatencyDist()[i];
+        EXPECT_EQ(static_cast<uint64_t>(numWrites), numLatencies);
+        close(fd);
+        delete output;
+
+        FILE *in = fopen(testFile, "r");
+        ASSERT_NE(nullptr, in);
+        char buffer[bytesPerWrite];
+        for (int i = 0; i < numWrites; ++i) {
+            ASSERT_EQ(bytesPerWrite, fread(buffer, 1, bytesPerWrite, in));
+            EXPECT_EQ('a' + i, buffer[0]);
+            EXPECT_EQ('a' + i, buffer[bytesPerWrite - 1]);
+        }
+        EXPECT_EQ(0U, fread(buffer, 1, 1, in));
+        fclose(in);
+        std::remove(testFile);
+    }
+}
+
+TEST_F(NanoLogTest, setBlockCompression) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+
+    RuntimeLogger::setBlockCompression(BLOCK_COMPRESSION_LZ4);
+    EXPECT_EQ(BLOCK_COMPRESSION_LZ4, RuntimeLogger::getBlockCompression());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        EXPECT_EQ(BLOCK_COMPRESSION_LZ4, shard->output->getBlockCompression());
+        EXPECT_TRUE(shard->compressionThread.joinable());
+    }
+
+    // Reallocated output buffers keep the compressor
+    RuntimeLogger::setCompressionThreads(2);
+    RuntimeLogger::setOutputBufferSize(2*RuntimeLogger::getOutputBufferSize());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards)
+        EXPECT_EQ(BLOCK_COMPRESSION_LZ4, shard->output->getBlockCompression());
+
+    // Invalid compressors are treated as none
+    RuntimeLogger::setBlockCompression(NUM_BLOCK_COMPRESSIONS);
+    EXPECT_EQ(BLOCK_COMPRESSION_NONE, RuntimeLogger::getBlockCompression());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards)
+        EXPECT_EQ(BLOCK_COMPRESSION_NONE, shard->output->getBlockCompression());
+
+    RuntimeLogger::setCompressionThreads(
+                                    NanoLogConfig::NUM_COMPRESSION_THREADS);
+    RuntimeLogger::setOutputBufferSize(NanoLogConfig::OUTPUT_BUFFER_SIZE);
+}
+
+TEST_F(NanoLogTest, OutputBackend_blockCompression) {
+    const char *testFile = "/tmp/testLog_outputBackend";
+    const uint32_t bytesPerWrite = 4096;
+
+    for (int e = 0; e < OutputEngine::NUM_OUTPUT_ENGINES; ++e) {
+        OutputEngine engine = static_cast<OutputEngine>(e);
+        OutputBackend *output = OutputBackend::create(engine, 1 << 20);
+        if (output == nullptr)
+            continue;
+
+        output->setBlockCompression(BLOCK_COMPRESSION_LZ4);
+        int fd = open(testFile, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0666);
+        ASSERT_LE(0, fd);
+
+        // All but the last write compress; the last one is left as is
+        int numWrites = issueWrites(output, fd, bytesPerWrite, true);
+        EXPECT_EQ(numWrites*bytesPerWrite, output->getBlockBytesIn());
+        EXPECT_GT(numWrites*bytesPerWrite, output->getBlockBytesOut());
+        EXPECT_LT(bytesPerWrite, output->getBlockBytesOut());
+        close(fd);
+        delete output;
+
+        FILE *in = fopen(testFile, "r");
+        ASSERT_NE(nullptr, in);
+        Log::CompressedBlock block;
+        char compressed[bytesPerWrite], buffer[bytesPerWrite];
+        for (int i = 0; i < numWrites - 1; ++i) {
+            ASSERT_EQ(sizeof(block), fread(&block, 1, sizeof(block), in));
+            EXPECT_EQ(Log::ExtendedEntryType::COMPRESSED_BLOCK,
+                      block.extendedType);
+            EXPECT_EQ(BlockCodec::LZ4, block.algorithm);
+            EXPECT_EQ(bytesPerWrite, block.uncompressedLength);
+            ASSERT_EQ(block.compressedLength,
+                      fread(compressed, 1, block.compressedLength, in));
+            EXPECT_EQ(bytesPerWrite, BlockCodec::decompress(compressed,
+                            block.compressedLength, buffer, sizeof(buffer)));
+            EXPECT_EQ('a' + i, buffer[0]);
+            EXPECT_EQ('a' + i, buffer[bytesPerWrite - 1]);
+        }
+        ASSERT_EQ(bytesPerWrite, fread(buffer, 1, bytesPerWrite, in));
+        srand(42);
+        EXPECT_EQ(static_cast<char>(rand()), buffer[0]);
+        EXPECT_EQ(0U, fread(buffer, 1, 1, in));
+        fclose(in);
+        std::remove(testFile);
+    }
+}
+
+/**
+ * Creates a TCP socket listening on an ephemeral loopback port.
+ *
+ * \param[out] port
+ *      Port the socket listens on
+ *
+ * \return
+ *      The listening socket
+ */
+static int
+listenOnLoopback(uint16_t *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t addrLength = sizeof(addr);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), addrLength)
+            || listen(fd, 1)
+            || getsockname(fd, reinterpret_cast<sockaddr*>(&addr),
+                           &addrLength))
+        return -1;
+
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+TEST_F(NanoLogTest, OutputBackend_collector) {
+    const uint32_t bytesPerWrite = 1 << 16;
+
+    uint16_t port;
+    int listenFd = listenOnLoopback(&port);
+    ASSERT_LE(0, listenFd);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(0, connect(fd, reinterpret_cast<sockaddr*>(&addr),
+                         sizeof(addr)));
+    int peer = accept(listenFd, NULL, NULL);
+    ASSERT_LE(0, peer);
+
+    OutputBackend *output = OutputBackend::create(OutputEngine::COLLECTOR,
+                                                  1 << 20);
+    ASSERT_NE(nullptr, output);
+    EXPECT_EQ(OutputEngine::COLLECTOR, output->getEngine());
+
+    // Drain the other end so that the sends don't block
+    std::vector<char> received;
+    std::thread reader([&]() {
+        char buffer[4096];
+        ssize_t bytesRead;
+        while ((bytesRead = read(peer, buffer, sizeof(buffer))) > 0)
+            received.insert(received.end(), buffer, buffer + bytesRead);
+    });
+
+    int numWrites = issueWrites(output, fd, bytesPerWrite);
+    EXPECT_EQ(0U, output->getNumFailedWrites());
+
+    shutdown(fd, SHUT_WR);
+    reader.join();
+    ASSERT_EQ(numWrites*bytesPerWrite, received.size());
+    for (int i = 0; i < numWrites; ++i) {
+        EXPECT_EQ('a' + i, received[i*bytesPerWrite]);
+        EXPECT_EQ('a' + i, received[(i + 1)*bytesPerWrite - 1]);
+    }
+
+    // Writes to a connection that's gone fail rather than block
+    memset(output->getFreeBuffer(), 'z', bytesPerWrite);
+    output->submitWrite(fd, bytesPerWrite);
+    output->waitForAllWrites();
+    EXPECT_EQ(1U, output->getNumFailedWrites());
+
+    delete output;
+    close(peer);
+    close(fd);
+    close(listenFd);
+}
+
+TEST_F(NanoLogTest, setLogCollector) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    const char *streamFile = "/tmp/testLog_collector";
+    OutputEngine fileEngine = RuntimeLogger::getOutputEngine();
+
+    uint16_t port;
+    int listenFd = listenOnLoopback(&port);
+    ASSERT_LE(0, listenFd);
+
+    std::vector<char> received;
+    std::thread collector([&]() {
+        int fd = accept(listenFd, NULL, NULL);
+        char buffer[4096];
+        ssize_t bytesRead;
+        while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0)
+            received.insert(received.end(), buffer, buffer + bytesRead);
+        close(fd);
+    });
+
+    uint32_t numConnections = rl.numLogCollectorConnections;
+    RuntimeLogger::setLogCollector("127.0.0.1", port);
+    EXPECT_EQ(OutputEngine::COLLECTOR, RuntimeLogger::getOutputEngine());
+    EXPECT_EQ(numConnections + 1, rl.numLogCollectorConnections);
+    EXPECT_FALSE(rl.logCollectorLost);
+    for (RuntimeLogger::CompressionShard *shard : rl.shards)
+        EXPECT_EQ(OutputEngine::COLLECTOR, shard->output->getEngine());
+
+    // The engine is remembered for when a log file is used again
+    RuntimeLogger::setOutputEngine(OutputEngine::POSIX_AIO);
+    EXPECT_EQ(OutputEngine::COLLECTOR, RuntimeLogger::getOutputEngine());
+    RuntimeLogger::sync();
+
+    // Going back to a log file ends the stream
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+    collector.join();
+    close(listenFd);
+    EXPECT_EQ(OutputEngine::POSIX_AIO, RuntimeLogger::getOutputEngine());
+    for (RuntimeLogger::CompressionShard *shard : rl.shards)
+        EXPECT_EQ(OutputEngine::POSIX_AIO, shard->output->getEngine());
+    RuntimeLogger::setOutputEngine(fileEngine);
+
+    ASSERT_LT(sizeof(Log::CollectorHello), received.size());
+    Log::CollectorHello hello;
+    memcpy(&hello, received.data(), sizeof(hello));
+    EXPECT_STREQ("NLCOLL1", hello.magic);
+    EXPECT_EQ(static_cast<uint32_t>(getpid()), hello.pid);
+    EXPECT_EQ(numConnections, hello.connection);
+
+    // What follows the hello is a log file
+    FILE *out = fopen(streamFile, "w");
+    ASSERT_NE(nullptr, out);
+    fwrite(received.data() + sizeof(hello), 1,
+           received.size() - sizeof(hello), out);
+    fclose(out);
+
+    Log::Decoder decoder;
+    EXPECT_TRUE(decoder.open(streamFile));
+    std::remove(streamFile);
+}
+
+TEST_F(NanoLogTest, rotateLogFile) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    const char *testFile = "/tmp/testLog_rotation";
+    std::string rotatedFile = std::string(testFile) + "." +
+                                std::to_string(rl.numLogFilesRotated + 1);
+    std::remove(testFile);
+    std::remove(rotatedFile.c_str());
+
+    RuntimeLogger::setLogFile(testFile);
+    RuntimeLogger::setCompressionThreads(2);
+    uint32_t generation = rl.logFileGeneration;
+    int oldFd = rl.outputFd;
+
+    RuntimeLogger::rotateLogFile();
+    EXPECT_TRUE(rl.rotationRequested);
+    RuntimeLogger::sync();
+
+    // Every shard follows once it has passed an output buffer boundary, and
+    // the last one to do so closes the old file.
+    for (int i = 0; i < 1000; ++i) {
+        {
+            std::lock_guard<std::mutex> lock(rl.rotationMutex);
+            if (rl.retiringFd < 0 && rl.checkpointPersisted)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    EXPECT_FALSE(rl.rotationRequested);
+    EXPECT_EQ(generation + 1, rl.logFileGeneration);
+    EXPECT_NE(oldFd, rl.outputFd);
+    EXPECT_EQ(-1, rl.retiringFd);
+    for (RuntimeLogger::CompressionShard *shard : rl.shards) {
+        EXPECT_EQ(rl.outputFd, shard->logFd);
+        EXPECT_EQ(rl.logFileGeneration.load(), shard->logFileGeneration);
+    }
+
+    // Both files start off with their own Checkpoint
+    Log::Decoder decoder;
+    EXPECT_TRUE(decoder.open(rotatedFile.c_str()));
+    EXPECT_TRUE(decoder.open(testFile));
+
+    RuntimeLogger::setCompressionThreads(
+                                    NanoLogConfig::NUM_COMPRESSION_THREADS);
+    RuntimeLogger::setLogFile(NanoLogConfig::DEFAULT_LOG_FILE);
+    std::remove(testFile);
+    std::remove(rotatedFile.c_str());
+}
+
+TEST_F(NanoLogTest, checkLogFileLimits) {
+    RuntimeLogger &rl = RuntimeLogger::nanoLogSingleton;
+    const char *testFile = "/tmp/testLog_rotationLimits";
+
+    // Keep the compression threads from acting on the requests
+    RuntimeLogger::sync();
+    rl.stopCompressionThreads();
+
+    int fd = open(testFile, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    ASSERT_LE(0, fd);
+
+    char buffer[1000];
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(500, write(fd, buffer, 500));
+
+    // Rotation is off by default
+    rl.rotationRequested = false;
+    rl.logFileBytesSubmitted = 0;
+    rl.checkLogFileLimits(fd, 500);
+    EXPECT_FALSE(rl.rotationRequested);
+    EXPECT_EQ(0U, rl.logFileBytesSubmitted);
+
+    // The size is looked up once enough was submitted to reach the limit
+    RuntimeLogger::setLogRotation(1000, 0);
+    rl.checkLogFileLimits(fd, 500);
+    EXPECT_FALSE(rl.rotationRequested);
+    EXPECT_EQ(1000U, rl.nextRotationSizeCheck);
+
+    rl.checkLogFileLimits(fd, 100);
+    EXPECT_FALSE(rl.rotationRequested);
+    EXPECT_EQ(1000U, rl.nextRotationSizeCheck);
+
+    ASSERT_EQ(500, write(fd, buffer, 500));
+    rl.checkLogFileLimits(fd, 400);
+    EXPECT_TRUE(rl.rotationRequested);
+
+    // Rotation by age
+    rl.rotationRequested = false;
+    RuntimeLogger::setLogRotation(0, 3600);
+    rl.logFileOpenCycles = PerfUtils::Cycles::rdtsc();
+    rl.checkLogFileLimits(fd, 100);
+    EXPECT_FALSE(rl.rotationRequested);
+
+    rl.logFileOpenCycles = PerfUtils::Cycles::rdtsc()
+                                    - PerfUtils::Cycles::fromSeconds(3601);
+    rl.checkLogFileLimits(fd, 100);
+    EXPECT_TRUE(rl.rotationRequested);
+
+    RuntimeLogger::setLogRotation(0, 0);
+    rl.rotationRequested = false;
+    rl.logFileOpenCycles = PerfUtils::Cycles::rdtsc();
+    rl.startCompressionThreads(false);
+    close(fd);
+    std::remove(testFile);
+}
+}; //namespace
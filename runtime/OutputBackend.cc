@@ -0,0 +1,1139 @@
+/* Copyright (c) 2016-2019 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <aio.h>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+
+// MSG_ZEROCOPY needs Linux 4.14+ headers; the COLLECTOR engine copies the
+// output buffers into the socket without them.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/errqueue.h>)
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) \
+        && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define NANOLOG_HAS_MSG_ZEROCOPY
+#endif
+#endif
+#endif
+
+// io_uring is driven through raw system calls so that NanoLog does not pick
+// up a dependency on liburing; only the kernel UAPI header is needed.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) \
+        && defined(__NR_io_uring_register)
+#define NANOLOG_HAS_IO_URING
+#endif
+#endif
+#endif
+
+// NanoLog.h pulls in OutputBackend.h via RuntimeLogger.h and has to come
+// first so that NanoLog::OutputEngine is declared by then.
+#include "NanoLog.h"
+#include "BlockCodec.h"
+#include "Config.h"
+#include "Cycles.h"
+#include "OutputBackend.h"
+
+namespace NanoLogInternal {
+
+/**
+ * OutputBackend constructor; allocates the ring of output buffers.
+ *
+ * \param outputEngine
+ *      Kernel interface implemented by the subclass
+ * \param maxInFlight
+ *      Maximum number of writes the subclass can have in flight at once
+ * \param bytesPerBuffer
+ *      Byte size of each output buffer
+ */
+OutputBackend::OutputBackend(OutputEngine outputEngine, uint32_t maxInFlight,
+                             uint32_t bytesPerBuffer)
+    : engine(outputEngine)
+    , queueDepth(maxInFlight)
+    , bufferSize(bytesPerBuffer)
+    , buffers(maxInFlight + 1, nullptr)
+    , completed(maxInFlight + 1, false)
+    , submitCycles(maxInFlight + 1, 0)
+    , nextFreeBuffer(0)
+    , oldestInFlight(0)
+    , numInFlight(0)
+    , blockCompression(BLOCK_COMPRESSION_NONE)
+    , compressorThread()
+    , compressorMutex()
+    , compressorWork()
+    , compressorDone()
+    , compressorShouldExit(false)
+    , numBuffersQueued(0)
+    , numBuffersCompressed(0)
+    , numBuffersHandedOff(0)
+    , nextToCompress(0)
+    , nextToHandOff(0)
+    , writeFds(maxInFlight + 1, -1)
+    , submittedBytes(maxInFlight + 1, 0)
+    , compressedBytes(maxInFlight + 1, 0)
+    , compressionBuffer(nullptr)
+    , blockBytesIn(0)
+    , blockBytesOut(0)
+    , blockCyclesCompressing(0)
+    , numFailedWrites(0)
+    , writeLatencyDist()
+{
+    for (char *&buffer : buffers) {
+        int err = posix_memalign(reinterpret_cast<void **>(&buffer),
+                                 512, bufferSize);
+        if (err) {
+            perror("The NanoLog system was not able to allocate enough memory "
+                           "to support its operations. Quitting...\r\n");
+            std::exit(-1);
+        }
+    }
+}
+
+// OutputBackend destructor; all writes must have been waited on first.
+OutputBackend::~OutputBackend() {
+    assert(numInFlight == 0);
+    setBlockCompression(BLOCK_COMPRESSION_NONE);
+
+    for (char *buffer : buffers)
+        free(buffer);
+    buffers.clear();
+}
+
+/**
+ * Writes the first nbytes of the free buffer (see getFreeBuffer()) to the end
+ * of a file asynchronously and returns the buffer to fill next. The caller
+ * must ensure the backend is not full (see isFull()) before invoking this.
+ *
+ * \param fd
+ *      File descriptor to write to
+ * \param nbytes
+ *      Number of bytes to write from the free buffer
+ *
+ * \return
+ *      The next free buffer
+ */
+char *
+OutputBackend::submitWrite(int fd, size_t nbytes) {
+    assert(!isFull());
+
+    uint32_t bufferIndex = nextFreeBuffer;
+    if (numInFlight == 0)
+        oldestInFlight = bufferIndex;
+
+    completed[bufferIndex] = false;
+    submitCycles[bufferIndex] = PerfUtils::Cycles::rdtsc();
+    nextFreeBuffer = (nextFreeBuffer + 1) % downCast<uint32_t>(buffers.size());
+    ++numInFlight;
+
+    if (blockCompression == BLOCK_COMPRESSION_NONE) {
+        submit(bufferIndex, fd, nbytes);
+        return buffers[nextFreeBuffer];
+    }
+
+    writeFds[bufferIndex] = fd;
+    submittedBytes[bufferIndex] = nbytes;
+    {
+        std::lock_guard<std::mutex> lock(compressorMutex);
+        ++numBuffersQueued;
+    }
+    compressorWork.notify_one();
+
+    return buffers[nextFreeBuffer];
+}
+
+/**
+ * Retires the in-flight writes that have finished, oldest first, so that
+ * their buffers can be reused.
+ *
+ * \param wait
+ *      true means block until at least one write has been retired if there
+ *      are writes in flight
+ *
+ * \return
+ *      Number of writes retired
+ */
+uint32_t
+OutputBackend::reapWrites(bool wait) {
+    if (numInFlight == 0)
+        return 0;
+
+    handOffCompressedBuffers(false);
+    if (getNumInKernel() > 0)
+        poll(false);
+
+    uint32_t numRetired = 0;
+    while (true) {
+        while (numInFlight > 0 && completed[oldestInFlight]) {
+            uint64_t latencyUs = PerfUtils::Cycles::toMicroseconds(
+                    PerfUtils::Cycles::rdtsc() - submitCycles[oldestInFlight]);
+            uint32_t bucket = (latencyUs == 0) ? 0 :
+                    std::min(Metrics::NUM_WRITE_LATENCY_BUCKETS - 1,
+                             64 - static_cast<uint32_t>(
+                                                __builtin_clzll(latencyUs)));
+            ++writeLatencyDist[bucket];
+
+            completed[oldestInFlight] = false;
+            oldestInFlight = (oldestInFlight + 1) %
+                                        downCast<uint32_t>(buffers.size());
+            --numInFlight;
+            ++numRetired;
+        }
+
+        if (numRetired > 0 || !wait || numInFlight == 0)
+            return numRetired;
+
+        // The oldest buffer may still be with the block compressor
+        if (getNumInKernel() > 0)
+            poll(true);
+        else
+            handOffCompressedBuffers(true);
+    }
+}
+
+/**
+ * Blocks until all the writes in flight have been retired.
+ *
+ * \return
+ *      Number of writes retired
+ */
+uint32_t
+OutputBackend::waitForAllWrites() {
+    uint32_t numRetired = 0;
+    while (numInFlight > 0)
+        numRetired += reapWrites(true);
+
+    return numRetired;
+}
+
+/**
+ * Sets the general purpose compressor the buffers submitted from here on are
+ * run through before they are written out, starting or stopping the helper
+ * thread that runs it. There must be no writes in flight.
+ *
+ * \param compression
+ *      Block compressor to use; BLOCK_COMPRESSION_NONE to write the buffers
+ *      out as is
+ */
+void
+OutputBackend::setBlockCompression(BlockCompression compression) {
+    assert(numInFlight == 0);
+
+    if (compressorThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(compressorMutex);
+            compressorShouldExit = true;
+        }
+        compressorWork.notify_one();
+        compressorThread.join();
+    }
+
+    free(compressionBuffer);
+    compressionBuffer = nullptr;
+    blockCompression = BLOCK_COMPRESSION_NONE;
+
+    if (compression == BLOCK_COMPRESSION_NONE ||
+            compression >= NUM_BLOCK_COMPRESSIONS)
+        return;
+
+    int err = posix_memalign(reinterpret_cast<void **>(&compressionBuffer),
+                             512, bufferSize);
+    if (err) {
+        perror("The NanoLog system was not able to allocate enough memory "
+                       "to support its operations. Quitting...\r\n");
+        std::exit(-1);
+    }
+
+    blockCompression = compression;
+    compressorShouldExit = false;
+    numBuffersQueued = numBuffersCompressed = numBuffersHandedOff = 0;
+    nextToCompress = nextToHandOff = nextFreeBuffer;
+    compressorThread = std::thread(&OutputBackend::compressorMain, this);
+}
+
+/**
+ * Hands the buffers the helper thread finished compressing over to the
+ * kernel, in the order they were submitted.
+ *
+ * \param wait
+ *      true means block until at least one buffer is compressed if there
+ *      are buffers waiting on the helper thread
+ */
+void
+OutputBackend::handOffCompressedBuffers(bool wait) {
+    if (numBuffersHandedOff == numBuffersQueued)
+        return;
+
+    if (wait && numBuffersCompressed == numBuffersHandedOff) {
+        std::unique_lock<std::mutex> lock(compressorMutex);
+        compressorDone.wait(lock, [this]() {
+            return numBuffersCompressed != numBuffersHandedOff;
+        });
+    }
+
+    uint64_t numCompressed = numBuffersCompressed;
+    while (numBuffersHandedOff < numCompressed) {
+        uint32_t bufferIndex = nextToHandOff;
+        nextToHandOff = (nextToHandOff + 1) %
+                                        downCast<uint32_t>(buffers.size());
+        ++numBuffersHandedOff;
+
+        blockBytesIn += submittedBytes[bufferIndex];
+        blockBytesOut += compressedBytes[bufferIndex];
+        submit(bufferIndex, writeFds[bufferIndex],
+               compressedBytes[bufferIndex]);
+    }
+}
+
+/**
+ * Compresses a submitted buffer in place into a CompressedBlock. Buffers
+ * that do not shrink are left as they are, so that they are written out
+ * uncompressed.
+ *
+ * \param bufferIndex
+ *      Index of the buffer to compress within buffers
+ */
+void
+OutputBackend::compressBuffer(uint32_t bufferIndex) {
+    char *buffer = buffers[bufferIndex];
+    size_t nbytes = submittedBytes[bufferIndex];
+    compressedBytes[bufferIndex] = nbytes;
+
+    if (nbytes <= sizeof(Log::CompressedBlock))
+        return;
+
+    size_t blockBytes = BlockCodec::compress(buffer, nbytes,
+                            compressionBuffer + sizeof(Log::CompressedBlock),
+                            nbytes - sizeof(Log::CompressedBlock) - 1);
+    if (blockBytes == 0)
+        return;
+
+    Log::CompressedBlock *block =
+                reinterpret_cast<Log::CompressedBlock*>(compressionBuffer);
+    block->entryType = Log::EntryType::INVALID;
+    block->extendedType = Log::ExtendedEntryType::COMPRESSED_BLOCK;
+    block->algorithm = BlockCodec::LZ4;
+    block->compressedLength = downCast<uint32_t>(blockBytes);
+    block->uncompressedLength = downCast<uint32_t>(nbytes);
+    blockBytes += sizeof(Log::CompressedBlock);
+
+    // Keep the writes a multiple of 512B (nbytes already is one)
+    if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
+        size_t bytesOver = blockBytes % 512;
+        if (bytesOver != 0) {
+            memset(compressionBuffer + blockBytes, 0, 512 - bytesOver);
+            blockBytes += 512 - bytesOver;
+        }
+    }
+
+    memcpy(buffer, compressionBuffer, blockBytes);
+    compressedBytes[bufferIndex] = blockBytes;
+}
+
+/**
+ * Main loop of the helper thread that compresses the buffers submitted while
+ * a block compressor is set. It runs until setBlockCompression() asks it to
+ * exit, which only happens with no buffers in flight.
+ */
+void
+OutputBackend::compressorMain() {
+    uint64_t numCompressed = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(compressorMutex);
+            compressorWork.wait(lock, [this, numCompressed]() {
+                return compressorShouldExit ||
+                                        numBuffersQueued != numCompressed;
+            });
+
+            if (numBuffersQueued == numCompressed)
+                return;
+        }
+
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        compressBuffer(nextToCompress);
+        nextToCompress = (nextToCompress + 1) %
+                                        downCast<uint32_t>(buffers.size());
+        blockCyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(compressorMutex);
+            numBuffersCompressed = ++numCompressed;
+        }
+        compressorDone.notify_one();
+    }
+}
+
+/**
+ * Invoked by the subclasses to mark the write of a buffer as finished.
+ *
+ * \param bufferIndex
+ *      Index of the buffer the write was issued from
+ */
+void
+OutputBackend::writeCompleted(uint32_t bufferIndex) {
+    assert(bufferIndex < completed.size());
+    completed[bufferIndex] = true;
+}
+
+/**
+ * OutputBackend using POSIX AIO. Only a single write is kept in flight since
+ * POSIX AIO makes no guarantees about the order in which requests complete.
+ */
+class PosixAioBackend : public OutputBackend {
+PUBLIC:
+    explicit PosixAioBackend(uint32_t bytesPerBuffer)
+        : OutputBackend(POSIX_AIO, 1, bytesPerBuffer)
+        , aioCb()
+        , inFlightBuffer(0)
+    {
+        memset(&aioCb, 0, sizeof(aioCb));
+    }
+
+    ~PosixAioBackend() {
+        if (numInFlight > 0)
+            waitForAllWrites();
+    }
+
+PROTECTED:
+    void
+    submit(uint32_t bufferIndex, int fd, size_t nbytes) {
+        inFlightBuffer = bufferIndex;
+        aioCb.aio_fildes = fd;
+        aioCb.aio_buf = buffers[bufferIndex];
+        aioCb.aio_nbytes = nbytes;
+
+        if (aio_write(&aioCb) == -1) {
+            fprintf(stderr, "Error at aio_write(): %s\n", strerror(errno));
+            ++numFailedWrites;
+            writeCompleted(bufferIndex);
+        }
+    }
+
+    void
+    poll(bool wait) {
+        if (numInFlight == 0 || completed[inFlightBuffer])
+            return;
+
+        if (aio_error(&aioCb) == EINPROGRESS) {
+            if (!wait)
+                return;
+
+            const struct aiocb *const aiocb_list[] = {&aioCb};
+            int err = aio_suspend(aiocb_list, 1, NULL);
+            if (err != 0)
+                perror("LogCompressor's Posix AIO suspend operation failed");
+
+            if (aio_error(&aioCb) == EINPROGRESS)
+                return;
+        }
+
+        // Finishing up the IO
+        int err = aio_error(&aioCb);
+        ssize_t ret = aio_return(&aioCb);
+
+        if (err != 0) {
+            fprintf(stderr, "LogCompressor's POSIX AIO failed"
+                    " with %d: %s\r\n", err, strerror(err));
+            ++numFailedWrites;
+        } else if (ret < 0) {
+            perror("LogCompressor's Posix AIO Write failed");
+            ++numFailedWrites;
+        }
+
+        writeCompleted(inFlightBuffer);
+    }
+
+    // POSIX AIO structure used to communicate async IO requests
+    struct aiocb aioCb;
+
+    // Index of the buffer aioCb refers to
+    uint32_t inFlightBuffer;
+};
+
+#ifdef NANOLOG_HAS_IO_URING
+/**
+ * OutputBackend using Linux io_uring. All the output buffers are registered
+ * with the kernel up front (if the memlock limit permits it) so that the
+ * writes skip the per-IO page pinning, and up to queueDepth writes may be in
+ * flight at once. Every write is submitted with IOSQE_IO_DRAIN so that it
+ * only starts after the previous ones finish; the compressed log relies on
+ * the buffers reaching the file in order (e.g. the dictionary entries
+ * precede the log messages that use them).
+ */
+class IoUringBackend : public OutputBackend {
+PUBLIC:
+    IoUringBackend(uint32_t maxInFlight, uint32_t bytesPerBuffer)
+        : OutputBackend(IO_URING, maxInFlight, bytesPerBuffer)
+        , ringFd(-1)
+        , sqRing(MAP_FAILED)
+        , sqRingBytes(0)
+        , cqRing(MAP_FAILED)
+        , cqRingBytes(0)
+        , sqes(nullptr)
+        , sqesBytes(0)
+        , sqTail(nullptr)
+        , sqMask(nullptr)
+        , sqArray(nullptr)
+        , cqHead(nullptr)
+        , cqTail(nullptr)
+        , cqMask(nullptr)
+        , cqes(nullptr)
+        , iovecs(buffers.size())
+        , buffersRegistered(false)
+    {
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = bufferSize;
+        }
+    }
+
+    ~IoUringBackend() {
+        if (numInFlight > 0)
+            waitForAllWrites();
+
+        if (sqes != nullptr)
+            munmap(sqes, sqesBytes);
+
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingBytes);
+
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingBytes);
+
+        if (ringFd >= 0)
+            close(ringFd);
+    }
+
+    /**
+     * Sets up the io_uring instance and registers the output buffers.
+     *
+     * \return
+     *      true if io_uring is usable on this system
+     */
+    bool
+    init() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup,
+                                          queueDepth, &params));
+        if (ringFd < 0)
+            return false;
+
+        sqRingBytes = params.sq_off.array + params.sq_entries*sizeof(__u32);
+        cqRingBytes = params.cq_off.cqes +
+                            params.cq_entries*sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+
+        sqRing = mmap(NULL, sqRingBytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(NULL, cqRingBytes, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ringFd,
+                          IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+                return false;
+        }
+
+        sqesBytes = params.sq_entries*sizeof(struct io_uring_sqe);
+        void *sqesMap = mmap(NULL, sqesBytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ringFd,
+                             IORING_OFF_SQES);
+        if (sqesMap == MAP_FAILED)
+            return false;
+        sqes = static_cast<struct io_uring_sqe *>(sqesMap);
+
+        char *sq = static_cast<char *>(sqRing);
+        char *cq = static_cast<char *>(cqRing);
+        sqTail = reinterpret_cast<__u32 *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<__u32 *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<__u32 *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<__u32 *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<__u32 *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<__u32 *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(cq +
+                                                       params.cq_off.cqes);
+
+        // Registration can fail on RLIMIT_MEMLOCK, in which case the writes
+        // fall back to regular (unregistered) vectored writes.
+        buffersRegistered = syscall(__NR_io_uring_register, ringFd,
+                                    IORING_REGISTER_BUFFERS, iovecs.data(),
+                                    static_cast<unsigned>(iovecs.size())) == 0;
+        return true;
+    }
+
+PROTECTED:
+    void
+    submit(uint32_t bufferIndex, int fd, size_t nbytes) {
+        __u32 tail = *sqTail;
+        __u32 index = tail & *sqMask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+
+        // The offset is ignored for files opened with O_APPEND
+        sqe->fd = fd;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->off = 0;
+        sqe->user_data = bufferIndex;
+        if (buffersRegistered) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = reinterpret_cast<uintptr_t>(buffers[bufferIndex]);
+            sqe->len = downCast<__u32>(nbytes);
+            sqe->buf_index = static_cast<__u16>(bufferIndex);
+        } else {
+            iovecs[bufferIndex].iov_len = nbytes;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = reinterpret_cast<uintptr_t>(&iovecs[bufferIndex]);
+            sqe->len = 1;
+        }
+
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        long ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0) {
+            perror("LogCompressor's io_uring submission failed");
+
+            // Take the entry back so it is not submitted later on
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            ++numFailedWrites;
+            writeCompleted(bufferIndex);
+        }
+    }
+
+    void
+    poll(bool wait) {
+        if (wait) {
+            long ret = syscall(__NR_io_uring_enter, ringFd, 0, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR)
+                perror("LogCompressor's io_uring wait operation failed");
+        }
+
+        __u32 head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "LogCompressor's io_uring write failed"
+                        " with %d: %s\r\n", -cqe->res, strerror(-cqe->res));
+                ++numFailedWrites;
+            }
+
+            writeCompleted(static_cast<uint32_t>(cqe->user_data));
+            ++head;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // File descriptor of the io_uring instance
+    int ringFd;
+
+    // Memory mapped submission and completion queue rings
+    void *sqRing;
+    size_t sqRingBytes;
+    void *cqRing;
+    size_t cqRingBytes;
+
+    // Memory mapped array of submission queue entries
+    struct io_uring_sqe *sqes;
+    size_t sqesBytes;
+
+    // Fields of the rings shared with the kernel
+    __u32 *sqTail;
+    __u32 *sqMask;
+    __u32 *sqArray;
+    __u32 *cqHead;
+    __u32 *cqTail;
+    __u32 *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Describes the output buffers for registration and unregistered writes
+    std::vector<struct iovec> iovecs;
+
+    // Indicates whether the output buffers are registered with the kernel
+    bool buffersRegistered;
+
+    DISALLOW_COPY_AND_ASSIGN(IoUringBackend);
+};
+#endif // NANOLOG_HAS_IO_URING
+
+/**
+ * OutputBackend streaming the output buffers to a log collector over the TCP
+ * connection it is handed as the file descriptor (see
+ * NanoLog::setLogCollector()). The compression threads all share the one
+ * connection, so each buffer is sent in full while holding streamMutex; the
+ * stream then carries whole buffers in the order they were submitted, just
+ * like a log file opened with O_APPEND.
+ *
+ * Buffers of at least NanoLogConfig::COLLECTOR_ZEROCOPY_MIN_BYTES are sent
+ * with MSG_ZEROCOPY and stay in flight until the kernel reports that it's
+ * done with their pages. The kernel numbers the zerocopy sends of a
+ * connection in the order they're made, so only the first backend to send
+ * on a connection does so with MSG_ZEROCOPY (and tracks the numbers); the
+ * others' buffers are copied into the socket and complete right away. The
+ * buffers are always copied if the kernel reports that it had to copy them
+ * anyway (e.g. over loopback).
+ *
+ * A send that fails, or that makes no progress for
+ * NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS, marks the connection as lost and
+ * shuts it down; the buffers submitted to it from then on fail right away
+ * (see getNumFailedWrites()) so that the compression threads keep draining
+ * the StagingBuffers until the RuntimeLogger reconnects. File descriptors
+ * that aren't sockets are simply written to.
+ */
+class CollectorBackend : public OutputBackend {
+PUBLIC:
+    explicit CollectorBackend(uint32_t bytesPerBuffer)
+        : OutputBackend(COLLECTOR, NanoLogConfig::COLLECTOR_QUEUE_DEPTH,
+                        bytesPerBuffer)
+        , zerocopyFd(-1)
+        , zerocopyIno(0)
+        , nextZerocopyId(0)
+        , zerocopyDoneBelow(0)
+        , zerocopyDoneRanges()
+        , lastZerocopyId(buffers.size(), 0)
+        , zerocopyPending(buffers.size(), false)
+        , numZerocopyPending(0)
+        , lastZerocopyProgress(0)
+    {
+    }
+
+    ~CollectorBackend() {
+        if (numInFlight > 0)
+            waitForAllWrites();
+
+        std::lock_guard<std::mutex> lock(streamMutex);
+        if (zerocopyOwner == this)
+            zerocopyOwner = nullptr;
+    }
+
+PROTECTED:
+    void
+    submit(uint32_t bufferIndex, int fd, size_t nbytes) {
+        std::lock_guard<std::mutex> lock(streamMutex);
+        const char *data = buffers[bufferIndex];
+
+        // Not connected at all
+        if (fd < 0) {
+            ++numFailedWrites;
+            writeCompleted(bufferIndex);
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+            while (nbytes > 0) {
+                ssize_t ret = write(fd, data, nbytes);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+
+                if (ret <= 0) {
+                    perror("LogCompressor's write to the log collector failed");
+                    ++numFailedWrites;
+                    break;
+                }
+                data += ret;
+                nbytes -= static_cast<size_t>(ret);
+            }
+
+            writeCompleted(bufferIndex);
+            return;
+        }
+
+        if (st.st_ino == lostIno) {
+            ++numFailedWrites;
+            writeCompleted(bufferIndex);
+            return;
+        }
+
+        bool zerocopy = nbytes >= NanoLogConfig::COLLECTOR_ZEROCOPY_MIN_BYTES
+                            && claimZerocopy(fd, st.st_ino);
+        bool zerocopySent = false;
+        while (nbytes > 0) {
+            int flags = MSG_NOSIGNAL;
+#ifdef NANOLOG_HAS_MSG_ZEROCOPY
+            if (zerocopy)
+                flags |= MSG_ZEROCOPY;
+#endif
+            ssize_t ret = send(fd, data, nbytes, flags);
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            // Out of memory to pin the pages with; copy instead
+            if (ret < 0 && errno == ENOBUFS && zerocopy) {
+                zerocopy = false;
+                continue;
+            }
+
+            if (ret <= 0) {
+                connectionLost(fd, st.st_ino, (ret < 0) ? errno : EPIPE);
+                break;
+            }
+
+            if (zerocopy) {
+                lastZerocopyId[bufferIndex] = nextZerocopyId++;
+                zerocopySent = true;
+            }
+            data += ret;
+            nbytes -= static_cast<size_t>(ret);
+        }
+
+        // A lost connection's buffers are done with; whatever the kernel
+        // still sends out of them will not be decoded anyway.
+        if (zerocopySent && st.st_ino != lostIno) {
+            zerocopyPending[bufferIndex] = true;
+            if (numZerocopyPending++ == 0)
+                lastZerocopyProgress = PerfUtils::Cycles::rdtsc();
+        } else {
+            writeCompleted(bufferIndex);
+        }
+    }
+
+    void
+    poll(bool wait) {
+        if (numZerocopyPending == 0)
+            return;
+
+        const uint64_t timeoutCycles = PerfUtils::Cycles::fromNanoseconds(
+                    1000000*uint64_t(NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS));
+        while (true) {
+            readZerocopyNotifications();
+
+            uint32_t numDone = 0;
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                if (zerocopyPending[i] && static_cast<int32_t>(
+                        lastZerocopyId[i] - zerocopyDoneBelow) < 0) {
+                    zerocopyPending[i] = false;
+                    --numZerocopyPending;
+                    writeCompleted(static_cast<uint32_t>(i));
+                    ++numDone;
+                }
+            }
+
+            uint64_t now = PerfUtils::Cycles::rdtsc();
+            if (numDone > 0)
+                lastZerocopyProgress = now;
+
+            if (numDone > 0 || !wait || numZerocopyPending == 0)
+                return;
+
+            if (now - lastZerocopyProgress > timeoutCycles) {
+                std::lock_guard<std::mutex> lock(streamMutex);
+                connectionLost(zerocopyFd, zerocopyIno, ETIMEDOUT);
+                releaseZerocopyBuffers();
+                return;
+            }
+
+            // The notifications are reported as errors on the socket
+            struct pollfd pfd = {zerocopyFd, 0, 0};
+            ::poll(&pfd, 1, 1);
+        }
+    }
+
+    /**
+     * Decides whether a buffer is sent with MSG_ZEROCOPY and takes over the
+     * zerocopy sends of the connection if no other backend made any yet.
+     * This shall only be invoked with streamMutex held.
+     *
+     * \param fd
+     *      Socket the buffer will be sent on
+     * \param ino
+     *      Inode number of the socket, which tells connections apart even if
+     *      they reuse the same file descriptor
+     *
+     * \return
+     *      true if the buffer should be sent with MSG_ZEROCOPY
+     */
+    bool
+    claimZerocopy(int fd, ino_t ino) {
+#ifdef NANOLOG_HAS_MSG_ZEROCOPY
+        if (ino == zerocopyIno && fd == zerocopyFd)
+            return zerocopyOwner == this && ino != copiedIno;
+
+        // The previous connection's buffers have to come back first
+        if (numZerocopyPending > 0 || ino == copiedIno)
+            return false;
+
+        if (ino == ownedIno && zerocopyOwner != this)
+            return false;
+
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+            copiedIno = ino;
+            return false;
+        }
+
+        zerocopyOwner = this;
+        ownedIno = ino;
+        zerocopyFd = fd;
+        zerocopyIno = ino;
+        nextZerocopyId = zerocopyDoneBelow = 0;
+        zerocopyDoneRanges.clear();
+        return true;
+#else
+        (void)fd;
+        (void)ino;
+        return false;
+#endif
+    }
+
+    /**
+     * Reads the completion notifications of the zerocopy sends off the
+     * socket's error queue, advancing zerocopyDoneBelow.
+     */
+    void
+    readZerocopyNotifications() {
+#ifdef NANOLOG_HAS_MSG_ZEROCOPY
+        while (true) {
+            char control[128];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (recvmsg(zerocopyFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                return;
+
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+                                            cm = CMSG_NXTHDR(&msg, cm)) {
+                bool recvErr = (cm->cmsg_level == SOL_IP &&
+                                cm->cmsg_type == IP_RECVERR) ||
+                               (cm->cmsg_level == SOL_IPV6 &&
+                                cm->cmsg_type == IPV6_RECVERR);
+                if (!recvErr)
+                    continue;
+
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(cm), sizeof(err));
+                if (err.ee_errno != 0 ||
+                        err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
+
+                // Pinning the pages was for nothing if they were copied
+                if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    std::lock_guard<std::mutex> lock(streamMutex);
+                    copiedIno = zerocopyIno;
+                }
+
+                zerocopyDone(err.ee_info, err.ee_data);
+            }
+        }
+#endif
+    }
+
+    /**
+     * Records the zerocopy sends from first to last (inclusive) as done.
+     */
+    void
+    zerocopyDone(uint32_t first, uint32_t last) {
+        if (first != zerocopyDoneBelow) {
+            zerocopyDoneRanges[first] = last;
+            return;
+        }
+
+        zerocopyDoneBelow = last + 1;
+        auto it = zerocopyDoneRanges.find(zerocopyDoneBelow);
+        while (it != zerocopyDoneRanges.end()) {
+            zerocopyDoneBelow = it->second + 1;
+            zerocopyDoneRanges.erase(it);
+            it = zerocopyDoneRanges.find(zerocopyDoneBelow);
+        }
+    }
+
+    /**
+     * Retires the buffers still waiting on the zerocopy sends of a lost
+     * connection.
+     */
+    void
+    releaseZerocopyBuffers() {
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if (zerocopyPending[i]) {
+                zerocopyPending[i] = false;
+                writeCompleted(static_cast<uint32_t>(i));
+            }
+        }
+        numZerocopyPending = 0;
+    }
+
+    /**
+     * Marks a connection as lost and shuts it down, so that the collector
+     * finishes off its file. This shall only be invoked with streamMutex
+     * held.
+     *
+     * \param fd
+     *      Socket of the connection
+     * \param ino
+     *      Inode number of the socket
+     * \param err
+     *      errno describing why
+     */
+    void
+    connectionLost(int fd, ino_t ino, int err) {
+        ++numFailedWrites;
+        if (ino == lostIno)
+            return;
+
+        fprintf(stderr, "NanoLog lost the connection to the log collector "
+                "(%s); output is dropped until it reconnects.\r\n",
+                strerror(err));
+        lostIno = ino;
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    // Serializes the sends of all the backends, and protects the static
+    // members below
+    static std::mutex streamMutex;
+
+    // Backend making the zerocopy sends on the connection with the inode
+    // number ownedIno; nullptr if it's gone
+    static CollectorBackend *zerocopyOwner;
+    static ino_t ownedIno;
+
+    // Inode numbers of the connection last found to copy the zerocopy sends
+    // (or not to support them) and of the connection last lost
+    static ino_t copiedIno;
+    static ino_t lostIno;
+
+    // Socket this backend makes zerocopy sends on and its inode number
+    int zerocopyFd;
+    ino_t zerocopyIno;
+
+    // Number of the next zerocopy send on zerocopyFd; all the sends numbered
+    // below zerocopyDoneBelow are done, and so are the ranges of later sends
+    // in zerocopyDoneRanges (first to last) that were reported out of order
+    uint32_t nextZerocopyId;
+    uint32_t zerocopyDoneBelow;
+    std::map<uint32_t, uint32_t> zerocopyDoneRanges;
+
+    // Number of the last zerocopy send carrying each buffer, and whether the
+    // buffer still waits on it
+    std::vector<uint32_t> lastZerocopyId;
+    std::vector<bool> zerocopyPending;
+    uint32_t numZerocopyPending;
+
+    // rdtsc() when a zerocopy send was last reported done (or made while
+    // none were pending)
+    uint64_t lastZerocopyProgress;
+
+    DISALLOW_COPY_AND_ASSIGN(CollectorBackend);
+};
+
+std::mutex CollectorBackend::streamMutex;
+CollectorBackend *CollectorBackend::zerocopyOwner = nullptr;
+ino_t CollectorBackend::ownedIno = 0;
+ino_t CollectorBackend::copiedIno = 0;
+ino_t CollectorBackend::lostIno = 0;
+
+/**
+ * Creates an OutputBackend for an output engine.
+ *
+ * \param engine
+ *      Kernel interface the backend should use
+ * \param bufferSize
+ *      Byte size of each of the backend's output buffers
+ *
+ * \return
+ *      The backend, or nullptr if the engine is not supported on this system
+ */
+OutputBackend *
+OutputBackend::create(OutputEngine engine, uint32_t bufferSize) {
+    switch (engine) {
+        case POSIX_AIO:
+            return new PosixAioBackend(bufferSize);
+
+        case IO_URING:
+        {
+#ifdef NANOLOG_HAS_IO_URING
+            IoUringBackend *backend = new IoUringBackend(
+                        NanoLogConfig::IO_URING_QUEUE_DEPTH, bufferSize);
+            if (backend->init())
+                return backend;
+
+            delete backend;
+#endif
+            return nullptr;
+        }
+
+        case COLLECTOR:
+            return new CollectorBackend(bufferSize);
+
+        default:
+            return nullptr;
+    }
+}
+
+/**
+ * Returns a human readable name for a block compressor.
+ */
+const char *
+OutputBackend::getBlockCompressionName(BlockCompression compression) {
+    switch (compression) {
+        case BLOCK_COMPRESSION_NONE:
+            return "none";
+        case BLOCK_COMPRESSION_LZ4:
+            return "LZ4";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Returns a human readable name for an output engine.
+ */
+const char *
+OutputBackend::getEngineName(OutputEngine engine) {
+    switch (engine) {
+        case POSIX_AIO:
+            return "POSIX AIO";
+        case IO_URING:
+            return "io_uring";
+        case COLLECTOR:
+            return "log collector";
+        default:
+            return "unknown";
+    }
+}
+
+}; // namespace NanoLogInternal
@@ -0,0 +1,285 @@
+/* Copyright (c) 2016-2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RUNTIME_OUTPUTBACKEND_H
+#define RUNTIME_OUTPUTBACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Common.h"
+#include "NanoLog.h"
+
+namespace NanoLogInternal {
+using namespace NanoLog;
+
+/**
+ * An OutputBackend owns the ring of output buffers a CompressionShard
+ * compresses into and writes the filled buffers to the log file
+ * asynchronously via one of the kernel interfaces in NanoLog::OutputEngine.
+ *
+ * Up to getQueueDepth() buffers can be in flight to the kernel at once, and
+ * one more buffer is always free for the Encoder to fill. The writes of a
+ * backend reach the file in the order they were submitted and their buffers
+ * are recycled in that same order.
+ *
+ * If a block compressor is set (see setBlockCompression()), the buffers
+ * submitted are first compressed by a helper thread owned by the backend and
+ * only handed to the kernel once they are, still in submission order. The
+ * buffers being compressed count as in flight.
+ *
+ * This class is not thread-safe; it should only be used by the compression
+ * thread that owns it.
+ */
+class OutputBackend {
+PUBLIC:
+    static OutputBackend *create(OutputEngine engine, uint32_t bufferSize);
+    static const char *getEngineName(OutputEngine engine);
+    static const char *getBlockCompressionName(BlockCompression compression);
+
+    virtual ~OutputBackend();
+
+    char *submitWrite(int fd, size_t nbytes);
+    uint32_t reapWrites(bool wait);
+    uint32_t waitForAllWrites();
+    void setBlockCompression(BlockCompression compression);
+
+    /**
+     * Returns the buffer that is not in flight and should be filled next.
+     */
+    inline char *
+    getFreeBuffer() {
+        return buffers[nextFreeBuffer];
+    }
+
+    inline uint32_t
+    getBufferSize() const {
+        return bufferSize;
+    }
+
+    inline OutputEngine
+    getEngine() const {
+        return engine;
+    }
+
+    inline uint32_t
+    getQueueDepth() const {
+        return queueDepth;
+    }
+
+    inline uint32_t
+    getNumInFlight() const {
+        return numInFlight;
+    }
+
+    inline BlockCompression
+    getBlockCompression() const {
+        return blockCompression;
+    }
+
+    /**
+     * Returns the number of bytes submitted that went through the block
+     * compressor and have been handed to the kernel.
+     */
+    inline uint64_t
+    getBlockBytesIn() const {
+        return blockBytesIn;
+    }
+
+    /**
+     * Returns the number of bytes the block compressor turned the
+     * getBlockBytesIn() bytes into (including padding).
+     */
+    inline uint64_t
+    getBlockBytesOut() const {
+        return blockBytesOut;
+    }
+
+    /**
+     * Returns the number of cycles the helper thread spent compressing.
+     */
+    inline uint64_t
+    getBlockCyclesCompressing() const {
+        return blockCyclesCompressing;
+    }
+
+    /**
+     * Returns the number of writes that failed (including the ones dropped
+     * by the COLLECTOR engine while its connection was lost).
+     */
+    inline uint64_t
+    getNumFailedWrites() const {
+        return numFailedWrites;
+    }
+
+    /**
+     * Returns the distribution of the time the writes took from submission
+     * until reapWrites() retired them (see NanoLog::Metrics). Since the
+     * completions are only polled for, this is an upper bound on the time the
+     * kernel took.
+     */
+    inline const uint64_t *
+    getWriteLatencyDist() const {
+        return writeLatencyDist;
+    }
+
+    /**
+     * Indicates that all queueDepth writes are in flight, so submitWrite()
+     * cannot be invoked until reapWrites() retires at least one of them.
+     */
+    inline bool
+    isFull() const {
+        return numInFlight == queueDepth;
+    }
+
+PROTECTED:
+    OutputBackend(OutputEngine engine, uint32_t queueDepth,
+                  uint32_t bufferSize);
+
+    /**
+     * Hands the write of a buffer over to the kernel. Implementations must
+     * invoke writeCompleted() once the write finishes (immediately if it
+     * could not be submitted).
+     *
+     * \param bufferIndex
+     *      Index of the buffer to write within buffers
+     * \param fd
+     *      File descriptor to write to
+     * \param nbytes
+     *      Number of bytes at the start of the buffer to write
+     */
+    virtual void submit(uint32_t bufferIndex, int fd, size_t nbytes) = 0;
+
+    /**
+     * Checks for finished writes and invokes writeCompleted() for each.
+     *
+     * \param wait
+     *      true means block until at least one write in flight finishes
+     */
+    virtual void poll(bool wait) = 0;
+
+    void writeCompleted(uint32_t bufferIndex);
+    void handOffCompressedBuffers(bool wait);
+    void compressBuffer(uint32_t bufferIndex);
+    void compressorMain();
+
+    /**
+     * Returns the number of writes that were handed to the kernel and have
+     * not been retired yet.
+     */
+    inline uint32_t
+    getNumInKernel() const {
+        return numInFlight - static_cast<uint32_t>(numBuffersQueued
+                                                    - numBuffersHandedOff);
+    }
+
+    // Kernel interface used by this backend
+    const OutputEngine engine;
+
+    // Maximum number of writes that can be in flight at once
+    const uint32_t queueDepth;
+
+    // Byte size of each of the buffers
+    const uint32_t bufferSize;
+
+    // Ring of queueDepth + 1 output buffers, aligned to 512 bytes for O_DIRECT
+    std::vector<char *> buffers;
+
+    // Marks which of the buffers in flight the kernel is done writing out
+    std::vector<bool> completed;
+
+    // Cycle counter at the time each buffer in flight was submitted
+    std::vector<uint64_t> submitCycles;
+
+    // Index of the buffer that is free to be filled next
+    uint32_t nextFreeBuffer;
+
+    // Index of the oldest buffer in flight (only meaningful if numInFlight > 0)
+    uint32_t oldestInFlight;
+
+    // Number of buffers submitted that have not been retired yet, which
+    // includes the ones waiting on the block compressor
+    uint32_t numInFlight;
+
+    // General purpose compressor the buffers are run through before they are
+    // handed to the kernel
+    BlockCompression blockCompression;
+
+    // Helper thread that compresses the buffers submitted while a block
+    // compressor is set
+    std::thread compressorThread;
+
+    // Protects the fields shared with compressorThread below
+    std::mutex compressorMutex;
+
+    // Signaled when a buffer is queued for compressorThread or it should exit
+    std::condition_variable compressorWork;
+
+    // Signaled when compressorThread finishes compressing a buffer
+    std::condition_variable compressorDone;
+
+    // Flag signaling compressorThread to stop running
+    bool compressorShouldExit;
+
+    // Number of buffers submitted to compressorThread and compressed by it.
+    // The buffers are compressed in the order they were submitted.
+    uint64_t numBuffersQueued;
+    std::atomic<uint64_t> numBuffersCompressed;
+
+    // Number of buffers compressed that were handed to the kernel (only
+    // accessed by the owning thread)
+    uint64_t numBuffersHandedOff;
+
+    // Index of the next buffer to compress (only accessed by
+    // compressorThread) and to hand to the kernel once compressed.
+    uint32_t nextToCompress;
+    uint32_t nextToHandOff;
+
+    // File descriptor each buffer queued for compression is written to
+    std::vector<int> writeFds;
+
+    // Number of bytes submitted for each buffer and the number of bytes to
+    // write for it after compression (set by compressorThread)
+    std::vector<size_t> submittedBytes;
+    std::vector<size_t> compressedBytes;
+
+    // Scratch buffer compressorThread compresses into; nullptr if no block
+    // compressor is set
+    char *compressionBuffer;
+
+    // Metrics: See getBlockBytesIn(), getBlockBytesOut() and
+    // getBlockCyclesCompressing()
+    uint64_t blockBytesIn;
+    uint64_t blockBytesOut;
+    std::atomic<uint64_t> blockCyclesCompressing;
+
+    // Metric: See getNumFailedWrites()
+    uint64_t numFailedWrites;
+
+    // Metric: See getWriteLatencyDist()
+    uint64_t writeLatencyDist[Metrics::NUM_WRITE_LATENCY_BUCKETS];
+
+    DISALLOW_COPY_AND_ASSIGN(OutputBackend);
+};
+
+}; // namespace NanoLogInternal
+
+#endif /* RUNTIME_OUTPUTBACKEND_H */
@@ -19,6 +19,8 @@
 #include <cstring>
 #include <cstdint>
 
+#include <immintrin.h>
+
 #include "Common.h"
 
 #ifndef PACKER_H
@@ -56,6 +58,12 @@
  *      (c) S = [9, 8 + sizeof(T)) => integer was represented in S-8 bytes and
  *                                    a negation was performed on the integer
  *
+ * The pack()-ed values are byte granular and of variable length, so the
+ * values themselves are found/copied one at a time, but without data-dependent
+ * branches (i.e. with a bit scan and fixed width loads/stores). The nibbles,
+ * on the other hand, are summed up 16 or 32 bytes at a time with SSSE3/AVX2
+ * table lookups when the CPU supports them (see getSizeOfPackedValues()).
+ *
  * TODO(syang0) Consider a packing scheme that can encode the special code
  * directly in the stream itself
  *
@@ -76,6 +84,29 @@ struct TwoNibbles {
     uint8_t second:4;
 } __attribute__((packed));
 
+/**
+ * Number of bytes pack() stored a value in, indexed by the special 4-bit code
+ * it returned for the value.
+ */
+static const uint8_t packedSizeOfNibble[16] = {
+    16, 1, 2, 3, 4, 5, 6, 7, 8, 1, 2, 3, 4, 5, 6, 7
+};
+
+/**
+ * Returns the fewest number of bytes needed to represent an unsigned integer.
+ *
+ * \param val
+ *      Integer to find the size of
+ *
+ * \return
+ *      Number of bytes needed to represent the integer (1-8)
+ */
+inline int
+getNumPackedBytes(uint64_t val) {
+    // The OR-ing keeps a 0 at 1 byte and __builtin_clzll()'s result defined
+    return (71 - __builtin_clzll(val | 1)) >> 3;
+}
+
 /**
  * Given an unsigned integer and a char array, find the fewest number of
  * bytes needed to represent the integer, copy that many bytes into the
@@ -93,29 +124,9 @@ template<typename T>
 inline typename std::enable_if<std::is_integral<T>::value &&
                                 !std::is_signed<T>::value, int>::type
 pack(char **buffer, T val) {
-    // Binary search for the smallest container. It is also worth noting that
-    // with -O3, the compiler will strip out extraneous if-statements based on T
-    // For example, if T is uint16_t, it would only leave the t < 1U<<8 check
-
-    //TODO(syang0) Is this too costly vs. a simple for loop?
-    int numBytes;
-    if (val < (1UL << 8)) {
-            numBytes = 1;
-    } else if (val < (1UL << 16)) {
-        numBytes = 2;
-    } else if (val < (1UL << 24)) {
-        numBytes = 3;
-    } else if (val < (1UL << 32)) {
-        numBytes = 4;
-    } else if (val < (1UL << 40)) {
-        numBytes = 5;
-    } else if (val < (1UL << 48)) {
-        numBytes = 6;
-    } else if (val < (1UL << 56)) {
-        numBytes = 7;
-    } else {
-        numBytes = 8;
-    }
+    // A bit scan (rather than a search through if-statements) determines the
+    // smallest container, so there are no mispredicted branches on the value
+    int numBytes = getNumPackedBytes(static_cast<uint64_t>(val));
 
     // Although we store the entire value here, we take advantage of the fact
     // that x86-64 is little-endian (storing the least significant bits first)
@@ -285,6 +296,144 @@ unpack(const char **in, uint8_t packNibble) {
     return result;
 }
 
+/**
+ * Branch-free variant of unpack() for integers that loads the 8 bytes at the
+ * read position (rather than memcpy()-ing a variable number of bytes) and
+ * masks off the ones that belong to the values after it. As such, the caller
+ * must ensure that 8 bytes can be read from the position.
+ *
+ * \param in
+ *      data array pointer to read the data back from and increment.
+ * \param packResult
+ *      special 4-bit code returned from pack()
+ *
+ * \return
+ *      original full-width value before compression
+ */
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value, T>::type
+unpackWide(const char **in, uint8_t packResult)
+{
+    // Integers are never packed into 16 bytes, but handle it as unpack() would
+    if (packResult == 0)
+        return unpack<T>(in, packResult);
+
+    uint32_t bytes = packedSizeOfNibble[packResult];
+    uint64_t negated = (packResult > 8);
+
+    uint64_t packed;
+    memcpy(&packed, *in, sizeof(packed));
+    packed &= ~0ULL >> (64 - 8*bytes);
+    *in += bytes;
+
+    return static_cast<T>((packed ^ (0 - negated)) + negated);
+}
+
+/**
+ * Sums the sizes of the values encoded by 32-byte blocks of nibbles with AVX2
+ * table lookups.
+ *
+ * \param bytes
+ *      Start of the nibbles
+ * \param numBlocks
+ *      Number of 32-byte (i.e. 64 nibble) blocks to process
+ *
+ * \return
+ *      The number of bytes used to encode the values
+ */
+__attribute__((target("avx2")))
+inline static uint32_t
+sumPackedSizesAVX2(const uint8_t *bytes, uint32_t numBlocks)
+{
+    const __m256i table = _mm256_setr_epi8(16, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 1, 2, 3, 4, 5, 6, 7,
+                                           16, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (uint32_t i = 0; i < numBlocks; ++i) {
+        __m256i nibbles = _mm256_loadu_si256(
+                                reinterpret_cast<const __m256i*>(bytes) + i);
+        __m256i first = _mm256_and_si256(nibbles, lowNibbles);
+        __m256i second = _mm256_and_si256(_mm256_srli_epi16(nibbles, 4),
+                                          lowNibbles);
+
+        // Each byte sums to at most 32, so it's safe to add them as bytes
+        __m256i sizes = _mm256_add_epi8(_mm256_shuffle_epi8(table, first),
+                                        _mm256_shuffle_epi8(table, second));
+        sum = _mm256_add_epi64(sum,
+                        _mm256_sad_epu8(sizes, _mm256_setzero_si256()));
+    }
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                                 _mm256_extracti128_si256(sum, 1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si64(
+                            _mm_add_epi64(half, _mm_unpackhi_epi64(half, half))));
+}
+
+/**
+ * Sums the sizes of the values encoded by 16-byte blocks of nibbles with
+ * SSSE3 table lookups.
+ *
+ * \param bytes
+ *      Start of the nibbles
+ * \param numBlocks
+ *      Number of 16-byte (i.e. 32 nibble) blocks to process
+ *
+ * \return
+ *      The number of bytes used to encode the values
+ */
+__attribute__((target("ssse3")))
+inline static uint32_t
+sumPackedSizesSSSE3(const uint8_t *bytes, uint32_t numBlocks)
+{
+    const __m128i table = _mm_setr_epi8(16, 1, 2, 3, 4, 5, 6, 7,
+                                        8, 1, 2, 3, 4, 5, 6, 7);
+    const __m128i lowNibbles = _mm_set1_epi8(0x0F);
+    __m128i sum = _mm_setzero_si128();
+
+    for (uint32_t i = 0; i < numBlocks; ++i) {
+        __m128i nibbles = _mm_loadu_si128(
+                                reinterpret_cast<const __m128i*>(bytes) + i);
+        __m128i first = _mm_and_si128(nibbles, lowNibbles);
+        __m128i second = _mm_and_si128(_mm_srli_epi16(nibbles, 4),
+                                       lowNibbles);
+        __m128i sizes = _mm_add_epi8(_mm_shuffle_epi8(table, first),
+                                     _mm_shuffle_epi8(table, second));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(sizes, _mm_setzero_si128()));
+    }
+
+    return static_cast<uint32_t>(_mm_cvtsi128_si64(
+                                _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum))));
+}
+
+/**
+ * Vector instruction sets getSizeOfPackedValues() can use, in increasing
+ * order of preference.
+ */
+enum VectorExtension {
+    SCALAR = 0,
+    SSSE3 = 1,
+    AVX2 = 2
+};
+
+/**
+ * Returns the best vector instruction set supported by the CPU we run on.
+ */
+inline static VectorExtension
+detectVectorExtension()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return AVX2;
+
+    if (__builtin_cpu_supports("ssse3"))
+        return SSSE3;
+
+    return SCALAR;
+}
+
 /**
  * Given a stream of nibbles, return the total number of bytes used to represent
  * the values encoded with the nibbles.
@@ -300,30 +449,97 @@ unpack(const char **in, uint8_t packNibble) {
 inline static uint32_t
 getSizeOfPackedValues(const TwoNibbles *nibbles, uint32_t numNibbles)
 {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(nibbles);
+    uint32_t numBytes = numNibbles/2;
     uint32_t size = 0;
-    for (uint32_t i = 0; i < numNibbles/2; ++i) {
-        size += nibbles[i].first + nibbles[i].second;
-        if (nibbles[i].first == 0)
-            size += 16;
-        if (nibbles[i].first > 0x8)
-            size -= 8;
-        if (nibbles[i].second == 0)
-            size += 16;
-        if (nibbles[i].second > 0x8)
-            size -= 8;
+    uint32_t i = 0;
+
+    // Most log messages have only a handful of arguments, so the vector
+    // instructions are only worth it for the longer streams
+    if (numBytes >= 16) {
+        static const VectorExtension extension = detectVectorExtension();
+
+        if (extension >= AVX2) {
+            size += sumPackedSizesAVX2(bytes, numBytes/32);
+            i = numBytes & ~31U;
+        }
+
+        if (extension >= SSSE3) {
+            size += sumPackedSizesSSSE3(bytes + i, (numBytes - i)/16);
+            i += (numBytes - i) & ~15U;
+        }
     }
 
-    if (numNibbles & 0x1) {
-        size += nibbles[numNibbles / 2].first;
-        if (nibbles[numNibbles/2].first == 0)
-            size += 16;
-        if (nibbles[numNibbles/2].first > 0x8)
-            size -= 8;
-    }
+    for (; i < numBytes; ++i)
+        size += packedSizeOfNibble[bytes[i] & 0x0F]
+                    + packedSizeOfNibble[bytes[i] >> 4];
+
+    if (numNibbles & 0x1)
+        size += packedSizeOfNibble[nibbles[numBytes].first];
 
     return size;
 }
 
+/**
+ * Packs an array of integers, storing the special codes returned by pack()
+ * for each into a separate stream of nibbles.
+ *
+ * \param[in/out] buffer
+ *      char array pointer used to store the compressed values and bump
+ * \param values
+ *      Integers to pack into the buffer
+ * \param count
+ *      Number of integers to pack
+ * \param[out] nibbles
+ *      Stream to store the (count + 1)/2 bytes of nibbles in
+ */
+template<typename T>
+inline void
+packValues(char **buffer, const T *values, uint32_t count, TwoNibbles *nibbles)
+{
+    uint32_t i = 0;
+    for (; i + 1 < count; i += 2) {
+        nibbles[i/2].first = 0x0f & static_cast<uint8_t>(
+                                                    pack(buffer, values[i]));
+        nibbles[i/2].second = 0x0f & static_cast<uint8_t>(
+                                                pack(buffer, values[i + 1]));
+    }
+
+    if (i < count) {
+        nibbles[i/2].first = 0x0f & static_cast<uint8_t>(
+                                                    pack(buffer, values[i]));
+        nibbles[i/2].second = 0;
+    }
+}
+
+/**
+ * Unpacks an array of integers packed by packValues().
+ *
+ * \param[in/out] in
+ *      data array pointer to read the values back from and increment
+ * \param nibbles
+ *      Stream of nibbles produced by packValues()
+ * \param count
+ *      Number of integers to unpack
+ * \param[out] values
+ *      Array to store the count integers in
+ */
+template<typename T>
+inline void
+unpackValues(const char **in, const TwoNibbles *nibbles, uint32_t count,
+             T *values)
+{
+    const char *end = *in + getSizeOfPackedValues(nibbles, count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t nibble = (i & 0x1) ? nibbles[i/2].second : nibbles[i/2].first;
+        if (*in + sizeof(uint64_t) <= end)
+            values[i] = unpackWide<T>(in, nibble);
+        else
+            values[i] = unpack<T>(in, nibble);
+    }
+}
+
 /**
  * This class takes in a data stream of pack() Nibbles followed by pack()'ed
  * values as produced by the compressor and unpack()'s them one by one.
@@ -381,7 +597,7 @@ public:
         uint8_t nibble = (onFirstNibble) ? nibblePosition->first
                                          : nibblePosition->second;
 
-        T ret = unpack<T>(&currPackedValue, nibble);
+        T ret = unpackNext<T>(nibble);
 
         if (!onFirstNibble)
             ++nibblePosition;
@@ -401,6 +617,26 @@ public:
     getEndOfPackedArguments() {
         return endOfValues;
     }
+
+PRIVATE:
+    /**
+     * Unpacks the next integer in the stream with unpackWide() unless
+     * it's too close to the end of the values to load 8 bytes.
+     */
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value, T>::type
+    unpackNext(uint8_t nibble) {
+        if (currPackedValue + sizeof(uint64_t) <= endOfValues)
+            return unpackWide<T>(&currPackedValue, nibble);
+
+        return unpack<T>(&currPackedValue, nibble);
+    }
+
+    template<typename T>
+    typename std::enable_if<!std::is_integral<T>::value, T>::type
+    unpackNext(uint8_t nibble) {
+        return unpack<T>(&currPackedValue, nibble);
+    }
 };
 } /* BufferUtils */
 
@@ -13,10 +13,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <assert.h>
 #include <cstdlib>
 #include <stdio.h>
 #include <fstream>
+#include <vector>
 
 #include "TestUtil.h"
 #include "Packer.h"
@@ -432,6 +434,121 @@ TEST_F(PackerTest, getSizeOfPackedValues) {
     EXPECT_EQ(84, getSizeOfPackedValues(nibbles, nibbleCntr));
 }
 
+TEST_F(PackerTest, getNumPackedBytes) {
+    EXPECT_EQ(1, getNumPackedBytes(0));
+    EXPECT_EQ(1, getNumPackedBytes(255));
+    EXPECT_EQ(2, getNumPackedBytes(256));
+    EXPECT_EQ(4, getNumPackedBytes((1UL << 32) - 1));
+    EXPECT_EQ(5, getNumPackedBytes(1UL << 32));
+    EXPECT_EQ(7, getNumPackedBytes((1UL << 56) - 1));
+    EXPECT_EQ(8, getNumPackedBytes(1UL << 56));
+    EXPECT_EQ(8, getNumPackedBytes(~0UL));
+}
+
+TEST_F(PackerTest, getSizeOfPackedValues_vectorized) {
+    // Reference implementation: the one nibble at a time definition
+    auto expectedSize = [](const TwoNibbles *nibbles, uint32_t numNibbles) {
+        uint32_t size = 0;
+        for (uint32_t i = 0; i < numNibbles; ++i) {
+            uint8_t nibble = (i & 1) ? nibbles[i/2].second : nibbles[i/2].first;
+            if (nibble == 0)
+                size += 16;
+            else if (nibble > 8)
+                size += nibble - 8;
+            else
+                size += nibble;
+        }
+        return size;
+    };
+
+    TwoNibbles nibbles[256];
+    srand(0);
+    for (int i = 0; i < 256; ++i) {
+        nibbles[i].first = rand() & 0x0F;
+        nibbles[i].second = rand() & 0x0F;
+    }
+
+    // Cover all of the cut-offs between the AVX2, SSSE3 and scalar paths
+    for (uint32_t numNibbles = 0; numNibbles <= 512; ++numNibbles) {
+        ASSERT_EQ(expectedSize(nibbles, numNibbles),
+                  getSizeOfPackedValues(nibbles, numNibbles))
+                  << "numNibbles=" << numNibbles;
+    }
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t*>(nibbles);
+    if (detectVectorExtension() >= SSSE3) {
+        EXPECT_EQ(0U, sumPackedSizesSSSE3(bytes, 0));
+        EXPECT_EQ(expectedSize(nibbles, 32), sumPackedSizesSSSE3(bytes, 1));
+        EXPECT_EQ(expectedSize(nibbles, 512), sumPackedSizesSSSE3(bytes, 16));
+    }
+
+    if (detectVectorExtension() >= AVX2) {
+        EXPECT_EQ(0U, sumPackedSizesAVX2(bytes, 0));
+        EXPECT_EQ(expectedSize(nibbles, 64), sumPackedSizesAVX2(bytes, 1));
+        EXPECT_EQ(expectedSize(nibbles, 512), sumPackedSizesAVX2(bytes, 8));
+    }
+
+    // All nibbles being 0 is the worst case for the byte sized partial sums
+    memset(nibbles, 0, sizeof(nibbles));
+    EXPECT_EQ(512U*16, getSizeOfPackedValues(nibbles, 512));
+}
+
+TEST_F(PackerTest, unpackWide) {
+    char *buffer = buffer_space;
+    int nibbles[] = {
+        pack(&buffer, int64_t(-1)),
+        pack(&buffer, uint64_t(1UL << 40)),
+        pack(&buffer, int32_t(-(1 << 20))),
+        pack(&buffer, uint64_t(~0UL)),
+        pack(&buffer, int64_t(1)),
+    };
+    memset(buffer, 0xFF, 8);
+
+    const char *readPtr = buffer_space;
+    EXPECT_EQ(-1, unpackWide<int64_t>(&readPtr, nibbles[0]));
+    EXPECT_EQ(1UL << 40, unpackWide<uint64_t>(&readPtr, nibbles[1]));
+    EXPECT_EQ(-(1 << 20), unpackWide<int>(&readPtr, nibbles[2]));
+    EXPECT_EQ(~0UL, unpackWide<uint64_t>(&readPtr, nibbles[3]));
+    EXPECT_EQ(1, unpackWide<int64_t>(&readPtr, nibbles[4]));
+    EXPECT_EQ(buffer, readPtr);
+}
+
+TEST_F(PackerTest, packValues) {
+    std::vector<int64_t> values;
+    for (int i = 0; i < 63; ++i) {
+        int64_t value = 1LL << i;
+        values.push_back((i % 3 == 0) ? -value : value);
+    }
+    values.push_back(0);
+    values.push_back(-1);
+
+    for (uint32_t count : {0U, 1U, 2U, 7U, 65U}) {
+        TwoNibbles nibbles[33];
+        char *buffer = buffer_space;
+        packValues(&buffer, values.data(), count, nibbles);
+
+        // Same format as pack()-ing the values one by one
+        char reference[1024];
+        char *referencePos = reference;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint8_t nibble = (i & 1) ? nibbles[i/2].second : nibbles[i/2].first;
+            EXPECT_EQ(nibble,
+                      0x0f & pack(&referencePos, values[i]));
+        }
+        ASSERT_EQ(referencePos - reference, buffer - buffer_space);
+        EXPECT_EQ(0, memcmp(reference, buffer_space, buffer - buffer_space));
+        EXPECT_EQ(uint32_t(buffer - buffer_space),
+                  getSizeOfPackedValues(nibbles, count));
+
+        std::vector<int64_t> unpacked(count);
+        const char *readPtr = buffer_space;
+        unpackValues(&readPtr, nibbles, count, unpacked.data());
+        EXPECT_EQ(buffer, readPtr);
+        EXPECT_TRUE(std::equal(unpacked.begin(), unpacked.end(),
+                               values.begin()));
+    }
+}
+
 TEST_F(PackerTest, nibbler) {
     BufferUtils::TwoNibbles nibbles[1000];
     char backing_buffer[1024];
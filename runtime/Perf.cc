@@ -36,6 +36,7 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <vector>
 #include <thread>
 
 #include <unistd.h>
@@ -404,6 +405,131 @@ double compressLinearSearch() {
     return Cycles::toSeconds(stop - start)/count;
 }
 
+double compressBitScan() {
+    const int count = 1000000;
+    uint64_t *buffer = static_cast<uint64_t*>(malloc(count*sizeof(uint64_t)));
+
+    srand(0);
+    for (int i = 0; i < count; i++) {
+        buffer[i] = 1UL << (rand()%64);
+    }
+
+    int sumOfBytes = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; ++i) {
+        sumOfBytes += BufferUtils::getNumPackedBytes(buffer[i]);
+    }
+    uint64_t stop = Cycles::rdtsc();
+
+    discard(&sumOfBytes);
+
+    free(buffer);
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+// Fills a buffer with count pack()-ed values of random sizes and returns
+// the nibbles describing them
+static std::vector<BufferUtils::TwoNibbles>
+packRandomValues(char *buffer, uint32_t count) {
+    std::vector<int64_t> values(count);
+    srand(0);
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = static_cast<int64_t>(1UL << (rand()%60));
+        if (rand() % 2)
+            values[i] = -values[i];
+    }
+
+    std::vector<BufferUtils::TwoNibbles> nibbles((count + 1)/2);
+    BufferUtils::packValues(&buffer, values.data(), count, nibbles.data());
+    return nibbles;
+}
+
+// Sums nibbles the way getSizeOfPackedValues() did before it was vectorized
+static uint32_t
+getSizeOfPackedValuesBranchy(const BufferUtils::TwoNibbles *nibbles,
+                             uint32_t numNibbles) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < numNibbles/2; ++i) {
+        size += nibbles[i].first + nibbles[i].second;
+        if (nibbles[i].first == 0)
+            size += 16;
+        if (nibbles[i].first > 0x8)
+            size -= 8;
+        if (nibbles[i].second == 0)
+            size += 16;
+        if (nibbles[i].second > 0x8)
+            size -= 8;
+    }
+
+    return size;
+}
+
+double sizeOfPackedValuesHelper(bool vectorized) {
+    const int count = 100000;
+    const uint32_t numNibbles = 64;
+    std::vector<char> buffer(numNibbles*sizeof(uint64_t));
+    std::vector<BufferUtils::TwoNibbles> nibbles =
+                            packRandomValues(buffer.data(), numNibbles);
+
+    uint64_t sumOfBytes = 0;
+    uint64_t start = Cycles::rdtsc();
+    for (int i = 0; i < count; ++i) {
+        // Vary the stream a bit so the loop can't be hoisted
+        nibbles[i % nibbles.size()].first = 1 + (i & 0x7);
+        if (vectorized)
+            sumOfBytes += BufferUtils::getSizeOfPackedValues(nibbles.data(),
+                                                             numNibbles);
+        else
+            sumOfBytes += getSizeOfPackedValuesBranchy(nibbles.data(),
+                                                       numNibbles);
+    }
+    uint64_t stop = Cycles::rdtsc();
+
+    discard(&sumOfBytes);
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+double sizeOfPackedValuesBranchy() {
+    return sizeOfPackedValuesHelper(false);
+}
+
+double sizeOfPackedValues() {
+    return sizeOfPackedValuesHelper(true);
+}
+
+double unpackHelper(bool batched) {
+    const uint32_t count = 1000000;
+    std::vector<char> buffer(count*sizeof(uint64_t));
+    std::vector<BufferUtils::TwoNibbles> nibbles =
+                                    packRandomValues(buffer.data(), count);
+    std::vector<int64_t> values(count);
+
+    const char *readPos = buffer.data();
+    uint64_t start = Cycles::rdtsc();
+    if (batched) {
+        BufferUtils::unpackValues(&readPos, nibbles.data(), count,
+                                  values.data());
+    } else {
+        for (uint32_t i = 0; i < count; ++i) {
+            uint8_t nibble = (i & 0x1) ? nibbles[i/2].second
+                                       : nibbles[i/2].first;
+            values[i] = BufferUtils::unpack<int64_t>(&readPos, nibble);
+        }
+    }
+    uint64_t stop = Cycles::rdtsc();
+
+    discard(values.data());
+    return Cycles::toSeconds(stop - start)/count;
+}
+
+double unpackIndividually() {
+    return unpackHelper(false);
+}
+
+double unpackValues() {
+    return unpackHelper(true);
+}
+
 double delayInBenchmark() {
     int count = 1000000;
     uint64_t x = 0;
@@ -1238,6 +1364,8 @@ TestInfo tests[] = {
      "Compress 1M uint64_t's via binary searching if-statements"},
     {"compressLinearSearch", compressLinearSearch,
      "Compress 1M uint64_t's via linear searching for-loop"},
+    {"compressBitScan", compressBitScan,
+     "Compress 1M uint64_t's via a bit scan"},
     {"delayInBenchmark", delayInBenchmark,
      "Taking an addition, modulo, and rdtsc()"},
     {"div32", div32,
@@ -1300,6 +1428,10 @@ TestInfo tests[] = {
      "cost of an rdtsc call"},
     {"rdtscp", rdtscp_test,
      "cost of an rdtscp call"},
+    {"sizeOfPackedValuesBranchy", sizeOfPackedValuesBranchy,
+     "Sum 64 nibbles one at a time with if-statements"},
+    {"sizeOfPackedValues", sizeOfPackedValues,
+     "Sum 64 nibbles with getSizeOfPackedValues()"},
     {"sched_getcpu", sched_getcpu_test,
      "Cost of sched_getcpu"},
     {"snprintfFileLocation", snprintfFileLocation,
@@ -1316,6 +1448,10 @@ TestInfo tests[] = {
      "snprintf the current time formatted using strftime %y/%m/%d %H:%M:%S"},
     {"strftime_wConversion", printTime_strftime_wConversion,
      "snprintf the current time formatted using strftime with tm conversion"},
+    {"unpackIndividually", unpackIndividually,
+     "Unpack 1M int64_t's one at a time with unpack()"},
+    {"unpackValues", unpackValues,
+     "Unpack 1M int64_t's with unpackValues()"},
     {"rdtscTest", rdtscTest,
      "Read the fine-grain cycle counter"},
     {"high_resolution_clock", high_resolution_clockTest,
@@ -14,14 +14,25 @@
  */
 
 
+#include <chrono>
+#include <cstring>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <iosfwd>
 #include <iostream>
 #include <locale>
+#include <pthread.h>
 #include <sstream>
 #include <string>
 #include <stdlib.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "Cycles.h"         /* Cycles::rdtsc() */
 #include "RuntimeLogger.h"
@@ -35,41 +46,93 @@ __thread RuntimeLogger::StagingBuffer *RuntimeLogger::stagingBuffer = nullptr;
 thread_local RuntimeLogger::StagingBufferDestroyer RuntimeLogger::sbc;
 RuntimeLogger RuntimeLogger::nanoLogSingleton;
 
+// Offset of the StagingBuffer object within its crash recovery file, which is
+// the RecoveryBufferHeader rounded up to a cache line
+static const size_t RECOVERY_FILE_OBJECT_OFFSET =
+        (sizeof(Log::RecoveryBufferHeader) + Util::BYTES_PER_CACHE_LINE - 1) &
+        ~(Util::BYTES_PER_CACHE_LINE - 1);
+
 // RuntimeLogger constructor
 RuntimeLogger::RuntimeLogger()
-        : threadBuffers()
+        : shards()
         , nextBufferId()
         , bufferMutex()
-        , compressionThread()
-        , hasOutstandingOperation(false)
+        , numaLocalStagingBuffers(NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS)
+        , hugePageStagingBuffers(NanoLogConfig::STAGING_BUFFER_HUGE_PAGES)
+        , mirroredStagingBuffers(NanoLogConfig::MIRRORED_STAGING_BUFFERS)
+        , compressionThreadsPinned(false)
+        , compressionThreadCpus()
+        , defaultCpuAffinity()
+        , stagingBufferPool()
+        , stagingBufferPoolMutex()
+        , numStagingBuffersReused(0)
+        , compressionAgentEnabled(false)
+        , agentBuffers()
         , compressionThreadShouldExit(false)
-        , syncRequested(false)
+        , syncGeneration(0)
+        , checkpointPersisted(false)
         , condMutex()
         , workAdded()
         , hintQueueEmptied()
+        , compressionThreadsParked(false)
+        , priorityLogGeneration(0)
         , outputFd(-1)
-        , aioCb()
-        , compressingBuffer(nullptr)
-        , outputDoubleBuffer(nullptr)
+        , logFilePath(NanoLogConfig::DEFAULT_LOG_FILE)
+        , rotationMaxBytes(0)
+        , rotationMaxAgeCycles(0)
+        , rotationRequested(false)
+        , logFileGeneration(0)
+        , logFileBytesSubmitted(0)
+        , nextRotationSizeCheck(0)
+        , logFileOpenCycles(0)
+        , rotationMutex()
+        , retiringFd(-1)
+        , retiringFdUsers(0)
+        , numLogFilesRotated(0)
+        , logCollectorAddr()
+        , logCollectorAddrLen(0)
+        , logCollectorName()
+        , fileOutputEngine(OutputEngine::POSIX_AIO)
+        , logCollectorLost(false)
+        , pendingCollectorFd(-1)
+        , nextCollectorConnectCycles(0)
+        , collectorBackoffUs(0)
+        , numLogCollectorConnections(0)
         , currentLogLevel(NOTICE)
-        , cycleAtThreadStart(0)
-        , cyclesActive(0)
-        , cyclesCompressing(0)
-        , stagingBufferPeekDist()
-        , cyclesScanningAndCompressing(0)
-        , cyclesDiskIO_upperBound(0)
-        , totalBytesRead(0)
-        , totalBytesWritten(0)
-        , padBytesWritten(0)
-        , logsProcessed(0)
-        , numAioWritesCompleted(0)
-        , coreId(-1)
-        , registrationMutex()
+        , logSites()
+        , logSiteRules()
+        , logSiteIndexes()
+        , logSiteMutex()
+        , logIdRulesSet(false)
+        , currentOverflowPolicy(OverflowPolicy::BLOCK)
+        , priorityLogLevel(WARNING)
+        , syncPriorityLogs(false)
+        , stagingBufferSize(NanoLogConfig::STAGING_BUFFER_SIZE)
+        , outputBufferSize(NanoLogConfig::OUTPUT_BUFFER_SIZE)
+        , outputEngine(OutputEngine::POSIX_AIO)
+        , blockCompression(BLOCK_COMPRESSION_NONE)
         , invocationSites()
-        , nextInvocationIndexToBePersisted(0)
+        , crashRecoveryPrefix()
+        , crashRecoveryFd(-1)
+        , crashRecoveryMutex()
+        , metricsExporterThread()
+        , metricsExporter()
+        , metricsExportIntervalMs(0)
+        , metricsExporterConfigMutex()
+        , metricsExporterMutex()
+        , metricsExporterWakeup()
+        , metricsExporterShouldExit(false)
+        , coarseTimestampLeadingSpacer()
+        , coarseTimestamp(0)
+        , coarseTimestampTrailingSpacer()
 {
-    for (size_t i = 0; i < Util::arraySize(stagingBufferPeekDist); ++i)
-        stagingBufferPeekDist[i] = 0;
+    CPU_ZERO(&compressionThreadCpus);
+    if (sched_getaffinity(0, sizeof(defaultCpuAffinity),
+                          &defaultCpuAffinity) != 0) {
+        CPU_ZERO(&defaultCpuAffinity);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &defaultCpuAffinity);
+    }
 
     const char *filename = NanoLogConfig::DEFAULT_LOG_FILE;
     outputFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
@@ -81,58 +144,296 @@ RuntimeLogger::RuntimeLogger()
         std::exit(-1);
     }
 
-    memset(&aioCb, 0, sizeof(aioCb));
-
-    int err = posix_memalign(reinterpret_cast<void **>(&compressingBuffer),
-                             512, NanoLogConfig::OUTPUT_BUFFER_SIZE);
-    if (err) {
-        perror("The NanoLog system was not able to allocate enough memory "
-                       "to support its operations. Quitting...\r\n");
-        std::exit(-1);
-    }
-
-    err = posix_memalign(reinterpret_cast<void **>(&outputDoubleBuffer),
-                         512, NanoLogConfig::OUTPUT_BUFFER_SIZE);
-    if (err) {
-        perror("The NanoLog system was not able to allocate enough memory "
-                       "to support its operations. Quitting...\r\n");
-        std::exit(-1);
-    }
+    uint32_t numShards = std::max(1U, NanoLogConfig::NUM_COMPRESSION_THREADS);
+    for (uint32_t i = 0; i < numShards; ++i)
+        shards.push_back(new CompressionShard(i, outputBufferSize,
+                                              outputEngine, blockCompression));
 
-#ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
-    compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
-#endif
+    startCompressionThreads(true);
 }
 
 // RuntimeLogger destructor
 RuntimeLogger::~RuntimeLogger() {
+    setMetricsExporter_internal(nullptr, 0);
     sync();
+    stopCompressionThreads();
+
+    // Free all the data structures. The StagingBuffers of threads that may
+    // still be running stay mapped, but their crash recovery files go away
+    // with the dictionary since everything they logged is persisted.
+    for (CompressionShard *shard : shards) {
+        for (StagingBuffer *sb : shard->threadBuffers) {
+            if (sb->recoveryFileBytes > 0)
+                unlink(sb->recoveryFile.c_str());
+        }
+        delete shard;
+    }
+    shards.clear();
+
+    for (StagingBuffer *sb : stagingBufferPool)
+        freeStagingBuffer(sb);
+    stagingBufferPool.clear();
+
+    // The compression agent finishes up the buffers it hasn't drained after
+    // the process is gone, which takes the dictionary as well
+    bool agentDrained = true;
+    for (StagingBuffer *sb : agentBuffers) {
+        if (sb->persistedPos == sb->producerPos)
+            unlink(sb->recoveryFile.c_str());
+        else
+            agentDrained = false;
+    }
+    agentBuffers.clear();
+
+    if (agentDrained) {
+        setCrashRecoveryDirectory_internal(nullptr);
+    } else {
+        std::lock_guard<std::mutex> lock(crashRecoveryMutex);
+        int fd = crashRecoveryFd.exchange(-1);
+        if (fd >= 0)
+            close(fd);
+        fprintf(stderr, "NanoLog left the log messages the compression agent "
+                "has not compressed yet in \"%s.*\".\r\n",
+                crashRecoveryPrefix.c_str());
+    }
 
-    // Stop the compression thread
-    {
-        std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
-        nanoLogSingleton.compressionThreadShouldExit = true;
-        nanoLogSingleton.workAdded.notify_all();
+    if (outputFd > 0)
+        close(outputFd);
+
+    outputFd = 0;
+
+    if (pendingCollectorFd >= 0)
+        close(pendingCollectorFd);
+}
+
+/**
+ * CompressionShard constructor; allocates the output buffers for the shard
+ * but does not start its compression thread.
+ *
+ * \param shardId
+ *      Index of the shard within RuntimeLogger::shards
+ * \param bufferSize
+ *      Byte size of each of the output buffers
+ * \param engine
+ *      Output engine used to write the output buffers; POSIX AIO is used
+ *      instead if the engine is not supported
+ * \param compression
+ *      Block compressor the output buffers are run through
+ */
+RuntimeLogger::CompressionShard::CompressionShard(uint32_t shardId,
+                                                  uint32_t bufferSize,
+                                                  OutputEngine engine,
+                                                  BlockCompression compression)
+    : id(shardId)
+    , threadBuffers()
+    , bufferMutex()
+    , persistedCallbacks()
+    , outputMutex()
+    , compressionThread()
+    , output(nullptr)
+    , nextInvocationIndexToBePersisted(0)
+    , logFd(-1)
+    , logFileGeneration(0)
+    , syncGenerationSeen(0)
+    , syncGenerationCompleted(0)
+    , cycleAtThreadStart(0)
+    , cyclesActive(0)
+    , cyclesCompressing(0)
+    , stagingBufferPeekDist()
+    , cyclesScanningAndCompressing(0)
+    , cyclesDiskIO_upperBound(0)
+    , totalBytesRead(0)
+    , totalBytesWritten(0)
+    , padBytesWritten(0)
+    , blockBytesIn(0)
+    , blockBytesOut(0)
+    , blockCyclesCompressing(0)
+    , logsProcessed(0)
+    , numWritesSubmitted(0)
+    , numWritesCompleted(0)
+    , passStarts()
+    , pendingPersistedUpTo()
+    , persistedUpTo(0)
+    , numWritesFailed(0)
+    , numWriteFailuresSeen(0)
+    , writeLatencyDist()
+    , cyclesIdleSpinning(0)
+    , cyclesIdleBackingOff(0)
+    , cyclesIdleParked(0)
+    , numTimesParked(0)
+    , priorityLogGenerationSeen(0)
+    , numPriorityWrites(0)
+    , numPrioritySyncs(0)
+    , numLogsDroppedRetired(0)
+    , outputQueueDepthSum(0)
+    , maxOutputQueueDepth(0)
+    , cyclesSubmittingWrites(0)
+    , maxCyclesSubmittingWrite(0)
+    , coreId(-1)
+{
+    for (size_t i = 0; i < Util::arraySize(stagingBufferPeekDist); ++i)
+        stagingBufferPeekDist[i] = 0;
+
+    if (!allocateOutputBuffers(bufferSize, engine, compression))
+        allocateOutputBuffers(bufferSize, OutputEngine::POSIX_AIO,
+                              compression);
+}
+
+/**
+ * (Re)allocates the shard's output buffers together with the OutputBackend
+ * that writes them, discarding the contents of the previous buffers. The
+ * compression thread must be stopped and the shard's output persisted before
+ * invoking this function.
+ *
+ * \param bufferSize
+ *      Byte size of each of the output buffers
+ * \param engine
+ *      Output engine used to write the output buffers
+ * \param compression
+ *      Block compressor the output buffers are run through
+ *
+ * \return
+ *      true if successful; false if the engine is not supported, in which
+ *      case the previous buffers are kept
+ */
+bool
+RuntimeLogger::CompressionShard::allocateOutputBuffers(uint32_t bufferSize,
+                                                   OutputEngine engine,
+                                                   BlockCompression compression)
+{
+    assert(!compressionThread.joinable());
+    assert(output == nullptr || output->getNumInFlight() == 0);
+
+    // Free the old buffers first so that both sets are never held at once
+    uint32_t oldBufferSize = (output) ? output->getBufferSize() : 0;
+    OutputEngine oldEngine = (output) ? output->getEngine() : POSIX_AIO;
+    std::lock_guard<std::mutex> lock(outputMutex);
+    if (output) {
+        blockBytesIn += output->getBlockBytesIn();
+        blockBytesOut += output->getBlockBytesOut();
+        blockCyclesCompressing += output->getBlockCyclesCompressing();
+        numWritesFailed += output->getNumFailedWrites();
+        numWriteFailuresSeen = 0;
+
+        const uint64_t *dist = output->getWriteLatencyDist();
+        for (uint32_t i = 0; i < Metrics::NUM_WRITE_LATENCY_BUCKETS; ++i)
+            writeLatencyDist[i] += dist[i];
     }
+    delete output;
 
-    if (nanoLogSingleton.compressionThread.joinable())
-        nanoLogSingleton.compressionThread.join();
+    output = OutputBackend::create(engine, bufferSize);
+    bool created = (output != nullptr);
+    if (!created && oldBufferSize != 0)
+        output = OutputBackend::create(oldEngine, oldBufferSize);
 
-    // Free all the data structures
-    if (compressingBuffer) {
-        free(compressingBuffer);
-        compressingBuffer = nullptr;
+    if (output != nullptr)
+        output->setBlockCompression(compression);
+
+    return created;
+}
+
+// CompressionShard destructor; the compression thread must be stopped first.
+RuntimeLogger::CompressionShard::~CompressionShard() {
+    assert(!compressionThread.joinable());
+
+    if (output) {
+        delete output;
+        output = nullptr;
+    }
+}
+
+/**
+ * Records the start of a pass of the compression thread's round-robin order
+ * through the threadBuffers. A log message that's in a StagingBuffer when
+ * a pass starts has been compressed by the end of the next pass (the first
+ * peek stops at the end of a plain ring), so persistedUpTo can move up to
+ * the start of the previous pass once the output so far is written out.
+ *
+ * \param timestamp
+ *      rdtsc() at the start of the pass
+ * \param outputPending
+ *      Indicates that the current output buffer holds log messages that
+ *      have yet to be submitted for writing
+ */
+void
+RuntimeLogger::CompressionShard::startPass(uint64_t timestamp,
+                                           bool outputPending)
+{
+    uint32_t writeNumber = numWritesSubmitted + (outputPending ? 1 : 0);
+    if (passStarts[1] != 0) {
+        if (!pendingPersistedUpTo.empty() &&
+                pendingPersistedUpTo.back().first == writeNumber)
+            pendingPersistedUpTo.back().second = passStarts[1];
+        else
+            pendingPersistedUpTo.emplace_back(writeNumber, passStarts[1]);
     }
 
-    if (outputDoubleBuffer) {
-        free(outputDoubleBuffer);
-        outputDoubleBuffer = nullptr;
+    passStarts[1] = passStarts[0];
+    passStarts[0] = timestamp;
+}
+
+/**
+ * Moves persistedUpTo up to the latest value recorded by startPass() whose
+ * write has completed.
+ */
+void
+RuntimeLogger::CompressionShard::updatePersistedUpTo()
+{
+    uint64_t upTo = 0;
+    while (!pendingPersistedUpTo.empty() &&
+            pendingPersistedUpTo.front().first <= numWritesCompleted) {
+        upTo = pendingPersistedUpTo.front().second;
+        pendingPersistedUpTo.pop_front();
     }
 
-    if (outputFd > 0)
-        close(outputFd);
+    if (upTo != 0)
+        persistedUpTo.store(upTo, std::memory_order_release);
+}
 
-    outputFd = 0;
+/**
+ * Folds the metrics of another (retiring) shard into this one so that
+ * getStats() remains cumulative when the number of shards shrinks.
+ *
+ * \param other
+ *      Shard whose metrics should be added to this one
+ */
+void
+RuntimeLogger::CompressionShard::absorbMetrics(const CompressionShard &other)
+{
+    cyclesActive += other.cyclesActive;
+    cyclesCompressing += other.cyclesCompressing;
+    for (size_t i = 0; i < Util::arraySize(stagingBufferPeekDist); ++i)
+        stagingBufferPeekDist[i] += other.stagingBufferPeekDist[i];
+    cyclesScanningAndCompressing += other.cyclesScanningAndCompressing;
+    cyclesDiskIO_upperBound += other.cyclesDiskIO_upperBound;
+    totalBytesRead += other.totalBytesRead;
+    totalBytesWritten += other.totalBytesWritten;
+    padBytesWritten += other.padBytesWritten;
+    blockBytesIn += other.blockBytesIn + other.output->getBlockBytesIn();
+    blockBytesOut += other.blockBytesOut + other.output->getBlockBytesOut();
+    blockCyclesCompressing += other.blockCyclesCompressing +
+                                    other.output->getBlockCyclesCompressing();
+    logsProcessed += other.logsProcessed;
+    numWritesSubmitted += other.numWritesSubmitted;
+    numWritesCompleted += other.numWritesCompleted;
+    numWritesFailed += other.numWritesFailed
+                                    + other.output->getNumFailedWrites();
+    for (uint32_t i = 0; i < Metrics::NUM_WRITE_LATENCY_BUCKETS; ++i)
+        writeLatencyDist[i] += other.writeLatencyDist[i]
+                                    + other.output->getWriteLatencyDist()[i];
+    cyclesIdleSpinning += other.cyclesIdleSpinning;
+    cyclesIdleBackingOff += other.cyclesIdleBackingOff;
+    cyclesIdleParked += other.cyclesIdleParked;
+    numTimesParked += other.numTimesParked;
+    numPriorityWrites += other.numPriorityWrites;
+    numPrioritySyncs += other.numPrioritySyncs;
+    numLogsDroppedRetired += other.numLogsDroppedRetired;
+    outputQueueDepthSum += other.outputQueueDepthSum;
+    maxOutputQueueDepth = std::max(maxOutputQueueDepth,
+                                   other.maxOutputQueueDepth);
+    cyclesSubmittingWrites += other.cyclesSubmittingWrites;
+    maxCyclesSubmittingWrite = std::max(maxCyclesSubmittingWrite,
+                                        other.maxCyclesSubmittingWrite);
 }
 
 // Documentation in NanoLog.h
@@ -144,27 +445,71 @@ RuntimeLogger::getStats() {
     uint64_t start = PerfUtils::Cycles::rdtsc();
     fdatasync(nanoLogSingleton.outputFd);
     uint64_t stop = PerfUtils::Cycles::rdtsc();
-    nanoLogSingleton.cyclesDiskIO_upperBound += (stop - start);
+    nanoLogSingleton.shards.at(0)->cyclesDiskIO_upperBound += (stop - start);
+
+    // Aggregate the metrics across the shards
+    uint64_t cyclesDiskIO_upperBound = 0, cyclesCompressing = 0;
+    uint64_t cyclesActive = 0, cyclesAlive = 0;
+    uint64_t totalBytesWritten = 0, totalBytesRead = 0, padBytesWritten = 0;
+    uint64_t logsProcessed = 0;
+    uint32_t numWritesSubmitted = 0, numWritesCompleted = 0;
+    uint64_t numWritesFailed = 0;
+    uint64_t outputQueueDepthSum = 0, cyclesSubmittingWrites = 0;
+    uint64_t maxCyclesSubmittingWrite = 0;
+    uint32_t maxOutputQueueDepth = 0;
+    uint64_t cyclesIdleSpinning = 0, cyclesIdleBackingOff = 0;
+    uint64_t cyclesIdleParked = 0, numTimesParked = 0;
+    uint64_t numPriorityWrites = 0, numPrioritySyncs = 0;
+    uint64_t blockBytesIn = 0, blockBytesOut = 0, blockCyclesCompressing = 0;
+    uint32_t numShards = getCompressionThreads();
+    for (CompressionShard *shard : nanoLogSingleton.shards) {
+        cyclesDiskIO_upperBound += shard->cyclesDiskIO_upperBound;
+        cyclesCompressing += shard->cyclesCompressing;
+        cyclesActive += shard->cyclesActive;
+        totalBytesWritten += shard->totalBytesWritten;
+        totalBytesRead += shard->totalBytesRead;
+        padBytesWritten += shard->padBytesWritten;
+        blockBytesIn += shard->blockBytesIn + shard->output->getBlockBytesIn();
+        blockBytesOut += shard->blockBytesOut
+                                    + shard->output->getBlockBytesOut();
+        blockCyclesCompressing += shard->blockCyclesCompressing
+                                + shard->output->getBlockCyclesCompressing();
+        logsProcessed += shard->logsProcessed;
+        numWritesSubmitted += shard->numWritesSubmitted;
+        numWritesCompleted += shard->numWritesCompleted;
+        numWritesFailed += shard->numWritesFailed
+                                    + shard->output->getNumFailedWrites();
+        cyclesIdleSpinning += shard->cyclesIdleSpinning;
+        cyclesIdleBackingOff += shard->cyclesIdleBackingOff;
+        cyclesIdleParked += shard->cyclesIdleParked;
+        numTimesParked += shard->numTimesParked;
+        numPriorityWrites += shard->numPriorityWrites;
+        numPrioritySyncs += shard->numPrioritySyncs;
+        outputQueueDepthSum += shard->outputQueueDepthSum;
+        maxOutputQueueDepth = std::max(maxOutputQueueDepth,
+                                       shard->maxOutputQueueDepth);
+        cyclesSubmittingWrites += shard->cyclesSubmittingWrites;
+        maxCyclesSubmittingWrite = std::max(maxCyclesSubmittingWrite,
+                                            shard->maxCyclesSubmittingWrite);
+
+        if (shard->cycleAtThreadStart != 0)
+            cyclesAlive += PerfUtils::Cycles::rdtsc()
+                                                - shard->cycleAtThreadStart;
+    }
 
-    double outputTime =
-            PerfUtils::Cycles::toSeconds(nanoLogSingleton.cyclesDiskIO_upperBound);
-    double compressTime =
-            PerfUtils::Cycles::toSeconds(nanoLogSingleton.cyclesCompressing);
+    double outputTime = PerfUtils::Cycles::toSeconds(cyclesDiskIO_upperBound);
+    double compressTime = PerfUtils::Cycles::toSeconds(cyclesCompressing);
     double workTime = outputTime + compressTime;
 
-    double totalBytesWrittenDouble = static_cast<double>(
-            nanoLogSingleton.totalBytesWritten);
-    double totalBytesReadDouble = static_cast<double>(
-            nanoLogSingleton.totalBytesRead);
-    double padBytesWrittenDouble = static_cast<double>(
-            nanoLogSingleton.padBytesWritten);
-    double numEventsProcessedDouble = static_cast<double>(
-            nanoLogSingleton.logsProcessed);
+    double totalBytesWrittenDouble = static_cast<double>(totalBytesWritten);
+    double totalBytesReadDouble = static_cast<double>(totalBytesRead);
+    double padBytesWrittenDouble = static_cast<double>(padBytesWritten);
+    double numEventsProcessedDouble = static_cast<double>(logsProcessed);
 
     snprintf(buffer, 1024,
                "\r\nWrote %lu events (%0.2lf MB) in %0.3lf seconds "
                    "(%0.3lf seconds spent compressing)\r\n",
-               nanoLogSingleton.logsProcessed,
+               logsProcessed,
                totalBytesWrittenDouble / 1.0e6,
                workTime,
                compressTime);
@@ -172,22 +517,113 @@ RuntimeLogger::getStats() {
 
     snprintf(buffer, 1024,
            "There were %u file flushes and the final sync time was %lf sec\r\n",
-           nanoLogSingleton.numAioWritesCompleted,
+           numWritesCompleted,
            PerfUtils::Cycles::toSeconds(stop - start));
     out << buffer;
 
-    double secondsAwake =
-            PerfUtils::Cycles::toSeconds(nanoLogSingleton.cyclesActive);
+    double numWritesSubmittedDouble = static_cast<double>(numWritesSubmitted);
+    snprintf(buffer, 1024,
+           "The %s output engine (queue depth %u) had %0.2lf writes in "
+               "flight on average (max %u) and took %0.2lf us per "
+               "submission (max %0.2lf us)\r\n",
+           OutputBackend::getEngineName(nanoLogSingleton.outputEngine),
+           nanoLogSingleton.shards.at(0)->output->getQueueDepth(),
+           static_cast<double>(outputQueueDepthSum)
+                                                / numWritesSubmittedDouble,
+           maxOutputQueueDepth,
+           1.0e6*PerfUtils::Cycles::toSeconds(cyclesSubmittingWrites)
+                                                / numWritesSubmittedDouble,
+           1.0e6*PerfUtils::Cycles::toSeconds(maxCyclesSubmittingWrite));
+    out << buffer;
+
+    if (numWritesFailed > 0) {
+        snprintf(buffer, 1024, "%lu output writes failed\r\n",
+                 numWritesFailed);
+        out << buffer;
+    }
+
+    if (numPriorityWrites > 0) {
+        snprintf(buffer, 1024,
+                 "%lu output writes went out early for priority log messages "
+                     "(%lu of them were synced)\r\n",
+                 numPriorityWrites, numPrioritySyncs);
+        out << buffer;
+    }
+
+    // Includes the threads that have exited, unlike getHistograms()
+    Metrics metrics;
+    getMetrics(metrics);
+    if (metrics.numLogsDropped > 0) {
+        snprintf(buffer, 1024,
+                 "%lu log statements were dropped due to full "
+                     "StagingBuffers\r\n",
+                 metrics.numLogsDropped);
+        out << buffer;
+    }
+
+    if (nanoLogSingleton.numLogFilesRotated > 0) {
+        snprintf(buffer, 1024, "The log file was rotated %u times\r\n",
+                 nanoLogSingleton.numLogFilesRotated);
+        out << buffer;
+    }
+
+    if (nanoLogSingleton.numLogCollectorConnections > 0) {
+        snprintf(buffer, 1024,
+                 "%u connections were made to the log collector\r\n",
+                 nanoLogSingleton.numLogCollectorConnections);
+        out << buffer;
+    }
+
+    if (nanoLogSingleton.numStagingBuffersReused > 0) {
+        snprintf(buffer, 1024,
+                 "%lu StagingBuffers were reused from exited threads\r\n",
+                 nanoLogSingleton.numStagingBuffersReused);
+        out << buffer;
+    }
+
+    if (blockBytesIn > 0) {
+        snprintf(buffer, 1024,
+               "Block compression shrank %0.2lf MB of output buffers to "
+                   "%0.2lf MB (%0.2lfx) in %0.3lf seconds on the helper "
+                   "thread(s)\r\n",
+               static_cast<double>(blockBytesIn) / 1.0e6,
+               static_cast<double>(blockBytesOut) / 1.0e6,
+               static_cast<double>(blockBytesIn)
+                                        / static_cast<double>(blockBytesOut),
+               PerfUtils::Cycles::toSeconds(blockCyclesCompressing));
+        out << buffer;
+    }
+
+    double secondsAwake = PerfUtils::Cycles::toSeconds(cyclesActive);
     double secondsThreadHasBeenAlive = PerfUtils::Cycles::toSeconds(
-            PerfUtils::Cycles::rdtsc() - nanoLogSingleton.cycleAtThreadStart);
+                                                                cyclesAlive);
     snprintf(buffer, 1024,
-               "Compression Thread was active for %0.3lf out of %0.3lf seconds "
-                   "(%0.2lf %%)\r\n",
+               "%u Compression Thread(s) were active for %0.3lf out of "
+                   "%0.3lf thread-seconds (%0.2lf %%)\r\n",
+               numShards,
                secondsAwake,
                secondsThreadHasBeenAlive,
                100.0 * secondsAwake / secondsThreadHasBeenAlive);
     out << buffer;
 
+    snprintf(buffer, 1024,
+               "While idle, they spun for %0.3lf seconds, backed off for "
+                   "%0.3lf seconds, and were parked %lu times for %0.3lf "
+                   "seconds\r\n",
+               PerfUtils::Cycles::toSeconds(cyclesIdleSpinning),
+               PerfUtils::Cycles::toSeconds(cyclesIdleBackingOff),
+               numTimesParked,
+               PerfUtils::Cycles::toSeconds(cyclesIdleParked));
+    out << buffer;
+
+    if (numTimesParked > 0) {
+        snprintf(buffer, 1024,
+                 "A log message that raced with a park may have waited up to "
+                     "%0.1lf ms to be picked up\r\n",
+                 NanoLogConfig::IDLE_PARK_TIMEOUT_US/1000.0);
+        out << buffer;
+    }
+
     snprintf(buffer, 1024,
                 "On average, that's\r\n\t%0.2lf MB/s or "
                     "%0.2lf ns/byte w/ processing\r\n",
@@ -203,10 +639,19 @@ RuntimeLogger::getStats() {
                 (outputTime * 1.0e9) / totalBytesWrittenDouble);
     out << buffer;
 
+    // Compression throughput is measured on the uncompressed input, i.e. the
+    // bytes consumed from the StagingBuffers
+    snprintf(buffer, 1024,
+                "\t%0.2lf MB/s or %0.2lf ns/byte compressing "
+                    "(%0.2lf MB read from the StagingBuffers)\r\n",
+                (totalBytesReadDouble / 1.0e6) / compressTime,
+                (compressTime * 1.0e9) / totalBytesReadDouble,
+                totalBytesReadDouble / 1.0e6);
+    out << buffer;
+
     snprintf(buffer, 1024,
                 "\t%0.2lf MB per flush with %0.1lf bytes/event\r\n",
-                (totalBytesWrittenDouble / 1.0e6) /
-                                         nanoLogSingleton.numAioWritesCompleted,
+                (totalBytesWrittenDouble / 1.0e6) / numWritesCompleted,
                 totalBytesWrittenDouble * 1.0 / numEventsProcessedDouble);
     out << buffer;
 
@@ -222,9 +667,9 @@ RuntimeLogger::getStats() {
            1.0 * totalBytesReadDouble / (totalBytesWrittenDouble
                                          + padBytesWrittenDouble),
            1.0 * totalBytesReadDouble / totalBytesWrittenDouble,
-           nanoLogSingleton.totalBytesRead,
-           nanoLogSingleton.totalBytesWritten,
-           nanoLogSingleton.padBytesWritten);
+           totalBytesRead,
+           totalBytesWritten,
+           padBytesWritten);
     out << buffer;
 
     return out.str();
@@ -248,29 +693,36 @@ RuntimeLogger::getHistograms()
     snprintf(buffer, 1024, "Distribution of StagingBuffer.peek() sizes\r\n");
     out << buffer;
     size_t numIntervals =
-            Util::arraySize(nanoLogSingleton.stagingBufferPeekDist);
+            Util::arraySize(nanoLogSingleton.shards.at(0)->stagingBufferPeekDist);
     for (size_t i = 0; i < numIntervals; ++i) {
+        uint64_t peeks = 0;
+        for (CompressionShard *shard : nanoLogSingleton.shards)
+            peeks += shard->stagingBufferPeekDist[i];
+
         snprintf(buffer, 1024
                 , "\t%02lu - %02lu%%: %lu\r\n"
                 , i*100/numIntervals
                 , (i+1)*100/numIntervals
-                , nanoLogSingleton.stagingBufferPeekDist[i]);
+                , peeks);
         out << buffer;
     }
 
-    {
-        std::unique_lock<std::mutex> lock(nanoLogSingleton.bufferMutex);
-        for (size_t i = 0; i < nanoLogSingleton.threadBuffers.size(); ++i) {
-            StagingBuffer *sb = nanoLogSingleton.threadBuffers.at(i);
+    std::unique_lock<std::mutex> shardsLock(nanoLogSingleton.bufferMutex);
+    for (CompressionShard *shard : nanoLogSingleton.shards) {
+        std::unique_lock<std::mutex> lock(shard->bufferMutex);
+        for (size_t i = 0; i < shard->threadBuffers.size(); ++i) {
+            StagingBuffer *sb = shard->threadBuffers.at(i);
             if (sb) {
                 snprintf(buffer, 1024, "Thread %u:\r\n", sb->getId());
                 out << buffer;
 
                 snprintf(buffer, 1024,
                                  "\tAllocations   : %lu\r\n"
-                                 "\tTimes Blocked : %u\r\n",
+                                 "\tTimes Blocked : %u\r\n"
+                                 "\tLogs Dropped  : %lu\r\n",
                          sb->numAllocations,
-                         sb->numTimesProducerBlocked);
+                         sb->numTimesProducerBlocked,
+                         sb->numLogsDropped);
                 out << buffer;
 
 #ifdef RECORD_PRODUCER_STATS
@@ -294,6 +746,7 @@ RuntimeLogger::getHistograms()
             }
         }
     }
+    shardsLock.unlock();
 
 
 #ifndef RECORD_PRODUCER_STATS
@@ -304,48 +757,197 @@ RuntimeLogger::getHistograms()
     return out.str();
 }
 
-// See documentation in NanoLog.h
+// Documentation in NanoLog.h
 void
-RuntimeLogger::preallocate() {
-    nanoLogSingleton.ensureStagingBufferAllocated();
-    // I wonder if it'll be a good idea to update minFreeSpace as well since
-    // the user is already willing to invoke this up front cost.
+RuntimeLogger::getMetrics(Metrics &metrics)
+{
+    // Start over from zeros, but keep the memory allocated for the threads
+    std::vector<ThreadMetrics> threads;
+    threads.swap(metrics.threads);
+    threads.clear();
+    metrics = Metrics();
+    metrics.threads.swap(threads);
+
+    std::lock_guard<std::mutex> shardsLock(nanoLogSingleton.bufferMutex);
+    metrics.compressionThreads = getCompressionThreads();
+    metrics.numLogFilesRotated = nanoLogSingleton.numLogFilesRotated;
+    metrics.numStagingBuffersReused = nanoLogSingleton.numStagingBuffersReused;
+
+    uint64_t cyclesActive = 0, cyclesCompressing = 0, cyclesOutput = 0;
+    for (CompressionShard *shard : nanoLogSingleton.shards) {
+        cyclesActive += shard->cyclesActive;
+        cyclesCompressing += shard->cyclesCompressing;
+        cyclesOutput += shard->cyclesDiskIO_upperBound;
+        metrics.logsProcessed += shard->logsProcessed;
+        metrics.bytesRead += shard->totalBytesRead;
+        metrics.bytesWritten += shard->totalBytesWritten;
+        metrics.padBytesWritten += shard->padBytesWritten;
+        metrics.blockBytesIn += shard->blockBytesIn;
+        metrics.blockBytesOut += shard->blockBytesOut;
+        metrics.numWritesSubmitted += shard->numWritesSubmitted;
+        metrics.numWritesCompleted += shard->numWritesCompleted;
+        metrics.numWritesFailed += shard->numWritesFailed;
+        metrics.numPriorityWrites += shard->numPriorityWrites;
+        metrics.numPrioritySyncs += shard->numPrioritySyncs;
+        for (uint32_t i = 0; i < Metrics::NUM_PEEK_BUCKETS; ++i)
+            metrics.stagingBufferPeekDist[i] += shard->stagingBufferPeekDist[i];
+        for (uint32_t i = 0; i < Metrics::NUM_WRITE_LATENCY_BUCKETS; ++i)
+            metrics.writeLatencyDist[i] += shard->writeLatencyDist[i];
+
+        {
+            std::lock_guard<std::mutex> outputLock(shard->outputMutex);
+            OutputBackend *output = shard->output;
+            if (output != nullptr) {
+                metrics.blockBytesIn += output->getBlockBytesIn();
+                metrics.blockBytesOut += output->getBlockBytesOut();
+                metrics.numWritesFailed += output->getNumFailedWrites();
+
+                const uint64_t *dist = output->getWriteLatencyDist();
+                for (uint32_t i = 0; i < Metrics::NUM_WRITE_LATENCY_BUCKETS;
+                        ++i)
+                    metrics.writeLatencyDist[i] += dist[i];
+            }
+        }
+
+        // The compression thread only holds the lock while it scans the
+        // buffers for work, so this is never held up by the compression
+        std::lock_guard<std::mutex> lock(shard->bufferMutex);
+        metrics.numLogsDropped += shard->numLogsDroppedRetired;
+        for (StagingBuffer *sb : shard->threadBuffers) {
+            metrics.threads.emplace_back();
+            sb->getMetrics(metrics.threads.back());
+            metrics.numLogsDropped += metrics.threads.back().numLogsDropped;
+        }
+    }
+
+    for (StagingBuffer *sb : nanoLogSingleton.agentBuffers) {
+        metrics.threads.emplace_back();
+        sb->getMetrics(metrics.threads.back());
+        metrics.numLogsDropped += metrics.threads.back().numLogsDropped;
+    }
+
+    metrics.nsActive = PerfUtils::Cycles::toNanoseconds(cyclesActive);
+    metrics.nsCompressing = PerfUtils::Cycles::toNanoseconds(cyclesCompressing);
+    metrics.nsOutput = PerfUtils::Cycles::toNanoseconds(cyclesOutput);
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setMetricsExporter(std::function<void(const Metrics&)> exporter,
+                                  uint32_t intervalMs)
+{
+    nanoLogSingleton.setMetricsExporter_internal(std::move(exporter),
+                                                 intervalMs);
 }
 
 /**
-* Internal helper function to wait for AIO completion.
-*/
+ * Updates the copy of the cycle counter read by the TIMESTAMP_COARSE log
+ * statements, which is kept by the first shard only.
+ *
+ * \param shard
+ *      Shard of the compression thread invoking this
+ * \param timestamp
+ *      Current rdtsc() value, or 0 if the thread is about to idle and stop
+ *      updating it
+ */
+void
+RuntimeLogger::setCoarseTimestamp(CompressionShard *shard, uint64_t timestamp)
+{
+    if (shard->id == 0)
+        coarseTimestamp.store(timestamp, std::memory_order_relaxed);
+}
+
+/**
+ * Replaces the function invoked by the metricsExporterThread, stopping the
+ * thread first and restarting it unless the exporting is turned off.
+ *
+ * \param exporter
+ *      Function to invoke with each snapshot; an empty function stops the
+ *      exporting
+ * \param intervalMs
+ *      Milliseconds between consecutive snapshots
+ */
 void
-RuntimeLogger::waitForAIO() {
-    if (hasOutstandingOperation) {
-        if (aio_error(&aioCb) == EINPROGRESS) {
-            const struct aiocb *const aiocb_list[] = {&aioCb};
-            int err = aio_suspend(aiocb_list, 1, NULL);
+RuntimeLogger::setMetricsExporter_internal(
+                                std::function<void(const Metrics&)> exporter,
+                                uint32_t intervalMs)
+{
+    std::lock_guard<std::mutex> configLock(metricsExporterConfigMutex);
 
-            if (err != 0)
-                perror("LogCompressor's Posix AIO suspend operation failed");
+    if (metricsExporterThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(metricsExporterMutex);
+            metricsExporterShouldExit = true;
         }
+        metricsExporterWakeup.notify_all();
+        metricsExporterThread.join();
+    }
 
-        int err = aio_error(&aioCb);
-        ssize_t ret = aio_return(&aioCb);
+    metricsExporter = std::move(exporter);
+    metricsExportIntervalMs = std::max(1U, intervalMs);
+    metricsExporterShouldExit = false;
 
-        if (err != 0) {
-            fprintf(stderr, "LogCompressor's POSIX AIO failed with %d: %s\r\n",
-                    err, strerror(err));
-        } else if (ret < 0) {
-            perror("LogCompressor's Posix AIO Write operation failed");
-        }
-        ++numAioWritesCompleted;
-        hasOutstandingOperation = false;
+    if (metricsExporter)
+        metricsExporterThread = std::thread(
+                                &RuntimeLogger::metricsExporterMain, this);
+}
+
+/**
+ * Main loop of the metricsExporterThread; hands a snapshot of getMetrics() to
+ * the metricsExporter every metricsExportIntervalMs until
+ * metricsExporterShouldExit is set.
+ */
+void
+RuntimeLogger::metricsExporterMain()
+{
+    Metrics metrics;
+    std::chrono::milliseconds interval(metricsExportIntervalMs);
+    std::chrono::steady_clock::time_point nextExport =
+            std::chrono::steady_clock::now() + interval;
+
+    std::unique_lock<std::mutex> lock(metricsExporterMutex);
+    while (!metricsExporterShouldExit) {
+        if (metricsExporterWakeup.wait_until(lock, nextExport)
+                                                    != std::cv_status::timeout)
+            continue;
+
+        // Keep to a fixed rate even when the exporter takes a while
+        nextExport += interval;
+        lock.unlock();
+        getMetrics(metrics);
+        metricsExporter(metrics);
+        lock.lock();
     }
 }
 
+// See documentation in NanoLog.h
+void
+RuntimeLogger::preallocate() {
+    nanoLogSingleton.ensureStagingBufferAllocated();
+    // I wonder if it'll be a good idea to update minFreeSpace as well since
+    // the user is already willing to invoke this up front cost.
+}
+
+// See documentation in NanoLog.h
+void
+RuntimeLogger::preallocate(uint32_t stagingBufferSize) {
+    stagingBufferSize = std::max(stagingBufferSize,
+                                 NanoLogConfig::MIN_STAGING_BUFFER_SIZE);
+    stagingBufferSize = std::min(stagingBufferSize,
+                                 NanoLogConfig::MAX_STAGING_BUFFER_SIZE);
+    nanoLogSingleton.ensureStagingBufferAllocated(stagingBufferSize);
+}
+
 /**
-* Main compression thread that handles scanning through the StagingBuffers,
-* compressing log entries, and outputting a compressed log file.
+* Main compression thread that handles scanning through the StagingBuffers
+* of a shard, compressing log entries, and outputting them to the shared
+* compressed log file.
+*
+* \param shard
+*      The shard whose StagingBuffers and output buffers this thread owns
 */
 void
-RuntimeLogger::compressionThreadMain() {
+RuntimeLogger::compressionThreadMain(CompressionShard *shard) {
     // Index of the last StagingBuffer checked for uncompressed log messages
     size_t lastStagingBufferChecked = 0;
 
@@ -353,10 +955,20 @@ RuntimeLogger::compressionThreadMain() {
     // the number of cyclesActive right before blocking/sleeping and then updated
     // to the latest rdtsc() when the thread re-awakens.
     uint64_t cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-    cycleAtThreadStart = cyclesAwakeStart;
-
-    // Manages the state associated with compressing log messages
-    Log::Encoder encoder(compressingBuffer, NanoLogConfig::OUTPUT_BUFFER_SIZE);
+    shard->cycleAtThreadStart = cyclesAwakeStart;
+
+    // Manages the state associated with compressing log messages. Only the
+    // first shard starts the file off with a Checkpoint (and if the file
+    // already has one, checkpointPersisted is true and none is written).
+    // The entries in every output buffer are led by a TimeIndex so that the
+    // Decoder can seek through the log file by time.
+    bool skipCheckpoint = (shard->id != 0 || checkpointPersisted);
+    OutputBackend *output = shard->output;
+    Log::Encoder encoder(output->getFreeBuffer(),
+                         output->getBufferSize(),
+                         skipCheckpoint,
+                         false,
+                         true);
 
     // Indicates whether a compression operation failed or not due
     // to insufficient space in the outputBuffer
@@ -366,15 +978,77 @@ RuntimeLogger::compressionThreadMain() {
     // zero-th index, but have not yet encoded that in he compressed output
     bool wrapAround = false;
 
-    // Keeps a shadow mapping of the log identifiers to static information
-    // to allow the logging threads to register in parallel with compression
-    // lookup
-    std::vector<StaticLogInfo> shadowStaticInfo;
+    // Tracks the idle strategy (see NanoLogConfig::IDLE_SPIN_DURATION_US):
+    // when the thread last found work to do (0 means it is not idle), the
+    // time of the last pass spent spinning, the current backoff interval, and
+    // whether it has announced it's about to park.
+    const uint64_t spinCycles = PerfUtils::Cycles::fromNanoseconds(
+                                1000*NanoLogConfig::IDLE_SPIN_DURATION_US);
+    const uint32_t minBackoffUs = std::max(1U,
+                                    NanoLogConfig::POLL_INTERVAL_NO_WORK_US);
+    uint64_t idleSince = 0;
+    uint64_t lastSpinPass = 0;
+    uint32_t backoffUs = minBackoffUs;
+    bool parkRequested = false;
+
+    // Indicates that the shard had StagingBuffers to drain on the last pass
+    bool shardHasBuffers = true;
+
+    // Number of consecutive passes that started at a nearly full
+    // StagingBuffer and ran out of output space before they completed
+    uint32_t prioritizedPasses = 0;
+
+    // Indicates that the output buffer being filled holds priority log
+    // messages (see setPriorityLogLevel()), so it's written out as soon as
+    // a write can be submitted
+    bool priorityLogsEncoded = false;
+
+    // Callbacks whose log messages reached the log file during the current
+    // pass (see NanoLog::notifyWhenPersisted()), invoked after the pass
+    std::vector<std::function<void()>> persistedCallbacks;
+
+    // rdtsc() after which the first shard takes its next reading of the wall
+    // clock (see NanoLogConfig::CLOCK_CALIBRATION_INTERVAL_MS)
+    const uint64_t calibrationCycles = PerfUtils::Cycles::fromNanoseconds(
+                    1000000UL*NanoLogConfig::CLOCK_CALIBRATION_INTERVAL_MS);
+    uint64_t nextClockCalibration = 0;
 
     // Each iteration of this loop scans for uncompressed log messages in the
     // thread buffers, compresses as much as possible, and outputs it to a file.
     while (!compressionThreadShouldExit) {
-        coreId = sched_getcpu();
+        shard->coreId = sched_getcpu();
+
+        // Rotate the log file at an output buffer boundary. The first shard
+        // opens the new file and leads it with a Checkpoint; the others follow
+        // once they're done with the buffer they're on. Switching over costs
+        // the compression thread the writes still in flight, but the logging
+        // threads keep going as long as their StagingBuffers have room.
+        if (encoder.getEncodedBytes() == 0) {
+            // A connection to the log collector that lost output is replaced
+            // like a rotated log file, so the next one decodes on its own
+            uint64_t numWriteFailures = output->getNumFailedWrites();
+            if (numWriteFailures != shard->numWriteFailuresSeen) {
+                shard->numWriteFailuresSeen = numWriteFailures;
+                if (outputEngine == COLLECTOR &&
+                        shard->logFileGeneration == logFileGeneration)
+                    logCollectorLost = true;
+            }
+
+            if (shard->id == 0 && (rotationRequested || logCollectorLost))
+                rotateLogFile_internal();
+
+            if (shard->logFileGeneration != logFileGeneration) {
+                switchLogFile(shard);
+
+                if (shard->id == 0 && !encoder.encodeCheckpoint()) {
+                    fprintf(stderr, "Internal Error: Not enough space "
+                                    "allocated for the Checkpoint of the "
+                                    "rotated log file.\r\n");
+                    exit(-1);
+                }
+                nextClockCalibration = 0;
+            }
+        }
 
         // Indicates how many bytes we have consumed from the StagingBuffers
         // in a single iteration of the while above. A value of 0 means we
@@ -383,27 +1057,90 @@ RuntimeLogger::compressionThreadMain() {
         uint64_t bytesConsumedThisIteration = 0;
 
         uint64_t start = PerfUtils::Cycles::rdtsc();
+        setCoarseTimestamp(shard, start);
+
         // Step 1: Find buffers with entries and compress them
         {
-            std::unique_lock<std::mutex> lock(bufferMutex);
+            std::unique_lock<std::mutex> lock(shard->bufferMutex);
+            std::vector<StagingBuffer *> &threadBuffers = shard->threadBuffers;
             size_t i = lastStagingBufferChecked;
 
-            // Output new dictionary entries, if necessary
-            if (nextInvocationIndexToBePersisted < invocationSites.size())
+            // Record which log messages made it to the log file, which lets
+            // the producers of recoverable StagingBuffers reuse their space
+            // and releases the callbacks waiting on them
+            bool allPersisted = encoder.getEncodedBytes() == 0 &&
+                                output->getNumInFlight() == 0;
+            for (StagingBuffer *sb : threadBuffers)
+                sb->releasePersisted(shard->numWritesSubmitted,
+                                     shard->numWritesCompleted,
+                                     allPersisted);
+
+            std::vector<PersistedCallback> &waiting = shard->persistedCallbacks;
+            size_t numWaiting = 0;
+            for (size_t j = 0; j < waiting.size(); ++j) {
+                if (waiting[j].stagingBuffer->persistedPosition >=
+                        waiting[j].position)
+                    persistedCallbacks.push_back(
+                                        std::move(waiting[j].callback));
+                else if (numWaiting++ != j)
+                    waiting[numWaiting - 1] = std::move(waiting[j]);
+            }
+            waiting.erase(waiting.begin() + numWaiting, waiting.end());
+            shardHasBuffers = !threadBuffers.empty();
+
+            // Move persistedUpTo along with the writes that completed. A
+            // shard without StagingBuffers has nothing left to write out.
+            shard->updatePersistedUpTo();
+            if (!shardHasBuffers)
+                shard->startPass(start, encoder.getEncodedBytes() > 0);
+
+            // Output new dictionary entries, if necessary. Every shard emits
+            // the dictionary entries its own extents rely on since the shards'
+            // output buffers may reach the file in any order; the Decoder
+            // drops the duplicates.
+            if (shard->nextInvocationIndexToBePersisted <
+                    invocationSites.size())
             {
-                std::unique_lock<std::mutex> lock (registrationMutex);
                 encoder.encodeNewDictionaryEntries(
-                                               nextInvocationIndexToBePersisted,
-                                               invocationSites);
+                                        shard->nextInvocationIndexToBePersisted,
+                                        invocationSites);
+            }
 
-                // update our shadow copy
-                for (uint64_t i = shadowStaticInfo.size();
-                                    i < nextInvocationIndexToBePersisted; ++i)
-                {
-                    shadowStaticInfo.push_back(invocationSites.at(i));
+            // Start the pass at the next StagingBuffer in round-robin order
+            // that holds a priority log message, which is then the only one
+            // drained (a priority pass). Otherwise, start it at the fullest
+            // of the StagingBuffers whose producers hinted that they're
+            // about to block, so they don't wait behind the others in
+            // round-robin order.
+            shard->priorityLogGenerationSeen = priorityLogGeneration;
+            size_t resumeAt = lastStagingBufferChecked;
+            bool prioritized = false;
+            bool priorityPass = false;
+            if (prioritizedPasses < NanoLogConfig::MAX_PRIORITIZED_PASSES) {
+                uint64_t mostBytesPending = 0;
+                for (size_t k = 0; k < threadBuffers.size(); ++k) {
+                    size_t j = (resumeAt + k) % threadBuffers.size();
+                    if (threadBuffers[j]->priorityPending) {
+                        lastStagingBufferChecked = i = j;
+                        prioritized = priorityPass = true;
+                        break;
+                    }
+
+                    if (!threadBuffers[j]->nearlyFull)
+                        continue;
+
+                    uint64_t bytesPending = threadBuffers[j]->getBytesPending();
+                    if (!prioritized || bytesPending > mostBytesPending) {
+                        mostBytesPending = bytesPending;
+                        lastStagingBufferChecked = i = j;
+                        prioritized = true;
+                    }
                 }
             }
 
+            // Number of times the priority pass peeked at its StagingBuffer
+            uint32_t priorityPeeks = 0;
+
             // Scan through the threadBuffers looking for log messages to
             // compress while the output buffer is not full.
             while (!compressionThreadShouldExit
@@ -411,6 +1148,36 @@ RuntimeLogger::compressionThreadMain() {
                    && !threadBuffers.empty()) {
                 uint64_t peekBytes = 0;
                 StagingBuffer *sb = threadBuffers[i];
+
+                // Record any log statements the producer had to drop since
+                // the last pass before compressing what it did manage to log
+                uint64_t numLogsDropped = sb->numLogsDropped;
+                if (numLogsDropped != sb->numLogsDroppedReported) {
+                    Fence::lfence(); // Read the count before the timestamp
+                    if (!encoder.encodeDroppedLogs(sb->getId(),
+                                numLogsDropped - sb->numLogsDroppedReported,
+                                sb->lastDropTimestamp)) {
+                        lastStagingBufferChecked = i;
+                        outputBufferFull = true;
+                        break;
+                    }
+
+                    sb->numLogsDroppedReported = numLogsDropped;
+                }
+
+                // Cleared ahead of the peek so that the producer can set them
+                // again for what it logs while this drains the buffer. The
+                // fence keeps the peek from reading a producerPos older than
+                // the one the producer moved before it found the flag set.
+                if (sb->nearlyFull)
+                    sb->nearlyFull = false;
+
+                bool priorityLogs = sb->priorityPending;
+                if (priorityLogs) {
+                    sb->priorityPending = false;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                }
+
                 char *peekPosition = sb->peek(&peekBytes);
 
                 // If there's work, unlock to perform it
@@ -419,10 +1186,11 @@ RuntimeLogger::compressionThreadMain() {
                     lock.unlock();
 
                     // Record metrics on the peek size
-                    size_t sizeOfDist = Util::arraySize(stagingBufferPeekDist);
+                    size_t sizeOfDist =
+                            Util::arraySize(shard->stagingBufferPeekDist);
                     size_t distIndex = (sizeOfDist*peekBytes)/
-                                            NanoLogConfig::STAGING_BUFFER_SIZE;
-                    ++(stagingBufferPeekDist[distIndex]);
+                                                        sb->getCapacity();
+                    ++(shard->stagingBufferPeekDist[distIndex]);
 
 
                     // Encode the data in RELEASE_THRESHOLD chunks
@@ -437,37 +1205,47 @@ RuntimeLogger::compressionThreadMain() {
                                 bytesToEncode,
                                 sb->getId(),
                                 wrapAround,
-                                &logsProcessed);
+                                &shard->logsProcessed);
 #else
                         long bytesRead = encoder.encodeLogMsgs(
                                 peekPosition + (peekBytes - remaining),
                                 bytesToEncode,
                                 sb->getId(),
                                 wrapAround,
-                                shadowStaticInfo,
-                                &logsProcessed);
+                                invocationSites,
+                                &shard->logsProcessed);
 #endif
 
 
                         if (bytesRead == 0) {
+                            // The priority log messages may be in the part
+                            // that's left for the next output buffer
+                            if (priorityLogs)
+                                sb->priorityPending = true;
+
                             lastStagingBufferChecked = i;
                             outputBufferFull = true;
                             break;
                         }
 
+                        priorityLogsEncoded |= priorityLogs;
                         wrapAround = false;
                         remaining -= downCast<uint32_t>(bytesRead);
                         sb->consume(bytesRead);
-                        totalBytesRead += bytesRead;
+                        shard->totalBytesRead += bytesRead;
                         bytesConsumedThisIteration += bytesRead;
+                        setCoarseTimestamp(shard, PerfUtils::Cycles::rdtsc());
                     }
-                    cyclesCompressing += PerfUtils::Cycles::rdtsc() - start;
+                    shard->cyclesCompressing += PerfUtils::Cycles::rdtsc()
+                                                                    - start;
                     lock.lock();
                 } else {
                     // If there's no work, check if we're supposed to delete
-                    // the stagingBuffer
+                    // (or pool) the stagingBuffer
                     if (sb->checkCanDelete()) {
-                        delete sb;
+                        // The shard keeps counting the buffer's drops
+                        shard->numLogsDroppedRetired += sb->numLogsDropped;
+                        releaseStagingBuffer(sb);
 
                         threadBuffers.erase(threadBuffers.begin() + i);
                         if (threadBuffers.empty()) {
@@ -482,187 +1260,429 @@ RuntimeLogger::compressionThreadMain() {
                             lastStagingBufferChecked > 0) {
                             --lastStagingBufferChecked;
                         }
+                        if (resumeAt > i)
+                            --resumeAt;
                         --i;
                     }
                 }
 
+                // A priority pass ends after its StagingBuffer so that the
+                // output is written out right away. It peeks a second time
+                // since the first peek stops at the end of a plain ring that
+                // the log messages wrapped around.
+                if (priorityPass) {
+                    if (peekBytes > 0 && !outputBufferFull && !sb->mirrored &&
+                            ++priorityPeeks < 2)
+                        continue;
+
+                    break;
+                }
+
                 i = (i + 1) % threadBuffers.size();
 
-                if (i == 0)
+                // Only the round-robin passes mark the passes through the
+                // buffers that the Decoder orders the log messages by
+                if (i == 0 && !prioritized) {
                     wrapAround = true;
+                    shard->startPass(PerfUtils::Cycles::rdtsc(),
+                                     encoder.getEncodedBytes() > 0);
+                }
 
                 // Completed a full pass through the buffers
                 if (i == lastStagingBufferChecked)
                     break;
             }
 
-            cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc() - start;
+            // A prioritized pass may have skipped the buffers the round-robin
+            // order was due to visit next, so the next pass still starts with
+            // them once MAX_PRIORITIZED_PASSES of those in a row have gone by.
+            // Leaving the round-robin position (and the wrapAround markers)
+            // to the plain passes keeps a buffer from being drained more than
+            // a pass ahead of the others in the stages the Decoder buffers.
+            if (prioritized) {
+                ++prioritizedPasses;
+                lastStagingBufferChecked = threadBuffers.empty() ? 0
+                                        : resumeAt % threadBuffers.size();
+            } else {
+                prioritizedPasses = 0;
+            }
+
+            shard->cyclesScanningAndCompressing += PerfUtils::Cycles::rdtsc()
+                                                                    - start;
+        }
+
+        // Invoked without the lock, so they may register callbacks again
+        for (std::function<void()> &callback : persistedCallbacks)
+            callback();
+        persistedCallbacks.clear();
+
+        // The first shard periodically reads the wall clock for the Decoder
+        // to correct the drift of its rdtsc() conversion with (see
+        // Log::ClockCalibration). It only does so along with output that's
+        // written out anyway, which is never the case when it's idle, and
+        // takes the rdtsc() half way through the clock_gettime().
+        if (shard->id == 0 && calibrationCycles > 0 &&
+                start >= nextClockCalibration &&
+                encoder.getEncodedBytes() > 0) {
+            struct timespec now;
+            uint64_t before = PerfUtils::Cycles::rdtsc();
+            clock_gettime(CLOCK_REALTIME, &now);
+            uint64_t after = PerfUtils::Cycles::rdtsc();
+
+            if (encoder.encodeClockCalibration(before + (after - before)/2,
+                            1000000000*static_cast<int64_t>(now.tv_sec)
+                                                            + now.tv_nsec))
+                nextClockCalibration = start + calibrationCycles;
         }
 
-        // If there's no data to output, go to sleep.
+        // If there's no data to output, spin, back off, and then park until
+        // a logging thread wakes the thread up.
         if (encoder.getEncodedBytes() == 0) {
             std::unique_lock<std::mutex> lock(condMutex);
 
             // If a sync was requested, we should make at least 1 more
             // pass to make sure we got everything up to the sync point.
-            if (syncRequested) {
-                syncRequested = false;
+            if (shard->syncGenerationSeen != syncGeneration) {
+                shard->syncGenerationSeen = syncGeneration;
+                continue;
+            }
+
+            // The same goes for priority log messages flagged during the pass
+            if (shard->priorityLogGenerationSeen != priorityLogGeneration)
+                continue;
+
+            shard->syncGenerationCompleted = shard->syncGenerationSeen;
+            hintQueueEmptied.notify_all();
+
+            // Retire finished writes so the other shards learn that the
+            // Checkpoint got persisted without waiting on more log messages.
+            // The next pass records which log messages they persisted.
+            uint32_t writesCompleted = output->reapWrites(false);
+            if (writesCompleted > 0) {
+                shard->numWritesCompleted += writesCompleted;
+                if (shard->id == 0)
+                    checkpointPersisted = true;
                 continue;
             }
 
-            cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+            uint64_t now = PerfUtils::Cycles::rdtsc();
+            if (idleSince == 0)
+                idleSince = lastSpinPass = now;
 
-            hintQueueEmptied.notify_one();
-            workAdded.wait_for(lock, std::chrono::microseconds(
-                    NanoLogConfig::POLL_INTERVAL_NO_WORK_US));
+            // Phase 1: Poll again right away
+            if (now - idleSince < spinCycles) {
+                shard->cyclesIdleSpinning += now - lastSpinPass;
+                lastSpinPass = now;
+                continue;
+            }
+
+            shard->cyclesActive += now - cyclesAwakeStart;
+
+            // The logging threads read the cycle counter while this sleeps
+            setCoarseTimestamp(shard, 0);
+            if (backoffUs <= NanoLogConfig::IDLE_MAX_BACKOFF_US ||
+                    output->getNumInFlight() > 0) {
+                // Phase 2: Sleep for exponentially longer intervals; writes
+                // still in flight keep the thread from parking.
+                uint32_t sleepUs = std::min(backoffUs,
+                                            NanoLogConfig::IDLE_MAX_BACKOFF_US);
+                workAdded.wait_for(lock, std::chrono::microseconds(sleepUs));
+                if (backoffUs <= NanoLogConfig::IDLE_MAX_BACKOFF_US)
+                    backoffUs *= 2;
+
+                cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+                shard->cyclesIdleBackingOff += cyclesAwakeStart - now;
+                continue;
+            }
+
+            // Phase 3: Park. The flag is raised one pass ahead of the wait so
+            // that most log messages which raced with it are found by that
+            // pass. It's not guaranteed though: a producer's store to
+            // producerPos may be reordered after its load of the flag, so it
+            // can see the flag down while this pass misses its message, which
+            // then waits out the park timeout (IDLE_PARK_TIMEOUT_US). The log
+            // messages of a compression agent's buffers are no reason to wake
+            // up, so a shard without buffers of its own parks without the
+            // flag and picks up new ones after the timeout.
+            if (compressionAgentEnabled && !shardHasBuffers) {
+                ++shard->numTimesParked;
+                workAdded.wait_for(lock, std::chrono::microseconds(
+                        NanoLogConfig::IDLE_PARK_TIMEOUT_US));
+            } else if (!parkRequested) {
+                compressionThreadsParked = true;
+                parkRequested = true;
+            } else if (compressionThreadsParked) {
+                ++shard->numTimesParked;
+                workAdded.wait_for(lock, std::chrono::microseconds(
+                        NanoLogConfig::IDLE_PARK_TIMEOUT_US));
+            } else {
+                // A logging thread woke us up before we got to wait
+                parkRequested = false;
+            }
+
+            cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+            shard->cyclesIdleParked += cyclesAwakeStart - now;
+            continue;
+        }
 
+        // Found work; reset the idle strategy
+        idleSince = 0;
+        backoffUs = minBackoffUs;
+        parkRequested = false;
+
+        // Hold the output of the other shards until the first shard has
+        // persisted the Checkpoint that must lead the log file (buffers for
+        // a file that was rotated away from can go out right away).
+        if (!checkpointPersisted && shard->id != 0 &&
+                shard->logFileGeneration == logFileGeneration) {
+            std::unique_lock<std::mutex> lock(condMutex);
+            shard->cyclesActive += PerfUtils::Cycles::rdtsc()
+                                                        - cyclesAwakeStart;
+            workAdded.wait_for(lock, std::chrono::microseconds(
+                    NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
             cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
             continue;
         }
 
-        if (hasOutstandingOperation) {
-            if (aio_error(&aioCb) == EINPROGRESS) {
-                const struct aiocb *const aiocb_list[] = {&aioCb};
-                if (outputBufferFull) {
-                    // If the output buffer is full and we're not done,
-                    // wait for completion
-                    cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
-                    int err = aio_suspend(aiocb_list, 1, NULL);
+        // Retire the writes that finished in the meantime to free up their
+        // buffers; wait for one if all the buffers are in flight.
+        uint32_t writesCompleted = output->reapWrites(false);
+        if (output->isFull()) {
+            if (outputBufferFull || priorityLogsEncoded) {
+                // If the output buffer is full and we're not done (or it
+                // holds priority log messages), wait for completion
+                shard->cyclesActive += PerfUtils::Cycles::rdtsc()
+                                                    - cyclesAwakeStart;
+                writesCompleted += output->reapWrites(true);
+                cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
+            } else {
+                // If there's no new data, go to sleep.
+                if (bytesConsumedThisIteration == 0 &&
+                    NanoLogConfig::POLL_INTERVAL_DURING_IO_US > 0) {
+                    std::unique_lock<std::mutex> lock(condMutex);
+                    shard->cyclesActive += PerfUtils::Cycles::rdtsc() -
+                                   cyclesAwakeStart;
+                    workAdded.wait_for(lock, std::chrono::microseconds(
+                            NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
                     cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-                    if (err != 0)
-                        perror("LogCompressor's Posix AIO "
-                                       "suspend operation failed");
-                } else {
-                    // If there's no new data, go to sleep.
-                    if (bytesConsumedThisIteration == 0 &&
-                        NanoLogConfig::POLL_INTERVAL_DURING_IO_US > 0) {
-                        std::unique_lock<std::mutex> lock(condMutex);
-                        cyclesActive += PerfUtils::Cycles::rdtsc() -
-                                       cyclesAwakeStart;
-                        workAdded.wait_for(lock, std::chrono::microseconds(
-                                NanoLogConfig::POLL_INTERVAL_DURING_IO_US));
-                        cyclesAwakeStart = PerfUtils::Cycles::rdtsc();
-                    }
+                }
 
-                    if (aio_error(&aioCb) == EINPROGRESS) {
-                        cyclesDiskIO_upperBound += (PerfUtils::Cycles::rdtsc() - start);
-                        continue;
-                    }
+                writesCompleted += output->reapWrites(false);
+                if (output->isFull()) {
+                    shard->numWritesCompleted += writesCompleted;
+                    shard->cyclesDiskIO_upperBound +=
+                                    (PerfUtils::Cycles::rdtsc() - start);
+                    continue;
                 }
             }
+        }
 
-            // Finishing up the IO
-            int err = aio_error(&aioCb);
-            ssize_t ret = aio_return(&aioCb);
-
-            if (err != 0) {
-                fprintf(stderr, "LogCompressor's POSIX AIO failed"
-                        " with %d: %s\r\n", err, strerror(err));
-            } else if (ret < 0) {
-                perror("LogCompressor's Posix AIO Write failed");
-            }
-            ++numAioWritesCompleted;
-            hasOutstandingOperation = false;
+        // Only the first shard's writes can complete the Checkpoint; the
+        // others may still be finishing up a file that was rotated away from.
+        if (writesCompleted > 0) {
+            shard->numWritesCompleted += writesCompleted;
+            if (shard->id == 0)
+                checkpointPersisted = true;
         }
 
-        // At this point, compressed items exist in the buffer and the double
-        // buffer used for IO is now free. Pad the output (if necessary) and
-        // output.
+        // Record how far all the shards have written out their log messages,
+        // which lets the Decoder sort the output buffers that the shards
+        // append to the log file independently of each other
+        uint64_t flushedUpTo = UINT64_MAX;
+        for (CompressionShard *other : shards)
+            flushedUpTo = std::min(flushedUpTo,
+                        other->persistedUpTo.load(std::memory_order_acquire));
+        encoder.setFlushedUpTo(flushedUpTo);
+
+        // At this point, compressed items exist in the buffer and there's a
+        // free buffer to swap in. Pad the output (if necessary) and output.
         ssize_t bytesToWrite = encoder.getEncodedBytes();
         if (NanoLogConfig::FILE_PARAMS & O_DIRECT) {
             ssize_t bytesOver = bytesToWrite % 512;
 
             if (bytesOver != 0) {
-                memset(compressingBuffer, 0, 512 - bytesOver);
+                memset(output->getFreeBuffer() + bytesToWrite, 0,
+                       512 - bytesOver);
                 bytesToWrite = bytesToWrite + 512 - bytesOver;
-                padBytesWritten += (512 - bytesOver);
+                shard->padBytesWritten += (512 - bytesOver);
             }
         }
 
-        aioCb.aio_fildes = outputFd;
-        aioCb.aio_buf = compressingBuffer;
-        aioCb.aio_nbytes = bytesToWrite;
-        totalBytesWritten += bytesToWrite;
-
-        if (aio_write(&aioCb) == -1)
-            fprintf(stderr, "Error at aio_write(): %s\n", strerror(errno));
+        shard->totalBytesWritten += bytesToWrite;
 
-        hasOutstandingOperation = true;
+        uint64_t submitStart = PerfUtils::Cycles::rdtsc();
+        char *nextBuffer = output->submitWrite(
+                            shard->logFd, static_cast<size_t>(bytesToWrite));
+        uint64_t submitCycles = PerfUtils::Cycles::rdtsc() - submitStart;
+        ++shard->numWritesSubmitted;
+        shard->cyclesSubmittingWrites += submitCycles;
+        shard->maxCyclesSubmittingWrite = std::max(
+                                shard->maxCyclesSubmittingWrite, submitCycles);
+        shard->outputQueueDepthSum += output->getNumInFlight();
+        shard->maxOutputQueueDepth = std::max(shard->maxOutputQueueDepth,
+                                              output->getNumInFlight());
 
         // Swap buffers
-        encoder.swapBuffer(outputDoubleBuffer,
-                           NanoLogConfig::OUTPUT_BUFFER_SIZE);
-        std::swap(outputDoubleBuffer, compressingBuffer);
+        encoder.swapBuffer(nextBuffer, output->getBufferSize());
         outputBufferFull = false;
 
-        cyclesDiskIO_upperBound += (PerfUtils::Cycles::rdtsc() - start);
+        // Persist the priority log messages before moving on, if requested
+        if (priorityLogsEncoded) {
+            ++shard->numPriorityWrites;
+            if (syncPriorityLogs.load(std::memory_order_relaxed) &&
+                    output->getEngine() != COLLECTOR) {
+                shard->numWritesCompleted += output->waitForAllWrites();
+                if (shard->id == 0)
+                    checkpointPersisted = true;
+
+                fdatasync(shard->logFd);
+                ++shard->numPrioritySyncs;
+            }
+
+            priorityLogsEncoded = false;
+        }
+
+        if (shard->logFileGeneration == logFileGeneration)
+            checkLogFileLimits(shard->logFd,
+                               static_cast<uint64_t>(bytesToWrite));
+
+        shard->cyclesDiskIO_upperBound += (PerfUtils::Cycles::rdtsc() - start);
     }
 
-    if (hasOutstandingOperation) {
+    if (output->getNumInFlight() > 0) {
         uint64_t start = PerfUtils::Cycles::rdtsc();
-        // Wait for any outstanding AIO to finish
-        while (aio_error(&aioCb) == EINPROGRESS);
-        int err = aio_error(&aioCb);
-        ssize_t ret = aio_return(&aioCb);
-
-        if (err != 0) {
-            fprintf(stderr, "LogCompressor's POSIX AIO failed with %d: %s\r\n",
-                    err, strerror(err));
-        } else if (ret < 0) {
-            perror("LogCompressor's Posix AIO Write operation failed");
-        }
-        ++numAioWritesCompleted;
-        hasOutstandingOperation = false;
-        cyclesDiskIO_upperBound += (PerfUtils::Cycles::rdtsc() - start);
+        // Wait for any outstanding writes to finish
+        shard->numWritesCompleted += output->waitForAllWrites();
+        if (shard->id == 0)
+            checkpointPersisted = true;
+        shard->cyclesDiskIO_upperBound += (PerfUtils::Cycles::rdtsc() - start);
     }
 
-    cycleAtThreadStart = 0;
-    cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
+    shard->cycleAtThreadStart = 0;
+    shard->cyclesActive += PerfUtils::Cycles::rdtsc() - cyclesAwakeStart;
 }
 
-// Documentation in NanoLog.h
+/**
+* Launches one compression thread per shard.
+*
+* \param newLogFile
+*      Indicates that outputFd was just opened and the first shard should
+*      start it off with a fresh Checkpoint (and dictionary).
+*/
 void
-RuntimeLogger::setLogFile_internal(const char *filename) {
-    // Check if it exists and is readable/writeable
-    if (access(filename, F_OK) == 0 && access(filename, R_OK | W_OK) != 0) {
-        std::string err = "Unable to read/write from new log file: ";
-        err.append(filename);
-        throw std::ios_base::failure(err);
+RuntimeLogger::startCompressionThreads(bool newLogFile) {
+    compressionThreadShouldExit = false;
+
+    if (newLogFile) {
+        checkpointPersisted = false;
+        rotationRequested = false;
+        logFileBytesSubmitted = 0;
+        nextRotationSizeCheck = 0;
+        logFileOpenCycles = PerfUtils::Cycles::rdtsc();
+
+        for (CompressionShard *shard : shards)
+            shard->nextInvocationIndexToBePersisted = 0;
     }
 
-    // Try to open the file
-    int newFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
-    if (newFd < 0) {
-        std::string err = "Unable to open file new log file: '";
-        err.append(filename);
-        err.append("': ");
-        err.append(strerror(errno));
-        throw std::ios_base::failure(err);
+    // Shards that stopped before following a rotation (or are new) start
+    // writing the current file, which needs their dictionary entries as well
+    for (CompressionShard *shard : shards) {
+        if (shard->logFd != outputFd ||
+                shard->logFileGeneration != logFileGeneration) {
+            shard->nextInvocationIndexToBePersisted = 0;
+            shard->logFd = outputFd;
+            shard->logFileGeneration = logFileGeneration;
+        }
     }
 
-    // Everything seems okay, stop the background thread and change files
-    sync();
+#ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
+    for (CompressionShard *shard : shards) {
+        shard->compressionThread = std::thread(
+                &RuntimeLogger::compressionThreadMain, this, shard);
+
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        if (compressionThreadsPinned)
+            applyCompressionThreadAffinity(shard);
+    }
+#endif
+}
 
-    // Stop the compression thread completely
+/**
+* Signals all the compression threads to exit and waits for them to finish
+* their outstanding IO. Log messages still in the StagingBuffers are retained
+* and will be output once the threads are restarted.
+*/
+void
+RuntimeLogger::stopCompressionThreads() {
     {
-        std::lock_guard<std::mutex> lock(nanoLogSingleton.condMutex);
+        std::lock_guard<std::mutex> lock(condMutex);
         compressionThreadShouldExit = true;
         workAdded.notify_all();
+        hintQueueEmptied.notify_all();
+    }
+
+    for (CompressionShard *shard : shards) {
+        if (shard->compressionThread.joinable())
+            shard->compressionThread.join();
+    }
+    coarseTimestamp = 0;
+
+    // All the writes are done, so a rotated file can be closed even if not
+    // every shard switched over.
+    if (retiringFd >= 0) {
+        close(retiringFd);
+        retiringFd = -1;
+        retiringFdUsers = 0;
+    }
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setLogFile_internal(const char *filename) {
+    // Check if it exists and is readable/writeable
+    if (access(filename, F_OK) == 0 && access(filename, R_OK | W_OK) != 0) {
+        std::string err = "Unable to read/write from new log file: ";
+        err.append(filename);
+        throw std::ios_base::failure(err);
+    }
+
+    // Try to open the file
+    int newFd = open(filename, NanoLogConfig::FILE_PARAMS, 0666);
+    if (newFd < 0) {
+        std::string err = "Unable to open file new log file: '";
+        err.append(filename);
+        err.append("': ");
+        err.append(strerror(errno));
+        throw std::ios_base::failure(err);
     }
 
-    if (compressionThread.joinable())
-        compressionThread.join();
+    // Everything seems okay, stop the background threads and change files
+    sync();
+    stopCompressionThreads();
 
     if (outputFd > 0)
         close(outputFd);
     outputFd = newFd;
+    logFilePath = filename;
+
+    // Switch back from the log collector
+    if (outputEngine == COLLECTOR) {
+        if (pendingCollectorFd >= 0)
+            close(pendingCollectorFd);
+        pendingCollectorFd = -1;
+        logCollectorLost = false;
+
+        outputEngine = fileOutputEngine;
+        for (CompressionShard *shard : shards) {
+            if (!shard->allocateOutputBuffers(outputBufferSize, outputEngine,
+                                              blockCompression))
+                shard->allocateOutputBuffers(outputBufferSize, POSIX_AIO,
+                                             blockCompression);
+        }
+    }
 
-    // Relaunch thread
-    nextInvocationIndexToBePersisted = 0; // Reset the dictionary
-    compressionThreadShouldExit = false;
-#ifndef BENCHMARK_DISCARD_ENTRIES_AT_STAGINGBUFFER
-    compressionThread = std::thread(&RuntimeLogger::compressionThreadMain, this);
-#endif
+    // Relaunch the threads; this also resets the dictionary
+    startCompressionThreads(true);
 }
 
 /**
@@ -685,6 +1705,757 @@ RuntimeLogger::setLogFile(const char *filename) {
     nanoLogSingleton.setLogFile_internal(filename);
 }
 
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setLogCollector_internal(const char *host, uint16_t port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    std::string service = std::to_string(port);
+    struct addrinfo *addrs = nullptr;
+    int err = getaddrinfo(host, service.c_str(), &hints, &addrs);
+    if (err != 0 || addrs == nullptr) {
+        std::string msg = "Unable to resolve the log collector '";
+        msg.append(host);
+        msg.append("': ");
+        msg.append(gai_strerror(err));
+        throw std::ios_base::failure(msg);
+    }
+
+    sync();
+    stopCompressionThreads();
+
+    memcpy(&logCollectorAddr, addrs->ai_addr,
+           std::min<size_t>(addrs->ai_addrlen, sizeof(logCollectorAddr)));
+    logCollectorAddrLen = static_cast<socklen_t>(
+            std::min<size_t>(addrs->ai_addrlen, sizeof(logCollectorAddr)));
+    logCollectorName = std::string(host) + ":" + service;
+    freeaddrinfo(addrs);
+
+    // A collector that can't be reached yet is retried like a lost one
+    int fd = connectLogCollector();
+    if (fd >= 0 && finishLogCollectorConnect(fd,
+                    NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS) <= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "NanoLog could not connect to the log collector at "
+                "%s; output is dropped until it does.\r\n",
+                logCollectorName.c_str());
+    }
+
+    if (pendingCollectorFd >= 0)
+        close(pendingCollectorFd);
+    pendingCollectorFd = -1;
+    collectorBackoffUs = 0;
+    nextCollectorConnectCycles = 0;
+    logCollectorLost = (fd < 0);
+
+    if (outputFd > 0)
+        close(outputFd);
+    outputFd = fd;
+
+    if (outputEngine != COLLECTOR) {
+        fileOutputEngine = outputEngine;
+        outputEngine = COLLECTOR;
+        for (CompressionShard *shard : shards)
+            shard->allocateOutputBuffers(outputBufferSize, outputEngine,
+                                         blockCompression);
+    }
+
+    startCompressionThreads(true);
+}
+
+/**
+* Streams the NanoLog output to a log collector instead of a log file (see
+* NanoLog.h). This function is *not* thread safe with respect to setLogFile()
+* and sync().
+*
+* \param host
+*      Host name or address of the collector
+* \param port
+*      TCP port the collector listens on
+*
+* \throw is_base::failure
+*      if the host cannot be resolved
+*/
+void
+RuntimeLogger::setLogCollector(const char *host, uint16_t port) {
+    nanoLogSingleton.setLogCollector_internal(host, port);
+}
+
+/**
+* Starts connecting a socket to the log collector without waiting for the
+* connection to be established (see finishLogCollectorConnect()).
+*
+* \return
+*      The socket, or -1 if connecting failed right away
+*/
+int
+RuntimeLogger::connectLogCollector() {
+    int fd = socket(logCollectorAddr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&logCollectorAddr),
+                logCollectorAddrLen) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+* Waits for a socket from connectLogCollector() to be connected and sets it
+* up for the compression threads: sends block, but for no longer than
+* NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS, and a Log::CollectorHello leads
+* the stream.
+*
+* \param fd
+*      Socket to finish connecting
+* \param timeoutMs
+*      Milliseconds to wait for the connection to be established
+*
+* \return
+*      1 if the socket is ready to use, 0 if it's still connecting, and -1 if
+*      connecting failed
+*/
+int
+RuntimeLogger::finishLogCollectorConnect(int fd, int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    int ready = poll(&pfd, 1, timeoutMs);
+    if (ready == 0)
+        return 0;
+
+    int err = 0;
+    socklen_t errLength = sizeof(err);
+    if (ready < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err,
+                                &errLength) != 0 || err != 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    struct timeval timeout;
+    timeout.tv_sec = NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS/1000;
+    timeout.tv_usec = 1000*(NanoLogConfig::COLLECTOR_SEND_TIMEOUT_MS%1000);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // The last buffer before an idle period shouldn't wait on an ACK
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Log::CollectorHello hello;
+    memset(&hello, 0, sizeof(hello));
+    strncpy(hello.magic, "NLCOLL1", sizeof(hello.magic));
+    hello.pid = static_cast<uint32_t>(getpid());
+    hello.connection = numLogCollectorConnections;
+    gethostname(hello.hostname, sizeof(hello.hostname) - 1);
+
+    if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello))
+        return -1;
+
+    ++numLogCollectorConnections;
+    return 1;
+}
+
+/**
+* Replaces the connection to the log collector after it was lost (or the log
+* was rotated) without blocking: the new connection is started by one
+* invocation and switched over to, like a rotated log file (see
+* switchLogFile()), by a later one once it's established. Attempts are
+* spaced out by a backoff that doubles up to
+* NanoLogConfig::COLLECTOR_RECONNECT_MAX_BACKOFF_US. This function shall only
+* be invoked by the first shard's compression thread.
+*
+* \return
+*      True if the shards were switched over to a new connection
+*/
+bool
+RuntimeLogger::reconnectLogCollector() {
+    {
+        std::lock_guard<std::mutex> lock(rotationMutex);
+        if (retiringFd >= 0)
+            return false;
+    }
+
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (pendingCollectorFd < 0) {
+        if (now < nextCollectorConnectCycles)
+            return false;
+
+        collectorBackoffUs = std::min(
+                NanoLogConfig::COLLECTOR_RECONNECT_MAX_BACKOFF_US,
+                std::max(NanoLogConfig::COLLECTOR_RECONNECT_MIN_BACKOFF_US,
+                         2*collectorBackoffUs));
+        nextCollectorConnectCycles = now + PerfUtils::Cycles::fromNanoseconds(
+                                            1000*uint64_t(collectorBackoffUs));
+        pendingCollectorFd = connectLogCollector();
+        if (pendingCollectorFd < 0)
+            return false;
+    }
+
+    // Give the connection until the next attempt is due
+    int connected = finishLogCollectorConnect(pendingCollectorFd, 0);
+    if (connected == 0 && now < nextCollectorConnectCycles)
+        return false;
+
+    int newFd = pendingCollectorFd;
+    pendingCollectorFd = -1;
+    if (connected <= 0) {
+        close(newFd);
+        return false;
+    }
+
+    rotationRequested = false;
+    logCollectorLost = false;
+    collectorBackoffUs = 0;
+    nextCollectorConnectCycles = 0;
+    logFileBytesSubmitted = 0;
+    nextRotationSizeCheck = 0;
+    logFileOpenCycles = now;
+
+    // The connection that was lost (if there was one) is retired like a
+    // rotated log file
+    std::lock_guard<std::mutex> lock(rotationMutex);
+    retiringFd = outputFd;
+    retiringFdUsers = static_cast<uint32_t>(shards.size());
+    outputFd = newFd;
+    checkpointPersisted = false;
+    ++logFileGeneration;
+    return true;
+}
+
+/**
+* Sets the limits at which the compression threads rotate the log file (see
+* NanoLog.h). This function is thread safe; the limits apply from the next
+* output buffer written on.
+*
+* \param maxBytes
+*      Rotate the log file once it holds this many bytes; 0 disables the limit
+* \param maxAgeSeconds
+*      Rotate the log file once it has been written to for this many seconds;
+*      0 disables the limit
+*/
+void
+RuntimeLogger::setLogRotation(uint64_t maxBytes, uint32_t maxAgeSeconds) {
+    nanoLogSingleton.rotationMaxBytes = maxBytes;
+    nanoLogSingleton.rotationMaxAgeCycles =
+                        PerfUtils::Cycles::fromSeconds(maxAgeSeconds);
+    nanoLogSingleton.nextRotationSizeCheck = 0;
+}
+
+/**
+* Requests the compression threads to rotate the log file at their next
+* output buffer boundary (see NanoLog.h). This only sets a flag, so it is
+* safe to invoke from a signal handler.
+*/
+void
+RuntimeLogger::rotateLogFile() {
+    nanoLogSingleton.rotationRequested = true;
+}
+
+/**
+* Renames the current log file to "<logFilePath>.<n>" and opens a fresh file
+* at logFilePath for the shards to switch over to (see switchLogFile()). This
+* function shall only be invoked by the first shard's compression thread, and
+* if a previous rotation has not been completed by all the shards yet, the
+* request is left pending.
+*
+* \return
+*      True if the log file was rotated; false if the rotation was postponed
+*      or failed (in which case the current file continues to be used)
+*/
+bool
+RuntimeLogger::rotateLogFile_internal() {
+    if (outputEngine == COLLECTOR)
+        return reconnectLogCollector();
+
+    {
+        std::lock_guard<std::mutex> lock(rotationMutex);
+        if (retiringFd >= 0)
+            return false;
+    }
+
+    rotationRequested = false;
+
+    std::string rotatedPath;
+    for (uint32_t n = numLogFilesRotated + 1; ; ++n) {
+        rotatedPath = logFilePath + "." + std::to_string(n);
+        if (access(rotatedPath.c_str(), F_OK) != 0)
+            break;
+    }
+
+    // The file may have been moved away already (i.e. by an external tool)
+    // in which case there's nothing to rename.
+    int renameError = 0;
+    if (rename(logFilePath.c_str(), rotatedPath.c_str()) != 0)
+        renameError = errno;
+
+    if (renameError != 0 && renameError != ENOENT) {
+        fprintf(stderr, "NanoLog could not rotate the log file \"%s\" to "
+                "\"%s\" (%s); logging continues to the current file.\r\n",
+                logFilePath.c_str(), rotatedPath.c_str(),
+                strerror(renameError));
+    }
+
+    bool renamed = (renameError == 0);
+    int newFd = -1;
+    if (renamed || renameError == ENOENT) {
+        newFd = open(logFilePath.c_str(), NanoLogConfig::FILE_PARAMS, 0666);
+        if (newFd < 0) {
+            fprintf(stderr, "NanoLog could not open a new log file at "
+                    "\"%s\" (%s); logging continues to the current "
+                    "file.\r\n", logFilePath.c_str(), strerror(errno));
+            if (renamed)
+                rename(rotatedPath.c_str(), logFilePath.c_str());
+        }
+    }
+
+    // Restart the limits either way so a failure isn't retried on every pass
+    logFileBytesSubmitted = 0;
+    nextRotationSizeCheck = 0;
+    logFileOpenCycles = PerfUtils::Cycles::rdtsc();
+
+    if (newFd < 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(rotationMutex);
+    retiringFd = outputFd;
+    retiringFdUsers = static_cast<uint32_t>(shards.size());
+    outputFd = newFd;
+    ++numLogFilesRotated;
+
+    // The other shards hold their output for the new file until the first
+    // shard's Checkpoint is persisted.
+    checkpointPersisted = false;
+    ++logFileGeneration;
+    return true;
+}
+
+/**
+* Switches a shard over to the current log file after a rotation. The
+* shard's outstanding writes to the old file are waited on first, and the
+* last shard to let go of the old file closes it. The shard then re-emits
+* the dictionary entries so that the new file can be decoded on its own.
+* This function shall only be invoked by the shard's compression thread
+* while its Encoder is empty.
+*
+* \param shard
+*      Shard to switch over
+*/
+void
+RuntimeLogger::switchLogFile(CompressionShard *shard) {
+    if (shard->output->getNumInFlight() > 0)
+        shard->numWritesCompleted += shard->output->waitForAllWrites();
+
+    // Failures writing the old file don't count against the new one
+    shard->numWriteFailuresSeen = shard->output->getNumFailedWrites();
+
+    std::lock_guard<std::mutex> lock(rotationMutex);
+    if (shard->logFd == retiringFd && retiringFd >= 0 &&
+            --retiringFdUsers == 0) {
+        close(retiringFd);
+        retiringFd = -1;
+    }
+
+    shard->logFd = outputFd;
+    shard->logFileGeneration = logFileGeneration;
+    shard->nextInvocationIndexToBePersisted = 0;
+}
+
+/**
+* Accounts for an output buffer submitted to the current log file and
+* requests a rotation if that puts the file past one of the limits set by
+* setLogRotation(). The size of the file is only looked up once enough bytes
+* were submitted to possibly reach the limit.
+*
+* \param fd
+*      File handle of the current log file
+* \param bytesSubmitted
+*      Number of bytes that were submitted to the file
+*/
+void
+RuntimeLogger::checkLogFileLimits(int fd, uint64_t bytesSubmitted) {
+    uint64_t maxBytes = rotationMaxBytes;
+    uint64_t maxAgeCycles = rotationMaxAgeCycles;
+    if (maxBytes == 0 && maxAgeCycles == 0)
+        return;
+
+    uint64_t submitted = (logFileBytesSubmitted += bytesSubmitted);
+    if (maxAgeCycles > 0 &&
+            PerfUtils::Cycles::rdtsc() - logFileOpenCycles >= maxAgeCycles) {
+        rotationRequested = true;
+        return;
+    }
+
+    if (maxBytes == 0 || submitted < nextRotationSizeCheck)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return;
+
+    // A connection to the log collector has no size of its own
+    uint64_t fileBytes = S_ISREG(st.st_mode) ?
+                            static_cast<uint64_t>(st.st_size) : submitted;
+    if (fileBytes >= maxBytes)
+        rotationRequested = true;
+    else
+        nextRotationSizeCheck = submitted + (maxBytes - fileBytes);
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setCompressionThreads_internal(uint32_t numThreads) {
+    if (numThreads == 0)
+        numThreads = 1;
+
+    if (numThreads == shards.size())
+        return;
+
+    sync();
+    stopCompressionThreads();
+
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        std::vector<StagingBuffer *> allBuffers;
+        for (CompressionShard *shard : shards) {
+            allBuffers.insert(allBuffers.end(), shard->threadBuffers.begin(),
+                              shard->threadBuffers.end());
+            shard->threadBuffers.clear();
+        }
+
+        while (shards.size() > numThreads) {
+            shards.front()->absorbMetrics(*shards.back());
+            delete shards.back();
+            shards.pop_back();
+        }
+
+        while (shards.size() < numThreads) {
+            uint32_t shardId = static_cast<uint32_t>(shards.size());
+            shards.push_back(new CompressionShard(shardId, outputBufferSize,
+                                                  outputEngine,
+                                                  blockCompression));
+        }
+
+        // Redistribute the StagingBuffers over the new set of shards. A single
+        // StagingBuffer is only ever drained by one shard at a time, so its
+        // log messages stay in order in the file.
+        for (StagingBuffer *sb : allBuffers)
+            shards[sb->getId() % shards.size()]->threadBuffers.push_back(sb);
+    }
+
+    startCompressionThreads(false);
+}
+
+/**
+* Restricts a shard's running compression thread to compressionThreadCpus, or
+* returns it to defaultCpuAffinity if the threads aren't pinned. bufferMutex
+* must be held.
+*
+* \param shard
+*      Shard whose compression thread to move
+*/
+void
+RuntimeLogger::applyCompressionThreadAffinity(CompressionShard *shard) {
+    const cpu_set_t *cpus = (compressionThreadsPinned) ? &compressionThreadCpus
+                                                       : &defaultCpuAffinity;
+    int err = pthread_setaffinity_np(shard->compressionThread.native_handle(),
+                                     sizeof(cpu_set_t), cpus);
+    if (err) {
+        fprintf(stderr, "NanoLog Warning: Could not set the CPU affinity of "
+                        "compression thread %u (%s)\r\n", shard->id,
+                        strerror(err));
+    }
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setCompressionThreadCpus_internal(const std::vector<int> &cpus)
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    CPU_ZERO(&compressionThreadCpus);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &compressionThreadCpus);
+    }
+
+    compressionThreadsPinned = (CPU_COUNT(&compressionThreadCpus) > 0);
+    for (CompressionShard *shard : shards) {
+        if (shard->compressionThread.joinable())
+            applyCompressionThreadAffinity(shard);
+    }
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setOutputBufferSize_internal(uint32_t bytes) {
+    // Output is written in 512B multiples (see O_DIRECT in the compression
+    // thread), so keep the buffers a multiple of that.
+    bytes = std::max(bytes, NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE);
+    bytes = std::min(bytes, NanoLogConfig::MAX_OUTPUT_BUFFER_SIZE);
+    bytes = (bytes + 511) & ~511U;
+
+    if (bytes == outputBufferSize)
+        return;
+
+    sync();
+    stopCompressionThreads();
+
+    outputBufferSize = bytes;
+    for (CompressionShard *shard : shards) {
+        if (!shard->allocateOutputBuffers(outputBufferSize, outputEngine,
+                                          blockCompression))
+            shard->allocateOutputBuffers(outputBufferSize, POSIX_AIO,
+                                         blockCompression);
+    }
+
+    startCompressionThreads(false);
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setOutputEngine_internal(OutputEngine engine) {
+    if (engine >= NUM_OUTPUT_ENGINES || engine == COLLECTOR)
+        engine = POSIX_AIO;
+
+    // Kept for when the output goes back to a file
+    if (outputEngine == COLLECTOR) {
+        fileOutputEngine = engine;
+        return;
+    }
+
+    if (engine == outputEngine)
+        return;
+
+    sync();
+    stopCompressionThreads();
+
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (!shards[i]->allocateOutputBuffers(outputBufferSize, engine,
+                                              blockCompression)) {
+            fprintf(stderr, "NanoLog: the %s output engine is not supported "
+                    "on this system; falling back to %s\r\n",
+                    OutputBackend::getEngineName(engine),
+                    OutputBackend::getEngineName(POSIX_AIO));
+
+            // Put the shards that already switched back as well
+            engine = POSIX_AIO;
+            for (size_t j = 0; j < i; ++j)
+                shards[j]->allocateOutputBuffers(outputBufferSize, engine,
+                                                 blockCompression);
+            break;
+        }
+    }
+
+    outputEngine = engine;
+    startCompressionThreads(false);
+}
+
+/**
+* Sets the engine used by the background threads to write the log file
+* (see NanoLog.h). This function is *not* thread safe with respect to
+* setLogFile() and sync().
+*
+* \param engine
+*      Output engine to switch to
+*/
+void
+RuntimeLogger::setOutputEngine(OutputEngine engine) {
+    nanoLogSingleton.setOutputEngine_internal(engine);
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setBlockCompression_internal(BlockCompression compression) {
+    if (compression >= NUM_BLOCK_COMPRESSIONS)
+        compression = BLOCK_COMPRESSION_NONE;
+
+    if (compression == blockCompression)
+        return;
+
+    sync();
+    stopCompressionThreads();
+
+    // The shards are stopped, so none of them has writes in flight
+    for (CompressionShard *shard : shards)
+        shard->output->setBlockCompression(compression);
+
+    blockCompression = compression;
+    startCompressionThreads(false);
+}
+
+/**
+* Sets the general purpose compressor the background threads run the output
+* buffers through (see NanoLog.h). This function is *not* thread safe with
+* respect to setLogFile() and sync().
+*
+* \param compression
+*      Block compressor to switch to
+*/
+void
+RuntimeLogger::setBlockCompression(BlockCompression compression) {
+    nanoLogSingleton.setBlockCompression_internal(compression);
+}
+
+/**
+* Sets the number of background compression threads (see NanoLog.h). This
+* function is *not* thread safe with respect to setLogFile() and sync().
+*
+* \param numThreads
+*      Number of compression threads to run; 0 is treated as 1.
+*/
+void
+RuntimeLogger::setCompressionThreads(uint32_t numThreads) {
+    nanoLogSingleton.setCompressionThreads_internal(numThreads);
+}
+
+/**
+* Sets the action logging threads take when their StagingBuffer is too full
+* to hold a new log message.
+*
+* \param policy
+*      OverflowPolicy enum that specifies what to do when full
+*/
+void
+RuntimeLogger::setOverflowPolicy(OverflowPolicy policy) {
+    if (policy < 0 || policy >= NUM_OVERFLOW_POLICIES)
+        policy = OverflowPolicy::BLOCK;
+    nanoLogSingleton.currentOverflowPolicy = policy;
+}
+
+/**
+* Sets the log level from which on log messages are written out right away
+* (see NanoLog::setPriorityLogLevel()).
+*
+* \param logLevel
+*      Least severe log level to write out right away
+* \param sync
+*      fdatasync() the log file after the writes of priority log messages
+*/
+void
+RuntimeLogger::setPriorityLogLevel(LogLevel logLevel, bool sync) {
+    if (logLevel < 0)
+        logLevel = static_cast<LogLevel>(0);
+    else if (logLevel >= NUM_LOG_LEVELS)
+        logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
+
+    nanoLogSingleton.priorityLogLevel.store(logLevel,
+                                            std::memory_order_relaxed);
+    nanoLogSingleton.syncPriorityLogs.store(sync, std::memory_order_relaxed);
+}
+
+/**
+* Sets the byte size of the StagingBuffers allocated for threads that have not
+* logged or preallocated yet. Existing StagingBuffers are not resized.
+*
+* \param bytes
+*      Size of the new StagingBuffers; this is clamped to the range
+*      [MIN_STAGING_BUFFER_SIZE, MAX_STAGING_BUFFER_SIZE]
+*/
+void
+RuntimeLogger::setStagingBufferSize(uint32_t bytes) {
+    bytes = std::max(bytes, NanoLogConfig::MIN_STAGING_BUFFER_SIZE);
+    bytes = std::min(bytes, NanoLogConfig::MAX_STAGING_BUFFER_SIZE);
+    nanoLogSingleton.stagingBufferSize = bytes;
+}
+
+/**
+* Sets how the StagingBuffers allocated for threads that have not logged or
+* preallocated yet are placed in memory. Existing StagingBuffers stay put.
+*
+* \param numaLocal
+*      Place each StagingBuffer on the NUMA node of its thread
+* \param hugePages
+*      Back the StagingBuffers with 2MB pages
+* \param mirrored
+*      Map the storage of each StagingBuffer twice so that log messages never
+*      wrap around its end (see StagingBuffer::mirrored)
+*/
+void
+RuntimeLogger::setStagingBufferPlacement(bool numaLocal, bool hugePages,
+                                         bool mirrored) {
+    std::lock_guard<std::mutex> lock(nanoLogSingleton.bufferMutex);
+    nanoLogSingleton.numaLocalStagingBuffers = numaLocal;
+    nanoLogSingleton.hugePageStagingBuffers = hugePages;
+    nanoLogSingleton.mirroredStagingBuffers = mirrored;
+}
+
+/**
+* Backs the StagingBuffers allocated for threads that have not logged or
+* preallocated yet with crash recovery files in a directory (see
+* NanoLog::setCrashRecoveryDirectory()).
+*
+* \param directory
+*      Directory to create the files in; nullptr or "" disables crash recovery
+*/
+void
+RuntimeLogger::setCrashRecoveryDirectory(const char *directory) {
+    // The compression agent depends on the files for good
+    if (nanoLogSingleton.compressionAgentEnabled)
+        return;
+
+    nanoLogSingleton.setCrashRecoveryDirectory_internal(directory);
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setCompressionAgent(const char *directory) {
+    nanoLogSingleton.setCompressionAgent_internal(directory);
+}
+
+/**
+* Restricts the compression threads, including the ones started later on, to
+* a set of CPUs.
+*
+* \param cpus
+*      Ids of the CPUs the threads may run on; an empty set (or one without
+*      any valid ids) unpins the threads
+*/
+void
+RuntimeLogger::setCompressionThreadCpus(const std::vector<int> &cpus) {
+    nanoLogSingleton.setCompressionThreadCpus_internal(cpus);
+}
+
+/**
+* Returns the id of the CPU that each compression thread last ran on, in
+* shard order, or -1 for a thread that hasn't run yet.
+*/
+std::vector<int>
+RuntimeLogger::getCoreIdsOfBackgroundThreads() {
+    std::lock_guard<std::mutex> lock(nanoLogSingleton.bufferMutex);
+    std::vector<int> coreIds;
+    for (CompressionShard *shard : nanoLogSingleton.shards)
+        coreIds.push_back(shard->coreId);
+
+    return coreIds;
+}
+
+/**
+* Changes the byte size of the compression threads' output buffers. Like
+* setLogFile(), the pending log messages are persisted before the buffers are
+* swapped out and this function is *not* thread safe.
+*
+* \param bytes
+*      Size of each output buffer; this is clamped to the range
+*      [MIN_OUTPUT_BUFFER_SIZE, MAX_OUTPUT_BUFFER_SIZE] and rounded up to a
+*      multiple of 512 bytes
+*/
+void
+RuntimeLogger::setOutputBufferSize(uint32_t bytes) {
+    nanoLogSingleton.setOutputBufferSize_internal(bytes);
+}
+
 /**
 * Sets the minimum log level new NANO_LOG messages will have to meet before
 * they are saved. Anything lower will be dropped.
@@ -698,7 +2469,169 @@ RuntimeLogger::setLogLevel(LogLevel logLevel) {
         logLevel = static_cast<LogLevel>(0);
     else if (logLevel >= NUM_LOG_LEVELS)
         logLevel = static_cast<LogLevel>(NUM_LOG_LEVELS - 1);
-    nanoLogSingleton.currentLogLevel = logLevel;
+
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::lock_guard<std::mutex> lock(rl.logSiteMutex);
+    rl.currentLogLevel = logLevel;
+    rl.refreshLogSites();
+}
+
+/**
+* Adds a filter that enables or disables the log invocation sites matching a
+* pattern regardless of the log level (see NanoLog.h). Invalid matches and
+* log identifiers are ignored.
+*
+* \param match
+*      What the pattern is matched against
+* \param pattern
+*      Log identifier, file glob, or format substring to match
+* \param enabled
+*      Whether the matching sites should log
+*/
+void
+RuntimeLogger::setLogSitesEnabled(LogSiteMatch match, const char *pattern,
+                                  bool enabled) {
+    if (match < 0 || match >= NUM_LOG_SITE_MATCHES || pattern == nullptr)
+        return;
+
+    LogSiteRule rule = {match, pattern, UNASSIGNED_LOGID, enabled};
+    if (match == MATCH_LOG_ID) {
+        char *end = nullptr;
+        long logId = strtol(pattern, &end, 10);
+        if (end == pattern || *end != '\0' || logId < 0 || logId > INT32_MAX)
+            return;
+
+        rule.logId = static_cast<int>(logId);
+    }
+
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::lock_guard<std::mutex> lock(rl.logSiteMutex);
+    rl.logSiteRules.push_back(rule);
+    if (match == MATCH_LOG_ID)
+        rl.logIdRulesSet = true;
+
+    rl.refreshLogSites();
+}
+
+/**
+* Removes all the log site filters, leaving the log level in charge of every
+* log invocation site again.
+*/
+void
+RuntimeLogger::clearLogSiteFilters() {
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::lock_guard<std::mutex> lock(rl.logSiteMutex);
+    rl.logSiteRules.clear();
+    rl.logIdRulesSet = false;
+    rl.refreshLogSites();
+}
+
+/**
+* Evaluates the log level and log site filters for a log invocation site.
+* logSiteMutex must be held.
+*
+* \param site
+*      Site to evaluate
+*
+* \return
+*      LOG_SITE_ENABLED or LOG_SITE_DISABLED
+*/
+int
+RuntimeLogger::evaluateLogSite(const LogSite &site) {
+    for (auto rule = logSiteRules.rbegin(); rule != logSiteRules.rend();
+            ++rule) {
+        bool matched = false;
+        switch (rule->match) {
+            case MATCH_LOG_ID:
+                matched = (rule->logId ==
+                                __atomic_load_n(site.logId, __ATOMIC_ACQUIRE));
+                break;
+            case MATCH_FILE:
+                matched = (fnmatch(rule->pattern.c_str(), site.filename, 0)
+                                                                        == 0);
+                break;
+            case MATCH_FORMAT:
+                matched = (strstr(site.format, rule->pattern.c_str())
+                                                                    != nullptr);
+                break;
+            default:
+                break;
+        }
+
+        if (matched)
+            return (rule->enabled) ? LOG_SITE_ENABLED : LOG_SITE_DISABLED;
+    }
+
+    return (site.severity > currentLogLevel) ? LOG_SITE_DISABLED
+                                             : LOG_SITE_ENABLED;
+}
+
+/**
+* Rewrites the filter words of all the log invocation sites reached so far
+* after a change to the log level or filters. logSiteMutex must be held.
+*/
+void
+RuntimeLogger::refreshLogSites() {
+    for (const LogSite &site : logSites)
+        __atomic_store_n(site.filter, evaluateLogSite(site), __ATOMIC_RELAXED);
+}
+
+/**
+* Rewrites the filter word of a single log invocation site, i.e. after it's
+* been assigned a log identifier. logSiteMutex must be held.
+*
+* \param logId
+*      Log identifier of the site, as passed to isLogSiteEnabled(); sites
+*      that haven't been reached yet are resolved on their first invocation
+*/
+void
+RuntimeLogger::refreshLogSite(const int *logId) {
+    auto it = logSiteIndexes.find(logId);
+    if (it == logSiteIndexes.end())
+        return;
+
+    const LogSite &site = logSites[it->second];
+    __atomic_store_n(site.filter, evaluateLogSite(site), __ATOMIC_RELAXED);
+}
+
+/**
+* Slow path of isLogSiteEnabled() that registers a log invocation site on
+* its first invocation and resolves its filter word.
+*
+* \param[in/out] siteFilter
+*      Filter word of the site
+* \param logId
+*      Log identifier of the site
+* \param filename
+*      File containing the log invocation
+* \param linenum
+*      Line number of the log invocation within filename
+* \param severity
+*      LogLevel of the log invocation
+* \param format
+*      printf format string of the log invocation
+*
+* \return
+*      true if the log statement should be recorded
+*/
+bool
+RuntimeLogger::resolveLogSite(int &siteFilter, const int *logId,
+                              const char *filename, int linenum,
+                              LogLevel severity, const char *format) {
+    std::lock_guard<std::mutex> lock(logSiteMutex);
+
+    // Another thread may have resolved the site in the meantime
+    int state = __atomic_load_n(&siteFilter, __ATOMIC_RELAXED);
+    if (state == LOG_SITE_UNRESOLVED) {
+        LogSite site = {&siteFilter, logId, filename, linenum, severity,
+                        format};
+        logSiteIndexes[logId] = logSites.size();
+        logSites.push_back(site);
+        state = evaluateLogSite(site);
+        __atomic_store_n(&siteFilter, state, __ATOMIC_RELAXED);
+    }
+
+    return state == LOG_SITE_ENABLED;
 }
 
 /**
@@ -714,10 +2647,522 @@ RuntimeLogger::sync() {
     return;
 #endif
 
-    std::unique_lock<std::mutex> lock(nanoLogSingleton.condMutex);
-    nanoLogSingleton.syncRequested = true;
-    nanoLogSingleton.workAdded.notify_all();
-    nanoLogSingleton.hintQueueEmptied.wait(lock);
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::unique_lock<std::mutex> lock(rl.condMutex);
+    uint64_t generation = ++rl.syncGeneration;
+    rl.workAdded.notify_all();
+
+    // Every shard must complete a pass after the request was made
+    rl.hintQueueEmptied.wait(lock, [&rl, generation]() {
+        if (rl.compressionThreadShouldExit)
+            return true;
+
+        for (CompressionShard *shard : rl.shards) {
+            if (shard->syncGenerationCompleted < generation)
+                return false;
+        }
+        return true;
+    });
+    lock.unlock();
+
+    if (rl.compressionAgentEnabled)
+        rl.waitForCompressionAgent();
+}
+
+/**
+* Returns the position of the calling thread's next log message (see
+* NanoLog::getLogPosition()).
+*/
+LogPosition
+RuntimeLogger::getLogPosition() {
+    LogPosition position = {UINT32_MAX, 0};
+    if (stagingBuffer != nullptr) {
+        position.bufferId = stagingBuffer->getId();
+        position.offset = stagingBuffer->getProducerPosition();
+    }
+
+    return position;
+}
+
+/**
+* Returns true if the log messages before a position have been written to the
+* log file (see NanoLog::isPersisted()).
+*
+* \param position
+*      Position returned by getLogPosition()
+*/
+bool
+RuntimeLogger::isPersisted(const LogPosition &position) {
+    // The calling thread's own StagingBuffer can't be retired under it
+    StagingBuffer *sb = stagingBuffer;
+    if (sb != nullptr && sb->getId() == position.bufferId &&
+            !sb->isAgentBuffer())
+        return sb->persistedPosition >= position.offset;
+
+    // A StagingBuffer is only retired once everything logged to it is
+    // persisted, so one that's not assigned to a shard anymore is done
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::lock_guard<std::mutex> lock(rl.bufferMutex);
+    for (CompressionShard *shard : rl.shards) {
+        std::lock_guard<std::mutex> shardLock(shard->bufferMutex);
+        for (StagingBuffer *candidate : shard->threadBuffers) {
+            if (candidate->getId() == position.bufferId)
+                return candidate->persistedPosition >= position.offset;
+        }
+    }
+
+    return true;
+}
+
+/**
+* Invokes a callback once the log messages before a position have been written
+* to the log file (see NanoLog::notifyWhenPersisted()).
+*
+* \param position
+*      Position returned by getLogPosition()
+* \param callback
+*      Function to invoke once the position is persisted
+*/
+void
+RuntimeLogger::notifyWhenPersisted(const LogPosition &position,
+                                   std::function<void()> callback) {
+    // The compression thread checks the StagingBuffer's persistedPosition
+    // against the callbacks under the same lock, so none is missed
+    RuntimeLogger &rl = nanoLogSingleton;
+    {
+        std::lock_guard<std::mutex> lock(rl.bufferMutex);
+        for (CompressionShard *shard : rl.shards) {
+            std::lock_guard<std::mutex> shardLock(shard->bufferMutex);
+            for (StagingBuffer *sb : shard->threadBuffers) {
+                if (sb->getId() != position.bufferId ||
+                        sb->persistedPosition >= position.offset)
+                    continue;
+
+                shard->persistedCallbacks.emplace_back(sb, position.offset,
+                                                       std::move(callback));
+                return;
+            }
+        }
+    }
+
+    callback();
+}
+
+/**
+* Waits for the compression agent to drain the StagingBuffers handed to it,
+* the way sync() waits for the compression threads. A buffer the agent makes
+* no progress on for NanoLogConfig::COMPRESSION_AGENT_SYNC_TIMEOUT_US (e.g.
+* because there's no agent running) ends the wait.
+*/
+void
+RuntimeLogger::waitForCompressionAgent() {
+    std::vector<StagingBuffer *> buffers;
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        buffers = agentBuffers;
+    }
+
+    const uint64_t timeoutCycles = PerfUtils::Cycles::fromNanoseconds(
+                        1000*uint64_t(NanoLogConfig::COMPRESSION_AGENT_SYNC_TIMEOUT_US));
+    for (StagingBuffer *sb : buffers) {
+        char *persisted = sb->persistedPos;
+        uint64_t lastProgress = PerfUtils::Cycles::rdtsc();
+        while (sb->persistedPos != sb->producerPos) {
+            uint64_t now = PerfUtils::Cycles::rdtsc();
+            if (sb->persistedPos != persisted) {
+                persisted = sb->persistedPos;
+                lastProgress = now;
+            } else if (now - lastProgress > timeoutCycles) {
+                return;
+            }
+
+            usleep(NanoLogConfig::IDLE_MAX_BACKOFF_US);
+        }
+    }
+}
+
+/**
+* Wakes up the compression threads parked waiting for more log messages. This
+* is invoked by the logging threads when they see compressionThreadsParked,
+* so it's kept out of line to keep the logging fast path small.
+*/
+void
+RuntimeLogger::wakeupCompressionThreads() {
+    RuntimeLogger &rl = nanoLogSingleton;
+    if (!rl.compressionThreadsParked.exchange(false))
+        return;
+
+    std::lock_guard<std::mutex> lock(rl.condMutex);
+    rl.workAdded.notify_all();
+}
+
+/**
+* Wakes the compression threads up for a priority log message, regardless of
+* whether they're parked or backing off, and has the ones that are busy take
+* another pass before they go idle. This is invoked by the logging threads
+* (see StagingBuffer::flagPriorityLog()).
+*/
+void
+RuntimeLogger::wakeupForPriorityLogs() {
+    RuntimeLogger &rl = nanoLogSingleton;
+    std::lock_guard<std::mutex> lock(rl.condMutex);
+    ++rl.priorityLogGeneration;
+    rl.compressionThreadsParked = false;
+    rl.workAdded.notify_all();
+}
+
+/**
+* Hands the calling thread a drained StagingBuffer from the pool, if there is
+* one of the requested size and placement, so that it doesn't have to
+* allocate and fault in a new one.
+*
+* \param bufferId
+*      Identifier the adopted buffer is to take on
+* \param bufferSize
+*      Byte size of the StagingBuffer the thread needs
+* \param numaLocal
+*      The buffer must reside on the calling thread's NUMA node
+* \param hugePages
+*      The buffer must (or must not) be backed by huge pages
+* \param mirrored
+*      The buffer must (or must not) be a mirrored ring, if it can be one
+*
+* \return
+*      The adopted StagingBuffer, reset for the calling thread, or nullptr if
+*      none fit and a new one has to be allocated
+*/
+RuntimeLogger::StagingBuffer *
+RuntimeLogger::adoptPooledStagingBuffer(uint32_t bufferId, uint32_t bufferSize,
+                                        bool numaLocal, bool hugePages,
+                                        bool mirrored)
+{
+    int numaNode = (numaLocal) ? Util::getNumaNode() : -1;
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    mirrored = mirrored && !hugePages && bufferSize % pageSize == 0;
+    bool recoverable = crashRecoveryFd.load(std::memory_order_relaxed) >= 0;
+    StagingBuffer *sb = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(stagingBufferPoolMutex);
+        for (size_t i = 0; i < stagingBufferPool.size(); ++i) {
+            StagingBuffer *candidate = stagingBufferPool[i];
+
+            // Recoverable buffers live in their files rather than where the
+            // thread would have placed them, so only their size has to fit
+            bool fits = candidate->getCapacity() == bufferSize &&
+                    (candidate->recoveryFileBytes > 0) == recoverable &&
+                    (recoverable || (candidate->hugePages == hugePages &&
+                                     candidate->mirrored == mirrored &&
+                                     candidate->numaNode == numaNode));
+            if (fits) {
+                sb = candidate;
+                stagingBufferPool[i] = stagingBufferPool.back();
+                stagingBufferPool.pop_back();
+                ++numStagingBuffersReused;
+                break;
+            }
+        }
+    }
+
+    if (sb)
+        sb->reset(bufferId);
+
+    return sb;
+}
+
+/**
+* Retires a StagingBuffer whose thread has exited and whose contents have all
+* been compressed by returning it to the pool, or freeing it if the pool is
+* full. This shall only be invoked by the compression thread once
+* StagingBuffer::checkCanDelete() is true; the caller removes the buffer
+* from its shard.
+*
+* \param sb
+*      StagingBuffer to retire
+*/
+void
+RuntimeLogger::releaseStagingBuffer(StagingBuffer *sb) {
+    {
+        std::lock_guard<std::mutex> lock(stagingBufferPoolMutex);
+        if (stagingBufferPool.size() <
+                NanoLogConfig::STAGING_BUFFER_POOL_SIZE) {
+            stagingBufferPool.push_back(sb);
+            return;
+        }
+    }
+
+    freeStagingBuffer(sb);
+}
+
+/**
+* Allocates a StagingBuffer within a new crash recovery file, if crash recovery
+* is enabled (see NanoLog::setCrashRecoveryDirectory()). The file is laid out
+* as a RecoveryBufferHeader followed by the StagingBuffer object and then its
+* storage, and mapped shared so that everything the producer and consumer
+* write to the buffer lands in the file without extra work.
+*
+* \param bufferId
+*      Identifier for the new StagingBuffer
+* \param bufferSize
+*      Byte size of the new StagingBuffer's storage
+*
+* \return
+*      The new StagingBuffer, or nullptr if crash recovery is disabled or the
+*      file could not be set up, in which case the caller allocates the buffer
+*      in memory instead
+*/
+RuntimeLogger::StagingBuffer *
+RuntimeLogger::allocateRecoverableStagingBuffer(uint32_t bufferId,
+                                                uint32_t bufferSize)
+{
+    std::string filename;
+    {
+        std::lock_guard<std::mutex> lock(crashRecoveryMutex);
+        if (crashRecoveryPrefix.empty())
+            return nullptr;
+
+        filename = crashRecoveryPrefix + ".buffer" + std::to_string(bufferId);
+    }
+
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t objectOffset = RECOVERY_FILE_OBJECT_OFFSET;
+    size_t storageOffset = (objectOffset + sizeof(StagingBuffer) +
+                            pageSize - 1) & ~(pageSize - 1);
+    size_t fileBytes = storageOffset + bufferSize;
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "NanoLog could not create the crash recovery file "
+                "\"%s\" (%s); the StagingBuffer is kept in memory "
+                "instead.\r\n", filename.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, fileBytes) == 0)
+        mapping = mmap(nullptr, fileBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+    int error = errno;
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "NanoLog could not map the crash recovery file "
+                "\"%s\" (%s); the StagingBuffer is kept in memory "
+                "instead.\r\n", filename.c_str(), strerror(error));
+        unlink(filename.c_str());
+        return nullptr;
+    }
+
+    // Fault the storage in for writing now rather than on the logging path
+    char *base = static_cast<char*>(mapping);
+    for (size_t offset = storageOffset; offset < fileBytes; offset += pageSize)
+        base[offset] = 0;
+
+    StagingBuffer *sb = new (base + objectOffset) StagingBuffer(bufferId,
+                                    bufferSize, false, false, false,
+                                    base + storageOffset);
+    sb->recoveryFile = filename;
+    sb->recoveryFileBytes = fileBytes;
+    sb->releasedPos = &sb->persistedPos;
+
+    auto fieldOffset = [base](const volatile void *field) {
+        return downCast<uint32_t>(
+                static_cast<const volatile char*>(field) - base);
+    };
+
+    Log::RecoveryBufferHeader *header =
+                            reinterpret_cast<Log::RecoveryBufferHeader*>(base);
+    header->storageAddress = reinterpret_cast<uint64_t>(sb->storage);
+    header->storageOffset = storageOffset;
+    header->capacity = bufferSize;
+    header->idOffset = fieldOffset(&sb->id);
+    header->producerPosOffset = fieldOffset(&sb->producerPos);
+    header->endOfRecordedSpaceOffset = fieldOffset(&sb->endOfRecordedSpace);
+    header->persistedPosOffset = fieldOffset(&sb->persistedPos);
+    header->consumerPosOffset = fieldOffset(&sb->consumerPos);
+    header->numLogsDroppedOffset = fieldOffset(&sb->numLogsDropped);
+    header->lastDropTimestampOffset = fieldOffset(&sb->lastDropTimestamp);
+    header->numLogsDroppedReportedOffset =
+                                    fieldOffset(&sb->numLogsDroppedReported);
+
+    // A compression agent may map the file as soon as it exists, so the
+    // magic goes in last to mark the rest as set up
+    std::atomic_thread_fence(std::memory_order_release);
+    strncpy(header->magic, "NLRCBF1", sizeof(header->magic));
+
+    return sb;
+}
+
+/**
+* Frees a StagingBuffer that no thread or shard refers to anymore, along with
+* its crash recovery file if it has one.
+*
+* \param sb
+*      StagingBuffer to free
+*/
+void
+RuntimeLogger::freeStagingBuffer(StagingBuffer *sb) {
+    if (sb->recoveryFileBytes == 0) {
+        delete sb;
+        return;
+    }
+
+    std::string filename = sb->recoveryFile;
+    size_t fileBytes = sb->recoveryFileBytes;
+    void *mapping = reinterpret_cast<char*>(sb) - RECOVERY_FILE_OBJECT_OFFSET;
+    sb->~StagingBuffer();
+    munmap(mapping, fileBytes);
+    unlink(filename.c_str());
+}
+
+/**
+* Internal version of setCrashRecoveryDirectory(). This starts a new crash
+* recovery dictionary with a Checkpoint and the log invocation sites
+* registered so far; each site registered afterwards is appended as it's
+* registered (see recordRecoverySite()). The previous dictionary is removed.
+*
+* \param directory
+*      Directory to create the files in; nullptr or "" disables crash recovery
+* \param compressionAgent
+*      Mark the dictionary for a compression agent to attach to (see
+*      NanoLog::setCompressionAgent())
+*/
+void
+RuntimeLogger::setCrashRecoveryDirectory_internal(const char *directory,
+                                                  bool compressionAgent) {
+    std::lock_guard<std::mutex> lock(crashRecoveryMutex);
+
+    int oldFd = crashRecoveryFd.exchange(-1);
+    if (oldFd >= 0) {
+        close(oldFd);
+        unlink((crashRecoveryPrefix + ".dictionary").c_str());
+    }
+    crashRecoveryPrefix.clear();
+
+    if (directory == nullptr || *directory == '\0')
+        return;
+
+    std::string prefix = std::string(directory) + "/nanolog." +
+                         std::to_string(getpid());
+    std::string filename = prefix + ".dictionary";
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                  0644);
+    if (fd < 0) {
+        fprintf(stderr, "NanoLog could not create the crash recovery "
+                "dictionary \"%s\" (%s); crash recovery is disabled.\r\n",
+                filename.c_str(), strerror(errno));
+        return;
+    }
+
+    Log::RecoveryDictionaryHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, "NLRCDC1", sizeof(header.magic));
+    header.pid = static_cast<uint32_t>(getpid());
+#ifdef PREPROCESSOR_NANOLOG
+    header.preprocessor = 1;
+#endif
+    header.compressionAgent = compressionAgent;
+    char *pos = reinterpret_cast<char*>(&header.checkpoint);
+    Log::insertCheckpoint(&pos, pos + sizeof(Log::Checkpoint), false);
+
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "NanoLog could not write the crash recovery "
+                "dictionary \"%s\" (%s); crash recovery is disabled.\r\n",
+                filename.c_str(), strerror(errno));
+        close(fd);
+        unlink(filename.c_str());
+        return;
+    }
+
+    crashRecoveryPrefix = prefix;
+    crashRecoveryFd.store(fd);
+
+    // Pairs with the fence in registerInvocationSite_internal(); a site added
+    // concurrently may be recorded twice, which the recovery tool tolerates.
+    // Every site whose registrant missed the new file has its identifier
+    // allocated by now, but it may sit behind one that's still being added,
+    // so go through every allocated identifier rather than size().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t numSites = invocationSites.getNumAllocated();
+    for (uint32_t id = 0; id < numSites; ++id) {
+        while (!invocationSites.isPublished(id))
+            std::this_thread::yield();
+
+        std::string site = Log::encodeRecoverySite(id, invocationSites[id]);
+        if (write(fd, site.data(), site.size()) < 0)
+            break;
+    }
+}
+
+/**
+* Appends a newly registered log invocation site to the crash recovery
+* dictionary. It's written out in a single append so that a crash can only
+* ever cut off the last site.
+*
+* \param fmtId
+*      Log identifier the site was registered as
+*/
+void
+RuntimeLogger::recordRecoverySite(uint32_t fmtId) {
+    std::string site = Log::encodeRecoverySite(fmtId, invocationSites[fmtId]);
+
+    std::lock_guard<std::mutex> lock(crashRecoveryMutex);
+    int fd = crashRecoveryFd.load();
+    if (fd >= 0 && write(fd, site.data(), site.size()) < 0) {
+        fprintf(stderr, "NanoLog could not append to the crash recovery "
+                "dictionary (%s).\r\n", strerror(errno));
+    }
+}
+
+// Documentation in NanoLog.h
+void
+RuntimeLogger::setCompressionAgent_internal(const char *directory) {
+    if (directory == nullptr || *directory == '\0' || compressionAgentEnabled)
+        return;
+
+    setCrashRecoveryDirectory_internal(directory, true);
+    if (crashRecoveryFd.load() < 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(bufferMutex);
+        compressionAgentEnabled = true;
+    }
+
+    // The compression threads only see the StagingBuffers allocated before
+    // this point, which don't need more than their size to drain quickly
+    setOutputBufferSize_internal(std::max(NanoLogConfig::MIN_OUTPUT_BUFFER_SIZE,
+                                          stagingBufferSize));
+}
+
+/**
+* Hands a StagingBuffer of the compression agent whose thread has exited and
+* whose contents the agent has drained to a new thread. The buffer keeps its
+* positions, which the agent tracks, rather than being reset. This shall only
+* be invoked with bufferMutex held.
+*
+* \param bufferSize
+*      Byte size the StagingBuffer must have
+*
+* \return
+*      The adopted StagingBuffer or nullptr if none was available
+*/
+RuntimeLogger::StagingBuffer *
+RuntimeLogger::adoptAgentStagingBuffer(uint32_t bufferSize) {
+    for (StagingBuffer *sb : agentBuffers) {
+        bool drained = sb->shouldDeallocate &&
+                sb->getCapacity() == bufferSize &&
+                sb->consumerPos == sb->producerPos &&
+                sb->persistedPos == sb->producerPos &&
+                sb->numLogsDropped == sb->numLogsDroppedReported;
+        if (drained) {
+            sb->shouldDeallocate = false;
+            sbc.stagingBufferCreated();
+            ++numStagingBuffersReused;
+            return sb;
+        }
+    }
+
+    return nullptr;
 }
 
 /**
@@ -742,7 +3187,7 @@ RuntimeLogger::sync() {
 */
 char *
 RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking) {
-    const char *endOfBuffer = storage + NanoLogConfig::STAGING_BUFFER_SIZE;
+    const char *endOfBuffer = storage + capacity;
 
 #ifdef RECORD_PRODUCER_STATS
     uint64_t start = PerfUtils::Cycles::rdtsc();
@@ -754,11 +3199,23 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
     // if the buffer either completely full or completely empty.
     // Doing this check here ensures that == means completely empty.
     while (minFreeSpace <= nbytes) {
-        // Since consumerPos can be updated in a different thread, we
-        // save a consistent copy of it here to do calculations on
-        char *cachedConsumerPos = consumerPos;
-
-        if (cachedConsumerPos <= producerPos) {
+        // Since consumerPos (or persistedPos, see releasedPos) can be
+        // updated in a different thread, we save a consistent copy of it
+        // here to do calculations on
+        char *cachedConsumerPos = *releasedPos;
+
+        // The consumer may have parked before noticing the buffer fill up
+        if (nanoLogSingleton.compressionThreadsParked.load(
+                                            std::memory_order_relaxed))
+            wakeupCompressionThreads();
+
+        if (mirrored) {
+            // All of the free space is contiguous past producerPos
+            minFreeSpace = (cachedConsumerPos <= producerPos)
+                    ? capacity - static_cast<uint64_t>(producerPos
+                                                        - cachedConsumerPos)
+                    : static_cast<uint64_t>(cachedConsumerPos - producerPos);
+        } else if (cachedConsumerPos <= producerPos) {
             minFreeSpace = endOfBuffer - producerPos;
 
             if (minFreeSpace > nbytes)
@@ -773,6 +3230,7 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
                 // prevents producerPos from updating before endOfRecordedSpace
                 Fence::sfence();
                 producerPos = storage;
+                ++producerLaps;
                 minFreeSpace = cachedConsumerPos - producerPos;
             }
         } else {
@@ -785,6 +3243,10 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
         minFreeSpace = endOfBuffer - storage;
 #endif
 
+        // Have the consumer get to this buffer first while we're blocked
+        if (minFreeSpace <= nbytes && !nearlyFull)
+            nearlyFull = true;
+
         // Needed to prevent infinite loops in tests
         if (!blocking && minFreeSpace <= nbytes)
             return nullptr;
@@ -799,6 +3261,18 @@ RuntimeLogger::StagingBuffer::reserveSpaceInternal(size_t nbytes, bool blocking)
     ++(cyclesProducerBlockedDist[index]);
 #endif
 
+    // Hint the consumer to drain the buffer ahead of the others if it's
+    // close to blocking the producer. The fill level is estimated from the
+    // positions alone; the gap past endOfRecordedSpace counts as free.
+    char *cachedConsumerPos = *releasedPos;
+    uint64_t freeSpace = (cachedConsumerPos <= producerPos)
+                ? capacity - static_cast<uint64_t>(producerPos
+                                                         - cachedConsumerPos)
+                : static_cast<uint64_t>(cachedConsumerPos - producerPos);
+    if (freeSpace < capacity/NanoLogConfig::NEARLY_FULL_FRACTION &&
+            !nearlyFull)
+        nearlyFull = true;
+
     ++numTimesProducerBlocked;
     return producerPos;
 }
@@ -820,6 +3294,15 @@ RuntimeLogger::StagingBuffer::peek(uint64_t *bytesAvailable) {
     // Save a consistent copy of producerPos
     char *cachedProducerPos = producerPos;
 
+    // The data past the end of a mirrored ring continues in its mirror
+    if (mirrored) {
+        *bytesAvailable = (cachedProducerPos >= consumerPos)
+                ? static_cast<uint64_t>(cachedProducerPos - consumerPos)
+                : capacity - static_cast<uint64_t>(consumerPos
+                                                        - cachedProducerPos);
+        return consumerPos;
+    }
+
     if (cachedProducerPos < consumerPos) {
         Fence::lfence(); // Prevent reading new producerPos but old endOf...
         *bytesAvailable = endOfRecordedSpace - consumerPos;
@@ -829,10 +3312,51 @@ RuntimeLogger::StagingBuffer::peek(uint64_t *bytesAvailable) {
 
         // Roll over
         consumerPos = storage;
+        ++consumerLaps;
     }
 
     *bytesAvailable = cachedProducerPos - consumerPos;
     return consumerPos;
 }
 
+/**
+ * Returns the number of bytes logged to the StagingBuffer that the consumer
+ * has yet to consume. The positions are read without synchronizing with the
+ * producer or the consumer, so the value may be slightly stale.
+ */
+uint64_t
+RuntimeLogger::StagingBuffer::getBytesPending() {
+    char *cachedProducerPos = producerPos;
+    char *cachedConsumerPos = consumerPos;
+
+    int64_t bytesPending = cachedProducerPos - cachedConsumerPos;
+    if (bytesPending < 0) {
+        Fence::lfence(); // Read the positions before endOfRecordedSpace
+        bytesPending = (endOfRecordedSpace - cachedConsumerPos)
+                                            + (cachedProducerPos - storage);
+    }
+
+    return static_cast<uint64_t>(std::max<int64_t>(0,
+                                std::min<int64_t>(bytesPending, capacity)));
+}
+
+/**
+ * Fills in the counters of the StagingBuffer for NanoLog::getMetrics(). They
+ * are read without synchronizing with the producer or the consumer, so they
+ * may be slightly stale.
+ *
+ * \param[out] metrics
+ *      Counters to fill in
+ */
+void
+RuntimeLogger::StagingBuffer::getMetrics(ThreadMetrics &metrics) {
+    metrics.id = id;
+    metrics.capacity = capacity;
+    metrics.bytesPending = static_cast<uint32_t>(getBytesPending());
+    metrics.numAllocations = numAllocations;
+    metrics.numLogsDropped = numLogsDropped;
+    metrics.numTimesBlocked = numTimesProducerBlocked;
+    metrics.nsBlocked = PerfUtils::Cycles::toNanoseconds(cyclesProducerBlocked);
+}
+
 }; // namespace NanoLog Internal
\ No newline at end of file
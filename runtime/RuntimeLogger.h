@@ -16,13 +16,19 @@
 #ifndef RUNTIME_NANOLOG_H
 #define RUNTIME_NANOLOG_H
 
-#include <aio.h>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/socket.h>
 
+#include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "Config.h"
@@ -30,6 +36,7 @@
 #include "Fence.h"
 #include "Log.h"
 #include "NanoLog.h"
+#include "OutputBackend.h"
 #include "Util.h"
 
 namespace NanoLogInternal {
@@ -50,15 +57,32 @@ using namespace NanoLog;
          */
         inline void
         registerInvocationSite_internal(int &logId, StaticLogInfo info) {
-            // TODO(syang0) Make this into a spin lock
-            std::lock_guard<std::mutex>
-                                    lock(nanoLogSingleton.registrationMutex);
-
-            if (logId != UNASSIGNED_LOGID)
+            if (__atomic_load_n(&logId, __ATOMIC_ACQUIRE) != UNASSIGNED_LOGID)
                 return;
 
-            logId = static_cast<int32_t>(invocationSites.size());
-            invocationSites.push_back(info);
+            // Threads that race to register the same site each add an entry,
+            // but only the first to claim the logId is ever referenced; the
+            // others are harmless duplicates in the dictionary.
+            int id = static_cast<int32_t>(invocationSites.add(info));
+
+            // The crash recovery dictionary has to have the site before any
+            // log message referencing it can land in a StagingBuffer. The
+            // fence pairs with the one in setCrashRecoveryDirectory(), so
+            // either it sees the site's identifier or the site sees its file.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (crashRecoveryFd.load(std::memory_order_relaxed) >= 0)
+                recordRecoverySite(id);
+
+            int unassigned = UNASSIGNED_LOGID;
+            __atomic_compare_exchange_n(&logId, &unassigned, id, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+            // Filters by log identifier could not match the site before it
+            // had one, so give them another look now that it does
+            if (logIdRulesSet.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(logSiteMutex);
+                refreshLogSite(&logId);
+            }
 
 #ifdef ENABLE_DEBUG_PRINTING
             printf("Registered '%s' as id=%d\r\n", info.formatString, logId);
@@ -86,6 +110,73 @@ using namespace NanoLog;
             nanoLogSingleton.registerInvocationSite_internal(logId, info);
         }
 
+        /**
+         * Determines whether a log invocation site should log. This is a
+         * single load and compare once the site's filter word is resolved;
+         * the first invocation of a site registers it with the RuntimeLogger
+         * so that later changes to the log level or filters can reach it.
+         *
+         * \param[in/out] siteFilter
+         *      Filter word of the site (see LOG_SITE_ENABLED); it must have a
+         *      static lifetime and start out as LOG_SITE_UNRESOLVED
+         * \param logId
+         *      Log identifier of the site, which may still be unassigned;
+         *      this must have a static lifetime as well
+         * \param filename
+         *      File containing the log invocation
+         * \param linenum
+         *      Line number of the log invocation within filename
+         * \param severity
+         *      LogLevel of the log invocation
+         * \param format
+         *      printf format string of the log invocation
+         *
+         * \return
+         *      true if the log statement should be recorded
+         */
+        static inline bool
+        isLogSiteEnabled(int &siteFilter, const int *logId,
+                         const char *filename, int linenum,
+                         LogLevel severity, const char *format) {
+            int state = __atomic_load_n(&siteFilter, __ATOMIC_RELAXED);
+            if (__builtin_expect(state == LOG_SITE_ENABLED, 1))
+                return true;
+
+            if (state == LOG_SITE_DISABLED)
+                return false;
+
+            return nanoLogSingleton.resolveLogSite(siteFilter, logId, filename,
+                                                   linenum, severity, format);
+        }
+
+        /**
+         * Reads the timestamp of a log statement from a TimestampSource. The
+         * source is a template parameter so that the choice between them is
+         * made at compile time.
+         *
+         * \return
+         *      rdtsc() timestamp of the log statement, or Log::NO_TIMESTAMP
+         *      for TIMESTAMP_NONE (which the Encoder fills in)
+         */
+        template<TimestampSource source>
+        static inline uint64_t
+        readTimestamp() {
+            if (source == TIMESTAMP_RDTSC)
+                return PerfUtils::Cycles::rdtsc();
+
+            if (source == TIMESTAMP_RDTSCP)
+                return PerfUtils::Cycles::rdtscp();
+
+            if (source == TIMESTAMP_COARSE) {
+                uint64_t timestamp = nanoLogSingleton.coarseTimestamp.load(
+                                                    std::memory_order_relaxed);
+                return (timestamp != 0) ? timestamp
+                                        : PerfUtils::Cycles::rdtsc();
+            }
+
+            return Log::NO_TIMESTAMP;
+        }
+
         /**
          * Allocate thread-local space for the generated C++ code to store an
          * uncompressed log message, but do not make it available for compression
@@ -93,13 +184,17 @@ using namespace NanoLog;
          * to the compression thread and this function shall not be invoked
          * again until the corresponding finishAlloc() is invoked first.
          *
-         * Note this will block of the buffer is full.
+         * Note this will block if the buffer is full, unless the overflow
+         * policy is DROP_NEWEST in which case the log statement is counted as
+         * dropped and nullptr is returned. The caller must then skip the
+         * corresponding finishAlloc().
          *
          * \param nbytes
          *      number of bytes to allocate in the
          *
          * \return
-         *      pointer to the allocated space
+         *      pointer to the allocated space or nullptr if the log statement
+         *      should be dropped
          */
         static inline char *
         reserveAlloc(size_t nbytes) {
@@ -115,31 +210,152 @@ using namespace NanoLog;
          *
          * \param nbytes
          *      Number of bytes to make visible
+         * \param severity
+         *      LogLevel of the log message; messages at the priority log
+         *      level or above are written out right away (see
+         *      setPriorityLogLevel())
          */
         static inline void
-        finishAlloc(size_t nbytes) {
+        finishAlloc(size_t nbytes, LogLevel severity) {
             stagingBuffer->finishReservation(nbytes);
+
+            if (severity <= nanoLogSingleton.priorityLogLevel.load(
+                                                std::memory_order_relaxed))
+                stagingBuffer->flagPriorityLog();
         }
 
         static std::string getStats();
         static std::string getHistograms();
+        static void getMetrics(Metrics &metrics);
+        static void setMetricsExporter(
+                            std::function<void(const Metrics&)> exporter,
+                            uint32_t intervalMs);
         static void preallocate();
+        static void preallocate(uint32_t stagingBufferSize);
         static void setLogFile(const char *filename);
+        static void setLogCollector(const char *host, uint16_t port);
+        static void setLogRotation(uint64_t maxBytes, uint32_t maxAgeSeconds);
+        static void rotateLogFile();
         static void setLogLevel(LogLevel logLevel);
+        static void setLogSitesEnabled(LogSiteMatch match, const char *pattern,
+                                       bool enabled);
+        static void clearLogSiteFilters();
+        static void setCompressionThreads(uint32_t numThreads);
+        static void setOverflowPolicy(OverflowPolicy policy);
+        static void setPriorityLogLevel(LogLevel logLevel, bool sync);
+        static void setStagingBufferSize(uint32_t bytes);
+        static void setStagingBufferPlacement(bool numaLocal, bool hugePages,
+                                              bool mirrored=false);
+        static void setCrashRecoveryDirectory(const char *directory);
+        static void setCompressionAgent(const char *directory);
+        static void setCompressionThreadCpus(const std::vector<int> &cpus);
+        static std::vector<int> getCoreIdsOfBackgroundThreads();
+        static void setOutputBufferSize(uint32_t bytes);
+        static void setOutputEngine(OutputEngine engine);
+        static void setBlockCompression(BlockCompression compression);
         static void sync();
+        static LogPosition getLogPosition();
+        static bool isPersisted(const LogPosition &position);
+        static void notifyWhenPersisted(const LogPosition &position,
+                                        std::function<void()> callback);
 
         static inline LogLevel getLogLevel() {
             return nanoLogSingleton.currentLogLevel;
         }
 
+        static inline OverflowPolicy getOverflowPolicy() {
+            return nanoLogSingleton.currentOverflowPolicy;
+        }
+
+        static inline uint32_t getStagingBufferSize() {
+            return nanoLogSingleton.stagingBufferSize;
+        }
+
+        static inline uint32_t getOutputBufferSize() {
+            return nanoLogSingleton.outputBufferSize;
+        }
+
+        static inline OutputEngine getOutputEngine() {
+            return nanoLogSingleton.outputEngine;
+        }
+
+        static inline BlockCompression getBlockCompression() {
+            return nanoLogSingleton.blockCompression;
+        }
+
         static inline int getCoreIdOfBackgroundThread() {
-            return nanoLogSingleton.coreId;
+            return nanoLogSingleton.shards.at(0)->coreId;
+        }
+
+        static inline uint32_t getCompressionThreads() {
+            return static_cast<uint32_t>(nanoLogSingleton.shards.size());
         }
     PRIVATE:
 
         // Forward Declarations
         class StagingBuffer;
         class StagingBufferDestroyer;
+        class CompressionShard;
+
+        /**
+         * A log invocation site that has been reached at least once, along
+         * with what's needed to re-evaluate the filters against it.
+         */
+        struct LogSite {
+            // Filter word and log identifier of the site (see
+            // isLogSiteEnabled())
+            int *filter;
+            const int *logId;
+
+            const char *filename;
+            int linenum;
+            LogLevel severity;
+            const char *format;
+        };
+
+        /**
+         * A rule that enables or disables the log invocation sites matching
+         * it, regardless of the log level (see NanoLog::setLogSitesEnabled()).
+         */
+        struct LogSiteRule {
+            LogSiteMatch match;
+
+            // File glob or format substring to match; unused for MATCH_LOG_ID
+            std::string pattern;
+
+            // Log identifier to match for MATCH_LOG_ID
+            int logId;
+
+            bool enabled;
+        };
+
+        /**
+         * A callback waiting for the log messages of a StagingBuffer to reach
+         * the log file (see NanoLog::notifyWhenPersisted()).
+         */
+        struct PersistedCallback {
+            PersistedCallback(StagingBuffer *stagingBuffer, uint64_t position,
+                              std::function<void()> callback)
+                : stagingBuffer(stagingBuffer)
+                , position(position)
+                , callback(std::move(callback))
+            {}
+
+            PersistedCallback(const PersistedCallback&) = default;
+            PersistedCallback(PersistedCallback&&) = default;
+            PersistedCallback& operator=(const PersistedCallback&) = default;
+            PersistedCallback& operator=(PersistedCallback&&) = default;
+
+            StagingBuffer *stagingBuffer;
+
+            // Log position (see StagingBuffer::getProducerPosition()) the
+            // StagingBuffer's persistedPosition has to reach
+            uint64_t position;
+
+            std::function<void()> callback;
+        };
+
+        int evaluateLogSite(const LogSite &site);
 
         // Storage for staging uncompressed log statements for compression
         static __thread StagingBuffer *stagingBuffer;
@@ -156,141 +372,374 @@ using namespace NanoLog;
 
         ~RuntimeLogger();
 
-        void compressionThreadMain();
+        void compressionThreadMain(CompressionShard *shard);
+
+        void startCompressionThreads(bool newLogFile);
+
+        void stopCompressionThreads();
 
         void setLogFile_internal(const char *filename);
 
-        void waitForAIO();
+        bool rotateLogFile_internal();
+        void switchLogFile(CompressionShard *shard);
+        void checkLogFileLimits(int fd, uint64_t bytesSubmitted);
+
+        void setLogCollector_internal(const char *host, uint16_t port);
+        int connectLogCollector();
+        int finishLogCollectorConnect(int fd, int timeoutMs);
+        bool reconnectLogCollector();
+
+        void setCompressionThreads_internal(uint32_t numThreads);
+        void setCompressionThreadCpus_internal(const std::vector<int> &cpus);
+        void applyCompressionThreadAffinity(CompressionShard *shard);
+
+        void setOutputBufferSize_internal(uint32_t bytes);
+        void setOutputEngine_internal(OutputEngine engine);
+        void setBlockCompression_internal(BlockCompression compression);
+
+        void setMetricsExporter_internal(
+                            std::function<void(const Metrics&)> exporter,
+                            uint32_t intervalMs);
+        void metricsExporterMain();
+
+        void setCoarseTimestamp(CompressionShard *shard, uint64_t timestamp);
+
+        static void wakeupCompressionThreads();
+        static void wakeupForPriorityLogs();
+
+        bool resolveLogSite(int &siteFilter, const int *logId,
+                            const char *filename, int linenum,
+                            LogLevel severity, const char *format);
+        void refreshLogSites();
+        void refreshLogSite(const int *logId);
+
+        StagingBuffer *adoptPooledStagingBuffer(uint32_t bufferId,
+                                                uint32_t bufferSize,
+                                                bool numaLocal,
+                                                bool hugePages,
+                                                bool mirrored);
+        void releaseStagingBuffer(StagingBuffer *sb);
+        StagingBuffer *allocateRecoverableStagingBuffer(uint32_t bufferId,
+                                                        uint32_t bufferSize);
+        void freeStagingBuffer(StagingBuffer *sb);
+
+        void setCrashRecoveryDirectory_internal(const char *directory,
+                                                bool compressionAgent=false);
+        void recordRecoverySite(uint32_t fmtId);
+
+        void setCompressionAgent_internal(const char *directory);
+        StagingBuffer *adoptAgentStagingBuffer(uint32_t bufferSize);
+        void waitForCompressionAgent();
 
         /**
          * Allocates thread-local structures if they weren't already allocated.
          * This is used by the generated C++ code to ensure it has space to
          * log uncompressed messages to and by the user if they wish to
          * preallocate the data structures on thread creation.
+         *
+         * \param bufferSize
+         *      Byte size of the StagingBuffer to allocate; a value of 0
+         *      selects the current stagingBufferSize.
          */
         inline void
-        ensureStagingBufferAllocated() {
+        ensureStagingBufferAllocated(uint32_t bufferSize = 0) {
             if (stagingBuffer == nullptr) {
+                if (bufferSize == 0)
+                    bufferSize = stagingBufferSize;
+
                 std::unique_lock<std::mutex> guard(bufferMutex);
                 uint32_t bufferId = nextBufferId++;
 
-                // Unlocked for the expensive StagingBuffer allocation
+                bool numaLocal = numaLocalStagingBuffers;
+                bool hugePages = hugePageStagingBuffers;
+                bool mirrored = mirroredStagingBuffers;
+
+                // The compression agent's buffers stay with it for good, so
+                // it's their drained ones that are adopted in agent mode
+                bool agent = compressionAgentEnabled;
+                if (agent) {
+                    stagingBuffer = adoptAgentStagingBuffer(bufferSize);
+                    if (stagingBuffer != nullptr)
+                        return;
+                }
+
+                // Unlocked for the expensive StagingBuffer allocation, which
+                // places the buffer in memory close to the calling thread (or
+                // in a crash recovery file). A drained buffer left behind by
+                // an exited thread is adopted instead if one fits.
                 guard.unlock();
-                stagingBuffer = new StagingBuffer(bufferId);
+                if (!agent)
+                    stagingBuffer = adoptPooledStagingBuffer(bufferId,
+                                        bufferSize, numaLocal, hugePages,
+                                        mirrored);
+                if (stagingBuffer == nullptr)
+                    stagingBuffer = allocateRecoverableStagingBuffer(bufferId,
+                                                                 bufferSize);
+                if (stagingBuffer == nullptr)
+                    stagingBuffer = new StagingBuffer(bufferId, bufferSize,
+                                            numaLocal, hugePages, mirrored);
                 guard.lock();
 
-                threadBuffers.push_back(stagingBuffer);
+                if (agent && stagingBuffer->isAgentBuffer()) {
+                    agentBuffers.push_back(stagingBuffer);
+                    return;
+                }
+
+                // The shard set can only change while bufferMutex is held
+                CompressionShard *shard = shards[bufferId % shards.size()];
+                std::lock_guard<std::mutex> shardGuard(shard->bufferMutex);
+                shard->threadBuffers.push_back(stagingBuffer);
             }
         }
 
-        // Globally the thread-local stagingBuffers
-        std::vector<StagingBuffer *> threadBuffers;
+        // Compression workers and the StagingBuffers they own. StagingBuffers
+        // are assigned to shards[bufferId % shards.size()] and there is
+        // always at least one shard.
+        std::vector<CompressionShard *> shards;
 
         // Stores the id for the next StagingBuffer to be allocated. The ids are
         // unique for this execution for each StagingBuffer allocation.
         uint32_t nextBufferId = 1;
 
-        // Protects reads and writes to threadBuffers
+        // Protects nextBufferId, the membership of shards, and the
+        // StagingBuffer placement and compression thread affinity below
         std::mutex bufferMutex;
 
-        // Background thread that polls the various staging buffers, compresses
-        // the staged log messages, and outputs it to a file.
-        std::thread compressionThread;
-
-        // Indicates there's an operation in aioCb that should be waited on
-        bool hasOutstandingOperation;
-
-        // Flag signaling the compressionThread to stop running
+        // Determines where StagingBuffers allocated from here on are placed
+        // in memory (see NanoLog::setStagingBufferPlacement())
+        bool numaLocalStagingBuffers;
+        bool hugePageStagingBuffers;
+        bool mirroredStagingBuffers;
+
+        // CPUs the compression threads are restricted to, if
+        // compressionThreadsPinned (see NanoLog::setCompressionThreadCpus()),
+        // and the CPUs the process was allowed to run on at startup, which
+        // the threads are returned to once they're unpinned.
+        bool compressionThreadsPinned;
+        cpu_set_t compressionThreadCpus;
+        cpu_set_t defaultCpuAffinity;
+
+        // Drained StagingBuffers whose threads have exited, kept for new
+        // threads to adopt (see NanoLogConfig::STAGING_BUFFER_POOL_SIZE)
+        std::vector<StagingBuffer *> stagingBufferPool;
+
+        // Protects stagingBufferPool. It is taken by the compression threads
+        // while they hold their shard's bufferMutex, so no other lock may be
+        // acquired while holding it.
+        std::mutex stagingBufferPoolMutex;
+
+        // Metric: Number of StagingBuffers adopted from stagingBufferPool
+        // (or from agentBuffers)
+        uint64_t numStagingBuffersReused;
+
+        // Indicates that the StagingBuffers allocated from here on are
+        // compressed by a compression agent rather than the shards (see
+        // NanoLog::setCompressionAgent()). It's only set under bufferMutex
+        // and never cleared.
+        std::atomic<bool> compressionAgentEnabled;
+
+        // StagingBuffers handed to the compression agent. They're never freed
+        // while the process runs since the agent may still have them mapped;
+        // a drained one is adopted by the next thread instead. Protected by
+        // bufferMutex.
+        std::vector<StagingBuffer *> agentBuffers;
+
+        // Flag signaling the compression threads to stop running
         bool compressionThreadShouldExit;
 
-        // Indicates that a sync request has been made but is not completed
-        // by the background thread yet.
-        bool syncRequested;
+        // Incremented on every sync() request; each shard acknowledges a
+        // request by copying the value into its syncGenerationCompleted once
+        // it has made a full pass through its buffers without finding work.
+        uint64_t syncGeneration;
+
+        // Indicates that the first shard, which owns the Checkpoint at the
+        // beginning of the current log file, has persisted it. The other
+        // shards hold their output until this is true so that the Decoder
+        // always finds the Checkpoint first.
+        std::atomic<bool> checkpointPersisted;
 
         // Protects the condition variables below
         std::mutex condMutex;
 
-        // Signal for when the compression thread should wakeup
+        // Signal for when the compression threads should wakeup
         std::condition_variable workAdded;
 
-        // Signaled when the LogCompressor makes a complete pass through all the
-        // thread staging buffers and finds no log messages to output.
+        // Signaled when a compression thread makes a complete pass through all
+        // of its staging buffers and finds no log messages to output.
         std::condition_variable hintQueueEmptied;
 
-        // File handle for the output file; should only be opened once at the
-        // construction of the LogCompressor
+        // Set by the compression threads before they park on workAdded after
+        // being idle for a while, and cleared by the first logging thread that
+        // sees it to wake them back up (see wakeupCompressionThreads()).
+        std::atomic<bool> compressionThreadsParked;
+
+        // Incremented (under condMutex) by the logging threads that flag a
+        // priority log message in a StagingBuffer that had none pending, so
+        // that a compression thread finishing a pass knows to take another
+        // one rather than go idle (see wakeupForPriorityLogs()).
+        std::atomic<uint32_t> priorityLogGeneration;
+
+        // File handle for the current output file. It is replaced by
+        // setLogFile() and, while the compression threads run, by the first
+        // shard when it rotates the log file (under rotationMutex); the shards
+        // write through their own copy (see CompressionShard::logFd).
         int outputFd;
 
-        // POSIX AIO structure used to communicate async IO requests
-        struct aiocb aioCb;
-
-        // Used to stage the compressed log messages before passing it on to the
-        // POSIX AIO library.
-
-        // Dynamically allocated buffer to stage compressed log message before
-        // handing it over to the POSIX AIO library for output.
-        char *compressingBuffer;
-
-        // Dynamically allocated double buffer that is swapped with the
-        // compressingBuffer when the latter is passed to the POSIX AIO library.
-        char *outputDoubleBuffer;
+        // Path of the current output file. Rotated files are renamed to
+        // "<logFilePath>.<n>" with the lowest n not yet taken.
+        std::string logFilePath;
+
+        // Rotate the log file once it holds this many bytes or has been open
+        // for this many cycles (see setLogRotation()); 0 disables the trigger.
+        std::atomic<uint64_t> rotationMaxBytes;
+        std::atomic<uint64_t> rotationMaxAgeCycles;
+
+        // Set by rotateLogFile() or by a shard that found the log file past
+        // one of the limits; the first shard acts on it at its next output
+        // buffer boundary.
+        std::atomic<bool> rotationRequested;
+
+        // Incremented every time the first shard switches outputFd over to a
+        // new file; shards on an older generation still write the old file.
+        std::atomic<uint32_t> logFileGeneration;
+
+        // Bytes the shards submitted to the current log file (before block
+        // compression), and the count at which the size of the file is checked
+        // against rotationMaxBytes next. Since a buffer never shrinks on its
+        // way to the file, this saves an fstat() per output buffer.
+        std::atomic<uint64_t> logFileBytesSubmitted;
+        std::atomic<uint64_t> nextRotationSizeCheck;
+
+        // rdtsc() when the current log file was opened
+        std::atomic<uint64_t> logFileOpenCycles;
+
+        // Protects outputFd, retiringFd, and retiringFdUsers while the
+        // shards switch over to a rotated log file
+        std::mutex rotationMutex;
+
+        // File handle of the log file that was rotated away from (-1 if none)
+        // and the number of shards that may still have writes in flight to
+        // it. The last shard to switch over closes it.
+        int retiringFd;
+        uint32_t retiringFdUsers;
+
+        // Metric: Number of times the log file was rotated
+        uint32_t numLogFilesRotated;
+
+        // Address of the log collector the output is streamed to while the
+        // outputEngine is COLLECTOR (see NanoLog::setLogCollector()), and
+        // "<host>:<port>" for messages
+        struct sockaddr_storage logCollectorAddr;
+        socklen_t logCollectorAddrLen;
+        std::string logCollectorName;
+
+        // Output engine to go back to once the output is switched from the
+        // log collector back to a file
+        OutputEngine fileOutputEngine;
+
+        // Set by a shard whose writes to the log collector failed; the first
+        // shard replaces the connection at its next output buffer boundary
+        // the way it rotates a log file.
+        std::atomic<bool> logCollectorLost;
+
+        // Socket of the connection the first shard is establishing to replace
+        // the current one (-1 if none), the rdtsc() at which it gives up on
+        // it or may try again, and the current backoff between the attempts
+        int pendingCollectorFd;
+        uint64_t nextCollectorConnectCycles;
+        uint32_t collectorBackoffUs;
+
+        // Metric: Number of connections made to log collectors
+        uint32_t numLogCollectorConnections;
 
         // Minimum log level that RuntimeLogger will accept. Anything lower will
-        // be dropped.
+        // be dropped, unless a LogSiteRule enables it.
         LogLevel currentLogLevel;
 
-        // Marks the rdtsc() when the current compression thread first started
-        // running. A value of 0 indicates the compression thread is not running
-        uint64_t cycleAtThreadStart;
-
-        // Metric: Number of cycles compression thread is doing work
-        uint64_t cyclesActive;
-
-        // Metric: Amount of time spent compressing the dynamic log data
-        uint64_t cyclesCompressing;
-
-        // Metric: Stores the distribution of StagingBuffer peek sizes in 5%
-        // increments relative to the full size. This distribution should show
-        // how well the background thread keeps up with the logging threads.
-        uint64_t stagingBufferPeekDist[20];
+        // Log invocation sites whose filter words have been resolved, and the
+        // rules they're resolved against in the order they were set (the
+        // last matching rule wins).
+        std::vector<LogSite> logSites;
+        std::vector<LogSiteRule> logSiteRules;
 
-        // Metric: Amount of time spent scanning the buffers for work and
-        // compressing events found.
-        uint64_t cyclesScanningAndCompressing;
+        // Index of each site in logSites, keyed by the address of its log
+        // identifier, so that a single site can be re-evaluated once it's
+        // assigned an identifier
+        std::unordered_map<const int*, size_t> logSiteIndexes;
 
-        // Metric: Upper bound on the amount of time spent on fsync() and disk
-        // writes. It is an upper bound since the code polls for the async IO
-        uint64_t cyclesDiskIO_upperBound;
+        // Protects currentLogLevel updates, logSites, logSiteIndexes,
+        // logSiteRules, and writes to the sites' filter words
+        std::mutex logSiteMutex;
 
-        // Metric: Number of bytes read in from the staging buffers
-        uint64_t totalBytesRead;
+        // Indicates that logSiteRules has a MATCH_LOG_ID rule
+        std::atomic<bool> logIdRulesSet;
 
-        // Metric: Number of bytes written to the output file (includes padding)
-        uint64_t totalBytesWritten;
+        // Action taken by the logging threads when their StagingBuffer is full
+        OverflowPolicy currentOverflowPolicy;
 
-        // Metric: Number of pad bytes written to round the file to the nearest
-        // 512B
-        uint64_t padBytesWritten;
+        // Log messages at this log level or above are written out right away
+        // and, if syncPriorityLogs, synced to the log file (see
+        // setPriorityLogLevel()). Every log message compares its log level
+        // against priorityLogLevel, so it's read with a relaxed load, which
+        // costs no more than a plain one.
+        std::atomic<LogLevel> priorityLogLevel;
+        std::atomic<bool> syncPriorityLogs;
 
-        // Metric: Number of log statements compressed and outputted.
-        uint64_t logsProcessed;
+        // Byte size of the StagingBuffers allocated for threads from here on;
+        // existing StagingBuffers keep the size they were allocated with.
+        uint32_t stagingBufferSize;
 
-        // Metric: Number of times an AIO write was completed.
-        uint32_t numAioWritesCompleted;
+        // Byte size of each of the output buffers in every CompressionShard
+        uint32_t outputBufferSize;
 
-        // Stores the last coreId that the background thread ran in.
-        int coreId;
+        // Kernel interface used by every CompressionShard to output its buffers
+        OutputEngine outputEngine;
 
-        // Used to control access to invocationSites
-        std::mutex registrationMutex;
+        // General purpose compressor every CompressionShard runs its output
+        // buffers through before writing them out
+        BlockCompression blockCompression;
 
         // Maps unique identifiers to log invocation sites encountered thus far
         // by the non-preprocessor version of NanoLog
-        std::vector<StaticLogInfo> invocationSites;
-
-        // Indicates the index of the next invocationSite that needs to be
-        // persisted to disk.
-        uint32_t nextInvocationIndexToBePersisted;
+        InvocationSiteRegistry invocationSites;
+
+        // Path prefix ("<directory>/nanolog.<pid>") of the crash recovery
+        // files, or empty if StagingBuffers are not made recoverable (see
+        // NanoLog::setCrashRecoveryDirectory())
+        std::string crashRecoveryPrefix;
+
+        // File handle of the crash recovery dictionary, or -1 if there's none
+        std::atomic<int> crashRecoveryFd;
+
+        // Protects crashRecoveryPrefix and writes to crashRecoveryFd. This is
+        // taken with other locks held, so no lock may be acquired under it.
+        std::mutex crashRecoveryMutex;
+
+        // Thread that invokes metricsExporter with a snapshot of getMetrics()
+        // every metricsExportIntervalMs (see NanoLog::setMetricsExporter()).
+        // Both are only changed while the thread is stopped.
+        std::thread metricsExporterThread;
+        std::function<void(const Metrics&)> metricsExporter;
+        uint32_t metricsExportIntervalMs;
+
+        // Serializes setMetricsExporter() invocations
+        std::mutex metricsExporterConfigMutex;
+
+        // Protects metricsExporterShouldExit, which signals
+        // metricsExporterThread to stop running, and the condition variable
+        // it's signaled with
+        std::mutex metricsExporterMutex;
+        std::condition_variable metricsExporterWakeup;
+        bool metricsExporterShouldExit;
+
+        // Copy of the cycle counter that the TIMESTAMP_COARSE log statements
+        // read, or 0 while it's not kept up to date (see
+        // setCoarseTimestamp()). It's written on every pass of the first
+        // compression thread, so the spacers keep it on a cache line of its
+        // own to spare the fields the logging threads read from invalidations.
+        char coarseTimestampLeadingSpacer[Util::BYTES_PER_CACHE_LINE];
+        std::atomic<uint64_t> coarseTimestamp;
+        char coarseTimestampTrailingSpacer[Util::BYTES_PER_CACHE_LINE];
 
         /**
          * Implements a circular FIFO producer/consumer byte queue that is used
@@ -310,13 +759,15 @@ using namespace NanoLog;
              * This mechanism is in place to allow the producer to initialize
              * the contents of the reservation before exposing it to the
              * consumer. This function will block behind the consumer if
-             * there's not enough space.
+             * there's not enough space, unless the overflow policy says to
+             * drop the log statement instead.
              *
              * \param nbytes
              *      Number of bytes to allocate
              *
              * \return
-             *      Pointer to at least nbytes of contiguous space
+             *      Pointer to at least nbytes of contiguous space or nullptr
+             *      if the allocation was dropped
              */
             inline char *
             reserveProducerSpace(size_t nbytes) {
@@ -327,7 +778,13 @@ using namespace NanoLog;
                     return producerPos;
 
                 // Slow allocation
-                return reserveSpaceInternal(nbytes);
+                bool blocking = (nanoLogSingleton.currentOverflowPolicy
+                                                    == OverflowPolicy::BLOCK);
+                char *reservation = reserveSpaceInternal(nbytes, blocking);
+                if (reservation == nullptr)
+                    recordDroppedLog();
+
+                return reservation;
             }
 
             /**
@@ -340,12 +797,46 @@ using namespace NanoLog;
             inline void
             finishReservation(size_t nbytes) {
                 assert(nbytes < minFreeSpace);
-                assert(producerPos + nbytes <
-                       storage + NanoLogConfig::STAGING_BUFFER_SIZE);
+                assert(producerPos + nbytes < storage + capacity ||
+                       (mirrored && producerPos + nbytes < storage
+                                                            + 2*capacity));
+
+                // A reservation can only run past the end of a mirrored ring
+                char *nextPos = producerPos + nbytes;
+                if (nextPos >= storage + capacity) {
+                    nextPos -= capacity;
+                    ++producerLaps;
+                }
 
                 Fence::sfence(); // Ensures producer finishes writes before bump
                 minFreeSpace -= nbytes;
-                producerPos += nbytes;
+                producerPos = nextPos;
+
+                // Only a parked compression thread needs an explicit wakeup.
+                // Nothing orders the store to producerPos ahead of this load,
+                // so a message that races with a park can miss both the wakeup
+                // and the compression thread's last pass; the park timeout
+                // (IDLE_PARK_TIMEOUT_US) bounds how long it waits then.
+                if (nanoLogSingleton.compressionThreadsParked.load(
+                                            std::memory_order_relaxed))
+                    wakeupCompressionThreads();
+            }
+
+            /**
+             * Flags the log message the producer just made visible with
+             * finishReservation() as a priority one, so that the compression
+             * thread drains the StagingBuffer ahead of the others and writes
+             * it out right away. Only the first priority log message since
+             * the consumer last drained the buffer wakes the compression
+             * threads up.
+             */
+            inline void
+            flagPriorityLog() {
+                bool alreadyPending = priorityPending;
+                priorityPending = true;
+
+                if (!alreadyPending)
+                    wakeupForPriorityLogs();
             }
 
             char *peek(uint64_t *bytesAvailable);
@@ -360,10 +851,43 @@ using namespace NanoLog;
              */
             inline void
             consume(uint64_t nbytes) {
+                char *nextPos = consumerPos + nbytes;
+                if (nextPos >= storage + capacity) {
+                    nextPos -= capacity;
+                    ++consumerLaps;
+                }
+
                 Fence::lfence(); // Make sure consumer reads finish before bump
-                consumerPos += nbytes;
+                consumerPos = nextPos;
             }
 
+            /**
+             * Returns the log position (see NanoLog::LogPosition) that the
+             * producer will log its next message at. It counts the bytes
+             * logged so far, except that the space skipped at the end of
+             * the ring on a roll-over counts as logged too. This shall only
+             * be invoked by the producer.
+             */
+            inline uint64_t
+            getProducerPosition() {
+                return producerLaps*capacity
+                        + static_cast<uint64_t>(producerPos - storage);
+            }
+
+            /**
+             * Returns the log position the consumer will consume the next
+             * log message from (see getProducerPosition()). This shall only
+             * be invoked by the consumer.
+             */
+            inline uint64_t
+            getConsumerPosition() {
+                return consumerLaps*capacity
+                        + static_cast<uint64_t>(consumerPos - storage);
+            }
+
+            void getMetrics(ThreadMetrics &metrics);
+            uint64_t getBytesPending();
+
             /**
              * Returns true if it's safe for the compression thread to delete
              * the StagingBuffer and remove it from the global vector.
@@ -373,7 +897,63 @@ using namespace NanoLog;
              */
             bool
             checkCanDelete() {
-                return shouldDeallocate && consumerPos == producerPos;
+                return shouldDeallocate && consumerPos == producerPos
+                        && numLogsDropped == numLogsDroppedReported
+                        && *releasedPos == consumerPos
+                        && persistedPosition == getConsumerPosition();
+            }
+
+            /**
+             * Returns true if the StagingBuffer is drained by a compression
+             * agent rather than the compression threads (see
+             * NanoLog::setCompressionAgent()).
+             */
+            inline bool
+            isAgentBuffer() {
+                return recoveryFileBytes > 0 &&
+                        nanoLogSingleton.compressionAgentEnabled;
+            }
+
+            /**
+             * Advances persistedPosition past the log messages that reached
+             * the log file, and hands their space back to the producer of a
+             * recoverable StagingBuffer; until then, the space holds on to
+             * them for crash recovery (see persistedPos). The consumer tells
+             * it about its writes to the log file, which must complete in
+             * the order they're submitted.
+             *
+             * \param writesSubmitted
+             *      Number of writes the consumer has submitted so far; the
+             *      log messages consumed since will go out with the next one
+             * \param writesCompleted
+             *      Number of those writes that have completed
+             * \param allPersisted
+             *      Indicates that everything consumed so far is in the log
+             *      file, i.e. there's nothing buffered or in flight
+             */
+            void
+            releasePersisted(uint32_t writesSubmitted, uint32_t writesCompleted,
+                             bool allPersisted) {
+                if (allPersisted) {
+                    persistedPos = consumerPos;
+                    persistedPosition = getConsumerPosition();
+                    releasePending = false;
+                    return;
+                }
+
+                if (releasePending && static_cast<int32_t>(
+                            writesCompleted - pendingReleaseWrite) >= 0) {
+                    persistedPos = pendingReleasePos;
+                    persistedPosition = pendingReleasePosition;
+                    releasePending = false;
+                }
+
+                if (!releasePending) {
+                    pendingReleasePos = consumerPos;
+                    pendingReleasePosition = getConsumerPosition();
+                    pendingReleaseWrite = writesSubmitted + 1;
+                    releasePending = true;
+                }
             }
 
 
@@ -381,21 +961,70 @@ using namespace NanoLog;
                 return id;
             }
 
-            StagingBuffer(uint32_t bufferId)
-                    : producerPos(storage)
-                    , endOfRecordedSpace(storage
-                                           + NanoLogConfig::STAGING_BUFFER_SIZE)
-                    , minFreeSpace(NanoLogConfig::STAGING_BUFFER_SIZE)
+            uint32_t getCapacity() {
+                return capacity;
+            }
+
+            StagingBuffer(uint32_t bufferId,
+                          uint32_t bufferSize=NanoLogConfig::STAGING_BUFFER_SIZE,
+                          bool numaLocal=NanoLogConfig::NUMA_LOCAL_STAGING_BUFFERS,
+                          bool hugePages=NanoLogConfig::STAGING_BUFFER_HUGE_PAGES,
+                          bool mirrored=NanoLogConfig::MIRRORED_STAGING_BUFFERS,
+                          char *preallocatedStorage=nullptr)
+                    : producerPos(nullptr)
+                    , producerLaps(0)
+                    , endOfRecordedSpace(nullptr)
+                    , minFreeSpace(bufferSize)
+                    , releasedPos(&consumerPos)
                     , cyclesProducerBlocked(0)
                     , numTimesProducerBlocked(0)
                     , numAllocations(0)
+                    , numLogsDropped(0)
+                    , lastDropTimestamp(0)
                     , cyclesProducerBlockedDist()
                     , cyclesIn10Ns(PerfUtils::Cycles::fromNanoseconds(10))
                     , cacheLineSpacer()
-                    , consumerPos(storage)
+                    , consumerPos(nullptr)
+                    , consumerLaps(0)
+                    , persistedPos(nullptr)
+                    , persistedPosition(0)
+                    , pendingReleasePos(nullptr)
+                    , pendingReleasePosition(0)
+                    , pendingReleaseWrite(0)
+                    , releasePending(false)
+                    , numLogsDroppedReported(0)
+                    , nearlyFull(false)
+                    , priorityPending(false)
                     , shouldDeallocate(false)
                     , id(bufferId)
-                    , storage() {
+                    , capacity(bufferSize)
+                    , storage(preallocatedStorage)
+                    , mappedBytes(0)
+                    , numaNode(numaLocal ? Util::getNumaNode() : -1)
+                    , hugePages(hugePages)
+                    , mirrored(false)
+                    , recoveryFile()
+                    , recoveryFileBytes(0) {
+                // Huge pages take precedence; a ring whose size isn't a
+                // multiple of the page size can't be mirrored either, so it
+                // falls back to a plain one.
+                if (storage == nullptr && mirrored && !hugePages) {
+                    storage = static_cast<char*>(Util::allocateMirroredMemory(
+                                capacity, numaLocal, &mappedBytes));
+                    this->mirrored = (storage != nullptr);
+                }
+                if (storage == nullptr)
+                    storage = static_cast<char*>(Util::allocateLocalMemory(
+                                capacity, numaLocal, hugePages, &mappedBytes));
+                if (storage == nullptr) {
+                    perror("The NanoLog system was not able to allocate enough "
+                           "memory for a StagingBuffer. Quitting...\r\n");
+                    std::exit(-1);
+                }
+
+                producerPos = consumerPos = persistedPos = storage;
+                endOfRecordedSpace = storage + capacity;
+
                 // Empty function, but causes the C++ runtime to instantiate the
                 // sbc thread_local (see documentation in function).
                 sbc.stagingBufferCreated();
@@ -408,15 +1037,73 @@ using namespace NanoLog;
             }
 
             ~StagingBuffer() {
+                if (mappedBytes > 0)
+                    Util::freeLocalMemory(storage, mappedBytes);
+                storage = nullptr;
+            }
+
+            /**
+             * Readies a drained StagingBuffer for a new thread to log to, as
+             * if it was freshly constructed but with its storage already
+             * faulted in. This shall only be invoked by the adopting thread
+             * before the buffer is handed to a compression thread.
+             *
+             * \param bufferId
+             *      New identifier for the buffer; the Decoder sees the new
+             *      thread as a separate stream, so it must not be reused.
+             */
+            void
+            reset(uint32_t bufferId) {
+                assert(consumerPos == producerPos);
+
+                producerPos = consumerPos = persistedPos = storage;
+                producerLaps = consumerLaps = 0;
+                persistedPosition = 0;
+                endOfRecordedSpace = storage + capacity;
+                minFreeSpace = capacity;
+                releasePending = false;
+                cyclesProducerBlocked = 0;
+                numTimesProducerBlocked = 0;
+                numAllocations = 0;
+                numLogsDropped = 0;
+                lastDropTimestamp = 0;
+                numLogsDroppedReported = 0;
+                nearlyFull = false;
+                priorityPending = false;
+                shouldDeallocate = false;
+                id = bufferId;
+
+                sbc.stagingBufferCreated();
+
+                for (size_t i = 0; i < Util::arraySize(
+                                              cyclesProducerBlockedDist); ++i)
+                {
+                    cyclesProducerBlockedDist[i] = 0;
+                }
             }
 
         PRIVATE:
 
             char *reserveSpaceInternal(size_t nbytes, bool blocking = true);
 
+            /**
+             * Counts a log statement that reserveProducerSpace() dropped so
+             * that the consumer can record the loss in the log.
+             */
+            inline void
+            recordDroppedLog() {
+                lastDropTimestamp = PerfUtils::Cycles::rdtsc();
+                Fence::sfence(); // Ensures timestamp is visible before count
+                numLogsDropped = numLogsDropped + 1;
+            }
+
             // Position within storage[] where the producer may place new data
             char *producerPos;
 
+            // Number of times producerPos wrapped around to the start of
+            // storage (see getProducerPosition())
+            uint64_t producerLaps;
+
             // Marks the end of valid data for the consumer. Set by the producer
             // on a roll-over
             char *endOfRecordedSpace;
@@ -425,6 +1112,10 @@ using namespace NanoLog;
             // rolling over the producerPos or stalling behind the consumer
             uint64_t minFreeSpace;
 
+            // Position the producer may not write past: consumerPos, or
+            // persistedPos if the buffer is recoverable
+            char* volatile *releasedPos;
+
             // Number of cycles producer was blocked while waiting for space to
             // free up in the StagingBuffer for an allocation.
             uint64_t cyclesProducerBlocked;
@@ -436,6 +1127,14 @@ using namespace NanoLog;
             // Number of alloc()'s performed
             uint64_t numAllocations;
 
+            // Number of log statements dropped due to a full buffer under the
+            // DROP_NEWEST overflow policy. This value is only updated by the
+            // producer.
+            volatile uint64_t numLogsDropped;
+
+            // rdtsc() value of the most recently dropped log statement
+            volatile uint64_t lastDropTimestamp;
+
             // Distribution of the number of times Producer was blocked
             // allocating space in 10ns increments. The last slot includes
             // all times greater than the last increment.
@@ -455,6 +1154,46 @@ using namespace NanoLog;
             // the next bytes from. This value is only updated by the consumer.
             char* volatile consumerPos;
 
+            // Number of times consumerPos wrapped around to the start of
+            // storage (see getConsumerPosition())
+            uint64_t consumerLaps;
+
+            // Position up to which the log messages consumed are known to be
+            // in the log file. In a recoverable StagingBuffer, the producer
+            // doesn't reuse space until it's persisted (see releasedPos), so
+            // storage holds every log message from here to producerPos for
+            // crash recovery. This value is only updated by the consumer.
+            char* volatile persistedPos;
+
+            // Log position (see getProducerPosition()) up to which the log
+            // messages are known to be in the log file. Unlike persistedPos,
+            // this is maintained for every StagingBuffer and may be read by
+            // any thread (see NanoLog::isPersisted()).
+            volatile uint64_t persistedPosition;
+
+            // Position persistedPos moves up to once the consumer's write
+            // number pendingReleaseWrite completes, if releasePending (see
+            // releasePersisted())
+            char *pendingReleasePos;
+            uint64_t pendingReleasePosition;
+            uint32_t pendingReleaseWrite;
+            bool releasePending;
+
+            // Value of numLogsDropped that the consumer last recorded in the
+            // log. This value is only updated by the consumer.
+            uint64_t numLogsDroppedReported;
+
+            // Hint from the producer that the buffer is nearly full or that
+            // it's blocked on it (see NanoLogConfig::NEARLY_FULL_FRACTION).
+            // The producer only sets it on its slow path and the consumer
+            // clears it before it drains the buffer.
+            volatile bool nearlyFull;
+
+            // Set by the producer after it logs a priority log message (see
+            // flagPriorityLog()) and cleared by the consumer before it drains
+            // the buffer.
+            volatile bool priorityPending;
+
             // Indicates that the thread owning this StagingBuffer has been
             // destructed (i.e. no more messages will be logged to it) and thus
             // should be cleaned up once the buffer has been emptied by the
@@ -465,8 +1204,33 @@ using namespace NanoLog;
             // similar to ThreadId, but is only assigned to threads that NANO_LOG).
             uint32_t id;
 
+            // Number of bytes in storage
+            uint32_t capacity;
+
             // Backing store used to implement the circular queue
-            char storage[NanoLogConfig::STAGING_BUFFER_SIZE];
+            char *storage;
+
+            // Number of bytes allocated for storage, which may exceed the
+            // capacity when it's backed by huge pages
+            size_t mappedBytes;
+
+            // NUMA node storage was placed on (-1 if it wasn't placed) and
+            // whether it's backed by huge pages; a pooled buffer is only
+            // adopted by threads that would have allocated it the same way.
+            int numaNode;
+            bool hugePages;
+
+            // True if storage is mapped twice back to back, so that the
+            // capacity bytes following it alias it. Reservations and peeks
+            // then run past the end of storage instead of wrapping around
+            // and endOfRecordedSpace stays at the end of storage.
+            bool mirrored;
+
+            // Crash recovery file the StagingBuffer and its storage are mapped
+            // from, and the byte size of the mapping (0 if the buffer is not
+            // recoverable; see RuntimeLogger::allocateRecoverableStagingBuffer())
+            std::string recoveryFile;
+            size_t recoveryFileBytes;
 
             friend RuntimeLogger;
             friend StagingBufferDestroyer;
@@ -474,6 +1238,184 @@ using namespace NanoLog;
             DISALLOW_COPY_AND_ASSIGN(StagingBuffer);
         };
 
+        /**
+         * A CompressionShard is one background compression thread together
+         * with the disjoint set of StagingBuffers it drains and the output
+         * buffers it compresses into. Each shard encodes its own BufferExtents
+         * and dictionary fragments and appends whole output buffers to the
+         * shared log file, so the shards never have to coordinate on
+         * the fast path.
+         */
+        class CompressionShard {
+        public:
+            CompressionShard(uint32_t shardId, uint32_t bufferSize,
+                             OutputEngine engine,
+                             BlockCompression compression);
+            ~CompressionShard();
+
+            bool allocateOutputBuffers(uint32_t bufferSize,
+                                       OutputEngine engine,
+                                       BlockCompression compression);
+            void absorbMetrics(const CompressionShard &other);
+            void startPass(uint64_t timestamp, bool outputPending);
+            void updatePersistedUpTo();
+
+            // Index of this shard within RuntimeLogger::shards
+            uint32_t id;
+
+            // StagingBuffers assigned to this shard
+            std::vector<StagingBuffer *> threadBuffers;
+
+            // Protects reads and writes to threadBuffers
+            std::mutex bufferMutex;
+
+            // Callbacks waiting for log messages of the threadBuffers to
+            // reach the log file, in the order they were registered; also
+            // protected by bufferMutex
+            std::vector<PersistedCallback> persistedCallbacks;
+
+            // Protects replacing output while getMetrics() reads its metrics
+            // (the compression thread, which is the only other user of output,
+            // is stopped while it's replaced)
+            std::mutex outputMutex;
+
+            // Background thread that polls the threadBuffers, compresses
+            // the staged log messages, and outputs it to a file.
+            std::thread compressionThread;
+
+            // Owns the output buffers the shard compresses into and writes
+            // them out to the log file
+            OutputBackend *output;
+
+            // Indicates the index of the next invocationSite that needs to be
+            // persisted to disk by this shard.
+            uint32_t nextInvocationIndexToBePersisted;
+
+            // File handle the shard writes its output buffers to and the
+            // RuntimeLogger::logFileGeneration it belongs to
+            int logFd;
+            uint32_t logFileGeneration;
+
+            // Last sync() generation this shard has started a pass for and
+            // the last one it has completed (see RuntimeLogger::syncGeneration)
+            uint64_t syncGenerationSeen;
+            uint64_t syncGenerationCompleted;
+
+            // Marks the rdtsc() when the compression thread first started
+            // running. A value of 0 indicates the thread is not running
+            uint64_t cycleAtThreadStart;
+
+            // Metric: Number of cycles compression thread is doing work
+            uint64_t cyclesActive;
+
+            // Metric: Amount of time spent compressing the dynamic log data
+            uint64_t cyclesCompressing;
+
+            // Metric: Stores the distribution of StagingBuffer peek sizes in
+            // 5% increments relative to the full size. This distribution
+            // should show how well the background thread keeps up with the
+            // logging threads.
+            uint64_t stagingBufferPeekDist[20];
+
+            // Metric: Amount of time spent scanning the buffers for work and
+            // compressing events found.
+            uint64_t cyclesScanningAndCompressing;
+
+            // Metric: Upper bound on the amount of time spent on fsync() and
+            // disk writes. It is an upper bound since the code polls for the
+            // async IO
+            uint64_t cyclesDiskIO_upperBound;
+
+            // Metric: Number of bytes read in from the staging buffers
+            uint64_t totalBytesRead;
+
+            // Metric: Number of bytes written to the output file (includes
+            // padding)
+            uint64_t totalBytesWritten;
+
+            // Metric: Number of pad bytes written to round the file to the
+            // nearest 512B
+            uint64_t padBytesWritten;
+
+            // Metric: Bytes fed to and produced by the block compressor, and
+            // the cycles its helper thread spent on them, in the output
+            // backends that were released (the current one keeps its own;
+            // see OutputBackend::getBlockBytesIn()).
+            uint64_t blockBytesIn;
+            uint64_t blockBytesOut;
+            uint64_t blockCyclesCompressing;
+
+            // Metric: Number of log statements compressed and outputted.
+            uint64_t logsProcessed;
+
+            // Metric: Number of output writes submitted and completed.
+            uint32_t numWritesSubmitted;
+            uint32_t numWritesCompleted;
+
+            // rdtsc() at the start of the last two passes of the compression
+            // thread's round-robin order through the threadBuffers
+            uint64_t passStarts[2];
+
+            // Values for persistedUpTo, each paired with the number of the
+            // write (counted like numWritesSubmitted) that must complete
+            // before it holds; oldest first
+            std::deque<std::pair<uint32_t, uint64_t>> pendingPersistedUpTo;
+
+            // Every log message the threadBuffers took before this rdtsc()
+            // has been written out to the log file (see startPass())
+            std::atomic<uint64_t> persistedUpTo;
+
+            // Metric: Number of output writes that failed in the output
+            // backends that were released (the current one keeps its own;
+            // see OutputBackend::getNumFailedWrites()), and the number of
+            // the current backend's failures the shard already acted on.
+            uint64_t numWritesFailed;
+            uint64_t numWriteFailuresSeen;
+
+            // Metric: Distribution of the output write latencies in the output
+            // backends that were released (the current one keeps its own;
+            // see OutputBackend::getWriteLatencyDist())
+            uint64_t writeLatencyDist[Metrics::NUM_WRITE_LATENCY_BUCKETS];
+
+            // Metric: Time the compression thread spent idling in each of the
+            // phases described at NanoLogConfig::IDLE_SPIN_DURATION_US, and the
+            // number of times it parked.
+            uint64_t cyclesIdleSpinning;
+            uint64_t cyclesIdleBackingOff;
+            uint64_t cyclesIdleParked;
+            uint64_t numTimesParked;
+
+            // Value of priorityLogGeneration at the start of the last pass
+            uint32_t priorityLogGenerationSeen;
+
+            // Metric: Number of output writes that held priority log
+            // messages, and the number of those that were synced
+            uint64_t numPriorityWrites;
+            uint64_t numPrioritySyncs;
+
+            // Metric: Number of log statements dropped by the StagingBuffers
+            // this shard retired, whose own counters went with them
+            uint64_t numLogsDroppedRetired;
+
+            // Metric: Sum of the number of writes in flight (including the
+            // new one) at each submission; used to compute the average
+            // output queue depth.
+            uint64_t outputQueueDepthSum;
+
+            // Metric: Largest number of writes that were in flight at once
+            uint32_t maxOutputQueueDepth;
+
+            // Metric: Time spent in and the longest time taken by a single
+            // write submission to the OutputBackend
+            uint64_t cyclesSubmittingWrites;
+            uint64_t maxCyclesSubmittingWrite;
+
+            // Stores the last coreId that the compression thread ran in.
+            int coreId;
+
+            DISALLOW_COPY_AND_ASSIGN(CompressionShard);
+        };
+
         // This class is intended to be instantiated as a C++ thread_local to
         // synchronize marking the thread local stagingBuffer for deletion with
         // thread death.
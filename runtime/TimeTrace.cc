@@ -25,6 +25,7 @@ __thread TimeTrace::Buffer* TimeTrace::threadBuffer = NULL;
 std::vector<TimeTrace::Buffer*> TimeTrace::threadBuffers;
 std::mutex TimeTrace::mutex;
 const char* TimeTrace::filename = NULL;
+TimeTrace::Sink TimeTrace::sink = NULL;
 
 /**
  * Creates a thread-private TimeTrace::Buffer object for the current thread,
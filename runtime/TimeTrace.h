@@ -48,6 +48,26 @@ class TimeTrace {
     class Buffer;
     static std::string getTrace(); 
 
+    /**
+     * Function that takes the records in place of the thread-local buffers
+     * (see setSink()); its arguments are those of record().
+     */
+    typedef void (*Sink)(uint64_t timestamp, const char* format,
+            uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+    /**
+     * Hands all the records from here on to a function instead of keeping
+     * them in the thread-local buffers, i.e. to log them with NanoLog
+     * (see NanoLog::routeTimeTrace()). This should be set before any
+     * thread records, since record() reads it without synchronization.
+     *
+     * \param sink
+     *      Function to hand the records to; NULL keeps them in the buffers
+     */
+    static void setSink(Sink sink) {
+        TimeTrace::sink = sink;
+    }
+
     static void setOutputFileName(const char *filename) {
         TimeTrace::filename = filename;
     }
@@ -81,6 +101,11 @@ class TimeTrace {
     static inline void record(uint64_t timestamp, const char* format,
             uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0,
             uint32_t arg3 = 0) {
+        if (sink != NULL) {
+            sink(timestamp, format, arg0, arg1, arg2, arg3);
+            return;
+        }
+
         if (threadBuffer == NULL) {
             createThreadBuffer();
         }
@@ -114,6 +139,10 @@ class TimeTrace {
     // write to stdout
     static const char* filename;
 
+    // Takes the records in place of the thread-local buffers; NULL means
+    // they're kept in the buffers (see setSink()).
+    static Sink sink;
+
     /**
      * This structure holds one entry in the TimeTrace.
      */
@@ -16,8 +16,10 @@
 #include <sstream>
 
 #include "Util.h"
+#include <linux/mempolicy.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <sys/mman.h>
 #include <string>
 
 using std::string;
@@ -113,5 +115,213 @@ hexDump(const void *buf, uint64_t bytes)
 }
 
 
+/**
+ * Returns the NUMA node of the CPU that the calling thread is running on, or
+ * -1 if it cannot be determined.
+ */
+int
+getNumaNode()
+{
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return -1;
+
+    return static_cast<int>(node);
+}
+
+/**
+ * Maps anonymous memory whose start is aligned to a multiple of alignment.
+ *
+ * \param length
+ *      Number of bytes to map
+ * \param alignment
+ *      Power of 2 that the start of the mapping should be a multiple of
+ *
+ * \return
+ *      The mapping or MAP_FAILED
+ */
+static void *
+mapAligned(size_t length, size_t alignment)
+{
+    char *memory = static_cast<char*>(mmap(nullptr, length + alignment,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1, 0));
+    if (memory == MAP_FAILED)
+        return MAP_FAILED;
+
+    // Trim the excess on either side of the aligned range
+    uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+    size_t head = ((start + alignment - 1) & ~(alignment - 1)) - start;
+    if (head > 0)
+        munmap(memory, head);
+    if (alignment > head)
+        munmap(memory + head + length, alignment - head);
+
+    return memory + head;
+}
+
+/**
+ * Sets the memory policy of a range of memory to prefer the NUMA node of the
+ * calling thread's CPU. The policy only has to be a preference; the kernel
+ * falls back to the other nodes if the local one is out of memory. Failures
+ * are ignored since they only mean that the kernel has no NUMA support.
+ *
+ * \param memory
+ *      Page aligned start of the range
+ * \param length
+ *      Number of bytes in the range
+ */
+static void
+preferLocalNode(void *memory, size_t length)
+{
+    int node = getNumaNode();
+    if (node < 0)
+        return;
+
+    unsigned long nodeMask[16] = {};
+    const size_t bitsPerMask = 8*sizeof(nodeMask[0]);
+    if (static_cast<size_t>(node) < bitsPerMask*arraySize(nodeMask)) {
+        nodeMask[node/bitsPerMask] |= 1UL << (node % bitsPerMask);
+        syscall(SYS_mbind, memory, length, MPOL_PREFERRED, nodeMask,
+                8*sizeof(nodeMask) + 1, 0);
+    }
+}
+
+/**
+ * Allocates memory for a buffer that's mostly accessed by the calling thread,
+ * such as a StagingBuffer. The memory can be placed on the NUMA node the
+ * thread runs on (rather than wherever its pages are first touched) and
+ * backed by huge pages to reduce the TLB misses of walking through it. The
+ * pages are faulted in before returning in either case, so that the cost is
+ * not paid by the thread's first accesses.
+ *
+ * \param bytes
+ *      Minimum number of bytes to allocate
+ * \param numaLocal
+ *      Prefer the NUMA node of the calling thread's CPU for the memory;
+ *      this has no effect on machines with a single node
+ * \param hugePages
+ *      Back the memory with 2MB pages. Pages reserved for hugetlbfs are
+ *      used if there are any, otherwise transparent huge pages are requested
+ *      for it. The size of the allocation is rounded up to 2MB.
+ * \param[out] mappedBytes
+ *      Number of bytes actually allocated, to be passed to freeLocalMemory()
+ *
+ * \return
+ *      Page aligned memory or nullptr if the allocation failed
+ */
+void *
+allocateLocalMemory(size_t bytes, bool numaLocal, bool hugePages,
+                    size_t *mappedBytes)
+{
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t alignment = (hugePages) ? BYTES_PER_HUGE_PAGE : pageSize;
+    size_t length = (bytes + alignment - 1) & ~(alignment - 1);
+    void *memory = MAP_FAILED;
+
+    if (hugePages) {
+        memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (memory == MAP_FAILED) {
+            memory = mapAligned(length, BYTES_PER_HUGE_PAGE);
+            if (memory != MAP_FAILED)
+                madvise(memory, length, MADV_HUGEPAGE);
+        }
+    } else {
+        memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (memory == MAP_FAILED)
+        return nullptr;
+
+    if (numaLocal)
+        preferLocalNode(memory, length);
+
+    for (size_t i = 0; i < length; i += pageSize)
+        static_cast<volatile char*>(memory)[i] = 0;
+
+    *mappedBytes = length;
+    return memory;
+}
+
+/**
+ * Allocates a ring buffer whose pages are mapped twice, back to back, so that
+ * the bytes past its end alias its start. Data that wraps around the end of
+ * the ring can then be read and written as one contiguous range. Like
+ * allocateLocalMemory(), the pages are faulted in before returning.
+ *
+ * \param bytes
+ *      Size of the ring; it must be a multiple of the page size
+ * \param numaLocal
+ *      Prefer the NUMA node of the calling thread's CPU for the memory
+ * \param[out] mappedBytes
+ *      Number of bytes of address space used (twice bytes), to be passed to
+ *      freeLocalMemory()
+ *
+ * \return
+ *      The start of the first of the two mappings, or nullptr if bytes is not
+ *      a multiple of the page size or the mappings failed
+ */
+void *
+allocateMirroredMemory(size_t bytes, bool numaLocal, size_t *mappedBytes)
+{
+    size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    if (bytes == 0 || bytes % pageSize != 0)
+        return nullptr;
+
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "NanoLog",
+                                      MFD_CLOEXEC));
+    if (fd < 0)
+        return nullptr;
+
+    if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // Reserve the address space for both copies, then map the file over it
+    char *memory = static_cast<char*>(mmap(nullptr, 2*bytes, PROT_NONE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    bool mapped = memory != MAP_FAILED &&
+            mmap(memory, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+            mmap(memory + bytes, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+    close(fd);
+
+    if (!mapped) {
+        if (memory != MAP_FAILED)
+            munmap(memory, 2*bytes);
+        return nullptr;
+    }
+
+    if (numaLocal)
+        preferLocalNode(memory, bytes);
+
+    for (size_t i = 0; i < bytes; i += pageSize)
+        static_cast<volatile char*>(memory)[i] = 0;
+
+    *mappedBytes = 2*bytes;
+    return memory;
+}
+
+/**
+ * Frees memory allocated with allocateLocalMemory().
+ *
+ * \param memory
+ *      Memory returned by allocateLocalMemory(); nullptr is ignored
+ * \param mappedBytes
+ *      Number of bytes allocateLocalMemory() reported were allocated
+ */
+void
+freeLocalMemory(void *memory, size_t mappedBytes)
+{
+    if (memory != nullptr)
+        munmap(memory, mappedBytes);
+}
+
 } // namespace Util
 } // namespace NanoLogInternal
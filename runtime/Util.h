@@ -40,6 +40,13 @@ namespace Util {
 
 std::string hexDump(const void *buffer, uint64_t bytes);
 
+int getNumaNode();
+void *allocateLocalMemory(size_t bytes, bool numaLocal, bool hugePages,
+                          size_t *mappedBytes);
+void *allocateMirroredMemory(size_t bytes, bool numaLocal,
+                             size_t *mappedBytes);
+void freeLocalMemory(void *memory, size_t mappedBytes);
+
 /* Doxygen is stupid and cannot distinguish between attributes and arguments. */
 #define FORCE_INLINE __inline __attribute__((always_inline))
 
@@ -179,6 +186,9 @@ serialReadPmc(int ecx)
 // Number of bytes in a cache-line in our x86 machines.
 static const uint32_t BYTES_PER_CACHE_LINE = 64;
 
+// Number of bytes in a huge page of our x86 machines.
+static const size_t BYTES_PER_HUGE_PAGE = 2*1024*1024;
+
 // Returns the number of elements in a statically allocated array.
 template<class T, size_t N>
 constexpr size_t arraySize(T (&)[N]) { return N; }